@@ -3879,3 +3879,175 @@ int ge_p3_is_point_at_infinity_vartime(const ge_p3 *p) {
   // Y/Z = 0/0
   return 0;
 }
+
+/* p2pool: fixed-base style scalar multiplication for points which are used many times */
+
+/*
+out[i] = 1/in[i], using one field inversion for the whole array (Montgomery's trick)
+out and in must not overlap
+*/
+
+void fe_batch_invert(fe *out, const fe *in, int n) {
+  fe acc;
+  fe t;
+  int i;
+
+  if (n <= 0) {
+    return;
+  }
+
+  fe_copy(out[0], in[0]);
+  for (i = 1; i < n; ++i) {
+    fe_mul(out[i], out[i - 1], in[i]);
+  }
+
+  fe_invert(acc, out[n - 1]);
+
+  for (i = n - 1; i > 0; --i) {
+    fe_mul(t, acc, out[i - 1]);
+    fe_mul(acc, acc, in[i]);
+    fe_copy(out[i], t);
+  }
+  fe_copy(out[0], acc);
+}
+
+/*
+Same as ge_tobytes() for n points, tmp must have space for 2 * n field elements
+*/
+
+void ge_p2_batch_tobytes(unsigned char *s, const ge_p2 *h, fe *tmp, int n) {
+  fe *recip = tmp + n;
+  fe x;
+  fe y;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    fe_copy(tmp[i], h[i].Z);
+  }
+
+  fe_batch_invert(recip, tmp, n);
+
+  for (i = 0; i < n; ++i, s += 32) {
+    fe_mul(x, h[i].X, recip[i]);
+    fe_mul(y, h[i].Y, recip[i]);
+    fe_tobytes(s, y);
+    s[31] ^= fe_isnegative(x) << 7;
+  }
+}
+
+/*
+table[i][j] = (j + 1) * 256^i * A, in the same format as ge_base
+*/
+
+void ge_precompute_table(ge_precomp table[32][8], const ge_p3 *A) {
+  ge_p3 p[8];
+  ge_cached c;
+  ge_p1p1 t;
+  ge_p2 s;
+  fe z[8];
+  fe recip[8];
+  fe x;
+  fe y;
+  int i, j;
+
+  p[0] = *A;
+
+  for (i = 0; i < 32; ++i) {
+    ge_p3_to_cached(&c, &p[0]);
+    for (j = 1; j < 8; ++j) {
+      ge_add(&t, &p[j - 1], &c);
+      ge_p1p1_to_p3(&p[j], &t);
+    }
+
+    for (j = 0; j < 8; ++j) {
+      fe_copy(z[j], p[j].Z);
+    }
+    fe_batch_invert(recip, z, 8);
+
+    for (j = 0; j < 8; ++j) {
+      fe_mul(x, p[j].X, recip[j]);
+      fe_mul(y, p[j].Y, recip[j]);
+      fe_add(table[i][j].yplusx, y, x);
+      fe_sub(table[i][j].yminusx, y, x);
+      fe_mul(table[i][j].xy2d, x, y);
+      fe_mul(table[i][j].xy2d, table[i][j].xy2d, fe_d2);
+    }
+
+    if (i < 31) {
+      /* 256 * A = 32 * (8 * A) */
+      ge_p3_dbl(&t, &p[7]);
+      for (j = 0; j < 4; ++j) {
+        ge_p1p1_to_p2(&s, &t);
+        ge_p2_dbl(&t, &s);
+      }
+      ge_p1p1_to_p3(&p[0], &t);
+    }
+  }
+}
+
+static void select_table(ge_precomp *t, const ge_precomp *row, signed char b) {
+  ge_precomp minust;
+  unsigned char bnegative = negative(b);
+  unsigned char babs = b - (((-bnegative) & b) << 1);
+
+  ge_precomp_0(t);
+  ge_precomp_cmov(t, &row[0], equal(babs, 1));
+  ge_precomp_cmov(t, &row[1], equal(babs, 2));
+  ge_precomp_cmov(t, &row[2], equal(babs, 3));
+  ge_precomp_cmov(t, &row[3], equal(babs, 4));
+  ge_precomp_cmov(t, &row[4], equal(babs, 5));
+  ge_precomp_cmov(t, &row[5], equal(babs, 6));
+  ge_precomp_cmov(t, &row[6], equal(babs, 7));
+  ge_precomp_cmov(t, &row[7], equal(babs, 8));
+  fe_copy(minust.yplusx, t->yminusx);
+  fe_copy(minust.yminusx, t->yplusx);
+  fe_neg(minust.xy2d, t->xy2d);
+  ge_precomp_cmov(t, &minust, bnegative);
+}
+
+/*
+h = a * A, where table was filled by ge_precompute_table(table, A)
+Same algorithm as ge_scalarmult_base()
+
+Preconditions:
+  a[31] <= 127
+*/
+
+void ge_scalarmult_table(ge_p3 *h, const unsigned char *a, const ge_precomp table[32][8]) {
+  signed char e[64];
+  signed char carry;
+  ge_p1p1 r;
+  ge_p2 s;
+  ge_precomp t;
+  int i;
+
+  for (i = 0; i < 32; ++i) {
+    e[2 * i + 0] = (a[i] >> 0) & 15;
+    e[2 * i + 1] = (a[i] >> 4) & 15;
+  }
+
+  carry = 0;
+  for (i = 0; i < 63; ++i) {
+    e[i] += carry;
+    carry = e[i] + 8;
+    carry >>= 4;
+    e[i] -= carry << 4;
+  }
+  e[63] += carry;
+
+  ge_p3_0(h);
+  for (i = 1; i < 64; i += 2) {
+    select_table(&t, table[i / 2], e[i]);
+    ge_madd(&r, h, &t); ge_p1p1_to_p3(h, &r);
+  }
+
+  ge_p3_dbl(&r, h);  ge_p1p1_to_p2(&s, &r);
+  ge_p2_dbl(&r, &s); ge_p1p1_to_p2(&s, &r);
+  ge_p2_dbl(&r, &s); ge_p1p1_to_p2(&s, &r);
+  ge_p2_dbl(&r, &s); ge_p1p1_to_p3(h, &r);
+
+  for (i = 0; i < 64; i += 2) {
+    select_table(&t, table[i / 2], e[i]);
+    ge_madd(&r, h, &t); ge_p1p1_to_p3(h, &r);
+  }
+}
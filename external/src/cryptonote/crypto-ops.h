@@ -163,3 +163,9 @@ void fe_tobytes(unsigned char *, const fe);
 void fe_invert(fe out, const fe z);
 
 int ge_p3_is_point_at_infinity_vartime(const ge_p3 *p);
+
+// p2pool
+void fe_batch_invert(fe *out, const fe *in, int n);
+void ge_p2_batch_tobytes(unsigned char *s, const ge_p2 *h, fe *tmp, int n);
+void ge_precompute_table(ge_precomp table[32][8], const ge_p3 *A);
+void ge_scalarmult_table(ge_p3 *h, const unsigned char *a, const ge_precomp table[32][8]);
@@ -0,0 +1,373 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "api_server.h"
+#include "p2pool_api.h"
+#include "metrics.h"
+
+static constexpr char log_category_prefix[] = "ApiServer ";
+
+static constexpr int DEFAULT_BACKLOG = 16;
+
+static constexpr uint64_t LONG_POLL_TIMEOUT = 30;
+static constexpr uint64_t IDLE_TIMEOUT = 60;
+
+#include "tcp_server.inl"
+
+namespace p2pool {
+
+ApiServer::ApiServer(p2pool_api* api, const std::string& listen_addresses)
+	: TCPServer(ApiClient::allocate)
+	, m_api(api)
+	, m_updateAsync{}
+	, m_timer{}
+	, m_numRequests(0)
+	, m_numNotModified(0)
+	, m_numLongPolls(0)
+{
+	int err = uv_async_init(&m_loop, &m_updateAsync, on_update_async);
+	if (err) {
+		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
+		panic();
+	}
+	m_updateAsync.data = this;
+
+	err = uv_timer_init(&m_loop, &m_timer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+	m_timer.data = this;
+
+	err = uv_timer_start(&m_timer, on_timer, 1000, 1000);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	start_listening(listen_addresses);
+}
+
+ApiServer::~ApiServer()
+{
+	shutdown_tcp();
+}
+
+void ApiServer::on_update()
+{
+	if (m_finished.load() == 0) {
+		uv_async_send(&m_updateAsync);
+	}
+}
+
+void ApiServer::print_status()
+{
+	LOGINFO(0, "status" <<
+		"\nConnections = " << m_numConnections.load() <<
+		"\nRequests    = " << m_numRequests.load() << " (" << m_numNotModified.load() << " not modified, " << m_numLongPolls.load() << " long polls)"
+	);
+}
+
+void ApiServer::on_shutdown()
+{
+	uv_timer_stop(&m_timer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_updateAsync), nullptr);
+}
+
+void ApiServer::on_timer(uv_timer_t* timer)
+{
+	ApiServer* server = reinterpret_cast<ApiServer*>(timer->data);
+	server->check_waiting_clients(true);
+	server->close_idle_clients();
+}
+
+void ApiServer::check_waiting_clients(bool timeout)
+{
+	const uint64_t cur_time = seconds_since_epoch();
+
+	std::vector<ApiClient*> answered;
+
+	auto it = std::remove_if(m_waitingClients.begin(), m_waitingClients.end(),
+		[this, timeout, cur_time, &answered](const WaitingClient& w)
+		{
+			ApiClient* client = w.m_client;
+			if ((client->m_resetCounter.load() != w.m_resetCounter) || !client->m_waiting) {
+				return true;
+			}
+
+			std::shared_ptr<const std::vector<uint8_t>> data;
+			uint64_t etag = 0;
+
+			const bool changed = !m_api->get_data(client->m_waitPath, data, etag) || (etag != client->m_waitEtag);
+			if (!changed && !(timeout && (cur_time >= client->m_waitDeadline))) {
+				return false;
+			}
+
+			// Answers with the new data, or with 304 Not Modified if the long poll timed out
+			client->m_waiting = false;
+			if (client->send_response(client->m_waitPath.c_str(), client->m_waitEtag, false)) {
+				answered.push_back(client);
+			}
+			else {
+				client->close();
+			}
+			return true;
+		});
+
+	m_waitingClients.erase(it, m_waitingClients.end());
+
+	// Requests pipelined behind the long poll were left in the read buffer, process them now
+	// This is done after the erase because they can start new long polls
+	for (ApiClient* client : answered) {
+		if (!client->process_requests()) {
+			client->close();
+		}
+	}
+}
+
+void ApiServer::close_idle_clients()
+{
+	const uint64_t cur_time = seconds_since_epoch();
+
+	std::vector<ApiClient*> idle_clients;
+	{
+		MutexLock lock(m_clientsListLock);
+
+		for (ApiClient* c = static_cast<ApiClient*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<ApiClient*>(c->m_next)) {
+			if (!c->m_waiting && (cur_time >= c->m_lastActive + IDLE_TIMEOUT)) {
+				idle_clients.push_back(c);
+			}
+		}
+	}
+
+	for (ApiClient* c : idle_clients) {
+		c->close();
+	}
+}
+
+ApiServer::ApiClient::ApiClient()
+	: m_lastActive(0)
+	, m_waitEtag(0)
+	, m_waitDeadline(0)
+	, m_waiting(false)
+{
+}
+
+void ApiServer::ApiClient::reset()
+{
+	Client::reset();
+	m_lastActive = 0;
+	m_waitPath.clear();
+	m_waitEtag = 0;
+	m_waitDeadline = 0;
+	m_waiting = false;
+}
+
+bool ApiServer::ApiClient::on_connect()
+{
+	m_lastActive = seconds_since_epoch();
+	return true;
+}
+
+bool ApiServer::ApiClient::on_read(char* data, uint32_t size)
+{
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+		LOGERR(1, "client: invalid data pointer or size in on_read()");
+		return false;
+	}
+
+	m_numRead += size;
+	m_lastActive = seconds_since_epoch();
+
+	return process_requests();
+}
+
+bool ApiServer::ApiClient::process_requests()
+{
+	// Requests are answered in order, so pipelined requests stay in the buffer while a long poll is pending
+	while (!m_waiting) {
+		char* request_end = nullptr;
+		for (char* c = m_readBuf; c + 4 <= m_readBuf + m_numRead; ++c) {
+			if (memcmp(c, "\r\n\r\n", 4) == 0) {
+				request_end = c;
+				break;
+			}
+		}
+
+		if (!request_end) {
+			if (m_numRead >= sizeof(m_readBuf)) {
+				LOGWARN(4, "client " << static_cast<char*>(m_addrString) << " sent a too long request");
+				return false;
+			}
+			return true;
+		}
+
+		*request_end = '\0';
+		if (!process_request(m_readBuf, static_cast<uint32_t>(request_end - m_readBuf))) {
+			return false;
+		}
+
+		const uint32_t n = static_cast<uint32_t>(request_end + 4 - m_readBuf);
+		m_numRead -= n;
+		if (m_numRead > 0) {
+			memmove(m_readBuf, m_readBuf + n, m_numRead);
+		}
+	}
+
+	return true;
+}
+
+static bool header_name_equals(const char* line, const char* name, size_t name_len)
+{
+	for (size_t i = 0; i < name_len; ++i) {
+		if (tolower(static_cast<unsigned char>(line[i])) != name[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ApiServer::ApiClient::process_request(char* request, uint32_t /*size*/)
+{
+	ApiServer* server = static_cast<ApiServer*>(m_owner);
+	++server->m_numRequests;
+
+	// Request line: GET /path[?wait] HTTP/1.1
+	if (strncmp(request, "GET ", 4) != 0) {
+		static constexpr char response[] = "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n";
+		return m_owner->send(this, reinterpret_cast<const uint8_t*>(response), sizeof(response) - 1, nullptr);
+	}
+
+	char* path = request + 4;
+	char* path_end = strchr(path, ' ');
+	if (!path_end) {
+		LOGWARN(4, "client " << static_cast<char*>(m_addrString) << " sent an invalid request line");
+		return false;
+	}
+
+	char* headers = strstr(path_end + 1, "\r\n");
+	*path_end = '\0';
+
+	bool wait = false;
+
+	char* query = strchr(path, '?');
+	if (query) {
+		*query = '\0';
+		wait = (strstr(query + 1, "wait") != nullptr);
+	}
+
+	uint64_t etag = 0;
+
+	static constexpr char if_none_match[] = "if-none-match:";
+	constexpr size_t if_none_match_len = sizeof(if_none_match) - 1;
+
+	for (char* line = headers; line;) {
+		line += 2;
+		char* next = strstr(line, "\r\n");
+		if (next) {
+			*next = '\0';
+		}
+
+		if ((strlen(line) > if_none_match_len) && header_name_equals(line, if_none_match, if_none_match_len)) {
+			// ETags are sent as "N", a weak W/"N" is also accepted
+			const char* p = line + if_none_match_len;
+			while (*p && ((*p < '0') || (*p > '9'))) {
+				++p;
+			}
+			etag = strtoull(p, nullptr, 10);
+		}
+
+		line = next;
+	}
+
+	// Paths are the same as file names in --data-api directory
+	while (*path == '/') {
+		++path;
+	}
+
+	if (strcmp(path, "metrics") == 0) {
+		return send_metrics();
+	}
+
+	return send_response(path, etag, wait);
+}
+
+bool ApiServer::ApiClient::send_metrics()
+{
+	std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>();
+	{
+		const std::string s = metrics::render();
+		data->assign(s.begin(), s.end());
+	}
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	s << "HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " << data->size() << "\r\n"
+		"Cache-Control: no-cache\r\n\r\n";
+
+	return m_owner->send(this, reinterpret_cast<const uint8_t*>(buf), s.m_pos, data);
+}
+
+bool ApiServer::ApiClient::send_response(const char* path, uint64_t etag, bool wait)
+{
+	ApiServer* server = static_cast<ApiServer*>(m_owner);
+
+	std::shared_ptr<const std::vector<uint8_t>> data;
+	uint64_t cur_etag = 0;
+
+	if (!server->m_api->get_data(path, data, cur_etag)) {
+		static constexpr char response[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+		return m_owner->send(this, reinterpret_cast<const uint8_t*>(response), sizeof(response) - 1, nullptr);
+	}
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	if (etag == cur_etag) {
+		if (wait) {
+			m_waitPath = path;
+			m_waitEtag = etag;
+			m_waitDeadline = seconds_since_epoch() + LONG_POLL_TIMEOUT;
+			m_waiting = true;
+
+			server->m_waitingClients.push_back({ this, m_resetCounter.load() });
+			++server->m_numLongPolls;
+			return true;
+		}
+
+		++server->m_numNotModified;
+
+		s << "HTTP/1.1 304 Not Modified\r\nETag: \"" << cur_etag << "\"\r\n\r\n";
+		return m_owner->send(this, reinterpret_cast<const uint8_t*>(buf), s.m_pos, nullptr);
+	}
+
+	s << "HTTP/1.1 200 OK\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length: " << data->size() << "\r\n"
+		"ETag: \"" << cur_etag << "\"\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Access-Control-Allow-Origin: *\r\n\r\n";
+
+	return m_owner->send(this, reinterpret_cast<const uint8_t*>(buf), s.m_pos, data);
+}
+
+} // namespace p2pool
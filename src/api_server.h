@@ -0,0 +1,95 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcp_server.h"
+
+namespace p2pool {
+
+class p2pool_api;
+
+static constexpr size_t API_SERVER_BUF_SIZE = 4096;
+
+// Read-only HTTP server for the latest p2pool_api data, it's served from memory
+// GET /pool/stats returns the data with an ETag, "If-None-Match" with the current ETag gets 304 Not Modified
+// GET /pool/stats?wait with the current ETag in "If-None-Match" waits until the data changes (long poll)
+// GET /metrics returns latency histograms and counters in Prometheus text format
+class ApiServer : public TCPServer<API_SERVER_BUF_SIZE, API_SERVER_BUF_SIZE>
+{
+public:
+	ApiServer(p2pool_api* api, const std::string& listen_addresses);
+	~ApiServer();
+
+	// Can be called from any thread
+	void on_update();
+
+	void print_status() override;
+
+	struct ApiClient : public Client
+	{
+		ApiClient();
+		FORCEINLINE ~ApiClient() {}
+
+		static Client* allocate() { return new ApiClient(); }
+
+		void reset() override;
+		bool on_connect() override;
+		bool on_read(char* data, uint32_t size) override;
+
+		bool process_requests();
+		bool process_request(char* request, uint32_t size);
+		bool send_response(const char* path, uint64_t etag, bool wait);
+		bool send_metrics();
+
+		uint64_t m_lastActive;
+
+		std::string m_waitPath;
+		uint64_t m_waitEtag;
+		uint64_t m_waitDeadline;
+		bool m_waiting;
+	};
+
+private:
+	void on_shutdown() override;
+
+	static void on_update_async(uv_async_t* async) { reinterpret_cast<ApiServer*>(async->data)->check_waiting_clients(false); }
+	static void on_timer(uv_timer_t* timer);
+
+	void check_waiting_clients(bool timeout);
+	void close_idle_clients();
+
+	p2pool_api* m_api;
+
+	uv_async_t m_updateAsync;
+	uv_timer_t m_timer;
+
+	struct WaitingClient
+	{
+		ApiClient* m_client;
+		uint32_t m_resetCounter;
+	};
+
+	// Used only in this server's event loop thread
+	std::vector<WaitingClient> m_waitingClients;
+
+	std::atomic<uint64_t> m_numRequests;
+	std::atomic<uint64_t> m_numNotModified;
+	std::atomic<uint64_t> m_numLongPolls;
+};
+
+} // namespace p2pool
@@ -18,143 +18,522 @@
 #include "common.h"
 #include "block_cache.h"
 #include "pool_block.h"
-#include "p2p_server.h"
+#include "side_chain.h"
+#include "keccak.h"
+#include <thread>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
 
 static constexpr char log_category_prefix[] = "BlockCache ";
 
+// Blocks are appended to one of two segment files
+// When the active segment has SEGMENT_BLOCKS records, the other segment is truncated and becomes active,
+// so the cache always has between SEGMENT_BLOCKS and NUM_SEGMENTS * SEGMENT_BLOCKS most recent blocks
+// Even right after a rotation it keeps NUM_BLOCKS blocks, like the fixed-slot cache did
+//
+// Segment format:
+// magic (8 bytes), version (4 bytes), reserved (4 bytes), generation (8 bytes)
+// then records: data size (4 bytes), first 4 bytes of keccak(data), data
+//
+// Record data starts with a record type and the record index:
+// sidechain height (8 bytes), sidechain id (32 bytes), consensus id digest (8 bytes)
+// load_all() uses the index to skip blocks from other sidechains and blocks which are too old without parsing them
+// The index is in each record and not in a table at the segment head: compact records refer to transactions
+// from all earlier records of the segment, so a segment is always read from the beginning anyway
+// Mainchain height is not in the index, it's not known yet when the cache is loaded and can't be used to skip blocks
+//
+// After the index:
+// RECORD_BLOCK: the rest is the full serialized block
+// RECORD_COMPACT_BLOCK: mainchain data without transactions (varint size + data), varint transaction count,
+//   then for each transaction either varint (index + 1) into the segment's transaction table,
+//   or 0 and the transaction hash which is added to the table, then sidechain data
+//
+// Consecutive blocks share most of their transactions, so compact blocks are much smaller.
+// The transaction table is rebuilt by reading the segment from the beginning and is reset when the segment is truncated.
 static constexpr uint32_t BLOCK_SIZE = 96 * 1024;
 static constexpr uint32_t NUM_BLOCKS = 4608;
-static constexpr uint32_t CACHE_SIZE = BLOCK_SIZE * NUM_BLOCKS;
-static constexpr char cache_name[] = "p2pool.cache";
+static constexpr uint32_t SEGMENT_BLOCKS = NUM_BLOCKS;
+static constexpr uint32_t NUM_SEGMENTS = 2;
+static constexpr char segment_names[NUM_SEGMENTS][16] = { "p2pool.cache.0", "p2pool.cache.1" };
+
+// Fixed-slot cache file used by older versions: NUM_BLOCKS slots of BLOCK_SIZE bytes, each slot is data size (4 bytes) and the serialized block
+// load_all() moves its blocks to the segments and removes it
+static constexpr char legacy_cache_name[] = "p2pool.cache";
+
+static constexpr uint8_t segment_magic[8] = { 'P', '2', 'P', 'C', 'A', 'C', 'H', 'E' };
+static constexpr uint32_t SEGMENT_VERSION = 4;
+static constexpr uint32_t SEGMENT_HEADER_SIZE = 24;
+static constexpr uint32_t RECORD_HEADER_SIZE = sizeof(uint32_t) * 2;
+static constexpr uint32_t RECORD_INDEX_SIZE = sizeof(uint64_t) * 2 + p2pool::HASH_SIZE;
+
+// Compact records can be slightly bigger than the block itself when all transactions are new
+static constexpr uint32_t MAX_RECORD_SIZE = BLOCK_SIZE * 2;
+
+enum RecordType : uint8_t
+{
+	RECORD_BLOCK = 0,
+	RECORD_COMPACT_BLOCK = 1,
+};
 
 namespace p2pool {
 
 struct BlockCache::Impl : public nocopy_nomove
 {
-#if defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION) || defined(__MACH__)
-
-	Impl()
+	struct RecordIndex
 	{
-		m_fd = open(cache_name, O_RDWR | O_CREAT, static_cast<mode_t>(0600));
-		if (m_fd == -1) {
-			LOGERR(1, "couldn't open/create " << cache_name);
-			return;
-		}
+		uint64_t m_sidechainHeight;
+		hash m_sidechainId;
+		uint64_t m_consensusDigest;
 
-		int result = lseek(m_fd, static_cast<off_t>(CACHE_SIZE) - 1, SEEK_SET);
-		if (result == -1) {
-			LOGERR(1, "lseek failed");
-			close(m_fd);
-			m_fd = -1;
-			return;
+		void write(std::vector<uint8_t>& out) const
+		{
+			const uint8_t* p = reinterpret_cast<const uint8_t*>(&m_sidechainHeight);
+			out.insert(out.end(), p, p + sizeof(uint64_t));
+
+			out.insert(out.end(), m_sidechainId.h, m_sidechainId.h + HASH_SIZE);
+
+			p = reinterpret_cast<const uint8_t*>(&m_consensusDigest);
+			out.insert(out.end(), p, p + sizeof(uint64_t));
 		}
 
-		result = write(m_fd, "", 1);
-		if (result != 1) {
-			LOGERR(1, "write failed");
-			close(m_fd);
-			m_fd = -1;
-			return;
+		void read(const uint8_t* data)
+		{
+			memcpy(&m_sidechainHeight, data, sizeof(uint64_t));
+			memcpy(m_sidechainId.h, data + sizeof(uint64_t), HASH_SIZE);
+			memcpy(&m_consensusDigest, data + sizeof(uint64_t) + HASH_SIZE, sizeof(uint64_t));
 		}
+	};
 
-		void* map = mmap(0, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
-		if (map == MAP_FAILED) {
-			LOGERR(1, "mmap failed");
-			close(m_fd);
-			m_fd = -1;
-			return;
+	struct Segment
+	{
+		FILE* m_file = nullptr;
+		uint64_t m_generation = 0;
+		uint64_t m_size = 0;
+		uint32_t m_numRecords = 0;
+
+		// Written since the last flush()
+		bool m_dirty = false;
+
+		// Valid records and their transaction table read on startup, freed after load_all()
+		std::vector<uint8_t> m_loadData;
+		std::vector<hash> m_txHashes;
+
+		// Transaction table of the active segment, used to write compact records
+		unordered_map<hash, uint32_t> m_txIndex;
+		uint32_t m_numTxHashes = 0;
+	};
+
+	explicit Impl(const std::vector<uint8_t>& consensus_id)
+	{
+		uv_mutex_init_checked(&m_lock);
+
+		hash h;
+		keccak(consensus_id.data(), static_cast<int>(consensus_id.size()), h.h, HASH_SIZE);
+		memcpy(&m_consensusDigest, h.h, sizeof(m_consensusDigest));
+
+		for (uint32_t i = 0; i < NUM_SEGMENTS; ++i) {
+			if (!open_segment(m_segments[i], segment_names[i])) {
+				close_all();
+				return;
+			}
 		}
 
-		m_data = reinterpret_cast<uint8_t*>(map);
+		m_active = (m_segments[1].m_generation > m_segments[0].m_generation) ? 1 : 0;
+
+		Segment& s = m_segments[m_active];
+		s.m_numTxHashes = static_cast<uint32_t>(s.m_txHashes.size());
+		s.m_txIndex.reserve(s.m_numTxHashes);
+		for (uint32_t i = 0; i < s.m_numTxHashes; ++i) {
+			s.m_txIndex.emplace(s.m_txHashes[i], i);
+		}
 	}
 
 	~Impl()
 	{
-		if (m_data) munmap(m_data, CACHE_SIZE);
-		if (m_fd != -1) close(m_fd);
+		close_all();
+		uv_mutex_destroy(&m_lock);
 	}
 
-	void flush()
+	FORCEINLINE bool valid() const { return m_segments[m_active].m_file != nullptr; }
+
+	static uint32_t checksum(const uint8_t* data, uint32_t size)
+	{
+		hash h;
+		keccak(data, static_cast<int>(size), h.h, HASH_SIZE);
+
+		uint32_t result;
+		memcpy(&result, h.h, sizeof(result));
+		return result;
+	}
+
+	static void write_header(uint8_t (&header)[SEGMENT_HEADER_SIZE], uint64_t generation)
 	{
-		if (m_data) {
-			msync(m_data, CACHE_SIZE, MS_SYNC);
+		memset(header, 0, sizeof(header));
+		memcpy(header, segment_magic, sizeof(segment_magic));
+		memcpy(header + 8, &SEGMENT_VERSION, sizeof(SEGMENT_VERSION));
+		memcpy(header + 16, &generation, sizeof(generation));
+	}
+
+	// Returns a duplicate of the file descriptor, so it can be synced without holding m_lock
+	static int dup_file(FILE* f)
+	{
+		if (fflush(f) != 0) {
+			return -1;
 		}
+#ifdef _WIN32
+		return _dup(_fileno(f));
+#else
+		return dup(fileno(f));
+#endif
 	}
 
-	int m_fd = -1;
+	static void sync_and_close(int fd)
+	{
+#ifdef _WIN32
+		_commit(fd);
+		_close(fd);
+#elif defined(__linux__)
+		fdatasync(fd);
+		close(fd);
+#else
+		fsync(fd);
+		close(fd);
+#endif
+	}
 
-#elif defined(_WIN32)
+	bool reset_segment(Segment& s, const char* name, uint64_t generation)
+	{
+		if (s.m_file) {
+			fclose(s.m_file);
+		}
+
+		s.m_file = fopen(name, "w+b");
+		if (!s.m_file) {
+			LOGERR(1, "couldn't create " << name);
+			return false;
+		}
+
+		uint8_t header[SEGMENT_HEADER_SIZE];
+		write_header(header, generation);
 
-	Impl()
+		if (fwrite(header, 1, sizeof(header), s.m_file) != sizeof(header)) {
+			LOGERR(1, "couldn't write " << name);
+			fclose(s.m_file);
+			s.m_file = nullptr;
+			return false;
+		}
+
+		s.m_generation = generation;
+		s.m_size = SEGMENT_HEADER_SIZE;
+		s.m_numRecords = 0;
+		s.m_dirty = true;
+		s.m_loadData.clear();
+		s.m_loadData.shrink_to_fit();
+		s.m_txHashes.clear();
+		s.m_txHashes.shrink_to_fit();
+		s.m_txIndex.clear();
+		s.m_numTxHashes = 0;
+
+		return true;
+	}
+
+	// Adds new transactions from a compact record to the table, returns false if the record is malformed
+	static bool read_tx_hashes(const uint8_t* data, const uint8_t* data_end, std::vector<hash>& tx_hashes)
 	{
-		m_file = CreateFile(cache_name, GENERIC_ALL, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_HIDDEN, NULL);
-		if (m_file == INVALID_HANDLE_VALUE) {
-			LOGERR(1, "couldn't open " << cache_name << ", error " << static_cast<uint32_t>(GetLastError()));
-			return;
+		uint64_t prefix_size, num_transactions;
+
+		data = readVarint(data, data_end, prefix_size);
+		if (!data || (prefix_size > static_cast<uint64_t>(data_end - data))) {
+			return false;
 		}
+		data += prefix_size;
 
-		if (SetFilePointer(m_file, CACHE_SIZE, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-			LOGERR(1, "SetFilePointer failed, error " << static_cast<uint32_t>(GetLastError()));
-			CloseHandle(m_file);
-			m_file = INVALID_HANDLE_VALUE;
-			return;
+		data = readVarint(data, data_end, num_transactions);
+		if (!data) {
+			return false;
 		}
 
-		if (!SetEndOfFile(m_file)) {
-			LOGERR(1, "SetEndOfFile failed, error " << static_cast<uint32_t>(GetLastError()));
-			CloseHandle(m_file);
-			m_file = INVALID_HANDLE_VALUE;
-			return;
+		for (uint64_t i = 0; i < num_transactions; ++i) {
+			uint64_t ref;
+			data = readVarint(data, data_end, ref);
+			if (!data) {
+				return false;
+			}
+			if (ref == 0) {
+				if (static_cast<uint64_t>(data_end - data) < HASH_SIZE) {
+					return false;
+				}
+				hash h;
+				memcpy(h.h, data, HASH_SIZE);
+				tx_hashes.emplace_back(h);
+				data += HASH_SIZE;
+			}
+			else if (ref > tx_hashes.size()) {
+				return false;
+			}
 		}
 
-		m_map = CreateFileMapping(m_file, NULL, PAGE_READWRITE, 0, CACHE_SIZE, NULL);
-		if (!m_map) {
-			LOGERR(1, "CreateFileMapping failed, error " << static_cast<uint32_t>(GetLastError()));
-			CloseHandle(m_file);
-			m_file = INVALID_HANDLE_VALUE;
-			return;
+		return true;
+	}
+
+	// Restores the serialized block from a compact record
+	static bool expand(const uint8_t* data, const uint8_t* data_end, const std::vector<hash>& tx_hashes, std::vector<uint8_t>& out)
+	{
+		uint64_t prefix_size, num_transactions;
+
+		out.clear();
+
+		data = readVarint(data, data_end, prefix_size);
+		if (!data || (prefix_size > static_cast<uint64_t>(data_end - data))) {
+			return false;
 		}
+		out.insert(out.end(), data, data + prefix_size);
+		data += prefix_size;
 
-		m_data = reinterpret_cast<uint8_t*>(MapViewOfFile(m_map, FILE_MAP_ALL_ACCESS, 0, 0, 0));
-		if (!m_data) {
-			LOGERR(1, "MapViewOfFile failed, error " << static_cast<uint32_t>(GetLastError()));
-			CloseHandle(m_map);
-			CloseHandle(m_file);
-			m_map = 0;
-			m_file = INVALID_HANDLE_VALUE;
+		data = readVarint(data, data_end, num_transactions);
+		if (!data) {
+			return false;
+		}
+		writeVarint(num_transactions, out);
+
+		for (uint64_t i = 0; i < num_transactions; ++i) {
+			uint64_t ref;
+			data = readVarint(data, data_end, ref);
+			if (!data) {
+				return false;
+			}
+			if (ref == 0) {
+				if (static_cast<uint64_t>(data_end - data) < HASH_SIZE) {
+					return false;
+				}
+				out.insert(out.end(), data, data + HASH_SIZE);
+				data += HASH_SIZE;
+			}
+			else if (ref <= tx_hashes.size()) {
+				const hash& h = tx_hashes[ref - 1];
+				out.insert(out.end(), h.h, h.h + HASH_SIZE);
+			}
+			else {
+				return false;
+			}
 		}
+
+		out.insert(out.end(), data, data_end);
+		return true;
 	}
 
-	~Impl()
+	bool open_segment(Segment& s, const char* name)
 	{
-		if (m_data) UnmapViewOfFile(m_data);
-		if (m_map) CloseHandle(m_map);
-		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		s.m_file = fopen(name, "r+b");
+		if (!s.m_file) {
+			return reset_segment(s, name, 0);
+		}
+
+		// Read the whole segment sequentially
+		std::vector<uint8_t>& data = s.m_loadData;
+		{
+			uint8_t buf[65536];
+			size_t n;
+			while ((n = fread(buf, 1, sizeof(buf), s.m_file)) > 0) {
+				data.insert(data.end(), buf, buf + n);
+			}
+		}
+
+		if ((data.size() < SEGMENT_HEADER_SIZE) || memcmp(data.data(), segment_magic, sizeof(segment_magic))) {
+			LOGWARN(1, name << " has unknown format, resetting it");
+			return reset_segment(s, name, 0);
+		}
+
+		uint32_t version;
+		memcpy(&version, data.data() + 8, sizeof(version));
+
+		if (version != SEGMENT_VERSION) {
+			LOGWARN(1, name << " has unsupported version " << version << ", resetting it");
+			return reset_segment(s, name, 0);
+		}
+
+		memcpy(&s.m_generation, data.data() + 16, sizeof(s.m_generation));
+
+		// Find the end of valid data, everything after it was written partially and will be overwritten
+		size_t offset = SEGMENT_HEADER_SIZE;
+		while (offset + RECORD_HEADER_SIZE <= data.size()) {
+			uint32_t size, record_checksum;
+			memcpy(&size, data.data() + offset, sizeof(size));
+			memcpy(&record_checksum, data.data() + offset + sizeof(uint32_t), sizeof(record_checksum));
+
+			if ((size <= RECORD_INDEX_SIZE) || (size > MAX_RECORD_SIZE) || (offset + RECORD_HEADER_SIZE + size > data.size())) {
+				break;
+			}
+
+			const uint8_t* p = data.data() + offset + RECORD_HEADER_SIZE;
+			if (checksum(p, size) != record_checksum) {
+				break;
+			}
+
+			if (*p == RECORD_COMPACT_BLOCK) {
+				// A record which fails to parse midway must not leave its transactions in the table
+				const size_t num_tx_hashes = s.m_txHashes.size();
+				if (!read_tx_hashes(p + 1 + RECORD_INDEX_SIZE, p + size, s.m_txHashes)) {
+					s.m_txHashes.resize(num_tx_hashes);
+					break;
+				}
+			}
+			else if (*p != RECORD_BLOCK) {
+				break;
+			}
+
+			offset += RECORD_HEADER_SIZE + size;
+			++s.m_numRecords;
+		}
+
+		if (offset < data.size()) {
+			LOGWARN(1, name << " has " << data.size() - offset << " bytes of incomplete or invalid data at the end");
+		}
+
+		data.resize(offset);
+		s.m_size = offset;
+
+		return true;
 	}
 
-	void flush()
+	void close_all()
 	{
-		if (m_data) {
-			FlushViewOfFile(m_data, 0);
-			FlushFileBuffers(m_file);
+		for (Segment& s : m_segments) {
+			if (s.m_file) {
+				fclose(s.m_file);
+				s.m_file = nullptr;
+			}
+			s.m_loadData.clear();
+			s.m_txHashes.clear();
+			s.m_txIndex.clear();
 		}
 	}
 
-	HANDLE m_file = INVALID_HANDLE_VALUE;
-	HANDLE m_map = 0;
+	void append(const RecordIndex& index, const PoolBlock::Blobs& blobs)
+	{
+		MutexLock lock(m_lock);
 
-#else
-	// Not implemented on other platforms
-	void flush() {}
-#endif
+		if (!valid()) {
+			return;
+		}
+
+		if (m_segments[m_active].m_numRecords >= SEGMENT_BLOCKS) {
+			const uint32_t next = (m_active + 1) % NUM_SEGMENTS;
+			if (!reset_segment(m_segments[next], segment_names[next], m_segments[m_active].m_generation + 1)) {
+				close_all();
+				return;
+			}
+			m_segments[m_active].m_txIndex.clear();
+			m_active = next;
+		}
+
+		Segment& s = m_segments[m_active];
+
+		// Mainchain data before the transaction list
+		const size_t prefix_size = blobs.m_headerSize + blobs.m_minerTxSize;
+
+		const uint8_t* mainchain_data = blobs.m_full.data();
+		const uint8_t* sidechain_data = mainchain_data + blobs.m_mainchainSize;
+
+		const uint8_t* data = mainchain_data + prefix_size;
+		const uint8_t* data_end = sidechain_data;
+
+		uint64_t num_transactions = 0;
+		data = readVarint(data, data_end, num_transactions);
+
+		m_record.assign(RECORD_HEADER_SIZE, 0);
+		m_newTxHashes.clear();
+
+		if (data && (num_transactions <= static_cast<uint64_t>(data_end - data) / HASH_SIZE) && (data + num_transactions * HASH_SIZE == data_end)) {
+			m_record.push_back(RECORD_COMPACT_BLOCK);
+			index.write(m_record);
+			writeVarint(prefix_size, m_record);
+			m_record.insert(m_record.end(), mainchain_data, mainchain_data + prefix_size);
+			writeVarint(num_transactions, m_record);
+
+			for (uint64_t i = 0; i < num_transactions; ++i, data += HASH_SIZE) {
+				hash h;
+				memcpy(h.h, data, HASH_SIZE);
+
+				auto it = s.m_txIndex.find(h);
+				if (it != s.m_txIndex.end()) {
+					writeVarint(it->second + 1, m_record);
+				}
+				else {
+					m_record.push_back(0);
+					m_record.insert(m_record.end(), h.h, h.h + HASH_SIZE);
+					s.m_txIndex.emplace(h, s.m_numTxHashes++);
+					m_newTxHashes.push_back(h);
+				}
+			}
+		}
+		else {
+			m_record.push_back(RECORD_BLOCK);
+			index.write(m_record);
+			m_record.insert(m_record.end(), mainchain_data, sidechain_data);
+		}
+
+		m_record.insert(m_record.end(), sidechain_data, mainchain_data + blobs.m_full.size());
+
+		const uint32_t size = static_cast<uint32_t>(m_record.size() - RECORD_HEADER_SIZE);
+		const uint32_t record_checksum = checksum(m_record.data() + RECORD_HEADER_SIZE, size);
+		memcpy(m_record.data(), &size, sizeof(size));
+		memcpy(m_record.data() + sizeof(uint32_t), &record_checksum, sizeof(record_checksum));
+
+		if ((fseek(s.m_file, static_cast<long>(s.m_size), SEEK_SET) != 0) || (fwrite(m_record.data(), 1, m_record.size(), s.m_file) != m_record.size())) {
+			LOGERR(1, "couldn't write to " << segment_names[m_active]);
+
+			// This record will be overwritten, so its transactions must not be referenced
+			for (const hash& h : m_newTxHashes) {
+				s.m_txIndex.erase(h);
+			}
+			s.m_numTxHashes -= static_cast<uint32_t>(m_newTxHashes.size());
+			return;
+		}
+
+		s.m_size += m_record.size();
+		++s.m_numRecords;
+		s.m_dirty = true;
+	}
+
+	// Only segments written since the last call are synced, and store() isn't blocked while it's running
+	void flush()
+	{
+		int fds[NUM_SEGMENTS];
+		uint32_t num_fds = 0;
+		{
+			MutexLock lock(m_lock);
+
+			for (Segment& s : m_segments) {
+				if (s.m_file && s.m_dirty) {
+					const int fd = dup_file(s.m_file);
+					if (fd >= 0) {
+						fds[num_fds++] = fd;
+						s.m_dirty = false;
+					}
+				}
+			}
+		}
+
+		for (uint32_t i = 0; i < num_fds; ++i) {
+			sync_and_close(fds[i]);
+		}
+	}
+
+	uv_mutex_t m_lock;
+	Segment m_segments[NUM_SEGMENTS];
+	uint32_t m_active = 0;
+	uint64_t m_consensusDigest = 0;
 
-	uint8_t* m_data = nullptr;
+	std::vector<uint8_t> m_record;
+	std::vector<hash> m_newTxHashes;
 };
 
-BlockCache::BlockCache()
-	: m_impl(new Impl())
+BlockCache::BlockCache(const SideChain& side_chain)
+	: m_impl(new Impl(side_chain.consensus_id()))
 	, m_flushRunning(0)
-	, m_storeIndex(0)
 {
 }
 
@@ -165,49 +544,242 @@ BlockCache::~BlockCache()
 
 void BlockCache::store(const PoolBlock& block)
 {
-	const std::vector<uint8_t> mainchain_data = block.serialize_mainchain_data();
-	const std::vector<uint8_t> sidechain_data = block.serialize_sidechain_data();
+	const std::shared_ptr<const PoolBlock::Blobs> blobs = block.get_blobs();
 
-	const size_t n1 = mainchain_data.size();
-	const size_t n2 = sidechain_data.size();
-
-	if (!m_impl->m_data || (sizeof(uint32_t) + n1 + n2 > BLOCK_SIZE)) {
+	if (blobs->m_full.size() > BLOCK_SIZE) {
 		return;
 	}
 
-	uint8_t* data = m_impl->m_data + (static_cast<size_t>((m_storeIndex++) % NUM_BLOCKS) * BLOCK_SIZE);
+	Impl::RecordIndex index;
+	index.m_sidechainHeight = block.m_sidechainHeight;
+	index.m_sidechainId = block.m_sidechainId;
+	index.m_consensusDigest = m_impl->m_consensusDigest;
 
-	*reinterpret_cast<uint32_t*>(data) = static_cast<uint32_t>(n1 + n2);
-	memcpy(data + sizeof(uint32_t), mainchain_data.data(), n1);
-	memcpy(data + sizeof(uint32_t) + n1, sidechain_data.data(), n2);
+	m_impl->append(index, *blobs);
 }
 
-void BlockCache::load_all(SideChain& side_chain, P2PServer& server)
+void BlockCache::load_all(SideChain& side_chain, std::vector<PoolBlock*>& loaded_blocks)
 {
-	if (!m_impl->m_data) {
+	if (!m_impl->valid()) {
 		return;
 	}
 
-	LOGINFO(1, "loading cached blocks");
+	struct Record
+	{
+		const uint8_t* m_data;
+		uint32_t m_size;
+		const std::vector<hash>* m_txHashes;
+		uint64_t m_sidechainHeight;
+	};
+
+	// Older segment first
+	std::vector<Record> records;
+	records.reserve(NUM_SEGMENTS * SEGMENT_BLOCKS);
+
+	uint32_t num_records = 0;
+	uint32_t num_other_sidechain = 0;
+	uint64_t max_height = 0;
+
+	for (uint32_t i = 1; i <= NUM_SEGMENTS; ++i) {
+		const Impl::Segment& s = m_impl->m_segments[(m_impl->m_active + i) % NUM_SEGMENTS];
+		const std::vector<uint8_t>& data = s.m_loadData;
+
+		for (size_t offset = SEGMENT_HEADER_SIZE; offset + RECORD_HEADER_SIZE <= data.size();) {
+			uint32_t n;
+			memcpy(&n, data.data() + offset, sizeof(n));
+			offset += RECORD_HEADER_SIZE;
+
+			const uint8_t* p = data.data() + offset;
+			offset += n;
+			++num_records;
+
+			Impl::RecordIndex index;
+			index.read(p + 1);
+
+			if (index.m_consensusDigest != m_impl->m_consensusDigest) {
+				++num_other_sidechain;
+				continue;
+			}
+
+			records.push_back({ p, n, &s.m_txHashes, index.m_sidechainHeight });
+			max_height = std::max(max_height, index.m_sidechainHeight);
+		}
+	}
+
+	// Only the last 2 PPLNS windows are needed, the rest would be pruned right away
+	const uint64_t window = side_chain.chain_window_size() * 2;
+	const uint64_t min_height = (max_height >= window) ? (max_height - window + 1) : 0;
+
+	records.erase(std::remove_if(records.begin(), records.end(), [min_height](const Record& r) { return r.m_sidechainHeight < min_height; }), records.end());
+
+	LOGINFO(1, "loading " << records.size() << " out of " << num_records << " cached blocks (" << num_other_sidechain << " from another sidechain, " << num_records - num_other_sidechain - records.size() << " too old)");
+
+	// Records are independent, so they're deserialized in parallel
+	// Each worker takes LOAD_CHUNK_SIZE records at a time and puts parsed blocks at the same indices
+	constexpr size_t LOAD_CHUNK_SIZE = 64;
+
+	std::vector<PoolBlock*> blocks(records.size(), nullptr);
+	std::atomic<size_t> counter{ 0 };
+
+	auto worker = [&side_chain, &records, &blocks, &counter]()
+	{
+		PoolBlock* block = nullptr;
+		std::vector<uint8_t> buf;
+
+		size_t begin;
+		while ((begin = counter.fetch_add(LOAD_CHUNK_SIZE)) < records.size()) {
+			const size_t end = std::min(begin + LOAD_CHUNK_SIZE, records.size());
+
+			for (size_t i = begin; i < end; ++i) {
+				const Record& r = records[i];
+
+				const uint8_t* data = r.m_data + 1 + RECORD_INDEX_SIZE;
+				size_t size = r.m_size - 1 - RECORD_INDEX_SIZE;
+
+				if (*r.m_data == RECORD_COMPACT_BLOCK) {
+					if (!Impl::expand(data, data + size, *r.m_txHashes, buf)) {
+						continue;
+					}
+					data = buf.data();
+					size = buf.size();
+				}
+
+				if (!block) {
+					block = new PoolBlock();
+				}
+
+				// Don't pass the loop here: uv_queue_work() can't be called from worker threads
+				if (block->deserialize(data, size, side_chain, nullptr) == 0) {
+					blocks[i] = block;
+					block = nullptr;
+				}
+			}
+		}
+
+		delete block;
+	};
+
+	const size_t num_threads = std::min<size_t>(std::max(std::thread::hardware_concurrency(), 1U), (records.size() + LOAD_CHUNK_SIZE - 1) / LOAD_CHUNK_SIZE);
+
+	std::vector<std::thread> threads;
+	if (num_threads > 1) {
+		threads.reserve(num_threads - 1);
+		try {
+			for (size_t i = 1; i < num_threads; ++i) {
+				threads.emplace_back(worker);
+			}
+		}
+		catch (const std::exception& e) {
+			LOGWARN(3, "load_all: failed to start a thread: " << e.what());
+		}
+	}
+
+	// Current thread also does its part of the work
+	worker();
+
+	for (std::thread& t : threads) {
+		t.join();
+	}
 
-	PoolBlock block;
 	uint32_t blocks_loaded = 0;
 
-	for (uint64_t i = 0; i < NUM_BLOCKS; ++i) {
-		const uint8_t* data = m_impl->m_data + i * BLOCK_SIZE;
-		const uint32_t n = *reinterpret_cast<const uint32_t*>(data);
+	loaded_blocks.reserve(loaded_blocks.size() + blocks.size());
+
+	for (PoolBlock* block : blocks) {
+		if (block) {
+			loaded_blocks.push_back(block);
+			++blocks_loaded;
+		}
+	}
+
+	for (Impl::Segment& s : m_impl->m_segments) {
+		s.m_loadData.clear();
+		s.m_loadData.shrink_to_fit();
+		s.m_txHashes.clear();
+		s.m_txHashes.shrink_to_fit();
+	}
+
+	const size_t threads_used = threads.size() + 1;
+	LOGINFO(1, "loaded " << blocks_loaded << " cached blocks using " << threads_used << " threads");
+
+	migrate_legacy_cache(side_chain, loaded_blocks);
+}
+
+void BlockCache::migrate_legacy_cache(SideChain& side_chain, std::vector<PoolBlock*>& loaded_blocks)
+{
+	FILE* f = fopen(legacy_cache_name, "rb");
+	if (!f) {
+		return;
+	}
+
+	LOGINFO(1, "moving blocks from old format " << legacy_cache_name);
+
+	unordered_set<hash> loaded_ids;
+	loaded_ids.reserve(loaded_blocks.size());
+	for (const PoolBlock* block : loaded_blocks) {
+		loaded_ids.insert(block->m_sidechainId);
+	}
+
+	std::vector<PoolBlock*> blocks;
+	std::vector<uint8_t> slot(BLOCK_SIZE);
+	PoolBlock* block = nullptr;
+	uint64_t max_height = 0;
+
+	for (uint32_t i = 0; i < NUM_BLOCKS; ++i) {
+		if (fread(slot.data(), 1, BLOCK_SIZE, f) != BLOCK_SIZE) {
+			break;
+		}
+
+		uint32_t n;
+		memcpy(&n, slot.data(), sizeof(n));
 
 		if (!n || (n + sizeof(uint32_t) > BLOCK_SIZE)) {
 			continue;
 		}
 
-		if (block.deserialize(data + sizeof(uint32_t), n, side_chain, uv_default_loop_checked()) == 0) {
-			server.add_cached_block(block);
-			++blocks_loaded;
+		if (!block) {
+			block = new PoolBlock();
+		}
+
+		if ((block->deserialize(slot.data() + sizeof(uint32_t), n, side_chain, nullptr) == 0) && loaded_ids.insert(block->m_sidechainId).second) {
+			max_height = std::max(max_height, block->m_sidechainHeight);
+			blocks.push_back(block);
+			block = nullptr;
+		}
+	}
+
+	delete block;
+	fclose(f);
+
+	// Same as in load_all(), and segments get the blocks in order
+	const uint64_t window = side_chain.chain_window_size() * 2;
+	const uint64_t min_height = (max_height >= window) ? (max_height - window + 1) : 0;
+
+	std::sort(blocks.begin(), blocks.end(), [](const PoolBlock* a, const PoolBlock* b) { return a->m_sidechainHeight < b->m_sidechainHeight; });
+
+	uint32_t blocks_moved = 0;
+
+	for (PoolBlock* b : blocks) {
+		if (b->m_sidechainHeight < min_height) {
+			delete b;
+			continue;
 		}
+		store(*b);
+		loaded_blocks.push_back(b);
+		++blocks_moved;
 	}
 
-	LOGINFO(1, "loaded " << blocks_loaded << " cached blocks");
+	m_impl->flush();
+
+	// Keep the old file if the segments couldn't be written, it will be tried again on the next start
+	if (!m_impl->valid()) {
+		LOGWARN(1, "couldn't move blocks from " << legacy_cache_name << ", keeping it");
+		return;
+	}
+
+	if (remove(legacy_cache_name) == 0) {
+		LOGINFO(1, "moved " << blocks_moved << " blocks from " << legacy_cache_name << " and removed it");
+	}
 }
 
 void BlockCache::flush()
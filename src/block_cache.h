@@ -21,23 +21,24 @@ namespace p2pool {
 
 struct PoolBlock;
 class SideChain;
-class P2PServer;
 
 class BlockCache : public nocopy_nomove
 {
 public:
-	BlockCache();
+	explicit BlockCache(const SideChain& side_chain);
 	~BlockCache();
 
 	void store(const PoolBlock& block);
-	void load_all(SideChain& side_chain, P2PServer& server);
+	// Appends all valid cached blocks to "blocks", the caller takes ownership
+	void load_all(SideChain& side_chain, std::vector<PoolBlock*>& blocks);
 	void flush();
 
 private:
+	void migrate_legacy_cache(SideChain& side_chain, std::vector<PoolBlock*>& loaded_blocks);
+
 	struct Impl;
 	Impl* m_impl;
 	std::atomic<uint32_t> m_flushRunning;
-	std::atomic<uint32_t> m_storeIndex;
 };
 
 } // namespace p2pool
@@ -28,12 +28,20 @@
 #include "side_chain.h"
 #include "pool_block.h"
 #include "params.h"
+#include "p2pool_api.h"
+#include "metrics.h"
+#include "trace.h"
 #include <zmq.hpp>
 #include <ctime>
 #include <numeric>
+#include <thread>
 
 static constexpr char log_category_prefix[] = "BlockTemplate ";
 
+// get_hashing_blobs() work split: blobs per chunk, and the minimum number of blobs to start another thread
+static constexpr uint32_t HASHING_BLOBS_CHUNK_SIZE = 64;
+static constexpr uint32_t HASHING_BLOBS_MIN_PER_THREAD = 512;
+
 namespace p2pool {
 
 BlockTemplate::BlockTemplate(p2pool* pool)
@@ -52,14 +60,18 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	, m_timestamp(0)
 	, m_txkeyPub{}
 	, m_txkeySec{}
-	, m_poolBlockTemplate(new PoolBlock())
 	, m_finalReward(0)
 	, m_rng(RandomDeviceSeed::instance)
 {
 	// Diffuse the initial state in case it has low quality
 	m_rng.discard(10000);
 
-	uv_rwlock_init_checked(&m_lock);
+	uv_mutex_init_checked(&m_updateLock);
+
+	// Empty template with ID = 0, so readers never get a null snapshot
+	std::shared_ptr<Snapshot> t = std::make_shared<Snapshot>();
+	t->m_poolBlockTemplate = std::make_shared<PoolBlock>();
+	m_snapshot = t;
 
 	m_blockHeader.reserve(64);
 	m_minerTx.reserve(49152);
@@ -67,15 +79,10 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 	m_transactionHashes.reserve(8192);
 	m_rewards.reserve(100);
 	m_blockTemplateBlob.reserve(65536);
-	m_merkleTreeMainBranch.reserve(HASH_SIZE * 10);
 	m_mempoolTxs.reserve(1024);
 	m_mempoolTxsOrder.reserve(1024);
 	m_shares.reserve(m_pool->side_chain().chain_window_size() * 2);
 
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		m_oldTemplates[i] = new BlockTemplate(*this);
-	}
-
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	m_knapsack.reserve(512 * 309375);
 #endif
@@ -83,67 +90,7 @@ BlockTemplate::BlockTemplate(p2pool* pool)
 
 BlockTemplate::~BlockTemplate()
 {
-	for (size_t i = 0; i < array_size(&BlockTemplate::m_oldTemplates); ++i) {
-		delete m_oldTemplates[i];
-	}
-
-	uv_rwlock_destroy(&m_lock);
-
-	delete m_poolBlockTemplate;
-}
-
-BlockTemplate::BlockTemplate(const BlockTemplate& b)
-	: m_poolBlockTemplate(new PoolBlock())
-{
-	uv_rwlock_init_checked(&m_lock);
-	*this = b;
-}
-
-// cppcheck-suppress operatorEqVarError
-BlockTemplate& BlockTemplate::operator=(const BlockTemplate& b)
-{
-	if (this == &b) {
-		return *this;
-	}
-
-	WriteLock lock(m_lock);
-
-	m_pool = b.m_pool;
-	m_templateId = b.m_templateId;
-	m_blockTemplateBlob = b.m_blockTemplateBlob;
-	m_merkleTreeMainBranch = b.m_merkleTreeMainBranch;
-	m_blockHeaderSize = b.m_blockHeaderSize;
-	m_minerTxOffsetInTemplate = b.m_minerTxOffsetInTemplate;
-	m_minerTxSize = b.m_minerTxSize;
-	m_nonceOffset = b.m_nonceOffset;
-	m_extraNonceOffsetInTemplate = b.m_extraNonceOffsetInTemplate;
-	m_numTransactionHashes = b.m_numTransactionHashes;
-	m_prevId = b.m_prevId;
-	m_height = b.m_height.load();
-	m_difficulty = b.m_difficulty;
-	m_seedHash = b.m_seedHash;
-	m_timestamp = b.m_timestamp;
-	m_txkeyPub = b.m_txkeyPub;
-	m_txkeySec = b.m_txkeySec;
-	*m_poolBlockTemplate = *b.m_poolBlockTemplate;
-	m_finalReward = b.m_finalReward;
-
-	m_minerTx.clear();
-	m_blockHeader.clear();
-	m_minerTxExtra.clear();
-	m_transactionHashes.clear();
-	m_rewards.clear();
-	m_mempoolTxs.clear();
-	m_mempoolTxsOrder.clear();
-	m_shares.clear();
-
-	m_rng = b.m_rng;
-
-#if TEST_MEMPOOL_PICKING_ALGORITHM
-	m_knapsack.clear();
-#endif
-
-	return *this;
+	uv_mutex_destroy(&m_updateLock);
 }
 
 static FORCEINLINE uint64_t get_base_reward(uint64_t already_generated_coins)
@@ -177,6 +124,130 @@ static FORCEINLINE uint64_t get_block_reward(uint64_t base_reward, uint64_t medi
 	return reward + fees;
 }
 
+// 0/1 knapsack over transaction weights rounded up to a bucket size, so memory and time don't depend on the median weight too much
+// It finds the maximum fee for every total weight and then picks the weight with the highest block reward (including penalty)
+// Returns false if the deadline was reached
+static constexpr uint64_t KNAPSACK_MAX_BUCKETS = 1 << 15;
+
+static bool knapsack(const std::vector<TxMempoolData>& txs, const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight,
+	std::chrono::high_resolution_clock::time_point deadline, std::vector<uint64_t>& fees, std::vector<uint64_t>& taken, std::vector<int>& result)
+{
+	result.clear();
+
+	// Same limit as in fill_optimal_knapsack, blocks bigger than this never give more reward in practice
+	const uint64_t max_weight = data.median_weight + (data.median_weight / 32);
+	if (max_weight <= miner_tx_weight) {
+		return true;
+	}
+
+	const uint64_t max_tx_weight = max_weight - miner_tx_weight;
+	const uint64_t bucket_size = max_tx_weight / KNAPSACK_MAX_BUCKETS + 1;
+	const uint64_t num_buckets = max_tx_weight / bucket_size + 1;
+	const uint64_t row_size = (num_buckets + 63) / 64;
+	const size_t n = txs.size();
+
+	fees.assign(num_buckets, 0);
+	taken.assign(n * row_size, 0);
+
+	for (size_t i = 0; i < n; ++i) {
+		if (((i & 15) == 0) && (std::chrono::high_resolution_clock::now() >= deadline)) {
+			return false;
+		}
+
+		const uint64_t w = (txs[i].weight + bucket_size - 1) / bucket_size;
+		const uint64_t fee = txs[i].fee;
+		uint64_t* row = taken.data() + i * row_size;
+
+		for (uint64_t c = num_buckets; c-- > w;) {
+			const uint64_t f = fees[c - w] + fee;
+			if (f > fees[c]) {
+				fees[c] = f;
+				row[c / 64] |= 1ULL << (c % 64);
+			}
+		}
+	}
+
+	uint64_t best_reward = base_reward;
+	uint64_t best_c = 0;
+
+	for (uint64_t c = 1; c < num_buckets; ++c) {
+		// c * bucket_size is the upper bound for the actual weight
+		const uint64_t reward = get_block_reward(base_reward, data.median_weight, fees[c], c * bucket_size + miner_tx_weight);
+		if (reward > best_reward) {
+			best_reward = reward;
+			best_c = c;
+		}
+	}
+
+	for (size_t i = n, c = best_c; (i-- > 0) && c;) {
+		if (taken[i * row_size + c / 64] & (1ULL << (c % 64))) {
+			result.push_back(static_cast<int>(i));
+			c -= (txs[i].weight + bucket_size - 1) / bucket_size;
+		}
+	}
+
+	return true;
+}
+
+void BlockTemplate::pick_transactions_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t greedy_reward)
+{
+	using namespace std::chrono;
+
+	const high_resolution_clock::time_point start = high_resolution_clock::now();
+	const high_resolution_clock::time_point deadline = start + milliseconds(m_pool->params().m_knapsackBudget);
+
+	const bool finished = knapsack(m_mempoolTxs, data, base_reward, miner_tx_weight, deadline, m_knapsackFees, m_knapsackTaken, m_knapsackOrder);
+
+	KnapsackStats& stats = m_knapsackStats;
+
+	++stats.m_runs;
+	stats.m_lastTime = duration_cast<microseconds>(high_resolution_clock::now() - start).count();
+	stats.m_lastRewardDelta = 0;
+
+	if (!finished) {
+		++stats.m_timeouts;
+		LOGINFO(4, "knapsack picking ran out of time (" << stats.m_lastTime << " us), using greedy picking");
+	}
+	else {
+		uint64_t fees = 0;
+		uint64_t weight = miner_tx_weight;
+		for (int i : m_knapsackOrder) {
+			fees += m_mempoolTxs[i].fee;
+			weight += m_mempoolTxs[i].weight;
+		}
+
+		const uint64_t reward = get_block_reward(base_reward, data.median_weight, fees, weight);
+
+		if (reward > greedy_reward) {
+			++stats.m_improved;
+			stats.m_lastRewardDelta = reward - greedy_reward;
+			stats.m_totalRewardDelta += stats.m_lastRewardDelta;
+			m_mempoolTxsOrder = m_knapsackOrder;
+		}
+
+		LOGINFO(3, "knapsack picking took " << stats.m_lastTime << " us, reward difference = " << log::Gray() << static_cast<int64_t>(reward - greedy_reward) << log::NoColor() << " piconero");
+	}
+
+	m_knapsackFees.clear();
+	m_knapsackTaken.clear();
+	m_knapsackOrder.clear();
+
+	p2pool_api* api = m_pool->api();
+	if (api && m_pool->params().m_localStats) {
+		api->set(p2pool_api::Category::LOCAL, "knapsack",
+			[stats](log::Stream& s)
+			{
+				s << "{\"runs\":" << stats.m_runs
+					<< ",\"timeouts\":" << stats.m_timeouts
+					<< ",\"improved\":" << stats.m_improved
+					<< ",\"last_time_us\":" << stats.m_lastTime
+					<< ",\"last_reward_delta\":" << stats.m_lastRewardDelta
+					<< ",\"total_reward_delta\":" << stats.m_totalRewardDelta
+					<< "}";
+			});
+	}
+}
+
 void BlockTemplate::shuffle_tx_order()
 {
 	const int64_t n = static_cast<int64_t>(m_mempoolTxsOrder.size());
@@ -185,6 +256,65 @@ void BlockTemplate::shuffle_tx_order()
 	}
 }
 
+// If the same transactions were picked for the previous template, keep their order from the previous template
+bool BlockTemplate::reuse_tx_order()
+{
+	const std::shared_ptr<const Snapshot> prev = snapshot();
+	const TxHashList& prev_transactions = prev->m_poolBlockTemplate->m_transactions;
+
+	if (prev_transactions.empty() || (prev_transactions.size() - 1 != m_mempoolTxsOrder.size())) {
+		return false;
+	}
+
+	unordered_map<hash, int> tx_index;
+	tx_index.reserve(m_mempoolTxsOrder.size());
+
+	for (int i : m_mempoolTxsOrder) {
+		tx_index.emplace(m_mempoolTxs[i].id, i);
+	}
+
+	std::vector<int> order;
+	order.reserve(m_mempoolTxsOrder.size());
+
+	for (size_t i = 1, n = prev_transactions.size(); i < n; ++i) {
+		auto it = tx_index.find(prev_transactions[i]);
+		if (it == tx_index.end()) {
+			return false;
+		}
+		order.push_back(it->second);
+	}
+
+	m_mempoolTxsOrder.swap(order);
+	return true;
+}
+
+// Miner tx weight from the dry run only depends on height, tx type, number of outputs and total size of reward amounts
+int BlockTemplate::get_miner_tx_weight(const MinerData& data, uint64_t max_reward_amounts_weight, uint64_t& weight)
+{
+	const uint8_t tx_type = m_poolBlockTemplate->get_tx_type();
+
+	DryRunResult& r = m_lastDryRun;
+
+	if (r.m_minerTxWeight && (r.m_height == data.height) && (r.m_txType == tx_type) && (r.m_numOutputs == m_shares.size()) && (r.m_rewardAmountsWeight == max_reward_amounts_weight)) {
+		weight = r.m_minerTxWeight;
+		return 1;
+	}
+
+	const int result = create_miner_tx(data, m_shares, max_reward_amounts_weight, true);
+	if (result < 0) {
+		return result;
+	}
+
+	r.m_height = data.height;
+	r.m_txType = tx_type;
+	r.m_numOutputs = m_shares.size();
+	r.m_rewardAmountsWeight = max_reward_amounts_weight;
+	r.m_minerTxWeight = m_minerTx.size();
+
+	weight = r.m_minerTxWeight;
+	return result;
+}
+
 void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet)
 {
 	if (data.major_version > HARDFORK_SUPPORTED_VERSION) {
@@ -192,60 +322,33 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		return;
 	}
 
-	// Block template construction is relatively slow, but it's better to keep the lock the whole time
-	// instead of using temporary variables and making a quick swap in the end
-	// 
-	// All readers will line up for the new template instead of using the outdated template
-	WriteLock lock(m_lock);
-
-	if (m_templateId > 0) {
-		*m_oldTemplates[m_templateId % array_size(&BlockTemplate::m_oldTemplates)] = *this;
-	}
+	// The new template is built without blocking readers, they keep using the current template until it's published
+	MutexLock lock(m_updateLock);
 
-	++m_templateId;
+	ScopedLatency latency(metrics::block_template_update);
 
-	// When block template generation fails for any reason
+	// When block template generation fails for any reason, the current template is simply not replaced
 	auto use_old_template = [this]() {
-		const uint32_t id = m_templateId - 1;
-		LOGWARN(4, "using old block template with ID = " << id);
-		*this = *m_oldTemplates[id % array_size(&BlockTemplate::m_oldTemplates)];
+		LOGWARN(4, "using old block template with ID = " << m_templateId);
 	};
 
+	m_poolBlockTemplate = std::make_shared<PoolBlock>();
+
 	get_tx_keys(m_txkeyPub, m_txkeySec, miner_wallet->spend_public_key(), data.prev_id);
 
+	// Output keys can be calculated in the background while transactions are being picked
+	m_pool->side_chain().precalc_template(miner_wallet, m_txkeySec);
+
 	m_height = data.height;
 	m_difficulty = data.difficulty;
 	m_seedHash = data.seed_hash;
 
 	// Only choose transactions that were received 10 or more seconds ago
-	size_t total_mempool_transactions;
-	{
-		m_mempoolTxs.clear();
-
-		ReadLock mempool_lock(mempool.m_lock);
-
-		total_mempool_transactions = mempool.m_transactions.size();
-
-		const uint64_t cur_time = seconds_since_epoch();
-
-		for (auto& it : mempool.m_transactions) {
-			if (cur_time >= it.second.time_received + 10) {
-				m_mempoolTxs.emplace_back(it.second);
-			}
-		}
-	}
-
+	//
 	// Safeguard for busy mempool moments
 	// If the block template gets too big, nodes won't be able to send and receive it because of p2p packet size limit
 	// Select 1000 transactions with the highest fee per byte
-	if (m_mempoolTxs.size() > 1000) {
-		std::nth_element(m_mempoolTxs.begin(), m_mempoolTxs.begin() + 1000, m_mempoolTxs.end(),
-			[](const TxMempoolData& tx_a, const TxMempoolData& tx_b)
-			{
-				return tx_a.fee * tx_b.weight > tx_b.fee * tx_a.weight;
-			});
-		m_mempoolTxs.resize(1000);
-	}
+	const size_t total_mempool_transactions = mempool.get_best_transactions(seconds_since_epoch(), 10, 1000, m_mempoolTxs);
 
 	LOGINFO(4, "mempool has " << total_mempool_transactions << " transactions, taking " << m_mempoolTxs.size() << " transactions from it");
 
@@ -266,7 +369,6 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		", weight = " << log::Gray() << total_tx_weight);
 
 	m_blockHeader.clear();
-	m_poolBlockTemplate->m_verified = false;
 
 	// Major and minor hardfork version
 	m_blockHeader.push_back(data.major_version);
@@ -312,13 +414,12 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	};
 	uint64_t max_reward_amounts_weight = get_reward_amounts_weight();
 
-	if (create_miner_tx(data, m_shares, max_reward_amounts_weight, true) < 0) {
+	uint64_t miner_tx_weight;
+	if (get_miner_tx_weight(data, max_reward_amounts_weight, miner_tx_weight) < 0) {
 		use_old_template();
 		return;
 	}
 
-	uint64_t miner_tx_weight = m_minerTx.size();
-
 	// Select transactions from the mempool
 	uint64_t final_reward, final_fees, final_weight;
 
@@ -327,12 +428,17 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 		m_mempoolTxsOrder[i] = static_cast<int>(i);
 	}
 
+	bool tx_order_reused;
+
 	// if a block doesn't get into the penalty zone, just pick all transactions
 	if (total_tx_weight + miner_tx_weight <= data.median_weight) {
 		final_fees = 0;
 		final_weight = miner_tx_weight;
 
-		shuffle_tx_order();
+		tx_order_reused = reuse_tx_order();
+		if (!tx_order_reused) {
+			shuffle_tx_order();
+		}
 
 		m_numTransactionHashes = m_mempoolTxsOrder.size();
 		m_transactionHashes.assign(HASH_SIZE, 0);
@@ -409,10 +515,17 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 			m_mempoolTxsOrder.erase(m_mempoolTxsOrder.begin() + ((k >= 0) ? k : i));
 		}
 
+		if (m_pool->params().m_knapsackBudget) {
+			pick_transactions_knapsack(data, base_reward, miner_tx_weight, final_reward);
+		}
+
 		final_fees = 0;
 		final_weight = miner_tx_weight;
 
-		shuffle_tx_order();
+		tx_order_reused = reuse_tx_order();
+		if (!tx_order_reused) {
+			shuffle_tx_order();
+		}
 
 		m_numTransactionHashes = m_mempoolTxsOrder.size();
 		m_transactionHashes.assign(HASH_SIZE, 0);
@@ -434,6 +547,7 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 
 		uint64_t final_reward2;
 		fill_optimal_knapsack(data, base_reward, miner_tx_weight, final_reward2, final_fees, final_weight);
+		tx_order_reused = false;
 		LOGINFO(3, "best_reward  = " << log::XMRAmount(final_reward2) << ", transactions = " << m_numTransactionHashes << ", final_weight = " << final_weight);
 		if (final_reward2 < final_reward) {
 			LOGERR(1, "fill_optimal_knapsack has a bug, found solution is not optimal. Fix it!");
@@ -483,14 +597,15 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 
 			max_reward_amounts_weight = get_reward_amounts_weight();
 
-			if (create_miner_tx(data, m_shares, max_reward_amounts_weight, true) < 0) {
+			uint64_t new_miner_tx_weight;
+			if (get_miner_tx_weight(data, max_reward_amounts_weight, new_miner_tx_weight) < 0) {
 				use_old_template();
 				return;
 			}
 
 			final_weight -= miner_tx_weight;
-			final_weight += m_minerTx.size();
-			miner_tx_weight = m_minerTx.size();
+			final_weight += new_miner_tx_weight;
+			miner_tx_weight = new_miner_tx_weight;
 
 			final_reward = get_block_reward(base_reward, data.median_weight, final_fees, final_weight);
 
@@ -528,14 +643,12 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	// Miner tx hash is skipped here because it's not a part of block template
 	m_blockTemplateBlob.insert(m_blockTemplateBlob.end(), m_transactionHashes.begin() + HASH_SIZE, m_transactionHashes.end());
 
-	m_poolBlockTemplate->m_transactions.clear();
-	m_poolBlockTemplate->m_transactions.resize(1);
-	m_poolBlockTemplate->m_transactions.reserve(m_mempoolTxsOrder.size() + 1);
+	m_poolBlockTemplate->m_transactions.reset(m_mempoolTxsOrder.size() + 1);
 	for (size_t i = 0, n = m_mempoolTxsOrder.size(); i < n;  ++i) {
 		m_poolBlockTemplate->m_transactions.push_back(m_mempoolTxs[m_mempoolTxsOrder[i]].id);
 	}
 
-	m_poolBlockTemplate->m_minerWallet = *miner_wallet;
+	m_poolBlockTemplate->m_minerWallet.assign(*miner_wallet);
 
 	m_poolBlockTemplate->serialize_sidechain_data();
 	m_poolBlockTemplate->m_sidechainId = calc_sidechain_hash();
@@ -575,11 +688,37 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	}
 #endif
 
-	const hash minerTx_hash = calc_miner_tx_hash(0);
+	std::shared_ptr<Snapshot> t = std::make_shared<Snapshot>();
+
+	t->m_templateId = m_templateId + 1;
+	t->m_blockTemplateBlob = std::move(m_blockTemplateBlob);
+	t->m_blockHeaderSize = m_blockHeaderSize;
+	t->m_minerTxOffsetInTemplate = m_minerTxOffsetInTemplate;
+	t->m_minerTxSize = m_minerTxSize;
+	t->m_nonceOffset = m_nonceOffset;
+	t->m_extraNonceOffsetInTemplate = m_extraNonceOffsetInTemplate;
+	t->m_numTransactionHashes = m_numTransactionHashes;
+	t->m_height = m_height;
+	t->m_difficulty = m_difficulty;
+	t->m_seedHash = m_seedHash;
+	t->m_poolBlockTemplate = m_poolBlockTemplate;
+
+	t->calc_miner_tx_keccak_state();
+
+	// Merkle tree branch for the miner tx doesn't depend on the miner tx itself,
+	// so it stays the same if all other transactions are the same and in the same order
+	if (tx_order_reused) {
+		t->m_merkleTreeMainBranch = snapshot()->m_merkleTreeMainBranch;
+	}
+	else {
+		const hash minerTx_hash = t->calc_miner_tx_hash(0);
 
-	memcpy(m_transactionHashes.data(), minerTx_hash.h, HASH_SIZE);
+		memcpy(m_transactionHashes.data(), minerTx_hash.h, HASH_SIZE);
+
+		calc_merkle_tree_main_branch(*t);
+	}
 
-	calc_merkle_tree_main_branch();
+	publish(t);
 
 	LOGINFO(3, "final reward = " << log::Gray() << log::XMRAmount(final_reward) << log::NoColor() <<
 		", weight = " << log::Gray() << final_weight << log::NoColor() <<
@@ -594,6 +733,37 @@ void BlockTemplate::update(const MinerData& data, const Mempool& mempool, Wallet
 	m_rewards.clear();
 	m_mempoolTxs.clear();
 	m_mempoolTxsOrder.clear();
+
+	// The last template was moved into the snapshot
+	m_blockTemplateBlob.reserve(65536);
+	m_poolBlockTemplate.reset();
+}
+
+void BlockTemplate::publish(const std::shared_ptr<Snapshot>& t)
+{
+	m_templateId = t->m_templateId;
+
+	const std::shared_ptr<const Snapshot> prev = snapshot();
+	if (prev->m_templateId > 0) {
+		std::atomic_store(&m_oldTemplates[prev->m_templateId % array_size(&BlockTemplate::m_oldTemplates)], prev);
+	}
+
+	std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(t));
+}
+
+std::shared_ptr<const BlockTemplate::Snapshot> BlockTemplate::find_snapshot(uint32_t template_id) const
+{
+	std::shared_ptr<const Snapshot> t = snapshot();
+	if (t->m_templateId == template_id) {
+		return t;
+	}
+
+	t = std::atomic_load(&m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)]);
+	if (t && (t->m_templateId == template_id)) {
+		return t;
+	}
+
+	return nullptr;
 }
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
@@ -709,6 +879,42 @@ int BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Mine
 
 	const uint8_t tx_type = m_poolBlockTemplate->get_tx_type();
 
+	if (!dry_run) {
+		if (m_cachedOutputsTxkeySec != m_txkeySec) {
+			m_cachedOutputsTxkeySec = m_txkeySec;
+			m_cachedOutputs.clear();
+		}
+		if (m_cachedOutputs.size() < num_outputs) {
+			m_cachedOutputs.resize(num_outputs);
+		}
+
+		// Calculate all outputs which are not cached yet in one batch, failed outputs are handled one by one below
+		std::vector<const Wallet*> new_outputs(num_outputs, nullptr);
+		for (size_t i = 0; i < num_outputs; ++i) {
+			const Wallet* w = shares[i].m_wallet;
+			const CachedOutput& c = m_cachedOutputs[i];
+			if ((c.m_spendPublicKey != w->spend_public_key()) || (c.m_viewPublicKey != w->view_public_key())) {
+				new_outputs[i] = w;
+			}
+		}
+
+		std::vector<hash> eph_public_keys(num_outputs);
+		std::vector<uint8_t> view_tags(num_outputs);
+
+		if (Wallet::get_eph_public_keys(new_outputs.data(), num_outputs, m_txkeySec, 0, eph_public_keys.data(), view_tags.data())) {
+			for (size_t i = 0; i < num_outputs; ++i) {
+				const Wallet* w = new_outputs[i];
+				if (w) {
+					CachedOutput& c = m_cachedOutputs[i];
+					c.m_spendPublicKey = w->spend_public_key();
+					c.m_viewPublicKey = w->view_public_key();
+					c.m_ephPublicKey = eph_public_keys[i];
+					c.m_viewTag = view_tags[i];
+				}
+			}
+		}
+	}
+
 	uint64_t reward_amounts_weight = 0;
 	for (size_t i = 0; i < num_outputs; ++i) {
 		writeVarint(m_rewards[i], [this, &reward_amounts_weight](uint8_t b)
@@ -724,8 +930,21 @@ int BlockTemplate::create_miner_tx(const MinerData& data, const std::vector<Mine
 			m_minerTx.insert(m_minerTx.end(), HASH_SIZE, 0);
 		}
 		else {
+			const Wallet* w = shares[i].m_wallet;
+			CachedOutput& c = m_cachedOutputs[i];
+
 			hash eph_public_key;
-			if (!shares[i].m_wallet->get_eph_public_key(m_txkeySec, i, eph_public_key, view_tag)) {
+			if ((c.m_spendPublicKey == w->spend_public_key()) && (c.m_viewPublicKey == w->view_public_key())) {
+				eph_public_key = c.m_ephPublicKey;
+				view_tag = c.m_viewTag;
+			}
+			else if (w->get_eph_public_key(m_txkeySec, i, eph_public_key, view_tag)) {
+				c.m_spendPublicKey = w->spend_public_key();
+				c.m_viewPublicKey = w->view_public_key();
+				c.m_ephPublicKey = eph_public_key;
+				c.m_viewTag = view_tag;
+			}
+			else {
 				LOGERR(1, "get_eph_public_key failed at index " << i);
 			}
 			m_minerTx.insert(m_minerTx.end(), eph_public_key.h, eph_public_key.h + HASH_SIZE);
@@ -837,7 +1056,20 @@ hash BlockTemplate::calc_sidechain_hash() const
 	return sidechain_hash;
 }
 
-hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
+void BlockTemplate::Snapshot::calc_miner_tx_keccak_state()
+{
+	const uint8_t* data = m_blockTemplateBlob.data() + m_minerTxOffsetInTemplate;
+	const size_t extra_nonce_offset = m_extraNonceOffsetInTemplate - m_minerTxOffsetInTemplate;
+
+	int size = static_cast<int>(extra_nonce_offset);
+
+	memset(m_minerTxKeccakState, 0, sizeof(m_minerTxKeccakState));
+	keccak_step(data, size, m_minerTxKeccakState);
+
+	m_minerTxKeccakStateSize = extra_nonce_offset - size;
+}
+
+hash BlockTemplate::Snapshot::calc_miner_tx_hash(uint32_t extra_nonce) const
 {
 	// Calculate 3 partial hashes
 	uint8_t hashes[HASH_SIZE * 3];
@@ -854,15 +1086,32 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 
 	// 1. Prefix (everything except vin_rct_type byte in the end)
 	// Apply extra_nonce in-place because we can't write to the block template here
-	keccak_custom([data, extra_nonce_offset, &extra_nonce_buf](int offset)
-		{
-			const uint32_t k = static_cast<uint32_t>(offset - extra_nonce_offset);
-			if (k < EXTRA_NONCE_SIZE) {
-				return extra_nonce_buf[k];
-			}
-			return data[offset];
-		},
-		static_cast<int>(m_minerTxSize) - 1, hashes, HASH_SIZE);
+	const int prefix_size = static_cast<int>(m_minerTxSize) - 1;
+	const int state_size = static_cast<int>(m_minerTxKeccakStateSize);
+
+	// Only the data after the precalculated Keccak state needs to be hashed, it's less than 200 bytes
+	uint8_t tail[KeccakParams::HASH_DATA_AREA * 2];
+	const int tail_size = prefix_size - state_size;
+
+	if ((state_size <= extra_nonce_offset) && (tail_size <= static_cast<int>(sizeof(tail)))) {
+		memcpy(tail, data + state_size, tail_size);
+		memcpy(tail + extra_nonce_offset - state_size, extra_nonce_buf, EXTRA_NONCE_SIZE);
+
+		uint64_t st[25];
+		memcpy(st, m_minerTxKeccakState, sizeof(st));
+		keccak_finish(tail, tail_size, st, hashes);
+	}
+	else {
+		keccak_custom([data, extra_nonce_offset, &extra_nonce_buf](int offset)
+			{
+				const uint32_t k = static_cast<uint32_t>(offset - extra_nonce_offset);
+				if (k < EXTRA_NONCE_SIZE) {
+					return extra_nonce_buf[k];
+				}
+				return data[offset];
+			},
+			prefix_size, hashes, HASH_SIZE);
+	}
 
 	// 2. Base RCT, single 0 byte in miner tx
 	static constexpr uint8_t known_second_hash[HASH_SIZE] = {
@@ -880,9 +1129,9 @@ hash BlockTemplate::calc_miner_tx_hash(uint32_t extra_nonce) const
 	return result;
 }
 
-void BlockTemplate::calc_merkle_tree_main_branch()
+void BlockTemplate::calc_merkle_tree_main_branch(Snapshot& t) const
 {
-	m_merkleTreeMainBranch.clear();
+	t.m_merkleTreeMainBranch.clear();
 
 	const uint64_t count = m_numTransactionHashes + 1;
 	const uint8_t* h = m_transactionHashes.data();
@@ -893,7 +1142,7 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 		memcpy(root_hash.h, h, HASH_SIZE);
 	}
 	else if (count == 2) {
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
+		t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		keccak(h, HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 	else {
@@ -906,86 +1155,68 @@ void BlockTemplate::calc_merkle_tree_main_branch()
 		std::vector<uint8_t> ints(cnt * HASH_SIZE);
 		memcpy(ints.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-		for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-			if (i == 0) {
-				m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
-			}
-			keccak(h + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
+		i = cnt * 2 - count;
+		j = cnt * 2 - count;
+		if (i == 0) {
+			t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), h + HASH_SIZE, h + HASH_SIZE * 2);
 		}
+		keccak_batch(h + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, cnt - j);
 
 		while (cnt > 2) {
 			cnt >>= 1;
-			for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-				if (i == 0) {
-					m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
-				}
-				keccak(ints.data() + i * HASH_SIZE, HASH_SIZE * 2, ints.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+			keccak_batch(ints.data(), HASH_SIZE * 2, ints.data(), cnt);
 		}
 
-		m_merkleTreeMainBranch.insert(m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
+		t.m_merkleTreeMainBranch.insert(t.m_merkleTreeMainBranch.end(), ints.data() + HASH_SIZE, ints.data() + HASH_SIZE * 2);
 		keccak(ints.data(), HASH_SIZE * 2, root_hash.h, HASH_SIZE);
 	}
 }
 
 bool BlockTemplate::get_difficulties(const uint32_t template_id, uint64_t& height, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		height = m_height;
-		mainchain_difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		return true;
-	}
-
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_difficulties(template_id, height, mainchain_difficulty, sidechain_difficulty);
+	const std::shared_ptr<const Snapshot> t = find_snapshot(template_id);
+	if (!t) {
+		return false;
 	}
 
-	return false;
+	height = t->m_height;
+	mainchain_difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	return true;
 }
 
 uint32_t BlockTemplate::get_hashing_blob(const uint32_t template_id, uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset) const
 {
-	ReadLock lock(m_lock);
-
-	if (template_id == m_templateId) {
-		height = m_height;
-		difficulty = m_difficulty;
-		sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-		seed_hash = m_seedHash;
-		nonce_offset = m_nonceOffset;
-
-		return get_hashing_blob_nolock(extra_nonce, blob);
+	const std::shared_ptr<const Snapshot> t = find_snapshot(template_id);
+	if (!t) {
+		return 0;
 	}
 
-	const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
 
-	if (old && (template_id == old->m_templateId)) {
-		return old->get_hashing_blob(template_id, extra_nonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
-	}
-
-	return 0;
+	return t->get_hashing_blob(extra_nonce, blob);
 }
 
 uint32_t BlockTemplate::get_hashing_blob(uint32_t extra_nonce, uint8_t (&blob)[128], uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
 {
-	ReadLock lock(m_lock);
+	const std::shared_ptr<const Snapshot> t = snapshot();
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
 
-	return get_hashing_blob_nolock(extra_nonce, blob);
+	return t->get_hashing_blob(extra_nonce, blob);
 }
 
-uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const
+uint32_t BlockTemplate::Snapshot::get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const
 {
 	uint8_t* p = blob;
 
@@ -1014,7 +1245,7 @@ uint32_t BlockTemplate::get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* b
 	return static_cast<uint32_t>(p - blob);
 }
 
-uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs, uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
+uint32_t BlockTemplate::Snapshot::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const
 {
 	blobs.clear();
 
@@ -1023,111 +1254,159 @@ uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t c
 		blobs.reserve(required_capacity * 2);
 	}
 
-	uint32_t blob_size = 0;
+	if (count == 0) {
+		return 0;
+	}
+
+	using namespace std::chrono;
+	const high_resolution_clock::time_point start_time = high_resolution_clock::now();
+
+	// The first blob determines the size of all blobs
+	uint8_t first_blob[128];
+	uint32_t blob_size = get_hashing_blob(extra_nonce_start, first_blob);
+
+	if (blob_size > sizeof(first_blob)) {
+		LOGERR(1, "internal error: get_hashing_blob returned too large blob size " << blob_size << ", expected <= " << sizeof(first_blob));
+		blob_size = sizeof(first_blob);
+	}
+	else if (blob_size < 76) {
+		LOGERR(1, "internal error: get_hashing_blob returned too little blob size " << blob_size << ", expected >= 76");
+	}
+
+	blobs.resize(static_cast<size_t>(count) * blob_size);
+	memcpy(blobs.data(), first_blob, blob_size);
 
-	ReadLock lock(m_lock);
+	// Blobs are independent, so they're generated in chunks by several threads when there are many of them
+	std::atomic<uint32_t> next_chunk{ 1 };
 
-	height = m_height;
-	difficulty = m_difficulty;
-	sidechain_difficulty = m_poolBlockTemplate->m_difficulty;
-	seed_hash = m_seedHash;
-	nonce_offset = m_nonceOffset;
-	template_id = m_templateId;
+	auto worker = [this, extra_nonce_start, count, blob_size, &blobs, &next_chunk]()
+	{
+		for (;;) {
+			const uint32_t from = next_chunk.fetch_add(HASHING_BLOBS_CHUNK_SIZE);
+			if (from >= count) {
+				return;
+			}
 
-	for (uint32_t i = 0; i < count; ++i) {
-		uint8_t blob[128];
-		uint32_t n = get_hashing_blob_nolock(extra_nonce_start + i, blob);
+			const uint32_t to = std::min(from + HASHING_BLOBS_CHUNK_SIZE, count);
 
-		if (n > sizeof(blob)) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned too large blob size " << n << ", expected <= " << sizeof(blob));
-			n = sizeof(blob);
-		}
-		else if (n < 76) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned too little blob size " << n << ", expected >= 76");
+			for (uint32_t i = from; i < to; ++i) {
+				uint8_t blob[128];
+				const uint32_t n = get_hashing_blob(extra_nonce_start + i, blob);
+
+				if (n != blob_size) {
+					LOGERR(1, "internal error: get_hashing_blob returned different blob size " << n << ", expected " << blob_size);
+				}
+				memcpy(blobs.data() + static_cast<size_t>(i) * blob_size, blob, blob_size);
+			}
 		}
+	};
 
-		if (blob_size == 0) {
-			blob_size = n;
+	const uint32_t num_threads = std::min(std::max(std::thread::hardware_concurrency(), 1U), count / HASHING_BLOBS_MIN_PER_THREAD);
+
+	std::vector<std::thread> threads;
+	if (num_threads > 1) {
+		threads.reserve(num_threads - 1);
+		try {
+			for (uint32_t i = 1; i < num_threads; ++i) {
+				threads.emplace_back(worker);
+			}
 		}
-		else if (n != blob_size) {
-			LOGERR(1, "internal error: get_hashing_blob_nolock returned different blob size " << n << ", expected " << blob_size);
+		catch (const std::exception& e) {
+			LOGWARN(3, "get_hashing_blobs: failed to start a thread: " << e.what());
 		}
-		blobs.insert(blobs.end(), blob, blob + blob_size);
 	}
 
+	// Current thread also does its part of the work
+	worker();
+
+	for (std::thread& t : threads) {
+		t.join();
+	}
+
+	const uint64_t dt = duration_cast<microseconds>(high_resolution_clock::now() - start_time).count();
+	const size_t threads_used = threads.size() + 1;
+	LOGINFO(5, "generated " << count << " hashing blobs in " << dt << " us using " << threads_used << " threads");
+
 	return blob_size;
 }
 
-std::vector<uint8_t> BlockTemplate::get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const
+uint32_t BlockTemplate::get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs, uint64_t& height, difficulty_type& difficulty, difficulty_type& sidechain_difficulty, hash& seed_hash, size_t& nonce_offset, uint32_t& template_id) const
 {
-	ReadLock lock(m_lock);
+	const std::shared_ptr<const Snapshot> t = snapshot();
 
-	if (template_id != m_templateId) {
-		const BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-		if (old && (template_id == old->m_templateId)) {
-			return old->get_block_template_blob(template_id, nonce_offset, extra_nonce_offset);
-		}
+	height = t->m_height;
+	difficulty = t->m_difficulty;
+	sidechain_difficulty = t->m_poolBlockTemplate->m_difficulty;
+	seed_hash = t->m_seedHash;
+	nonce_offset = t->m_nonceOffset;
+	template_id = t->m_templateId;
+
+	return t->get_hashing_blobs(extra_nonce_start, count, blobs);
+}
 
+std::vector<uint8_t> BlockTemplate::get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const
+{
+	const std::shared_ptr<const Snapshot> t = find_snapshot(template_id);
+	if (!t) {
 		nonce_offset = 0;
 		extra_nonce_offset = 0;
 		return std::vector<uint8_t>();
 	}
 
-	nonce_offset = m_nonceOffset;
-	extra_nonce_offset = m_extraNonceOffsetInTemplate;
-	return m_blockTemplateBlob;
+	nonce_offset = t->m_nonceOffset;
+	extra_nonce_offset = t->m_extraNonceOffsetInTemplate;
+	return t->m_blockTemplateBlob;
 }
 
-void BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
+hash BlockTemplate::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
-	WriteLock lock(m_lock);
+	const std::shared_ptr<const Snapshot> t = find_snapshot(template_id);
+	if (!t) {
+		return {};
+	}
 
-	if (template_id == m_templateId) {
-		m_poolBlockTemplate->m_nonce = nonce;
-		m_poolBlockTemplate->m_extraNonce = extra_nonce;
+	TraceSpan span("submit_sidechain_block", t->m_poolBlockTemplate->m_sidechainId);
 
-		SideChain& side_chain = m_pool->side_chain();
+	// Published template is immutable, so nonce and extra nonce go into a copy
+	PoolBlock block(*t->m_poolBlockTemplate);
+	block.m_nonce = nonce;
+	block.m_extraNonce = extra_nonce;
 
-#if POOL_BLOCK_DEBUG
-		{
-			std::vector<uint8_t> buf = m_poolBlockTemplate->serialize_mainchain_data();
-			const std::vector<uint8_t> sidechain_data = m_poolBlockTemplate->serialize_sidechain_data();
+	SideChain& side_chain = m_pool->side_chain();
 
-			memcpy(buf.data() + m_nonceOffset, &nonce, NONCE_SIZE);
-			memcpy(buf.data() + m_extraNonceOffsetInTemplate, &extra_nonce, EXTRA_NONCE_SIZE);
+#if POOL_BLOCK_DEBUG
+	{
+		std::vector<uint8_t> buf = block.serialize_mainchain_data();
+		const std::vector<uint8_t> sidechain_data = block.serialize_sidechain_data();
 
-			buf.insert(buf.end(), sidechain_data.begin(), sidechain_data.end());
+		memcpy(buf.data() + t->m_nonceOffset, &nonce, NONCE_SIZE);
+		memcpy(buf.data() + t->m_extraNonceOffsetInTemplate, &extra_nonce, EXTRA_NONCE_SIZE);
 
-			PoolBlock check;
-			const int result = check.deserialize(buf.data(), buf.size(), side_chain, nullptr);
-			if (result != 0) {
-				LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
-			}
+		buf.insert(buf.end(), sidechain_data.begin(), sidechain_data.end());
 
-			hash pow_hash;
-			if (!check.get_pow_hash(m_pool->hasher(), check.m_txinGenHeight, m_seedHash, pow_hash)) {
-				LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
-			}
-			else if (!check.m_difficulty.check_pow(pow_hash)) {
-				LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
-			}
+		PoolBlock check;
+		const int result = check.deserialize(buf.data(), buf.size(), side_chain, nullptr);
+		if (result != 0) {
+			LOGERR(1, "pool block blob generation and/or parsing is broken, error " << result);
 		}
-#endif
 
-		m_poolBlockTemplate->m_verified = true;
-		if (!side_chain.block_seen(*m_poolBlockTemplate)) {
-			m_poolBlockTemplate->m_wantBroadcast = true;
-			side_chain.add_block(*m_poolBlockTemplate);
+		hash pow_hash;
+		if (!check.get_pow_hash(m_pool->hasher(), check.m_txinGenHeight, t->m_seedHash, pow_hash)) {
+			LOGERR(1, "PoW check failed for the sidechain block. Fix it! ");
+		}
+		else if (!check.m_difficulty.check_pow(pow_hash)) {
+			LOGERR(1, "Sidechain block has wrong PoW. Fix it! ");
 		}
-		return;
 	}
+#endif
 
-	BlockTemplate* old = m_oldTemplates[template_id % array_size(&BlockTemplate::m_oldTemplates)];
-
-	if (old && (template_id == old->m_templateId)) {
-		old->submit_sidechain_block(template_id, nonce, extra_nonce);
-		return;
+	block.m_verified = true;
+	if (!side_chain.block_seen(block)) {
+		block.m_wantBroadcast = true;
+		side_chain.add_block(block);
 	}
+
+	return block.m_sidechainId;
 }
 
 } // namespace p2pool
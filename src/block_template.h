@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include <memory>
 
 #define TEST_MEMPOOL_PICKING_ALGORITHM 0
 
@@ -29,15 +30,12 @@ class Wallet;
 struct PoolBlock;
 struct MinerShare;
 
-class BlockTemplate
+class BlockTemplate : public nocopy_nomove
 {
 public:
 	explicit BlockTemplate(p2pool* pool);
 	~BlockTemplate();
 
-	BlockTemplate(const BlockTemplate& b);
-	BlockTemplate& operator=(const BlockTemplate& b);
-
 	void update(const MinerData& data, const Mempool& mempool, Wallet* miner_wallet);
 
 	bool get_difficulties(const uint32_t template_id, uint64_t& height, difficulty_type& mainchain_difficulty, difficulty_type& sidechain_difficulty) const;
@@ -48,10 +46,46 @@ public:
 
 	std::vector<uint8_t> get_block_template_blob(uint32_t template_id, size_t& nonce_offset, size_t& extra_nonce_offset) const;
 
-	FORCEINLINE uint64_t height() const { return m_height; }
-	FORCEINLINE difficulty_type difficulty() const { return m_difficulty; }
+	// Immutable result of update(), published atomically
+	// Readers keep a reference to it, so they never wait for the next update and old template IDs stay valid
+	struct Snapshot
+	{
+		uint32_t m_templateId = 0;
+
+		std::vector<uint8_t> m_blockTemplateBlob;
+		std::vector<uint8_t> m_merkleTreeMainBranch;
+
+		size_t m_blockHeaderSize = 0;
+		size_t m_minerTxOffsetInTemplate = 0;
+		size_t m_minerTxSize = 0;
+		size_t m_nonceOffset = 0;
+		size_t m_extraNonceOffsetInTemplate = 0;
+
+		// Keccak state after the miner tx data before extra nonce, it's the same for all extra nonce values
+		uint64_t m_minerTxKeccakState[25] = {};
+		size_t m_minerTxKeccakStateSize = 0;
+
+		size_t m_numTransactionHashes = 0;
+		uint64_t m_height = 0;
+		difficulty_type m_difficulty;
+		hash m_seedHash;
+
+		std::shared_ptr<const PoolBlock> m_poolBlockTemplate;
+
+		void calc_miner_tx_keccak_state();
+		hash calc_miner_tx_hash(uint32_t extra_nonce) const;
+		uint32_t get_hashing_blob(uint32_t extra_nonce, uint8_t* blob) const;
 
-	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
+		// Blobs for "count" consecutive extra nonces, generated by several threads when there are many of them
+		uint32_t get_hashing_blobs(uint32_t extra_nonce_start, uint32_t count, std::vector<uint8_t>& blobs) const;
+	};
+
+	std::shared_ptr<const Snapshot> snapshot() const { return std::atomic_load(&m_snapshot); }
+
+	uint64_t height() const { return snapshot()->m_height; }
+	difficulty_type difficulty() const { return snapshot()->m_difficulty; }
+
+	hash submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
 	FORCEINLINE const std::vector<MinerShare>& shares() const { return m_shares; }
 
@@ -60,18 +94,27 @@ private:
 
 private:
 	int create_miner_tx(const MinerData& data, const std::vector<MinerShare>& shares, uint64_t max_reward_amounts_weight, bool dry_run);
+	int get_miner_tx_weight(const MinerData& data, uint64_t max_reward_amounts_weight, uint64_t& weight);
+	bool reuse_tx_order();
+	void pick_transactions_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t greedy_reward);
 	hash calc_sidechain_hash() const;
-	hash calc_miner_tx_hash(uint32_t extra_nonce) const;
-	void calc_merkle_tree_main_branch();
+	void calc_merkle_tree_main_branch(Snapshot& t) const;
 
-	uint32_t get_hashing_blob_nolock(uint32_t extra_nonce, uint8_t* blob) const;
+	std::shared_ptr<const Snapshot> find_snapshot(uint32_t template_id) const;
+	void publish(const std::shared_ptr<Snapshot>& t);
 
-	mutable uv_rwlock_t m_lock;
+	// The current template and up to 4 previous ones, indexed by template ID
+	// update() replaces an old template before the current one, so readers check the current template first
+	std::shared_ptr<const Snapshot> m_snapshot;
+	std::shared_ptr<const Snapshot> m_oldTemplates[4];
+
+	// Only one update() can run at a time, readers never take this lock
+	uv_mutex_t m_updateLock;
 
 	uint32_t m_templateId;
 
+	// Everything below is update() state, it's not accessed by readers
 	std::vector<uint8_t> m_blockTemplateBlob;
-	std::vector<uint8_t> m_merkleTreeMainBranch;
 
 	size_t m_blockHeaderSize;
 	size_t m_minerTxOffsetInTemplate;
@@ -81,7 +124,7 @@ private:
 
 	size_t m_numTransactionHashes;
 	hash m_prevId;
-	std::atomic<uint64_t> m_height;
+	uint64_t m_height;
 	difficulty_type m_difficulty;
 	hash m_seedHash;
 
@@ -90,13 +133,12 @@ private:
 	hash m_txkeyPub;
 	hash m_txkeySec;
 
-	PoolBlock* m_poolBlockTemplate;
-
-	BlockTemplate* m_oldTemplates[4] = {};
+	// A new PoolBlock is created for every update, it becomes a part of the published snapshot
+	std::shared_ptr<PoolBlock> m_poolBlockTemplate;
 
 	uint64_t m_finalReward;
 
-	// Temp vectors, will be cleaned up after use and skipped in copy constructor/assignment operators
+	// Temp vectors, will be cleaned up after use
 	std::vector<uint8_t> m_minerTx;
 	std::vector<uint8_t> m_blockHeader;
 	std::vector<uint8_t> m_minerTxExtra;
@@ -110,6 +152,47 @@ private:
 
 	void shuffle_tx_order();
 
+	// Results from previous updates which are reused when their inputs didn't change
+	struct DryRunResult
+	{
+		uint64_t m_height;
+		uint8_t m_txType;
+		size_t m_numOutputs;
+		uint64_t m_rewardAmountsWeight;
+		uint64_t m_minerTxWeight;
+	};
+
+	DryRunResult m_lastDryRun = {};
+
+	// Output keys only depend on tx secret key, output index and wallet
+	struct CachedOutput
+	{
+		hash m_spendPublicKey;
+		hash m_viewPublicKey;
+		hash m_ephPublicKey;
+		uint8_t m_viewTag;
+	};
+
+	hash m_cachedOutputsTxkeySec;
+	std::vector<CachedOutput> m_cachedOutputs;
+
+	// --knapsack mode state and statistics
+	std::vector<uint64_t> m_knapsackFees;
+	std::vector<uint64_t> m_knapsackTaken;
+	std::vector<int> m_knapsackOrder;
+
+	struct KnapsackStats
+	{
+		uint64_t m_runs;
+		uint64_t m_timeouts;
+		uint64_t m_improved;
+		uint64_t m_lastRewardDelta;
+		uint64_t m_totalRewardDelta;
+		uint64_t m_lastTime;
+	};
+
+	KnapsackStats m_knapsackStats = {};
+
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	void fill_optimal_knapsack(const MinerData& data, uint64_t base_reward, uint64_t miner_tx_weight, uint64_t& best_reward, uint64_t& final_fees, uint64_t& final_weight);
 
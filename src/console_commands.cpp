@@ -21,6 +21,8 @@
 #include "p2pool.h"
 #include "stratum_server.h"
 #include "p2p_server.h"
+#include "p2pool_api.h"
+#include "api_server.h"
 #ifdef WITH_RANDOMX
 #include "miner.h"
 #endif
@@ -102,7 +104,7 @@ typedef struct cmd {
 	cmdfunc *func;
 } cmd;
 
-static cmdfunc do_help, do_status, do_loglevel, do_addpeers, do_droppeers, do_showpeers, do_showworkers, do_showbans, do_outpeers, do_inpeers, do_exit;
+static cmdfunc do_help, do_status, do_loglevel, do_addpeers, do_droppeers, do_showpeers, do_showworkers, do_showbans, do_outpeers, do_inpeers, do_memprof, do_exit;
 
 #ifdef WITH_RANDOMX
 static cmdfunc do_start_mining, do_stop_mining;
@@ -119,6 +121,7 @@ static cmd cmds[] = {
 	{ STRCONST("bans"), "", "show all banned IPs", do_showbans },
 	{ STRCONST("outpeers"), "", "set maximum number of outgoing connections", do_outpeers },
 	{ STRCONST("inpeers"), "", "set maximum number of incoming connections", do_inpeers },
+	{ STRCONST("memprof"), "[start <bytes>|stop]", "sample one allocation every <bytes> (default 524288) and show memory usage by call site", do_memprof },
 #ifdef WITH_RANDOMX
 	{ STRCONST("start_mining"), "<threads>", "start mining", do_start_mining },
 	{ STRCONST("stop_mining"), "", "stop mining", do_stop_mining },
@@ -144,9 +147,13 @@ static void do_status(p2pool *m_pool, const char * /* args */)
 	if (m_pool->p2p_server()) {
 		m_pool->p2p_server()->print_status();
 	}
+	if (m_pool->api() && m_pool->api()->http_server()) {
+		m_pool->api()->http_server()->print_status();
+	}
 #ifdef WITH_RANDOMX
 	m_pool->print_miner_status();
 #endif
+	print_work_lanes_status();
 	bkg_jobs_tracker.print_status();
 }
 
@@ -212,6 +219,20 @@ static void do_inpeers(p2pool* m_pool, const char* args)
 	}
 }
 
+static void do_memprof(p2pool* /* m_pool */, const char* args)
+{
+	if (strncmp(args, "start", 5) == 0) {
+		const uint64_t n = strtoull(args + 5, nullptr, 10);
+		alloc_profiler::start(n ? n : 524288);
+	}
+	else if (strncmp(args, "stop", 4) == 0) {
+		alloc_profiler::stop();
+	}
+	else {
+		alloc_profiler::print_status();
+	}
+}
+
 #ifdef WITH_RANDOMX
 static void do_start_mining(p2pool* m_pool, const char* args)
 {
@@ -19,6 +19,7 @@
 #include "crypto.h"
 #include "keccak.h"
 #include "uv_util.h"
+#include <deque>
 
 extern "C" {
 #include "crypto-ops.h"
@@ -154,48 +155,285 @@ static FORCEINLINE void derivation_to_scalar(const hash& derivation, size_t outp
 	hash_to_scalar(data, static_cast<int>(p - data), res);
 }
 
-class Cache : public nocopy_nomove
+struct WalletKeyTable
+{
+	hash m_spendPublicKey;
+	hash m_viewPublicKey;
+	ge_p3 m_viewPoint;
+	ge_cached m_spendPoint;
+	ge_precomp m_viewMultiples[32][8];
+};
+
+// 8 * key2 * view_public_key
+static void derivation_point(ge_p2& result, const WalletKeyTable& table, const hash& key2)
+{
+	ge_p1p1 point;
+
+	// The table can't be used for scalars >= 2^255, fall back to the generic code to get exactly the same result
+	if (key2.h[HASH_SIZE - 1] > 127) {
+		ge_scalarmult(&result, key2.h, &table.m_viewPoint);
+	}
+	else {
+		ge_p3 point2;
+		ge_scalarmult_table(&point2, key2.h, table.m_viewMultiples);
+		ge_p3_to_p2(&result, &point2);
+	}
+
+	ge_mul8(&point, &result);
+	ge_p1p1_to_p2(&result, &point);
+}
+
+// Hs(derivation || output_index) * G + spend_public_key
+static void public_key_point(ge_p2& result, const hash& derivation, size_t output_index, const WalletKeyTable& table)
+{
+	uint8_t scalar[HASH_SIZE];
+	ge_p3 point;
+	ge_p1p1 point2;
+
+	derivation_to_scalar(derivation, output_index, scalar);
+	ge_scalarmult_base(&point, scalar);
+	ge_add(&point2, &point, &table.m_spendPoint);
+	ge_p1p1_to_p2(&result, &point2);
+}
+
+// Collects points and converts them to bytes with one field inversion
+class PointBatch : public nocopy_nomove
 {
 public:
-	Cache()
-		: derivations(new DerivationsMap())
-		, public_keys(new PublicKeysMap())
-		, tx_keys(new TxKeysMap())
+	enum { SIZE = 64 };
+
+	PointBatch() : m_count(0) {}
+
+	FORCEINLINE ge_p2& add(size_t index)
 	{
-		uv_rwlock_init_checked(&derivations_lock);
-		uv_rwlock_init_checked(&public_keys_lock);
-		uv_rwlock_init_checked(&tx_keys_lock);
+		m_indices[m_count] = index;
+		return m_points[m_count++];
 	}
 
-	~Cache()
+	// Calls f(index, bytes) for all points added since the previous call
+	template<typename T>
+	void flush(T&& f)
 	{
-		delete derivations;
-		delete public_keys;
-		delete tx_keys;
+		ge_p2_batch_tobytes(m_bytes[0], m_points, m_tmp, m_count);
+
+		for (int i = 0; i < m_count; ++i) {
+			f(m_indices[i], m_bytes[i]);
+		}
 
-		uv_rwlock_destroy(&derivations_lock);
-		uv_rwlock_destroy(&public_keys_lock);
-		uv_rwlock_destroy(&tx_keys_lock);
+		m_count = 0;
 	}
 
-	bool get_derivation(const hash& key1, const hash& key2, size_t output_index, hash& derivation, uint8_t& view_tag)
+private:
+	int m_count;
+	size_t m_indices[SIZE];
+	ge_p2 m_points[SIZE];
+	fe m_tmp[SIZE * 2];
+	uint8_t m_bytes[SIZE][HASH_SIZE];
+};
+
+// Fixed capacity hash map split into shards by key, each shard has its own lock
+// Every entry remembers the epoch when it was last used: age() evicts entries which weren't used for a whole epoch,
+// and a full shard evicts the least recently used quarter of its entries
+template<typename Key, typename Value>
+class ShardedCache : public nocopy_nomove
+{
+public:
+	enum { NUM_SHARDS = 64 };
+
+	explicit ShardedCache(size_t capacity)
+		: m_shardCapacity(static_cast<uint32_t>(std::max<size_t>(capacity / NUM_SHARDS, 16)))
+		, m_epoch(0)
+		, m_hits(0)
+		, m_misses(0)
+		, m_evictions(0)
 	{
-		std::array<uint8_t, HASH_SIZE * 2> index;
-		memcpy(index.data(), key1.h, HASH_SIZE);
-		memcpy(index.data() + HASH_SIZE, key2.h, HASH_SIZE);
+		for (Shard& shard : m_shards) {
+			uv_rwlock_init_checked(&shard.m_lock);
+		}
+	}
 
-		derivation = {};
-		{
-			ReadLock lock(derivations_lock);
-			auto it = derivations->find(index);
-			if (it != derivations->end()) {
-				const DerivationEntry& entry = it->second;
-				derivation = entry.m_derivation;
-				if (entry.find_view_tag(output_index, view_tag)) {
-					return true;
+	~ShardedCache()
+	{
+		for (Shard& shard : m_shards) {
+			uv_rwlock_destroy(&shard.m_lock);
+		}
+	}
+
+	// Calls f(value) under the shard's read lock if the key is found, f returns false if the value isn't good enough
+	template<typename T>
+	bool find(const Key& key, T&& f)
+	{
+		Shard& shard = get_shard(key);
+
+		ReadLock lock(shard.m_lock);
+
+		auto it = shard.m_index.find(key);
+		if (it == shard.m_index.end()) {
+			++m_misses;
+			return false;
+		}
+
+		Slot& slot = shard.m_slots[it->second];
+
+		const uint32_t epoch = m_epoch.load(std::memory_order_relaxed);
+		if (slot.m_lastUsed.load(std::memory_order_relaxed) != epoch) {
+			slot.m_lastUsed.store(epoch, std::memory_order_relaxed);
+		}
+
+		if (!f(static_cast<const Value&>(slot.m_value))) {
+			++m_misses;
+			return false;
+		}
+
+		++m_hits;
+		return true;
+	}
+
+	// Calls f(value, is_new) under the shard's write lock
+	template<typename T>
+	void update(const Key& key, T&& f)
+	{
+		Shard& shard = get_shard(key);
+		AllocationTag tag(alloc_profiler::Tag::CRYPTO_CACHE);
+
+		WriteLock lock(shard.m_lock);
+
+		auto it = shard.m_index.find(key);
+		if (it != shard.m_index.end()) {
+			f(shard.m_slots[it->second].m_value, false);
+			return;
+		}
+
+		if (shard.m_freeSlots.empty()) {
+			if (shard.m_slots.size() >= m_shardCapacity) {
+				evict_oldest(shard);
+			}
+			else {
+				shard.m_freeSlots.push_back(static_cast<uint32_t>(shard.m_slots.size()));
+				shard.m_slots.emplace_back();
+			}
+		}
+
+		const uint32_t index = shard.m_freeSlots.back();
+		shard.m_freeSlots.pop_back();
+
+		Slot& slot = shard.m_slots[index];
+		slot.m_value = Value();
+		slot.m_lastUsed.store(m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		shard.m_index.emplace(key, index);
+		f(slot.m_value, true);
+	}
+
+	// Starts a new epoch and evicts entries which weren't used in the previous one
+	void age()
+	{
+		const uint32_t epoch = ++m_epoch;
+
+		for (Shard& shard : m_shards) {
+			WriteLock lock(shard.m_lock);
+
+			for (auto it = shard.m_index.begin(); it != shard.m_index.end();) {
+				if (epoch - shard.m_slots[it->second].m_lastUsed.load(std::memory_order_relaxed) > 1) {
+					shard.m_freeSlots.push_back(it->second);
+					it = shard.m_index.erase(it);
+					++m_evictions;
+				}
+				else {
+					++it;
 				}
 			}
 		}
+	}
+
+	void get_stats(CryptoCacheStats::Counters& stats)
+	{
+		stats.m_size = 0;
+		for (Shard& shard : m_shards) {
+			ReadLock lock(shard.m_lock);
+			stats.m_size += shard.m_index.size();
+		}
+
+		stats.m_capacity = static_cast<uint64_t>(m_shardCapacity) * NUM_SHARDS;
+		stats.m_hits = m_hits.load();
+		stats.m_misses = m_misses.load();
+		stats.m_evictions = m_evictions.load();
+	}
+
+private:
+	struct Slot
+	{
+		Slot() : m_value(), m_lastUsed(0) {}
+
+		Value m_value;
+		std::atomic<uint32_t> m_lastUsed;
+	};
+
+	// Slots are in a deque, so they never move and m_lastUsed can be updated under the read lock
+	struct Shard
+	{
+		uv_rwlock_t m_lock;
+		unordered_map<Key, uint32_t> m_index;
+		std::deque<Slot> m_slots;
+		std::vector<uint32_t> m_freeSlots;
+	};
+
+	// Keys start with curve points or hashes, so their first bytes are already uniformly distributed
+	FORCEINLINE Shard& get_shard(const Key& key)
+	{
+		uint64_t k;
+		memcpy(&k, key.data(), sizeof(k));
+		return m_shards[(k >> 32) % NUM_SHARDS];
+	}
+
+	void evict_oldest(Shard& shard)
+	{
+		std::vector<std::pair<uint32_t, Key>> entries;
+		entries.reserve(shard.m_index.size());
+
+		const uint32_t epoch = m_epoch.load(std::memory_order_relaxed);
+		for (const auto& it : shard.m_index) {
+			entries.emplace_back(epoch - shard.m_slots[it.second].m_lastUsed.load(std::memory_order_relaxed), it.first);
+		}
+
+		const size_t n = std::max<size_t>(entries.size() / 4, 1);
+		std::nth_element(entries.begin(), entries.begin() + (n - 1), entries.end(),
+			[](const std::pair<uint32_t, Key>& a, const std::pair<uint32_t, Key>& b) { return a.first > b.first; });
+
+		for (size_t i = 0; i < n; ++i) {
+			auto it = shard.m_index.find(entries[i].second);
+			shard.m_freeSlots.push_back(it->second);
+			shard.m_index.erase(it);
+		}
+
+		m_evictions += n;
+	}
+
+	const uint32_t m_shardCapacity;
+	std::atomic<uint32_t> m_epoch;
+
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+
+	Shard m_shards[NUM_SHARDS];
+};
+
+class Cache : public nocopy_nomove
+{
+public:
+	Cache()
+		: derivations(DERIVATIONS_CAPACITY)
+		, public_keys(PUBLIC_KEYS_CAPACITY)
+		, tx_keys(TX_KEYS_CAPACITY)
+	{
+	}
+
+	bool get_derivation(const hash& key1, const hash& key2, size_t output_index, hash& derivation, uint8_t& view_tag)
+	{
+		if (find_derivation(key1, key2, output_index, derivation, view_tag)) {
+			return true;
+		}
 
 		if (derivation.empty()) {
 			ge_p3 point;
@@ -213,35 +451,56 @@ public:
 		}
 
 		derive_view_tag(derivation, output_index, view_tag);
+		store_derivation(key1, key2, output_index, derivation, view_tag);
+
+		return true;
+	}
+
+	void get_derivations(const WalletKeyTable* const* tables, const hash& key2, size_t first_output_index, size_t count, hash* derivations, uint8_t* view_tags)
+	{
+		PointBatch batch;
 
+		// Derivations which are not in the cache need their view tags calculated and stored
+		auto store = [this, tables, &key2, first_output_index, derivations, view_tags](size_t i)
 		{
-			WriteLock lock(derivations_lock);
+			derive_view_tag(derivations[i], first_output_index + i, view_tags[i]);
+			store_derivation(tables[i]->m_viewPublicKey, key2, first_output_index + i, derivations[i], view_tags[i]);
+		};
 
-			DerivationEntry& entry = derivations->emplace(index, DerivationEntry{ derivation, {} }).first->second;
+		for (size_t begin = 0; begin < count; begin += PointBatch::SIZE) {
+			const size_t end = std::min<size_t>(begin + PointBatch::SIZE, count);
 
-			const uint32_t k = static_cast<uint32_t>(output_index << 8) | view_tag;
-			if (std::find(entry.m_viewTags.begin(), entry.m_viewTags.end(), k) == entry.m_viewTags.end()) {
-				entry.m_viewTags.emplace_back(k);
+			for (size_t i = begin; i < end; ++i) {
+				if (!tables[i]) {
+					continue;
+				}
+
+				if (find_derivation(tables[i]->m_viewPublicKey, key2, first_output_index + i, derivations[i], view_tags[i])) {
+					continue;
+				}
+
+				if (derivations[i].empty()) {
+					derivation_point(batch.add(i), *tables[i], key2);
+				}
+				else {
+					store(i);
+				}
 			}
-		}
 
-		return true;
+			batch.flush([derivations, &store](size_t i, const uint8_t* bytes)
+				{
+					memcpy(derivations[i].h, bytes, HASH_SIZE);
+					store(i);
+				});
+		}
 	}
 
 	bool get_public_key(const hash& derivation, size_t output_index, const hash& base, hash& derived_key)
 	{
-		std::array<uint8_t, HASH_SIZE * 2 + sizeof(size_t)> index;
-		memcpy(index.data(), derivation.h, HASH_SIZE);
-		memcpy(index.data() + HASH_SIZE, base.h, HASH_SIZE);
-		memcpy(index.data() + HASH_SIZE * 2, &output_index, sizeof(size_t));
+		const auto index = get_public_key_index(derivation, output_index, base);
 
-		{
-			ReadLock lock(public_keys_lock);
-			auto it = public_keys->find(index);
-			if (it != public_keys->end()) {
-				derived_key = it->second;
-				return true;
-			}
+		if (public_keys.find(index, [&derived_key](const hash& key) { derived_key = key; return true; })) {
+			return true;
 		}
 
 		uint8_t scalar[HASH_SIZE];
@@ -262,28 +521,58 @@ public:
 		ge_p1p1_to_p2(&point5, &point4);
 		ge_tobytes(derived_key.h, &point5);
 
-		{
-			WriteLock lock(public_keys_lock);
-			public_keys->emplace(index, derived_key);
-		}
+		public_keys.update(index, [&derived_key](hash& key, bool) { key = derived_key; });
 
 		return true;
 	}
 
+	void get_public_keys(const hash* derivations, const WalletKeyTable* const* tables, size_t first_output_index, size_t count, hash* derived_keys)
+	{
+		PointBatch batch;
+
+		for (size_t begin = 0; begin < count; begin += PointBatch::SIZE) {
+			const size_t end = std::min<size_t>(begin + PointBatch::SIZE, count);
+
+			for (size_t i = begin; i < end; ++i) {
+				if (!tables[i]) {
+					continue;
+				}
+
+				const auto index = get_public_key_index(derivations[i], first_output_index + i, tables[i]->m_spendPublicKey);
+
+				hash& derived_key = derived_keys[i];
+				if (!public_keys.find(index, [&derived_key](const hash& key) { derived_key = key; return true; })) {
+					public_key_point(batch.add(i), derivations[i], first_output_index + i, *tables[i]);
+				}
+			}
+
+			batch.flush([this, derivations, tables, first_output_index, derived_keys](size_t i, const uint8_t* bytes)
+				{
+					hash& derived_key = derived_keys[i];
+					memcpy(derived_key.h, bytes, HASH_SIZE);
+
+					const auto index = get_public_key_index(derivations[i], first_output_index + i, tables[i]->m_spendPublicKey);
+					public_keys.update(index, [&derived_key](hash& key, bool) { key = derived_key; });
+				});
+		}
+	}
+
 	void get_tx_keys(hash& pub, hash& sec, const hash& wallet_spend_key, const hash& monero_block_id)
 	{
 		std::array<uint8_t, HASH_SIZE * 2> index;
 		memcpy(index.data(), wallet_spend_key.h, HASH_SIZE);
 		memcpy(index.data() + HASH_SIZE, monero_block_id.h, HASH_SIZE);
 
-		{
-			ReadLock lock(tx_keys_lock);
-			auto it = tx_keys->find(index);
-			if (it != tx_keys->end()) {
-				pub = it->second.first;
-				sec = it->second.second;
-				return;
-			}
+		const bool found = tx_keys.find(index,
+			[&pub, &sec](const std::pair<hash, hash>& keys)
+			{
+				pub = keys.first;
+				sec = keys.second;
+				return true;
+			});
+
+		if (found) {
+			return;
 		}
 
 		static constexpr char domain[] = "tx_secret_key";
@@ -296,32 +585,80 @@ public:
 
 		generate_keys_deterministic(pub, sec, entropy, sizeof(entropy));
 
-		{
-			WriteLock lock(tx_keys_lock);
-			tx_keys->emplace(index, std::pair<hash, hash>(pub, sec));
-		}
+		tx_keys.update(index, [&pub, &sec](std::pair<hash, hash>& keys, bool) { keys = { pub, sec }; });
 	}
 
-	void clear()
+	void age()
 	{
-		{
-			WriteLock lock(derivations_lock);
-			delete derivations;
-			derivations = new DerivationsMap();
-		}
-		{
-			WriteLock lock(public_keys_lock);
-			delete public_keys;
-			public_keys = new PublicKeysMap();
-		}
-		{
-			WriteLock lock(tx_keys_lock);
-			delete tx_keys;
-			tx_keys = new TxKeysMap();
-		}
+		derivations.age();
+		public_keys.age();
+		tx_keys.age();
+	}
+
+	void get_stats(CryptoCacheStats& stats)
+	{
+		derivations.get_stats(stats.m_derivations);
+		public_keys.get_stats(stats.m_publicKeys);
+		tx_keys.get_stats(stats.m_txKeys);
 	}
 
 private:
+	typedef std::array<uint8_t, HASH_SIZE * 2> DerivationIndex;
+	typedef std::array<uint8_t, HASH_SIZE * 2 + sizeof(size_t)> PublicKeyIndex;
+
+	static FORCEINLINE DerivationIndex get_derivation_index(const hash& key1, const hash& key2)
+	{
+		DerivationIndex index;
+		memcpy(index.data(), key1.h, HASH_SIZE);
+		memcpy(index.data() + HASH_SIZE, key2.h, HASH_SIZE);
+		return index;
+	}
+
+	static FORCEINLINE PublicKeyIndex get_public_key_index(const hash& derivation, size_t output_index, const hash& base)
+	{
+		PublicKeyIndex index;
+		memcpy(index.data(), derivation.h, HASH_SIZE);
+		memcpy(index.data() + HASH_SIZE, base.h, HASH_SIZE);
+		memcpy(index.data() + HASH_SIZE * 2, &output_index, sizeof(size_t));
+		return index;
+	}
+
+	// Returns true if both the derivation and the view tag are cached, derivation is set (non-empty) if only the derivation is cached
+	bool find_derivation(const hash& key1, const hash& key2, size_t output_index, hash& derivation, uint8_t& view_tag)
+	{
+		derivation = {};
+
+		return derivations.find(get_derivation_index(key1, key2),
+			[&derivation, output_index, &view_tag](const DerivationEntry& entry)
+			{
+				derivation = entry.m_derivation;
+				return entry.find_view_tag(output_index, view_tag);
+			});
+	}
+
+	void store_derivation(const hash& key1, const hash& key2, size_t output_index, const hash& derivation, uint8_t view_tag)
+	{
+		const uint32_t k = static_cast<uint32_t>(output_index << 8) | view_tag;
+
+		derivations.update(get_derivation_index(key1, key2),
+			[&derivation, k](DerivationEntry& entry, bool is_new)
+			{
+				if (is_new) {
+					entry.m_derivation = derivation;
+				}
+				if (std::find(entry.m_viewTags.begin(), entry.m_viewTags.end(), k) == entry.m_viewTags.end()) {
+					entry.m_viewTags.emplace_back(k);
+				}
+			});
+	}
+
+	// Enough for all wallets in PPLNS window and all side chain blocks of a few Monero blocks
+	enum {
+		DERIVATIONS_CAPACITY = 1 << 18,
+		PUBLIC_KEYS_CAPACITY = 1 << 18,
+		TX_KEYS_CAPACITY = 1 << 16,
+	};
+
 	struct DerivationEntry
 	{
 		hash m_derivation;
@@ -338,18 +675,9 @@ private:
 		}
 	};
 
-	typedef unordered_map<std::array<uint8_t, HASH_SIZE * 2>, DerivationEntry> DerivationsMap;
-	typedef unordered_map<std::array<uint8_t, HASH_SIZE * 2 + sizeof(size_t)>, hash> PublicKeysMap;
-	typedef unordered_map<std::array<uint8_t, HASH_SIZE * 2>, std::pair<hash, hash>> TxKeysMap;
-
-	uv_rwlock_t derivations_lock;
-	DerivationsMap* derivations;
-
-	uv_rwlock_t public_keys_lock;
-	PublicKeysMap* public_keys;
-
-	uv_rwlock_t tx_keys_lock;
-	TxKeysMap* tx_keys;
+	ShardedCache<DerivationIndex, DerivationEntry> derivations;
+	ShardedCache<PublicKeyIndex, hash> public_keys;
+	ShardedCache<std::array<uint8_t, HASH_SIZE * 2>, std::pair<hash, hash>> tx_keys;
 };
 
 static Cache* cache = nullptr;
@@ -364,6 +692,54 @@ bool derive_public_key(const hash& derivation, size_t output_index, const hash&
 	return cache->get_public_key(derivation, output_index, base, derived_key);
 }
 
+WalletKeyTable* create_wallet_key_table(const hash& spend_public_key, const hash& view_public_key)
+{
+	ge_p3 spend_point;
+	ge_p3 view_point;
+
+	if ((ge_frombytes_vartime(&spend_point, spend_public_key.h) != 0) || (ge_frombytes_vartime(&view_point, view_public_key.h) != 0)) {
+		return nullptr;
+	}
+
+	WalletKeyTable* table = new WalletKeyTable();
+
+	table->m_spendPublicKey = spend_public_key;
+	table->m_viewPublicKey = view_public_key;
+	table->m_viewPoint = view_point;
+	ge_p3_to_cached(&table->m_spendPoint, &spend_point);
+	ge_precompute_table(table->m_viewMultiples, &view_point);
+
+	return table;
+}
+
+void destroy_wallet_key_table(WalletKeyTable* table)
+{
+	delete table;
+}
+
+bool generate_key_derivation(const WalletKeyTable& table, const hash& key2, size_t output_index, hash& derivation, uint8_t& view_tag)
+{
+	const WalletKeyTable* t = &table;
+	cache->get_derivations(&t, key2, output_index, 1, &derivation, &view_tag);
+	return true;
+}
+
+void derive_public_key(const hash& derivation, size_t output_index, const WalletKeyTable& table, hash& derived_key)
+{
+	const WalletKeyTable* t = &table;
+	cache->get_public_keys(&derivation, &t, output_index, 1, &derived_key);
+}
+
+void generate_key_derivations(const WalletKeyTable* const* tables, const hash& key2, size_t first_output_index, size_t count, hash* derivations, uint8_t* view_tags)
+{
+	cache->get_derivations(tables, key2, first_output_index, count, derivations, view_tags);
+}
+
+void derive_public_keys(const hash* derivations, const WalletKeyTable* const* tables, size_t first_output_index, size_t count, hash* derived_keys)
+{
+	cache->get_public_keys(derivations, tables, first_output_index, count, derived_keys);
+}
+
 void get_tx_keys(hash& pub, hash& sec, const hash& wallet_spend_key, const hash& monero_block_id)
 {
 	cache->get_tx_keys(pub, sec, wallet_spend_key, monero_block_id);
@@ -400,11 +776,20 @@ void destroy_crypto_cache()
 	}
 }
 
-void clear_crypto_cache()
+void age_crypto_cache()
+{
+	if (cache) {
+		cache->age();
+	}
+}
+
+CryptoCacheStats get_crypto_cache_stats()
 {
+	CryptoCacheStats stats{};
 	if (cache) {
-		cache->clear();
+		cache->get_stats(stats);
 	}
+	return stats;
 }
 
 } // namespace p2pool
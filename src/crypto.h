@@ -27,8 +27,45 @@ bool generate_key_derivation(const hash& key1, const hash& key2, size_t output_i
 bool derive_public_key(const hash& derivation, size_t output_index, const hash& base, hash& derived_key);
 void derive_view_tag(const hash& derivation, size_t output_index, uint8_t& view_tag);
 
+// Precomputed multiples of a wallet's view public key and its decompressed spend public key (~30 KB)
+// Derivations for a wallet with a table use a fixed-base scalar multiplication which is several times faster
+struct WalletKeyTable;
+
+// Returns nullptr if the keys are invalid
+WalletKeyTable* create_wallet_key_table(const hash& spend_public_key, const hash& view_public_key);
+void destroy_wallet_key_table(WalletKeyTable* table);
+
+// Same as generate_key_derivation(view_public_key, key2, ...) and derive_public_key(derivation, ..., spend_public_key, ...)
+bool generate_key_derivation(const WalletKeyTable& table, const hash& key2, size_t output_index, hash& derivation, uint8_t& view_tag);
+void derive_public_key(const hash& derivation, size_t output_index, const WalletKeyTable& table, hash& derived_key);
+
+// Batch versions for outputs [first_output_index, first_output_index + count) of one miner tx, tables[i] is used for output first_output_index + i
+// Points are normalised with one field inversion per batch, outputs with tables[i] == nullptr are skipped
+void generate_key_derivations(const WalletKeyTable* const* tables, const hash& key2, size_t first_output_index, size_t count, hash* derivations, uint8_t* view_tags);
+void derive_public_keys(const hash* derivations, const WalletKeyTable* const* tables, size_t first_output_index, size_t count, hash* derived_keys);
+
 void init_crypto_cache();
 void destroy_crypto_cache();
-void clear_crypto_cache();
+
+// Crypto cache has a fixed capacity, entries which weren't used since the previous call are evicted here
+void age_crypto_cache();
+
+struct CryptoCacheStats
+{
+	struct Counters
+	{
+		uint64_t m_size;
+		uint64_t m_capacity;
+		uint64_t m_hits;
+		uint64_t m_misses;
+		uint64_t m_evictions;
+	};
+
+	Counters m_derivations;
+	Counters m_publicKeys;
+	Counters m_txKeys;
+};
+
+CryptoCacheStats get_crypto_cache_stats();
 
 } // namespace p2pool
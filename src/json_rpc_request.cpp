@@ -18,6 +18,7 @@
 #include "common.h"
 #include "uv_util.h"
 #include "json_rpc_request.h"
+#include "metrics.h"
 #include <curl/curl.h>
 
 static constexpr char log_category_prefix[] = "JSONRPCRequest ";
@@ -25,6 +26,79 @@ static constexpr char log_category_prefix[] = "JSONRPCRequest ";
 namespace p2pool {
 namespace JSONRPCRequest {
 
+// Connection cache (and DNS cache) shared by all requests running on the same event loop
+// Connections are kept alive after a request is finished, so the next request to the same host/port/proxy doesn't need to connect again
+// curl doesn't support using one connection cache from several threads at the same time, so every loop gets its own share handle
+// Requests run only in their loop's thread, so a share handle is never used concurrently and doesn't need lock callbacks
+static bool connection_pool_enabled = false;
+static uv_mutex_t share_handles_lock;
+static std::vector<std::pair<uv_loop_t*, CURLSH*>> share_handles;
+
+static CURLSH* get_share_handle(uv_loop_t* loop)
+{
+	if (!connection_pool_enabled) {
+		return nullptr;
+	}
+
+	MutexLock lock(share_handles_lock);
+
+	for (const std::pair<uv_loop_t*, CURLSH*>& h : share_handles) {
+		if (h.first == loop) {
+			return h.second;
+		}
+	}
+
+	CURLSH* share_handle = curl_share_init();
+	if (!share_handle) {
+		LOGERR(1, "curl_share_init() failed, connections to monerod will not be reused");
+	}
+	else {
+		CURLSHcode r = curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		if (r == CURLSHE_OK) r = curl_share_setopt(share_handle, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+		if (r != CURLSHE_OK) {
+			LOGERR(1, "curl_share_setopt failed: " << curl_share_strerror(r) << ", connections to monerod will not be reused");
+			curl_share_cleanup(share_handle);
+			share_handle = nullptr;
+		}
+	}
+
+	// A failed share handle is remembered too, so it's not tried again for every request
+	share_handles.emplace_back(loop, share_handle);
+	return share_handle;
+}
+
+void init_connection_pool()
+{
+	if (connection_pool_enabled) {
+		return;
+	}
+
+	uv_mutex_init_checked(&share_handles_lock);
+	connection_pool_enabled = true;
+}
+
+void destroy_connection_pool()
+{
+	if (!connection_pool_enabled) {
+		return;
+	}
+
+	connection_pool_enabled = false;
+
+	for (const std::pair<uv_loop_t*, CURLSH*>& h : share_handles) {
+		if (h.second) {
+			const CURLSHcode r = curl_share_cleanup(h.second);
+			if (r != CURLSHE_OK) {
+				LOGWARN(1, "curl_share_cleanup failed: " << curl_share_strerror(r));
+			}
+		}
+	}
+
+	share_handles.clear();
+	uv_mutex_destroy(&share_handles_lock);
+}
+
 struct CurlContext
 {
 	CurlContext(const std::string& address, int port, const std::string& req, const std::string& auth, const std::string& proxy, CallbackBase* cb, CallbackBase* close_cb, uv_loop_t* loop);
@@ -78,6 +152,8 @@ struct CurlContext
 	std::string m_error;
 
 	curl_slist* m_headers;
+
+	std::chrono::high_resolution_clock::time_point m_startTime;
 };
 
 CurlContext::CurlContext(const std::string& address, int port, const std::string& req, const std::string& auth, const std::string& proxy, CallbackBase* cb, CallbackBase* close_cb, uv_loop_t* loop)
@@ -90,6 +166,7 @@ CurlContext::CurlContext(const std::string& address, int port, const std::string
 	, m_handle(nullptr)
 	, m_req(req)
 	, m_headers(nullptr)
+	, m_startTime(std::chrono::high_resolution_clock::now())
 {
 	m_pollHandles.reserve(2);
 
@@ -181,6 +258,17 @@ CurlContext::CurlContext(const std::string& address, int port, const std::string
 	curl_easy_setopt_checked(m_handle, CURLOPT_CONNECTTIMEOUT, timeout);
 	curl_easy_setopt_checked(m_handle, CURLOPT_TIMEOUT, timeout * 10);
 
+	CURLSH* share_handle = get_share_handle(m_loop);
+	if (share_handle) {
+		curl_easy_setopt_checked(m_handle, CURLOPT_SHARE, share_handle);
+		curl_easy_setopt_checked(m_handle, CURLOPT_TCP_KEEPALIVE, 1L);
+
+		// Keep idle connections longer than the default 118 seconds, so submit_block can reuse them
+#if LIBCURL_VERSION_NUM >= 0x074100
+		curl_easy_setopt_checked(m_handle, CURLOPT_MAXAGE_CONN, 600L);
+#endif
+	}
+
 	m_headers = curl_slist_append(m_headers, "Content-Type: application/json");
 	if (m_headers) {
 		curl_easy_setopt_checked(m_handle, CURLOPT_HTTPHEADER, m_headers);
@@ -214,6 +302,8 @@ CurlContext::CurlContext(const std::string& address, int port, const std::string
 
 CurlContext::~CurlContext()
 {
+	metrics::rpc_request.add(std::chrono::high_resolution_clock::now() - m_startTime);
+
 	if (m_error.empty() && !m_response.empty()) {
 		(*m_callback)(m_response.data(), m_response.size());
 	}
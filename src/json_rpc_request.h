@@ -37,6 +37,10 @@ private:
 	T m_cb;
 };
 
+// Keep-alive connections to monerod are shared by all requests on the same event loop, these must be called after curl_global_init() and before curl_global_cleanup()
+void init_connection_pool();
+void destroy_connection_pool();
+
 void Call(const std::string& address, int port, const std::string& req, const std::string& auth, const std::string& proxy, CallbackBase* cb, CallbackBase* close_cb, uv_loop_t* loop);
 
 template<typename T, typename U>
@@ -18,6 +18,15 @@
 #include "common.h"
 #include "keccak.h"
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define KECCAK_X64
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(WITH_KECCAK_NEON)
+// The NEON kernel hasn't been run on real hardware yet, so it's only built with -DWITH_KECCAK_NEON=ON
+#define KECCAK_NEON
+#include <arm_neon.h>
+#endif
+
 namespace p2pool {
 
 #ifndef ROTL64
@@ -153,4 +162,251 @@ void keccak(const uint8_t *in, int inlen, uint8_t (&md)[200])
 	keccak(in, inlen, md, 200);
 }
 
+void keccak_step(const uint8_t*& in, int& inlen, uint64_t (&st)[25])
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	for (; inlen >= rsiz; inlen -= rsiz, in += rsiz) {
+		for (int i = 0; i < rsizw; i++) {
+			st[i] ^= read_unaligned(reinterpret_cast<const uint64_t*>(in) + i);
+		}
+		keccakf(st);
+	}
+}
+
+void keccak_finish(const uint8_t* in, int inlen, uint64_t (&st)[25], uint8_t* md)
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	keccak_step(in, inlen, st);
+
+	// last block and padding
+	alignas(8) uint8_t temp[144];
+
+	memcpy(temp, in, inlen);
+	temp[inlen++] = 1;
+	memset(temp + inlen, 0, rsiz - inlen);
+	temp[rsiz - 1] |= 0x80;
+
+	for (int i = 0; i < rsizw; i++) {
+		st[i] ^= reinterpret_cast<uint64_t*>(temp)[i];
+	}
+
+	keccakf(st);
+
+	memcpy(md, st, HASH_SIZE);
+}
+
+#ifdef _MSC_VER
+#define KECCAK_TARGET(x)
+#else
+#define KECCAK_TARGET(x) __attribute__((target(x)))
+#endif
+
+#ifdef KECCAK_X64
+
+#define KECCAK_LANES_FUNC keccakf_avx2
+#define KECCAK_LANES_TARGET KECCAK_TARGET("avx2")
+#define KECCAK_LANES 4
+#define KECCAK_LANES_TYPE __m256i
+#define KECCAK_LOAD(p) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))
+#define KECCAK_STORE(p, x) _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x)
+#define KECCAK_XOR(a, b) _mm256_xor_si256(a, b)
+#define KECCAK_ANDN(a, b) _mm256_andnot_si256(a, b)
+#define KECCAK_ROTL(x, n) _mm256_or_si256(_mm256_slli_epi64(x, n), _mm256_srli_epi64(x, 64 - (n)))
+#define KECCAK_SET1(x) _mm256_set1_epi64x(static_cast<int64_t>(x))
+#include "keccak_lanes.inl"
+
+// Masked forms (with all lanes enabled) don't use _mm512_undefined_epi32() which triggers -Wuninitialized on GCC 12
+#define KECCAK_LANES_FUNC keccakf_avx512
+#define KECCAK_LANES_TARGET KECCAK_TARGET("avx512f")
+#define KECCAK_LANES 8
+#define KECCAK_LANES_TYPE __m512i
+#define KECCAK_LOAD(p) _mm512_loadu_si512(p)
+#define KECCAK_STORE(p, x) _mm512_storeu_si512(p, x)
+#define KECCAK_XOR(a, b) _mm512_xor_si512(a, b)
+#define KECCAK_ANDN(a, b) _mm512_mask_andnot_epi64(a, static_cast<__mmask8>(-1), a, b)
+#define KECCAK_ROTL(x, n) _mm512_mask_rol_epi64(x, static_cast<__mmask8>(-1), x, n)
+#define KECCAK_SET1(x) _mm512_set1_epi64(static_cast<int64_t>(x))
+#include "keccak_lanes.inl"
+
+#endif
+
+#ifdef KECCAK_NEON
+
+#define KECCAK_LANES_FUNC keccakf_neon
+#define KECCAK_LANES_TARGET
+#define KECCAK_LANES 2
+#define KECCAK_LANES_TYPE uint64x2_t
+#define KECCAK_LOAD(p) vld1q_u64(p)
+#define KECCAK_STORE(p, x) vst1q_u64(p, x)
+#define KECCAK_XOR(a, b) veorq_u64(a, b)
+#define KECCAK_ANDN(a, b) vbicq_u64(b, a)
+#define KECCAK_ROTL(x, n) vsriq_n_u64(vshlq_n_u64(x, n), x, 64 - (n))
+#define KECCAK_SET1(x) vdupq_n_u64(x)
+#include "keccak_lanes.inl"
+
+#endif
+
+static bool keccak_lanes_supported(int lanes)
+{
+	switch (lanes) {
+	case 1:
+		return true;
+
+#ifdef KECCAK_X64
+	case 4:
+	case 8:
+#ifdef _MSC_VER
+		{
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7) {
+				return false;
+			}
+
+			// OSXSAVE and AVX
+			__cpuid(info, 1);
+			if ((info[2] & 0x18000000) != 0x18000000) {
+				return false;
+			}
+
+			// OS must save YMM registers (and ZMM registers for AVX-512)
+			const uint64_t xcr0 = _xgetbv(0);
+			const uint64_t xcr0_mask = (lanes == 8) ? 0xE6 : 0x06;
+			if ((xcr0 & xcr0_mask) != xcr0_mask) {
+				return false;
+			}
+
+			__cpuidex(info, 7, 0);
+			return (info[1] & ((lanes == 8) ? (1 << 16) : (1 << 5))) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		return (lanes == 8) ? __builtin_cpu_supports("avx512f") : __builtin_cpu_supports("avx2");
+#endif
+#endif
+
+#ifdef KECCAK_NEON
+	case 2:
+		return true;
+#endif
+
+	default:
+		return false;
+	}
+}
+
+static int keccak_lanes_detect()
+{
+	for (int lanes : { 8, 4, 2 }) {
+		if (keccak_lanes_supported(lanes)) {
+			return lanes;
+		}
+	}
+	return 1;
+}
+
+static std::atomic<int> keccak_batch_lanes_selected{ keccak_lanes_detect() };
+
+int keccak_batch_lanes()
+{
+	return keccak_batch_lanes_selected.load(std::memory_order_relaxed);
+}
+
+bool keccak_batch_set_lanes(int lanes)
+{
+	if (lanes == 0) {
+		lanes = keccak_lanes_detect();
+	}
+	else if (!keccak_lanes_supported(lanes)) {
+		return false;
+	}
+
+	keccak_batch_lanes_selected.store(lanes, std::memory_order_relaxed);
+	return true;
+}
+
+// Hashes N inputs (in + i * inlen) at once with one of the multi-lane kernels
+// All inputs are read before the first output is written, so md can overlap with in
+template<int N>
+static FORCEINLINE void keccak_lanes(void (*kernel)(uint64_t*), const uint8_t* in, int inlen, uint8_t* md)
+{
+	constexpr int rsiz = KeccakParams::HASH_DATA_AREA;
+	constexpr int rsizw = rsiz / 8;
+
+	alignas(64) uint64_t st[25 * N] = {};
+
+	int offset = 0;
+
+	for (; inlen - offset >= rsiz; offset += rsiz) {
+		for (int lane = 0; lane < N; ++lane) {
+			const uint64_t* p = reinterpret_cast<const uint64_t*>(in + lane * inlen + offset);
+			for (int i = 0; i < rsizw; ++i) {
+				st[i * N + lane] ^= read_unaligned(p + i);
+			}
+		}
+		kernel(st);
+	}
+
+	// last block and padding
+	const int k = inlen - offset;
+
+	for (int lane = 0; lane < N; ++lane) {
+		alignas(8) uint8_t temp[rsiz];
+
+		memcpy(temp, in + lane * inlen + offset, k);
+		temp[k] = 1;
+		memset(temp + k + 1, 0, rsiz - k - 1);
+		temp[rsiz - 1] |= 0x80;
+
+		for (int i = 0; i < rsizw; ++i) {
+			st[i * N + lane] ^= reinterpret_cast<uint64_t*>(temp)[i];
+		}
+	}
+
+	kernel(st);
+
+	for (int lane = 0; lane < N; ++lane) {
+		for (size_t i = 0; i < HASH_SIZE / 8; ++i) {
+			memcpy(md + lane * HASH_SIZE + i * 8, st + i * N + lane, 8);
+		}
+	}
+}
+
+void keccak_batch(const uint8_t* in, int inlen, uint8_t* md, size_t count)
+{
+	const int lanes = keccak_batch_lanes();
+	size_t i = 0;
+
+#ifdef KECCAK_X64
+	if (lanes >= 8) {
+		for (; i + 8 <= count; i += 8) {
+			keccak_lanes<8>(keccakf_avx512, in + i * inlen, inlen, md + i * HASH_SIZE);
+		}
+	}
+	if (lanes >= 4) {
+		for (; i + 4 <= count; i += 4) {
+			keccak_lanes<4>(keccakf_avx2, in + i * inlen, inlen, md + i * HASH_SIZE);
+		}
+	}
+#endif
+
+#ifdef KECCAK_NEON
+	if (lanes >= 2) {
+		for (; i + 2 <= count; i += 2) {
+			keccak_lanes<2>(keccakf_neon, in + i * inlen, inlen, md + i * HASH_SIZE);
+		}
+	}
+#endif
+
+	(void)lanes;
+
+	for (; i < count; ++i) {
+		keccak(in + i * inlen, inlen, md + i * HASH_SIZE, HASH_SIZE);
+	}
+}
+
 } // namespace p2pool
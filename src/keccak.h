@@ -28,6 +28,21 @@ void keccakf(uint64_t* st);
 void keccak(const uint8_t *in, int inlen, uint8_t *md, int mdlen);
 void keccak(const uint8_t* in, int inlen, uint8_t (&md)[200]);
 
+// Incremental hashing with 32-byte output: keccak_step() absorbs all full blocks and advances in/inlen,
+// keccak_finish() absorbs the rest and produces the same hash as keccak(in, inlen, md, HASH_SIZE)
+void keccak_step(const uint8_t*& in, int& inlen, uint64_t (&st)[25]);
+void keccak_finish(const uint8_t* in, int inlen, uint64_t (&st)[25], uint8_t* md);
+
+// Hashes "count" inputs of "inlen" bytes each (input i starts at in + i * inlen) into 32-byte digests at md + i * HASH_SIZE
+// Uses multi-lane AVX-512/AVX2/NEON kernels when the CPU supports them. md can be equal to in if inlen >= HASH_SIZE (in-place merkle tree levels)
+void keccak_batch(const uint8_t* in, int inlen, uint8_t* md, size_t count);
+
+// Number of inputs keccak_batch() hashes in parallel: 8 (AVX-512), 4 (AVX2), 2 (NEON) or 1
+int keccak_batch_lanes();
+
+// Forces keccak_batch() to use the given number of lanes (0 = autodetect), returns false if this CPU doesn't support it
+bool keccak_batch_set_lanes(int lanes);
+
 template<typename T>
 FORCEINLINE void keccak_custom(T&& in, int inlen, uint8_t* md, int mdlen)
 {
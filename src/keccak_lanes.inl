@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Multi-lane keccak-f[1600], included from keccak.cpp once per instruction set
+// State is interleaved: st[i * KECCAK_LANES + lane] is the i-th state word of the given lane
+//
+// The includer defines:
+// KECCAK_LANES_FUNC, KECCAK_LANES_TARGET, KECCAK_LANES, KECCAK_LANES_TYPE
+// KECCAK_LOAD(p), KECCAK_STORE(p, x), KECCAK_XOR(a, b), KECCAK_ANDN(a, b) = ~a & b, KECCAK_ROTL(x, n), KECCAK_SET1(x)
+
+KECCAK_LANES_TARGET static void KECCAK_LANES_FUNC(uint64_t* st)
+{
+	KECCAK_LANES_TYPE s[25];
+
+	for (int i = 0; i < 25; ++i) {
+		s[i] = KECCAK_LOAD(st + i * KECCAK_LANES);
+	}
+
+	for (int round = 0; round < KeccakParams::ROUNDS; ++round) {
+		KECCAK_LANES_TYPE bc[5];
+
+		// Theta
+		for (int i = 0; i < 5; ++i) {
+			bc[i] = KECCAK_XOR(KECCAK_XOR(KECCAK_XOR(s[i], s[i + 5]), KECCAK_XOR(s[i + 10], s[i + 15])), s[i + 20]);
+		}
+
+		for (int i = 0; i < 5; ++i) {
+			const KECCAK_LANES_TYPE t = KECCAK_XOR(bc[(i + 4) % 5], KECCAK_ROTL(bc[(i + 1) % 5], 1));
+			s[i +  0] = KECCAK_XOR(s[i +  0], t);
+			s[i +  5] = KECCAK_XOR(s[i +  5], t);
+			s[i + 10] = KECCAK_XOR(s[i + 10], t);
+			s[i + 15] = KECCAK_XOR(s[i + 15], t);
+			s[i + 20] = KECCAK_XOR(s[i + 20], t);
+		}
+
+		// Rho Pi
+		const KECCAK_LANES_TYPE t = s[1];
+		s[ 1] = KECCAK_ROTL(s[ 6], 44);
+		s[ 6] = KECCAK_ROTL(s[ 9], 20);
+		s[ 9] = KECCAK_ROTL(s[22], 61);
+		s[22] = KECCAK_ROTL(s[14], 39);
+		s[14] = KECCAK_ROTL(s[20], 18);
+		s[20] = KECCAK_ROTL(s[ 2], 62);
+		s[ 2] = KECCAK_ROTL(s[12], 43);
+		s[12] = KECCAK_ROTL(s[13], 25);
+		s[13] = KECCAK_ROTL(s[19],  8);
+		s[19] = KECCAK_ROTL(s[23], 56);
+		s[23] = KECCAK_ROTL(s[15], 41);
+		s[15] = KECCAK_ROTL(s[ 4], 27);
+		s[ 4] = KECCAK_ROTL(s[24], 14);
+		s[24] = KECCAK_ROTL(s[21],  2);
+		s[21] = KECCAK_ROTL(s[ 8], 55);
+		s[ 8] = KECCAK_ROTL(s[16], 45);
+		s[16] = KECCAK_ROTL(s[ 5], 36);
+		s[ 5] = KECCAK_ROTL(s[ 3], 28);
+		s[ 3] = KECCAK_ROTL(s[18], 21);
+		s[18] = KECCAK_ROTL(s[17], 15);
+		s[17] = KECCAK_ROTL(s[11], 10);
+		s[11] = KECCAK_ROTL(s[ 7],  6);
+		s[ 7] = KECCAK_ROTL(s[10],  3);
+		s[10] = KECCAK_ROTL(t, 1);
+
+		// Chi
+		for (int j = 0; j < 25; j += 5) {
+			const KECCAK_LANES_TYPE s0 = s[j    ];
+			const KECCAK_LANES_TYPE s1 = s[j + 1];
+			const KECCAK_LANES_TYPE s2 = s[j + 2];
+			const KECCAK_LANES_TYPE s3 = s[j + 3];
+			const KECCAK_LANES_TYPE s4 = s[j + 4];
+			s[j    ] = KECCAK_XOR(s0, KECCAK_ANDN(s1, s2));
+			s[j + 1] = KECCAK_XOR(s1, KECCAK_ANDN(s2, s3));
+			s[j + 2] = KECCAK_XOR(s2, KECCAK_ANDN(s3, s4));
+			s[j + 3] = KECCAK_XOR(s3, KECCAK_ANDN(s4, s0));
+			s[j + 4] = KECCAK_XOR(s4, KECCAK_ANDN(s0, s1));
+		}
+
+		// Iota
+		s[0] = KECCAK_XOR(s[0], KECCAK_SET1(keccakf_rndc[round]));
+	}
+
+	for (int i = 0; i < 25; ++i) {
+		KECCAK_STORE(st + i * KECCAK_LANES, s[i]);
+	}
+}
+
+#undef KECCAK_LANES_FUNC
+#undef KECCAK_LANES_TARGET
+#undef KECCAK_LANES
+#undef KECCAK_LANES_TYPE
+#undef KECCAK_LOAD
+#undef KECCAK_STORE
+#undef KECCAK_XOR
+#undef KECCAK_ANDN
+#undef KECCAK_ROTL
+#undef KECCAK_SET1
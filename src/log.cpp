@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "uv_util.h"
+#include "log_ring.h"
 #include <ctime>
 #include <fstream>
 #include <thread>
@@ -42,30 +43,32 @@ static const HANDLE hStdOut = GetStdHandle(STD_OUTPUT_HANDLE);
 static const HANDLE hStdErr = GetStdHandle(STD_ERROR_HANDLE);
 #endif
 
+// Every thread which logs gets its own ring
+typedef LogRing<1 << 20> Ring;
+
+static thread_local Ring* thread_ring = nullptr;
+static thread_local bool thread_ring_released = false;
+
+// Deferred records go here when the ring is full, they're formatted on the calling thread then
+static thread_local std::vector<uint8_t> thread_fallback_buf;
+
 class Worker
 {
 public:
-	enum params : int
-	{
-		SLOT_SIZE = 1024,
-		BUF_SIZE = SLOT_SIZE * 8192,
-	};
-
 	FORCEINLINE Worker()
-		: m_writePos(0)
-		, m_readPos(0)
+		: m_stopWorker(false)
+		, m_sleeping(false)
 	{
 		set_main_thread();
 
 		m_logFile.open(log_file_name, std::ios::app | std::ios::binary);
 
-		m_buf.resize(BUF_SIZE);
-
 		// Create default loop here
 		uv_default_loop();
 
 		uv_cond_init(&m_cond);
 		uv_mutex_init(&m_mutex);
+		uv_mutex_init(&m_ringsLock);
 
 		const int err = uv_thread_create(&m_worker, run_wrapper, this);
 		if (err) {
@@ -110,114 +113,179 @@ public:
 		}
 
 		LOGINFO(0, "stopped");
+
+		// Everything logged before this point will be written
+		m_stopWorker.store(true);
+		wake_up();
 		uv_thread_join(&m_worker);
 		uv_cond_destroy(&m_cond);
 		uv_mutex_destroy(&m_mutex);
 		uv_loop_close(uv_default_loop());
 
 		m_logFile.close();
+
+		// Rings are not deleted here because other threads can still be logging while the process exits
 	}
 
-	FORCEINLINE void write(const char* buf, uint32_t size)
+	FORCEINLINE void write(Severity severity, uint64_t timestamp, const char* buf, uint32_t size)
 	{
-		if (m_writePos.load() - m_readPos > BUF_SIZE - SLOT_SIZE * 16) {
+		Ring* ring = get_ring();
+
+		if (!ring || !ring->write(severity, timestamp, buf, size)) {
 			// Buffer is full, can't log normally
-			if (size > 3) {
-				fwrite(buf + 3, 1, size - 3, stderr);
-			}
+			fwrite(buf, 1, size, stderr);
+			return;
+		}
+
+		notify();
+	}
+
+	FORCEINLINE uint8_t* deferred_begin(uint32_t size)
+	{
+		Ring* ring = get_ring();
+
+		char* p = (ring && (size <= std::numeric_limits<uint16_t>::max())) ? ring->reserve(size) : nullptr;
+		if (p) {
+			return reinterpret_cast<uint8_t*>(p);
+		}
+
+		thread_fallback_buf.resize(size);
+		return thread_fallback_buf.data();
+	}
+
+	FORCEINLINE void deferred_end(Severity severity, uint8_t* data, uint32_t size)
+	{
+		if (data == thread_fallback_buf.data()) {
+			// Buffer is full, can't log normally
+			char buf[Stream::BUF_SIZE + 1];
+			Stream s(buf);
+			format_deferred(data, severity, s);
+			fwrite(buf, 1, s.m_pos, stderr);
 			return;
 		}
 
-		const uint32_t writePos = m_writePos.fetch_add(SLOT_SIZE);
-		char* p = m_buf.data() + (writePos % BUF_SIZE);
+		const uint64_t timestamp = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+		thread_ring->commit(severity, timestamp, size, true);
 
-		memcpy(p + 1, buf + 1, size - 1);
+		notify();
+	}
 
-		// Ensure memory order in the writer thread
+private:
+	// Marks the ring abandoned when its thread exits
+	struct RingOwner
+	{
+		~RingOwner()
+		{
+			// The main thread can still log after its thread_local objects are destroyed, its ring is never released
+			if (thread_ring && !is_main_thread()) {
+				thread_ring->m_abandoned.store(true);
+				thread_ring = nullptr;
+				thread_ring_released = true;
+			}
+		}
+	};
+
+	FORCEINLINE Ring* get_ring()
+	{
+		Ring* ring = thread_ring;
+		if (!ring && !thread_ring_released) {
+			ring = register_thread();
+		}
+		return ring;
+	}
+
+	FORCEINLINE void notify()
+	{
+		// Pairs with the fence in run(): either the logger thread sees the new record, or we see that it's sleeping
 		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeping.load(std::memory_order_relaxed)) {
+			wake_up();
+		}
+	}
 
-		// Mark that everything is written into this log slot
-		p[0] = buf[0] + 1;
+	NOINLINE Ring* register_thread()
+	{
+		static thread_local RingOwner owner;
+		(void)owner;
+
+		Ring* ring = new Ring();
+		{
+			uv_mutex_lock(&m_ringsLock);
+			m_rings.push_back(ring);
+			uv_mutex_unlock(&m_ringsLock);
+		}
+
+		thread_ring = ring;
+		return ring;
+	}
 
-		// Signal the worker thread
+	FORCEINLINE void wake_up()
+	{
+		uv_mutex_lock(&m_mutex);
 		uv_cond_signal(&m_cond);
+		uv_mutex_unlock(&m_mutex);
 	}
 
-private:
 	static void run_wrapper(void* arg) { reinterpret_cast<Worker*>(arg)->run(); }
 
 	NOINLINE void run()
 	{
 		worker_started = true;
 
+		std::vector<Ring*> rings;
+		std::vector<uint32_t> ends;
+
+		bool done;
 		do {
-			uv_mutex_lock(&m_mutex);
-			if (m_readPos == m_writePos.load()) {
-				// Nothing to do, wait for the signal
-				uv_cond_wait(&m_cond, &m_mutex);
+			done = m_stopWorker.load();
+
+			{
+				uv_mutex_lock(&m_ringsLock);
+				rings = m_rings;
+				uv_mutex_unlock(&m_ringsLock);
 			}
-			uv_mutex_unlock(&m_mutex);
-
-			for (uint32_t writePos = m_writePos.load(); m_readPos != writePos; writePos = m_writePos.load()) {
-				// We have at least one log slot pending, possibly more than one
-				// Process everything in a loop before reading m_writePos again
-				do {
-					char* p = m_buf.data() + (m_readPos % BUF_SIZE);
-
-					// Wait until everything is written into this log slot
-					volatile char& severity = p[0];
-					while (!severity) {
-						std::this_thread::yield();
-					}
 
-					// Ensure memory order in the reader thread
-					std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!done && !has_pending(rings)) {
+				uv_mutex_lock(&m_mutex);
+				m_sleeping.store(true, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
 
-					uint32_t size = static_cast<uint8_t>(p[2]);
-					size = (size << 8) + static_cast<uint8_t>(p[1]);
+				// Nothing to do, wait for the signal. The timeout is only a safety net
+				if (!has_pending(rings)) {
+					uv_cond_timedwait(&m_cond, &m_mutex, 100000000ULL);
+				}
 
-					if (size > 3) {
-						p += 3;
-						size -= 3;
+				m_sleeping.store(false, std::memory_order_relaxed);
+				uv_mutex_unlock(&m_mutex);
 
-						// Read CONSOLE_COLORS only once because its value can be changed in another thread
-						const bool c = CONSOLE_COLORS;
+				// New threads could have registered while we were sleeping
+				continue;
+			}
 
-						if (!c) {
-							strip_colors(p, size);
-						}
+			ends.resize(rings.size());
+			for (size_t i = 0, n = rings.size(); i < n; ++i) {
+				ends[i] = rings[i]->m_writePos.load(std::memory_order_acquire);
+			}
 
-#ifdef _WIN32
-						DWORD k;
-						WriteConsole((severity == 1) ? hStdOut : hStdErr, p, size, &k, nullptr);
-#else
-						fwrite(p, 1, size, (severity == 1) ? stdout : stderr);
-#endif
+			// Merge records from all rings in timestamp order
+			for (;;) {
+				Ring* ring = nullptr;
+				const Ring::Record* record = nullptr;
 
-						if (m_logFile.is_open()) {
-							if (c) {
-								strip_colors(p, size);
-							}
-
-							if (severity == 1) {
-								m_logFile.write("NOTICE  ", 8);
-							}
-							else if (severity == 2) {
-								m_logFile.write("WARNING ", 8);
-							}
-							else if (severity == 3) {
-								m_logFile.write("ERROR   ", 8);
-							}
-
-							m_logFile.write(p, size);
-						}
+				for (size_t i = 0, n = rings.size(); i < n; ++i) {
+					const Ring::Record* r = rings[i]->peek(ends[i]);
+					if (r && (!record || (r->m_timestamp < record->m_timestamp))) {
+						ring = rings[i];
+						record = r;
 					}
+				}
 
-					// Mark this log slot empty
-					severity = '\0';
+				if (!record) {
+					break;
+				}
 
-					m_readPos += SLOT_SIZE;
-				} while (m_readPos < writePos);
+				output(record);
+				ring->pop(record);
 			}
 
 			// Flush the log file only after all pending log lines have been written
@@ -231,7 +299,93 @@ private:
 					m_logFile.open(log_file_name, std::ios::app | std::ios::binary);
 				}
 			}
-		} while (!stopped);
+
+			delete_abandoned_rings();
+		} while (!done);
+	}
+
+	static bool has_pending(const std::vector<Ring*>& rings)
+	{
+		for (const Ring* ring : rings) {
+			if (ring->m_readPos.load(std::memory_order_relaxed) != ring->m_writePos.load(std::memory_order_acquire)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void delete_abandoned_rings()
+	{
+		uv_mutex_lock(&m_ringsLock);
+
+		auto it = std::remove_if(m_rings.begin(), m_rings.end(),
+			[](Ring* ring)
+			{
+				if (ring->m_abandoned.load() && (ring->m_readPos.load(std::memory_order_relaxed) == ring->m_writePos.load(std::memory_order_acquire))) {
+					delete ring;
+					return true;
+				}
+				return false;
+			});
+
+		m_rings.erase(it, m_rings.end());
+
+		uv_mutex_unlock(&m_ringsLock);
+	}
+
+	NOINLINE void output(const Ring::Record* record)
+	{
+		const uint32_t severity = record->m_severity;
+
+		char buf[Stream::BUF_SIZE + 64];
+		Stream s(buf);
+
+		s << Cyan();
+		s.writeTimestamp(record->m_timestamp);
+		s << NoColor() << ' ';
+
+		const char* data = reinterpret_cast<const char*>(record) + Ring::HEADER_SIZE;
+		if (record->m_deferred) {
+			format_deferred(reinterpret_cast<const uint8_t*>(data), static_cast<Severity>(severity), s);
+		}
+		else {
+			s.writeBuf(data, record->m_size);
+		}
+
+		char* p = buf;
+		uint32_t size = static_cast<uint32_t>(s.m_pos);
+
+		// Read CONSOLE_COLORS only once because its value can be changed in another thread
+		const bool c = CONSOLE_COLORS;
+
+		if (!c) {
+			strip_colors(p, size);
+		}
+
+#ifdef _WIN32
+		DWORD k;
+		WriteConsole((severity == 0) ? hStdOut : hStdErr, p, size, &k, nullptr);
+#else
+		fwrite(p, 1, size, (severity == 0) ? stdout : stderr);
+#endif
+
+		if (m_logFile.is_open()) {
+			if (c) {
+				strip_colors(p, size);
+			}
+
+			if (severity == 0) {
+				m_logFile.write("NOTICE  ", 8);
+			}
+			else if (severity == 1) {
+				m_logFile.write("WARNING ", 8);
+			}
+			else if (severity == 2) {
+				m_logFile.write("ERROR   ", 8);
+			}
+
+			m_logFile.write(p, size);
+		}
 	}
 
 	static FORCEINLINE void strip_colors(char* buf, uint32_t& size)
@@ -261,14 +415,16 @@ private:
 		size = static_cast<uint32_t>(p_write - buf);
 	}
 
-	std::vector<char> m_buf;
-	std::atomic<uint32_t> m_writePos;
-	uint32_t m_readPos;
+	std::atomic<bool> m_stopWorker;
+	std::atomic<bool> m_sleeping;
 
 	uv_cond_t m_cond;
 	uv_mutex_t m_mutex;
 	uv_thread_t m_worker;
 
+	uv_mutex_t m_ringsLock;
+	std::vector<Ring*> m_rings;
+
 	std::ofstream m_logFile;
 };
 
@@ -276,27 +432,70 @@ static Worker worker;
 
 #endif // P2POOL_LOG_DISABLE
 
-NOINLINE Writer::Writer(Severity severity) : Stream(m_stackBuf)
+NOINLINE Writer::Writer(Severity severity)
+	: Stream(m_stackBuf)
+	, m_severity(severity)
+	, m_timestamp(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count()))
 {
-	m_buf[0] = static_cast<char>(severity);
-	m_pos = 3;
-
-	*this << Cyan();
-	writeCurrentTime();
-	*this << NoColor() << ' ';
 }
 
 NOINLINE Writer::~Writer()
 {
-	const uint32_t size = static_cast<uint32_t>(m_pos + 1);
-	m_buf[1] = static_cast<uint8_t>(size & 255);
-	m_buf[2] = static_cast<uint8_t>(size >> 8);
 	m_buf[m_pos] = '\n';
 #ifndef P2POOL_LOG_DISABLE
-	worker.write(m_buf, size);
+	worker.write(m_severity, m_timestamp, m_buf, static_cast<uint32_t>(m_pos + 1));
 #endif
 }
 
+#ifndef P2POOL_LOG_DISABLE
+
+uint8_t* deferred_begin(uint32_t size)
+{
+	return worker.deferred_begin(size);
+}
+
+void deferred_end(Severity severity, uint8_t* data, uint32_t size)
+{
+	worker.deferred_end(severity, data, size);
+}
+
+#endif
+
+NOINLINE void format_deferred(const uint8_t* data, Severity severity, Stream& s)
+{
+	const DeferredFormat* fmt;
+	memcpy(&fmt, data, sizeof(fmt));
+	data += sizeof(fmt);
+
+	s << Gray() << fmt->m_prefix;
+
+	switch (severity) {
+	case Severity::Info:    s << NoColor(); break;
+	case Severity::Warning: s << Yellow();  break;
+	case Severity::Error:   s << Red();     break;
+	}
+
+	const char* p = fmt->m_fmt;
+	for (const char* q = p; *q; ++q) {
+		if ((q[0] == '{') && (q[1] == '}')) {
+			s.writeBuf(p, q - p);
+
+			DeferredPut put;
+			memcpy(&put, data, sizeof(put));
+			data = put(data + sizeof(put), &s);
+
+			++q;
+			p = q + 1;
+		}
+	}
+	s.writeBuf(p, strlen(p));
+
+	s << NoColor();
+
+	// Streams always have space for one more byte, same as in Writer
+	s.m_buf[s.m_pos++] = '\n';
+}
+
 void reopen()
 {
 	// This will trigger the worker thread which will then reopen log file if it's been moved
@@ -310,12 +509,9 @@ void stop()
 #endif
 }
 
-NOINLINE void Stream::writeCurrentTime()
+NOINLINE void Stream::writeTimestamp(uint64_t timestamp_us)
 {
-	using namespace std::chrono;
-
-	const system_clock::time_point now = system_clock::now();
-	const time_t t0 = system_clock::to_time_t(now);
+	const time_t t0 = static_cast<time_t>(timestamp_us / 1000000);
 
 	tm t;
 
@@ -328,7 +524,7 @@ NOINLINE void Stream::writeCurrentTime()
 	m_numberWidth = 2;
 	*this << (t.tm_year + 1900) << '-' << (t.tm_mon + 1) << '-' << t.tm_mday << ' ' << t.tm_hour << ':' << t.tm_min << ':' << t.tm_sec << '.';
 
-	const int32_t mcs = time_point_cast<microseconds>(now).time_since_epoch().count() % 1000000;
+	const int32_t mcs = static_cast<int32_t>(timestamp_us % 1000000);
 
 	m_numberWidth = 4;
 	*this << (mcs / 100);
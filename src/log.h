@@ -103,7 +103,7 @@ struct Stream
 	FORCEINLINE int getNumberWidth() const { return m_numberWidth; }
 	FORCEINLINE void setNumberWidth(int width) { m_numberWidth = width; }
 
-	NOINLINE void writeCurrentTime();
+	NOINLINE void writeTimestamp(uint64_t timestamp_us);
 
 	int m_pos;
 	int m_numberWidth;
@@ -111,11 +111,16 @@ struct Stream
 	int m_bufSize;
 };
 
+// Only the message text is formatted on the calling thread, the timestamp and severity
+// formatting, color stripping and file I/O are done by the logger thread
+// LOG*_FMT() don't format anything on the calling thread, see LOG_FMT()
 struct Writer : public Stream
 {
 	explicit NOINLINE Writer(Severity severity);
 	NOINLINE ~Writer();
 
+	Severity m_severity;
+	uint64_t m_timestamp;
 	char m_stackBuf[BUF_SIZE + 1];
 };
 
@@ -458,6 +463,154 @@ template<> struct log::Stream::Entry<raw_ip>
 	static FORCEINLINE void put(const raw_ip& value, Stream* wrapper) { put_rawip(value, wrapper); }
 };
 
+// Deferred logging: LOGINFO_FMT() and friends store a pointer to the format and raw copies of the arguments,
+// everything is formatted later by the logger thread. Each argument is stored as its formatting function followed by its data.
+struct DeferredFormat
+{
+	const char* m_prefix;
+	const char* m_fmt;
+};
+
+typedef const uint8_t* (*DeferredPut)(const uint8_t* data, Stream* wrapper);
+
+constexpr size_t DEFERRED_ALIGN = 8;
+constexpr size_t deferred_align(size_t n) { return (n + DEFERRED_ALIGN - 1) & ~(DEFERRED_ALIGN - 1); }
+
+// Values are copied as is, so only types without pointers to other data can be used here
+template<typename T>
+struct DeferredArg
+{
+	static_assert(std::is_trivially_copyable<T>::value && !std::is_pointer<T>::value, "This type can't be logged with deferred formatting");
+	static_assert(alignof(T) <= DEFERRED_ALIGN, "Type alignment is too big");
+
+	static FORCEINLINE size_t size(const T&) { return deferred_align(sizeof(T)); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const T& value) { memcpy(p, &value, sizeof(T)); return p + deferred_align(sizeof(T)); }
+
+	static NOINLINE const uint8_t* put(const uint8_t* p, Stream* wrapper)
+	{
+		*wrapper << T(*reinterpret_cast<const T*>(p));
+		return p + deferred_align(sizeof(T));
+	}
+};
+
+// Strings are copied: data size (4 bytes), then the data itself
+struct DeferredBuf
+{
+	static FORCEINLINE size_t size(size_t n) { return deferred_align(sizeof(uint32_t) + std::min<size_t>(n, Stream::BUF_SIZE)); }
+
+	static FORCEINLINE uint8_t* write(uint8_t* p, const void* data, size_t n)
+	{
+		const uint32_t k = static_cast<uint32_t>(std::min<size_t>(n, Stream::BUF_SIZE));
+		memcpy(p, &k, sizeof(k));
+		memcpy(p + sizeof(k), data, k);
+		return p + deferred_align(sizeof(k) + k);
+	}
+
+	static NOINLINE const uint8_t* put(const uint8_t* p, Stream* wrapper)
+	{
+		uint32_t k;
+		memcpy(&k, p, sizeof(k));
+		wrapper->writeBuf(reinterpret_cast<const char*>(p + sizeof(k)), k);
+		return p + deferred_align(sizeof(k) + k);
+	}
+};
+
+struct DeferredStr : DeferredBuf
+{
+	static FORCEINLINE size_t size(const char* s) { return DeferredBuf::size(strlen(s)); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const char* s) { return DeferredBuf::write(p, s, strlen(s)); }
+};
+
+template<> struct DeferredArg<const char*> : DeferredStr {};
+template<> struct DeferredArg<char*> : DeferredStr {};
+
+// Char arrays are often buffers which are not filled completely, so only the part before the first null is copied
+template<size_t N> struct DeferredArg<char[N]> : DeferredBuf
+{
+	static FORCEINLINE size_t length(const char (&s)[N]) { const void* end = memchr(s, 0, N); return end ? (static_cast<const char*>(end) - s) : N; }
+
+	static FORCEINLINE size_t size(const char (&s)[N]) { return DeferredBuf::size(length(s)); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const char (&s)[N]) { return DeferredBuf::write(p, s, length(s)); }
+};
+
+template<> struct DeferredArg<std::string> : DeferredBuf
+{
+	static FORCEINLINE size_t size(const std::string& s) { return DeferredBuf::size(s.length()); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const std::string& s) { return DeferredBuf::write(p, s.data(), s.length()); }
+};
+
+template<> struct DeferredArg<const_buf> : DeferredBuf
+{
+	static FORCEINLINE size_t size(const const_buf& b) { return DeferredBuf::size(b.m_size); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const const_buf& b) { return DeferredBuf::write(p, b.m_data, b.m_size); }
+};
+
+template<> struct DeferredArg<hex_buf>
+{
+	static FORCEINLINE size_t size(const hex_buf& b) { return DeferredBuf::size(b.m_size); }
+	static FORCEINLINE uint8_t* write(uint8_t* p, const hex_buf& b) { return DeferredBuf::write(p, b.m_data, b.m_size); }
+
+	static NOINLINE const uint8_t* put(const uint8_t* p, Stream* wrapper)
+	{
+		uint32_t k;
+		memcpy(&k, p, sizeof(k));
+		*wrapper << hex_buf(p + sizeof(k), k);
+		return p + deferred_align(sizeof(k) + k);
+	}
+};
+
+FORCEINLINE size_t deferred_size() { return 0; }
+
+template<typename T, typename... Args>
+FORCEINLINE size_t deferred_size(const T& value, const Args&... args)
+{
+	return sizeof(DeferredPut) + DeferredArg<T>::size(value) + deferred_size(args...);
+}
+
+FORCEINLINE uint8_t* deferred_write(uint8_t* p) { return p; }
+
+template<typename T, typename... Args>
+FORCEINLINE uint8_t* deferred_write(uint8_t* p, const T& value, const Args&... args)
+{
+	const DeferredPut put = &DeferredArg<T>::put;
+	memcpy(p, &put, sizeof(put));
+	p = DeferredArg<T>::write(p + sizeof(put), value);
+	return deferred_write(p, args...);
+}
+
+// Writes the whole log line (without timestamp) for the data written by deferred_write()
+void format_deferred(const uint8_t* data, Severity severity, Stream& s);
+
+uint8_t* deferred_begin(uint32_t size);
+void deferred_end(Severity severity, uint8_t* data, uint32_t size);
+
+template<typename... Args>
+FORCEINLINE void write_deferred(Severity severity, const DeferredFormat* fmt, const Args&... args)
+{
+	const uint32_t size = static_cast<uint32_t>(sizeof(fmt) + deferred_size(args...));
+
+	uint8_t* data = deferred_begin(size);
+	memcpy(data, &fmt, sizeof(fmt));
+	deferred_write(data + sizeof(fmt), args...);
+
+	deferred_end(severity, data, size);
+}
+
+constexpr size_t num_placeholders(const char* fmt)
+{
+	size_t n = 0;
+	for (; *fmt; ++fmt) {
+		if ((fmt[0] == '{') && (fmt[1] == '}')) {
+			++n;
+			++fmt;
+		}
+	}
+	return n;
+}
+
+// Used only in sizeof(), so it's not defined anywhere
+template<typename... Args> char (&num_args(const Args&...))[sizeof...(Args) + 1];
+
 namespace {
 	template<log::Severity severity> void apply_severity(log::Stream&);
 
@@ -499,12 +652,34 @@ struct DummyStream
 		} \
 	} while (0)
 
+struct DummyArgs
+{
+	template<typename... Args>
+	FORCEINLINE DummyArgs(const Args&...) {}
+};
+
+// Same check for LOG*_FMT() arguments, it also checks that the format has a "{}" for every argument
+#define SIDE_EFFECT_CHECK_FMT(level, fmt, ...) \
+	do { \
+		static_assert(log::num_placeholders(fmt) == sizeof(log::num_args(__VA_ARGS__)) - 1, "Number of {} in the format doesn't match the number of arguments"); \
+		if (0) { \
+			MSVC_PRAGMA(warning(suppress:26444)) \
+			[=]() { \
+				log::DummyArgs x(level, __VA_ARGS__); \
+			}; \
+		} \
+	} while (0)
+
 #ifdef P2POOL_LOG_DISABLE
 
 #define LOGINFO(level, ...) SIDE_EFFECT_CHECK(level, __VA_ARGS__)
 #define LOGWARN(level, ...) SIDE_EFFECT_CHECK(level, __VA_ARGS__)
 #define LOGERR(level, ...) SIDE_EFFECT_CHECK(level, __VA_ARGS__)
 
+#define LOGINFO_FMT(level, fmt, ...) SIDE_EFFECT_CHECK_FMT(level, fmt, __VA_ARGS__)
+#define LOGWARN_FMT(level, fmt, ...) SIDE_EFFECT_CHECK_FMT(level, fmt, __VA_ARGS__)
+#define LOGERR_FMT(level, fmt, ...) SIDE_EFFECT_CHECK_FMT(level, fmt, __VA_ARGS__)
+
 #else
 
 #define LOG(level, severity, ...) \
@@ -522,6 +697,21 @@ struct DummyStream
 #define LOGWARN(level, ...) LOG(level, log::Severity::Warning, __VA_ARGS__)
 #define LOGERR(level, ...)  LOG(level, log::Severity::Error, __VA_ARGS__)
 
+// Only copies the arguments, use it where logging must be cheap: "{}" in the format are replaced with the arguments
+// Arguments can be anything LOG() supports, except types which point to other data (only strings are copied)
+#define LOG_FMT(level, severity, fmt, ...) \
+	do { \
+		SIDE_EFFECT_CHECK_FMT(level, fmt, __VA_ARGS__); \
+		if (level <= log::GLOBAL_LOG_LEVEL) { \
+			static constexpr log::DeferredFormat CONCAT(log_fmt_, __LINE__) = { log_category_prefix, fmt }; \
+			log::write_deferred(severity, &CONCAT(log_fmt_, __LINE__), __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LOGINFO_FMT(level, fmt, ...) LOG_FMT(level, log::Severity::Info, fmt, __VA_ARGS__)
+#define LOGWARN_FMT(level, fmt, ...) LOG_FMT(level, log::Severity::Warning, fmt, __VA_ARGS__)
+#define LOGERR_FMT(level, fmt, ...)  LOG_FMT(level, log::Severity::Error, fmt, __VA_ARGS__)
+
 #endif
 
 void reopen();
@@ -0,0 +1,136 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+
+namespace p2pool {
+
+namespace log {
+
+// Single producer, single consumer ring buffer used by the logger
+// Records never wrap around the end of the buffer, a record with zero size means "skip to the start"
+// A tail too short for a record header is always skipped, nothing is written there
+template<uint32_t BUF_SIZE>
+struct LogRing
+{
+	static_assert((BUF_SIZE & (BUF_SIZE - 1)) == 0, "BUF_SIZE must be a power of 2");
+
+	struct Record
+	{
+		uint64_t m_timestamp;
+		uint16_t m_size;
+		uint8_t m_severity;
+
+		// Data is a DeferredFormat pointer and raw arguments instead of text, see LOG_FMT()
+		uint8_t m_deferred;
+	};
+
+	static constexpr uint32_t RECORD_ALIGN = 8;
+	static constexpr uint32_t HEADER_SIZE = (sizeof(Record) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+
+	// Memory is not initialized here, so rings of threads that barely log don't use much physical memory
+	LogRing() : m_buf(new char[BUF_SIZE]), m_writePos(0), m_readPos(0), m_reservedPos(0), m_abandoned(false) {}
+	~LogRing() { delete[] m_buf; }
+
+	LogRing(const LogRing&) = delete;
+	LogRing& operator=(const LogRing&) = delete;
+
+	// Called only from the owner thread
+	// Returns space for "size" bytes of record data or nullptr if the ring is full, the record is published by commit()
+	FORCEINLINE char* reserve(uint32_t size)
+	{
+		const uint32_t n = (HEADER_SIZE + size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+
+		const uint32_t writePos = m_writePos.load(std::memory_order_relaxed);
+		const uint32_t offset = writePos % BUF_SIZE;
+		const uint32_t padding = ((offset + n > BUF_SIZE) || (BUF_SIZE - offset < HEADER_SIZE)) ? (BUF_SIZE - offset) : 0;
+
+		if (writePos + padding + n - m_readPos.load(std::memory_order_acquire) > BUF_SIZE) {
+			return nullptr;
+		}
+
+		if (padding >= HEADER_SIZE) {
+			reinterpret_cast<Record*>(m_buf + offset)->m_size = 0;
+		}
+
+		m_reservedPos = writePos + padding;
+		return m_buf + (m_reservedPos % BUF_SIZE) + HEADER_SIZE;
+	}
+
+	FORCEINLINE void commit(Severity severity, uint64_t timestamp, uint32_t size, bool deferred)
+	{
+		Record* r = reinterpret_cast<Record*>(m_buf + (m_reservedPos % BUF_SIZE));
+		r->m_timestamp = timestamp;
+		r->m_size = static_cast<uint16_t>(size);
+		r->m_severity = static_cast<uint8_t>(severity);
+		r->m_deferred = deferred ? 1 : 0;
+
+		const uint32_t n = (HEADER_SIZE + size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+		m_writePos.store(m_reservedPos + n, std::memory_order_release);
+	}
+
+	FORCEINLINE bool write(Severity severity, uint64_t timestamp, const char* buf, uint32_t size)
+	{
+		char* p = reserve(size);
+		if (!p) {
+			return false;
+		}
+
+		memcpy(p, buf, size);
+		commit(severity, timestamp, size, false);
+		return true;
+	}
+
+	// Called only from the logger thread, returns nullptr if there is nothing to read before "end"
+	FORCEINLINE const Record* peek(uint32_t end)
+	{
+		while (m_readPos.load(std::memory_order_relaxed) != end) {
+			const uint32_t readPos = m_readPos.load(std::memory_order_relaxed);
+			const uint32_t offset = readPos % BUF_SIZE;
+			if (BUF_SIZE - offset >= HEADER_SIZE) {
+				const Record* r = reinterpret_cast<const Record*>(m_buf + offset);
+				if (r->m_size) {
+					return r;
+				}
+			}
+			m_readPos.store(readPos + (BUF_SIZE - offset), std::memory_order_release);
+		}
+		return nullptr;
+	}
+
+	FORCEINLINE void pop(const Record* r)
+	{
+		const uint32_t n = (HEADER_SIZE + r->m_size + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+		m_readPos.store(m_readPos.load(std::memory_order_relaxed) + n, std::memory_order_release);
+	}
+
+	char* m_buf;
+	std::atomic<uint32_t> m_writePos;
+	std::atomic<uint32_t> m_readPos;
+
+	// Used only by the owner thread between reserve() and commit()
+	uint32_t m_reservedPos;
+
+	// Set when the owner thread exits, the logger thread deletes the ring once it's empty
+	std::atomic<bool> m_abandoned;
+};
+
+} // namespace log
+
+} // namespace p2pool
@@ -20,6 +20,7 @@
 #include "p2pool.h"
 #include "stratum_server.h"
 #include "p2p_server.h"
+#include "json_rpc_request.h"
 #include <curl/curl.h>
 
 void p2pool_usage()
@@ -29,22 +30,33 @@ void p2pool_usage()
 		"--wallet             Wallet address to mine to. Subaddresses and integrated addresses are not supported!\n"
 		"--host               IP address of your Monero node, default is 127.0.0.1\n"
 		"--rpc-port           monerod RPC API port number, default is 18081\n"
+		"--submit-hosts       Comma-separated list of IP:RPC_port of additional Monero nodes, found blocks are submitted to all of them and --host at once\n"
 		"--zmq-port           monerod ZMQ pub port number, default is 18083 (same port as in monerod's \"--zmq-pub\" command line parameter)\n"
 		"--stratum            Comma-separated list of IP:port for stratum server to listen on\n"
 		"--p2p                Comma-separated list of IP:port for p2p server to listen on\n"
 		"--addpeers           Comma-separated list of IP:port of other p2pool nodes to connect to\n"
 		"--light-mode         Don't allocate RandomX dataset, saves 2GB of RAM\n"
+		"--dataset-prefetch   Build the next RandomX epoch's dataset in the background before the seed changes, needs 2.3GB of extra RAM\n"
+		"--numa               Keep a copy of RandomX dataset on each NUMA node and pin miner threads to nodes (Linux only), needs 2GB of RAM per extra node\n"
 		"--loglevel           Verbosity of the log, integer number between 0 and %d\n"
 		"--config             Name of the p2pool config file\n"
 		"--data-api           Path to the p2pool JSON data (use it in tandem with an external web-server)\n"
+		"--http-api           IP:port list to serve the same JSON data over HTTP from memory, with ETags and long polling (GET /pool/stats?wait) and Prometheus metrics at /metrics, can be used with or without --data-api\n"
+		"--trace FILE         Write block propagation spans (receiving, deserializing, adding, broadcasting blocks, updating block templates and stratum jobs) to FILE in Chrome trace-event JSON format\n"
+		"--trace-sample N     Trace only blocks with sidechain id divisible by N (default 4), nodes with the same N trace the same blocks\n"
 		"--local-api          Enable /local/ path in api path for Stratum Server and built-in miner statistics\n"
 		"--stratum-api        An alias for --local-api\n"
-		"--no-cache           Disable p2pool.cache\n"
+		"--no-cache           Disable p2pool.cache.* files\n"
 		"--no-color           Disable colors in console output\n"
 		"--no-randomx         Disable internal RandomX hasher: p2pool will use RPC calls to monerod to check PoW hashes\n"
 		"--out-peers N        Maximum number of outgoing connections for p2p server (any value between 10 and 450)\n"
 		"--in-peers N         Maximum number of incoming connections for p2p server (any value between 10 and 450)\n"
+		"--sync-pipeline N    Maximum number of block requests in flight to each peer when downloading missing blocks (any value between 1 and 64)\n"
 		"--start-mining N     Start built-in miner using N threads (any value between 1 and 64)\n"
+		"--knapsack N         Use near-optimal transaction picking for blocks bigger than median weight, with a time limit of N milliseconds per block template (any value between 1 and 1000)\n"
+		"--stratum-threads N  Run stratum server on N event loop threads sharing the same listen port (any value between 1 and 64, Linux/FreeBSD only)\n"
+		"--stratum-share-rate Raise auto diff for all miners when they submit more than this many shares per second in total, or when share PoW checks can't keep up (any value between 1 and 10000)\n"
+		"--work-lanes P,B,G   Number of worker threads for share PoW checks, incoming blocks and background jobs (default 4,2,1, 0 uses libuv's threadpool, up to 64 each)\n"
 		"--mini               Connect to p2pool-mini sidechain. Note that it will also change default p2p port from %d to %d\n"
 		"--no-autodiff        Disable automatic difficulty adjustment for miners connected to stratum\n"
 		"--rpc-login          Specify username[:password] required for Monero RPC server\n"
@@ -93,6 +105,8 @@ int main(int argc, char* argv[])
 		return result;
 	}
 
+	p2pool::JSONRPCRequest::init_connection_pool();
+
 	try {
 		p2pool::p2pool pool(argc, argv);
 		result = pool.run();
@@ -101,6 +115,8 @@ int main(int argc, char* argv[])
 		result = 1;
 	}
 
+	p2pool::JSONRPCRequest::destroy_connection_pool();
+
 	curl_global_cleanup();
 
 	p2pool::destroy_crypto_cache();
@@ -259,6 +259,21 @@ void* calloc_hook(size_t count, size_t size) noexcept
 	return p;
 }
 
+// The sampling profiler replaces the same hooks, so it's not available together with the leak detector
+static constexpr char log_category_prefix[] = "AllocProfiler ";
+
+namespace alloc_profiler {
+
+const char* const tag_names[static_cast<size_t>(Tag::COUNT)] = { "other", "sidechain", "p2p", "stratum", "crypto_cache", "mempool" };
+
+void start(uint64_t) { LOGWARN(0, "not available when memory leak detector is enabled"); }
+void stop() {}
+void print_status() {}
+void get_tag_stats(TagStats& stats) { stats = {}; }
+Tag set_tag(Tag tag) { return tag; }
+
+} // namespace alloc_profiler
+
 } // p2pool
 
 void memory_tracking_start()
@@ -315,21 +330,410 @@ void memory_tracking_start() {}
 // cppcheck-suppress functionStatic
 void memory_tracking_stop() {}
 
+#include "uv_util.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CALLER_ADDRESS() _ReturnAddress()
+#else
+#include <dlfcn.h>
+#define CALLER_ADDRESS() __builtin_return_address(0)
+#endif
+
+static constexpr char log_category_prefix[] = "AllocProfiler ";
+
 namespace p2pool {
 
-void* malloc_hook(size_t n) noexcept { return malloc(n); }
-void* realloc_hook(void* ptr, size_t size) noexcept { return realloc(ptr, size); }
-void* calloc_hook(size_t count, size_t size) noexcept { return calloc(count, size); }
-void free_hook(void* p) noexcept { free(p); }
+namespace alloc_profiler {
+
+const char* const tag_names[static_cast<size_t>(Tag::COUNT)] = { "other", "sidechain", "p2p", "stratum", "crypto_cache", "mempool" };
+
+// Everything is in fixed size arrays, so recording a sample never allocates memory
+static constexpr uint32_t MAX_SAMPLES = 1 << 16;
+static constexpr uint32_t MAX_SITES = 1 << 12;
+static constexpr uint32_t NUM_BUCKETS = 1 << 16;
+
+struct Sample
+{
+	void* p;
+	uint64_t weight;
+	uint32_t site;
+	uint32_t next;
+};
+
+struct Site
+{
+	void* caller;
+	Tag tag;
+	uint64_t live_bytes;
+	uint64_t total_bytes;
+	uint64_t live_samples;
+};
+
+static std::atomic<bool> sampling{ false };
+static std::atomic<uint64_t> sample_interval{ 0 };
+static uint64_t start_time = 0;
+static uint64_t dropped_samples = 0;
+
+static uv_mutex_t lock;
+
+// Allocations can only be sampled after start(), so it's enough to have the lock ready by the time main() starts
+static struct LockInit
+{
+	LockInit() { uv_mutex_init_checked(&lock); }
+} lock_init;
+
+// Lists of live samples, read without the lock in free_hook() to skip pointers which were never sampled
+static std::atomic<uint32_t> buckets[NUM_BUCKETS];
+
+// Index 0 means "none"
+static Sample samples[MAX_SAMPLES];
+static uint32_t free_samples = 0;
+static uint32_t num_samples_used = 1;
+
+static Site sites[MAX_SITES];
+
+static thread_local Tag current_tag = Tag::OTHER;
+static thread_local uint64_t bytes_since_sample = 0;
+
+FORCEINLINE static uint32_t bucket_index(const void* p)
+{
+	const uint64_t k = reinterpret_cast<uintptr_t>(p) >> 4;
+	return static_cast<uint32_t>((k * 0x9E3779B97F4A7C15ULL) >> 48) & (NUM_BUCKETS - 1);
+}
+
+static Site* find_site(void* caller, Tag tag)
+{
+	const uint64_t k = reinterpret_cast<uintptr_t>(caller) ^ static_cast<uint64_t>(tag);
+	for (uint32_t i = static_cast<uint32_t>((k * 0x9E3779B97F4A7C15ULL) >> 52), n = 0; n < MAX_SITES; i = (i + 1) & (MAX_SITES - 1), ++n) {
+		Site& s = sites[i & (MAX_SITES - 1)];
+		if (!s.caller) {
+			s.caller = caller;
+			s.tag = tag;
+			return &s;
+		}
+		if ((s.caller == caller) && (s.tag == tag)) {
+			return &s;
+		}
+	}
+	return nullptr;
+}
+
+static NOINLINE void record(void* p, uint64_t weight, void* caller)
+{
+	MutexLock lock2(lock);
+
+	if (!sampling.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	uint32_t index = free_samples;
+	if (index) {
+		free_samples = samples[index].next;
+	}
+	else if (num_samples_used < MAX_SAMPLES) {
+		index = num_samples_used++;
+	}
+
+	Site* site = index ? find_site(caller, current_tag) : nullptr;
+	if (!site) {
+		if (index) {
+			samples[index].next = free_samples;
+			free_samples = index;
+		}
+		++dropped_samples;
+		return;
+	}
+
+	site->live_bytes += weight;
+	site->total_bytes += weight;
+	++site->live_samples;
+
+	const uint32_t b = bucket_index(p);
+
+	Sample& s = samples[index];
+	s.p = p;
+	s.weight = weight;
+	s.site = static_cast<uint32_t>(site - sites);
+	s.next = buckets[b].load(std::memory_order_relaxed);
+
+	buckets[b].store(index, std::memory_order_relaxed);
+}
+
+static NOINLINE void remove(void* p)
+{
+	MutexLock lock2(lock);
+
+	const uint32_t b = bucket_index(p);
+
+	for (uint32_t prev = 0, k = buckets[b].load(std::memory_order_relaxed); k != 0; prev = k, k = samples[k].next) {
+		Sample& s = samples[k];
+		if (s.p == p) {
+			Site& site = sites[s.site];
+			site.live_bytes -= s.weight;
+			--site.live_samples;
+
+			if (prev) {
+				samples[prev].next = s.next;
+			}
+			else {
+				buckets[b].store(s.next, std::memory_order_relaxed);
+			}
+
+			s.next = free_samples;
+			free_samples = k;
+			return;
+		}
+	}
+}
+
+FORCEINLINE static void on_alloc(void* p, size_t n, void* caller)
+{
+	if (LIKELY(!sampling.load(std::memory_order_relaxed)) || !p) {
+		return;
+	}
+
+	// Each sample stands for all bytes allocated in this thread since the previous sample
+	const uint64_t k = bytes_since_sample + n;
+	if (k < sample_interval.load(std::memory_order_relaxed)) {
+		bytes_since_sample = k;
+		return;
+	}
+
+	bytes_since_sample = 0;
+	record(p, k, caller);
+}
+
+FORCEINLINE static void on_free(void* p)
+{
+	if (LIKELY(!sampling.load(std::memory_order_relaxed)) || !p) {
+		return;
+	}
+
+	if (buckets[bucket_index(p)].load(std::memory_order_relaxed)) {
+		remove(p);
+	}
+}
+
+static void clear()
+{
+	for (std::atomic<uint32_t>& b : buckets) {
+		b.store(0, std::memory_order_relaxed);
+	}
+	memset(samples, 0, sizeof(samples));
+	memset(sites, 0, sizeof(sites));
+	free_samples = 0;
+	num_samples_used = 1;
+	dropped_samples = 0;
+}
+
+void start(uint64_t sample_bytes)
+{
+	sample_bytes = std::max<uint64_t>(sample_bytes, 1024);
+	{
+		MutexLock lock2(lock);
+
+		if (!sampling.load()) {
+			clear();
+			start_time = seconds_since_epoch();
+		}
+
+		sample_interval = sample_bytes;
+		sampling = true;
+	}
+
+	LOGINFO(0, "started, sampling every " << sample_bytes << " allocated bytes");
+}
+
+void stop()
+{
+	if (!sampling.load()) {
+		return;
+	}
+
+	{
+		MutexLock lock2(lock);
+		sampling = false;
+		clear();
+	}
+
+	LOGINFO(0, "stopped");
+}
+
+void get_tag_stats(TagStats& stats)
+{
+	stats = {};
+
+	MutexLock lock2(lock);
+
+	stats.m_running = sampling.load();
+
+	for (const Site& s : sites) {
+		if (s.caller) {
+			stats.m_liveBytes[static_cast<size_t>(s.tag)] += s.live_bytes;
+			stats.m_totalBytes[static_cast<size_t>(s.tag)] += s.total_bytes;
+		}
+	}
+}
+
+static void print_site(const Site& s, uint64_t elapsed)
+{
+	char buf[64];
+	const char* module = "";
+	uintptr_t offset = reinterpret_cast<uintptr_t>(s.caller);
+
+#ifndef _MSC_VER
+	Dl_info info;
+	if (dladdr(s.caller, &info) && info.dli_fname) {
+		module = info.dli_fname;
+		offset -= reinterpret_cast<uintptr_t>(info.dli_fbase);
+	}
+#endif
+
+	snprintf(buf, sizeof(buf), "0x%llx", static_cast<unsigned long long>(offset));
+
+	LOGINFO(0, log::Gray() << module << '+' << static_cast<const char*>(buf) << log::NoColor()
+		<< ": " << tag_names[static_cast<size_t>(s.tag)]
+		<< ", live " << (s.live_bytes >> 10) << " KB"
+		<< ", allocated " << (s.total_bytes >> 10) << " KB"
+		<< " (" << (s.total_bytes / elapsed >> 10) << " KB/s)");
+}
+
+void print_status()
+{
+	if (!sampling.load()) {
+		LOGINFO(0, "not running, use \"memprof start [bytes]\" to start it");
+		return;
+	}
+
+	std::vector<Site> tmp;
+	tmp.reserve(MAX_SITES);
+
+	uint64_t dropped, elapsed;
+	{
+		MutexLock lock2(lock);
+
+		for (const Site& s : sites) {
+			if (s.caller) {
+				tmp.push_back(s);
+			}
+		}
+
+		dropped = dropped_samples;
+		elapsed = std::max<uint64_t>(seconds_since_epoch() - start_time, 1);
+	}
+
+	TagStats stats;
+	get_tag_stats(stats);
+
+	const size_t num_sites = tmp.size();
+	LOGINFO(0, "status, " << num_sites << " call sites in " << elapsed << " seconds, " << dropped << " samples dropped");
+
+	for (size_t i = 0; i < static_cast<size_t>(Tag::COUNT); ++i) {
+		LOGINFO(0, tag_names[i] << ": live " << (stats.m_liveBytes[i] >> 10) << " KB, allocated " << (stats.m_totalBytes[i] >> 10) << " KB (" << (stats.m_totalBytes[i] / elapsed >> 10) << " KB/s)");
+	}
+
+	std::sort(tmp.begin(), tmp.end(), [](const Site& a, const Site& b) { return a.live_bytes > b.live_bytes; });
+
+	LOGINFO(0, "top call sites by live bytes:");
+	for (size_t i = 0; (i < 10) && (i < num_sites) && tmp[i].live_bytes; ++i) {
+		print_site(tmp[i], elapsed);
+	}
+
+	std::sort(tmp.begin(), tmp.end(), [](const Site& a, const Site& b) { return a.total_bytes > b.total_bytes; });
+
+	LOGINFO(0, "top call sites by allocation rate:");
+	for (size_t i = 0; (i < 10) && (i < num_sites); ++i) {
+		print_site(tmp[i], elapsed);
+	}
+}
+
+Tag set_tag(Tag tag)
+{
+	const Tag prev = current_tag;
+	current_tag = tag;
+	return prev;
+}
+
+} // namespace alloc_profiler
+
+void* malloc_hook(size_t n) noexcept
+{
+	void* p = malloc(n);
+	alloc_profiler::on_alloc(p, n, CALLER_ADDRESS());
+	return p;
+}
+
+void* realloc_hook(void* ptr, size_t size) noexcept
+{
+	void* p = realloc(ptr, size);
+
+	// If realloc() fails, the old block is still allocated and keeps its sample (realloc(ptr, 0) frees it and can return nullptr)
+	if (p || !size) {
+		alloc_profiler::on_free(ptr);
+		alloc_profiler::on_alloc(p, size, CALLER_ADDRESS());
+	}
+	return p;
+}
+
+void* calloc_hook(size_t count, size_t size) noexcept
+{
+	void* p = calloc(count, size);
+	alloc_profiler::on_alloc(p, count * size, CALLER_ADDRESS());
+	return p;
+}
+
+void free_hook(void* p) noexcept
+{
+	alloc_profiler::on_free(p);
+	free(p);
+}
 
 char* strdup_hook(const char* s) noexcept
 {
 #ifdef _MSC_VER
-	return _strdup(s);
+	char* s1 = _strdup(s);
 #else
-	return strdup(s);
+	char* s1 = strdup(s);
 #endif
+	if (s1) {
+		alloc_profiler::on_alloc(s1, strlen(s) + 1, CALLER_ADDRESS());
+	}
+	return s1;
+}
+
+FORCEINLINE static void* allocate(size_t n, void* caller)
+{
+	void* p = malloc(n ? n : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	alloc_profiler::on_alloc(p, n, caller);
+	return p;
+}
+
+FORCEINLINE static void* allocate_nothrow(size_t n, void* caller) noexcept
+{
+	void* p = malloc(n ? n : 1);
+	alloc_profiler::on_alloc(p, n, caller);
+	return p;
 }
 
+FORCEINLINE static void deallocate(void* p) noexcept
+{
+	alloc_profiler::on_free(p);
+	free(p);
 }
+
+} // namespace p2pool
+
+NOINLINE void* operator new(size_t n) { return p2pool::allocate(n, CALLER_ADDRESS()); }
+NOINLINE void* operator new[](size_t n) { return p2pool::allocate(n, CALLER_ADDRESS()); }
+NOINLINE void* operator new(size_t n, const std::nothrow_t&) noexcept { return p2pool::allocate_nothrow(n, CALLER_ADDRESS()); }
+NOINLINE void* operator new[](size_t n, const std::nothrow_t&) noexcept { return p2pool::allocate_nothrow(n, CALLER_ADDRESS()); }
+NOINLINE void operator delete(void* p) noexcept { p2pool::deallocate(p); }
+NOINLINE void operator delete[](void* p) noexcept { p2pool::deallocate(p); }
+NOINLINE void operator delete(void* p, size_t) noexcept { p2pool::deallocate(p); }
+NOINLINE void operator delete[](void* p, size_t) noexcept { p2pool::deallocate(p); }
+
 #endif
@@ -33,12 +33,31 @@ Mempool::~Mempool()
 	uv_rwlock_destroy(&m_lock);
 }
 
-void Mempool::add(const TxMempoolData& tx)
+bool Mempool::FeeRateOrder::operator()(const TxMempoolData& a, const TxMempoolData& b) const
 {
+	// a.fee / a.weight > b.fee / b.weight, without overflow
+	uint64_t a_hi, b_hi;
+	const uint64_t a_lo = umul128(a.fee, b.weight, &a_hi);
+	const uint64_t b_lo = umul128(b.fee, a.weight, &b_hi);
+
+	if (a_hi != b_hi) return a_hi > b_hi;
+	if (a_lo != b_lo) return a_lo > b_lo;
+
+	return a.id < b.id;
+}
+
+void Mempool::add_batch(const std::vector<TxMempoolData>& transactions)
+{
+	AllocationTag tag(alloc_profiler::Tag::MEMPOOL);
 	WriteLock lock(m_lock);
 
-	if (!m_transactions.emplace(tx.id, tx).second) {
-		LOGWARN(1, "duplicate transaction with id = " << tx.id << ", skipped");
+	for (const TxMempoolData& tx : transactions) {
+		if (m_transactions.emplace(tx.id, tx).second) {
+			m_byFeeRate.insert(tx);
+		}
+		else {
+			LOGWARN(1, "duplicate transaction with id = " << tx.id << ", skipped");
+		}
 	}
 }
 
@@ -46,6 +65,7 @@ void Mempool::swap(std::vector<TxMempoolData>& transactions)
 {
 	const uint64_t cur_time = seconds_since_epoch();
 
+	AllocationTag tag(alloc_profiler::Tag::MEMPOOL);
 	WriteLock lock(m_lock);
 
 	// Initialize time_received for all transactions
@@ -60,10 +80,29 @@ void Mempool::swap(std::vector<TxMempoolData>& transactions)
 	}
 
 	m_transactions.clear();
+	m_byFeeRate.clear();
 
 	for (TxMempoolData& data : transactions) {
-		m_transactions.emplace(data.id, data);
+		if (m_transactions.emplace(data.id, data).second) {
+			m_byFeeRate.insert(data);
+		}
 	}
 }
 
+size_t Mempool::get_best_transactions(uint64_t cur_time, uint64_t min_age, size_t max_count, std::vector<TxMempoolData>& result) const
+{
+	result.clear();
+
+	ReadLock lock(m_lock);
+
+	// Transactions which are too new are skipped, there are only as many of them as monerod sent in the last min_age seconds
+	for (auto it = m_byFeeRate.begin(); (it != m_byFeeRate.end()) && (result.size() < max_count); ++it) {
+		if (cur_time >= it->time_received + min_age) {
+			result.push_back(*it);
+		}
+	}
+
+	return m_transactions.size();
+}
+
 } // namespace p2pool
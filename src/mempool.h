@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include <set>
 
 namespace p2pool {
 
@@ -29,12 +30,25 @@ public:
 	Mempool();
 	~Mempool();
 
-	void add(const TxMempoolData& tx);
+	void add_batch(const std::vector<TxMempoolData>& transactions);
 	void swap(std::vector<TxMempoolData>& transactions);
 
+	// Copies up to max_count transactions with the highest fee per byte which were received at least min_age seconds before cur_time
+	// Returns the total number of transactions in the mempool
+	size_t get_best_transactions(uint64_t cur_time, uint64_t min_age, size_t max_count, std::vector<TxMempoolData>& result) const;
+
 public:
 	mutable uv_rwlock_t m_lock;
 	unordered_map<hash, TxMempoolData> m_transactions;
+
+private:
+	struct FeeRateOrder
+	{
+		bool operator()(const TxMempoolData& a, const TxMempoolData& b) const;
+	};
+
+	// Same transactions as m_transactions, highest fee per byte first
+	std::set<TxMempoolData, FeeRateOrder> m_byFeeRate;
 };
 
 } // namespace p2pool
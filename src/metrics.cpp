@@ -0,0 +1,162 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include "crypto.h"
+
+namespace p2pool {
+
+LatencyHistogram::LatencyHistogram(const char* name, const char* help)
+	: m_name(name)
+	, m_help(help)
+	, m_buckets{}
+	, m_sumNs(0)
+{
+}
+
+void LatencyHistogram::add_ns(uint64_t ns)
+{
+	const uint64_t us = ns / 1000;
+	const uint64_t index = us ? std::min<uint64_t>(bsr(us) + 1, NUM_BUCKETS - 1) : 0;
+
+	m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+	m_sumNs.fetch_add(ns, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::render(std::string& out) const
+{
+	char buf[256];
+
+	snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s histogram\n", m_name, m_help, m_name);
+	out += buf;
+
+	// Prometheus buckets are cumulative
+	uint64_t count = 0;
+	for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+		count += m_buckets[i].load(std::memory_order_relaxed);
+		if (i < NUM_BUCKETS - 1) {
+			snprintf(buf, sizeof(buf), "%s_bucket{le=\"%g\"} %llu\n", m_name, static_cast<double>(1ULL << i) * 1e-6, static_cast<unsigned long long>(count));
+		}
+		else {
+			snprintf(buf, sizeof(buf), "%s_bucket{le=\"+Inf\"} %llu\n", m_name, static_cast<unsigned long long>(count));
+		}
+		out += buf;
+	}
+
+	snprintf(buf, sizeof(buf), "%s_sum %.9f\n%s_count %llu\n", m_name, static_cast<double>(m_sumNs.load(std::memory_order_relaxed)) * 1e-9, m_name, static_cast<unsigned long long>(count));
+	out += buf;
+}
+
+void MetricCounter::render(std::string& out) const
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", m_name, m_help, m_name, m_name, static_cast<unsigned long long>(m_value.load(std::memory_order_relaxed)));
+	out += buf;
+}
+
+namespace metrics {
+
+LatencyHistogram block_template_update("p2pool_block_template_update_seconds", "BlockTemplate::update() duration");
+LatencyHistogram stratum_job_broadcast("p2pool_stratum_job_broadcast_seconds", "Time to send a new job to all stratum clients of one event loop");
+LatencyHistogram share_check("p2pool_share_check_seconds", "Time from receiving a stratum share to having its result");
+LatencyHistogram add_external_block("p2pool_add_external_block_seconds", "SideChain::add_external_block() duration");
+LatencyHistogram verify_block("p2pool_verify_block_seconds", "SideChain::verify() duration");
+LatencyHistogram deserialize_block("p2pool_deserialize_block_seconds", "Deserialization time of blocks received from peers");
+LatencyHistogram rpc_request("p2pool_rpc_request_seconds", "Round-trip time of RPC requests to monerod");
+LatencyHistogram submit_block("p2pool_submit_block_seconds", "Time from finding a Monero block to the monerod response to submit_block");
+
+MetricCounter stale_shares("p2pool_stale_shares_total", "Stratum shares submitted for outdated jobs");
+MetricCounter uncles("p2pool_uncles_total", "Uncle blocks referenced by sidechain blocks added to the chain");
+
+std::string render()
+{
+	static const LatencyHistogram* histograms[] = {
+		&block_template_update,
+		&stratum_job_broadcast,
+		&share_check,
+		&add_external_block,
+		&verify_block,
+		&deserialize_block,
+		&rpc_request,
+		&submit_block,
+	};
+
+	static const MetricCounter* counters[] = {
+		&stale_shares,
+		&uncles,
+	};
+
+	std::string out;
+	out.reserve(16384);
+
+	for (const LatencyHistogram* h : histograms) {
+		h->render(out);
+	}
+
+	for (const MetricCounter* c : counters) {
+		c->render(out);
+	}
+
+	const CryptoCacheStats stats = get_crypto_cache_stats();
+
+	const std::pair<const char*, const CryptoCacheStats::Counters*> caches[] = {
+		{ "derivations", &stats.m_derivations },
+		{ "public_keys", &stats.m_publicKeys },
+		{ "tx_keys", &stats.m_txKeys },
+	};
+
+	out += "# HELP p2pool_crypto_cache_hits_total Crypto cache lookups which found the entry\n# TYPE p2pool_crypto_cache_hits_total counter\n";
+	for (const auto& c : caches) {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "p2pool_crypto_cache_hits_total{cache=\"%s\"} %llu\n", c.first, static_cast<unsigned long long>(c.second->m_hits));
+		out += buf;
+	}
+
+	out += "# HELP p2pool_crypto_cache_misses_total Crypto cache lookups which didn't find the entry\n# TYPE p2pool_crypto_cache_misses_total counter\n";
+	for (const auto& c : caches) {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "p2pool_crypto_cache_misses_total{cache=\"%s\"} %llu\n", c.first, static_cast<unsigned long long>(c.second->m_misses));
+		out += buf;
+	}
+
+	alloc_profiler::TagStats alloc_stats;
+	alloc_profiler::get_tag_stats(alloc_stats);
+
+	// Only while the allocation profiler is running ("memprof start" console command)
+	if (alloc_stats.m_running) {
+		out += "# HELP p2pool_alloc_live_bytes Estimated live heap bytes by subsystem (sampled)\n# TYPE p2pool_alloc_live_bytes gauge\n";
+		for (size_t i = 0; i < static_cast<size_t>(alloc_profiler::Tag::COUNT); ++i) {
+			char buf[128];
+			snprintf(buf, sizeof(buf), "p2pool_alloc_live_bytes{tag=\"%s\"} %llu\n", alloc_profiler::tag_names[i], static_cast<unsigned long long>(alloc_stats.m_liveBytes[i]));
+			out += buf;
+		}
+
+		out += "# HELP p2pool_alloc_bytes_total Estimated heap bytes allocated by subsystem since the profiler was started (sampled)\n# TYPE p2pool_alloc_bytes_total counter\n";
+		for (size_t i = 0; i < static_cast<size_t>(alloc_profiler::Tag::COUNT); ++i) {
+			char buf[128];
+			snprintf(buf, sizeof(buf), "p2pool_alloc_bytes_total{tag=\"%s\"} %llu\n", alloc_profiler::tag_names[i], static_cast<unsigned long long>(alloc_stats.m_totalBytes[i]));
+			out += buf;
+		}
+	}
+
+	return out;
+}
+
+} // namespace metrics
+
+} // namespace p2pool
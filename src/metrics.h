@@ -0,0 +1,92 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace p2pool {
+
+// Lock-free latency histogram: bucket i counts durations below 2^i microseconds, the last bucket counts everything else
+class LatencyHistogram : public nocopy_nomove
+{
+public:
+	static constexpr uint32_t NUM_BUCKETS = 27;
+
+	LatencyHistogram(const char* name, const char* help);
+
+	void add_ns(uint64_t ns);
+
+	template<typename T>
+	FORCEINLINE void add(T duration) { add_ns(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count())); }
+
+	void render(std::string& out) const;
+
+private:
+	const char* m_name;
+	const char* m_help;
+
+	std::atomic<uint64_t> m_buckets[NUM_BUCKETS];
+	std::atomic<uint64_t> m_sumNs;
+};
+
+class MetricCounter : public nocopy_nomove
+{
+public:
+	MetricCounter(const char* name, const char* help) : m_name(name), m_help(help), m_value(0) {}
+
+	FORCEINLINE void add(uint64_t n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+
+	void render(std::string& out) const;
+
+private:
+	const char* m_name;
+	const char* m_help;
+
+	std::atomic<uint64_t> m_value;
+};
+
+// Adds the time between construction and destruction to a histogram
+class ScopedLatency : public nocopy_nomove
+{
+public:
+	explicit FORCEINLINE ScopedLatency(LatencyHistogram& histogram) : m_histogram(histogram), m_start(std::chrono::high_resolution_clock::now()) {}
+	FORCEINLINE ~ScopedLatency() { m_histogram.add(std::chrono::high_resolution_clock::now() - m_start); }
+
+private:
+	LatencyHistogram& m_histogram;
+	std::chrono::high_resolution_clock::time_point m_start;
+};
+
+namespace metrics {
+
+extern LatencyHistogram block_template_update;
+extern LatencyHistogram stratum_job_broadcast;
+extern LatencyHistogram share_check;
+extern LatencyHistogram add_external_block;
+extern LatencyHistogram verify_block;
+extern LatencyHistogram deserialize_block;
+extern LatencyHistogram rpc_request;
+extern LatencyHistogram submit_block;
+
+extern MetricCounter stale_shares;
+extern MetricCounter uncles;
+
+// All metrics in Prometheus text format, crypto cache counters included
+std::string render();
+
+} // namespace metrics
+
+} // namespace p2pool
@@ -39,20 +39,28 @@ Miner::Miner(p2pool* pool, uint32_t threads)
 	, m_threads(threads)
 	, m_stopped{ false }
 	, m_startTimestamp(high_resolution_clock::now())
-	, m_nonce(0)
 	, m_nonceTimestamp(m_startTimestamp)
+	, m_statusTimestamp(m_startTimestamp)
 	, m_extraNonce(static_cast<uint32_t>(pool->p2p_server()->get_random64()))
+	, m_jobStartHashes(0)
 	, m_totalHashes(0)
 	, m_sharesFound(0)
 	, m_job{}
-	, m_jobIndex{ 0 }
+	, m_jobNonce{}
+	, m_jobSequence{ 0 }
 {
 	on_block(m_pool->block_template());
 
 	m_minerThreads.reserve(threads);
 
+	// Spread threads over NUMA nodes, each one will use its node's dataset copy
+	const uint32_t num_nodes = m_pool->hasher() ? m_pool->hasher()->num_dataset_replicas() : 1;
+	if (num_nodes > 1) {
+		m_threadsPerNode.resize(num_nodes, 0);
+	}
+
 	for (uint32_t i = 0; i < threads; ++i) {
-		WorkerData* data = new WorkerData{ this, i + 1, threads, {} };
+		WorkerData* data = new WorkerData{ this, i + 1, threads, i % num_nodes, {} };
 		const int err = uv_thread_create(&data->m_worker, run, data);
 		if (err) {
 			LOGERR(1, "failed to start worker thread " << data->m_index << '/' << threads << ", error " << uv_err_name(err));
@@ -60,6 +68,10 @@ Miner::Miner(p2pool* pool, uint32_t threads)
 			continue;
 		}
 		m_minerThreads.push_back(data);
+
+		if (num_nodes > 1) {
+			++m_threadsPerNode[data->m_node];
+		}
 	}
 }
 
@@ -75,29 +87,71 @@ Miner::~Miner()
 
 void Miner::print_status()
 {
-	const uint32_t hash_count = 0 - m_nonce.load();
+	const auto cur_ts = high_resolution_clock::now();
+
+	const uint64_t hash_count = total_hashes() - m_jobStartHashes;
 
-	const double dt = static_cast<double>(duration_cast<nanoseconds>(high_resolution_clock::now() - m_nonceTimestamp).count()) / 1e9;
+	const double dt = static_cast<double>(duration_cast<nanoseconds>(cur_ts - m_nonceTimestamp).count()) / 1e9;
 	const uint64_t hr = (dt > 0.0) ? static_cast<uint64_t>(hash_count / dt) : 0;
 
+	// Per-thread hashrate since the previous status, and how long threads take to pick up a new job
+	const double status_dt = static_cast<double>(duration_cast<nanoseconds>(cur_ts - m_statusTimestamp).count()) / 1e9;
+	m_statusTimestamp = cur_ts;
+
+	std::string thread_hashrates;
+	uint64_t switches = 0, switch_total_ns = 0, switch_max_ns = 0;
+
+	for (WorkerData* data : m_minerThreads) {
+		const uint64_t hashes = data->m_hashes.load();
+		const uint64_t thread_hr = (status_dt > 0.0) ? static_cast<uint64_t>((hashes - data->m_statusHashes) / status_dt) : 0;
+		data->m_statusHashes = hashes;
+
+		thread_hashrates += thread_hashrates.empty() ? "\nThread H/s   = " : ", ";
+		thread_hashrates += std::to_string(thread_hr);
+
+		switches += data->m_jobSwitches.load();
+		switch_total_ns += data->m_jobSwitchTotalNs.load();
+		switch_max_ns = std::max(switch_max_ns, data->m_jobSwitchMaxNs.load());
+	}
+
+	const uint64_t switch_avg_us = switches ? (switch_total_ns / switches / 1000) : 0;
+	const uint64_t switch_max_us = switch_max_ns / 1000;
+
+	std::string placement;
+	for (uint32_t n : m_threadsPerNode) {
+		placement += placement.empty() ? "\nNUMA threads = " : ", ";
+		placement += std::to_string(n);
+	}
+
 	LOGINFO(0, "status" <<
 		"\nThreads      = " << m_threads <<
 		"\nHashrate     = " << log::Hashrate(hr) <<
-		"\nShares found = " << m_sharesFound.load()
+		"\nShares found = " << m_sharesFound.load() <<
+		thread_hashrates <<
+		"\nJob switch   = " << switch_avg_us << " us average, " << switch_max_us << " us max (" << switches << " switches)" <<
+		placement
 	);
 }
 
 void Miner::on_block(const BlockTemplate& block)
 {
-	const uint32_t next_index = m_jobIndex ^ 1;
-	Job& j = m_job[next_index];
+	const uint32_t next_sequence = m_jobSequence.load() + 1;
+	const uint32_t slot = next_sequence % JOB_RING_SIZE;
+
+	Job& j = m_job[slot];
 	hash seed;
 	j.m_blobSize = block.get_hashing_blob(m_extraNonce, j.m_blob, j.m_height, j.m_diff, j.m_sidechainDiff, seed, j.m_nonceOffset, j.m_templateId);
 
-	const uint32_t hash_count = 0 - m_nonce.exchange(0);
-	m_jobIndex = next_index;
-
 	const auto cur_ts = high_resolution_clock::now();
+	j.m_publishTimestamp = duration_cast<nanoseconds>(cur_ts.time_since_epoch()).count();
+
+	m_jobNonce[slot] = 0;
+	m_jobSequence = next_sequence;
+
+	const uint64_t total = total_hashes();
+	const uint64_t hash_count = total - m_jobStartHashes;
+	m_jobStartHashes = total;
+
 	const double dt = static_cast<double>(duration_cast<nanoseconds>(cur_ts - m_nonceTimestamp).count()) / 1e9;
 
 	m_nonceTimestamp = cur_ts;
@@ -141,8 +195,16 @@ void Miner::run(void* data)
 void Miner::run(WorkerData* data)
 {
 	RandomX_Hasher_Base* hasher = m_pool->hasher();
+
+	// Pin the thread before creating the VM so its scratchpad is allocated on the same node
+	if (!m_threadsPerNode.empty()) {
+		if (!set_thread_affinity(numa_nodes()[data->m_node])) {
+			LOGWARN(1, "worker thread " << data->m_index << '/' << data->m_count << ": couldn't pin to NUMA node " << data->m_node);
+		}
+	}
+
 	randomx_cache* cache = hasher->cache();
-	randomx_dataset* dataset = hasher->dataset();
+	randomx_dataset* dataset = hasher->node_dataset(data->m_node);
 
 	if (!cache && !dataset) {
 		LOGERR(1, "worker thread " << data->m_index << '/' << data->m_count << ": RandomX cache and dataset are not ready");
@@ -164,44 +226,71 @@ void Miner::run(WorkerData* data)
 		}
 	}
 
+	// job[index] is being hashed, job[index ^ 1] is the next input, so a new job is picked up without losing a hash
 	uint32_t index = 0;
 	Job job[2];
 
-	uint32_t seed_counter = 0;
-	bool first = true;
+	Job cur_job;
+	uint32_t job_sequence = 0;
+	read_job(job_sequence, cur_job);
 
-	Miner* miner = data->m_miner;
+	uint32_t seed_counter = hasher->seed_counter();
+	hash seed = hasher->current_seed();
+	bool first = true;
 
 	while (!m_stopped) {
 		if (hasher->seed_counter() != seed_counter) {
 			LOGINFO(5, "worker thread " << data->m_index << '/' << data->m_count << " paused (waiting for RandomX cache/dataset update)");
 			hasher->sync_wait();
 			seed_counter = hasher->seed_counter();
-			if (flags & RANDOMX_FLAG_FULL_MEM) {
-				dataset = hasher->dataset();
-				randomx_vm_set_dataset(vm, dataset);
-			}
-			else {
-				cache = hasher->cache();
-				randomx_vm_set_cache(vm, cache);
+
+			// set_seed() is also called when the seed stays the same, the VM keeps its dataset or cache then
+			const hash new_seed = hasher->current_seed();
+			if (new_seed != seed) {
+				seed = new_seed;
+				if (flags & RANDOMX_FLAG_FULL_MEM) {
+					dataset = hasher->node_dataset(data->m_node);
+					randomx_vm_set_dataset(vm, dataset);
+				}
+				else {
+					cache = hasher->cache();
+					randomx_vm_set_cache(vm, cache);
+				}
+
+				// The hash in flight was started with the old seed, its result is useless
+				first = true;
 			}
 			LOGINFO(5, "worker thread " << data->m_index << '/' << data->m_count << " resumed");
 		}
 
+		if (read_job(job_sequence, cur_job)) {
+			const int64_t now = duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count();
+			const uint64_t latency = static_cast<uint64_t>(std::max<int64_t>(now - cur_job.m_publishTimestamp, 0));
+
+			data->m_jobSwitches.fetch_add(1, std::memory_order_relaxed);
+			data->m_jobSwitchTotalNs.fetch_add(latency, std::memory_order_relaxed);
+			if (latency > data->m_jobSwitchMaxNs.load(std::memory_order_relaxed)) {
+				data->m_jobSwitchMaxNs.store(latency, std::memory_order_relaxed);
+			}
+		}
+
+		std::atomic<uint32_t>& nonce = m_jobNonce[job_sequence % JOB_RING_SIZE];
+
 		if (first) {
 			first = false;
-			memcpy(&job[index], &miner->m_job[miner->m_jobIndex], sizeof(Job));
-			job[index].set_nonce(miner->m_nonce.fetch_sub(1), miner->m_extraNonce);
+			memcpy(&job[index], &cur_job, sizeof(Job));
+			job[index].set_nonce(nonce.fetch_sub(1), m_extraNonce);
 			randomx_calculate_hash_first(vm, job[index].m_blob, job[index].m_blobSize);
 		}
 
 		const Job& j = job[index];
 		index ^= 1;
-		memcpy(&job[index], &miner->m_job[miner->m_jobIndex], sizeof(Job));
-		job[index].set_nonce(miner->m_nonce.fetch_sub(1), miner->m_extraNonce);
+		memcpy(&job[index], &cur_job, sizeof(Job));
+		job[index].set_nonce(nonce.fetch_sub(1), m_extraNonce);
 
 		hash h;
 		randomx_calculate_hash_next(vm, job[index].m_blob, job[index].m_blobSize, &h);
+		data->m_hashes.fetch_add(1, std::memory_order_relaxed);
 
 		if (j.m_diff.check_pow(h)) {
 			LOGINFO(0, log::Green() << "worker thread " << data->m_index << '/' << data->m_count << " found a mainchain block, submitting it");
@@ -220,6 +309,36 @@ void Miner::run(WorkerData* data)
 	randomx_destroy_vm(vm);
 }
 
+// Copies the latest job if it's newer than "sequence", returns true if it did
+bool Miner::read_job(uint32_t& sequence, Job& job) const
+{
+	const uint32_t cur_sequence = m_jobSequence.load();
+	if (cur_sequence == sequence) {
+		return false;
+	}
+
+	for (uint32_t cur = cur_sequence;;) {
+		memcpy(&job, &m_job[cur % JOB_RING_SIZE], sizeof(Job));
+
+		// The slot could have been reused while it was copied, take the latest job again then
+		const uint32_t latest = m_jobSequence.load();
+		if (latest - cur < JOB_RING_SIZE - 1) {
+			sequence = cur;
+			return true;
+		}
+		cur = latest;
+	}
+}
+
+uint64_t Miner::total_hashes() const
+{
+	uint64_t result = 0;
+	for (const WorkerData* data : m_minerThreads) {
+		result += data->m_hashes.load();
+	}
+	return result;
+}
+
 void Miner::Job::set_nonce(uint32_t nonce, uint32_t extra_nonce)
 {
 	m_nonce = nonce;
@@ -46,18 +46,34 @@ private:
 		Miner* m_miner;
 		uint32_t m_index;
 		uint32_t m_count;
+		uint32_t m_node;
 		uv_thread_t m_worker;
+
+		// Written by the worker thread, read by print_status() and on_block()
+		std::atomic<uint64_t> m_hashes{ 0 };
+		std::atomic<uint64_t> m_jobSwitches{ 0 };
+		std::atomic<uint64_t> m_jobSwitchTotalNs{ 0 };
+		std::atomic<uint64_t> m_jobSwitchMaxNs{ 0 };
+
+		// Used only by print_status()
+		uint64_t m_statusHashes = 0;
 	};
 
 	std::vector<WorkerData*> m_minerThreads;
+
+	// Worker threads per NUMA node, empty if threads are not pinned (--numa)
+	std::vector<uint32_t> m_threadsPerNode;
 	std::atomic<bool> m_stopped;
 
 	std::chrono::high_resolution_clock::time_point m_startTimestamp;
 
-	std::atomic<uint32_t> m_nonce;
 	std::chrono::high_resolution_clock::time_point m_nonceTimestamp;
+	std::chrono::high_resolution_clock::time_point m_statusTimestamp;
 	const uint32_t m_extraNonce;
 
+	// Sum of all threads' hash counters when the current job was published
+	uint64_t m_jobStartHashes;
+
 	std::atomic<uint64_t> m_totalHashes;
 	std::atomic<uint32_t> m_sharesFound;
 
@@ -73,10 +89,22 @@ private:
 		uint32_t m_nonce = 0;
 		uint32_t m_extraNonce = 0;
 
+		// When on_block() published this job, used to measure how long threads take to switch to it
+		int64_t m_publishTimestamp = 0;
+
 		void set_nonce(uint32_t nonce, uint32_t extra_nonce);
 	};
-	Job m_job[2];
-	std::atomic<uint32_t> m_jobIndex;
+
+	// on_block() writes the next slot and then bumps m_jobSequence, so slots being read are not overwritten until JOB_RING_SIZE - 1 newer jobs have been published
+	// Each job has its own nonce counter, threads still finishing the previous job don't repeat nonces of the new one
+	static constexpr uint32_t JOB_RING_SIZE = 4;
+
+	Job m_job[JOB_RING_SIZE];
+	std::atomic<uint32_t> m_jobNonce[JOB_RING_SIZE];
+	std::atomic<uint32_t> m_jobSequence;
+
+	bool read_job(uint32_t& sequence, Job& job) const;
+	uint64_t total_hashes() const;
 
 	void run(WorkerData* data);
 };
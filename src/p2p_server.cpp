@@ -22,12 +22,14 @@
 #include "keccak.h"
 #include "side_chain.h"
 #include "pool_block.h"
+#include "mempool.h"
 #include "block_cache.h"
 #include "json_rpc_request.h"
 #include "json_parsers.h"
+#include "metrics.h"
+#include "trace.h"
 #include <rapidjson/document.h>
 #include <fstream>
-#include <numeric>
 
 static constexpr char log_category_prefix[] = "P2PServer ";
 static constexpr char saved_peer_list_file_name[] = "p2pool_peers.txt";
@@ -38,6 +40,16 @@ static constexpr int DEFAULT_BACKLOG = 16;
 static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 
 static constexpr size_t SEND_BUF_MIN_SIZE = 256;
+static constexpr size_t COMPACT_TX_ID_SIZE = 6;
+static constexpr uint64_t BLOCK_REQUEST_TIMEOUT_MS = 10000;
+
+// ANCESTORS_REQUEST limits: blocks per request, and bytes per response including what's still queued for sending to this peer
+static constexpr uint32_t ANCESTORS_MAX_COUNT = 64;
+static constexpr size_t ANCESTORS_MAX_SIZE = 4 * 1024 * 1024;
+
+// Relay scheduling: the best outgoing peers get broadcasts first, persistently slow outgoing peers are replaced every 5 minutes
+static constexpr uint32_t RELAY_PRIORITY_PEERS = 8;
+static constexpr uint64_t MAX_RELAY_DELAY_MS = 10000;
 
 #include "tcp_server.inl"
 
@@ -46,26 +58,27 @@ namespace p2pool {
 P2PServer::P2PServer(p2pool* pool)
 	: TCPServer(P2PClient::allocate)
 	, m_pool(pool)
-	, m_cache(pool->params().m_blockCache ? new BlockCache() : nullptr)
+	, m_cache(nullptr)
 	, m_cacheLoaded(false)
 	, m_initialPeerList(pool->params().m_p2pPeerList)
 	, m_cachedBlocks(nullptr)
 	, m_rng(RandomDeviceSeed::instance)
-	, m_block(new PoolBlock())
-	, m_blockDeserializeResult(0)
 	, m_timer{}
 	, m_timerCounter(0)
 	, m_timerInterval(2)
 	, m_peerListLastSaved(0)
 	, m_lookForMissingBlocks(true)
-	, m_fastestPeer(nullptr)
+	, m_syncPipeline(pool->params().m_syncPipeline)
+	, m_blocksDownloaded(0)
+	, m_bytesDownloaded(0)
+	, m_syncReportTime(0)
+	, m_syncReportBlocks(0)
+	, m_syncReportBytes(0)
 {
-	m_blockDeserializeBuf.reserve(131072);
-
 	// Diffuse the initial state in case it has low quality
 	m_rng.discard(10000);
 
-	m_peerId = m_rng();
+	m_peerId = make_peer_id(m_rng(), CAPABILITY_COMPACT_BLOCKS | CAPABILITY_ANCESTORS_REQUEST);
 
 	const Params& params = pool->params();
 
@@ -86,7 +99,6 @@ P2PServer::P2PServer(p2pool* pool)
 	set_max_incoming_peers(params.m_maxIncomingPeers);
 
 	uv_mutex_init_checked(&m_rngLock);
-	uv_mutex_init_checked(&m_blockLock);
 	uv_mutex_init_checked(&m_peerListLock);
 	uv_mutex_init_checked(&m_broadcastLock);
 	uv_rwlock_init_checked(&m_cachedBlocksLock);
@@ -120,9 +132,15 @@ P2PServer::P2PServer(p2pool* pool)
 		panic();
 	}
 
+	// Block cache was loaded in the background while p2pool was waiting for monerod
+	std::vector<PoolBlock*> cached_blocks;
+	m_cache = m_pool->take_block_cache(cached_blocks);
+
 	if (m_cache) {
 		WriteLock lock(m_cachedBlocksLock);
-		m_cache->load_all(m_pool->side_chain(), *this);
+		for (PoolBlock* block : cached_blocks) {
+			add_cached_block(block);
+		}
 		m_cacheLoaded = true;
 	}
 
@@ -142,7 +160,6 @@ P2PServer::~P2PServer()
 	shutdown_tcp();
 
 	uv_mutex_destroy(&m_rngLock);
-	uv_mutex_destroy(&m_blockLock);
 	uv_mutex_destroy(&m_peerListLock);
 	uv_mutex_destroy(&m_broadcastLock);
 
@@ -151,18 +168,22 @@ P2PServer::~P2PServer()
 
 	uv_mutex_destroy(&m_connectToPeersLock);
 
-	delete m_block;
-	delete m_cache;
+	if (m_cache) {
+		m_pool->side_chain().save_chain_state();
+		delete m_cache;
+	}
 
 	for (const Broadcast* data : m_broadcastQueue) {
 		delete data;
 	}
 }
 
-void P2PServer::add_cached_block(const PoolBlock& block)
+// Takes ownership of the block
+void P2PServer::add_cached_block(PoolBlock* block)
 {
 	if (m_cacheLoaded) {
 		LOGERR(1, "add_cached_block can only be called on startup. Fix the code!");
+		delete block;
 		return;
 	}
 
@@ -170,9 +191,8 @@ void P2PServer::add_cached_block(const PoolBlock& block)
 		m_cachedBlocks = new unordered_map<hash, PoolBlock*>();
 	}
 
-	if (m_cachedBlocks->find(block.m_sidechainId) == m_cachedBlocks->end()) {
-		PoolBlock* new_block = new PoolBlock(block);
-		m_cachedBlocks->insert({ new_block->m_sidechainId, new_block });
+	if (!m_cachedBlocks->insert({ block->m_sidechainId, block }).second) {
+		delete block;
 	}
 }
 
@@ -249,29 +269,72 @@ void P2PServer::on_connect_failed(bool is_v6, const raw_ip& ip, int port)
 {
 	MutexLock lock(m_peerListLock);
 
-	for (auto it = m_peerList.begin(); it != m_peerList.end(); ++it) {
-		if ((it->m_isV6 == is_v6) && (it->m_port == port) && (it->m_addr == ip)) {
-			++it->m_numFailedConnections;
-			if (it->m_numFailedConnections >= 10) {
-				m_peerList.erase(it);
-			}
-			return;
+	Peer* p = find_peer(ip);
+	if (p && (p->m_isV6 == is_v6) && (p->m_port == port)) {
+		++p->m_numFailedConnections;
+		if (p->m_numFailedConnections >= 10) {
+			erase_peer(static_cast<size_t>(p - m_peerList.data()));
 		}
 	}
 }
 
+P2PServer::Peer* P2PServer::find_peer(const raw_ip& ip)
+{
+	auto it = m_peerIndex.find(ip);
+	return (it != m_peerIndex.end()) ? &m_peerList[it->second] : nullptr;
+}
+
+void P2PServer::add_peer(const Peer& peer)
+{
+	if (m_peerIndex.emplace(peer.m_addr, m_peerList.size()).second) {
+		m_peerList.push_back(peer);
+	}
+}
+
+// Moves the last peer in its place, so the order of m_peerList is not preserved
+void P2PServer::erase_peer(size_t index)
+{
+	m_peerIndex.erase(m_peerList[index].m_addr);
+
+	if (index + 1 < m_peerList.size()) {
+		m_peerList[index] = m_peerList.back();
+		m_peerIndex[m_peerList[index].m_addr] = index;
+	}
+
+	m_peerList.pop_back();
+}
+
+void P2PServer::rebuild_peer_index()
+{
+	m_peerIndex.clear();
+	m_peerIndex.reserve(m_peerList.size());
+
+	for (size_t i = 0, n = m_peerList.size(); i < n; ++i) {
+		m_peerIndex[m_peerList[i].m_addr] = i;
+	}
+}
+
 void P2PServer::update_peer_connections()
 {
 	const uint64_t cur_time = seconds_since_epoch();
 	const uint64_t last_updated = m_pool->side_chain().last_updated();
 
 	bool has_good_peers = false;
-	m_fastestPeer = nullptr;
 
-	unordered_set<raw_ip> connected_clients;
+	// Connected peers and their stats
+	struct ConnectedPeer
+	{
+		uint32_t m_relayDelay;
+		int64_t m_pingTime;
+	};
+
+	unordered_map<raw_ip, ConnectedPeer> connected_clients;
 	{
 		MutexLock lock(m_clientsListLock);
 
+		std::vector<P2PClient*> outgoing_clients;
+		outgoing_clients.reserve(m_numConnections);
+
 		connected_clients.reserve(m_numConnections);
 		for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
 			const int timeout = client->m_handshakeComplete ? 300 : 10;
@@ -297,14 +360,28 @@ void P2PServer::update_peer_connections()
 				}
 			}
 
-			connected_clients.insert(client->m_addr);
+			connected_clients.emplace(client->m_addr, ConnectedPeer{ client->m_relayDelay, client->m_pingTime });
 			if (client->is_good()) {
 				has_good_peers = true;
-				if ((client->m_pingTime >= 0) && (!m_fastestPeer || (m_fastestPeer->m_pingTime > client->m_pingTime))) {
-					m_fastestPeer = client;
+				if (!client->m_isIncoming) {
+					outgoing_clients.push_back(client);
 				}
 			}
 		}
+
+		// Disconnect the slowest outgoing peer if it's much slower than the others, a new random peer will take its place
+		if (((m_timerCounter % 150) == 75) && (outgoing_clients.size() >= 4) && (outgoing_clients.size() >= m_maxOutgoingPeers)) {
+			std::sort(outgoing_clients.begin(), outgoing_clients.end(), [](const P2PClient* a, const P2PClient* b) { return a->relay_cost() < b->relay_cost(); });
+
+			const uint64_t median_cost = outgoing_clients[outgoing_clients.size() / 2]->relay_cost();
+			P2PClient* slowest = outgoing_clients.back();
+			const uint64_t slowest_cost = slowest->relay_cost();
+
+			if (slowest_cost > median_cost * 2 + 500) {
+				LOGINFO(4, "disconnecting slow peer " << static_cast<char*>(slowest->m_addrString) << " (relay cost " << slowest_cost << " ms, median " << median_cost << " ms)");
+				slowest->close();
+			}
+		}
 	}
 
 	std::vector<Peer> peer_list;
@@ -312,15 +389,25 @@ void P2PServer::update_peer_connections()
 		MutexLock lock(m_peerListLock);
 
 		if ((m_timerCounter % 30) == 1) {
-			// Update last seen time for currently connected peers
-			for (Peer& p : m_peerList) {
-				if (connected_clients.find(p.m_addr) != connected_clients.end()) {
-					p.m_lastSeen = cur_time;
+			// Update stats for currently connected peers
+			for (const auto& it : connected_clients) {
+				Peer* p = find_peer(it.first);
+				if (p) {
+					p->m_lastSeen = cur_time;
+					p->m_relayDelay = it.second.m_relayDelay;
+					if (it.second.m_pingTime >= 0) {
+						p->m_pingTime = static_cast<uint32_t>(std::min<int64_t>(it.second.m_pingTime, MAX_RELAY_DELAY_MS));
+					}
 				}
 			}
 
 			// Remove all peers that weren't seen for more than 1 hour
+			const size_t n = m_peerList.size();
 			m_peerList.erase(std::remove_if(m_peerList.begin(), m_peerList.end(), [cur_time](const Peer& p) { return p.m_lastSeen + 3600 < cur_time; }), m_peerList.end());
+
+			if (m_peerList.size() != n) {
+				rebuild_peer_index();
+			}
 		}
 
 		peer_list = m_peerList;
@@ -339,8 +426,32 @@ void P2PServer::update_peer_connections()
 	}
 
 	// Try to have at least N outgoing connections (N defaults to 10, can be set via --out-peers command line parameter)
-	for (uint32_t i = m_numConnections - m_numIncomingConnections; (i < N) && !peer_list.empty();) {
-		const uint64_t k = get_random64() % peer_list.size();
+	uint32_t i = m_numConnections - m_numIncomingConnections;
+
+	// Half of the free slots go to the best scored peers, the rest to random peers, so new peers get a chance too
+	if (i < N) {
+		std::sort(peer_list.begin(), peer_list.end(), [](const Peer& a, const Peer& b) { return a.score() > b.score(); });
+
+		for (uint32_t num_best = (N - i + 1) / 2; (num_best > 0) && !peer_list.empty();) {
+			const Peer& peer = peer_list.back();
+
+			if ((connected_clients.find(peer.m_addr) == connected_clients.end()) && connect_to_peer(peer.m_isV6, peer.m_addr, peer.m_port)) {
+				++i;
+				--num_best;
+			}
+
+			peer_list.pop_back();
+		}
+	}
+
+	while ((i < N) && !peer_list.empty()) {
+		// Pick the better of two random peers
+		uint64_t k = get_random64() % peer_list.size();
+		const uint64_t k2 = get_random64() % peer_list.size();
+		if (peer_list[k2].score() < peer_list[k].score()) {
+			k = k2;
+		}
+
 		const Peer& peer = peer_list[k];
 
 		if ((connected_clients.find(peer.m_addr) == connected_clients.end()) && connect_to_peer(peer.m_isV6, peer.m_addr, peer.m_port)) {
@@ -416,7 +527,7 @@ void P2PServer::save_peer_list_async()
 	work->req.data = work;
 	work->server = this;
 
-	const int err = uv_queue_work(&m_loop, &work->req,
+	const int err = uv_queue_work_lane(&m_loop, WorkLane::BACKGROUND, &work->req,
 		[](uv_work_t* req)
 		{
 			bkg_jobs_tracker.start("P2PServer::save_peer_list_async");
@@ -458,7 +569,7 @@ void P2PServer::save_peer_list()
 			memcpy(addr.s6_addr, p.m_addr.data, sizeof(addr.s6_addr));
 			addr_str = inet_ntop(AF_INET6, &addr, addr_str_buf, sizeof(addr_str_buf));
 			if (addr_str) {
-				f << '[' << addr_str << "]:" << p.m_port << '\n';
+				f << '[' << addr_str << "]:" << p.m_port;
 			}
 		}
 		else {
@@ -466,9 +577,13 @@ void P2PServer::save_peer_list()
 			memcpy(&addr.s_addr, p.m_addr.data + 12, sizeof(addr.s_addr));
 			addr_str = inet_ntop(AF_INET, &addr, addr_str_buf, sizeof(addr_str_buf));
 			if (addr_str) {
-				f << addr_str << ':' << p.m_port << '\n';
+				f << addr_str << ':' << p.m_port;
 			}
 		}
+
+		if (addr_str) {
+			f << ' ' << p.m_relayDelay << ' ' << p.m_pingTime << ' ' << p.m_numFailedConnections << ' ' << p.m_lastSeen << '\n';
+		}
 	}
 
 	f.flush();
@@ -549,11 +664,40 @@ void P2PServer::load_peer_list()
 	}
 
 	// Finally load peers from p2pool_peers.txt
+	// Each line is "IP:port relay_delay ping_time failed_connections last_seen", everything after the port is optional
+	unordered_map<std::string, Peer> saved_stats;
+
 	std::ifstream f(saved_peer_list_file_name);
 	if (f.is_open()) {
 		std::string address;
 		while (f.good()) {
 			std::getline(f, address);
+
+			const size_t k = address.find(' ');
+			if (k != std::string::npos) {
+				uint64_t values[4] = { DEFAULT_RELAY_DELAY_MS, DEFAULT_RELAY_DELAY_MS, 0, 0 };
+
+				const char* p = address.c_str() + k;
+				for (uint64_t& value : values) {
+					char* end;
+					const uint64_t x = strtoull(p, &end, 10);
+					if (end == p) {
+						break;
+					}
+					value = x;
+					p = end;
+				}
+
+				Peer stats{};
+				stats.m_relayDelay = static_cast<uint32_t>(std::min<uint64_t>(values[0], MAX_RELAY_DELAY_MS));
+				stats.m_pingTime = static_cast<uint32_t>(std::min<uint64_t>(values[1], MAX_RELAY_DELAY_MS));
+				stats.m_numFailedConnections = static_cast<uint32_t>(std::min<uint64_t>(values[2], 9));
+				stats.m_lastSeen = values[3];
+
+				address.resize(k);
+				saved_stats[address] = stats;
+			}
+
 			if (!address.empty()) {
 				if (!saved_list.empty()) {
 					saved_list += ',';
@@ -568,31 +712,37 @@ void P2PServer::load_peer_list()
 		return;
 	}
 
+	const uint64_t cur_time = seconds_since_epoch();
+
 	MutexLock lock(m_peerListLock);
 
 	parse_address_list(saved_list,
-		[this](bool is_v6, const std::string& /*address*/, const std::string& ip, int port)
+		[this, &saved_stats, cur_time](bool is_v6, const std::string& address, const std::string& ip, int port)
 		{
 			Peer p;
 			if (!str_to_ip(is_v6, ip.c_str(), p.m_addr)) {
 				return;
 			}
 			p.m_isV6 = is_v6;
+			p.m_port = port;
+			p.m_numFailedConnections = 0;
+			p.m_lastSeen = cur_time;
 
-			bool already_added = false;
-			for (const Peer& peer : m_peerList) {
-				if ((peer.m_isV6 == p.m_isV6) && (peer.m_addr == p.m_addr)) {
-					already_added = true;
-					break;
+			auto it = saved_stats.find(address);
+			if (it != saved_stats.end()) {
+				const Peer& stats = it->second;
+				p.m_relayDelay = stats.m_relayDelay;
+				p.m_pingTime = stats.m_pingTime;
+				p.m_numFailedConnections = stats.m_numFailedConnections;
+
+				// Loaded peers get at least 30 minutes before they can be removed for not being seen
+				if (stats.m_lastSeen) {
+					p.m_lastSeen = std::max(std::min(stats.m_lastSeen, cur_time), cur_time - 1800);
 				}
 			}
 
-			p.m_port = port;
-			p.m_numFailedConnections = 0;
-			p.m_lastSeen = seconds_since_epoch();
-
-			if (!already_added && !is_banned(p.m_addr)) {
-				m_peerList.push_back(p);
+			if (!find_peer(p.m_addr) && !is_banned(p.m_addr)) {
+				add_peer(p);
 			}
 		});
 
@@ -679,36 +829,36 @@ void P2PServer::load_monerod_peer_list()
 		}, &m_loop);
 }
 
-void P2PServer::update_peer_in_list(bool is_v6, const raw_ip& ip, int port)
+// Returns the saved relay delay of this peer
+uint32_t P2PServer::update_peer_in_list(bool is_v6, const raw_ip& ip, int port)
 {
 	const uint64_t cur_time = seconds_since_epoch();
 
 	MutexLock lock(m_peerListLock);
 
-	for (Peer& p : m_peerList) {
-		if ((p.m_isV6 == is_v6) && (p.m_addr == ip)) {
-			p.m_port = port;
-			p.m_numFailedConnections = 0;
-			p.m_lastSeen = cur_time;
-			return;
-		}
+	Peer* p = find_peer(ip);
+	if (p) {
+		p->m_isV6 = is_v6;
+		p->m_port = port;
+		p->m_numFailedConnections = 0;
+		p->m_lastSeen = cur_time;
+		return p->m_relayDelay;
 	}
 
 	if (!is_banned(ip)) {
-		m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time });
+		add_peer(Peer{ is_v6, ip, port, 0, cur_time });
 	}
+
+	return DEFAULT_RELAY_DELAY_MS;
 }
 
 void P2PServer::remove_peer_from_list(P2PClient* client)
 {
 	MutexLock lock(m_peerListLock);
 
-	for (auto it = m_peerList.begin(); it != m_peerList.end(); ++it) {
-		const Peer& p = *it;
-		if ((p.m_isV6 == client->m_isV6) && (p.m_port == client->m_listenPort) && (p.m_addr == client->m_addr)) {
-			m_peerList.erase(it);
-			return;
-		}
+	Peer* p = find_peer(client->m_addr);
+	if (p && (p->m_isV6 == client->m_isV6) && (p->m_port == client->m_listenPort)) {
+		erase_peer(static_cast<size_t>(p - m_peerList.data()));
 	}
 }
 
@@ -716,17 +866,16 @@ void P2PServer::remove_peer_from_list(const raw_ip& ip)
 {
 	MutexLock lock(m_peerListLock);
 
-	for (auto it = m_peerList.begin(); it != m_peerList.end(); ++it) {
-		const Peer& p = *it;
-		if (p.m_addr == ip) {
-			m_peerList.erase(it);
-			return;
-		}
+	Peer* p = find_peer(ip);
+	if (p) {
+		erase_peer(static_cast<size_t>(p - m_peerList.data()));
 	}
 }
 
 void P2PServer::broadcast(const PoolBlock& block)
 {
+	TraceSpan span("P2PServer::broadcast", block.m_sidechainId);
+
 	MinerData miner_data = m_pool->miner_data();
 
 	if (block.m_txinGenHeight + 2 < miner_data.height) {
@@ -740,38 +889,26 @@ void P2PServer::broadcast(const PoolBlock& block)
 	}
 
 	Broadcast* data = new Broadcast();
+	data->id = block.m_sidechainId;
 
-	int outputs_offset, outputs_blob_size;
-	const std::vector<uint8_t> mainchain_data = block.serialize_mainchain_data(nullptr, nullptr, &outputs_offset, &outputs_blob_size);
-	const std::vector<uint8_t> sidechain_data = block.serialize_sidechain_data();
-
-	data->blob.reserve(mainchain_data.size() + sidechain_data.size());
-	data->blob = mainchain_data;
-	data->blob.insert(data->blob.end(), sidechain_data.begin(), sidechain_data.end());
-
-	data->pruned_blob.reserve(mainchain_data.size() + sidechain_data.size() + 16 - outputs_blob_size);
-	data->pruned_blob.assign(mainchain_data.begin(), mainchain_data.begin() + outputs_offset);
-
-	// 0 outputs in the pruned blob
-	data->pruned_blob.push_back(0);
-
-	const uint64_t total_reward = std::accumulate(block.m_outputs.begin(), block.m_outputs.end(), 0ULL,
-		[](uint64_t a, const PoolBlock::TxOutput& b)
-		{
-			return a + b.m_reward;
-		});
+	const std::shared_ptr<const PoolBlock::Blobs> blobs = block.get_blobs();
+	data->blob = SharedBuf(blobs, &blobs->m_full);
+	data->pruned_blob = SharedBuf(blobs, &blobs->m_pruned);
 
-	writeVarint(total_reward, data->pruned_blob);
-	writeVarint(outputs_blob_size, data->pruned_blob);
+	const std::vector<uint8_t>& pruned_blob = blobs->m_pruned;
+	std::vector<uint8_t>& compact = data->compact_blob;
 
-	data->pruned_blob.insert(data->pruned_blob.end(), mainchain_data.begin() + outputs_offset + outputs_blob_size, mainchain_data.end());
-	data->pruned_blob.insert(data->pruned_blob.end(), sidechain_data.begin(), sidechain_data.end());
+	// Not worth it for blocks with few transactions
+	if (make_compact_blob(block.m_sidechainId, pruned_blob, get_random64(), compact) && (compact.size() >= pruned_blob.size())) {
+		compact.clear();
+		compact.shrink_to_fit();
+	}
 
 	data->ancestor_hashes.reserve(block.m_uncles.size() + 1);
 	data->ancestor_hashes = block.m_uncles;
 	data->ancestor_hashes.push_back(block.m_parent);
 
-	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << " (height " << block.m_sidechainHeight << "): " << data->pruned_blob.size() << '/' << data->blob.size() << " bytes (pruned/full)");
+	LOGINFO(5, "Broadcasting block " << block.m_sidechainId << " (height " << block.m_sidechainHeight << "): " << data->compact_blob.size() << '/' << data->pruned_blob->size() << '/' << data->blob->size() << " bytes (compact/pruned/full)");
 
 	{
 		MutexLock lock(m_broadcastLock);
@@ -805,12 +942,14 @@ void P2PServer::broadcast(const PoolBlock& block)
 
 void P2PServer::on_broadcast()
 {
-	std::vector<Broadcast*> broadcast_queue;
+	std::vector<std::shared_ptr<const Broadcast>> broadcast_queue;
 	broadcast_queue.reserve(2);
 
 	{
 		MutexLock lock(m_broadcastLock);
-		broadcast_queue = m_broadcastQueue;
+		for (Broadcast* data : m_broadcastQueue) {
+			broadcast_queue.emplace_back(data);
+		}
 		m_broadcastQueue.clear();
 	}
 
@@ -818,81 +957,225 @@ void P2PServer::on_broadcast()
 		return;
 	}
 
-	ON_SCOPE_LEAVE([&broadcast_queue]()
+	AllocationTag tag(alloc_profiler::Tag::P2P);
+
+	const trace::clock::time_point trace_start = trace::clock::now();
+	ON_SCOPE_LEAVE([&broadcast_queue, trace_start]()
 		{
-			for (const Broadcast* data : broadcast_queue) {
-				delete data;
+			if (trace::enabled) {
+				const trace::clock::time_point trace_end = trace::clock::now();
+				for (const std::shared_ptr<const Broadcast>& data : broadcast_queue) {
+					trace::add_span("P2PServer::on_broadcast", data->id, trace_start, trace_end);
+				}
 			}
 		});
 
+	// Every block is serialized once, all peers get the same shared blob (full or pruned) after their own message header
+	struct BroadcastBlobs
+	{
+		SharedBuf blob;
+		SharedBuf pruned_blob;
+		SharedBuf compact_blob;
+	};
+
+	std::vector<BroadcastBlobs> blobs;
+	blobs.reserve(broadcast_queue.size());
+
+	for (const std::shared_ptr<const Broadcast>& data : broadcast_queue) {
+		blobs.push_back({ data->blob, data->pruned_blob, SharedBuf(data, &data->compact_blob) });
+	}
+
+	using namespace std::chrono;
+	const uint64_t cur_time = duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
+
+	for (const std::shared_ptr<const Broadcast>& data : broadcast_queue) {
+		m_relayTimes.emplace(data->id, RelayTime{ cur_time, true });
+	}
+
 	MutexLock lock(m_clientsListLock);
 
+	// Send to the fastest peers first: a few best outgoing peers, then all others by relay cost
+	std::vector<P2PClient*> clients;
+	clients.reserve(m_numConnections);
+
 	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if (!client->is_good()) {
-			continue;
+		if (client->is_good()) {
+			clients.push_back(client);
 		}
+	}
 
-		for (Broadcast* data : broadcast_queue) {
-			send(client, [client, data](void* buf, size_t buf_size) -> size_t
-			{
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
+	std::sort(clients.begin(), clients.end(), [](const P2PClient* a, const P2PClient* b) { return a->relay_cost() < b->relay_cost(); });
+
+	std::vector<P2PClient*> ordered_clients;
+	ordered_clients.reserve(clients.size());
+
+	for (P2PClient*& client : clients) {
+		if (!client->m_isIncoming && (ordered_clients.size() < RELAY_PRIORITY_PEERS)) {
+			ordered_clients.push_back(client);
+			client = nullptr;
+		}
+	}
+
+	for (P2PClient* client : clients) {
+		if (client) {
+			ordered_clients.push_back(client);
+		}
+	}
 
-				bool send_pruned = true;
+	for (P2PClient* client : ordered_clients) {
+		for (size_t i = 0, n = broadcast_queue.size(); i < n; ++i) {
+			const Broadcast* data = broadcast_queue[i].get();
 
-				const hash* a = client->m_broadcastedHashes;
-				const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
+			bool send_pruned = true;
 
-				for (const hash& id : data->ancestor_hashes) {
-					if (std::find(a, b, id) == b) {
-						send_pruned = false;
-						break;
-					}
+			const hash* a = client->m_broadcastedHashes;
+			const hash* b = client->m_broadcastedHashes + array_size(&P2PClient::m_broadcastedHashes);
+
+			for (const hash& id : data->ancestor_hashes) {
+				if (std::find(a, b, id) == b) {
+					send_pruned = false;
+					break;
 				}
+			}
 
-				if (send_pruned) {
-					LOGINFO(6, "sending BLOCK_BROADCAST (pruned) to " << log::Gray() << static_cast<char*>(client->m_addrString));
+			const bool send_compact = send_pruned && (client->m_capabilities & CAPABILITY_COMPACT_BLOCKS) && !data->compact_blob.empty();
 
-					const uint32_t len = static_cast<uint32_t>(data->pruned_blob.size());
-					if (buf_size < SEND_BUF_MIN_SIZE + 1 + sizeof(uint32_t) + len) {
-						return 0;
-					}
+			if (send_compact) {
+				LOGINFO_FMT(6, "sending COMPACT_BLOCK_BROADCAST to {}{}", log::Gray(), static_cast<char*>(client->m_addrString));
+			}
+			else if (send_pruned) {
+				LOGINFO_FMT(6, "sending BLOCK_BROADCAST (pruned) to {}{}", log::Gray(), static_cast<char*>(client->m_addrString));
+			}
+			else {
+				LOGINFO_FMT(5, "sending BLOCK_BROADCAST (full)   to {}{}", log::Gray(), static_cast<char*>(client->m_addrString));
+			}
 
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+			const SharedBuf& blob = send_compact ? blobs[i].compact_blob : (send_pruned ? blobs[i].pruned_blob : blobs[i].blob);
+			const uint32_t len = static_cast<uint32_t>(blob->size());
 
-					memcpy(p, &len, sizeof(uint32_t));
-					p += sizeof(uint32_t);
+			uint8_t header[1 + sizeof(uint32_t)];
+			header[0] = static_cast<uint8_t>(send_compact ? MessageId::COMPACT_BLOCK_BROADCAST : MessageId::BLOCK_BROADCAST);
+			memcpy(header + 1, &len, sizeof(uint32_t));
 
-					if (len) {
-						memcpy(p, data->pruned_blob.data(), len);
-						p += len;
-					}
-				}
-				else {
-					LOGINFO(5, "sending BLOCK_BROADCAST (full)   to " << log::Gray() << static_cast<char*>(client->m_addrString));
+			// The peer must be able to read the whole message into its receive buffer
+			if (SEND_BUF_MIN_SIZE + sizeof(header) + len > P2P_BUF_SIZE) {
+				LOGWARN(4, "BLOCK_BROADCAST is too big (" << len << " bytes), not sending it");
+				continue;
+			}
 
-					const uint32_t len = static_cast<uint32_t>(data->blob.size());
-					if (buf_size < SEND_BUF_MIN_SIZE + 1 + sizeof(uint32_t) + len) {
-						return 0;
-					}
+			send(client, header, sizeof(header), blob);
+		}
+	}
+}
 
-					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+void P2PServer::update_relay_delay(P2PClient* client, const hash& id)
+{
+	if (id.empty()) {
+		return;
+	}
 
-					memcpy(p, &len, sizeof(uint32_t));
-					p += sizeof(uint32_t);
+	using namespace std::chrono;
+	const uint64_t cur_time = duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
 
-					if (len) {
-						memcpy(p, data->blob.data(), len);
-						p += len;
-					}
-				}
+	const RelayTime& t = m_relayTimes.emplace(id, RelayTime{ cur_time, false }).first->second;
+	if (t.m_own) {
+		return;
+	}
 
-				return p - p0;
-			});
+	const uint64_t delay = std::min(cur_time - t.m_time, MAX_RELAY_DELAY_MS);
+	client->m_relayDelay = static_cast<uint32_t>((client->m_relayDelay * 7ULL + delay) / 8);
+}
+
+void P2PServer::prune_relay_times()
+{
+	using namespace std::chrono;
+	const uint64_t cur_time = duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
+
+	for (auto it = m_relayTimes.begin(); it != m_relayTimes.end();) {
+		if (cur_time >= it->second.m_time + MAX_RELAY_DELAY_MS * 6) {
+			it = m_relayTimes.erase(it);
+		}
+		else {
+			++it;
 		}
 	}
 }
 
+// Format: sidechain id, salt, prefix size, prefix (up to the transaction count), transaction count, 6-byte short ids, the rest of the pruned blob
+bool P2PServer::make_compact_blob(const hash& id, const std::vector<uint8_t>& pruned_blob, uint64_t salt, std::vector<uint8_t>& compact)
+{
+	compact.clear();
+
+	PoolBlockView view;
+	if (view.parse(pruned_blob.data(), pruned_blob.size()) != 0) {
+		return false;
+	}
+
+	const uint8_t* pruned_begin = pruned_blob.data();
+	const uint32_t prefix_size = static_cast<uint32_t>(view.m_transactions - pruned_begin);
+	const uint32_t num_transactions = static_cast<uint32_t>(view.m_numTransactions);
+
+	compact.reserve(HASH_SIZE + sizeof(salt) + sizeof(uint32_t) * 2 + prefix_size + num_transactions * COMPACT_TX_ID_SIZE + (pruned_begin + pruned_blob.size() - view.m_sidechainData));
+
+	compact.insert(compact.end(), id.h, id.h + HASH_SIZE);
+	compact.insert(compact.end(), reinterpret_cast<const uint8_t*>(&salt), reinterpret_cast<const uint8_t*>(&salt) + sizeof(salt));
+	compact.insert(compact.end(), reinterpret_cast<const uint8_t*>(&prefix_size), reinterpret_cast<const uint8_t*>(&prefix_size) + sizeof(prefix_size));
+	compact.insert(compact.end(), pruned_begin, view.m_transactions);
+	compact.insert(compact.end(), reinterpret_cast<const uint8_t*>(&num_transactions), reinterpret_cast<const uint8_t*>(&num_transactions) + sizeof(num_transactions));
+
+	for (uint32_t i = 0; i < num_transactions; ++i) {
+		hash tx_id;
+		memcpy(tx_id.h, view.m_transactions + i * HASH_SIZE, HASH_SIZE);
+
+		const uint64_t short_id = compact_tx_id(tx_id, salt);
+		compact.insert(compact.end(), reinterpret_cast<const uint8_t*>(&short_id), reinterpret_cast<const uint8_t*>(&short_id) + COMPACT_TX_ID_SIZE);
+	}
+
+	compact.insert(compact.end(), view.m_sidechainData, pruned_begin + pruned_blob.size());
+
+	return true;
+}
+
+uint64_t P2PServer::compact_tx_id(const hash& id, uint64_t salt)
+{
+	// Transaction ids are already uniformly distributed, the salt only makes collisions unpredictable for each block
+	// A collision can't produce a wrong block: ambiguous ids are requested explicitly, and the reconstructed block is checked by its sidechain id
+	const uint64_t* data = reinterpret_cast<const uint64_t*>(id.h);
+
+	uint64_t hi;
+	const uint64_t lo = umul128(data[0] ^ salt, data[1] ^ (salt * 0x9E3779B97F4A7C15ULL) ^ 1, &hi);
+
+	return (lo ^ hi ^ data[2] ^ data[3]) & ((1ULL << (COMPACT_TX_ID_SIZE * 8)) - 1);
+}
+
+static uint32_t peer_id_check(uint64_t peer_id)
+{
+	uint8_t data[sizeof(uint64_t)];
+	memcpy(data, &peer_id, sizeof(data));
+
+	hash h;
+	keccak(data, static_cast<int>(sizeof(data)), h.h, HASH_SIZE);
+
+	uint32_t result;
+	memcpy(&result, h.h, sizeof(result));
+	return result & 0xFFFFFF;
+}
+
+uint64_t P2PServer::make_peer_id(uint64_t random, uint32_t capabilities)
+{
+	const uint64_t peer_id = (random & 0xFFFFFFFFULL) | (static_cast<uint64_t>(capabilities & 0xFF) << 56);
+	return peer_id | (static_cast<uint64_t>(peer_id_check(peer_id)) << 32);
+}
+
+uint32_t P2PServer::peer_id_capabilities(uint64_t peer_id)
+{
+	// A random peer ID from an older version has a 1 in 2^24 chance to pass this check
+	const uint64_t check = (peer_id >> 32) & 0xFFFFFF;
+	const uint64_t data = peer_id & ~(0xFFFFFFULL << 32);
+
+	return (peer_id_check(data) == check) ? static_cast<uint32_t>(peer_id >> 56) : 0;
+}
+
 uint64_t P2PServer::get_random64()
 {
 	MutexLock lock(m_rngLock);
@@ -906,6 +1189,7 @@ void P2PServer::print_status()
 	LOGINFO(0, "status" <<
 		"\nConnections    = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)" <<
 		"\nPeer list size = " << m_peerList.size() <<
+		"\nDownloaded     = " << m_blocksDownloaded.load() << " blocks (" << m_bytesDownloaded.load() / 1024 << " KB)" <<
 		"\nUptime         = " << log::Duration(seconds_since_epoch() - m_pool->start_time())
 	);
 }
@@ -925,7 +1209,7 @@ void P2PServer::show_peers()
 
 	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
 		if (client->m_listenPort >= 0) {
-			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << static_cast<char*>(client->m_addrString));
+			LOGINFO(0, (client->m_isIncoming ? "I " : "O ") << client->m_pingTime << " ms\t" << client->m_relayDelay << " ms\t" << static_cast<char*>(client->m_addrString));
 			++n;
 		}
 	}
@@ -933,154 +1217,561 @@ void P2PServer::show_peers()
 	LOGINFO(0, "Total: " << n << " peers");
 }
 
-int P2PServer::deserialize_block(const uint8_t* buf, uint32_t size)
+struct P2PServer::DeserializeWork
 {
+	uv_work_t req;
+	P2PServer* server;
+	hash id;
+	std::vector<uint8_t> blob;
+	PoolBlock block;
 	int result;
+};
 
-	if ((m_blockDeserializeBuf.size() == size) && (memcmp(m_blockDeserializeBuf.data(), buf, size) == 0)) {
-		m_block->reset_offchain_data();
-		result = m_blockDeserializeResult;
-	}
-	else {
-		result = m_block->deserialize(buf, size, m_pool->side_chain(), &m_loop);
-		m_blockDeserializeBuf.assign(buf, buf + size);
-		m_blockDeserializeResult = result;
-		m_lookForMissingBlocks = true;
-	}
-
-	return result;
-}
-
-void P2PServer::on_timer()
+void P2PServer::deserialize_block_async(P2PClient* client, const uint8_t* buf, uint32_t size, const hash& id, BlockSource source)
 {
-	++m_timerCounter;
-
-	if (!m_initialPeerList.empty()) {
-		connect_to_peers(m_initialPeerList);
-		m_initialPeerList.clear();
+	auto it = m_blocksInFlight.find(id);
+	if (it != m_blocksInFlight.end()) {
+		LOGINFO_FMT(6, "block {} is already being deserialized, waiting for it", id);
+		it->second.emplace_back(BlockRequester{ client, client->m_resetCounter.load(), client->m_addr, source, std::vector<uint8_t>(buf, buf + size) });
+		return;
 	}
 
-	flush_cache();
-	download_missing_blocks();
-	update_peer_list();
-	save_peer_list_async();
-	update_peer_connections();
-	check_zmq();
+	m_blocksInFlight[id].emplace_back(BlockRequester{ client, client->m_resetCounter.load(), client->m_addr, source, {} });
+	start_deserialize_job(id, std::vector<uint8_t>(buf, buf + size));
 }
 
-void P2PServer::flush_cache()
+void P2PServer::start_deserialize_job(const hash& id, std::vector<uint8_t>&& blob)
 {
-	if (!m_cache || ((m_timerCounter % 30) != 2)) {
-		return;
-	}
-
-	struct Work
-	{
-		uv_work_t req;
-		BlockCache* cache;
-	};
-
-	Work* work = new Work{};
+	DeserializeWork* work = new DeserializeWork{ {}, this, id, std::move(blob), {}, 0 };
 	work->req.data = work;
-	work->cache = m_cache;
 
-	const int err = uv_queue_work(&m_loop, &work->req,
+	const int err = uv_queue_work_lane(&m_loop, WorkLane::BLOCKS, &work->req,
 		[](uv_work_t* req)
 		{
-			bkg_jobs_tracker.start("P2PServer::flush_cache");
-			reinterpret_cast<Work*>(req->data)->cache->flush();
+			bkg_jobs_tracker.start("P2PServer::deserialize_block_async");
+			DeserializeWork* work = reinterpret_cast<DeserializeWork*>(req->data);
+
+			// uv_queue_work can't be called from a background job, so get_outputs_blob() runs without helper jobs here
+			ScopedLatency latency(metrics::deserialize_block);
+			TraceSpan span("deserialize_block", work->id);
+			AllocationTag tag(alloc_profiler::Tag::SIDECHAIN);
+			work->result = work->block.deserialize(work->blob.data(), work->blob.size(), work->server->m_pool->side_chain(), nullptr);
 		},
-		[](uv_work_t* req, int)
+		[](uv_work_t* req, int /*status*/)
 		{
-			delete reinterpret_cast<Work*>(req->data);
-			bkg_jobs_tracker.stop("P2PServer::flush_cache");
+			DeserializeWork* work = reinterpret_cast<DeserializeWork*>(req->data);
+			work->server->on_block_deserialized(work);
+			delete work;
+			bkg_jobs_tracker.stop("P2PServer::deserialize_block_async");
 		});
 
 	if (err) {
-		LOGERR(1, "flush_cache: uv_queue_work failed, error " << uv_err_name(err));
+		LOGERR(1, "deserialize_block_async: uv_queue_work failed, error " << uv_err_name(err));
+		m_blocksInFlight.erase(id);
 		delete work;
 	}
 }
 
-void P2PServer::download_missing_blocks()
+void P2PServer::on_block_deserialized(DeserializeWork* work)
 {
-	if (!m_lookForMissingBlocks) {
-		return;
-	}
+	m_lookForMissingBlocks = true;
 
-	std::vector<hash> missing_blocks;
-	m_pool->side_chain().get_missing_blocks(missing_blocks);
-
-	if (missing_blocks.empty()) {
-		m_lookForMissingBlocks = false;
-		m_missingBlockRequests.clear();
+	auto it = m_blocksInFlight.find(work->id);
+	if (it == m_blocksInFlight.end()) {
+		LOGERR(1, "on_block_deserialized: block " << work->id << " is not in flight");
 		return;
 	}
 
-	MutexLock lock(m_clientsListLock);
+	std::vector<BlockRequester> requesters = std::move(it->second);
+	m_blocksInFlight.erase(it);
 
-	if (m_numConnections == 0) {
-		return;
-	}
+	if (work->result != 0) {
+		// The first requester sent this blob, try the next peer's blob if there is one
+		const BlockRequester& r = requesters.front();
+		P2PClient* client = r.m_client;
 
-	std::vector<P2PClient*> clients;
-	clients.reserve(m_numConnections);
+		const bool compact = (r.m_source == BlockSource::COMPACT_BROADCAST);
 
-	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
-		if (client->is_good()) {
-			clients.emplace_back(client);
+		if (compact) {
+			// Our mempool had a different transaction with the same short id, it's not the peer's fault
+			LOGINFO(4, "compact block " << work->id << " couldn't be rebuilt from mempool, error " << work->result);
+		}
+		else if (r.m_resetCounter == client->m_resetCounter.load()) {
+			LOGWARN(3, "peer " << static_cast<char*>(client->m_addrString) << " sent an invalid block, error " << work->result);
+			client->ban(DEFAULT_BAN_TIME);
+			remove_peer_from_list(client);
+			client->close();
+		}
+		else {
+			const log::hex_buf addr_hex(r.m_addr.data, sizeof(r.m_addr.data));
+			LOGWARN(3, "IP " << addr_hex << " sent an invalid block, error " << work->result);
+			ban(r.m_addr, DEFAULT_BAN_TIME);
+			remove_peer_from_list(r.m_addr);
 		}
-	}
 
-	if (clients.empty()) {
+		requesters.erase(requesters.begin());
+
+		if (!requesters.empty()) {
+			std::vector<uint8_t> blob = std::move(requesters.front().m_blob);
+			m_blocksInFlight[work->id] = std::move(requesters);
+			start_deserialize_job(work->id, std::move(blob));
+		}
+		else if (compact) {
+			LOGINFO(4, "requesting the full block " << work->id);
+			queue_block_downloads({ work->id });
+		}
 		return;
 	}
 
-	ReadLock lock2(m_cachedBlocksLock);
+	PoolBlock& block = work->block;
+	P2PClient* sender = nullptr;
 
-	// Try to download each block from a random client
-	for (const hash& id : missing_blocks) {
-		P2PClient* client = clients[get_random64() % clients.size()];
+	for (size_t i = 0, n = requesters.size(); i < n; ++i) {
+		const BlockRequester& r = requesters[i];
+		P2PClient* client = r.m_client;
 
-		const uint64_t truncated_block_id = *reinterpret_cast<const uint64_t*>(id.h);
-		if (!m_missingBlockRequests.insert({ client->m_peerId, truncated_block_id }).second) {
-			// We already asked this peer about this block
-			// Don't try to ask another peer, leave it for another timer tick
+		// This peer disconnected while the block was being deserialized
+		if (r.m_resetCounter != client->m_resetCounter.load()) {
 			continue;
 		}
 
-		if (m_cachedBlocks) {
-			auto it = m_cachedBlocks->find(id);
-			if (it != m_cachedBlocks->end()) {
-				LOGINFO(5, "using cached block for id = " << id);
-				client->handle_incoming_block_async(it->second);
-				continue;
-			}
-		}
+		// Only the first requester's blob was deserialized, other peers sent the same block if their blobs are identical
+		const bool verified = (i == 0) || (r.m_blob == work->blob);
 
-		const bool result = send(client,
-			[&id, client](void* buf, size_t buf_size) -> size_t
-			{
-				LOGINFO(5, "sending BLOCK_REQUEST for id = " << id << " to " << static_cast<char*>(client->m_addrString));
+		bool accept = false;
+		if (!client->on_block_deserialized(block, r.m_source, verified, accept)) {
+			client->ban(DEFAULT_BAN_TIME);
+			remove_peer_from_list(client);
+			client->close();
+			continue;
+		}
 
-				if (buf_size < SEND_BUF_MIN_SIZE) {
+		if (accept && !sender) {
+			sender = client;
+		}
+
+		// The block's id was checked when it was deserialized
+		if (verified && (r.m_source == BlockSource::ANCESTOR)) {
+			on_block_downloaded(client, block.m_sidechainId, static_cast<uint32_t>(work->blob.size()));
+		}
+	}
+
+	if (sender) {
+		sender->handle_incoming_block_async(&block);
+	}
+}
+
+// Only parses the block's structure, so duplicate blocks from other peers are skipped without deserializing them
+// A seen block counts only if it's byte for byte the same as our copy, so its id is verified too
+// Everything else is deserialized, and the block's id is checked there
+bool P2PServer::block_seen(const uint8_t* buf, uint32_t size, hash& sidechain_id)
+{
+	PoolBlockView view;
+	if (view.parse(buf, size) != 0) {
+		return false;
+	}
+
+	sidechain_id = view.m_sidechainId;
+
+	SideChain& side_chain = m_pool->side_chain();
+	if (!side_chain.was_seen(sidechain_id)) {
+		return false;
+	}
+
+	const std::shared_ptr<const PoolBlock::Blobs> blobs = side_chain.get_cached_blobs(sidechain_id);
+	if (!blobs) {
+		return false;
+	}
+
+	for (const std::vector<uint8_t>* blob : { &blobs->m_full, &blobs->m_pruned }) {
+		if ((blob->size() == size) && (memcmp(blob->data(), buf, size) == 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void P2PServer::on_timer()
+{
+	++m_timerCounter;
+
+	if (!m_initialPeerList.empty()) {
+		connect_to_peers(m_initialPeerList);
+		m_initialPeerList.clear();
+	}
+
+	flush_cache();
+	flush_trace();
+	prune_relay_times();
+	download_missing_blocks();
+	update_peer_list();
+	save_peer_list_async();
+	update_peer_connections();
+	check_zmq();
+}
+
+void P2PServer::flush_cache()
+{
+	if (!m_cache || ((m_timerCounter % 30) != 2)) {
+		return;
+	}
+
+	struct Work
+	{
+		uv_work_t req;
+		BlockCache* cache;
+		SideChain* side_chain;
+	};
+
+	Work* work = new Work{};
+	work->req.data = work;
+	work->cache = m_cache;
+	work->side_chain = &m_pool->side_chain();
+
+	const int err = uv_queue_work_lane(&m_loop, WorkLane::BACKGROUND, &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("P2PServer::flush_cache");
+			Work* work = reinterpret_cast<Work*>(req->data);
+			work->cache->flush();
+			work->side_chain->save_chain_state();
+		},
+		[](uv_work_t* req, int)
+		{
+			delete reinterpret_cast<Work*>(req->data);
+			bkg_jobs_tracker.stop("P2PServer::flush_cache");
+		});
+
+	if (err) {
+		LOGERR(1, "flush_cache: uv_queue_work failed, error " << uv_err_name(err));
+		delete work;
+	}
+}
+
+void P2PServer::flush_trace()
+{
+	if (!trace::enabled || ((m_timerCounter % 10) != 5)) {
+		return;
+	}
+
+	uv_work_t* req = new uv_work_t{};
+
+	const int err = uv_queue_work_lane(&m_loop, WorkLane::BACKGROUND, req,
+		[](uv_work_t* /*req*/)
+		{
+			bkg_jobs_tracker.start("P2PServer::flush_trace");
+			trace::flush();
+		},
+		[](uv_work_t* req, int)
+		{
+			delete req;
+			bkg_jobs_tracker.stop("P2PServer::flush_trace");
+		});
+
+	if (err) {
+		LOGERR(1, "flush_trace: uv_queue_work failed, error " << uv_err_name(err));
+		delete req;
+	}
+}
+
+void P2PServer::download_missing_blocks()
+{
+	check_block_downloads();
+
+	if (!m_lookForMissingBlocks) {
+		return;
+	}
+
+	std::vector<hash> missing_blocks;
+	m_pool->side_chain().get_missing_blocks(missing_blocks);
+
+	if (missing_blocks.empty()) {
+		m_lookForMissingBlocks = false;
+		m_blockDownloads.clear();
+		m_blockDownloadQueue.clear();
+		return;
+	}
+
+	// Forget the blocks which are not missing anymore
+	{
+		unordered_set<hash> missing;
+		missing.reserve(missing_blocks.size());
+		for (const hash& id : missing_blocks) {
+			missing.insert(id);
+		}
+
+		for (auto it = m_blockDownloads.begin(); it != m_blockDownloads.end();) {
+			if (missing.find(it->first) == missing.end()) {
+				it = m_blockDownloads.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+	std::vector<hash> ids;
+	ids.reserve(missing_blocks.size());
+	{
+		MutexLock lock(m_clientsListLock);
+
+		P2PClient* client = nullptr;
+		for (P2PClient* c = static_cast<P2PClient*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<P2PClient*>(c->m_next)) {
+			if (c->is_good()) {
+				client = c;
+				break;
+			}
+		}
+
+		if (!client) {
+			return;
+		}
+
+		ReadLock lock2(m_cachedBlocksLock);
+
+		for (const hash& id : missing_blocks) {
+			if (m_cachedBlocks) {
+				auto it = m_cachedBlocks->find(id);
+				if (it != m_cachedBlocks->end()) {
+					LOGINFO(5, "using cached block for id = " << id);
+					client->handle_incoming_block_async(it->second);
+					continue;
+				}
+			}
+			ids.emplace_back(id);
+		}
+	}
+
+	queue_block_downloads(ids);
+}
+
+void P2PServer::queue_block_downloads(const std::vector<hash>& ids)
+{
+	for (const hash& id : ids) {
+		BlockDownload& d = m_blockDownloads[id];
+		if (!d.m_client && !d.m_queued) {
+			d.m_queued = true;
+			m_blockDownloadQueue.push_back(id);
+		}
+	}
+
+	dispatch_block_downloads();
+}
+
+void P2PServer::dispatch_block_downloads()
+{
+	if (m_blockDownloadQueue.empty()) {
+		return;
+	}
+
+	MutexLock lock(m_clientsListLock);
+
+	std::vector<P2PClient*> clients;
+	clients.reserve(m_numConnections);
+
+	for (P2PClient* client = static_cast<P2PClient*>(m_connectedClientsList->m_next); client != m_connectedClientsList; client = static_cast<P2PClient*>(client->m_next)) {
+		if (client->is_good() && !client->m_isClosing) {
+			clients.emplace_back(client);
+		}
+	}
+
+	if (clients.empty()) {
+		return;
+	}
+
+	using namespace std::chrono;
+	const uint64_t cur_time = duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
+
+	const bool initial_sync = !m_pool->side_chain().precalcFinished();
+
+	while (!m_blockDownloadQueue.empty()) {
+		const hash id = m_blockDownloadQueue.front();
+
+		auto it = m_blockDownloads.find(id);
+		if ((it == m_blockDownloads.end()) || !it->second.m_queued) {
+			m_blockDownloadQueue.pop_front();
+			continue;
+		}
+
+		BlockDownload& d = it->second;
+
+		// Pick the peer which is expected to respond first: requests already in flight to it plus this one, times its round trip time
+		P2PClient* best_client = nullptr;
+		uint64_t best_cost = std::numeric_limits<uint64_t>::max();
+		bool has_untried_peers = false;
+
+		for (P2PClient* client : clients) {
+			if (std::find(d.m_triedPeers.begin(), d.m_triedPeers.end(), client->m_peerId) != d.m_triedPeers.end()) {
+				continue;
+			}
+
+			has_untried_peers = true;
+
+			const uint64_t pending = client->m_blockRequests.size() + client->m_ancestorsRequests.size();
+			if (pending >= m_syncPipeline) {
+				continue;
+			}
+
+			const uint64_t ping = (client->m_pingTime >= 0) ? static_cast<uint64_t>(client->m_pingTime) : 1000;
+			const uint64_t cost = (pending + 1) * (ping + 10);
+
+			if (cost < best_cost) {
+				best_client = client;
+				best_cost = cost;
+			}
+		}
+
+		if (!has_untried_peers) {
+			// All connected peers were asked already, wait for new peers
+			d.m_queued = false;
+			m_blockDownloadQueue.pop_front();
+			continue;
+		}
+
+		if (!best_client) {
+			// All pipelines are full, continue when some responses come back
+			break;
+		}
+
+		m_blockDownloadQueue.pop_front();
+		d.m_queued = false;
+
+		// During the initial sync, ask for the whole range of ancestors at once if the peer supports it
+		const bool request_ancestors = initial_sync && (best_client->m_capabilities & CAPABILITY_ANCESTORS_REQUEST);
+
+		const bool result = send(best_client,
+			[&id, best_client, request_ancestors](void* buf, size_t buf_size) -> size_t
+			{
+				if (buf_size < SEND_BUF_MIN_SIZE + 1 + HASH_SIZE + sizeof(uint32_t)) {
 					return 0;
 				}
 
 				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
 				uint8_t* p = p0;
 
-				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+				if (request_ancestors) {
+					LOGINFO_FMT(5, "sending ANCESTORS_REQUEST for id = {} to {}", id, static_cast<char*>(best_client->m_addrString));
 
-				memcpy(p, id.h, HASH_SIZE);
-				p += HASH_SIZE;
+					*(p++) = static_cast<uint8_t>(MessageId::ANCESTORS_REQUEST);
+
+					memcpy(p, id.h, HASH_SIZE);
+					p += HASH_SIZE;
+
+					memcpy(p, &ANCESTORS_MAX_COUNT, sizeof(uint32_t));
+					p += sizeof(uint32_t);
+				}
+				else {
+					LOGINFO_FMT(5, "sending BLOCK_REQUEST for id = {} to {}", id, static_cast<char*>(best_client->m_addrString));
+
+					*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
+
+					memcpy(p, id.h, HASH_SIZE);
+					p += HASH_SIZE;
+				}
 
 				return p - p0;
 			});
 
-		if (result) {
-			++client->m_blockPendingRequests;
+		d.m_triedPeers.push_back(best_client->m_peerId);
+
+		if (!result) {
+			clients.erase(std::find(clients.begin(), clients.end(), best_client));
+			if (clients.empty()) {
+				break;
+			}
+			continue;
+		}
+
+		if (request_ancestors) {
+			best_client->m_ancestorsRequests.emplace_back(id, ANCESTORS_MAX_COUNT);
+		}
+		else {
+			best_client->m_blockRequests.push_back(id);
 		}
+
+		d.m_client = best_client;
+		d.m_resetCounter = best_client->m_resetCounter.load();
+		d.m_requestTime = cur_time;
+	}
+}
+
+void P2PServer::on_block_downloaded(P2PClient* client, const hash& id, uint32_t size)
+{
+	// Chain tip request
+	if (id.empty()) {
+		return;
+	}
+
+	auto it = m_blockDownloads.find(id);
+
+	if (size == 0) {
+		// This peer doesn't have the block, ask another one
+		if ((it != m_blockDownloads.end()) && (it->second.m_client == client)) {
+			BlockDownload& d = it->second;
+			d.m_client = nullptr;
+			d.m_queued = true;
+			m_blockDownloadQueue.push_back(id);
+		}
+	}
+	else {
+		++m_blocksDownloaded;
+		m_bytesDownloaded += size;
+
+		if (it != m_blockDownloads.end()) {
+			m_blockDownloads.erase(it);
+		}
+	}
+
+	dispatch_block_downloads();
+}
+
+void P2PServer::check_block_downloads()
+{
+	using namespace std::chrono;
+	const uint64_t cur_time = duration_cast<milliseconds>(high_resolution_clock::now().time_since_epoch()).count();
+
+	uint32_t num_in_flight = 0;
+
+	// Requests which were not answered in time, or whose peer disconnected, go to other peers
+	for (auto& it : m_blockDownloads) {
+		BlockDownload& d = it.second;
+		if (!d.m_client) {
+			continue;
+		}
+
+		if (d.m_client->m_resetCounter.load() != d.m_resetCounter) {
+			LOGINFO_FMT(5, "peer disconnected before sending block {}, asking another peer", it.first);
+		}
+		else if (cur_time >= d.m_requestTime + BLOCK_REQUEST_TIMEOUT_MS) {
+			LOGINFO_FMT(5, "peer {} didn't send block {} in time, asking another peer", static_cast<char*>(d.m_client->m_addrString), it.first);
+		}
+		else {
+			++num_in_flight;
+			continue;
+		}
+
+		d.m_client = nullptr;
+		d.m_queued = true;
+		m_blockDownloadQueue.push_back(it.first);
+	}
+
+	dispatch_block_downloads();
+
+	const uint64_t t = cur_time / 1000;
+	if (t >= m_syncReportTime + 10) {
+		const uint64_t blocks = m_blocksDownloaded - m_syncReportBlocks;
+		const uint64_t bytes = m_bytesDownloaded - m_syncReportBytes;
+
+		if (blocks && m_syncReportTime) {
+			const uint64_t dt = t - m_syncReportTime;
+			const size_t num_queued = m_blockDownloadQueue.size();
+			LOGINFO(4, "downloaded " << blocks << " blocks in " << dt << " seconds (" << blocks / dt << " blocks/s, " << bytes / dt / 1024 << " KB/s), " << num_in_flight << " requests in flight, " << num_queued << " queued");
+		}
+
+		m_syncReportTime = t;
+		m_syncReportBlocks = m_blocksDownloaded;
+		m_syncReportBytes = m_bytesDownloaded;
 	}
 }
 
@@ -1114,12 +1805,13 @@ P2PServer::P2PClient::P2PClient()
 	, m_lastPeerListRequestTime{}
 	, m_peerListPendingRequests(0)
 	, m_pingTime(-1)
-	, m_blockPendingRequests(0)
+	, m_relayDelay(DEFAULT_RELAY_DELAY_MS)
 	, m_chainTipBlockRequest(false)
 	, m_lastAlive(0)
 	, m_lastBroadcastTimestamp(0)
 	, m_lastBlockrequestTimestamp(0)
 	, m_broadcastedHashes{}
+	, m_capabilities(0)
 {
 }
 
@@ -1138,12 +1830,6 @@ P2PServer::P2PClient::~P2PClient()
 
 void P2PServer::P2PClient::reset()
 {
-	P2PServer* server = static_cast<P2PServer*>(m_owner);
-
-	if (server && (server->m_fastestPeer == this)) {
-		server->m_fastestPeer = nullptr;
-	}
-
 	Client::reset();
 
 	m_peerId = 0;
@@ -1159,7 +1845,9 @@ void P2PServer::P2PClient::reset()
 	m_lastPeerListRequestTime = {};
 	m_peerListPendingRequests = 0;
 	m_pingTime = -1;
-	m_blockPendingRequests = 0;
+	m_relayDelay = DEFAULT_RELAY_DELAY_MS;
+	m_blockRequests.clear();
+	m_ancestorsRequests.clear();
 	m_chainTipBlockRequest = false;
 	m_lastAlive = 0;
 	m_lastBroadcastTimestamp = 0;
@@ -1169,6 +1857,9 @@ void P2PServer::P2PClient::reset()
 		h = {};
 	}
 	m_broadcastedHashesIndex = 0;
+
+	m_capabilities = 0;
+	m_pendingCompactBlock = {};
 }
 
 bool P2PServer::P2PClient::on_connect()
@@ -1201,6 +1892,8 @@ bool P2PServer::P2PClient::on_connect()
 
 bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 {
+	AllocationTag tag(alloc_profiler::Tag::P2P);
+
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 	if (!server) {
 		return false;
@@ -1244,7 +1937,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent HANDSHAKE_CHALLENGE");
+			LOGINFO_FMT(5, "peer {}{}{} sent HANDSHAKE_CHALLENGE", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + CHALLENGE_SIZE + sizeof(uint64_t)) {
 				bytes_read = 1 + CHALLENGE_SIZE + sizeof(uint64_t);
@@ -1265,7 +1958,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent HANDSHAKE_SOLUTION");
+			LOGINFO_FMT(5, "peer {}{}{} sent HANDSHAKE_SOLUTION", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + HASH_SIZE + CHALLENGE_SIZE) {
 				bytes_read = 1 + HASH_SIZE + CHALLENGE_SIZE;
@@ -1285,7 +1978,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent LISTEN_PORT");
+			LOGINFO_FMT(5, "peer {}{}{} sent LISTEN_PORT", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + sizeof(int32_t)) {
 				bytes_read = 1 + sizeof(int32_t);
@@ -1306,7 +1999,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_REQUEST");
+			LOGINFO_FMT(5, "peer {}{}{} sent BLOCK_REQUEST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + HASH_SIZE) {
 				bytes_read = 1 + HASH_SIZE;
@@ -1319,22 +2012,24 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			break;
 
 		case MessageId::BLOCK_RESPONSE:
-			if (m_blockPendingRequests <= 0) {
+			if (m_blockRequests.empty()) {
 				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an unexpected BLOCK_RESPONSE");
 				ban(DEFAULT_BAN_TIME);
 				server->remove_peer_from_list(this);
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_RESPONSE");
+			LOGINFO_FMT(5, "peer {}{}{} sent BLOCK_RESPONSE", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + sizeof(uint32_t)) {
 				const uint32_t block_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
 				if (bytes_left >= 1 + sizeof(uint32_t) + block_size) {
 					bytes_read = 1 + sizeof(uint32_t) + block_size;
 
-					--m_blockPendingRequests;
-					if (!on_block_response(buf + 1 + sizeof(uint32_t), block_size)) {
+					const hash requested_id = m_blockRequests.front();
+					m_blockRequests.pop_front();
+
+					if (!on_block_response(buf + 1 + sizeof(uint32_t), block_size, requested_id)) {
 						ban(DEFAULT_BAN_TIME);
 						server->remove_peer_from_list(this);
 						return false;
@@ -1344,13 +2039,13 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			break;
 
 		case MessageId::BLOCK_BROADCAST:
-			LOGINFO(6, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent BLOCK_BROADCAST");
+			LOGINFO_FMT(6, "peer {}{}{} sent BLOCK_BROADCAST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1 + sizeof(uint32_t)) {
 				const uint32_t block_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
 				if (bytes_left >= 1 + sizeof(uint32_t) + block_size) {
 					bytes_read = 1 + sizeof(uint32_t) + block_size;
-					if (!on_block_broadcast(buf + 1 + sizeof(uint32_t), block_size)) {
+					if (!on_block_broadcast(buf + 1 + sizeof(uint32_t), block_size, BlockSource::BROADCAST)) {
 						ban(DEFAULT_BAN_TIME);
 						server->remove_peer_from_list(this);
 						return false;
@@ -1359,8 +2054,124 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 			}
 			break;
 
+		case MessageId::COMPACT_BLOCK_BROADCAST:
+			LOGINFO_FMT(6, "peer {}{}{} sent COMPACT_BLOCK_BROADCAST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t msg_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
+				if (bytes_left >= 1 + sizeof(uint32_t) + msg_size) {
+					bytes_read = 1 + sizeof(uint32_t) + msg_size;
+					if (!on_compact_block_broadcast(buf + 1 + sizeof(uint32_t), msg_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::MISSING_TXS_REQUEST:
+			++num_block_requests;
+			if (num_block_requests > 100) {
+				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent too many MISSING_TXS_REQUEST messages at once");
+				ban(DEFAULT_BAN_TIME);
+				server->remove_peer_from_list(this);
+				return false;
+			}
+
+			LOGINFO_FMT(5, "peer {}{}{} sent MISSING_TXS_REQUEST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t msg_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
+				if (bytes_left >= 1 + sizeof(uint32_t) + msg_size) {
+					bytes_read = 1 + sizeof(uint32_t) + msg_size;
+					if (!on_missing_txs_request(buf + 1 + sizeof(uint32_t), msg_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::MISSING_TXS_RESPONSE:
+			LOGINFO_FMT(5, "peer {}{}{} sent MISSING_TXS_RESPONSE", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t msg_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
+				if (bytes_left >= 1 + sizeof(uint32_t) + msg_size) {
+					bytes_read = 1 + sizeof(uint32_t) + msg_size;
+					if (!on_missing_txs_response(buf + 1 + sizeof(uint32_t), msg_size)) {
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+				}
+			}
+			break;
+
+		case MessageId::ANCESTORS_REQUEST:
+			++num_block_requests;
+			if (num_block_requests > 100) {
+				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent too many ANCESTORS_REQUEST messages at once");
+				ban(DEFAULT_BAN_TIME);
+				server->remove_peer_from_list(this);
+				return false;
+			}
+
+			LOGINFO_FMT(5, "peer {}{}{} sent ANCESTORS_REQUEST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+
+			if (bytes_left >= 1 + HASH_SIZE + sizeof(uint32_t)) {
+				bytes_read = 1 + HASH_SIZE + sizeof(uint32_t);
+				if (!on_ancestors_request(buf + 1)) {
+					ban(DEFAULT_BAN_TIME);
+					server->remove_peer_from_list(this);
+					return false;
+				}
+			}
+			break;
+
+		case MessageId::ANCESTORS_RESPONSE:
+			if (m_ancestorsRequests.empty()) {
+				LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an unexpected ANCESTORS_RESPONSE");
+				ban(DEFAULT_BAN_TIME);
+				server->remove_peer_from_list(this);
+				return false;
+			}
+
+			LOGINFO_FMT(6, "peer {}{}{} sent ANCESTORS_RESPONSE", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+
+			if (bytes_left >= 1 + sizeof(uint32_t)) {
+				const uint32_t block_size = read_unaligned(reinterpret_cast<uint32_t*>(buf + 1));
+				if (bytes_left >= 1 + sizeof(uint32_t) + block_size) {
+					bytes_read = 1 + sizeof(uint32_t) + block_size;
+
+					if (block_size == 0) {
+						// End of the response, the requested block goes to another peer if it didn't come with it
+						const hash requested_id = m_ancestorsRequests.front().first;
+						m_ancestorsRequests.pop_front();
+						server->on_block_downloaded(this, requested_id, 0);
+					}
+					else if (m_ancestorsRequests.front().second == 0) {
+						LOGWARN(4, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent more blocks in ANCESTORS_RESPONSE than requested");
+						ban(DEFAULT_BAN_TIME);
+						server->remove_peer_from_list(this);
+						return false;
+					}
+					else {
+						--m_ancestorsRequests.front().second;
+						if (!on_ancestor_block(buf + 1 + sizeof(uint32_t), block_size)) {
+							ban(DEFAULT_BAN_TIME);
+							server->remove_peer_from_list(this);
+							return false;
+						}
+					}
+				}
+			}
+			break;
+
 		case MessageId::PEER_LIST_REQUEST:
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent PEER_LIST_REQUEST");
+			LOGINFO_FMT(5, "peer {}{}{} sent PEER_LIST_REQUEST", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 1) {
 				bytes_read = 1;
@@ -1380,7 +2191,7 @@ bool P2PServer::P2PClient::on_read(char* data, uint32_t size)
 				return false;
 			}
 
-			LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent PEER_LIST_RESPONSE");
+			LOGINFO_FMT(5, "peer {}{}{} sent PEER_LIST_RESPONSE", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 
 			if (bytes_left >= 2) {
 				const uint32_t num_peers = buf[1];
@@ -1435,10 +2246,6 @@ void P2PServer::P2PClient::on_disconnected()
 {
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	if (server && (server->m_fastestPeer == this)) {
-		server->m_fastestPeer = nullptr;
-	}
-
 	m_pingTime = -1;
 
 	if (!m_handshakeComplete) {
@@ -1459,7 +2266,7 @@ bool P2PServer::P2PClient::send_handshake_challenge()
 	return owner->send(this,
 		[this, owner](void* buf, size_t buf_size) -> size_t
 		{
-			LOGINFO(5, "sending HANDSHAKE_CHALLENGE to " << static_cast<char*>(m_addrString));
+			LOGINFO_FMT(5, "sending HANDSHAKE_CHALLENGE to {}", static_cast<char*>(m_addrString));
 
 			if (buf_size < SEND_BUF_MIN_SIZE) {
 				return 0;
@@ -1510,56 +2317,64 @@ void P2PServer::P2PClient::send_handshake_solution(const uint8_t (&challenge)[CH
 	memcpy(work->challenge, challenge, CHALLENGE_SIZE);
 	work->salt = server->get_random64();
 
-	const int err = uv_queue_work(&server->m_loop, &work->req,
+	const int err = uv_queue_work_lane(&server->m_loop, WorkLane::BLOCKS, &work->req,
 		[](uv_work_t* req)
 		{
 			bkg_jobs_tracker.start("P2PServer::send_handshake_solution");
 
 			Work* work = reinterpret_cast<Work*>(req->data);
 			const std::vector<uint8_t>& consensus_id = work->server->m_pool->side_chain().consensus_id();
-			const int consensus_id_size = static_cast<int>(consensus_id.size());
+			const int input_size = CHALLENGE_SIZE * 2 + static_cast<int>(consensus_id.size());
 
-			for (size_t iter = 1;; ++iter, ++work->salt) {
-				uint64_t k = work->salt;
-				for (size_t i = 0; i < CHALLENGE_SIZE; ++i) {
-					work->solution_salt[i] = k & 0xFF;
-					k >>= 8;
-				}
+			// This is an incoming connection, so it must do PoW, not us. Only one hash is needed in this case
+			const size_t batch_size = work->client->m_isIncoming ? 1 : HANDSHAKE_BATCH_SIZE;
 
-				keccak_custom(
-					[work, &consensus_id, consensus_id_size](int offset) -> uint8_t
-					{
-						if (offset < CHALLENGE_SIZE) {
-							return work->challenge[offset];
-						}
-						offset -= CHALLENGE_SIZE;
+			// Salts are tried in batches, so keccak_batch() can hash several of them in parallel
+			std::vector<uint8_t> inputs(batch_size * input_size);
+			std::vector<hash> results(batch_size);
 
-						if (offset < consensus_id_size) {
-							return consensus_id[offset];
-						}
+			for (size_t i = 0; i < batch_size; ++i) {
+				uint8_t* p = inputs.data() + i * input_size;
+				memcpy(p, work->challenge, CHALLENGE_SIZE);
+				memcpy(p + CHALLENGE_SIZE, consensus_id.data(), consensus_id.size());
+			}
+
+			for (size_t iter = 0;; iter += batch_size) {
+				for (size_t i = 0; i < batch_size; ++i) {
+					uint8_t* p = inputs.data() + (i + 1) * input_size - CHALLENGE_SIZE;
+					uint64_t k = work->salt + i;
+					for (size_t j = 0; j < CHALLENGE_SIZE; ++j) {
+						p[j] = k & 0xFF;
+						k >>= 8;
+					}
+				}
 
-						return work->solution_salt[offset - consensus_id_size];
-					}, CHALLENGE_SIZE * 2 + static_cast<int>(consensus_id.size()), work->solution.h, HASH_SIZE);
+				keccak_batch(inputs.data(), input_size, results[0].h, batch_size);
 
 				// We might've been disconnected while working on the challenge, do nothing in this case
 				if (work->client->m_resetCounter.load() != work->reset_counter) {
 					return;
 				}
 
-				if (work->client->m_isIncoming) {
-					// This is an incoming connection, so it must do PoW, not us
-					return;
-				}
+				for (size_t i = 0; i < batch_size; ++i) {
+					const uint64_t* value = reinterpret_cast<const uint64_t*>(results[i].h);
 
-				uint64_t* value = reinterpret_cast<uint64_t*>(work->solution.h);
+					uint64_t high;
+					umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
 
-				uint64_t high;
-				umul128(value[HASH_SIZE / sizeof(uint64_t) - 1], CHALLENGE_DIFFICULTY, &high);
+					// Incoming connections take the first hash regardless of PoW
+					if ((high == 0) || work->client->m_isIncoming) {
+						work->solution = results[i];
+						memcpy(work->solution_salt, inputs.data() + (i + 1) * input_size - CHALLENGE_SIZE, CHALLENGE_SIZE);
 
-				if (high == 0) {
-					LOGINFO(5, "found handshake challenge solution after " << iter << " iterations");
-					return;
+						if (!work->client->m_isIncoming) {
+							LOGINFO(5, "found handshake challenge solution after " << (iter + i + 1) << " iterations");
+						}
+						return;
+					}
 				}
+
+				work->salt += batch_size;
 			}
 		},
 		[](uv_work_t* req, int)
@@ -1675,6 +2490,7 @@ bool P2PServer::P2PClient::on_handshake_challenge(const uint8_t* buf)
 	}
 
 	m_peerId = peer_id;
+	m_capabilities = peer_id_capabilities(peer_id);
 
 	bool same_peer = false;
 	{
@@ -1725,7 +2541,7 @@ bool P2PServer::P2PClient::on_handshake_solution(const uint8_t* buf)
 	m_handshakeComplete = true;
 
 	if (!m_handshakeInvalid) {
-		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " handshake completed");
+		LOGINFO_FMT(5, "peer {}{}{} handshake completed", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
 	}
 
 	if (m_handshakeSolutionSent) {
@@ -1754,21 +2570,21 @@ bool P2PServer::P2PClient::on_handshake_solution(const uint8_t* buf)
 
 void P2PServer::P2PClient::on_after_handshake(uint8_t* &p)
 {
-	LOGINFO(5, "sending LISTEN_PORT to " << static_cast<char*>(m_addrString));
+	LOGINFO_FMT(5, "sending LISTEN_PORT to {}", static_cast<char*>(m_addrString));
 	*(p++) = static_cast<uint8_t>(MessageId::LISTEN_PORT);
 
 	const int32_t port = m_owner->listen_port();
 	memcpy(p, &port, sizeof(port));
 	p += sizeof(port);
 
-	LOGINFO(5, "sending BLOCK_REQUEST for the chain tip to " << static_cast<char*>(m_addrString));
+	LOGINFO_FMT(5, "sending BLOCK_REQUEST for the chain tip to {}", static_cast<char*>(m_addrString));
 	*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
 
 	hash empty;
 	memcpy(p, empty.h, HASH_SIZE);
 	p += HASH_SIZE;
 
-	++m_blockPendingRequests;
+	m_blockRequests.emplace_back();
 	m_chainTipBlockRequest = true;
 	m_lastBroadcastTimestamp = seconds_since_epoch();
 }
@@ -1785,7 +2601,7 @@ bool P2PServer::P2PClient::on_listen_port(const uint8_t* buf)
 
 	m_listenPort = port;
 
-	static_cast<P2PServer*>(m_owner)->update_peer_in_list(m_isV6, m_addr, port);
+	m_relayDelay = static_cast<P2PServer*>(m_owner)->update_peer_in_list(m_isV6, m_addr, port);
 	return true;
 }
 
@@ -1798,74 +2614,113 @@ bool P2PServer::P2PClient::on_block_request(const uint8_t* buf)
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	std::vector<uint8_t> blob;
+	// The blob is shared with the block, only the message header is written here
+	SideChain::BlockBlob blob;
 	if (!server->m_pool->side_chain().get_block_blob(id, blob) && !id.empty()) {
 		LOGWARN(5, "got a request for block with id " << id << " but couldn't find it");
 	}
 
-	return server->send(this,
-		[this, &blob](void* buf, size_t buf_size) -> size_t
-		{
-			LOGINFO(5, "sending BLOCK_RESPONSE to " << static_cast<char*>(m_addrString));
+	LOGINFO_FMT(5, "sending BLOCK_RESPONSE to {}", static_cast<char*>(m_addrString));
 
-			const uint32_t len = static_cast<uint32_t>(blob.size());
+	const uint32_t len = blob ? static_cast<uint32_t>(blob->size()) : 0;
 
-			if (buf_size < SEND_BUF_MIN_SIZE + 1 + sizeof(uint32_t) + len) {
-				return 0;
-			}
+	uint8_t header[1 + sizeof(uint32_t)];
+	header[0] = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
+	memcpy(header + 1, &len, sizeof(uint32_t));
 
-			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-			uint8_t* p = p0;
+	return server->send(this, header, sizeof(header), blob);
+}
 
-			*(p++) = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
+bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size, const hash& requested_id)
+{
+	static_cast<P2PServer*>(m_owner)->on_block_downloaded(this, requested_id, size);
 
-			memcpy(p, &len, sizeof(uint32_t));
-			p += sizeof(uint32_t);
+	if (!size) {
+		LOGINFO_FMT(5, "peer {}{}{} sent an empty block response", log::Gray(), static_cast<char*>(m_addrString), log::NoColor());
+		return true;
+	}
 
-			if (len) {
-				memcpy(p, blob.data(), len);
-				p += len;
-			}
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-			return p - p0;
-		});
-}
+	hash id;
+	const bool seen = server->block_seen(buf, size, id);
 
-bool P2PServer::P2PClient::on_block_response(const uint8_t* buf, uint32_t size)
-{
-	if (!size) {
-		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(m_addrString) << log::NoColor() << " sent an empty block response");
+	// Chain tip is always checked, even if we already have this block
+	BlockSource source = BlockSource::RESPONSE;
+	if (m_chainTipBlockRequest) {
+		m_chainTipBlockRequest = false;
+		source = BlockSource::CHAIN_TIP;
+	}
+	else if (seen) {
+		LOGINFO_FMT(6, "block {} was received before, skipping it", id);
 		return true;
 	}
 
+	server->deserialize_block_async(this, buf, size, id, source);
+	return true;
+}
+
+bool P2PServer::P2PClient::on_ancestors_request(const uint8_t* buf)
+{
+	m_lastBlockrequestTimestamp = seconds_since_epoch();
+
+	hash id;
+	memcpy(id.h, buf, HASH_SIZE);
+
+	uint32_t count;
+	memcpy(&count, buf + HASH_SIZE, sizeof(uint32_t));
+	count = std::min(count, ANCESTORS_MAX_COUNT);
+
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	MutexLock lock(server->m_blockLock);
+	// Don't pile up more data if this peer isn't reading fast enough, but always send at least the requested block
+	const size_t queued = uv_stream_get_write_queue_size(reinterpret_cast<const uv_stream_t*>(&m_socket));
+	const size_t max_size = (queued < ANCESTORS_MAX_SIZE) ? (ANCESTORS_MAX_SIZE - queued) : 1;
 
-	const int result = server->deserialize_block(buf, size);
-	if (result != 0) {
-		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
-		return false;
+	std::vector<SideChain::BlockBlob> blobs;
+	if (count > 0) {
+		server->m_pool->side_chain().get_ancestor_blobs(id, count, max_size, blobs);
 	}
 
-	if (m_chainTipBlockRequest) {
-		m_chainTipBlockRequest = false;
+	const size_t num_blobs = blobs.size();
+	LOGINFO_FMT(5, "sending {} blocks in ANCESTORS_RESPONSE for id = {} to {}", num_blobs, id, static_cast<char*>(m_addrString));
+
+	// Each block goes in its own message, an empty block marks the end of the response
+	blobs.emplace_back();
 
-		const uint64_t peer_height = server->get_block()->m_txinGenHeight;
-		const uint64_t our_height = server->m_pool->miner_data().height;
+	for (const SideChain::BlockBlob& blob : blobs) {
+		const uint32_t len = blob ? static_cast<uint32_t>(blob->size()) : 0;
 
-		if (peer_height + 2 < our_height) {
-			LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " is mining on top of a stale block (mainchain height " << peer_height << ", expected >= " << our_height << ')');
+		uint8_t header[1 + sizeof(uint32_t)];
+		header[0] = static_cast<uint8_t>(MessageId::ANCESTORS_RESPONSE);
+		memcpy(header + 1, &len, sizeof(uint32_t));
+
+		if (!server->send(this, header, sizeof(header), blob)) {
 			return false;
 		}
+	}
+
+	return true;
+}
+
+bool P2PServer::P2PClient::on_ancestor_block(const uint8_t* buf, uint32_t size)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-		server->send_peer_list_request(this, seconds_since_epoch());
+	hash id;
+	if (server->block_seen(buf, size, id)) {
+		// The blob matches our copy, so the id is verified
+		server->on_block_downloaded(this, id, size);
+		LOGINFO_FMT(6, "block {} was received before, skipping it", id);
+		return true;
 	}
 
-	return handle_incoming_block_async(server->get_block());
+	// The id isn't verified yet, the download is counted after the block is deserialized
+	server->deserialize_block_async(this, buf, size, id, BlockSource::ANCESTOR);
+	return true;
 }
 
-bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
+bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size, BlockSource source)
 {
 	if (!size) {
 		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an empty block");
@@ -1873,58 +2728,293 @@ bool P2PServer::P2PClient::on_block_broadcast(const uint8_t* buf, uint32_t size)
 	}
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
+	TraceSpan span("on_block_broadcast");
+
+	hash id;
+	const bool seen = server->block_seen(buf, size, id);
+	span.set_id(id);
+
+	if (seen) {
+		m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = id;
+		m_lastBroadcastTimestamp = seconds_since_epoch();
+		server->update_relay_delay(this, id);
+
+		LOGINFO_FMT(6, "block {} was received before, skipping it", id);
+		return true;
+	}
+
+	server->deserialize_block_async(this, buf, size, id, source);
+	return true;
+}
+
+bool P2PServer::P2PClient::on_compact_block_broadcast(const uint8_t* buf, uint32_t size)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	const uint8_t* data = buf;
+	const uint8_t* data_end = buf + size;
 
-	MutexLock lock(server->m_blockLock);
+	hash id;
+	uint64_t salt;
+	uint32_t prefix_size;
 
-	const int result = server->deserialize_block(buf, size);
-	if (result != 0) {
-		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " sent an invalid block, error " << result);
+	if (size < HASH_SIZE + sizeof(salt) + sizeof(prefix_size) + sizeof(uint32_t)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an invalid compact block");
 		return false;
 	}
 
-	const PoolBlock* block = server->get_block();
+	memcpy(id.h, data, HASH_SIZE);
+	data += HASH_SIZE;
+
+	memcpy(&salt, data, sizeof(salt));
+	data += sizeof(salt);
 
-	m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = block->m_sidechainId;
+	memcpy(&prefix_size, data, sizeof(prefix_size));
+	data += sizeof(prefix_size);
 
-	MinerData miner_data = server->m_pool->miner_data();
+	if (static_cast<size_t>(data_end - data) < prefix_size + sizeof(uint32_t)) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an invalid compact block");
+		return false;
+	}
 
-	if (block->m_prevId != miner_data.prev_id) {
-		// This peer is mining on top of a different Monero block, investigate it
-		const uint64_t peer_height = block->m_txinGenHeight;
-		const uint64_t our_height = miner_data.height;
+	const uint8_t* prefix = data;
+	data += prefix_size;
 
-		if (peer_height < our_height) {
-			if (our_height - peer_height < 5) {
-				using namespace std::chrono;
-				const int64_t elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - miner_data.time_received).count();
-				if (our_height - peer_height > 1) {
-					LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " broadcasted a stale block (" << elapsed_ms << " ms late, mainchain height " << peer_height << ", expected >= " << our_height << "), ignoring it");
-					return true;
-				}
-				else {
-					LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " broadcasted a stale block (" << elapsed_ms << " ms late, mainchain height " << peer_height << ", expected >= " << our_height << ")");
+	uint32_t num_transactions;
+	memcpy(&num_transactions, data, sizeof(num_transactions));
+	data += sizeof(num_transactions);
+
+	if (static_cast<uint64_t>(data_end - data) < static_cast<uint64_t>(num_transactions) * COMPACT_TX_ID_SIZE) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted an invalid compact block");
+		return false;
+	}
+
+	const uint8_t* short_ids = data;
+	data += static_cast<size_t>(num_transactions) * COMPACT_TX_ID_SIZE;
+
+	if (server->m_pool->side_chain().was_seen(id)) {
+		// The id is only trusted if our copy of the block gives exactly the same compact blob with this salt
+		// A block which is still being processed can't be checked, it's skipped without crediting the peer
+		const std::shared_ptr<const PoolBlock::Blobs> blobs = server->m_pool->side_chain().get_cached_blobs(id);
+		std::vector<uint8_t> compact;
+
+		if (blobs && make_compact_blob(id, blobs->m_pruned, salt, compact) && (compact.size() == size) && (memcmp(compact.data(), buf, size) == 0)) {
+			m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = id;
+			m_lastBroadcastTimestamp = seconds_since_epoch();
+			server->update_relay_delay(this, id);
+		}
+
+		LOGINFO_FMT(6, "block {} was received before, skipping it", id);
+		return true;
+	}
+
+	const size_t blob_size = prefix_size + static_cast<size_t>(num_transactions) * HASH_SIZE + (data_end - data);
+
+	// The pruned block can't be bigger than what BLOCK_BROADCAST can carry
+	if (blob_size > P2P_BUF_SIZE) {
+		LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " broadcasted a compact block which is too big");
+		return false;
+	}
+
+	m_pendingCompactBlock = {};
+
+	PendingCompactBlock& block = m_pendingCompactBlock;
+	block.m_sidechainId = id;
+	block.m_blob.reserve(blob_size);
+	block.m_blob.assign(prefix, prefix + prefix_size);
+	block.m_blob.resize(prefix_size + static_cast<size_t>(num_transactions) * HASH_SIZE);
+	block.m_blob.insert(block.m_blob.end(), data, data_end);
+	block.m_txOffset = prefix_size;
+
+	// Each transaction must match exactly one transaction in our mempool, everything else is requested from the peer
+	std::vector<uint32_t> num_matches(num_transactions, 0);
+	{
+		unordered_map<uint64_t, uint32_t> indices;
+		indices.reserve(num_transactions);
+
+		for (uint32_t i = 0; i < num_transactions; ++i) {
+			uint64_t short_id = 0;
+			memcpy(&short_id, short_ids + i * COMPACT_TX_ID_SIZE, COMPACT_TX_ID_SIZE);
+
+			auto result = indices.emplace(short_id, i);
+			if (!result.second) {
+				num_matches[i] = 2;
+				num_matches[result.first->second] = 2;
+			}
+		}
+
+		const Mempool& mempool = server->m_pool->mempool();
+		ReadLock lock(mempool.m_lock);
+
+		for (const auto& it : mempool.m_transactions) {
+			auto it2 = indices.find(compact_tx_id(it.first, salt));
+			if (it2 != indices.end()) {
+				const uint32_t index = it2->second;
+				if (++num_matches[index] == 1) {
+					memcpy(block.m_blob.data() + block.m_txOffset + index * HASH_SIZE, it.first.h, HASH_SIZE);
 				}
 			}
-			else {
-				LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " broadcasted an unreasonably stale block (mainchain height " << peer_height << ", expected >= " << our_height << ')');
+		}
+	}
+
+	for (uint32_t i = 0; i < num_transactions; ++i) {
+		if (num_matches[i] != 1) {
+			block.m_missing.push_back(i);
+		}
+	}
+
+	if (block.m_missing.empty()) {
+		std::vector<uint8_t> blob = std::move(block.m_blob);
+		m_pendingCompactBlock = {};
+
+		LOGINFO_FMT(6, "peer {}{}{} compact block {} was reconstructed from mempool", log::Gray(), static_cast<char*>(m_addrString), log::NoColor(), id);
+		return on_block_broadcast(blob.data(), static_cast<uint32_t>(blob.size()), BlockSource::COMPACT_BROADCAST);
+	}
+
+	const uint32_t num_missing = static_cast<uint32_t>(block.m_missing.size());
+	LOGINFO_FMT(5, "peer {}{}{} compact block {}: {}/{} transactions are missing, requesting them", log::Gray(), static_cast<char*>(m_addrString), log::NoColor(), id, num_missing, num_transactions);
+
+	return server->send(this,
+		[this](void* buf, size_t buf_size) -> size_t
+		{
+			LOGINFO_FMT(5, "sending MISSING_TXS_REQUEST to {}", static_cast<char*>(m_addrString));
+
+			const PendingCompactBlock& block = m_pendingCompactBlock;
+			const uint32_t len = static_cast<uint32_t>(HASH_SIZE + block.m_missing.size() * sizeof(uint32_t));
+
+			if (buf_size < SEND_BUF_MIN_SIZE + 1 + sizeof(uint32_t) + len) {
+				return 0;
+			}
+
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			*(p++) = static_cast<uint8_t>(MessageId::MISSING_TXS_REQUEST);
+
+			memcpy(p, &len, sizeof(uint32_t));
+			p += sizeof(uint32_t);
+
+			memcpy(p, block.m_sidechainId.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			memcpy(p, block.m_missing.data(), block.m_missing.size() * sizeof(uint32_t));
+			p += block.m_missing.size() * sizeof(uint32_t);
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::on_missing_txs_request(const uint8_t* buf, uint32_t size)
+{
+	if ((size < HASH_SIZE) || ((size - HASH_SIZE) % sizeof(uint32_t))) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an invalid MISSING_TXS_REQUEST");
+		return false;
+	}
+
+	m_lastBlockrequestTimestamp = seconds_since_epoch();
+
+	hash id;
+	memcpy(id.h, buf, HASH_SIZE);
+
+	const uint8_t* indices = buf + HASH_SIZE;
+	const uint32_t num_indices = (size - HASH_SIZE) / sizeof(uint32_t);
+
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	// Empty response (just the block id) means we don't have this block
+	std::vector<hash> transactions;
+
+	SideChain::BlockBlob blob;
+	PoolBlockView view;
+
+	if (server->m_pool->side_chain().get_block_blob(id, blob) && (view.parse(blob->data(), blob->size()) == 0)) {
+		transactions.reserve(num_indices);
+
+		for (uint32_t i = 0; i < num_indices; ++i) {
+			const uint32_t index = read_unaligned(reinterpret_cast<const uint32_t*>(indices + i * sizeof(uint32_t)));
+			if (index >= view.m_numTransactions) {
+				LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " requested transaction " << index << " from block " << id << " which has only " << view.m_numTransactions << " transactions");
 				return false;
 			}
+
+			hash h;
+			memcpy(h.h, view.m_transactions + index * HASH_SIZE, HASH_SIZE);
+			transactions.emplace_back(h);
 		}
-		else if (peer_height > our_height) {
-			if (peer_height >= our_height + 2) {
-				LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " is ahead on mainchain (height " << peer_height << ", your height " << our_height << "). Is your monerod stuck or lagging?");
+	}
+	else {
+		LOGWARN(5, "got a request for transactions from block with id " << id << " but couldn't find it");
+	}
+
+	return server->send(this,
+		[this, &id, &transactions](void* buf, size_t buf_size) -> size_t
+		{
+			LOGINFO_FMT(5, "sending MISSING_TXS_RESPONSE to {}", static_cast<char*>(m_addrString));
+
+			const uint32_t len = static_cast<uint32_t>(HASH_SIZE + transactions.size() * HASH_SIZE);
+
+			if (buf_size < SEND_BUF_MIN_SIZE + 1 + sizeof(uint32_t) + len) {
+				return 0;
 			}
-		}
-		else {
-			LOGINFO(4, "peer " << static_cast<char*>(m_addrString) << " is mining on an alternative mainchain tip (height " << peer_height << ")");
-		}
+
+			uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
+			uint8_t* p = p0;
+
+			*(p++) = static_cast<uint8_t>(MessageId::MISSING_TXS_RESPONSE);
+
+			memcpy(p, &len, sizeof(uint32_t));
+			p += sizeof(uint32_t);
+
+			memcpy(p, id.h, HASH_SIZE);
+			p += HASH_SIZE;
+
+			for (const hash& h : transactions) {
+				memcpy(p, h.h, HASH_SIZE);
+				p += HASH_SIZE;
+			}
+
+			return p - p0;
+		});
+}
+
+bool P2PServer::P2PClient::on_missing_txs_response(const uint8_t* buf, uint32_t size)
+{
+	if (size < HASH_SIZE) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an invalid MISSING_TXS_RESPONSE");
+		return false;
+	}
+
+	hash id;
+	memcpy(id.h, buf, HASH_SIZE);
+
+	PendingCompactBlock& block = m_pendingCompactBlock;
+
+	// Response to an earlier compact block which was replaced by a newer one or rebuilt from mempool
+	if (block.m_blob.empty() || (id != block.m_sidechainId)) {
+		LOGINFO_FMT(5, "peer {} sent transactions for block {} which is not pending anymore", static_cast<char*>(m_addrString), id);
+		return true;
+	}
+
+	if (size == HASH_SIZE) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " couldn't send missing transactions for block " << id);
+		m_pendingCompactBlock = {};
+		return true;
 	}
 
-	block->m_wantBroadcast = true;
+	if (size != HASH_SIZE + block.m_missing.size() * HASH_SIZE) {
+		LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " sent an invalid MISSING_TXS_RESPONSE");
+		return false;
+	}
 
-	m_lastBroadcastTimestamp = seconds_since_epoch();
+	const uint8_t* transactions = buf + HASH_SIZE;
+	for (size_t i = 0, n = block.m_missing.size(); i < n; ++i) {
+		memcpy(block.m_blob.data() + block.m_txOffset + block.m_missing[i] * HASH_SIZE, transactions + i * HASH_SIZE, HASH_SIZE);
+	}
+
+	std::vector<uint8_t> blob = std::move(block.m_blob);
+	m_pendingCompactBlock = {};
 
-	return handle_incoming_block_async(block);
+	return on_block_broadcast(blob.data(), static_cast<uint32_t>(blob.size()), BlockSource::COMPACT_BROADCAST);
 }
 
 bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
@@ -1978,7 +3068,7 @@ bool P2PServer::P2PClient::on_peer_list_request(const uint8_t*)
 	return server->send(this,
 		[this, &peers, num_selected_peers](void* buf, size_t buf_size) -> size_t
 		{
-			LOGINFO(5, "sending PEER_LIST_RESPONSE to " << static_cast<char*>(m_addrString));
+			LOGINFO_FMT(5, "sending PEER_LIST_RESPONSE to {}", static_cast<char*>(m_addrString));
 
 			if (buf_size < SEND_BUF_MIN_SIZE + 2 + num_selected_peers * 19) {
 				return 0;
@@ -2032,20 +3122,97 @@ bool P2PServer::P2PClient::on_peer_list_response(const uint8_t* buf) const
 		memcpy(&port, buf, 2);
 		buf += 2;
 
-		bool already_added = false;
-		for (Peer& p : server->m_peerList) {
-			if ((p.m_isV6 == is_v6) && (p.m_addr == ip)) {
-				already_added = true;
-				p.m_lastSeen = cur_time;
-				break;
+		Peer* p = server->find_peer(ip);
+		if (p) {
+			p->m_lastSeen = cur_time;
+		}
+		else if (!server->is_banned(ip)) {
+			server->add_peer(Peer{ is_v6, ip, port, 0, cur_time });
+		}
+	}
+
+	return true;
+}
+
+// Called in the event loop thread after a block sent by this peer was deserialized
+// Returns false if the peer must be banned, "accept" is set if the block should be added to the side chain
+bool P2PServer::P2PClient::on_block_deserialized(PoolBlock& block, BlockSource source, bool verified, bool& accept)
+{
+	P2PServer* server = static_cast<P2PServer*>(m_owner);
+
+	accept = false;
+
+	switch (source) {
+	case BlockSource::RESPONSE:
+	case BlockSource::ANCESTOR:
+		break;
+
+	case BlockSource::CHAIN_TIP:
+		{
+			const uint64_t peer_height = block.m_txinGenHeight;
+			const uint64_t our_height = server->m_pool->miner_data().height;
+
+			if (peer_height + 2 < our_height) {
+				LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " is mining on top of a stale block (mainchain height " << peer_height << ", expected >= " << our_height << ')');
+				return false;
 			}
+
+			server->send_peer_list_request(this, seconds_since_epoch());
 		}
+		break;
+
+	case BlockSource::BROADCAST:
+	case BlockSource::COMPACT_BROADCAST:
+		{
+			// Relay bookkeeping uses the sidechain id computed when the block was deserialized
+			if (verified) {
+				m_broadcastedHashes[m_broadcastedHashesIndex.fetch_add(1) % array_size(&P2PClient::m_broadcastedHashes)] = block.m_sidechainId;
+				server->update_relay_delay(this, block.m_sidechainId);
+			}
+
+			MinerData miner_data = server->m_pool->miner_data();
+
+			if (block.m_prevId != miner_data.prev_id) {
+				// This peer is mining on top of a different Monero block, investigate it
+				const uint64_t peer_height = block.m_txinGenHeight;
+				const uint64_t our_height = miner_data.height;
+
+				if (peer_height < our_height) {
+					if (our_height - peer_height < 5) {
+						using namespace std::chrono;
+						const int64_t elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - miner_data.time_received).count();
+						if (our_height - peer_height > 1) {
+							LOGWARN(5, "peer " << static_cast<char*>(m_addrString) << " broadcasted a stale block (" << elapsed_ms << " ms late, mainchain height " << peer_height << ", expected >= " << our_height << "), ignoring it");
+							return true;
+						}
+						else {
+							LOGINFO(5, "peer " << static_cast<char*>(m_addrString) << " broadcasted a stale block (" << elapsed_ms << " ms late, mainchain height " << peer_height << ", expected >= " << our_height << ")");
+						}
+					}
+					else {
+						LOGWARN(4, "peer " << static_cast<char*>(m_addrString) << " broadcasted an unreasonably stale block (mainchain height " << peer_height << ", expected >= " << our_height << ')');
+						return false;
+					}
+				}
+				else if (peer_height > our_height) {
+					if (peer_height >= our_height + 2) {
+						LOGWARN(3, "peer " << static_cast<char*>(m_addrString) << " is ahead on mainchain (height " << peer_height << ", your height " << our_height << "). Is your monerod stuck or lagging?");
+					}
+				}
+				else {
+					LOGINFO(4, "peer " << static_cast<char*>(m_addrString) << " is mining on an alternative mainchain tip (height " << peer_height << ")");
+				}
+			}
 
-		if (!already_added && !server->is_banned(ip)) {
-			server->m_peerList.emplace_back(Peer{ is_v6, ip, port, 0, cur_time });
+			block.m_wantBroadcast = true;
+			if (verified) {
+				m_lastBroadcastTimestamp = seconds_since_epoch();
+			}
 		}
+		break;
 	}
 
+	accept = true;
 	return true;
 }
 
@@ -2054,7 +3221,7 @@ bool P2PServer::P2PClient::handle_incoming_block_async(const PoolBlock* block)
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
 	if (server->m_pool->side_chain().block_seen(*block)) {
-		LOGINFO(6, "block " << block->m_sidechainId << " was received before, skipping it");
+		LOGINFO_FMT(6, "block {} was received before, skipping it", block->m_sidechainId);
 		return true;
 	}
 
@@ -2072,7 +3239,7 @@ bool P2PServer::P2PClient::handle_incoming_block_async(const PoolBlock* block)
 	Work* work = new Work{ {}, *block, this, server, m_resetCounter.load(), m_addr, {} };
 	work->req.data = work;
 
-	const int err = uv_queue_work(&server->m_loop, &work->req,
+	const int err = uv_queue_work_lane(&server->m_loop, WorkLane::BLOCKS, &work->req,
 		[](uv_work_t* req)
 		{
 			bkg_jobs_tracker.start("P2PServer::handle_incoming_block_async");
@@ -2117,63 +3284,32 @@ void P2PServer::P2PClient::handle_incoming_block(p2pool* pool, PoolBlock& block,
 
 void P2PServer::P2PClient::post_handle_incoming_block(const uint32_t reset_counter, std::vector<hash>& missing_blocks)
 {
-	// We might have been disconnected while side_chain was adding the block
-	// In this case we can't send BLOCK_REQUEST messages on this connection anymore
-	if (reset_counter != m_resetCounter.load()) {
-		return;
-	}
-
 	if (missing_blocks.empty()) {
 		return;
 	}
 
 	P2PServer* server = static_cast<P2PServer*>(m_owner);
 
-	// If the initial sync is not finished yet, try to ask the fastest peer too
-	P2PClient* c = server->m_fastestPeer;
-	if (c && (c != this) && !server->m_pool->side_chain().precalcFinished()) {
-		LOGINFO(5, "peer " << static_cast<char*>(c->m_addrString) << " is faster, sending BLOCK_REQUEST to it too");
-		c->post_handle_incoming_block(c->m_resetCounter.load(), missing_blocks);
-	}
-
-	ReadLock lock(server->m_cachedBlocksLock);
-
-	for (const hash& id : missing_blocks) {
-		if (server->m_cachedBlocks) {
-			auto it = server->m_cachedBlocks->find(id);
-			if (it != server->m_cachedBlocks->end()) {
-				LOGINFO(5, "using cached block for id = " << id);
-				handle_incoming_block_async(it->second);
-				continue;
-			}
-		}
-
-		const bool result = server->send(this,
-			[this, &id](void* buf, size_t buf_size) -> size_t
-			{
-				LOGINFO(5, "sending BLOCK_REQUEST for id = " << id << " to " << static_cast<char*>(m_addrString));
-
-				if (buf_size < SEND_BUF_MIN_SIZE + 1 + HASH_SIZE) {
-					return 0;
+	std::vector<hash> ids;
+	ids.reserve(missing_blocks.size());
+	{
+		ReadLock lock(server->m_cachedBlocksLock);
+
+		for (const hash& id : missing_blocks) {
+			// We might have been disconnected while side_chain was adding the block
+			if (server->m_cachedBlocks && (reset_counter == m_resetCounter.load())) {
+				auto it = server->m_cachedBlocks->find(id);
+				if (it != server->m_cachedBlocks->end()) {
+					LOGINFO(5, "using cached block for id = " << id);
+					handle_incoming_block_async(it->second);
+					continue;
 				}
-
-				uint8_t* p0 = reinterpret_cast<uint8_t*>(buf);
-				uint8_t* p = p0;
-
-				*(p++) = static_cast<uint8_t>(MessageId::BLOCK_REQUEST);
-
-				memcpy(p, id.h, HASH_SIZE);
-				p += HASH_SIZE;
-
-				return p - p0;
-			});
-
-		if (!result) {
-			return;
+			}
+			ids.emplace_back(id);
 		}
-
-		++m_blockPendingRequests;
 	}
+
+	server->queue_block_downloads(ids);
 }
 
 } // namespace p2pool
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "tcp_server.h"
+#include <deque>
 
 namespace p2pool {
 
@@ -27,6 +28,7 @@ class BlockCache;
 
 static constexpr size_t P2P_BUF_SIZE = 128 * 1024;
 static constexpr size_t PEER_LIST_RESPONSE_MAX_PEERS = 16;
+static constexpr uint32_t DEFAULT_RELAY_DELAY_MS = 1000;
 static constexpr int DEFAULT_P2P_PORT = 37889;
 static constexpr int DEFAULT_P2P_PORT_MINI = 37888;
 
@@ -42,12 +44,45 @@ public:
 		BLOCK_BROADCAST = 5,
 		PEER_LIST_REQUEST = 6,
 		PEER_LIST_RESPONSE = 7,
+		COMPACT_BLOCK_BROADCAST = 8,
+		MISSING_TXS_REQUEST = 9,
+		MISSING_TXS_RESPONSE = 10,
+		ANCESTORS_REQUEST = 11,
+		ANCESTORS_RESPONSE = 12,
 	};
 
+	// Capabilities are announced in the peer ID sent with HANDSHAKE_CHALLENGE, see make_peer_id()
+	enum {
+		CAPABILITY_COMPACT_BLOCKS = 1,
+		CAPABILITY_ANCESTORS_REQUEST = 2,
+	};
+
+	// Where an incoming block came from, decides what is checked after it's deserialized
+	enum class BlockSource {
+		RESPONSE,
+		CHAIN_TIP,
+		ANCESTOR,
+		BROADCAST,
+		// Broadcast rebuilt from short transaction ids, it can be invalid because of a short id collision in our mempool
+		COMPACT_BROADCAST,
+	};
+
+	// Salted short transaction id used in compact block broadcasts
+	static uint64_t compact_tx_id(const hash& id, uint64_t salt);
+
+	// Compact blob is the pruned blob with transaction hashes replaced by salted short ids
+	// Returns false if the pruned blob can't be parsed
+	static bool make_compact_blob(const hash& id, const std::vector<uint8_t>& pruned_blob, uint64_t salt, std::vector<uint8_t>& compact);
+
+	// Older versions only compare peer IDs, so capabilities are stored in the peer ID together with a check value
+	// Bits 0-31 are random, bits 32-55 are the check value, bits 56-63 are capability flags
+	static uint64_t make_peer_id(uint64_t random, uint32_t capabilities);
+	static uint32_t peer_id_capabilities(uint64_t peer_id);
+
 	explicit P2PServer(p2pool *pool);
 	~P2PServer();
 
-	void add_cached_block(const PoolBlock& block);
+	void add_cached_block(PoolBlock* block);
 	void clear_cached_blocks();
 	void store_in_cache(const PoolBlock& block);
 
@@ -82,6 +117,7 @@ public:
 		enum {
 			CHALLENGE_SIZE = 8,
 			CHALLENGE_DIFFICULTY = 10000,
+			HANDSHAKE_BATCH_SIZE = 16,
 		};
 
 		bool send_handshake_challenge();
@@ -93,11 +129,18 @@ public:
 		void on_after_handshake(uint8_t* &p);
 		bool on_listen_port(const uint8_t* buf);
 		bool on_block_request(const uint8_t* buf);
-		bool on_block_response(const uint8_t* buf, uint32_t size);
-		bool on_block_broadcast(const uint8_t* buf, uint32_t size);
+		bool on_block_response(const uint8_t* buf, uint32_t size, const hash& requested_id);
+		bool on_block_broadcast(const uint8_t* buf, uint32_t size, BlockSource source);
+		bool on_compact_block_broadcast(const uint8_t* buf, uint32_t size);
+		bool on_missing_txs_request(const uint8_t* buf, uint32_t size);
+		bool on_missing_txs_response(const uint8_t* buf, uint32_t size);
+		bool on_ancestors_request(const uint8_t* buf);
+		bool on_ancestor_block(const uint8_t* buf, uint32_t size);
 		bool on_peer_list_request(const uint8_t* buf);
 		bool on_peer_list_response(const uint8_t* buf) const;
 
+		bool on_block_deserialized(PoolBlock& block, BlockSource source, bool verified, bool& accept);
+
 		bool handle_incoming_block_async(const PoolBlock* block);
 		void handle_incoming_block(p2pool* pool, PoolBlock& block, const uint32_t reset_counter, const raw_ip& addr, std::vector<hash>& missing_blocks);
 		void post_handle_incoming_block(const uint32_t reset_counter, std::vector<hash>& missing_blocks);
@@ -119,7 +162,18 @@ public:
 		int m_peerListPendingRequests;
 		int64_t m_pingTime;
 
-		int m_blockPendingRequests;
+		// How late this peer's broadcasts come compared to the first peer which sent us the same block (moving average, milliseconds)
+		uint32_t m_relayDelay;
+
+		// Estimated time for a block sent to this peer to reach the others, broadcasts go to peers with the lowest cost first
+		uint64_t relay_cost() const { return static_cast<uint64_t>((m_pingTime >= 0) ? m_pingTime : DEFAULT_RELAY_DELAY_MS) + m_relayDelay; }
+
+		// Ids of the blocks requested from this peer in the order BLOCK_RESPONSE messages will come back, empty id is the chain tip request
+		std::deque<hash> m_blockRequests;
+
+		// Ids of the blocks whose ancestors were requested from this peer and how many more blocks each response may still have
+		// Each ANCESTORS_RESPONSE stream ends with an empty block
+		std::deque<std::pair<hash, uint32_t>> m_ancestorsRequests;
 		bool m_chainTipBlockRequest;
 
 		uint64_t m_lastAlive;
@@ -128,6 +182,18 @@ public:
 
 		hash m_broadcastedHashes[8];
 		std::atomic<uint32_t> m_broadcastedHashesIndex{ 0 };
+
+		uint32_t m_capabilities;
+
+		// Compact block broadcast waiting for MISSING_TXS_RESPONSE
+		// m_blob is the pruned block with empty hashes in place of the missing transactions
+		struct PendingCompactBlock
+		{
+			hash m_sidechainId;
+			std::vector<uint8_t> m_blob;
+			size_t m_txOffset = 0;
+			std::vector<uint32_t> m_missing;
+		} m_pendingCompactBlock;
 	};
 
 	void broadcast(const PoolBlock& block);
@@ -144,8 +210,8 @@ public:
 	void set_max_outgoing_peers(uint32_t n) { m_maxOutgoingPeers = std::min(std::max(n, 10U), 450U); }
 	void set_max_incoming_peers(uint32_t n) { m_maxIncomingPeers = std::min(std::max(n, 10U), 450U); }
 
-	int deserialize_block(const uint8_t* buf, uint32_t size);
-	const PoolBlock* get_block() const { return m_block; }
+	void deserialize_block_async(P2PClient* client, const uint8_t* buf, uint32_t size, const hash& id, BlockSource source);
+	bool block_seen(const uint8_t* buf, uint32_t size, hash& sidechain_id);
 
 private:
 	p2pool* m_pool;
@@ -163,6 +229,7 @@ private:
 	void on_timer();
 
 	void flush_cache();
+	void flush_trace();
 	void download_missing_blocks();
 	void check_zmq();
 	void update_peer_connections();
@@ -172,17 +239,30 @@ private:
 	void save_peer_list();
 	void load_peer_list();
 	void load_monerod_peer_list();
-	void update_peer_in_list(bool is_v6, const raw_ip& ip, int port);
+	uint32_t update_peer_in_list(bool is_v6, const raw_ip& ip, int port);
 	void remove_peer_from_list(P2PClient* client);
 	void remove_peer_from_list(const raw_ip& ip);
 
 	uv_mutex_t m_rngLock;
 	std::mt19937_64 m_rng;
 
-	uv_mutex_t m_blockLock;
-	PoolBlock* m_block;
-	std::vector<uint8_t> m_blockDeserializeBuf;
-	int m_blockDeserializeResult;
+	// Blocks being deserialized in background jobs, used only in the event loop thread
+	// Peers sending a block which is already being deserialized wait for the same job
+	// Their blobs are kept in case the first peer's blob turns out to be invalid
+	struct BlockRequester
+	{
+		P2PClient* m_client;
+		uint32_t m_resetCounter;
+		raw_ip m_addr;
+		BlockSource m_source;
+		std::vector<uint8_t> m_blob;
+	};
+
+	unordered_map<hash, std::vector<BlockRequester>> m_blocksInFlight;
+
+	struct DeserializeWork;
+	void start_deserialize_job(const hash& id, std::vector<uint8_t>&& blob);
+	void on_block_deserialized(DeserializeWork* work);
 
 	uv_timer_t m_timer;
 	uint64_t m_timerCounter;
@@ -199,16 +279,33 @@ private:
 		int m_port;
 		uint32_t m_numFailedConnections;
 		uint64_t m_lastSeen;
+		uint32_t m_relayDelay = DEFAULT_RELAY_DELAY_MS;
+		uint32_t m_pingTime = DEFAULT_RELAY_DELAY_MS;
+
+		// Lower is better, same units as P2PClient::relay_cost() plus a penalty for each failed connection
+		uint64_t score() const { return static_cast<uint64_t>(m_pingTime) + m_relayDelay + m_numFailedConnections * 1000ULL; }
 	};
 
+	// All peer list stats are saved to p2pool_peers.txt, so good peers are known right after a restart
+	// m_peerIndex maps addresses to positions in m_peerList, both are protected by m_peerListLock
 	std::vector<Peer> m_peerList;
+	unordered_map<raw_ip, size_t> m_peerIndex;
+
+	Peer* find_peer(const raw_ip& ip);
+	void add_peer(const Peer& peer);
+	void erase_peer(size_t index);
+	void rebuild_peer_index();
+
 	std::vector<Peer> m_peerListMonero;
 	std::atomic<uint64_t> m_peerListLastSaved;
 
 	struct Broadcast
 	{
-		std::vector<uint8_t> blob;
-		std::vector<uint8_t> pruned_blob;
+		hash id;
+		// Shared with the block
+		SharedBuf blob;
+		SharedBuf pruned_blob;
+		std::vector<uint8_t> compact_blob;
 		std::vector<hash> ancestor_hashes;
 	};
 
@@ -216,10 +313,46 @@ private:
 	uv_async_t m_broadcastAsync;
 	std::vector<Broadcast*> m_broadcastQueue;
 
+	// When each recent block was first received (milliseconds), used to measure how fast peers relay blocks
+	// Blocks broadcasted by us are marked as own, peers resending them are not measured
+	struct RelayTime
+	{
+		uint64_t m_time;
+		bool m_own;
+	};
+
+	unordered_map<hash, RelayTime> m_relayTimes;
+
+	void update_relay_delay(P2PClient* client, const hash& id);
+	void prune_relay_times();
+
 	bool m_lookForMissingBlocks;
-	unordered_set<std::pair<uint64_t, uint64_t>> m_missingBlockRequests;
 
-	P2PClient* m_fastestPeer;
+	// Missing blocks download scheduler, used only in the event loop thread
+	// Blocks are requested from all good peers (preferring faster peers) with up to m_syncPipeline requests in flight per peer
+	struct BlockDownload
+	{
+		P2PClient* m_client = nullptr;
+		uint32_t m_resetCounter = 0;
+		uint64_t m_requestTime = 0;
+		bool m_queued = false;
+		std::vector<uint64_t> m_triedPeers;
+	};
+
+	uint32_t m_syncPipeline;
+	unordered_map<hash, BlockDownload> m_blockDownloads;
+	std::deque<hash> m_blockDownloadQueue;
+
+	std::atomic<uint64_t> m_blocksDownloaded;
+	std::atomic<uint64_t> m_bytesDownloaded;
+	uint64_t m_syncReportTime;
+	uint64_t m_syncReportBlocks;
+	uint64_t m_syncReportBytes;
+
+	void queue_block_downloads(const std::vector<hash>& ids);
+	void dispatch_block_downloads();
+	void on_block_downloaded(P2PClient* client, const hash& id, uint32_t size);
+	void check_block_downloads();
 
 	static void on_broadcast(uv_async_t* handle) { reinterpret_cast<P2PServer*>(handle->data)->on_broadcast(); }
 	void on_broadcast();
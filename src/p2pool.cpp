@@ -27,6 +27,7 @@
 #include "side_chain.h"
 #include "stratum_server.h"
 #include "p2p_server.h"
+#include "block_cache.h"
 #ifdef WITH_RANDOMX
 #include "miner.h"
 #endif
@@ -36,6 +37,8 @@
 #include "p2pool_api.h"
 #include "pool_block.h"
 #include "keccak.h"
+#include "metrics.h"
+#include "trace.h"
 #include <thread>
 #include <fstream>
 
@@ -47,15 +50,30 @@ constexpr uint64_t SEEDHASH_EPOCH_LAG = 64;
 
 constexpr char FOUND_BLOCKS_FILE[] = "p2pool.blocks";
 
+// Mainchain headers file format:
+// magic (8 bytes), network type (8 bytes), number of headers (8 bytes)
+// then for each header: height, timestamp, reward, difficulty (lo, hi) (8 bytes each), id (32 bytes)
+// then keccak of everything above (32 bytes)
+constexpr char MAINCHAIN_HEADERS_FILE[] = "p2pool.mainchain";
+constexpr char MAINCHAIN_HEADERS_TMP_FILE[] = "p2pool.mainchain.tmp";
+constexpr uint8_t MAINCHAIN_HEADERS_MAGIC[8] = { 'P', '2', 'P', 'M', 'A', 'I', 'N', '1' };
+constexpr size_t MAINCHAIN_HEADER_SIZE = sizeof(uint64_t) * 5 + 32;
+
 namespace p2pool {
 
 p2pool::p2pool(int argc, char* argv[])
 	: m_stopped(false)
 	, m_params(new Params(argc, argv))
 	, m_updateSeed(true)
-	, m_submitBlockData{}
+	, m_mainchainByHeight(MAINCHAIN_RING_SIZE)
+	, m_mainchainMaxHeight(0)
+	, m_mainchainSize(0)
+	, m_mainchainPrunedHeight(0)
 	, m_zmqLastActive(0)
 	, m_startTime(seconds_since_epoch())
+	, m_startupTime(std::chrono::steady_clock::now())
+	, m_startupPhases{}
+	, m_startupReported(false)
 {
 	LOGINFO(1, log::LightCyan() << VERSION);
 
@@ -64,18 +82,51 @@ p2pool::p2pool(int argc, char* argv[])
 		throw std::exception();
 	}
 
+	m_submitEndpoints.push_back({ m_params->m_host, static_cast<int>(m_params->m_rpcPort), m_params->m_host + ':' + std::to_string(m_params->m_rpcPort) });
+
+	const std::string& submit_hosts = m_params->m_submitHosts;
+	for (size_t k1 = 0, k2; k1 < submit_hosts.length(); k1 = k2 + 1) {
+		k2 = submit_hosts.find(',', k1);
+		if (k2 == std::string::npos) {
+			k2 = submit_hosts.length();
+		}
+
+		const std::string address = submit_hosts.substr(k1, k2 - k1);
+		const size_t k = address.find_last_of(':');
+		const int port = (k != std::string::npos) ? atoi(address.c_str() + k + 1) : 0;
+
+		if ((port <= 0) || (port >= 65536)) {
+			LOGERR(1, "invalid IP:port " << address << " in --submit-hosts");
+			throw std::exception();
+		}
+
+		std::string ip = address.substr(0, k);
+		if ((ip.length() >= 2) && (ip.front() == '[') && (ip.back() == ']')) {
+			ip = ip.substr(1, ip.length() - 2);
+		}
+
+		m_submitEndpoints.push_back({ ip, port, address });
+	}
+
 	if (m_params->m_socks5Proxy.empty()) {
-		if (m_params->m_dns) {
-			bool is_v6;
-			if (!resolve_host(m_params->m_host, is_v6)) {
-				LOGERR(1, "resolve_host failed for " << m_params->m_host);
+		for (SubmitEndpoint& e : m_submitEndpoints) {
+			if (m_params->m_dns) {
+				bool is_v6;
+				if (!resolve_host(e.m_host, is_v6)) {
+					LOGERR(1, "resolve_host failed for " << e.m_host);
+					throw std::exception();
+				}
+			}
+			else if (e.m_host.find_first_not_of("0123456789.:") != std::string::npos) {
+				LOGERR(1, "Can't resolve hostname " << e.m_host << " with DNS disabled");
 				throw std::exception();
 			}
 		}
-		else if (m_params->m_host.find_first_not_of("0123456789.:") != std::string::npos) {
-			LOGERR(1, "Can't resolve hostname " << m_params->m_host << " with DNS disabled");
-			throw std::exception();
-		}
+		m_params->m_host = m_submitEndpoints.front().m_host;
+	}
+
+	if (m_submitEndpoints.size() > 1) {
+		LOGINFO(1, "found blocks will be submitted to " << m_submitEndpoints.size() << " Monero nodes");
 	}
 
 	hash pub, sec, eph_public_key;
@@ -96,14 +147,7 @@ p2pool::p2pool(int argc, char* argv[])
 		LOGWARN(1, "Mining to a stagenet wallet address");
 	}
 
-	int err = uv_async_init(uv_default_loop_checked(), &m_submitBlockAsync, on_submit_block);
-	if (err) {
-		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
-		throw std::exception();
-	}
-	m_submitBlockAsync.data = this;
-
-	err = uv_async_init(uv_default_loop_checked(), &m_blockTemplateAsync, on_update_block_template);
+	int err = uv_async_init(uv_default_loop_checked(), &m_blockTemplateAsync, on_update_block_template);
 	if (err) {
 		LOGERR(1, "uv_async_init failed, error " << uv_err_name(err));
 		throw std::exception();
@@ -130,17 +174,19 @@ p2pool::p2pool(int argc, char* argv[])
 #ifdef WITH_RANDOMX
 	uv_mutex_init_checked(&m_minerLock);
 #endif
-	uv_mutex_init_checked(&m_submitBlockDataLock);
+	uv_mutex_init_checked(&m_startupLock);
 
-	m_api = m_params->m_apiPath.empty() ? nullptr : new p2pool_api(m_params->m_apiPath, m_params->m_localStats);
+	m_api = (m_params->m_apiPath.empty() && m_params->m_apiHttpAddresses.empty()) ? nullptr : new p2pool_api(m_params->m_apiPath, m_params->m_localStats, m_params->m_apiHttpAddresses);
 
 	if (m_params->m_localStats && !m_api) {
-		LOGERR(1, "--local-api and --stratum-api command line parameters can't be used without --data-api");
+		LOGERR(1, "--local-api and --stratum-api command line parameters can't be used without --data-api or --http-api");
 		throw std::exception();
 	}
 
 	m_sideChain = new SideChain(this, type, m_params->m_mini ? "mini" : nullptr);
 
+	load_mainchain_headers();
+
 	if (m_params->m_p2pAddresses.empty()) {
 		const int p2p_port = m_sideChain->is_mini() ? DEFAULT_P2P_PORT_MINI : DEFAULT_P2P_PORT;
 
@@ -176,13 +222,21 @@ p2pool::p2pool(int argc, char* argv[])
 
 p2pool::~p2pool()
 {
+	save_mainchain_headers();
+
 	uv_rwlock_destroy(&m_mainchainLock);
 	uv_rwlock_destroy(&m_minerDataLock);
 	uv_mutex_destroy(&m_foundBlocksLock);
 #ifdef WITH_RANDOMX
 	uv_mutex_destroy(&m_minerLock);
 #endif
-	uv_mutex_destroy(&m_submitBlockDataLock);
+	uv_mutex_destroy(&m_startupLock);
+
+	// Only if p2pool was stopped before P2PServer started
+	for (PoolBlock* block : m_cachedBlocks) {
+		delete block;
+	}
+	delete m_blockCache;
 
 	delete m_api;
 	delete m_sideChain;
@@ -197,6 +251,11 @@ bool p2pool::calculate_hash(const void* data, size_t size, uint64_t height, cons
 	return m_hasher->calculate(data, size, height, seed, result);
 }
 
+bool p2pool::calculate_hashes(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results)
+{
+	return m_hasher->calculate_batch(blobs, blob_size, count, height, seed, results);
+}
+
 uint64_t p2pool::get_seed_height(uint64_t height)
 {
 	if (LIKELY(height > SEEDHASH_EPOCH_LAG)) {
@@ -209,12 +268,12 @@ bool p2pool::get_seed(uint64_t height, hash& seed) const
 {
 	ReadLock lock(m_mainchainLock);
 
-	auto it = m_mainchainByHeight.find(get_seed_height(height));
-	if (it == m_mainchainByHeight.end()) {
+	const ChainMain* c = mainchain_find(get_seed_height(height));
+	if (!c) {
 		return false;
 	}
 
-	seed = it->second.id;
+	seed = c->id;
 	return true;
 }
 
@@ -229,20 +288,32 @@ void p2pool::print_miner_status()
 }
 #endif
 
-void p2pool::handle_tx(TxMempoolData& tx)
+void p2pool::handle_txs(std::vector<TxMempoolData>& txs)
 {
-	if (!tx.weight || !tx.fee) {
-		LOGWARN(1, "invalid transaction: tx id = " << tx.id << ", size = " << tx.blob_size << ", weight = " << tx.weight << ", fee = " << static_cast<double>(tx.fee) / 1e6 << " um");
+	txs.erase(std::remove_if(txs.begin(), txs.end(),
+		[](const TxMempoolData& tx)
+		{
+			if (!tx.weight || !tx.fee) {
+				LOGWARN(1, "invalid transaction: tx id = " << tx.id << ", size = " << tx.blob_size << ", weight = " << tx.weight << ", fee = " << static_cast<double>(tx.fee) / 1e6 << " um");
+				return true;
+			}
+			return false;
+		}), txs.end());
+
+	if (txs.empty()) {
 		return;
 	}
 
-	m_mempool->add(tx);
+	// All transactions from one ZMQ message are added under a single lock
+	m_mempool->add_batch(txs);
 
-	LOGINFO(5,
-		"new tx id = " << log::LightBlue() << tx.id << log::NoColor() <<
-		", size = " << log::Gray() << tx.blob_size << log::NoColor() <<
-		", weight = " << log::Gray() << tx.weight << log::NoColor() <<
-		", fee = " << log::Gray() << static_cast<double>(tx.fee) / 1e6 << " um");
+	for (const TxMempoolData& tx : txs) {
+		LOGINFO(5,
+			"new tx id = " << log::LightBlue() << tx.id << log::NoColor() <<
+			", size = " << log::Gray() << tx.blob_size << log::NoColor() <<
+			", weight = " << log::Gray() << tx.weight << log::NoColor() <<
+			", fee = " << log::Gray() << static_cast<double>(tx.fee) / 1e6 << " um");
+	}
 
 #if TEST_MEMPOOL_PICKING_ALGORITHM
 	m_blockTemplate->update(miner_data(), *m_mempool, &m_params->m_wallet);
@@ -264,9 +335,9 @@ void p2pool::handle_miner_data(MinerData& data)
 	{
 		WriteLock lock(m_mainchainLock);
 
-		m_mainchainByHeight[data.height].difficulty = data.difficulty;
+		mainchain_get(data.height).difficulty = data.difficulty;
 
-		ChainMain& c = m_mainchainByHeight[data.height - 1];
+		ChainMain& c = mainchain_get(data.height - 1);
 		c.height = data.height - 1;
 		c.id = data.prev_id;
 
@@ -301,9 +372,9 @@ void p2pool::handle_miner_data(MinerData& data)
 		"\n---------------------------------------------------------------------------------------------------------------"
 	);
 
-	// Tx secret keys from all miners change every block, so cache can be cleared here
+	// Tx secret keys from all miners change every block, so old cache entries can be evicted here
 	if (m_sideChain->precalcFinished()) {
-		clear_crypto_cache();
+		age_crypto_cache();
 	}
 
 	if (!is_main_thread()) {
@@ -321,8 +392,8 @@ void p2pool::handle_miner_data(MinerData& data)
 			WriteLock lock(m_mainchainLock);
 
 			for (uint64_t h = data.height; h && (h + BLOCK_HEADERS_REQUIRED > data.height); --h) {
-				auto it = m_mainchainByHeight.find(h);
-				if ((it == m_mainchainByHeight.end()) || it->second.difficulty.empty()) {
+				const ChainMain* c = mainchain_find(h);
+				if (!c || c->difficulty.empty()) {
 					LOGWARN(3, "Mainchain data for height " << h << " is missing, requesting it from monerod again");
 					missing_heights.push_back(h);
 				}
@@ -368,7 +439,7 @@ void p2pool::handle_chain_main(ChainMain& data, const char* extra)
 	{
 		WriteLock lock(m_mainchainLock);
 
-		ChainMain& c = m_mainchainByHeight[data.height];
+		ChainMain& c = mainchain_get(data.height);
 		c.height = data.height;
 		c.timestamp = data.timestamp;
 		c.reward = data.reward;
@@ -417,56 +488,38 @@ void p2pool::handle_chain_main(ChainMain& data, const char* extra)
 	}
 
 	api_update_network_stats();
+	warm_up_submit_endpoints();
 
 	m_zmqLastActive = seconds_since_epoch();
 }
 
 void p2pool::submit_block_async(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
-	{
-		MutexLock lock(m_submitBlockDataLock);
-
-		m_submitBlockData.template_id = template_id;
-		m_submitBlockData.nonce = nonce;
-		m_submitBlockData.extra_nonce = extra_nonce;
-		m_submitBlockData.blob.clear();
-	}
+	SubmitBlockData data;
+	data.found_time = std::chrono::high_resolution_clock::now();
+	data.template_id = template_id;
+	data.nonce = nonce;
+	data.extra_nonce = extra_nonce;
 
-	// If p2pool is stopped, m_submitBlockAsync is most likely already closed
 	if (m_stopped) {
 		LOGWARN(0, "p2pool is shutting down, but a block was found. Trying to submit it anyway!");
-		submit_block();
-		return;
 	}
 
-	const int err = uv_async_send(&m_submitBlockAsync);
-	if (err) {
-		LOGERR(1, "uv_async_send failed, error " << uv_err_name(err));
-	}
+	// The request is built on the calling thread, JSONRPCRequest::call() then hands it to the main event loop which runs the RPC connections
+	submit_block(data);
 }
 
 void p2pool::submit_block_async(std::vector<uint8_t>&& blob)
 {
-	{
-		MutexLock lock(m_submitBlockDataLock);
-
-		m_submitBlockData.template_id = 0;
-		m_submitBlockData.nonce = 0;
-		m_submitBlockData.extra_nonce = 0;
-		m_submitBlockData.blob = std::move(blob);
-	}
+	SubmitBlockData data;
+	data.found_time = std::chrono::high_resolution_clock::now();
+	data.blob = std::move(blob);
 
-	// If p2pool is stopped, m_submitBlockAsync is most likely already closed
 	if (m_stopped) {
 		LOGWARN(0, "p2pool is shutting down, but a block was found. Trying to submit it anyway!");
-		submit_block();
-		return;
 	}
 
-	const int err = uv_async_send(&m_submitBlockAsync);
-	if (err) {
-		LOGERR(1, "uv_async_send failed, error " << uv_err_name(err));
-	}
+	submit_block(data);
 }
 
 bool init_signals(p2pool* pool, bool init);
@@ -481,7 +534,6 @@ void p2pool::on_stop(uv_async_t* async)
 		pool->m_api->on_stop();
 	}
 
-	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_submitBlockAsync), nullptr);
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_blockTemplateAsync), nullptr);
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_stopAsync), nullptr);
 	uv_close(reinterpret_cast<uv_handle_t*>(&pool->m_restartZMQAsync), nullptr);
@@ -493,14 +545,8 @@ void p2pool::on_stop(uv_async_t* async)
 	loop->data = nullptr;
 }
 
-void p2pool::submit_block() const
+void p2pool::submit_block(SubmitBlockData& submit_data)
 {
-	SubmitBlockData submit_data;
-	{
-		MutexLock lock(m_submitBlockDataLock);
-		submit_data = m_submitBlockData;
-	}
-
 	const uint64_t height = m_blockTemplate->height();
 	const difficulty_type diff = m_blockTemplate->difficulty();
 
@@ -522,96 +568,166 @@ void p2pool::submit_block() const
 		is_external = true;
 	}
 
+	std::vector<uint8_t>& blob = submit_data.blob;
+
+	if (nonce_offset && (nonce_offset + sizeof(submit_data.nonce) <= blob.size())) {
+		for (size_t i = 0; i < sizeof(submit_data.nonce); ++i) {
+			blob[nonce_offset + i] = static_cast<uint8_t>(submit_data.nonce >> (i * 8));
+		}
+	}
+
+	if (extra_nonce_offset && (extra_nonce_offset + sizeof(submit_data.extra_nonce) <= blob.size())) {
+		for (size_t i = 0; i < sizeof(submit_data.extra_nonce); ++i) {
+			blob[extra_nonce_offset + i] = static_cast<uint8_t>(submit_data.extra_nonce >> (i * 8));
+		}
+	}
+
+	static constexpr char request_prefix[] = "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"submit_block\",\"params\":[\"";
+	static constexpr char request_suffix[] = "\"]}";
+
 	std::string request;
-	request.reserve(submit_data.blob.size() * 2 + 128);
+	request.reserve(sizeof(request_prefix) + blob.size() * 2 + sizeof(request_suffix));
 
-	request = "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"submit_block\",\"params\":[\"";
+	request = request_prefix;
+	request.resize(request.length() + blob.size() * 2);
+	to_hex(blob.data(), blob.size(), &request[sizeof(request_prefix) - 1]);
+	request.append(request_suffix);
 
 	const uint32_t template_id = submit_data.template_id;
 	const uint32_t nonce = submit_data.nonce;
 	const uint32_t extra_nonce = submit_data.extra_nonce;
+	const auto found_time = submit_data.found_time;
 
-	for (size_t i = 0; i < submit_data.blob.size(); ++i) {
-		char buf[16];
+	// All endpoints get the block at once, each on its own keep-alive connection
+	for (uint32_t endpoint = 0; endpoint < m_submitEndpoints.size(); ++endpoint) {
+		const SubmitEndpoint& e = m_submitEndpoints[endpoint];
+		const std::string& name = e.m_name;
 
-		if (nonce_offset && nonce_offset <= i && i < nonce_offset + sizeof(submit_data.nonce)) {
-			snprintf(buf, sizeof(buf), "%02x", submit_data.nonce & 255);
-			submit_data.nonce >>= 8;
-		}
-		else if (extra_nonce_offset && extra_nonce_offset <= i && i < extra_nonce_offset + sizeof(submit_data.extra_nonce)) {
-			snprintf(buf, sizeof(buf), "%02x", submit_data.extra_nonce & 255);
-			submit_data.extra_nonce >>= 8;
-		}
-		else {
-			snprintf(buf, sizeof(buf), "%02x", submit_data.blob[i]);
-		}
+		JSONRPCRequest::call(e.m_host, e.m_rpcPort, request, m_params->m_rpcLogin, m_params->m_socks5Proxy,
+			[this, endpoint, name, height, diff, template_id, nonce, extra_nonce, is_external, found_time](const char* data, size_t size)
+			{
+				rapidjson::Document doc;
+				if (doc.Parse<rapidjson::kParseCommentsFlag | rapidjson::kParseTrailingCommasFlag>(data, size).HasParseError() || !doc.IsObject()) {
+					LOGERR(0, "submit_block: invalid JSON response from daemon " << name);
+					return;
+				}
 
-		request.append(buf);
-	}
-	request.append("\"]}");
+				if (doc.HasMember("error")) {
+					auto& err = doc["error"];
 
-	JSONRPCRequest::call(m_params->m_host, m_params->m_rpcPort, request, m_params->m_rpcLogin, m_params->m_socks5Proxy,
-		[height, diff, template_id, nonce, extra_nonce, is_external](const char* data, size_t size)
-		{
-			rapidjson::Document doc;
-			if (doc.Parse<rapidjson::kParseCommentsFlag | rapidjson::kParseTrailingCommasFlag>(data, size).HasParseError() || !doc.IsObject()) {
-				LOGERR(0, "submit_block: invalid JSON response from daemon");
-				return;
-			}
+					if (!err.IsObject()) {
+						LOGERR(0, "submit_block: invalid JSON reponse from daemon " << name << ": 'error' is not an object");
+						return;
+					}
+
+					const char* error_msg = nullptr;
 
-			if (doc.HasMember("error")) {
-				auto& err = doc["error"];
+					auto it = doc.FindMember("message");
+					if (it != doc.MemberEnd() && it->value.IsString()) {
+						error_msg = it->value.GetString();
+					}
 
-				if (!err.IsObject()) {
-					LOGERR(0, "submit_block: invalid JSON reponse from daemon: 'error' is not an object");
+					if (is_external) {
+						LOGWARN(3, "submit_block (external blob): daemon " << name << " returned error: " << (error_msg ? error_msg : "unknown error"));
+					}
+					else {
+						LOGERR(0, "submit_block: daemon " << name << " returned error: '" << (error_msg ? error_msg : "unknown error") << "', template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
+						add_submit_result(height, endpoint, found_time, false);
+					}
 					return;
 				}
 
-				const char* error_msg = nullptr;
-
-				auto it = doc.FindMember("message");
-				if (it != doc.MemberEnd() && it->value.IsString()) {
-					error_msg = it->value.GetString();
+				auto it = doc.FindMember("result");
+				if (it != doc.MemberEnd() && it->value.IsObject()) {
+					auto& result = it->value;
+					auto it2 = result.FindMember("status");
+					if (it2 != result.MemberEnd() && it2->value.IsString() && (strcmp(it2->value.GetString(), "OK") == 0)) {
+						LOGINFO(0, log::LightGreen() << "submit_block: BLOCK ACCEPTED at height " << height << " and difficulty = " << diff << " by " << name);
+						if (!is_external) {
+							add_submit_result(height, endpoint, found_time, true);
+						}
+						return;
+					}
 				}
 
-				if (is_external) {
-					LOGWARN(3, "submit_block (external blob): daemon returned error: " << (error_msg ? error_msg : "unknown error"));
-				}
-				else {
-					LOGERR(0, "submit_block: daemon returned error: '" << (error_msg ? error_msg : "unknown error") << "', template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
-				}
-				return;
-			}
+				LOGWARN(0, "submit_block: daemon " << name << " sent unrecognizable reply: " << log::const_buf(data, size));
+			},
+			[this, endpoint, name, height, is_external, found_time](const char* data, size_t size)
+			{
+				metrics::submit_block.add(std::chrono::high_resolution_clock::now() - found_time);
 
-			auto it = doc.FindMember("result");
-			if (it != doc.MemberEnd() && it->value.IsObject()) {
-				auto& result = it->value;
-				auto it2 = result.FindMember("status");
-				if (it2 != result.MemberEnd() && it2->value.IsString() && (strcmp(it2->value.GetString(), "OK") == 0)) {
-					LOGINFO(0, log::LightGreen() << "submit_block: BLOCK ACCEPTED at height " << height << " and difficulty = " << diff);
-					return;
+				if (size > 0) {
+					if (is_external) {
+						LOGWARN(3, "submit_block (external blob): RPC request to " << name << " failed, error " << log::const_buf(data, size));
+					}
+					else {
+						LOGERR(0, "submit_block: RPC request to " << name << " failed, error " << log::const_buf(data, size));
+						add_submit_result(height, endpoint, found_time, false);
+					}
 				}
+			});
+	}
+}
+
+void p2pool::add_submit_result(uint64_t height, uint32_t endpoint, const std::chrono::high_resolution_clock::time_point& found_time, bool accepted)
+{
+	if (!m_api) {
+		return;
+	}
+
+	using namespace std::chrono;
+	const int64_t dt = duration_cast<microseconds>(high_resolution_clock::now() - found_time).count();
+	const SubmitResult result{ height, endpoint, static_cast<uint32_t>(std::min<int64_t>(std::max<int64_t>(dt, 0), std::numeric_limits<uint32_t>::max())), accepted };
+
+	bool found = false;
+	{
+		MutexLock lock(m_foundBlocksLock);
+
+		// monerod usually responds before the new block comes through ZMQ, but it's not guaranteed
+		for (auto i = m_foundBlocks.rbegin(); (i != m_foundBlocks.rend()) && (i->height >= height); ++i) {
+			if (i->height == height) {
+				i->submit_results.push_back(result);
+				found = true;
+				break;
 			}
+		}
 
-			LOGWARN(0, "submit_block: daemon sent unrecognizable reply: " << log::const_buf(data, size));
-		},
-		[is_external](const char* data, size_t size)
-		{
-			if (size > 0) {
-				if (is_external) {
-					LOGWARN(3, "submit_block (external blob): RPC request failed, error " << log::const_buf(data, size));
-				}
-				else {
-					LOGERR(0, "submit_block: RPC request failed, error " << log::const_buf(data, size));
+		if (!found) {
+			m_pendingSubmitResults.erase(
+				std::remove_if(m_pendingSubmitResults.begin(), m_pendingSubmitResults.end(), [height](const SubmitResult& r) { return r.height + 10 < height; }),
+				m_pendingSubmitResults.end());
+
+			m_pendingSubmitResults.push_back(result);
+		}
+	}
+
+	if (found) {
+		api_update_block_found(nullptr, nullptr);
+	}
+}
+
+void p2pool::warm_up_submit_endpoints() const
+{
+	// --host gets RPC requests all the time, other endpoints need one per block to keep their connections alive
+	for (size_t i = 1; i < m_submitEndpoints.size(); ++i) {
+		const SubmitEndpoint& e = m_submitEndpoints[i];
+		const std::string& name = e.m_name;
+
+		JSONRPCRequest::call(e.m_host, e.m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_version\"}", m_params->m_rpcLogin, m_params->m_socks5Proxy,
+			[](const char*, size_t) {},
+			[name](const char* data, size_t size)
+			{
+				if (size > 0) {
+					LOGWARN(3, "submit endpoint " << name << " is unreachable, error " << log::const_buf(data, size));
 				}
-			}
-		});
+			});
+	}
 }
 
-void p2pool::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
+hash p2pool::submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce)
 {
 	LOGINFO(3, "submit_sidechain_block: template id = " << template_id << ", nonce = " << nonce << ", extra_nonce = " << extra_nonce);
-	m_blockTemplate->submit_sidechain_block(template_id, nonce, extra_nonce);
+	return m_blockTemplate->submit_sidechain_block(template_id, nonce, extra_nonce);
 }
 
 void p2pool::update_block_template_async(bool is_alternative_block)
@@ -631,13 +747,30 @@ void p2pool::update_block_template_async(bool is_alternative_block)
 
 void p2pool::update_block_template()
 {
+	TraceSpan span("update_block_template");
+
 	MinerData data = miner_data();
 
 	if (m_updateSeed) {
 		m_hasher->set_seed_async(data.seed_hash);
 		m_updateSeed = false;
+
+		// The next seed is known SEEDHASH_EPOCH_LAG blocks before it's used
+		hash next_seed;
+		if (get_seed(data.height + SEEDHASH_EPOCH_LAG, next_seed) && (next_seed != data.seed_hash)) {
+			m_hasher->prefetch_seed_async(next_seed);
+		}
 	}
 	m_blockTemplate->update(data, *m_mempool, &m_params->m_wallet);
+
+	// Traced by the sidechain tip this template was built on
+	if (trace::enabled) {
+		const std::shared_ptr<const BlockTemplate::Snapshot> t = m_blockTemplate->snapshot();
+		if (t && t->m_poolBlockTemplate) {
+			span.set_id(t->m_poolBlockTemplate->m_parent);
+		}
+	}
+
 	stratum_on_block();
 	api_update_pool_stats();
 
@@ -654,6 +787,8 @@ void p2pool::update_block_template()
 
 void p2pool::download_block_headers(uint64_t current_height)
 {
+	startup_phase_begin(StartupPhase::MAINCHAIN_HEADERS);
+
 	const uint64_t seed_height = get_seed_height(current_height);
 	const uint64_t prev_seed_height = (seed_height > SEEDHASH_EPOCH_BLOCKS) ? (seed_height - SEEDHASH_EPOCH_BLOCKS) : 0;
 
@@ -692,47 +827,108 @@ void p2pool::download_block_headers(uint64_t current_height)
 
 	const uint64_t start_height = (current_height > BLOCK_HEADERS_REQUIRED) ? (current_height - BLOCK_HEADERS_REQUIRED) : 0;
 
+	// Headers loaded from p2pool.mainchain don't need to be downloaded again
+	// The last loaded header is downloaded too to check that it's still in the chain
+	uint64_t delta_start = start_height;
+	hash delta_start_id;
+	{
+		ReadLock lock(m_mainchainLock);
+
+		uint64_t first_missing = start_height;
+		for (; first_missing < current_height; ++first_missing) {
+			const ChainMain* c = mainchain_find(first_missing);
+			if (!c || c->id.empty() || !c->timestamp || c->difficulty.empty()) {
+				break;
+			}
+		}
+
+		if (first_missing > start_height) {
+			delta_start = first_missing - 1;
+			delta_start_id = mainchain_find(delta_start)->id;
+			LOGINFO(1, "using " << delta_start - start_height << " saved mainchain headers");
+		}
+	}
+
 	s.m_pos = 0;
-	s << "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_block_headers_range\",\"params\":{\"start_height\":" << start_height << ",\"end_height\":" << current_height - 1 << "}}\0";
+	s << "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_block_headers_range\",\"params\":{\"start_height\":" << delta_start << ",\"end_height\":" << current_height - 1 << "}}\0";
 
 	JSONRPCRequest::call(m_params->m_host, m_params->m_rpcPort, buf, m_params->m_rpcLogin, m_params->m_socks5Proxy,
-		[this, start_height, current_height](const char* data, size_t size)
+		[this, start_height, delta_start, delta_start_id, current_height](const char* data, size_t size)
 		{
-			if (parse_block_headers_range(data, size) == current_height - start_height) {
-				update_median_timestamp();
-				if (m_serversStarted.exchange(1) == 0) {
-					try {
-						m_ZMQReader = new ZMQReader(m_params->m_host, m_params->m_zmqPort, m_params->m_socks5Proxy, this);
-					}
-					catch (const std::exception& e) {
-						LOGERR(1, "Couldn't start ZMQ reader: exception " << e.what());
-						panic();
+			if (parse_block_headers_range(data, size) == current_height - delta_start) {
+				if (delta_start > start_height) {
+					bool reorg = false;
+					{
+						WriteLock lock(m_mainchainLock);
+
+						const ChainMain* c = mainchain_find(delta_start);
+						if (!c || (c->id != delta_start_id)) {
+							reorg = true;
+							for (uint64_t h = start_height; h < delta_start; ++h) {
+								mainchain_erase(h);
+							}
+						}
 					}
 
-					m_stratumServer = new StratumServer(this);
-					m_p2pServer = new P2PServer(this);
-#ifdef WITH_RANDOMX
-					if (m_params->m_minerThreads) {
-						start_mining(m_params->m_minerThreads);
+					if (reorg) {
+						LOGWARN(1, "saved mainchain headers are not in the current chain, downloading all headers");
+						download_block_headers(current_height);
+						return;
 					}
-#endif
-					api_update_network_stats();
 				}
+
+				update_median_timestamp();
+				startup_phase_end(StartupPhase::MAINCHAIN_HEADERS);
+
+				m_mainchainHeadersReady = true;
+				start_servers();
 			}
 			else {
-				LOGERR(1, "fatal error: couldn't download block headers for heights " << start_height << " - " << current_height - 1);
+				LOGERR(1, "fatal error: couldn't download block headers for heights " << delta_start << " - " << current_height - 1);
 				panic();
 			}
 		},
-		[start_height, current_height](const char* data, size_t size)
+		[delta_start, current_height](const char* data, size_t size)
 		{
 			if (size > 0) {
-				LOGERR(1, "fatal error: couldn't download block headers for heights " << start_height << " - " << current_height - 1 << ", error " << log::const_buf(data, size));
+				LOGERR(1, "fatal error: couldn't download block headers for heights " << delta_start << " - " << current_height - 1 << ", error " << log::const_buf(data, size));
 				panic();
 			}
 		});
 }
 
+void p2pool::start_servers()
+{
+	if (!m_mainchainHeadersReady || m_blockCacheLoading || m_stopped) {
+		return;
+	}
+
+	if (m_serversStarted.exchange(1)) {
+		return;
+	}
+
+	startup_phase_begin(StartupPhase::SERVERS);
+
+	try {
+		m_ZMQReader = new ZMQReader(m_params->m_host, m_params->m_zmqPort, m_params->m_socks5Proxy, this);
+	}
+	catch (const std::exception& e) {
+		LOGERR(1, "Couldn't start ZMQ reader: exception " << e.what());
+		panic();
+	}
+
+	m_stratumServer = new StratumServer(this);
+	m_p2pServer = new P2PServer(this);
+#ifdef WITH_RANDOMX
+	if (m_params->m_minerThreads) {
+		start_mining(m_params->m_minerThreads);
+	}
+#endif
+	api_update_network_stats();
+
+	startup_phase_end(StartupPhase::SERVERS);
+}
+
 bool p2pool::chainmain_get_by_hash(const hash& id, ChainMain& data) const
 {
 	ReadLock lock(m_mainchainLock);
@@ -750,18 +946,20 @@ bool p2pool::get_timestamps(uint64_t (&timestamps)[TIMESTAMP_WINDOW]) const
 {
 	ReadLock lock(m_mainchainLock);
 
-	if (m_mainchainByHeight.size() <= TIMESTAMP_WINDOW) {
+	if (m_mainchainSize <= TIMESTAMP_WINDOW) {
 		return false;
 	}
 
-	auto it = m_mainchainByHeight.end();
+	int i = 0;
 
-	for (int i = 0; (i < TIMESTAMP_WINDOW) && (it != m_mainchainByHeight.begin()); ++i) {
-		--it;
-		timestamps[i] = it->second.timestamp;
+	for (uint64_t h = m_mainchainMaxHeight, k = 0; (i < TIMESTAMP_WINDOW) && (k < MAINCHAIN_RING_SIZE) && (h <= m_mainchainMaxHeight); --h, ++k) {
+		const ChainMain* c = mainchain_find(h);
+		if (c) {
+			timestamps[i++] = c->timestamp;
+		}
 	}
 
-	return true;
+	return (i == TIMESTAMP_WINDOW);
 }
 
 void p2pool::update_median_timestamp()
@@ -911,7 +1109,12 @@ void p2pool::parse_get_info_rpc(const char* data, size_t size)
 		panic();
 	}
 
-	get_version();
+	startup_phase_end(StartupPhase::MONEROD_INFO);
+
+	m_monerodInfoChecked = true;
+	if (m_monerodVersionChecked) {
+		get_miner_data();
+	}
 }
 
 void p2pool::get_version()
@@ -981,11 +1184,17 @@ void p2pool::parse_get_version_rpc(const char* data, size_t size)
 		panic();
 	}
 
-	get_miner_data();
+	startup_phase_end(StartupPhase::MONEROD_VERSION);
+
+	m_monerodVersionChecked = true;
+	if (m_monerodInfoChecked) {
+		get_miner_data();
+	}
 }
 
 void p2pool::get_miner_data()
 {
+	startup_phase_begin(StartupPhase::MINER_DATA);
 	m_getMinerDataPending = true;
 
 	JSONRPCRequest::call(m_params->m_host, m_params->m_rpcPort, "{\"jsonrpc\":\"2.0\",\"id\":\"0\",\"method\":\"get_miner_data\"}", m_params->m_rpcLogin, m_params->m_socks5Proxy,
@@ -1065,6 +1274,8 @@ void p2pool::parse_get_miner_data_rpc(const char* data, size_t size)
 	}
 
 	handle_miner_data(minerData);
+	startup_phase_end(StartupPhase::MINER_DATA);
+
 	download_block_headers(minerData.height);
 }
 
@@ -1102,7 +1313,7 @@ bool p2pool::parse_block_header(const char* data, size_t size, ChainMain& c)
 
 	{
 		WriteLock lock(m_mainchainLock);
-		m_mainchainByHeight[c.height] = c;
+		mainchain_get(c.height) = c;
 		m_mainchainByHash[c.id] = c;
 	}
 
@@ -1151,7 +1362,7 @@ uint32_t p2pool::parse_block_headers_range(const char* data, size_t size)
 		if (PARSE(*i, c, height) && PARSE(*i, c, timestamp) && PARSE(*i, c, reward) && parseValue(*i, "hash", c.id)) {
 			min_height = std::min(min_height, c.height);
 			max_height = std::max(max_height, c.height);
-			m_mainchainByHeight[c.height] = c;
+			mainchain_get(c.height) = c;
 			m_mainchainByHash[c.id] = c;
 			++num_headers_parsed;
 		}
@@ -1309,20 +1520,210 @@ void p2pool::cleanup_mainchain_data(uint64_t height)
 	const uint64_t seed_height = get_seed_height(height);
 	const std::array<uint64_t, 3> seed_heights{ seed_height, seed_height - SEEDHASH_EPOCH_BLOCKS, seed_height - SEEDHASH_EPOCH_BLOCKS * 2 };
 
-	for (auto it = m_mainchainByHeight.begin(); it != m_mainchainByHeight.end();) {
-		const uint64_t h = it->first;
-		if (h + PRUNE_DISTANCE >= height) {
-			break;
+	if (height <= PRUNE_DISTANCE) {
+		return;
+	}
+
+	const uint64_t prune_height = height - PRUNE_DISTANCE;
+
+	if (m_mainchainPrunedHeight + MAINCHAIN_RING_SIZE < prune_height) {
+		// Headers loaded from p2pool.mainchain (or the first call) can be older than the range below, so every slot is checked once
+		for (const MainchainSlot& slot : m_mainchainByHeight) {
+			const uint64_t h = slot.m_header.height;
+			if (slot.m_used && (h < prune_height) && (std::find(seed_heights.begin(), seed_heights.end(), h) == seed_heights.end())) {
+				mainchain_erase(h);
+			}
+		}
+	}
+	else {
+		// Only heights which became too old since the last call are checked, older ones are already pruned
+		for (uint64_t h = m_mainchainPrunedHeight; h < prune_height; ++h) {
+			if (std::find(seed_heights.begin(), seed_heights.end(), h) == seed_heights.end()) {
+				mainchain_erase(h);
+			}
 		}
+	}
+
+	// The oldest seed height from the previous epoch is not needed anymore
+	if (seed_height >= SEEDHASH_EPOCH_BLOCKS * 3) {
+		mainchain_erase(seed_height - SEEDHASH_EPOCH_BLOCKS * 3);
+	}
+
+	m_mainchainPrunedHeight = std::max(m_mainchainPrunedHeight, prune_height);
+}
+
+const ChainMain* p2pool::mainchain_find(uint64_t height) const
+{
+	const MainchainSlot& slot = m_mainchainByHeight[height % MAINCHAIN_RING_SIZE];
+	return (slot.m_used && (slot.m_header.height == height)) ? &slot.m_header : nullptr;
+}
+
+// Returns the header at this height, adding an empty one if it's not there yet (same as std::map::operator[])
+ChainMain& p2pool::mainchain_get(uint64_t height)
+{
+	MainchainSlot& slot = m_mainchainByHeight[height % MAINCHAIN_RING_SIZE];
+
+	if (slot.m_used && (slot.m_header.height == height)) {
+		return slot.m_header;
+	}
+
+	if (slot.m_used) {
+		m_mainchainByHash.erase(slot.m_header.id);
+	}
+	else {
+		++m_mainchainSize;
+	}
+
+	slot.m_header = ChainMain();
+	slot.m_header.height = height;
+	slot.m_used = true;
 
-		if (std::find(seed_heights.begin(), seed_heights.end(), h) == seed_heights.end()) {
-			m_mainchainByHash.erase(it->second.id);
-			it = m_mainchainByHeight.erase(it);
+	m_mainchainMaxHeight = std::max(m_mainchainMaxHeight, height);
+
+	return slot.m_header;
+}
+
+void p2pool::mainchain_erase(uint64_t height)
+{
+	MainchainSlot& slot = m_mainchainByHeight[height % MAINCHAIN_RING_SIZE];
+
+	if (slot.m_used && (slot.m_header.height == height)) {
+		m_mainchainByHash.erase(slot.m_header.id);
+		slot.m_used = false;
+		--m_mainchainSize;
+	}
+}
+
+void p2pool::save_mainchain_headers() const
+{
+	std::vector<uint8_t> data;
+	{
+		ReadLock lock(m_mainchainLock);
+
+		data.reserve(sizeof(MAINCHAIN_HEADERS_MAGIC) + sizeof(uint64_t) * 2 + m_mainchainSize * MAINCHAIN_HEADER_SIZE + HASH_SIZE);
+		data.insert(data.end(), MAINCHAIN_HEADERS_MAGIC, MAINCHAIN_HEADERS_MAGIC + sizeof(MAINCHAIN_HEADERS_MAGIC));
+
+		const uint64_t network_type = static_cast<uint64_t>(m_sideChain->network_type());
+		data.insert(data.end(), reinterpret_cast<const uint8_t*>(&network_type), reinterpret_cast<const uint8_t*>(&network_type) + sizeof(uint64_t));
+
+		const size_t count_offset = data.size();
+		data.resize(data.size() + sizeof(uint64_t));
+
+		auto write = [&data](uint64_t value)
+		{
+			data.insert(data.end(), reinterpret_cast<const uint8_t*>(&value), reinterpret_cast<const uint8_t*>(&value) + sizeof(uint64_t));
+		};
+
+		uint64_t count = 0;
+		for (const MainchainSlot& slot : m_mainchainByHeight) {
+			const ChainMain& c = slot.m_header;
+
+			// Skip incomplete headers, they will be downloaded again
+			if (!slot.m_used || c.id.empty() || !c.timestamp || c.difficulty.empty()) {
+				continue;
+			}
+
+			write(c.height);
+			write(c.timestamp);
+			write(c.reward);
+			write(c.difficulty.lo);
+			write(c.difficulty.hi);
+			data.insert(data.end(), c.id.h, c.id.h + HASH_SIZE);
+			++count;
 		}
-		else {
-			++it;
+
+		if (!count) {
+			return;
+		}
+
+		memcpy(data.data() + count_offset, &count, sizeof(count));
+	}
+
+	hash checksum;
+	keccak(data.data(), static_cast<int>(data.size()), checksum.h, HASH_SIZE);
+	data.insert(data.end(), checksum.h, checksum.h + HASH_SIZE);
+
+	{
+		std::ofstream f(MAINCHAIN_HEADERS_TMP_FILE, std::ios::binary);
+		if (!f.is_open()) {
+			LOGERR(1, "couldn't open " << MAINCHAIN_HEADERS_TMP_FILE);
+			return;
+		}
+		f.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!f.good()) {
+			LOGERR(1, "couldn't write " << MAINCHAIN_HEADERS_TMP_FILE);
+			return;
+		}
+	}
+
+	std::remove(MAINCHAIN_HEADERS_FILE);
+	if (std::rename(MAINCHAIN_HEADERS_TMP_FILE, MAINCHAIN_HEADERS_FILE) != 0) {
+		LOGERR(1, "couldn't rename " << MAINCHAIN_HEADERS_TMP_FILE << " to " << MAINCHAIN_HEADERS_FILE);
+		return;
+	}
+
+	LOGINFO(4, "saved mainchain headers to " << MAINCHAIN_HEADERS_FILE);
+}
+
+void p2pool::load_mainchain_headers()
+{
+	std::vector<uint8_t> data;
+	{
+		std::ifstream f(MAINCHAIN_HEADERS_FILE, std::ios::binary);
+		if (!f.is_open()) {
+			return;
 		}
+		data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	}
+
+	constexpr size_t header_size = sizeof(MAINCHAIN_HEADERS_MAGIC) + sizeof(uint64_t) * 2;
+
+	if ((data.size() < header_size + HASH_SIZE) || memcmp(data.data(), MAINCHAIN_HEADERS_MAGIC, sizeof(MAINCHAIN_HEADERS_MAGIC))) {
+		LOGWARN(1, MAINCHAIN_HEADERS_FILE << " is corrupted, ignoring it");
+		return;
+	}
+
+	hash checksum;
+	keccak(data.data(), static_cast<int>(data.size() - HASH_SIZE), checksum.h, HASH_SIZE);
+	if (memcmp(checksum.h, data.data() + data.size() - HASH_SIZE, HASH_SIZE)) {
+		LOGWARN(1, MAINCHAIN_HEADERS_FILE << " has invalid checksum, ignoring it");
+		return;
+	}
+
+	uint64_t network_type, count;
+	memcpy(&network_type, data.data() + sizeof(MAINCHAIN_HEADERS_MAGIC), sizeof(uint64_t));
+	memcpy(&count, data.data() + sizeof(MAINCHAIN_HEADERS_MAGIC) + sizeof(uint64_t), sizeof(uint64_t));
+
+	if (network_type != static_cast<uint64_t>(m_sideChain->network_type())) {
+		LOGWARN(1, MAINCHAIN_HEADERS_FILE << " was saved for a different network, ignoring it");
+		return;
+	}
+
+	if (count != (data.size() - header_size - HASH_SIZE) / MAINCHAIN_HEADER_SIZE) {
+		LOGWARN(1, MAINCHAIN_HEADERS_FILE << " is corrupted, ignoring it");
+		return;
+	}
+
+	WriteLock lock(m_mainchainLock);
+
+	for (const uint8_t* p = data.data() + header_size, *e = p + count * MAINCHAIN_HEADER_SIZE; p < e; p += MAINCHAIN_HEADER_SIZE) {
+		ChainMain c;
+
+		memcpy(&c.height, p, sizeof(uint64_t));
+		memcpy(&c.timestamp, p + sizeof(uint64_t), sizeof(uint64_t));
+		memcpy(&c.reward, p + sizeof(uint64_t) * 2, sizeof(uint64_t));
+		memcpy(&c.difficulty.lo, p + sizeof(uint64_t) * 3, sizeof(uint64_t));
+		memcpy(&c.difficulty.hi, p + sizeof(uint64_t) * 4, sizeof(uint64_t));
+		memcpy(c.id.h, p + sizeof(uint64_t) * 5, HASH_SIZE);
+
+		mainchain_get(c.height) = c;
+		m_mainchainByHash[c.id] = c;
 	}
+
+	// Old headers from the file are pruned the same way as the ones which come from monerod
+	cleanup_mainchain_data(m_mainchainMaxHeight);
+
+	LOGINFO(1, "loaded " << m_mainchainSize << " mainchain headers from " << MAINCHAIN_HEADERS_FILE);
 }
 
 void p2pool::api_update_block_found(const ChainMain* data, const PoolBlock* block)
@@ -1349,12 +1750,23 @@ void p2pool::api_update_block_found(const ChainMain* data, const PoolBlock* bloc
 		MutexLock lock(m_foundBlocksLock);
 		if (data) {
 			m_foundBlocks.emplace_back(cur_time, data->height, data->id, diff, total_hashes);
+
+			FoundBlock& b = m_foundBlocks.back();
+			for (auto i = m_pendingSubmitResults.begin(); i != m_pendingSubmitResults.end();) {
+				if (i->height == b.height) {
+					b.submit_results.push_back(*i);
+					i = m_pendingSubmitResults.erase(i);
+				}
+				else {
+					++i;
+				}
+			}
 		}
 		found_blocks.assign(m_foundBlocks.end() - std::min<size_t>(m_foundBlocks.size(), 51), m_foundBlocks.end());
 	}
 
 	m_api->set(p2pool_api::Category::POOL, "blocks",
-		[&found_blocks](log::Stream& s)
+		[this, &found_blocks](log::Stream& s)
 		{
 			s << '[';
 			bool first = true;
@@ -1366,7 +1778,23 @@ void p2pool::api_update_block_found(const ChainMain* data, const PoolBlock* bloc
 					<< "\"hash\":\"" << i->id << "\","
 					<< "\"difficulty\":" << i->block_diff << ','
 					<< "\"totalHashes\":" << i->total_hashes << ','
-					<< "\"ts\":" << i->timestamp << '}';
+					<< "\"ts\":" << i->timestamp;
+
+				if (!i->submit_results.empty()) {
+					s << ",\"submit\":[";
+					for (size_t j = 0; j < i->submit_results.size(); ++j) {
+						const SubmitResult& r = i->submit_results[j];
+						if (j) {
+							s << ',';
+						}
+						s << "{\"host\":\"" << m_submitEndpoints[r.endpoint].m_name << "\","
+							<< "\"accepted\":" << (r.accepted ? "true" : "false") << ','
+							<< "\"ms\":" << r.latency_us * 1e-3 << '}';
+					}
+					s << ']';
+				}
+
+				s << '}';
 				first = false;
 			}
 			s << ']';
@@ -1379,12 +1807,12 @@ bool p2pool::get_difficulty_at_height(uint64_t height, difficulty_type& diff)
 {
 	ReadLock lock(m_mainchainLock);
 
-	auto it = m_mainchainByHeight.find(height);
-	if (it == m_mainchainByHeight.end()) {
+	const ChainMain* c = mainchain_find(height);
+	if (!c) {
 		return false;
 	}
 
-	diff = it->second.difficulty;
+	diff = c->difficulty;
 	return true;
 }
 
@@ -1525,6 +1953,167 @@ void p2pool::restart_zmq()
 	}
 }
 
+BlockCache* p2pool::take_block_cache(std::vector<PoolBlock*>& blocks)
+{
+	BlockCache* cache = m_blockCache;
+	m_blockCache = nullptr;
+
+	blocks.swap(m_cachedBlocks);
+	m_cachedBlocks.clear();
+
+	return cache;
+}
+
+void p2pool::load_block_cache_async()
+{
+	if (!m_params->m_blockCache) {
+		return;
+	}
+
+	struct Work
+	{
+		p2pool* pool;
+		uv_work_t req;
+	};
+
+	Work* work = new Work{ this, {} };
+	work->req.data = work;
+
+	m_blockCacheLoading = true;
+	startup_phase_begin(StartupPhase::BLOCK_CACHE);
+
+	const int err = uv_queue_work_lane(uv_default_loop_checked(), WorkLane::BACKGROUND, &work->req,
+		[](uv_work_t* req)
+		{
+			bkg_jobs_tracker.start("p2pool::load_block_cache_async");
+			reinterpret_cast<Work*>(req->data)->pool->load_block_cache();
+		},
+		[](uv_work_t* req, int)
+		{
+			Work* work = reinterpret_cast<Work*>(req->data);
+			p2pool* pool = work->pool;
+			delete work;
+
+			pool->m_blockCacheLoading = false;
+			pool->start_servers();
+
+			bkg_jobs_tracker.stop("p2pool::load_block_cache_async");
+		});
+
+	if (err) {
+		LOGERR(1, "load_block_cache_async: uv_queue_work failed, error " << uv_err_name(err));
+		delete work;
+		load_block_cache();
+		m_blockCacheLoading = false;
+	}
+}
+
+void p2pool::load_block_cache()
+{
+	if (!m_stopped) {
+		m_blockCache = new BlockCache(*m_sideChain);
+		m_sideChain->load_chain_state();
+		m_blockCache->load_all(*m_sideChain, m_cachedBlocks);
+		m_sideChain->trust_cached_blocks(m_cachedBlocks);
+	}
+
+	startup_phase_end(StartupPhase::BLOCK_CACHE);
+}
+
+// Saved mainchain headers usually have both current RandomX seeds, so the dataset can be ready by the time monerod answers
+// If they're outdated, the real seeds from get_miner_data and download_block_headers() replace them
+void p2pool::predict_seeds()
+{
+	hash seed, old_seed;
+	{
+		ReadLock lock(m_mainchainLock);
+
+		if (!m_mainchainSize) {
+			return;
+		}
+
+		const uint64_t seed_height = get_seed_height(m_mainchainMaxHeight + 1);
+		const uint64_t prev_seed_height = (seed_height > SEEDHASH_EPOCH_BLOCKS) ? (seed_height - SEEDHASH_EPOCH_BLOCKS) : 0;
+
+		const ChainMain* c = mainchain_find(seed_height);
+		const ChainMain* prev = mainchain_find(prev_seed_height);
+
+		if (!c || !prev || c->id.empty() || prev->id.empty()) {
+			return;
+		}
+
+		seed = c->id;
+		old_seed = prev->id;
+	}
+
+	LOGINFO(1, "using RandomX seeds from " << MAINCHAIN_HEADERS_FILE);
+	m_hasher->set_seeds_async(seed, old_seed);
+}
+
+static constexpr const char* startup_phase_names[] = {
+	"monerod get_info",
+	"monerod get_version",
+	"get_miner_data",
+	"mainchain headers",
+	"RandomX cache and dataset",
+	"block cache",
+	"ZMQ, stratum and p2p servers",
+};
+
+static_assert(array_size(startup_phase_names) == static_cast<size_t>(p2pool::StartupPhase::COUNT), "Update startup_phase_names");
+
+void p2pool::startup_phase_begin(StartupPhase phase)
+{
+	const uint64_t t = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_startupTime).count());
+
+	MutexLock lock(m_startupLock);
+
+	StartupPhaseTiming& p = m_startupPhases[static_cast<size_t>(phase)];
+	if (!p.m_started && !m_startupReported) {
+		p.m_started = true;
+		p.m_beginUs = t;
+	}
+}
+
+void p2pool::startup_phase_end(StartupPhase phase)
+{
+	const uint64_t t = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_startupTime).count());
+
+	MutexLock lock(m_startupLock);
+
+	StartupPhaseTiming& p = m_startupPhases[static_cast<size_t>(phase)];
+	if (!p.m_started || p.m_finished || m_startupReported) {
+		return;
+	}
+
+	p.m_finished = true;
+	p.m_endUs = t;
+
+	if (!m_startupPhases[static_cast<size_t>(StartupPhase::SERVERS)].m_finished) {
+		return;
+	}
+
+	for (const StartupPhaseTiming& k : m_startupPhases) {
+		if (k.m_started && !k.m_finished) {
+			return;
+		}
+	}
+
+	m_startupReported = true;
+
+	const double ready = static_cast<double>(m_startupPhases[static_cast<size_t>(StartupPhase::SERVERS)].m_endUs) * 1e-6;
+	LOGINFO(1, log::LightCyan() << "startup finished, servers started after " << ready << " s" << log::NoColor() << ", phase timings (start - end):");
+
+	for (size_t i = 0; i < array_size(m_startupPhases); ++i) {
+		const StartupPhaseTiming& k = m_startupPhases[i];
+		if (k.m_started) {
+			const double begin = static_cast<double>(k.m_beginUs) * 1e-6;
+			const double end = static_cast<double>(k.m_endUs) * 1e-6;
+			LOGINFO(1, startup_phase_names[i] << ": " << begin << " - " << end << " s (" << end - begin << " s)");
+		}
+	}
+}
+
 int p2pool::run()
 {
 	if (!m_params->valid()) {
@@ -1537,6 +2126,9 @@ int p2pool::run()
 		return 1;
 	}
 
+	init_work_lanes(m_params->m_workLaneThreads);
+	trace::init(m_params->m_traceFile, m_params->m_traceSampleRate);
+
 	if (!init_signals(this, true)) {
 		LOGERR(1, "failed to initialize signal handlers");
 		return 1;
@@ -1547,8 +2139,21 @@ int p2pool::run()
 	loop->data = nullptr;
 	GetLoopUserData(loop);
 
+	// Startup dependencies:
+	// - block cache: nothing, it's loaded in the background right away
+	// - RandomX: seeds from saved mainchain headers, or from get_miner_data if they're missing or outdated
+	// - get_info and get_version run in parallel, get_miner_data waits for both
+	// - mainchain headers: get_miner_data
+	// - servers: mainchain headers and block cache
 	try {
+		load_block_cache_async();
+		predict_seeds();
+
+		startup_phase_begin(StartupPhase::MONEROD_INFO);
+		startup_phase_begin(StartupPhase::MONEROD_VERSION);
 		get_info();
+		get_version();
+
 		load_found_blocks();
 		const int rc = uv_run(uv_default_loop_checked(), UV_RUN_DEFAULT);
 		LOGINFO(1, "uv_run exited, result = " << rc);
@@ -1570,6 +2175,9 @@ int p2pool::run()
 	delete m_stratumServer;
 	delete m_p2pServer;
 
+	stop_work_lanes();
+	trace::stop();
+
 	LOGINFO(1, "stopped");
 	return 0;
 }
@@ -34,6 +34,7 @@ class ConsoleCommands;
 class p2pool_api;
 class ZMQReader;
 struct PoolBlock;
+class BlockCache;
 
 class p2pool : public MinerCallbackHandler
 {
@@ -49,6 +50,7 @@ public:
 	const Params& params() const { return *m_params; }
 	BlockTemplate& block_template() { return *m_blockTemplate; }
 	SideChain& side_chain() { return *m_sideChain; }
+	const Mempool& mempool() const { return *m_mempool; }
 
 	FORCEINLINE MinerData miner_data() const
 	{
@@ -60,6 +62,7 @@ public:
 
 	RandomX_Hasher_Base* hasher() const { return m_hasher; }
 	bool calculate_hash(const void* data, size_t size, uint64_t height, const hash& seed, hash& result);
+	bool calculate_hashes(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results);
 	static uint64_t get_seed_height(uint64_t height);
 	bool get_seed(uint64_t height, hash& seed) const;
 
@@ -70,13 +73,14 @@ public:
 	void print_miner_status();
 #endif
 
-	virtual void handle_tx(TxMempoolData& tx) override;
+	virtual void handle_txs(std::vector<TxMempoolData>& txs) override;
 	virtual void handle_miner_data(MinerData& data) override;
 	virtual void handle_chain_main(ChainMain& data, const char* extra) override;
 
 	void submit_block_async(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 	void submit_block_async(std::vector<uint8_t>&& blob);
-	void submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
+	// Returns sidechain id of the submitted block, or an empty hash if the template is too old
+	hash submit_sidechain_block(uint32_t template_id, uint32_t nonce, uint32_t extra_nonce);
 
 	void update_block_template_async(bool is_alternative_block = false);
 	void update_block_template();
@@ -98,17 +102,36 @@ public:
 	uint64_t start_time() const { return m_startTime; }
 	void restart_zmq();
 
+	// Startup phases run concurrently as soon as their dependencies are ready, see run()
+	enum class StartupPhase : uint32_t
+	{
+		MONEROD_INFO,
+		MONEROD_VERSION,
+		MINER_DATA,
+		MAINCHAIN_HEADERS,
+		RANDOMX_SEED,
+		BLOCK_CACHE,
+		SERVERS,
+
+		COUNT
+	};
+
+	// Each phase is timed once, it can be called from any thread
+	// Timings are logged when the servers are running and all started phases are finished
+	void startup_phase_begin(StartupPhase phase);
+	void startup_phase_end(StartupPhase phase);
+
+	// P2PServer takes ownership of the block cache and the blocks loaded from it
+	BlockCache* take_block_cache(std::vector<PoolBlock*>& blocks);
+
 private:
 	p2pool(const p2pool&) = delete;
 	p2pool(p2pool&&) = delete;
 
-	static void on_submit_block(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->submit_block(); }
 	static void on_update_block_template(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->update_block_template(); }
 	static void on_stop(uv_async_t*);
 	static void on_restart_zmq(uv_async_t* async) { reinterpret_cast<p2pool*>(async->data)->restart_zmq(); }
 
-	void submit_block() const;
-
 	std::atomic<bool> m_stopped;
 
 	Params* m_params;
@@ -121,9 +144,31 @@ private:
 	Mempool* m_mempool;
 
 	mutable uv_rwlock_t m_mainchainLock;
-	std::map<uint64_t, ChainMain> m_mainchainByHeight;
+
+	// Mainchain headers by height, stored at (height % MAINCHAIN_RING_SIZE)
+	// It's big enough to keep the latest BLOCK_HEADERS_REQUIRED heights and 3 latest RandomX seed heights
+	enum { MAINCHAIN_RING_SIZE = 8192 };
+
+	struct MainchainSlot
+	{
+		ChainMain m_header;
+		bool m_used;
+	};
+
+	std::vector<MainchainSlot> m_mainchainByHeight;
+	uint64_t m_mainchainMaxHeight;
+	uint64_t m_mainchainSize;
+	uint64_t m_mainchainPrunedHeight;
 	unordered_map<hash, ChainMain> m_mainchainByHash;
 
+	// These expect m_mainchainLock to be already locked
+	const ChainMain* mainchain_find(uint64_t height) const;
+	ChainMain& mainchain_get(uint64_t height);
+	void mainchain_erase(uint64_t height);
+
+	void save_mainchain_headers() const;
+	void load_mainchain_headers();
+
 	mutable uv_rwlock_t m_minerDataLock;
 	MinerData m_minerData;
 
@@ -133,6 +178,11 @@ private:
 
 	void stratum_on_block();
 
+	void load_block_cache_async();
+	void load_block_cache();
+	void predict_seeds();
+	void start_servers();
+
 	void get_info();
 	void load_found_blocks();
 	void parse_get_info_rpc(const char* data, size_t size);
@@ -152,6 +202,15 @@ private:
 
 	void cleanup_mainchain_data(uint64_t height);
 
+	// Response of one monerod endpoint to submit_block, latency is measured from the moment the block was found
+	struct SubmitResult
+	{
+		uint64_t height;
+		uint32_t endpoint;
+		uint32_t latency_us;
+		bool accepted;
+	};
+
 	struct FoundBlock
 	{
 		FORCEINLINE FoundBlock(time_t _t, uint64_t _h, const hash& _id, const difficulty_type& _block_diff, const difficulty_type& _total_hashes)
@@ -167,11 +226,17 @@ private:
 		hash id;
 		difficulty_type block_diff;
 		difficulty_type total_hashes;
+		std::vector<SubmitResult> submit_results;
 	};
 
 	uv_mutex_t m_foundBlocksLock;
 	std::vector<FoundBlock> m_foundBlocks;
 
+	// Submit results which arrived before the block was found in the mainchain, protected by m_foundBlocksLock
+	std::vector<SubmitResult> m_pendingSubmitResults;
+
+	void add_submit_result(uint64_t height, uint32_t endpoint, const std::chrono::high_resolution_clock::time_point& found_time, bool accepted);
+
 	std::atomic<uint32_t> m_serversStarted{ 0 };
 	StratumServer* m_stratumServer = nullptr;
 	P2PServer* m_p2pServer = nullptr;
@@ -189,12 +254,24 @@ private:
 		uint32_t nonce = 0;
 		uint32_t extra_nonce = 0;
 		std::vector<uint8_t> blob;
+		std::chrono::high_resolution_clock::time_point found_time;
+	};
+
+	// Can be called from any thread, sends the block to all submit endpoints at once
+	void submit_block(SubmitBlockData& data);
+
+	struct SubmitEndpoint
+	{
+		std::string m_host;
+		int m_rpcPort;
+		std::string m_name;
 	};
 
-	mutable uv_mutex_t m_submitBlockDataLock;
-	SubmitBlockData m_submitBlockData;
+	// --host comes first, then --submit-hosts. Read-only after the constructor
+	std::vector<SubmitEndpoint> m_submitEndpoints;
+
+	void warm_up_submit_endpoints() const;
 
-	uv_async_t m_submitBlockAsync;
 	uv_async_t m_blockTemplateAsync;
 	uv_async_t m_stopAsync;
 
@@ -208,6 +285,28 @@ private:
 
 	hash m_getMinerDataHash;
 	bool m_getMinerDataPending = false;
+
+	// Used only in the main thread: get_miner_data waits for both monerod checks, servers wait for mainchain headers and the block cache
+	bool m_monerodInfoChecked = false;
+	bool m_monerodVersionChecked = false;
+	bool m_mainchainHeadersReady = false;
+	bool m_blockCacheLoading = false;
+
+	BlockCache* m_blockCache = nullptr;
+	std::vector<PoolBlock*> m_cachedBlocks;
+
+	struct StartupPhaseTiming
+	{
+		bool m_started;
+		bool m_finished;
+		uint64_t m_beginUs;
+		uint64_t m_endUs;
+	};
+
+	uv_mutex_t m_startupLock;
+	std::chrono::steady_clock::time_point m_startupTime;
+	StartupPhaseTiming m_startupPhases[static_cast<size_t>(StartupPhase::COUNT)];
+	bool m_startupReported;
 };
 
 } // namespace p2pool
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "p2pool_api.h"
+#include "api_server.h"
 
 #ifdef _MSC_VER
 #include <direct.h>
@@ -28,15 +29,28 @@ static constexpr char log_category_prefix[] = "P2Pool API ";
 
 namespace p2pool {
 
-p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats)
+p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats, const std::string& http_addresses)
 	: m_apiPath(api_path)
 	, m_counter(0)
+	, m_httpEtag(0)
+	, m_httpServer(nullptr)
 {
-	if (m_apiPath.empty()) {
+	if (m_apiPath.empty() && http_addresses.empty()) {
 		LOGERR(1, "api path is empty");
 		panic();
 	}
 
+	uv_mutex_init_checked(&m_dumpDataLock);
+	uv_rwlock_init_checked(&m_httpDataLock);
+
+	if (!http_addresses.empty()) {
+		m_httpServer = new ApiServer(this, http_addresses);
+	}
+
+	if (m_apiPath.empty()) {
+		return;
+	}
+
 	if ((m_apiPath.back() != '/')
 #ifdef _WIN32
 		&& (m_apiPath.back() != '\\')
@@ -58,8 +72,6 @@ p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats)
 	}
 	m_dumpToFileAsync.data = this;
 
-	uv_mutex_init_checked(&m_dumpDataLock);
-
 	m_networkPath = m_apiPath + "network/";
 	m_poolPath = m_apiPath + "pool/";
 	m_localPath = m_apiPath + "local/";
@@ -74,7 +86,10 @@ p2pool_api::p2pool_api(const std::string& api_path, const bool local_stats)
 
 p2pool_api::~p2pool_api()
 {
+	delete m_httpServer;
+
 	uv_mutex_destroy(&m_dumpDataLock);
+	uv_rwlock_destroy(&m_httpDataLock);
 }
 
 void p2pool_api::create_dir(const std::string& path)
@@ -100,7 +115,23 @@ void p2pool_api::create_dir(const std::string& path)
 
 void p2pool_api::on_stop()
 {
-	uv_close(reinterpret_cast<uv_handle_t*>(&m_dumpToFileAsync), nullptr);
+	if (!m_apiPath.empty()) {
+		uv_close(reinterpret_cast<uv_handle_t*>(&m_dumpToFileAsync), nullptr);
+	}
+}
+
+bool p2pool_api::get_data(const std::string& name, std::shared_ptr<const std::vector<uint8_t>>& data, uint64_t& etag) const
+{
+	ReadLock lock(m_httpDataLock);
+
+	auto it = m_httpData.find(name);
+	if (it == m_httpData.end()) {
+		return false;
+	}
+
+	data = it->second.m_data;
+	etag = it->second.m_etag;
+	return true;
 }
 
 void p2pool_api::dump_to_file_async_internal(Category category, const char* filename, DumpFileCallbackBase&& callback)
@@ -110,6 +141,37 @@ void p2pool_api::dump_to_file_async_internal(Category category, const char* file
 	callback(s);
 	buf.resize(s.m_pos);
 
+	if (m_httpServer) {
+		std::string name;
+
+		switch (category) {
+		case Category::GLOBAL:  name = filename; break;
+		case Category::NETWORK: name = std::string("network/") + filename; break;
+		case Category::POOL:    name = std::string("pool/") + filename; break;
+		case Category::LOCAL:   name = std::string("local/") + filename; break;
+		}
+
+		bool changed = false;
+		{
+			WriteLock lock(m_httpDataLock);
+
+			HttpData& d = m_httpData[name];
+			if (!d.m_data || (d.m_data->size() != buf.size()) || (memcmp(d.m_data->data(), buf.data(), buf.size()) != 0)) {
+				d.m_data = std::make_shared<const std::vector<uint8_t>>(buf.begin(), buf.end());
+				d.m_etag = ++m_httpEtag;
+				changed = true;
+			}
+		}
+
+		if (changed) {
+			m_httpServer->on_update();
+		}
+	}
+
+	if (m_apiPath.empty()) {
+		return;
+	}
+
 	std::string path;
 
 	switch (category) {
@@ -18,13 +18,17 @@
 #pragma once
 
 #include "uv_util.h"
+#include <memory>
 
 namespace p2pool {
 
+class ApiServer;
+
 class p2pool_api
 {
 public:
-	p2pool_api(const std::string& api_path, const bool local_stats);
+	// Empty api_path doesn't write any files, the data is then only available through the HTTP server
+	p2pool_api(const std::string& api_path, const bool local_stats, const std::string& http_addresses);
 	~p2pool_api();
 
 	enum class Category {
@@ -40,6 +44,11 @@ public:
 	template<typename T>
 	void set(Category category, const char* filename, T&& callback) { dump_to_file_async_internal(category, filename, DumpFileCallback<T>(std::move(callback))); }
 
+	// Latest data for "pool/stats" etc., the ETag changes only when the data changes
+	bool get_data(const std::string& name, std::shared_ptr<const std::vector<uint8_t>>& data, uint64_t& etag) const;
+
+	ApiServer* http_server() const { return m_httpServer; }
+
 private:
 	void create_dir(const std::string& path);
 
@@ -90,6 +99,18 @@ private:
 	uv_async_t m_dumpToFileAsync;
 
 	uint64_t m_counter;
+
+	struct HttpData
+	{
+		std::shared_ptr<const std::vector<uint8_t>> m_data;
+		uint64_t m_etag;
+	};
+
+	mutable uv_rwlock_t m_httpDataLock;
+	unordered_map<std::string, HttpData> m_httpData;
+	uint64_t m_httpEtag;
+
+	ApiServer* m_httpServer;
 };
 
 } // namespace p2pool
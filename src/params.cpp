@@ -39,6 +39,11 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--submit-hosts") == 0) && (i + 1 < argc)) {
+			m_submitHosts = argv[++i];
+			ok = true;
+		}
+
 		if ((strcmp(argv[i], "--zmq-port") == 0) && (i + 1 < argc)) {
 			m_zmqPort = strtoul(argv[++i], nullptr, 10);
 			ok = true;
@@ -49,6 +54,16 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if (strcmp(argv[i], "--dataset-prefetch") == 0) {
+			m_datasetPrefetch = true;
+			ok = true;
+		}
+
+		if (strcmp(argv[i], "--numa") == 0) {
+			m_numa = true;
+			ok = true;
+		}
+
 		if ((strcmp(argv[i], "--wallet") == 0) && (i + 1 < argc)) {
 			m_wallet.decode(argv[++i]);
 			ok = true;
@@ -85,6 +100,21 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--http-api") == 0) && (i + 1 < argc)) {
+			m_apiHttpAddresses = argv[++i];
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc)) {
+			m_traceFile = argv[++i];
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--trace-sample") == 0) && (i + 1 < argc)) {
+			m_traceSampleRate = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 1000000UL);
+			ok = true;
+		}
+
 		if ((strcmp(argv[i], "--local-api") == 0) || (strcmp(argv[i], "--stratum-api") == 0)) {
 			m_localStats = true;
 			ok = true;
@@ -115,11 +145,44 @@ Params::Params(int argc, char* argv[])
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--sync-pipeline") == 0) && (i + 1 < argc)) {
+			m_syncPipeline = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 64UL);
+			ok = true;
+		}
+
 		if ((strcmp(argv[i], "--start-mining") == 0) && (i + 1 < argc)) {
 			m_minerThreads = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 64UL);
 			ok = true;
 		}
 
+		if ((strcmp(argv[i], "--knapsack") == 0) && (i + 1 < argc)) {
+			m_knapsackBudget = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 1000UL);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--stratum-threads") == 0) && (i + 1 < argc)) {
+			m_stratumThreads = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 64UL);
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--work-lanes") == 0) && (i + 1 < argc)) {
+			const char* s = argv[++i];
+			for (uint32_t& n : m_workLaneThreads) {
+				char* end;
+				n = std::min(strtoul(s, &end, 10), 64UL);
+				if (*end != ',') {
+					break;
+				}
+				s = end + 1;
+			}
+			ok = true;
+		}
+
+		if ((strcmp(argv[i], "--stratum-share-rate") == 0) && (i + 1 < argc)) {
+			m_stratumShareRate = std::min(std::max(strtoul(argv[++i], nullptr, 10), 1UL), 10000UL);
+			ok = true;
+		}
+
 		if (strcmp(argv[i], "--mini") == 0) {
 			m_mini = true;
 			ok = true;
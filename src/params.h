@@ -29,14 +29,20 @@ struct Params
 
 	std::string m_host = "127.0.0.1";
 	uint32_t m_rpcPort = 18081;
+	std::string m_submitHosts;
 	uint32_t m_zmqPort = 18083;
 	bool m_lightMode = false;
+	bool m_datasetPrefetch = false;
+	bool m_numa = false;
 	Wallet m_wallet{ nullptr };
 	std::string m_stratumAddresses;
 	std::string m_p2pAddresses;
 	std::string m_p2pPeerList;
 	std::string m_config;
 	std::string m_apiPath;
+	std::string m_apiHttpAddresses;
+	std::string m_traceFile;
+	uint32_t m_traceSampleRate = 4;
 	bool m_localStats = false;
 	bool m_blockCache = true;
 #ifdef WITH_RANDOMX
@@ -46,7 +52,12 @@ struct Params
 #endif
 	uint32_t m_maxOutgoingPeers = 10;
 	uint32_t m_maxIncomingPeers = 450;
+	uint32_t m_syncPipeline = 16;
 	uint32_t m_minerThreads = 0;
+	uint32_t m_knapsackBudget = 0;
+	uint32_t m_stratumThreads = 1;
+	uint32_t m_stratumShareRate = 0;
+	uint32_t m_workLaneThreads[3] = { 4, 2, 1 }; // PoW, blocks, background
 	bool m_mini = false;
 	bool m_autoDiff = true;
 	std::string m_rpcLogin;
@@ -28,6 +28,219 @@ static constexpr char log_category_prefix[] = "PoolBlock ";
 
 namespace p2pool {
 
+// Hashes are stored in fixed-size chunks which never move, so they can be read without taking the lock
+// A block's indices stay valid as long as the block references them
+class TxHashTable : public nocopy_nomove
+{
+public:
+	TxHashTable() : m_chunks{}, m_numChunks(0), m_numEntries(0)
+	{
+		uv_mutex_init_checked(&m_lock);
+	}
+
+	~TxHashTable()
+	{
+		for (uint32_t i = 0; i < m_numChunks; ++i) {
+			delete[] m_chunks[i];
+		}
+		uv_mutex_destroy(&m_lock);
+	}
+
+	FORCEINLINE const hash& get(uint32_t index) const { return entry(index).m_hash; }
+
+	uint32_t add_nolock(const hash& h)
+	{
+		auto it = m_indices.find(h);
+		if (it != m_indices.end()) {
+			++entry(it->second).m_refs;
+			return it->second;
+		}
+
+		uint32_t index;
+		if (!m_freeIndices.empty()) {
+			index = m_freeIndices.back();
+			m_freeIndices.pop_back();
+		}
+		else {
+			if (m_numEntries == m_numChunks * CHUNK_SIZE) {
+				if (m_numChunks >= MAX_CHUNKS) {
+					LOGERR(0, "transaction hash table is full, fix the code!");
+					panic();
+				}
+				m_chunks[m_numChunks++] = new Entry[CHUNK_SIZE];
+			}
+			index = m_numEntries++;
+		}
+
+		Entry& e = entry(index);
+		e.m_hash = h;
+		e.m_refs = 1;
+
+		m_indices.emplace(h, index);
+		return index;
+	}
+
+	FORCEINLINE void add_ref_nolock(uint32_t index) { ++entry(index).m_refs; }
+
+	void release_nolock(uint32_t index)
+	{
+		Entry& e = entry(index);
+		if (--e.m_refs == 0) {
+			m_indices.erase(e.m_hash);
+			m_freeIndices.push_back(index);
+		}
+	}
+
+	uint64_t num_unique_hashes() const
+	{
+		MutexLock lock(m_lock);
+		return m_indices.size();
+	}
+
+	uint64_t memory_usage() const
+	{
+		MutexLock lock(m_lock);
+		return static_cast<uint64_t>(m_numChunks) * CHUNK_SIZE * sizeof(Entry) + m_indices.size() * (sizeof(hash) + sizeof(uint32_t)) + m_freeIndices.capacity() * sizeof(uint32_t);
+	}
+
+	mutable uv_mutex_t m_lock;
+
+private:
+	static constexpr uint32_t CHUNK_BITS = 12;
+	static constexpr uint32_t CHUNK_SIZE = 1U << CHUNK_BITS;
+	static constexpr uint32_t MAX_CHUNKS = 1U << 12;
+
+	struct Entry
+	{
+		hash m_hash;
+		uint32_t m_refs;
+	};
+
+	FORCEINLINE Entry& entry(uint32_t index) const { return m_chunks[index >> CHUNK_BITS][index & (CHUNK_SIZE - 1)]; }
+
+	Entry* m_chunks[MAX_CHUNKS];
+	uint32_t m_numChunks;
+	uint32_t m_numEntries;
+
+	unordered_map<hash, uint32_t> m_indices;
+	std::vector<uint32_t> m_freeIndices;
+};
+
+static TxHashTable& tx_hash_table()
+{
+	static TxHashTable table;
+	return table;
+}
+
+TxHashList::TxHashList(const TxHashList& l)
+	: m_minerTxHash(l.m_minerTxHash)
+	, m_indices(l.m_indices)
+{
+	if (m_indices.size() > 1) {
+		TxHashTable& table = tx_hash_table();
+		MutexLock lock(table.m_lock);
+
+		for (size_t i = 1, n = m_indices.size(); i < n; ++i) {
+			table.add_ref_nolock(m_indices[i]);
+		}
+	}
+}
+
+TxHashList& TxHashList::operator=(const TxHashList& l)
+{
+	if (this == &l) {
+		return *this;
+	}
+
+	if ((m_indices.size() > 1) || (l.m_indices.size() > 1)) {
+		TxHashTable& table = tx_hash_table();
+		MutexLock lock(table.m_lock);
+
+		for (size_t i = 1, n = l.m_indices.size(); i < n; ++i) {
+			table.add_ref_nolock(l.m_indices[i]);
+		}
+		for (size_t i = 1, n = m_indices.size(); i < n; ++i) {
+			table.release_nolock(m_indices[i]);
+		}
+	}
+
+	m_minerTxHash = l.m_minerTxHash;
+	m_indices = l.m_indices;
+
+	return *this;
+}
+
+const hash& TxHashList::operator[](size_t i) const
+{
+	return (i == 0) ? m_minerTxHash : tx_hash_table().get(m_indices[i]);
+}
+
+void TxHashList::clear()
+{
+	if (m_indices.size() > 1) {
+		TxHashTable& table = tx_hash_table();
+		MutexLock lock(table.m_lock);
+
+		for (size_t i = 1, n = m_indices.size(); i < n; ++i) {
+			table.release_nolock(m_indices[i]);
+		}
+	}
+
+	m_minerTxHash = {};
+	m_indices.clear();
+}
+
+void TxHashList::reset(size_t capacity)
+{
+	clear();
+	m_indices.reserve(capacity);
+	m_indices.push_back(0);
+}
+
+void TxHashList::push_back(const hash& h)
+{
+	TxHashTable& table = tx_hash_table();
+	MutexLock lock(table.m_lock);
+	m_indices.push_back(table.add_nolock(h));
+}
+
+void TxHashList::append(const uint8_t* hashes, size_t count)
+{
+	if (!count) {
+		return;
+	}
+
+	m_indices.reserve(m_indices.size() + count);
+
+	TxHashTable& table = tx_hash_table();
+	MutexLock lock(table.m_lock);
+
+	for (size_t i = 0; i < count; ++i) {
+		hash h;
+		memcpy(h.h, hashes + i * HASH_SIZE, HASH_SIZE);
+		m_indices.push_back(table.add_nolock(h));
+	}
+}
+
+void TxHashList::copy_to(uint8_t* out, size_t first) const
+{
+	const TxHashTable& table = tx_hash_table();
+
+	for (size_t i = first, n = m_indices.size(); i < n; ++i, out += HASH_SIZE) {
+		memcpy(out, ((i == 0) ? m_minerTxHash : table.get(m_indices[i])).h, HASH_SIZE);
+	}
+}
+
+uint64_t TxHashList::num_unique_hashes()
+{
+	return tx_hash_table().num_unique_hashes();
+}
+
+uint64_t TxHashList::memory_usage()
+{
+	return tx_hash_table().memory_usage();
+}
+
 PoolBlock::PoolBlock()
 	: m_majorVersion(0)
 	, m_minorVersion(0)
@@ -104,6 +317,8 @@ PoolBlock& PoolBlock::operator=(const PoolBlock& b)
 	m_wantBroadcast = b.m_wantBroadcast;
 	m_precalculated = b.m_precalculated;
 
+	m_blobs = b.m_blobs;
+
 	m_localTimestamp = seconds_since_epoch();
 
 	if (lock_result == 0) {
@@ -209,8 +424,9 @@ std::vector<uint8_t> PoolBlock::serialize_mainchain_data_nolock(size_t* header_s
 	}
 
 	writeVarint(m_transactions.size() - 1, data);
-	const uint8_t* t = reinterpret_cast<const uint8_t*>(m_transactions.data());
-	data.insert(data.end(), t + HASH_SIZE, t + m_transactions.size() * HASH_SIZE);
+	const size_t tx_offset = data.size();
+	data.resize(tx_offset + (m_transactions.size() - 1) * HASH_SIZE);
+	m_transactions.copy_to(data.data() + tx_offset, 1);
 
 #if POOL_BLOCK_DEBUG
 	if (!m_mainChainDataDebug.empty() && (data != m_mainChainDataDebug)) {
@@ -224,14 +440,17 @@ std::vector<uint8_t> PoolBlock::serialize_mainchain_data_nolock(size_t* header_s
 
 std::vector<uint8_t> PoolBlock::serialize_sidechain_data() const
 {
-	std::vector<uint8_t> data;
-
 	MutexLock lock(m_lock);
+	return serialize_sidechain_data_nolock();
+}
 
+std::vector<uint8_t> PoolBlock::serialize_sidechain_data_nolock() const
+{
+	std::vector<uint8_t> data;
 	data.reserve((m_uncles.size() + 4) * HASH_SIZE + 20);
 
-	const hash& spend = m_minerWallet.spend_public_key();
-	const hash& view = m_minerWallet.view_public_key();
+	const hash& spend = m_minerWallet->spend_public_key();
+	const hash& view = m_minerWallet->view_public_key();
 
 	data.insert(data.end(), spend.h, spend.h + HASH_SIZE);
 	data.insert(data.end(), view.h, view.h + HASH_SIZE);
@@ -262,6 +481,58 @@ std::vector<uint8_t> PoolBlock::serialize_sidechain_data() const
 	return data;
 }
 
+std::shared_ptr<const PoolBlock::Blobs> PoolBlock::make_blobs_nolock() const
+{
+	size_t header_size, miner_tx_size;
+	int outputs_offset, outputs_blob_size;
+	const std::vector<uint8_t> mainchain_data = serialize_mainchain_data_nolock(&header_size, &miner_tx_size, &outputs_offset, &outputs_blob_size);
+	const std::vector<uint8_t> sidechain_data = serialize_sidechain_data_nolock();
+
+	Blobs* blobs = new Blobs();
+
+	blobs->m_mainchainSize = mainchain_data.size();
+	blobs->m_headerSize = header_size;
+	blobs->m_minerTxSize = miner_tx_size;
+
+	blobs->m_full.reserve(mainchain_data.size() + sidechain_data.size());
+	blobs->m_full = mainchain_data;
+	blobs->m_full.insert(blobs->m_full.end(), sidechain_data.begin(), sidechain_data.end());
+
+	std::vector<uint8_t>& pruned = blobs->m_pruned;
+	pruned.reserve(mainchain_data.size() + sidechain_data.size() + 16 - outputs_blob_size);
+	pruned.assign(mainchain_data.begin(), mainchain_data.begin() + outputs_offset);
+
+	// 0 outputs in the pruned blob
+	pruned.push_back(0);
+
+	uint64_t total_reward = 0;
+	for (const TxOutput& output : m_outputs) {
+		total_reward += output.m_reward;
+	}
+
+	writeVarint(total_reward, pruned);
+	writeVarint(outputs_blob_size, pruned);
+
+	pruned.insert(pruned.end(), mainchain_data.begin() + outputs_offset + outputs_blob_size, mainchain_data.end());
+	pruned.insert(pruned.end(), sidechain_data.begin(), sidechain_data.end());
+
+	return std::shared_ptr<const Blobs>(blobs);
+}
+
+std::shared_ptr<const PoolBlock::Blobs> PoolBlock::get_blobs() const
+{
+	MutexLock lock(m_lock);
+	return m_blobs ? m_blobs : make_blobs_nolock();
+}
+
+void PoolBlock::finalize_blobs()
+{
+	MutexLock lock(m_lock);
+	if (!m_blobs) {
+		m_blobs = make_blobs_nolock();
+	}
+}
+
 void PoolBlock::reset_offchain_data()
 {
 	// Defaults for off-chain variables
@@ -299,23 +570,41 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher_Base* hasher, uint64_t height, const
 		MutexLock lock(m_lock);
 
 		size_t header_size, miner_tx_size;
-		const std::vector<uint8_t> mainchain_data = serialize_mainchain_data_nolock(&header_size, &miner_tx_size, nullptr, nullptr);
+		std::vector<uint8_t> mainchain_data;
+		const uint8_t* mainchain_begin;
+		size_t mainchain_size;
+
+		if (m_blobs) {
+			header_size = m_blobs->m_headerSize;
+			miner_tx_size = m_blobs->m_minerTxSize;
+			mainchain_begin = m_blobs->m_full.data();
+			mainchain_size = m_blobs->m_mainchainSize;
+		}
+		else {
+			mainchain_data = serialize_mainchain_data_nolock(&header_size, &miner_tx_size, nullptr, nullptr);
+			mainchain_begin = mainchain_data.data();
+			mainchain_size = mainchain_data.size();
+		}
 
-		if (!header_size || !miner_tx_size || (mainchain_data.size() < header_size + miner_tx_size)) {
+		if (!header_size || !miner_tx_size || (mainchain_size < header_size + miner_tx_size) || m_transactions.empty()) {
 			LOGERR(1, "tried to calculate PoW of uninitialized block");
 			return false;
 		}
 
 		blob_size = header_size;
-		memcpy(blob, mainchain_data.data(), blob_size);
+		memcpy(blob, mainchain_begin, blob_size);
 
-		const uint8_t* miner_tx = mainchain_data.data() + header_size;
+		const uint8_t* miner_tx = mainchain_begin + header_size;
 		keccak(miner_tx, static_cast<int>(miner_tx_size) - 1, reinterpret_cast<uint8_t*>(hashes), HASH_SIZE);
 
 		count = m_transactions.size();
-		uint8_t* h = reinterpret_cast<uint8_t*>(m_transactions.data());
+
+		std::vector<hash> tx_hashes(count);
+		uint8_t* h = reinterpret_cast<uint8_t*>(tx_hashes.data());
+		m_transactions.copy_to(h + HASH_SIZE, 1);
 
 		keccak(reinterpret_cast<uint8_t*>(hashes), HASH_SIZE * 3, h, HASH_SIZE);
+		m_transactions.miner_tx_hash() = tx_hashes[0];
 
 		if (count == 1) {
 			memcpy(blob + blob_size, h, HASH_SIZE);
@@ -333,15 +622,13 @@ bool PoolBlock::get_pow_hash(RandomX_Hasher_Base* hasher, uint64_t height, const
 			std::vector<uint8_t> tmp_ints(cnt * HASH_SIZE);
 			memcpy(tmp_ints.data(), h, (cnt * 2 - count) * HASH_SIZE);
 
-			for (i = cnt * 2 - count, j = cnt * 2 - count; j < cnt; i += 2, ++j) {
-				keccak(h + i * HASH_SIZE, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, HASH_SIZE);
-			}
+			i = cnt * 2 - count;
+			j = cnt * 2 - count;
+			keccak_batch(h + i * HASH_SIZE, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, cnt - j);
 
 			while (cnt > 2) {
 				cnt >>= 1;
-				for (i = 0, j = 0; j < cnt; i += 2, ++j) {
-					keccak(tmp_ints.data() + i * HASH_SIZE, HASH_SIZE * 2, tmp_ints.data() + j * HASH_SIZE, HASH_SIZE);
-				}
+				keccak_batch(tmp_ints.data(), HASH_SIZE * 2, tmp_ints.data(), cnt);
 			}
 
 			keccak(tmp_ints.data(), HASH_SIZE * 2, blob + blob_size, HASH_SIZE);
@@ -378,4 +665,96 @@ uint64_t PoolBlock::get_payout(const Wallet& w) const
 	return 0;
 }
 
+PoolBlockAllocator::PoolBlockAllocator()
+	: m_numBlocks(0)
+	, m_numSlabs(0)
+{
+}
+
+PoolBlockAllocator::~PoolBlockAllocator()
+{
+	if (num_blocks()) {
+		LOGERR(1, "~PoolBlockAllocator: " << num_blocks() << " blocks were not destroyed. Fix the code!");
+	}
+
+	for (auto& it : m_buckets) {
+		for (Slab* slab : it.second) {
+			delete slab;
+		}
+	}
+}
+
+PoolBlock* PoolBlockAllocator::create(const PoolBlock& b)
+{
+	std::vector<Slab*>& slabs = m_buckets[b.m_sidechainHeight / HEIGHTS_PER_BUCKET];
+
+	Slab* slab = nullptr;
+	for (Slab* s : slabs) {
+		if (~s->m_usedMask) {
+			slab = s;
+			break;
+		}
+	}
+
+	if (!slab) {
+		slab = new Slab();
+		slabs.push_back(slab);
+		++m_numSlabs;
+	}
+
+	const uint64_t free_mask = ~slab->m_usedMask;
+	const uint64_t index = bsr(free_mask & (~free_mask + 1));
+
+	PoolBlock* result = new (slab->slot(index)) PoolBlock(b);
+
+	slab->m_usedMask |= (1ULL << index);
+	++m_numBlocks;
+
+	return result;
+}
+
+void PoolBlockAllocator::destroy(PoolBlock* b)
+{
+	if (!b) {
+		return;
+	}
+
+	auto it = m_buckets.find(b->m_sidechainHeight / HEIGHTS_PER_BUCKET);
+	if (it == m_buckets.end()) {
+		LOGERR(1, "destroy: block at height " << b->m_sidechainHeight << " was not allocated here. Fix the code!");
+		return;
+	}
+
+	std::vector<Slab*>& slabs = it->second;
+
+	for (size_t i = 0, n = slabs.size(); i < n; ++i) {
+		Slab* slab = slabs[i];
+		if (!slab->contains(b)) {
+			continue;
+		}
+
+		const uint64_t index = static_cast<uint64_t>(reinterpret_cast<Slab::Storage*>(b) - slab->m_slots);
+
+		b->~PoolBlock();
+		slab->m_usedMask &= ~(1ULL << index);
+		--m_numBlocks;
+
+		// The whole slab is free now, give it back
+		if (!slab->m_usedMask) {
+			delete slab;
+			--m_numSlabs;
+
+			slabs[i] = slabs.back();
+			slabs.pop_back();
+
+			if (slabs.empty()) {
+				m_buckets.erase(it);
+			}
+		}
+		return;
+	}
+
+	LOGERR(1, "destroy: block at height " << b->m_sidechainHeight << " was not allocated here. Fix the code!");
+}
+
 } // namespace p2pool
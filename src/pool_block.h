@@ -19,6 +19,7 @@
 
 #include "uv_util.h"
 #include "wallet.h"
+#include <memory>
 
 #ifdef _DEBUG
 #define POOL_BLOCK_DEBUG 1
@@ -45,12 +46,99 @@ class SideChain;
 * Pool block's PoW hash is calculated from the Monero block template part using Monero's consensus rules
 */
 
-struct DifficultyData
+// Read-only view of a serialized pool block, parsed in place without allocating memory
+// Only the binary format is checked, the sidechain id is not verified until the block is deserialized into PoolBlock
+// All pointers point into the parsed buffer, so the view is only valid while the buffer is
+struct PoolBlockView
 {
-	FORCEINLINE DifficultyData(uint64_t t, const difficulty_type& d) : m_timestamp(t), m_cumulativeDifficulty(d) {}
+	int parse(const uint8_t* data, size_t size);
 
+	const uint8_t* m_data;
+	size_t m_size;
+
+	uint8_t m_majorVersion;
+	uint8_t m_minorVersion;
 	uint64_t m_timestamp;
+	hash m_prevId;
+	uint32_t m_nonce;
+	uint64_t m_txinGenHeight;
+
+	// Pruned blocks have no outputs, only total reward and outputs blob size
+	uint64_t m_numOutputs;
+	const uint8_t* m_outputs;
+	uint64_t m_totalReward;
+	int m_outputsOffset;
+	int m_outputsBlobSize;
+	int m_outputsActualBlobSize;
+
+	hash m_txkeyPub;
+	uint64_t m_extraNonceSize;
+	uint32_t m_extraNonce;
+	hash m_sidechainId;
+
+	// Offsets in the unpruned block, used when calculating HASH
+	int m_nonceOffset;
+	int m_extraNonceOffset;
+	int m_sidechainHashOffset;
+
+	uint64_t m_numTransactions;
+	const uint8_t* m_transactions;
+
+	const uint8_t* m_sidechainData;
+	hash m_spendPublicKey;
+	hash m_viewPublicKey;
+	hash m_txkeySec;
+	hash m_parent;
+
+	uint64_t m_numUncles;
+	const uint8_t* m_uncles;
+
+	uint64_t m_sidechainHeight;
+	difficulty_type m_difficulty;
 	difficulty_type m_cumulativeDifficulty;
+
+	FORCEINLINE uint8_t get_tx_type() const { return (m_majorVersion < HARDFORK_VIEW_TAGS_VERSION) ? TXOUT_TO_KEY : TXOUT_TO_TAGGED_KEY; }
+};
+
+// Transaction hashes of a block, interned in a global refcounted table
+// Blocks mined on the same Monero height share most of their transactions, so each block keeps 4 bytes per transaction instead of 32
+// Index 0 is the miner transaction hash, it's different in every block so it's stored in place
+class TxHashList
+{
+public:
+	TxHashList() : m_minerTxHash() {}
+	~TxHashList() { clear(); }
+
+	TxHashList(const TxHashList& l);
+	TxHashList& operator=(const TxHashList& l);
+
+	FORCEINLINE size_t size() const { return m_indices.size(); }
+	FORCEINLINE bool empty() const { return m_indices.empty(); }
+
+	const hash& operator[](size_t i) const;
+	FORCEINLINE hash& miner_tx_hash() { return m_minerTxHash; }
+
+	void clear();
+
+	// Clears the list, leaving only the miner transaction hash, and reserves space for "capacity" hashes
+	void reset(size_t capacity);
+
+	void push_back(const hash& h);
+
+	// Appends "count" hashes stored back to back
+	void append(const uint8_t* hashes, size_t count);
+
+	// Copies hashes from index "first" to the end of the list, back to back
+	void copy_to(uint8_t* out, size_t first) const;
+
+	static uint64_t num_unique_hashes();
+	static uint64_t memory_usage();
+
+private:
+	hash m_minerTxHash;
+
+	// m_indices[0] is a placeholder for the miner transaction
+	std::vector<uint32_t> m_indices;
 };
 
 struct PoolBlock
@@ -97,10 +185,10 @@ struct PoolBlock
 	uint32_t m_extraNonce;
 
 	// All block transaction hashes including the miner transaction hash at index 0
-	std::vector<hash> m_transactions;
+	TxHashList m_transactions;
 
-	// Miner's wallet
-	Wallet m_minerWallet{ nullptr };
+	// Miner's wallet, shared with all other blocks mined by the same address
+	InternedWallet m_minerWallet;
 
 	// Transaction secret key
 	// Required to check that pub keys in the miner transaction pay out to correct miner wallet addresses
@@ -131,11 +219,34 @@ struct PoolBlock
 
 	uint64_t m_localTimestamp;
 
+	// Serialized block, full and pruned (no outputs, only total reward and outputs blob size)
+	struct Blobs
+	{
+		std::vector<uint8_t> m_full;
+		std::vector<uint8_t> m_pruned;
+
+		// Mainchain data is at the beginning of m_full: header, miner tx and the transaction list
+		size_t m_mainchainSize;
+		size_t m_headerSize;
+		size_t m_minerTxSize;
+	};
+
+	// Built once by finalize_blobs() when the block can't change anymore, then shared by the block cache, broadcasts and block requests
+	// Copies of the block share it too, so a copy must be reset before it's modified
+	std::shared_ptr<const Blobs> m_blobs;
+
+	// Cached blobs if the block has them, a fresh serialization otherwise
+	std::shared_ptr<const Blobs> get_blobs() const;
+	void finalize_blobs();
+
 	std::vector<uint8_t> serialize_mainchain_data(size_t* header_size = nullptr, size_t* miner_tx_size = nullptr, int* outputs_offset = nullptr, int* outputs_blob_size = nullptr) const;
 	std::vector<uint8_t> serialize_mainchain_data_nolock(size_t* header_size, size_t* miner_tx_size, int* outputs_offset, int* outputs_blob_size) const;
 	std::vector<uint8_t> serialize_sidechain_data() const;
+	std::vector<uint8_t> serialize_sidechain_data_nolock() const;
+	std::shared_ptr<const Blobs> make_blobs_nolock() const;
 
 	int deserialize(const uint8_t* data, size_t size, const SideChain& sidechain, uv_loop_t* loop);
+	int deserialize(const PoolBlockView& view, const SideChain& sidechain, uv_loop_t* loop);
 	void reset_offchain_data();
 
 	bool get_pow_hash(RandomX_Hasher_Base* hasher, uint64_t height, const hash& seed_hash, hash& pow_hash);
@@ -147,4 +258,47 @@ struct PoolBlock
 	FORCEINLINE uint8_t get_tx_type() const { return (m_majorVersion < HARDFORK_VIEW_TAGS_VERSION) ? TXOUT_TO_KEY : TXOUT_TO_TAGGED_KEY; }
 };
 
+// Allocates sidechain blocks in fixed-size slabs grouped by sidechain height
+// Blocks are pruned by height, so pruning old heights releases whole slabs at once instead of fragmenting the heap
+// Not thread-safe, SideChain only uses it under its write lock
+class PoolBlockAllocator : public nocopy_nomove
+{
+public:
+	PoolBlockAllocator();
+	~PoolBlockAllocator();
+
+	PoolBlock* create(const PoolBlock& b);
+	void destroy(PoolBlock* b);
+
+	// Can be called from any thread, without the lock which create() and destroy() are called under
+	FORCEINLINE uint64_t num_blocks() const { return m_numBlocks.load(std::memory_order_relaxed); }
+	FORCEINLINE uint64_t num_slabs() const { return m_numSlabs.load(std::memory_order_relaxed); }
+	FORCEINLINE uint64_t capacity() const { return num_slabs() * SLOTS_PER_SLAB; }
+	FORCEINLINE uint64_t memory_usage() const { return num_slabs() * sizeof(Slab); }
+
+	static constexpr uint64_t HEIGHTS_PER_BUCKET = 64;
+	static constexpr uint64_t SLOTS_PER_SLAB = 64;
+
+private:
+	struct Slab
+	{
+		typedef std::aligned_storage<sizeof(PoolBlock), alignof(PoolBlock)>::type Storage;
+
+		Slab() : m_usedMask(0) {}
+
+		Storage m_slots[SLOTS_PER_SLAB];
+		uint64_t m_usedMask;
+
+		FORCEINLINE PoolBlock* slot(uint64_t i) { return reinterpret_cast<PoolBlock*>(&m_slots[i]); }
+		FORCEINLINE bool contains(const PoolBlock* b) const { return (reinterpret_cast<const void*>(b) >= m_slots) && (reinterpret_cast<const void*>(b) < m_slots + SLOTS_PER_SLAB); }
+	};
+
+	static_assert(SLOTS_PER_SLAB == sizeof(uint64_t) * 8, "m_usedMask must have one bit per slot");
+
+	unordered_map<uint64_t, std::vector<Slab*>> m_buckets;
+
+	std::atomic<uint64_t> m_numBlocks;
+	std::atomic<uint64_t> m_numSlabs;
+};
+
 } // namespace p2pool
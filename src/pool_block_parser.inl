@@ -19,210 +19,294 @@
 
 namespace p2pool {
 
-// Parse an arbitrary binary blob into the pool block
+// Parse an arbitrary binary blob into the pool block view
 // Since data here can come from external and possibly malicious sources, check everything
-// Only the syntax (i.e. the serialized block binary format) and the keccak hash are checked here
-// Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
-int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& sidechain, uv_loop_t* loop)
+// Only the syntax (i.e. the serialized block binary format) is checked here, PoolBlock::deserialize() checks the keys and the keccak hash
+int PoolBlockView::parse(const uint8_t* data, size_t size)
 {
-	try {
-		// Sanity check
-		if (!data || (size > 128 * 1024)) {
-			return __LINE__;
-		}
+	// Sanity check
+	if (!data || (size > 128 * 1024)) {
+		return __LINE__;
+	}
 
-		const uint8_t* const data_begin = data;
-		const uint8_t* const data_end = data + size;
+	const uint8_t* const data_begin = data;
+	const uint8_t* const data_end = data + size;
 
-		auto read_byte = [&data, data_end](uint8_t& b) -> bool
-		{
-			if (data < data_end) {
-				b = *(data++);
-				return true;
-			}
-			return false;
-		};
+	m_data = data;
+	m_size = size;
+
+	auto read_byte = [&data, data_end](uint8_t& b) -> bool
+	{
+		if (data < data_end) {
+			b = *(data++);
+			return true;
+		}
+		return false;
+	};
 
 #define READ_BYTE(x) do { if (!read_byte(x)) return __LINE__; } while (0)
 #define EXPECT_BYTE(value) do { uint8_t tmp; READ_BYTE(tmp); if (tmp != (value)) return __LINE__; } while (0)
 
 #define READ_VARINT(x) do { data = readVarint(data, data_end, x); if (!data) return __LINE__; } while(0)
 
-		auto read_buf = [&data, data_end](void* buf, size_t size) -> bool
-		{
-			if (static_cast<size_t>(data_end - data) < size) {
-				return false;
-			}
+	auto read_buf = [&data, data_end](void* buf, size_t size) -> bool
+	{
+		if (static_cast<size_t>(data_end - data) < size) {
+			return false;
+		}
 
-			memcpy(buf, data, size);
-			data += size;
-			return true;
-		};
+		memcpy(buf, data, size);
+		data += size;
+		return true;
+	};
 
 #define READ_BUF(buf, size) do { if (!read_buf((buf), (size))) return __LINE__; } while(0)
 
-		MutexLock lock(m_lock);
+	auto skip_hashes = [&data, data_end](uint64_t count) -> bool
+	{
+		if (count > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return false;
+		if (static_cast<uint64_t>(data_end - data) < count * HASH_SIZE) return false;
 
-		READ_BYTE(m_majorVersion);
-		if (m_majorVersion > HARDFORK_SUPPORTED_VERSION) return __LINE__;
+		data += count * HASH_SIZE;
+		return true;
+	};
 
-		READ_BYTE(m_minorVersion);
-		if (m_minorVersion < m_majorVersion) return __LINE__;
+	READ_BYTE(m_majorVersion);
+	if (m_majorVersion > HARDFORK_SUPPORTED_VERSION) return __LINE__;
 
-		READ_VARINT(m_timestamp);
-		READ_BUF(m_prevId.h, HASH_SIZE);
+	READ_BYTE(m_minorVersion);
+	if (m_minorVersion < m_majorVersion) return __LINE__;
 
-		const int nonce_offset = static_cast<int>(data - data_begin);
-		READ_BUF(&m_nonce, NONCE_SIZE);
+	READ_VARINT(m_timestamp);
+	READ_BUF(m_prevId.h, HASH_SIZE);
 
-		EXPECT_BYTE(TX_VERSION);
+	m_nonceOffset = static_cast<int>(data - data_begin);
+	READ_BUF(&m_nonce, NONCE_SIZE);
 
-		uint64_t unlock_height;
-		READ_VARINT(unlock_height);
+	EXPECT_BYTE(TX_VERSION);
 
-		EXPECT_BYTE(1);
-		EXPECT_BYTE(TXIN_GEN);
+	uint64_t unlock_height;
+	READ_VARINT(unlock_height);
 
-		READ_VARINT(m_txinGenHeight);
-		if (unlock_height != m_txinGenHeight + MINER_REWARD_UNLOCK_TIME) return __LINE__;
+	EXPECT_BYTE(1);
+	EXPECT_BYTE(TXIN_GEN);
 
-		std::vector<uint8_t> outputs_blob;
-		const int outputs_offset = static_cast<int>(data - data_begin);
+	READ_VARINT(m_txinGenHeight);
+	if (unlock_height != m_txinGenHeight + MINER_REWARD_UNLOCK_TIME) return __LINE__;
 
-		uint64_t num_outputs;
-		READ_VARINT(num_outputs);
+	m_outputsOffset = static_cast<int>(data - data_begin);
 
-		uint64_t total_reward = 0;
-		int outputs_blob_size;
+	READ_VARINT(m_numOutputs);
 
-		if (num_outputs > 0) {
-			// Outputs are in the buffer, just read them
-			// Each output is at least 34 bytes, exit early if there's not enough data left
-			// 1 byte for reward, 1 byte for tx_type, 32 bytes for eph_pub_key
-			constexpr uint64_t MIN_OUTPUT_SIZE = 34;
+	m_outputs = data;
+	m_totalReward = 0;
 
-			if (num_outputs > std::numeric_limits<uint64_t>::max() / MIN_OUTPUT_SIZE) return __LINE__;
-			if (static_cast<uint64_t>(data_end - data) < num_outputs * MIN_OUTPUT_SIZE) return __LINE__;
+	if (m_numOutputs > 0) {
+		// Outputs are in the buffer, just check them
+		// Each output is at least 34 bytes, exit early if there's not enough data left
+		// 1 byte for reward, 1 byte for tx_type, 32 bytes for eph_pub_key
+		constexpr uint64_t MIN_OUTPUT_SIZE = 34;
 
-			m_outputs.resize(num_outputs);
-			m_outputs.shrink_to_fit();
+		if (m_numOutputs > std::numeric_limits<uint64_t>::max() / MIN_OUTPUT_SIZE) return __LINE__;
+		if (static_cast<uint64_t>(data_end - data) < m_numOutputs * MIN_OUTPUT_SIZE) return __LINE__;
 
-			const uint8_t expected_tx_type = get_tx_type();
+		const uint8_t expected_tx_type = get_tx_type();
+		const size_t output_key_size = (expected_tx_type == TXOUT_TO_TAGGED_KEY) ? (HASH_SIZE + 1) : HASH_SIZE;
 
-			for (uint64_t i = 0; i < num_outputs; ++i) {
-				TxOutput& t = m_outputs[i];
+		for (uint64_t i = 0; i < m_numOutputs; ++i) {
+			uint64_t reward;
+			READ_VARINT(reward);
+			m_totalReward += reward;
 
-				uint64_t reward;
-				READ_VARINT(reward);
-				t.m_reward = reward;
-				total_reward += reward;
+			EXPECT_BYTE(expected_tx_type);
 
-				EXPECT_BYTE(expected_tx_type);
+			if (static_cast<size_t>(data_end - data) < output_key_size) return __LINE__;
+			data += output_key_size;
+		}
 
-				READ_BUF(t.m_ephPublicKey.h, HASH_SIZE);
+		m_outputsBlobSize = static_cast<int>(data - data_begin) - m_outputsOffset;
+	}
+	else {
+		// Outputs are not in the buffer and must be calculated from sidechain data
+		// We only have total reward and outputs blob size here
+		READ_VARINT(m_totalReward);
 
-				if (expected_tx_type == TXOUT_TO_TAGGED_KEY) {
-					uint8_t view_tag;
-					READ_BYTE(view_tag);
-					t.m_viewTag = view_tag;
-				}
-			}
+		uint64_t tmp;
+		READ_VARINT(tmp);
 
-			outputs_blob_size = static_cast<int>(data - data_begin) - outputs_offset;
-			outputs_blob.assign(data_begin + outputs_offset, data);
+		// Sanity check
+		if ((tmp == 0) || (tmp > 128 * 1024)) {
+			return __LINE__;
 		}
-		else {
-			// Outputs are not in the buffer and must be calculated from sidechain data
-			// We only have total reward and outputs blob size here
-			READ_VARINT(total_reward);
 
-			uint64_t tmp;
-			READ_VARINT(tmp);
+		m_outputsBlobSize = static_cast<int>(tmp);
+	}
 
-			// Sanity check
-			if ((tmp == 0) || (tmp > 128 * 1024)) {
-				return __LINE__;
-			}
+	// Technically some p2pool node could keep stuffing block with transactions until reward is less than 0.6 XMR
+	// But default transaction picking algorithm never does that. It's better to just ban such nodes
+	if (m_totalReward < 600000000000ULL) {
+		return __LINE__;
+	}
 
-			outputs_blob_size = static_cast<int>(tmp);
-		}
+	m_outputsActualBlobSize = static_cast<int>(data - data_begin) - m_outputsOffset;
+	if (m_outputsBlobSize < m_outputsActualBlobSize) {
+		return __LINE__;
+	}
 
-		// Technically some p2pool node could keep stuffing block with transactions until reward is less than 0.6 XMR
-		// But default transaction picking algorithm never does that. It's better to just ban such nodes
-		if (total_reward < 600000000000ULL) {
-			return __LINE__;
-		}
+	const int outputs_blob_size_diff = m_outputsBlobSize - m_outputsActualBlobSize;
 
-		const int outputs_actual_blob_size = static_cast<int>(data - data_begin) - outputs_offset;
-		if (outputs_blob_size < outputs_actual_blob_size) {
-			return __LINE__;
-		}
+	uint64_t tx_extra_size;
+	READ_VARINT(tx_extra_size);
+
+	const uint8_t* tx_extra_begin = data;
 
-		const int outputs_blob_size_diff = outputs_blob_size - outputs_actual_blob_size;
+	EXPECT_BYTE(TX_EXTRA_TAG_PUBKEY);
+	READ_BUF(m_txkeyPub.h, HASH_SIZE);
 
-		uint64_t tx_extra_size;
-		READ_VARINT(tx_extra_size);
+	EXPECT_BYTE(TX_EXTRA_NONCE);
+	READ_VARINT(m_extraNonceSize);
 
-		const uint8_t* tx_extra_begin = data;
+	// Sanity check
+	if ((m_extraNonceSize < EXTRA_NONCE_SIZE) || (m_extraNonceSize > EXTRA_NONCE_MAX_SIZE)) return __LINE__;
 
-		EXPECT_BYTE(TX_EXTRA_TAG_PUBKEY);
-		READ_BUF(m_txkeyPub.h, HASH_SIZE);
+	m_extraNonceOffset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
+	READ_BUF(&m_extraNonce, EXTRA_NONCE_SIZE);
+	for (uint64_t i = EXTRA_NONCE_SIZE; i < m_extraNonceSize; ++i) {
+		EXPECT_BYTE(0);
+	}
 
-		EXPECT_BYTE(TX_EXTRA_NONCE);
-		READ_VARINT(m_extraNonceSize);
+	EXPECT_BYTE(TX_EXTRA_MERGE_MINING_TAG);
+	EXPECT_BYTE(HASH_SIZE);
 
-		// Sanity check
-		if ((m_extraNonceSize < EXTRA_NONCE_SIZE) || (m_extraNonceSize > EXTRA_NONCE_MAX_SIZE)) return __LINE__;
+	m_sidechainHashOffset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
+	READ_BUF(m_sidechainId.h, HASH_SIZE);
 
-		const int extra_nonce_offset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
-		READ_BUF(&m_extraNonce, EXTRA_NONCE_SIZE);
-		for (uint64_t i = EXTRA_NONCE_SIZE; i < m_extraNonceSize; ++i) {
-			EXPECT_BYTE(0);
-		}
+	if (static_cast<uint64_t>(data - tx_extra_begin) != tx_extra_size) return __LINE__;
 
-		EXPECT_BYTE(TX_EXTRA_MERGE_MINING_TAG);
-		EXPECT_BYTE(HASH_SIZE);
+	EXPECT_BYTE(0);
 
-		const int sidechain_hash_offset = static_cast<int>((data - data_begin) + outputs_blob_size_diff);
-		READ_BUF(m_sidechainId.h, HASH_SIZE);
+	READ_VARINT(m_numTransactions);
 
-		if (static_cast<uint64_t>(data - tx_extra_begin) != tx_extra_size) return __LINE__;
+	m_transactions = data;
+	if (!skip_hashes(m_numTransactions)) return __LINE__;
 
-		EXPECT_BYTE(0);
+	m_sidechainData = data;
 
-		uint64_t num_transactions;
-		READ_VARINT(num_transactions);
+	READ_BUF(m_spendPublicKey.h, HASH_SIZE);
+	READ_BUF(m_viewPublicKey.h, HASH_SIZE);
+	READ_BUF(m_txkeySec.h, HASH_SIZE);
+	READ_BUF(m_parent.h, HASH_SIZE);
 
-		if (num_transactions > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
-		if (static_cast<uint64_t>(data_end - data) < num_transactions * HASH_SIZE) return __LINE__;
+	READ_VARINT(m_numUncles);
 
-		m_transactions.resize(1);
-		m_transactions.reserve(num_transactions + 1);
+	m_uncles = data;
+	if (!skip_hashes(m_numUncles)) return __LINE__;
 
-		for (uint64_t i = 0; i < num_transactions; ++i) {
-			hash id;
-			READ_BUF(id.h, HASH_SIZE);
-			m_transactions.emplace_back(std::move(id));
+	READ_VARINT(m_sidechainHeight);
+
+	READ_VARINT(m_difficulty.lo);
+	READ_VARINT(m_difficulty.hi);
+
+	READ_VARINT(m_cumulativeDifficulty.lo);
+	READ_VARINT(m_cumulativeDifficulty.hi);
+
+#undef READ_BYTE
+#undef EXPECT_BYTE
+#undef READ_VARINT
+#undef READ_BUF
+
+	if (data != data_end) {
+		return __LINE__;
+	}
+
+	return 0;
+}
+
+int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& sidechain, uv_loop_t* loop)
+{
+	PoolBlockView view;
+
+	const int result = view.parse(data, size);
+	if (result != 0) {
+		return result;
+	}
+
+	return deserialize(view, sidechain, loop);
+}
+
+// Materialize the pool block from a parsed view
+// Semantics must also be checked elsewhere before accepting the block (PoW, reward split between miners, difficulty calculation and so on)
+int PoolBlock::deserialize(const PoolBlockView& view, const SideChain& sidechain, uv_loop_t* loop)
+{
+	try {
+		const uint8_t* const data_begin = view.m_data;
+		const uint8_t* const data_end = view.m_data + view.m_size;
+
+		MutexLock lock(m_lock);
+
+		m_blobs.reset();
+
+		m_majorVersion = view.m_majorVersion;
+		m_minorVersion = view.m_minorVersion;
+		m_timestamp = view.m_timestamp;
+		m_prevId = view.m_prevId;
+		m_nonce = view.m_nonce;
+		m_txinGenHeight = view.m_txinGenHeight;
+
+		std::vector<uint8_t> outputs_blob;
+
+		const int outputs_offset = view.m_outputsOffset;
+		const int outputs_blob_size = view.m_outputsBlobSize;
+		const int outputs_blob_size_diff = outputs_blob_size - view.m_outputsActualBlobSize;
+
+		if (view.m_numOutputs > 0) {
+			m_outputs.resize(view.m_numOutputs);
+			m_outputs.shrink_to_fit();
+
+			const bool has_view_tags = (view.get_tx_type() == TXOUT_TO_TAGGED_KEY);
+
+			// The view already checked the outputs
+			const uint8_t* data = view.m_outputs;
+
+			for (TxOutput& t : m_outputs) {
+				uint64_t reward = 0;
+				data = readVarint(data, data_end, reward);
+				t.m_reward = reward;
+
+				// Skip tx_type
+				++data;
+
+				memcpy(t.m_ephPublicKey.h, data, HASH_SIZE);
+				data += HASH_SIZE;
+
+				if (has_view_tags) {
+					t.m_viewTag = *(data++);
+				}
+			}
+
+			outputs_blob.assign(data_begin + outputs_offset, data_begin + outputs_offset + outputs_blob_size);
 		}
 
+		m_txkeyPub = view.m_txkeyPub;
+		m_extraNonceSize = view.m_extraNonceSize;
+		m_extraNonce = view.m_extraNonce;
+		m_sidechainId = view.m_sidechainId;
+
+		m_transactions.reset(view.m_numTransactions + 1);
+		m_transactions.append(view.m_transactions, view.m_numTransactions);
+
 #if POOL_BLOCK_DEBUG
-		m_mainChainDataDebug.reserve((data - data_begin) + outputs_blob_size_diff);
+		m_mainChainDataDebug.reserve((view.m_sidechainData - data_begin) + outputs_blob_size_diff);
 		m_mainChainDataDebug.assign(data_begin, data_begin + outputs_offset);
 		m_mainChainDataDebug.insert(m_mainChainDataDebug.end(), outputs_blob_size, 0);
-		m_mainChainDataDebug.insert(m_mainChainDataDebug.end(), data_begin + outputs_offset + outputs_actual_blob_size, data);
-
-		const uint8_t* sidechain_data_begin = data;
+		m_mainChainDataDebug.insert(m_mainChainDataDebug.end(), data_begin + outputs_offset + view.m_outputsActualBlobSize, view.m_sidechainData);
 #endif
 
-		hash spend_pub_key;
-		hash view_pub_key;
-		READ_BUF(spend_pub_key.h, HASH_SIZE);
-		READ_BUF(view_pub_key.h, HASH_SIZE);
-		if (!m_minerWallet.assign(spend_pub_key, view_pub_key, sidechain.network_type())) {
+		if (!m_minerWallet.assign(view.m_spendPublicKey, view.m_viewPublicKey, sidechain.network_type())) {
 			return __LINE__;
 		}
 
-		READ_BUF(m_txkeySec.h, HASH_SIZE);
+		m_txkeySec = view.m_txkeySec;
 
 		if (!check_keys(m_txkeyPub, m_txkeySec)) {
 			return __LINE__;
@@ -231,47 +315,28 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& si
 		// Enforce deterministic tx keys starting from v15
 		if (m_majorVersion >= HARDFORK_VIEW_TAGS_VERSION) {
 			hash pub, sec;
-			get_tx_keys(pub, sec, spend_pub_key, m_prevId);
+			get_tx_keys(pub, sec, view.m_spendPublicKey, m_prevId);
 			if ((pub != m_txkeyPub) || (sec != m_txkeySec)) {
 				return __LINE__;
 			}
 		}
 
-		READ_BUF(m_parent.h, HASH_SIZE);
-
-		uint64_t num_uncles;
-		READ_VARINT(num_uncles);
-
-		if (num_uncles > std::numeric_limits<uint64_t>::max() / HASH_SIZE) return __LINE__;
-		if (static_cast<uint64_t>(data_end - data) < num_uncles * HASH_SIZE) return __LINE__;
+		m_parent = view.m_parent;
 
 		m_uncles.clear();
-		m_uncles.reserve(num_uncles);
+		m_uncles.reserve(view.m_numUncles);
 
-		for (uint64_t i = 0; i < num_uncles; ++i) {
+		for (uint64_t i = 0; i < view.m_numUncles; ++i) {
 			hash id;
-			READ_BUF(id.h, HASH_SIZE);
+			memcpy(id.h, view.m_uncles + i * HASH_SIZE, HASH_SIZE);
 			m_uncles.emplace_back(std::move(id));
 		}
 
-		READ_VARINT(m_sidechainHeight);
-
-		READ_VARINT(m_difficulty.lo);
-		READ_VARINT(m_difficulty.hi);
-
-		READ_VARINT(m_cumulativeDifficulty.lo);
-		READ_VARINT(m_cumulativeDifficulty.hi);
+		m_sidechainHeight = view.m_sidechainHeight;
+		m_difficulty = view.m_difficulty;
+		m_cumulativeDifficulty = view.m_cumulativeDifficulty;
 
-#undef READ_BYTE
-#undef EXPECT_BYTE
-#undef READ_VARINT
-#undef READ_BUF
-
-		if (data != data_end) {
-			return __LINE__;
-		}
-
-		if ((num_outputs == 0) && !sidechain.get_outputs_blob(this, total_reward, outputs_blob, loop)) {
+		if ((view.m_numOutputs == 0) && !sidechain.get_outputs_blob(this, view.m_totalReward, outputs_blob, loop)) {
 			return __LINE__;
 		}
 
@@ -283,6 +348,10 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& si
 		memcpy(m_mainChainDataDebug.data() + outputs_offset, outputs_blob.data(), outputs_blob_size);
 #endif
 
+		const int nonce_offset = view.m_nonceOffset;
+		const int extra_nonce_offset = view.m_extraNonceOffset;
+		const int sidechain_hash_offset = view.m_sidechainHashOffset;
+
 		hash check;
 		const std::vector<uint8_t>& consensus_id = sidechain.consensus_id();
 		keccak_custom(
@@ -320,14 +389,14 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& si
 
 				return consensus_id[offset];
 			},
-			static_cast<int>(size + outputs_blob_size_diff + consensus_id.size()), check.h, HASH_SIZE);
+			static_cast<int>(view.m_size + outputs_blob_size_diff + consensus_id.size()), check.h, HASH_SIZE);
 
 		if (check != m_sidechainId) {
 			return __LINE__;
 		}
 
 #if POOL_BLOCK_DEBUG
-		m_sideChainDataDebug.assign(sidechain_data_begin, data_end);
+		m_sideChainDataDebug.assign(view.m_sidechainData, data_end);
 #endif
 	}
 	catch (std::exception& e) {
@@ -337,6 +406,7 @@ int PoolBlock::deserialize(const uint8_t* data, size_t size, const SideChain& si
 	}
 
 	reset_offchain_data();
+	finalize_blobs();
 	return 0;
 }
 
@@ -33,15 +33,38 @@ static constexpr char log_category_prefix[] = "RandomX_Hasher ";
 
 namespace p2pool {
 
+bool RandomX_Hasher_Base::calculate_batch(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (!calculate(blobs + i * blob_size, blob_size, height, seed, results[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
 #ifdef WITH_RANDOMX
 RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 	: m_pool(pool)
 	, m_cache{}
 	, m_dataset(nullptr)
+	, m_datasetReady(false)
+	, m_numFullVMs(0)
+	, m_fullVMAllocFailed(false)
 	, m_seed{}
 	, m_index(0)
 	, m_seedCounter(0)
 	, m_oldSeedCounter(0)
+	, m_pendingOldSeed{}
+	, m_prefetchEnabled(false)
+	, m_prefetchCache(nullptr)
+	, m_prefetchDataset(nullptr)
+	, m_prefetchSeed{}
+	, m_prefetchThread{}
+	, m_prefetchThreadStarted(false)
+	, m_prefetchBusy(false)
+	, m_prefetchReady(false)
+	, m_prefetchCancel(false)
 {
 	uint64_t memory_allocated = 0;
 
@@ -76,6 +99,20 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 
 	uv_rwlock_init_checked(&m_datasetLock);
 	uv_rwlock_init_checked(&m_cacheLock);
+	uv_mutex_init_checked(&m_fullVMsLock);
+	uv_mutex_init_checked(&m_prefetchLock);
+
+	if (m_dataset && m_pool->params().m_numa) {
+		alloc_node_datasets();
+		memory_allocated += m_nodeDatasets.size() * (RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE);
+	}
+
+	m_prefetchEnabled = m_dataset && m_pool->params().m_datasetPrefetch;
+
+	if (m_prefetchEnabled && !m_nodeDatasets.empty()) {
+		LOGWARN(1, "dataset prefetch doesn't work with --numa yet, disabling it");
+		m_prefetchEnabled = false;
+	}
 
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_vm); ++i) {
 		uv_mutex_init_checked(&m_vm[i].mutex);
@@ -90,11 +127,29 @@ RandomX_Hasher::RandomX_Hasher(p2pool* pool)
 RandomX_Hasher::~RandomX_Hasher()
 {
 	m_stopped.exchange(1);
+	m_prefetchCancel = true;
 	{
 		WriteLock lock(m_datasetLock);
 		WriteLock lock2(m_cacheLock);
 	}
 
+	{
+		MutexLock lock(m_prefetchLock);
+		if (m_prefetchThreadStarted) {
+			uv_thread_join(&m_prefetchThread);
+			m_prefetchThreadStarted = false;
+		}
+	}
+	uv_mutex_destroy(&m_prefetchLock);
+
+	if (m_prefetchDataset) {
+		randomx_release_dataset(m_prefetchDataset);
+	}
+
+	if (m_prefetchCache) {
+		randomx_release_cache(m_prefetchCache);
+	}
+
 	uv_rwlock_destroy(&m_datasetLock);
 	uv_rwlock_destroy(&m_cacheLock);
 
@@ -108,10 +163,20 @@ RandomX_Hasher::~RandomX_Hasher()
 		uv_mutex_destroy(&m_vm[i].mutex);
 	}
 
+	// All full dataset VMs are back in the free list because nothing can hold m_datasetLock now
+	for (randomx_vm* vm : m_freeFullVMs) {
+		randomx_destroy_vm(vm);
+	}
+	uv_mutex_destroy(&m_fullVMsLock);
+
 	if (m_dataset) {
 		randomx_release_dataset(m_dataset);
 	}
 
+	for (randomx_dataset* dataset : m_nodeDatasets) {
+		randomx_release_dataset(dataset);
+	}
+
 	for (size_t i = 0; i < array_size(&RandomX_Hasher::m_cache); ++i) {
 		if (m_cache[i]) {
 			randomx_release_cache(m_cache[i]);
@@ -121,6 +186,46 @@ RandomX_Hasher::~RandomX_Hasher()
 	LOGINFO(1, "stopped");
 }
 
+void RandomX_Hasher::alloc_node_datasets()
+{
+	const std::vector<std::vector<uint32_t>>& nodes = numa_nodes();
+	if (nodes.size() < 2) {
+		LOGINFO(1, "single NUMA node, using one dataset");
+		return;
+	}
+
+	// Leave enough memory for everything else
+	constexpr uint64_t MIN_FREE_MEMORY = 1024ULL << 20;
+
+	const size_t num_nodes = nodes.size();
+	const uint64_t needed = (num_nodes - 1) * (RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE);
+	const uint64_t free_memory = uv_get_free_memory();
+
+	if (free_memory < needed + MIN_FREE_MEMORY) {
+		LOGWARN(1, "not enough free memory for " << num_nodes << " dataset copies (" << (free_memory >> 20) << " MB free, " << ((needed + MIN_FREE_MEMORY) >> 20) << " MB required), using one dataset");
+		return;
+	}
+
+	// Pages are not touched here, set_seed() initializes each copy from threads pinned to its node so they end up in local memory
+	for (size_t i = 1; i < num_nodes; ++i) {
+		randomx_dataset* dataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+		if (!dataset) {
+			dataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+			if (!dataset) {
+				LOGWARN(1, "couldn't allocate RandomX dataset for NUMA node " << i << ", using one dataset");
+				for (randomx_dataset* d : m_nodeDatasets) {
+					randomx_release_dataset(d);
+				}
+				m_nodeDatasets.clear();
+				return;
+			}
+		}
+		m_nodeDatasets.push_back(dataset);
+	}
+
+	LOGINFO(1, "allocated a RandomX dataset copy for each of " << num_nodes << " NUMA nodes");
+}
+
 void RandomX_Hasher::set_seed_async(const hash& seed)
 {
 	if (m_seed[m_index] == seed) {
@@ -163,6 +268,12 @@ void RandomX_Hasher::set_seed_async(const hash& seed)
 	}
 }
 
+void RandomX_Hasher::set_seeds_async(const hash& seed, const hash& old_seed)
+{
+	m_pendingOldSeed = old_seed;
+	set_seed_async(seed);
+}
+
 void RandomX_Hasher::set_seed(const hash& seed)
 {
 	if (m_stopped.load()) {
@@ -179,6 +290,18 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		return;
 	}
 
+	if (m_pool) {
+		m_pool->startup_phase_begin(p2pool::StartupPhase::RANDOMX_SEED);
+	}
+
+	ON_SCOPE_LEAVE([this]()
+		{
+			if (m_pool) {
+				m_pool->startup_phase_end(p2pool::StartupPhase::RANDOMX_SEED);
+			}
+		});
+
+	bool prefetched = false;
 	{
 		ON_SCOPE_LEAVE([this]() { uv_rwlock_wrunlock(&m_cacheLock); });
 
@@ -190,7 +313,33 @@ void RandomX_Hasher::set_seed(const hash& seed)
 		m_seed[m_index] = seed;
 
 		LOGINFO(1, "new seed " << log::LightBlue() << seed);
-		randomx_init_cache(m_cache[m_index], m_seed[m_index].h, HASH_SIZE);
+
+		{
+			MutexLock lock2(m_prefetchLock);
+
+			if (m_prefetchReady && !m_prefetchBusy && (m_prefetchSeed == seed)) {
+				// Nothing can use the dataset now, all full dataset VMs are in the free list
+				std::swap(m_cache[m_index], m_prefetchCache);
+				std::swap(m_dataset, m_prefetchDataset);
+
+				MutexLock lock3(m_fullVMsLock);
+				for (randomx_vm* vm : m_freeFullVMs) {
+					randomx_vm_set_dataset(vm, m_dataset);
+				}
+
+				m_prefetchReady = false;
+				m_prefetchSeed = {};
+				prefetched = true;
+			}
+			else if (m_prefetchBusy) {
+				// Too late, the dataset will be built the usual way
+				m_prefetchCancel = true;
+			}
+		}
+
+		if (!prefetched) {
+			randomx_init_cache(m_cache[m_index], m_seed[m_index].h, HASH_SIZE);
+		}
 
 		MutexLock lock2(m_vm[m_index].mutex);
 
@@ -214,6 +363,16 @@ void RandomX_Hasher::set_seed(const hash& seed)
 
 	LOGINFO(1, log::LightCyan() << "cache updated");
 
+	if ((m_oldSeedCounter.load() == 0) && !m_pendingOldSeed.empty()) {
+		set_old_seed(m_pendingOldSeed);
+	}
+
+	if (prefetched) {
+		m_datasetReady = true;
+		LOGINFO(1, log::LightCyan() << "dataset updated (prefetched)");
+		return;
+	}
+
 	if (m_dataset) {
 		const uint32_t numItems = randomx_dataset_item_count();
 		uint32_t numThreads = std::thread::hardware_concurrency();
@@ -228,11 +387,45 @@ void RandomX_Hasher::set_seed(const hash& seed)
 			std::this_thread::yield();
 		}
 
-		LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+		if (m_nodeDatasets.empty()) {
+			LOGINFO(1, log::LightCyan() << "running " << numThreads << " threads to update dataset");
+		}
 
 		ReadLock lock2(m_cacheLock);
 
-		if (numThreads > 1) {
+		if (!m_nodeDatasets.empty()) {
+			const std::vector<std::vector<uint32_t>>& nodes = numa_nodes();
+
+			// Each copy is built only by threads pinned to its node, using half of its cores
+			std::vector<std::thread> threads;
+			threads.reserve(std::thread::hardware_concurrency() / 2 + nodes.size());
+
+			for (uint32_t node = 0; node <= m_nodeDatasets.size(); ++node) {
+				const std::vector<uint32_t>& cpus = nodes[node];
+				randomx_dataset* dataset = node_dataset(node);
+				const uint32_t n = std::max<uint32_t>(static_cast<uint32_t>(cpus.size() / 2), 1);
+
+				for (uint32_t i = 0; i < n; ++i) {
+					const uint32_t a = static_cast<uint32_t>((static_cast<uint64_t>(numItems) * i) / n);
+					const uint32_t b = static_cast<uint32_t>((static_cast<uint64_t>(numItems) * (i + 1)) / n);
+
+					threads.emplace_back([this, &cpus, dataset, a, b]()
+						{
+							set_thread_affinity(cpus);
+							randomx_init_dataset(dataset, m_cache[m_index], a, b - a);
+						});
+				}
+			}
+
+			const size_t num_threads = threads.size();
+			const size_t num_nodes = nodes.size();
+			LOGINFO(1, log::LightCyan() << "running " << num_threads << " threads on " << num_nodes << " NUMA nodes to update dataset");
+
+			for (std::thread& t : threads) {
+				t.join();
+			}
+		}
+		else if (numThreads > 1) {
 			std::vector<std::thread> threads;
 			threads.reserve(numThreads);
 
@@ -256,20 +449,7 @@ void RandomX_Hasher::set_seed(const hash& seed)
 			randomx_init_dataset(m_dataset, m_cache[m_index], 0, numItems);
 		}
 
-		MutexLock lock3(m_vm[FULL_DATASET_VM].mutex);
-
-		if (!m_vm[FULL_DATASET_VM].vm) {
-			const randomx_flags flags = randomx_get_flags() | RANDOMX_FLAG_FULL_MEM;
-
-			m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, nullptr, m_dataset);
-			if (!m_vm[FULL_DATASET_VM].vm) {
-				LOGWARN(1, "couldn't allocate RandomX VM using large pages");
-				m_vm[FULL_DATASET_VM].vm = randomx_create_vm(flags, nullptr, m_dataset);
-				if (!m_vm[FULL_DATASET_VM].vm) {
-					LOGERR(1, "couldn't allocate RandomX VM");
-				}
-			}
-		}
+		m_datasetReady = true;
 
 		LOGINFO(1, log::LightCyan() << "dataset updated");
 	}
@@ -282,14 +462,19 @@ void RandomX_Hasher::set_old_seed(const hash& seed)
 		std::this_thread::yield();
 	}
 
-	LOGINFO(1, "old seed " << log::LightBlue() << seed);
-
 	{
 		WriteLock lock(m_cacheLock);
 
-		m_oldSeedCounter.fetch_add(1);
-
 		const uint32_t old_index = m_index ^ 1;
+
+		// Already there if it came from set_seeds_async()
+		if (m_oldSeedCounter.load() && (m_seed[old_index] == seed)) {
+			return;
+		}
+
+		LOGINFO(1, "old seed " << log::LightBlue() << seed);
+
+		m_oldSeedCounter.fetch_add(1);
 		m_seed[old_index] = seed;
 
 		randomx_init_cache(m_cache[old_index], m_seed[old_index].h, HASH_SIZE);
@@ -316,12 +501,160 @@ void RandomX_Hasher::set_old_seed(const hash& seed)
 	LOGINFO(1, log::LightCyan() << "old cache updated");
 }
 
+void RandomX_Hasher::prefetch_seed_async(const hash& seed)
+{
+	if (!m_prefetchEnabled || m_stopped.load()) {
+		return;
+	}
+
+	MutexLock lock(m_prefetchLock);
+
+	if (m_prefetchBusy || (m_prefetchSeed == seed)) {
+		return;
+	}
+
+	{
+		ReadLock lock2(m_cacheLock);
+		if (m_seed[m_index] == seed) {
+			return;
+		}
+	}
+
+	if (m_prefetchThreadStarted) {
+		uv_thread_join(&m_prefetchThread);
+		m_prefetchThreadStarted = false;
+	}
+
+	if (!alloc_prefetch_buffers()) {
+		m_prefetchEnabled = false;
+		return;
+	}
+
+	m_prefetchSeed = seed;
+	m_prefetchReady = false;
+	m_prefetchCancel = false;
+	m_prefetchBusy = true;
+
+	const int err = uv_thread_create(&m_prefetchThread, prefetch_thread, this);
+	if (err) {
+		LOGERR(1, "failed to start dataset prefetch thread, error " << uv_err_name(err));
+		m_prefetchBusy = false;
+		m_prefetchSeed = {};
+		return;
+	}
+
+	m_prefetchThreadStarted = true;
+	LOGINFO(1, "prefetching dataset for the next seed " << log::LightBlue() << seed);
+}
+
+bool RandomX_Hasher::alloc_prefetch_buffers()
+{
+	if (m_prefetchCache && m_prefetchDataset) {
+		return true;
+	}
+
+	// Leave enough memory for everything else on small hosts
+	constexpr uint64_t MIN_FREE_MEMORY = 1024ULL << 20;
+
+	const uint64_t needed = RANDOMX_DATASET_BASE_SIZE + RANDOMX_DATASET_EXTRA_SIZE + RANDOMX_ARGON_MEMORY * 1024ULL;
+	const uint64_t free_memory = uv_get_free_memory();
+
+	if (free_memory < needed + MIN_FREE_MEMORY) {
+		LOGWARN(1, "not enough free memory for dataset prefetch (" << (free_memory >> 20) << " MB free, " << ((needed + MIN_FREE_MEMORY) >> 20) << " MB required), disabling it");
+		return false;
+	}
+
+	if (!m_prefetchCache) {
+		const randomx_flags flags = randomx_get_flags();
+
+		m_prefetchCache = randomx_alloc_cache(flags | RANDOMX_FLAG_LARGE_PAGES);
+		if (!m_prefetchCache) {
+			m_prefetchCache = randomx_alloc_cache(flags);
+			if (!m_prefetchCache) {
+				LOGWARN(1, "couldn't allocate RandomX cache for dataset prefetch, disabling it");
+				return false;
+			}
+		}
+	}
+
+	if (!m_prefetchDataset) {
+		m_prefetchDataset = randomx_alloc_dataset(RANDOMX_FLAG_LARGE_PAGES);
+		if (!m_prefetchDataset) {
+			m_prefetchDataset = randomx_alloc_dataset(RANDOMX_FLAG_DEFAULT);
+			if (!m_prefetchDataset) {
+				LOGWARN(1, "couldn't allocate RandomX dataset for dataset prefetch, disabling it");
+				return false;
+			}
+		}
+	}
+
+	LOGINFO(1, "allocated " << (needed >> 20) << " MB for dataset prefetch");
+	return true;
+}
+
+void RandomX_Hasher::prefetch_thread(void* arg)
+{
+	RandomX_Hasher* hasher = reinterpret_cast<RandomX_Hasher*>(arg);
+
+	make_thread_background();
+
+	// m_prefetchSeed, m_prefetchCache and m_prefetchDataset don't change while m_prefetchBusy is set
+	randomx_init_cache(hasher->m_prefetchCache, hasher->m_prefetchSeed.h, HASH_SIZE);
+
+	const uint32_t numItems = randomx_dataset_item_count();
+	const uint32_t numThreads = std::max(std::thread::hardware_concurrency() / 2, 1U);
+
+	auto init_range = [hasher](uint32_t a, uint32_t b)
+	{
+		// Small steps to react to cancellation quickly
+		constexpr uint32_t STEP = 1 << 14;
+
+		make_thread_background();
+		for (uint32_t i = a; (i < b) && !hasher->m_prefetchCancel.load(); i += STEP) {
+			randomx_init_dataset(hasher->m_prefetchDataset, hasher->m_prefetchCache, i, std::min<uint32_t>(b - i, STEP));
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(numThreads - 1);
+
+	try {
+		for (uint32_t i = 1; i < numThreads; ++i) {
+			threads.emplace_back(init_range, (numItems * i) / numThreads, (numItems * (i + 1)) / numThreads);
+		}
+	}
+	catch (const std::exception& e) {
+		LOGWARN(1, "dataset prefetch: failed to start a thread: " << e.what());
+		hasher->m_prefetchCancel = true;
+	}
+
+	init_range(0, numItems / numThreads);
+
+	for (std::thread& t : threads) {
+		t.join();
+	}
+
+	const bool ready = !hasher->m_prefetchCancel.load();
+	if (ready) {
+		LOGINFO(1, log::LightCyan() << "dataset prefetch finished");
+	}
+
+	hasher->m_prefetchReady = ready;
+	hasher->m_prefetchBusy = false;
+}
+
 void RandomX_Hasher::sync_wait()
 {
 	ReadLock lock(m_datasetLock);
 	ReadLock lock2(m_cacheLock);
 }
 
+hash RandomX_Hasher::current_seed()
+{
+	ReadLock lock(m_cacheLock);
+	return m_seed[m_index];
+}
+
 bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*/, const hash& seed, hash& result)
 {
 	// First try to use the dataset if it's ready
@@ -332,11 +665,13 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*
 			return false;
 		}
 
-		MutexLock lock(m_vm[FULL_DATASET_VM].mutex);
-
-		if (m_vm[FULL_DATASET_VM].vm && (seed == m_seed[m_index])) {
-			randomx_calculate_hash(m_vm[FULL_DATASET_VM].vm, data, size, &result);
-			return true;
+		if (m_datasetReady && (seed == m_seed[m_index])) {
+			randomx_vm* vm = acquire_full_vm();
+			if (vm) {
+				randomx_calculate_hash(vm, data, size, &result);
+				release_full_vm(vm);
+				return true;
+			}
 		}
 	}
 
@@ -366,6 +701,76 @@ bool RandomX_Hasher::calculate(const void* data, size_t size, uint64_t /*height*
 
 	return false;
 }
+
+bool RandomX_Hasher::calculate_batch(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results)
+{
+	if ((count > 1) && (uv_rwlock_tryrdlock(&m_datasetLock) == 0)) {
+		ON_SCOPE_LEAVE([this]() { uv_rwlock_rdunlock(&m_datasetLock); });
+
+		if (m_stopped.load()) {
+			return false;
+		}
+
+		if (m_datasetReady && (seed == m_seed[m_index])) {
+			randomx_vm* vm = acquire_full_vm();
+			if (vm) {
+				// Pipelined hashing: each call finishes the previous hash and starts the next one
+				randomx_calculate_hash_first(vm, blobs, blob_size);
+				for (size_t i = 1; i < count; ++i) {
+					randomx_calculate_hash_next(vm, blobs + i * blob_size, blob_size, &results[i - 1]);
+				}
+				randomx_calculate_hash_last(vm, &results[count - 1]);
+
+				release_full_vm(vm);
+				return true;
+			}
+		}
+	}
+
+	return RandomX_Hasher_Base::calculate_batch(blobs, blob_size, count, height, seed, results);
+}
+
+randomx_vm* RandomX_Hasher::acquire_full_vm()
+{
+	{
+		MutexLock lock(m_fullVMsLock);
+
+		if (!m_freeFullVMs.empty()) {
+			randomx_vm* vm = m_freeFullVMs.back();
+			m_freeFullVMs.pop_back();
+			return vm;
+		}
+	}
+
+	if (m_fullVMAllocFailed.load()) {
+		return nullptr;
+	}
+
+	// All full dataset VMs are busy in other threads, create one more
+	const randomx_flags flags = randomx_get_flags() | RANDOMX_FLAG_FULL_MEM;
+
+	randomx_vm* vm = randomx_create_vm(flags | RANDOMX_FLAG_LARGE_PAGES, nullptr, m_dataset);
+	if (!vm) {
+		LOGWARN(1, "couldn't allocate RandomX VM using large pages");
+		vm = randomx_create_vm(flags, nullptr, m_dataset);
+		if (!vm) {
+			LOGERR(1, "couldn't allocate RandomX VM");
+			m_fullVMAllocFailed = true;
+			return nullptr;
+		}
+	}
+
+	const uint32_t n = m_numFullVMs.fetch_add(1) + 1;
+	LOGINFO(4, "created full dataset VM, " << n << " VMs total");
+
+	return vm;
+}
+
+void RandomX_Hasher::release_full_vm(randomx_vm* vm)
+{
+	MutexLock lock(m_fullVMsLock);
+	m_freeFullVMs.push_back(vm);
+}
 #endif
 
 RandomX_Hasher_RPC::RandomX_Hasher_RPC(p2pool* pool)
@@ -34,13 +34,21 @@ public:
 
 	virtual void set_seed_async(const hash&) {}
 	virtual void set_old_seed(const hash&) {}
+	virtual void set_seeds_async(const hash&, const hash&) {}
+	virtual void prefetch_seed_async(const hash&) {}
 
 	virtual randomx_cache* cache() const { return nullptr; }
 	virtual randomx_dataset* dataset() const { return nullptr; }
+	virtual randomx_dataset* node_dataset(uint32_t) const { return dataset(); }
+	virtual uint32_t num_dataset_replicas() const { return 1; }
 	virtual uint32_t seed_counter() const { return 0; }
+	virtual hash current_seed() { return {}; }
 	virtual void sync_wait() {}
 
 	virtual bool calculate(const void* data, size_t size, uint64_t height, const hash& seed, hash& result) = 0;
+
+	// Calculates hashes of count blobs of the same size stored back to back
+	virtual bool calculate_batch(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results);
 };
 
 #ifdef WITH_RANDOMX
@@ -55,14 +63,26 @@ public:
 
 	void set_old_seed(const hash& seed) override;
 
+	// Both seeds at once, so the dataset doesn't wait for set_old_seed() (seeds from saved mainchain headers on startup)
+	void set_seeds_async(const hash& seed, const hash& old_seed) override;
+
+	// Builds the next seed's dataset in the background, set_seed() swaps it in when the seed changes
+	void prefetch_seed_async(const hash& seed) override;
+
 	randomx_cache* cache() const override { return m_cache[m_index]; }
 	randomx_dataset* dataset() const override { return m_dataset; }
+	randomx_dataset* node_dataset(uint32_t node) const override { return ((node > 0) && (node <= m_nodeDatasets.size())) ? m_nodeDatasets[node - 1] : m_dataset; }
+	uint32_t num_dataset_replicas() const override { return static_cast<uint32_t>(m_nodeDatasets.size() + 1); }
 	uint32_t seed_counter() const override { return m_seedCounter.load(); }
+	hash current_seed() override;
 	void sync_wait() override;
 
 	bool calculate(const void* data, size_t size, uint64_t height, const hash& seed, hash& result) override;
+	bool calculate_batch(const uint8_t* blobs, size_t blob_size, size_t count, uint64_t height, const hash& seed, hash* results) override;
 
 private:
+	randomx_vm* acquire_full_vm();
+	void release_full_vm(randomx_vm* vm);
 
 	struct ThreadSafeVM
 	{
@@ -79,18 +99,49 @@ private:
 
 	uv_rwlock_t m_datasetLock;
 	randomx_dataset* m_dataset;
+	bool m_datasetReady;
 
-	// 0: light VM for the current seed
-	// 1: light VM for the previous seed
-	// 2: full dataset VM for the current seed
-	enum { FULL_DATASET_VM = 2 };
-	ThreadSafeVM m_vm[3]{};
+	// Copies of m_dataset for NUMA nodes 1..N-1 (--numa), m_dataset is node 0's copy
+	std::vector<randomx_dataset*> m_nodeDatasets;
+	void alloc_node_datasets();
+
+	// Light VMs for the current and previous seeds, indexed by m_index
+	ThreadSafeVM m_vm[2]{};
+
+	// Full dataset VMs are created on demand, one for each thread calculating hashes at the same time
+	// They all share m_dataset, so they work for any seed and don't need an update when it changes
+	uv_mutex_t m_fullVMsLock;
+	std::vector<randomx_vm*> m_freeFullVMs;
+	std::atomic<uint32_t> m_numFullVMs;
+	std::atomic<bool> m_fullVMAllocFailed;
 
 	hash m_seed[2];
 	uint32_t m_index;
 
 	std::atomic<uint32_t> m_seedCounter;
 	std::atomic<uint32_t> m_oldSeedCounter;
+
+	// Set by set_seeds_async() before it queues set_seed()
+	hash m_pendingOldSeed;
+
+	// Cache and dataset for the next seed (--dataset-prefetch), allocated on first use
+	// After a swap they hold the previous seed's data until the next prefetch, which starts long after all miner threads have switched
+	static void prefetch_thread(void* arg);
+	bool alloc_prefetch_buffers();
+
+	bool m_prefetchEnabled;
+
+	uv_mutex_t m_prefetchLock;
+	randomx_cache* m_prefetchCache;
+	randomx_dataset* m_prefetchDataset;
+	hash m_prefetchSeed;
+
+	uv_thread_t m_prefetchThread;
+	bool m_prefetchThreadStarted;
+
+	std::atomic<bool> m_prefetchBusy;
+	std::atomic<bool> m_prefetchReady;
+	std::atomic<bool> m_prefetchCancel;
 };
 #endif
 
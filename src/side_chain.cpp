@@ -33,6 +33,8 @@
 #include "params.h"
 #include "json_parsers.h"
 #include "crypto.h"
+#include "metrics.h"
+#include "trace.h"
 #include <rapidjson/document.h>
 #include <rapidjson/istreamwrapper.h>
 #include <fstream>
@@ -48,23 +50,325 @@ static_assert(1 <= UNCLE_BLOCK_DEPTH && UNCLE_BLOCK_DEPTH <= 10, "Invalid UNCLE_
 
 static constexpr uint64_t MONERO_BLOCK_TIME = 120;
 
+// How many recently generated outputs blobs get_outputs_blob() keeps
+static constexpr size_t OUTPUTS_BLOB_CACHE_SIZE = 8;
+
 namespace p2pool {
 
 static constexpr uint8_t default_consensus_id[HASH_SIZE] = { 34,175,126,231,181,11,104,146,227,153,218,107,44,108,68,39,178,81,4,212,169,4,142,0,177,110,157,240,68,7,249,24 };
 static constexpr uint8_t mini_consensus_id[HASH_SIZE] = { 57,130,201,26,149,174,199,250,66,80,189,18,108,216,194,220,136,23,63,24,64,113,221,44,219,86,39,163,53,24,126,196 };
 
+void BlocksByHeight::init(uint64_t min_capacity)
+{
+	uint64_t capacity = 1;
+	while (capacity < min_capacity) {
+		capacity <<= 1;
+	}
+
+	m_slots.clear();
+	m_slots.resize(capacity);
+	m_mask = capacity - 1;
+	m_minHeight = std::numeric_limits<uint64_t>::max();
+	m_overflow.clear();
+}
+
+std::vector<PoolBlock*>* BlocksByHeight::find(uint64_t height)
+{
+	Slot& slot = m_slots[height & m_mask];
+	if ((slot.m_height == height) && !slot.m_blocks.empty()) {
+		return &slot.m_blocks;
+	}
+
+	if (!m_overflow.empty()) {
+		auto it = m_overflow.find(height);
+		if (it != m_overflow.end()) {
+			return &it->second;
+		}
+	}
+
+	return nullptr;
+}
+
+const std::vector<PoolBlock*>* BlocksByHeight::find(uint64_t height) const
+{
+	return const_cast<BlocksByHeight*>(this)->find(height);
+}
+
+void BlocksByHeight::add(uint64_t height, PoolBlock* block)
+{
+	m_minHeight = std::min(m_minHeight, height);
+
+	Slot& slot = m_slots[height & m_mask];
+	if ((slot.m_height == height) && !slot.m_blocks.empty()) {
+		slot.m_blocks.push_back(block);
+		return;
+	}
+
+	// This height can already be in the overflow map if its slot was occupied by another height at the time
+	if (!m_overflow.empty()) {
+		auto it = m_overflow.find(height);
+		if (it != m_overflow.end()) {
+			it->second.push_back(block);
+			return;
+		}
+	}
+
+	if (slot.m_blocks.empty()) {
+		slot.m_height = height;
+		slot.m_blocks.push_back(block);
+		return;
+	}
+
+	m_overflow[height].push_back(block);
+}
+
+void DifficultyWindow::clear()
+{
+	m_nodes.clear();
+	m_freeNodes.clear();
+	m_root = NONE;
+	m_heights = decltype(m_heights)();
+}
+
+void DifficultyWindow::add(uint64_t height, uint64_t timestamp, const difficulty_type& cumulative_difficulty)
+{
+	uint32_t index;
+	if (!m_freeNodes.empty()) {
+		index = m_freeNodes.back();
+		m_freeNodes.pop_back();
+	}
+	else {
+		index = static_cast<uint32_t>(m_nodes.size());
+		m_nodes.emplace_back();
+	}
+
+	// xorshift64*
+	m_rng ^= m_rng >> 12;
+	m_rng ^= m_rng << 25;
+	m_rng ^= m_rng >> 27;
+
+	Node& node = m_nodes[index];
+	node.m_timestamp = timestamp;
+	node.m_seq = m_seq++;
+	node.m_priority = m_rng * 0x2545F4914F6CDD1DULL;
+	node.m_cumulativeDifficulty = cumulative_difficulty;
+	node.m_left = NONE;
+	node.m_right = NONE;
+	update(index);
+
+	m_heights.emplace(height, index);
+
+	uint32_t left, right;
+	split(m_root, node.m_timestamp, node.m_seq, left, right);
+	m_root = merge(merge(left, index), right);
+}
+
+void DifficultyWindow::prune(uint64_t max_height)
+{
+	while (!m_heights.empty() && (m_heights.top().first <= max_height)) {
+		const uint32_t index = m_heights.top().second;
+		m_heights.pop();
+
+		const uint64_t timestamp = m_nodes[index].m_timestamp;
+		const uint64_t seq = m_nodes[index].m_seq;
+
+		// Cut out the [(timestamp, seq), (timestamp, seq + 1)) range which is exactly this node
+		uint32_t left, middle, right;
+		split(m_root, timestamp, seq, left, right);
+		split(right, timestamp, seq + 1, middle, right);
+		m_root = merge(left, right);
+
+		m_freeNodes.push_back(index);
+	}
+}
+
+void DifficultyWindow::get_range(uint64_t& timestamp1, uint64_t& timestamp2, difficulty_type& diff1, difficulty_type& diff2) const
+{
+	const uint32_t n = static_cast<uint32_t>(size());
+
+	const uint32_t cut_size = (n + 9) / 10;
+	const uint32_t index1 = cut_size - 1;
+	const uint32_t index2 = n - cut_size;
+
+	timestamp1 = kth(index1).m_timestamp;
+	timestamp2 = kth(index2).m_timestamp;
+
+	diff1 = { std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
+	diff2 = { 0, 0 };
+
+	// Entries with timestamp1 <= timestamp <= timestamp2 are a contiguous range in timestamp order
+	range_diff(m_root, count_less(timestamp1), count_less_or_equal(timestamp2), diff1, diff2);
+}
+
+void DifficultyWindow::update(uint32_t node)
+{
+	Node& n = m_nodes[node];
+
+	n.m_size = 1;
+	n.m_minDiff = n.m_cumulativeDifficulty;
+	n.m_maxDiff = n.m_cumulativeDifficulty;
+
+	for (uint32_t child : { n.m_left, n.m_right }) {
+		if (child != NONE) {
+			const Node& c = m_nodes[child];
+			n.m_size += c.m_size;
+			if (c.m_minDiff < n.m_minDiff) {
+				n.m_minDiff = c.m_minDiff;
+			}
+			if (n.m_maxDiff < c.m_maxDiff) {
+				n.m_maxDiff = c.m_maxDiff;
+			}
+		}
+	}
+}
+
+// All keys in "a" must be less than all keys in "b"
+uint32_t DifficultyWindow::merge(uint32_t a, uint32_t b)
+{
+	if (a == NONE) {
+		return b;
+	}
+	if (b == NONE) {
+		return a;
+	}
+
+	if (m_nodes[a].m_priority > m_nodes[b].m_priority) {
+		const uint32_t t = merge(m_nodes[a].m_right, b);
+		m_nodes[a].m_right = t;
+		update(a);
+		return a;
+	}
+
+	const uint32_t t = merge(a, m_nodes[b].m_left);
+	m_nodes[b].m_left = t;
+	update(b);
+	return b;
+}
+
+// "left" gets all keys less than (timestamp, seq), "right" gets the rest
+void DifficultyWindow::split(uint32_t node, uint64_t timestamp, uint64_t seq, uint32_t& left, uint32_t& right)
+{
+	if (node == NONE) {
+		left = NONE;
+		right = NONE;
+		return;
+	}
+
+	Node& n = m_nodes[node];
+
+	if ((n.m_timestamp < timestamp) || ((n.m_timestamp == timestamp) && (n.m_seq < seq))) {
+		split(n.m_right, timestamp, seq, n.m_right, right);
+		left = node;
+	}
+	else {
+		split(n.m_left, timestamp, seq, left, n.m_left);
+		right = node;
+	}
+
+	update(node);
+}
+
+const DifficultyWindow::Node& DifficultyWindow::kth(uint32_t k) const
+{
+	uint32_t node = m_root;
+
+	for (;;) {
+		const Node& n = m_nodes[node];
+		const uint32_t left_size = (n.m_left != NONE) ? m_nodes[n.m_left].m_size : 0;
+
+		if (k < left_size) {
+			node = n.m_left;
+		}
+		else if (k == left_size) {
+			return n;
+		}
+		else {
+			k -= left_size + 1;
+			node = n.m_right;
+		}
+	}
+}
+
+uint32_t DifficultyWindow::count_less(uint64_t timestamp) const
+{
+	uint32_t result = 0;
+
+	for (uint32_t node = m_root; node != NONE;) {
+		const Node& n = m_nodes[node];
+		if (n.m_timestamp < timestamp) {
+			result += ((n.m_left != NONE) ? m_nodes[n.m_left].m_size : 0) + 1;
+			node = n.m_right;
+		}
+		else {
+			node = n.m_left;
+		}
+	}
+
+	return result;
+}
+
+uint32_t DifficultyWindow::count_less_or_equal(uint64_t timestamp) const
+{
+	return (timestamp < std::numeric_limits<uint64_t>::max()) ? count_less(timestamp + 1) : static_cast<uint32_t>(size());
+}
+
+// Lowest and highest cumulative difficulty of entries [begin, end) in timestamp order, counting from the start of this subtree
+void DifficultyWindow::range_diff(uint32_t node, uint32_t begin, uint32_t end, difficulty_type& diff1, difficulty_type& diff2) const
+{
+	if ((node == NONE) || (begin >= end)) {
+		return;
+	}
+
+	const Node& n = m_nodes[node];
+
+	if ((begin == 0) && (end >= n.m_size)) {
+		if (n.m_minDiff < diff1) {
+			diff1 = n.m_minDiff;
+		}
+		if (diff2 < n.m_maxDiff) {
+			diff2 = n.m_maxDiff;
+		}
+		return;
+	}
+
+	const uint32_t left_size = (n.m_left != NONE) ? m_nodes[n.m_left].m_size : 0;
+
+	if (begin < left_size) {
+		range_diff(n.m_left, begin, std::min(end, left_size), diff1, diff2);
+	}
+
+	if ((begin <= left_size) && (left_size < end)) {
+		if (n.m_cumulativeDifficulty < diff1) {
+			diff1 = n.m_cumulativeDifficulty;
+		}
+		if (diff2 < n.m_cumulativeDifficulty) {
+			diff2 = n.m_cumulativeDifficulty;
+		}
+	}
+
+	if (end > left_size + 1) {
+		range_diff(n.m_right, (begin > left_size + 1) ? (begin - left_size - 1) : 0, end - left_size - 1, diff1, diff2);
+	}
+}
+
 SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	: m_pool(pool)
 	, m_networkType(type)
 	, m_chainTip{ nullptr }
 	, m_seenWalletsLastPruneTime(0)
+	, m_difficultyWindowHeight(0)
+	, m_difficultyCache{}
+	, m_difficultyCacheIndex(0)
 	, m_poolName(pool_name ? pool_name : "default")
 	, m_targetBlockTime(10)
 	, m_minDifficulty(MIN_DIFFICULTY, 0)
 	, m_chainWindowSize(2160)
 	, m_unclePenalty(20)
-	, m_curDifficulty(m_minDifficulty)
 	, m_precalcFinished(false)
+	, m_precalcStopped(false)
+	, m_numVerifyThreads(1)
+	, m_precheckedBlock(nullptr)
+	, m_precheckedWallets(nullptr)
 {
 	LOGINFO(1, log::LightCyan() << "network type  = " << m_networkType);
 
@@ -79,9 +383,19 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	uv_rwlock_init_checked(&m_sidechainLock);
 	uv_mutex_init_checked(&m_seenWalletsLock);
 	uv_mutex_init_checked(&m_seenBlocksLock);
-	uv_rwlock_init_checked(&m_curDifficultyLock);
+	uv_mutex_init_checked(&m_sharesWindowLock);
+	uv_mutex_init_checked(&m_chainStateFileLock);
+	uv_mutex_init_checked(&m_outputsBlobCacheLock);
+	uv_mutex_init_checked(&m_snapshotLock);
+
+	{
+		Snapshot* snapshot = new Snapshot();
+		snapshot->m_difficulty = m_minDifficulty;
+		m_snapshot.reset(snapshot);
+	}
 
-	m_difficultyData.reserve(m_chainWindowSize);
+	// prune_old_blocks() keeps 2xPPLNS window on the main chain, and alternative blocks for the time it takes to mine 4xPPLNS window
+	m_blocksByHeight.init(m_chainWindowSize * 6 + MONERO_BLOCK_TIME / m_targetBlockTime);
 
 	LOGINFO(1, "generating consensus ID");
 
@@ -158,6 +472,7 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	LOGINFO(1, "consensus ID = " << log::LightCyan() << m_consensusIdDisplayStr.c_str());
 
 	uv_cond_init_checked(&m_precalcJobsCond);
+	uv_cond_init_checked(&m_verifyBatchesCond);
 	uv_mutex_init_checked(&m_precalcJobsMutex);
 	m_precalcJobs.reserve(16);
 
@@ -176,6 +491,8 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 	if (numThreads > 8) numThreads = 8;
 #endif
 
+	m_numVerifyThreads = numThreads;
+
 	LOGINFO(4, "running " << numThreads << " pre-calculation workers");
 
 	m_precalcWorkers.reserve(numThreads);
@@ -183,6 +500,12 @@ SideChain::SideChain(p2pool* pool, NetworkType type, const char* pool_name)
 		m_precalcWorkers.emplace_back(&SideChain::precalc_worker, this);
 	}
 
+	// The thread which verifies blocks is the last helper
+	m_verifyWorkers.reserve(numThreads - 1);
+	for (uint32_t i = 1; i < numThreads; ++i) {
+		m_verifyWorkers.emplace_back(&SideChain::verify_worker, this);
+	}
+
 	m_uniquePrecalcInputs = new unordered_set<size_t>();
 }
 
@@ -193,10 +516,13 @@ SideChain::~SideChain()
 	uv_rwlock_destroy(&m_sidechainLock);
 	uv_mutex_destroy(&m_seenWalletsLock);
 	uv_mutex_destroy(&m_seenBlocksLock);
-	uv_rwlock_destroy(&m_curDifficultyLock);
+	uv_mutex_destroy(&m_sharesWindowLock);
+	uv_mutex_destroy(&m_chainStateFileLock);
+	uv_mutex_destroy(&m_outputsBlobCacheLock);
+	uv_mutex_destroy(&m_snapshotLock);
 
 	for (const auto& it : m_blocksById) {
-		delete it.second;
+		m_blockAllocator.destroy(it.second);
 	}
 }
 
@@ -204,7 +530,7 @@ void SideChain::fill_sidechain_data(PoolBlock& block, const Wallet* w, const has
 {
 	ReadLock lock(m_sidechainLock);
 
-	block.m_minerWallet = *w;
+	block.m_minerWallet.assign(*w);
 	block.m_txkeySec = txkeySec;
 	block.m_uncles.clear();
 
@@ -237,11 +563,11 @@ void SideChain::fill_sidechain_data(PoolBlock& block, const Wallet* w, const has
 	}
 
 	for (uint64_t i = 0, n = std::min<uint64_t>(UNCLE_BLOCK_DEPTH, tip->m_sidechainHeight + 1); i < n; ++i) {
-		auto it = m_blocksByHeight.find(tip->m_sidechainHeight - i);
-		if (it == m_blocksByHeight.end()) {
+		const std::vector<PoolBlock*>* blocks = m_blocksByHeight.find(tip->m_sidechainHeight - i);
+		if (!blocks) {
 			continue;
 		}
-		for (const PoolBlock* uncle : it->second) {
+		for (const PoolBlock* uncle : *blocks) {
 			// Only add verified and valid blocks
 			if (!uncle || !uncle->m_verified || uncle->m_invalid) {
 				continue;
@@ -310,12 +636,273 @@ void SideChain::fill_sidechain_data(PoolBlock& block, const Wallet* w, const has
 	get_shares(&block, shares);
 }
 
+void SideChain::precalc_template(const Wallet* w, const hash& txkeySec)
+{
+	// Initial sync uses its own pre-calculation jobs
+	if (!m_precalcFinished) {
+		return;
+	}
+
+	ReadLock lock(m_sidechainLock);
+
+	std::vector<const Wallet*> wallets;
+
+	const PoolBlock* tip = m_chainTip;
+	if (!tip || !get_wallets(tip, wallets)) {
+		return;
+	}
+
+	// The next block template will most likely have the same wallets plus this miner's wallet
+	auto it = std::lower_bound(wallets.begin(), wallets.end(), w, [](const Wallet* a, const Wallet* b) { return *a < *b; });
+	if ((it == wallets.end()) || !(**it == *w)) {
+		wallets.insert(it, w);
+	}
+
+	launch_background_precalc(txkeySec, wallets);
+}
+
 P2PServer* SideChain::p2pServer() const
 {
 	return m_pool ? m_pool->p2p_server() : nullptr;
 }
 
+uint64_t SideChain::uncle_penalty(const PoolBlock* uncle) const
+{
+	// Take some % of uncle's weight into the share of the block which mined it
+	uint64_t product[2];
+	product[0] = umul128(uncle->m_difficulty.lo, m_unclePenalty, &product[1]);
+
+	uint64_t rem;
+	return udiv128(product[1], product[0], 100, &rem);
+}
+
+void SideChain::SharesWindow::update(const Delta& d, bool add)
+{
+	auto it = m_entries.find(d.m_wallet->spend_public_key());
+	if (it == m_entries.end()) {
+		it = m_entries.emplace(d.m_wallet->spend_public_key(), Entry{ 0, {} }).first;
+	}
+
+	Entry& e = it->second;
+
+	if (add) {
+		e.m_weight += d.m_weight;
+	}
+	else {
+		e.m_weight -= d.m_weight;
+	}
+
+	if (d.m_refs) {
+		auto w = std::find_if(e.m_wallets.begin(), e.m_wallets.end(),
+			[&d](const std::pair<const Wallet*, uint64_t>& p) { return p.first->view_public_key() == d.m_wallet->view_public_key(); });
+
+		if (add) {
+			if (w != e.m_wallets.end()) {
+				w->second += d.m_refs;
+			}
+			else {
+				e.m_wallets.emplace_back(d.m_wallet, d.m_refs);
+			}
+		}
+		else if (w != e.m_wallets.end()) {
+			w->second -= d.m_refs;
+			if (w->second == 0) {
+				e.m_wallets.erase(w);
+			}
+		}
+	}
+
+	if (e.m_wallets.empty()) {
+		m_entries.erase(it);
+	}
+}
+
+void SideChain::SharesWindow::apply(const std::vector<Delta>& deltas)
+{
+	for (const Delta& d : deltas) {
+		update(d, d.m_add);
+	}
+}
+
+void SideChain::SharesWindow::revert(const std::vector<Delta>& deltas)
+{
+	for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+		update(*it, !it->m_add);
+	}
+}
+
+void SideChain::SharesWindow::get_shares(std::vector<MinerShare>& shares) const
+{
+	shares.clear();
+	shares.reserve(m_entries.size());
+
+	// Same choice as combine_shares(): the wallet with the lowest view key gets the share
+	for (const auto& it : m_entries) {
+		const Wallet* wallet = it.second.m_wallets.front().first;
+		for (const auto& w : it.second.m_wallets) {
+			if (w.first->view_public_key() < wallet->view_public_key()) {
+				wallet = w.first;
+			}
+		}
+		shares.emplace_back(it.second.m_weight, wallet);
+	}
+}
+
+bool SideChain::build_shares_window(const PoolBlock* tip) const
+{
+	m_sharesWindow.clear();
+
+	std::vector<SharesWindow::Delta> deltas;
+	deltas.reserve(m_chainWindowSize * 2);
+
+	uint64_t block_depth = 0;
+	const PoolBlock* cur = tip;
+	do {
+		uint64_t weight = cur->m_difficulty.lo;
+
+		for (const hash& uncle_id : cur->m_uncles) {
+			auto it = m_blocksById.find(uncle_id);
+			if (it == m_blocksById.end()) {
+				m_sharesWindow.clear();
+				return false;
+			}
+
+			const PoolBlock* uncle = it->second;
+
+			// Skip uncles which are already out of PPLNS window
+			if (tip->m_sidechainHeight - uncle->m_sidechainHeight >= m_chainWindowSize) {
+				continue;
+			}
+
+			const uint64_t penalty = uncle_penalty(uncle);
+			weight += penalty;
+			deltas.push_back({ uncle->m_minerWallet.get(), uncle->m_difficulty.lo - penalty, 1, true });
+		}
+
+		deltas.push_back({ cur->m_minerWallet.get(), weight, 1, true });
+		m_sharesWindow.m_blocks.push_back(cur);
+
+		++block_depth;
+		if ((block_depth >= m_chainWindowSize) || (cur->m_sidechainHeight == 0)) {
+			break;
+		}
+
+		cur = get_parent(cur);
+		if (!cur) {
+			m_sharesWindow.clear();
+			return false;
+		}
+	} while (true);
+
+	m_sharesWindow.apply(deltas);
+	m_sharesWindow.m_tipId = tip->m_sidechainId;
+
+	return true;
+}
+
 bool SideChain::get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares) const
+{
+	// Genesis block and blocks without known parents can't reuse the parent's window
+	const PoolBlock* parent = tip->m_sidechainHeight ? get_parent(tip) : nullptr;
+	if (!parent || (parent->m_sidechainHeight + 1 != tip->m_sidechainHeight)) {
+		return get_shares_full(tip, shares);
+	}
+
+	// Only blocks which are already in the sidechain can become the new base for incremental updates
+	auto tip_it = m_blocksById.find(tip->m_sidechainId);
+	const bool is_stored = (tip_it != m_blocksById.end()) && (tip_it->second == tip);
+
+	MutexLock lock(m_sharesWindowLock);
+
+	if (is_stored && (m_sharesWindow.m_tipId == tip->m_sidechainId) && !m_sharesWindow.m_blocks.empty()) {
+		m_sharesWindow.get_shares(shares);
+		return true;
+	}
+
+	if ((m_sharesWindow.m_blocks.empty() || (m_sharesWindow.m_tipId != parent->m_sidechainId)) && !build_shares_window(parent)) {
+		return get_shares_full(tip, shares);
+	}
+
+	const std::deque<const PoolBlock*>& window = m_sharesWindow.m_blocks;
+
+	std::vector<SharesWindow::Delta> deltas;
+	deltas.reserve(UNCLE_BLOCK_DEPTH * 3 + 4);
+
+	// Add the new block and its uncles
+	uint64_t weight = tip->m_difficulty.lo;
+
+	for (const hash& uncle_id : tip->m_uncles) {
+		auto it = m_blocksById.find(uncle_id);
+		if (it == m_blocksById.end()) {
+			LOGWARN(3, "get_shares: can't find uncle block at height = " << tip->m_sidechainHeight << ", id = " << uncle_id);
+			LOGWARN(3, "get_shares: can't calculate shares for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+			return false;
+		}
+
+		const PoolBlock* uncle = it->second;
+		if (tip->m_sidechainHeight - uncle->m_sidechainHeight >= m_chainWindowSize) {
+			continue;
+		}
+
+		const uint64_t penalty = uncle_penalty(uncle);
+		weight += penalty;
+		deltas.push_back({ uncle->m_minerWallet.get(), uncle->m_difficulty.lo - penalty, 1, true });
+	}
+
+	deltas.push_back({ tip->m_minerWallet.get(), weight, 1, true });
+
+	// The oldest block in the parent's window falls out. Its uncles are already out of the window at this point.
+	const bool window_full = (window.size() >= m_chainWindowSize);
+	if (window_full) {
+		const PoolBlock* b = window.back();
+		deltas.push_back({ b->m_minerWallet.get(), b->m_difficulty.lo, 1, false });
+	}
+
+	// Uncles at height (tip height - m_chainWindowSize) fall out too: both their own shares and the penalty given to the blocks which mined them
+	if (tip->m_sidechainHeight >= m_chainWindowSize) {
+		const uint64_t uncle_height = tip->m_sidechainHeight - m_chainWindowSize;
+		const size_t new_window_size = std::min<size_t>(m_chainWindowSize, window.size() + 1);
+
+		for (size_t j = (new_window_size > UNCLE_BLOCK_DEPTH) ? (new_window_size - UNCLE_BLOCK_DEPTH) : 1; j < new_window_size; ++j) {
+			const PoolBlock* b = window[j - 1];
+			for (const hash& uncle_id : b->m_uncles) {
+				auto it = m_blocksById.find(uncle_id);
+				if (it == m_blocksById.end()) {
+					m_sharesWindow.clear();
+					return get_shares_full(tip, shares);
+				}
+
+				const PoolBlock* uncle = it->second;
+				if (uncle->m_sidechainHeight == uncle_height) {
+					const uint64_t penalty = uncle_penalty(uncle);
+					deltas.push_back({ b->m_minerWallet.get(), penalty, 0, false });
+					deltas.push_back({ uncle->m_minerWallet.get(), uncle->m_difficulty.lo - penalty, 1, false });
+				}
+			}
+		}
+	}
+
+	m_sharesWindow.apply(deltas);
+	m_sharesWindow.get_shares(shares);
+
+	if (is_stored) {
+		// Keep the new window, next time it can be extended by one more block
+		m_sharesWindow.m_blocks.push_front(tip);
+		if (window_full) {
+			m_sharesWindow.m_blocks.pop_back();
+		}
+		m_sharesWindow.m_tipId = tip->m_sidechainId;
+	}
+	else {
+		// Block templates are not a part of the sidechain yet, keep the parent's window
+		m_sharesWindow.revert(deltas);
+	}
+
+	LOGINFO(6, "get_shares: " << shares.size() << " unique wallets in PPLNS window");
+	return true;
+}
+
+bool SideChain::get_shares_full(const PoolBlock* tip, std::vector<MinerShare>& shares) const
 {
 	shares.clear();
 	shares.reserve(m_chainWindowSize * 2);
@@ -325,7 +912,7 @@ bool SideChain::get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares
 	uint64_t block_depth = 0;
 	const PoolBlock* cur = tip;
 	do {
-		MinerShare cur_share{ cur->m_difficulty.lo, &cur->m_minerWallet };
+		MinerShare cur_share{ cur->m_difficulty.lo, cur->m_minerWallet.get() };
 
 		for (const hash& uncle_id : cur->m_uncles) {
 			auto it = m_blocksById.find(uncle_id);
@@ -350,7 +937,7 @@ bool SideChain::get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares
 			const uint64_t uncle_penalty = udiv128(product[1], product[0], 100, &rem);
 
 			cur_share.m_weight += uncle_penalty;
-			shares.emplace_back(uncle->m_difficulty.lo - uncle_penalty, &uncle->m_minerWallet);
+			shares.emplace_back(uncle->m_difficulty.lo - uncle_penalty, uncle->m_minerWallet.get());
 		}
 
 		shares.push_back(cur_share);
@@ -375,13 +962,43 @@ bool SideChain::get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares
 		cur = it->second;
 	} while (true);
 
+	combine_shares(shares);
+
+	LOGINFO(6, "get_shares: " << shares.size() << " unique wallets in PPLNS window");
+	return true;
+}
+
+void SideChain::combine_shares(std::vector<MinerShare>& shares)
+{
 	// Combine shares with the same wallet addresses
-	std::sort(shares.begin(), shares.end(), [](const auto& a, const auto& b) { return *a.m_wallet < *b.m_wallet; });
+	// Wallets are interned, so the first pass only compares pointers
+	// The second pass sorts the much shorter list of unique wallets by address, wallets with the same spend key are sorted by view key
+	// so the share always goes to the same wallet, no matter in which order they were in the PPLNS window
+	merge_shares(shares, [](const Wallet* a, const Wallet* b) { return a < b; }, [](const Wallet* a, const Wallet* b) { return a == b; });
+	merge_shares(shares,
+		[](const Wallet* a, const Wallet* b)
+		{
+			if (*a == *b) {
+				return a->view_public_key() < b->view_public_key();
+			}
+			return *a < *b;
+		},
+		[](const Wallet* a, const Wallet* b) { return *a == *b; });
+}
+
+template<typename Less, typename Equal>
+void SideChain::merge_shares(std::vector<MinerShare>& shares, Less less, Equal equal)
+{
+	if (shares.empty()) {
+		return;
+	}
+
+	std::sort(shares.begin(), shares.end(), [&less](const MinerShare& a, const MinerShare& b) { return less(a.m_wallet, b.m_wallet); });
 
 	size_t k = 0;
 	for (size_t i = 1, n = shares.size(); i < n; ++i)
 	{
-		if (*shares[i].m_wallet == *shares[k].m_wallet) {
+		if (equal(shares[i].m_wallet, shares[k].m_wallet)) {
 			shares[k].m_weight += shares[i].m_weight;
 		}
 		else {
@@ -392,9 +1009,6 @@ bool SideChain::get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares
 	}
 
 	shares.resize(k + 1);
-
-	LOGINFO(6, "get_shares: " << k + 1 << " unique wallets in PPLNS window");
-	return true;
 }
 
 bool SideChain::get_wallets(const PoolBlock* tip, std::vector<const Wallet*>& wallets) const
@@ -407,7 +1021,7 @@ bool SideChain::get_wallets(const PoolBlock* tip, std::vector<const Wallet*>& wa
 	const PoolBlock* cur = tip;
 
 	do {
-		wallets.push_back(&cur->m_minerWallet);
+		wallets.push_back(cur->m_minerWallet.get());
 
 		for (const hash& uncle_id : cur->m_uncles) {
 			auto it = m_blocksById.find(uncle_id);
@@ -417,7 +1031,7 @@ bool SideChain::get_wallets(const PoolBlock* tip, std::vector<const Wallet*>& wa
 
 			// Skip uncles which are already out of PPLNS window
 			if (tip->m_sidechainHeight - it->second->m_sidechainHeight < m_chainWindowSize) {
-				wallets.push_back(&it->second->m_minerWallet);
+				wallets.push_back(it->second->m_minerWallet.get());
 			}
 		}
 
@@ -434,7 +1048,10 @@ bool SideChain::get_wallets(const PoolBlock* tip, std::vector<const Wallet*>& wa
 		cur = it->second;
 	} while (true);
 
-	// Remove duplicates
+	// Remove duplicates, comparing interned wallet pointers first
+	std::sort(wallets.begin(), wallets.end());
+	wallets.erase(std::unique(wallets.begin(), wallets.end()), wallets.end());
+
 	std::sort(wallets.begin(), wallets.end(), [](const Wallet* a, const Wallet* b) { return *a < *b; });
 	wallets.erase(std::unique(wallets.begin(), wallets.end(), [](const Wallet* a, const Wallet* b) { return *a == *b; }), wallets.end());
 
@@ -456,6 +1073,13 @@ bool SideChain::block_seen(const PoolBlock& block)
 	return !m_seenBlocks.insert(block.m_sidechainId).second;
 }
 
+// Unlike block_seen(), doesn't mark the block as seen, so it can be used with unverified ids
+bool SideChain::was_seen(const hash& id)
+{
+	MutexLock lock(m_seenBlocksLock);
+	return m_seenBlocks.find(id) != m_seenBlocks.end();
+}
+
 void SideChain::unsee_block(const PoolBlock& block)
 {
 	MutexLock lock(m_seenBlocksLock);
@@ -464,6 +1088,10 @@ void SideChain::unsee_block(const PoolBlock& block)
 
 bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks)
 {
+	ScopedLatency latency(metrics::add_external_block);
+	TraceSpan span("add_external_block", block.m_sidechainId);
+	AllocationTag tag(alloc_profiler::Tag::SIDECHAIN);
+
 	if (block.m_difficulty < m_minDifficulty) {
 		LOGWARN(3, "add_external_block: block has invalid difficulty " << block.m_difficulty << ", expected >= " << m_minDifficulty);
 		return false;
@@ -471,6 +1099,7 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 
 	const difficulty_type expected_diff = difficulty();
 	bool too_low_diff = (block.m_difficulty < expected_diff);
+	bool trusted = false;
 	{
 		ReadLock lock(m_sidechainLock);
 		if (m_blocksById.find(block.m_sidechainId) != m_blocksById.end()) {
@@ -478,6 +1107,9 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 			return true;
 		}
 
+		// Only to skip prechecking output keys, verify() decides if this block is trusted
+		trusted = is_trusted(block);
+
 		// This is mainly an anti-spam measure, not an actual verification step
 		if (too_low_diff) {
 			// Reduce required diff by 50% (by doubling this block's diff) to account for alternative chains
@@ -493,6 +1125,14 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 				}
 			}
 		}
+
+		// Start calculating this block's output keys in the background while its PoW is being checked
+		if (!too_low_diff && m_precalcFinished) {
+			std::vector<const Wallet*> wallets;
+			if (get_wallets(&block, wallets)) {
+				launch_background_precalc(block.m_txkeySec, wallets);
+			}
+		}
 	}
 
 	LOGINFO(4, "add_external_block: height = " << block.m_sidechainHeight << ", id = " << block.m_sidechainId << ", mainchain height = " << block.m_txinGenHeight);
@@ -550,6 +1190,11 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 		return false;
 	}
 
+	// Output keys are the most expensive part of verification, check them before add_block() takes the write lock
+	// If they're wrong, verify() will check them again and mark this block as invalid
+	std::vector<InternedWallet> prechecked_wallets;
+	const bool prechecked = !trusted && precheck_outputs(block, prechecked_wallets);
+
 	bool block_found = false;
 
 	missing_blocks.clear();
@@ -582,26 +1227,50 @@ bool SideChain::add_external_block(PoolBlock& block, std::vector<hash>& missing_
 		m_pool->api_update_block_found(&data, &block);
 	}
 
-	add_block(block);
+	add_block(block, prechecked ? &prechecked_wallets : nullptr);
 	return true;
 }
 
 void SideChain::add_block(const PoolBlock& block)
 {
+	add_block(block, nullptr);
+}
+
+void SideChain::add_block(const PoolBlock& block, const std::vector<InternedWallet>* prechecked_wallets)
+{
+	add_block_locked(block, prechecked_wallets);
+
+	// A new chain tip's snapshot walks the PPLNS window, this is done after the write lock is released
+	publish_snapshot();
+}
+
+void SideChain::add_block_locked(const PoolBlock& block, const std::vector<InternedWallet>* prechecked_wallets)
+{
+	AllocationTag tag(alloc_profiler::Tag::SIDECHAIN);
+
 	LOGINFO(3, "add_block: height = " << block.m_sidechainHeight <<
 		", id = " << block.m_sidechainId <<
 		", mainchain height = " << block.m_txinGenHeight <<
 		", verified = " << (block.m_verified ? 1 : 0)
 	);
 
-	PoolBlock* new_block = new PoolBlock(block);
+	WriteLock lock(m_sidechainLock);
+
+	PoolBlock* new_block = m_blockAllocator.create(block);
+
+	// Deserialized blocks already have them, only our own blocks are serialized here
+	// Old blocks added during sync don't need them, see release_old_blobs()
+	if (new_block->m_sidechainHeight >= m_blobsReleaseHeight) {
+		new_block->finalize_blobs();
+	}
+	else {
+		new_block->m_blobs.reset();
+	}
 	{
-		MutexLock lock(m_seenWalletsLock);
-		m_seenWallets[new_block->m_minerWallet.spend_public_key()] = new_block->m_localTimestamp;
+		MutexLock lock2(m_seenWalletsLock);
+		m_seenWallets[new_block->m_minerWallet->spend_public_key()] = new_block->m_localTimestamp;
 	}
 
-	WriteLock lock(m_sidechainLock);
-
 	auto result = m_blocksById.insert({ new_block->m_sidechainId, new_block });
 	if (!result.second) {
 		LOGWARN(3, "add_block: trying to add the same block twice, id = "
@@ -609,11 +1278,13 @@ void SideChain::add_block(const PoolBlock& block)
 			<< new_block->m_sidechainHeight << ", height = "
 			<< new_block->m_txinGenHeight);
 
-		delete new_block;
+		m_blockAllocator.destroy(new_block);
 		return;
 	}
 
-	m_blocksByHeight[new_block->m_sidechainHeight].push_back(new_block);
+	m_blocksByHeight.add(new_block->m_sidechainHeight, new_block);
+
+	metrics::uncles.add(new_block->m_uncles.size());
 
 	// Pre-calculate eph_public_keys during initial sync
 	launch_precalc(new_block);
@@ -631,7 +1302,13 @@ void SideChain::add_block(const PoolBlock& block)
 		}
 	}
 	else {
+		m_precheckedBlock = new_block;
+		m_precheckedWallets = prechecked_wallets;
+
 		verify_loop(new_block);
+
+		m_precheckedBlock = nullptr;
+		m_precheckedWallets = nullptr;
 	}
 }
 
@@ -654,39 +1331,76 @@ void SideChain::watch_mainchain_block(const ChainMain& data, const hash& possibl
 	m_watchBlockSidechainId = possible_id;
 }
 
-bool SideChain::get_block_blob(const hash& id, std::vector<uint8_t>& blob) const
+bool SideChain::get_block_blob(const hash& id, BlockBlob& blob) const
 {
-	ReadLock lock(m_sidechainLock);
-
-	const PoolBlock* block = nullptr;
-
 	// Empty hash means we return current sidechain tip
 	if (id.empty()) {
-		block = m_chainTip;
+		const std::shared_ptr<const Snapshot> s = snapshot();
 
 		// Don't return stale chain tip
-		if (block && (block->m_txinGenHeight + 2 < m_pool->miner_data().height)) {
+		if (!s->m_blobs || (s->m_txinGenHeight + 2 < m_pool->miner_data().height)) {
 			return false;
 		}
-	}
-	else {
-		auto it = m_blocksById.find(id);
-		if (it != m_blocksById.end()) {
-			block = it->second;
-		}
+
+		blob = BlockBlob(s->m_blobs, &s->m_blobs->m_full);
+		return true;
 	}
 
-	if (!block) {
+	ReadLock lock(m_sidechainLock);
+
+	auto it = m_blocksById.find(id);
+	if (it == m_blocksById.end()) {
 		return false;
 	}
 
-	blob = block->serialize_mainchain_data();
-	const std::vector<uint8_t> sidechain_data = block->serialize_sidechain_data();
-	blob.insert(blob.end(), sidechain_data.begin(), sidechain_data.end());
+	const std::shared_ptr<const PoolBlock::Blobs> blobs = it->second->get_blobs();
+	blob = BlockBlob(blobs, &blobs->m_full);
 
 	return true;
 }
 
+std::shared_ptr<const PoolBlock::Blobs> SideChain::get_cached_blobs(const hash& id) const
+{
+	ReadLock lock(m_sidechainLock);
+
+	auto it = m_blocksById.find(id);
+	if (it == m_blocksById.end()) {
+		return nullptr;
+	}
+
+	return it->second->m_blobs;
+}
+
+void SideChain::get_ancestor_blobs(const hash& id, uint32_t max_count, size_t max_size, std::vector<BlockBlob>& blobs) const
+{
+	blobs.clear();
+
+	ReadLock lock(m_sidechainLock);
+
+	size_t total_size = 0;
+	hash cur_id = id;
+
+	while (blobs.size() < max_count) {
+		auto it = m_blocksById.find(cur_id);
+		if (it == m_blocksById.end()) {
+			break;
+		}
+
+		const PoolBlock* block = it->second;
+
+		const std::shared_ptr<const PoolBlock::Blobs> block_blobs = block->get_blobs();
+
+		total_size += block_blobs->m_full.size();
+		blobs.emplace_back(block_blobs, &block_blobs->m_full);
+
+		if (total_size >= max_size) {
+			break;
+		}
+
+		cur_id = block->m_parent;
+	}
+}
+
 bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob, uv_loop_t* loop) const
 {
 	blob.clear();
@@ -725,6 +1439,41 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 	}
 
 	const size_t n = tmpShares.size();
+	const uint8_t tx_type = block->get_tx_type();
+
+	// Outputs depend only on the tx key, the shares and the total reward
+	// The same pruned block usually comes from several peers, so look for it in the cache first
+	hash cache_key;
+	{
+		std::vector<uint8_t> key_data;
+		key_data.reserve(HASH_SIZE + sizeof(uint64_t) + 1 + n * (HASH_SIZE * 2 + sizeof(uint64_t)));
+
+		key_data.insert(key_data.end(), block->m_txkeySec.h, block->m_txkeySec.h + HASH_SIZE);
+		writeVarint(total_reward, key_data);
+		key_data.push_back(tx_type);
+
+		for (const MinerShare& share : tmpShares) {
+			const hash& spend = share.m_wallet->spend_public_key();
+			const hash& view = share.m_wallet->view_public_key();
+			key_data.insert(key_data.end(), spend.h, spend.h + HASH_SIZE);
+			key_data.insert(key_data.end(), view.h, view.h + HASH_SIZE);
+			writeVarint(share.m_weight, key_data);
+		}
+
+		keccak(key_data.data(), static_cast<int>(key_data.size()), cache_key.h, HASH_SIZE);
+	}
+
+	{
+		MutexLock lock2(m_outputsBlobCacheLock);
+
+		for (const OutputsBlob& cached : m_outputsBlobCache) {
+			if (cached.m_key == cache_key) {
+				blob = cached.m_blob;
+				block->m_outputs = cached.m_outputs;
+				return true;
+			}
+		}
+	}
 
 	// Helper jobs call get_eph_public_key with indices in descending order
 	// Current thread will process indices in ascending order so when they meet, everything will be cached
@@ -790,8 +1539,6 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 	block->m_outputs.clear();
 	block->m_outputs.reserve(n);
 
-	const uint8_t tx_type = block->get_tx_type();
-
 	hash eph_public_key;
 	for (size_t i = 0; i < n; ++i) {
 		// stop helper jobs when they meet with current thread
@@ -829,18 +1576,22 @@ bool SideChain::get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::v
 		}
 	}
 
+	{
+		MutexLock lock2(m_outputsBlobCacheLock);
+
+		if (m_outputsBlobCache.size() >= OUTPUTS_BLOB_CACHE_SIZE) {
+			m_outputsBlobCache.pop_back();
+		}
+		m_outputsBlobCache.push_front({ cache_key, blob, block->m_outputs });
+	}
+
 	return true;
 }
 
-void SideChain::print_status(bool obtain_sidechain_lock) const
+void SideChain::print_status() const
 {
-	std::vector<hash> blocks_in_window;
-	blocks_in_window.reserve(m_chainWindowSize * 9 / 8);
-
-	const difficulty_type diff = difficulty();
-
-	if (obtain_sidechain_lock) uv_rwlock_rdlock(&m_sidechainLock);
-	ON_SCOPE_LEAVE([this, obtain_sidechain_lock]() { if (obtain_sidechain_lock) uv_rwlock_rdunlock(&m_sidechainLock); });
+	const std::shared_ptr<const Snapshot> snapshot = this->snapshot();
+	const difficulty_type& diff = snapshot->m_difficulty;
 
 	uint64_t rem;
 	uint64_t pool_hashrate = udiv128(diff.hi, diff.lo, m_targetBlockTime, &rem);
@@ -848,99 +1599,20 @@ void SideChain::print_status(bool obtain_sidechain_lock) const
 	difficulty_type network_diff = m_pool->miner_data().difficulty;
 	uint64_t network_hashrate = udiv128(network_diff.hi, network_diff.lo, MONERO_BLOCK_TIME, &rem);
 
-	const PoolBlock* tip = m_chainTip;
-
-	uint64_t block_depth = 0;
-	const PoolBlock* cur = tip;
-	const uint64_t tip_height = tip ? tip->m_sidechainHeight : 0;
-
-	uint32_t total_blocks_in_window = 0;
-	uint32_t total_uncles_in_window = 0;
-
-	// each dot corresponds to m_chainWindowSize / 30 shares, with current values, 2160 / 30 = 72
-	std::array<uint32_t, 30> our_blocks_in_window{};
-	std::array<uint32_t, 30> our_uncles_in_window{};
-
-	while (cur) {
-		blocks_in_window.emplace_back(cur->m_sidechainId);
-		++total_blocks_in_window;
-
-		if (cur->m_minerWallet == m_pool->params().m_wallet) {
-			// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
-			const size_t window_index = (total_blocks_in_window - 1) / ((m_chainWindowSize + our_blocks_in_window.size() - 1) / our_blocks_in_window.size());
-			our_blocks_in_window[std::min(window_index, our_blocks_in_window.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
-		}
-
-		++block_depth;
-		if (block_depth >= m_chainWindowSize) {
-			break;
-		}
-
-		for (const hash& uncle_id : cur->m_uncles) {
-			blocks_in_window.emplace_back(uncle_id);
-			auto it = m_blocksById.find(uncle_id);
-			if (it != m_blocksById.end()) {
-				PoolBlock* uncle = it->second;
-				if (tip_height - uncle->m_sidechainHeight < m_chainWindowSize) {
-					++total_uncles_in_window;
-					if (uncle->m_minerWallet == m_pool->params().m_wallet) {
-						// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
-						const size_t window_index = (total_blocks_in_window - 1) / ((m_chainWindowSize + our_uncles_in_window.size() - 1) / our_uncles_in_window.size());
-						our_uncles_in_window[std::min(window_index, our_uncles_in_window.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
-					}
-				}
-			}
-		}
-
-		cur = get_parent(cur);
-	}
+	const uint64_t tip_height = snapshot->m_sidechainHeight;
 
-	uint64_t total_orphans = 0;
-	uint64_t our_orphans = 0;
+	const WindowStats* stats = &snapshot->m_windowStats;
 
 	uint64_t your_reward = 0;
 	uint64_t total_reward = 0;
+	get_reward(*snapshot, snapshot->m_outputs, m_pool->params().m_wallet, your_reward, total_reward);
 
-	if (tip) {
-		std::sort(blocks_in_window.begin(), blocks_in_window.end());
-		for (uint64_t i = 0; (i < m_chainWindowSize) && (i <= tip_height); ++i) {
-			auto it = m_blocksByHeight.find(tip_height - i);
-			if (it == m_blocksByHeight.end()) {
-				continue;
-			}
-			for (const PoolBlock* block : it->second) {
-				if (!std::binary_search(blocks_in_window.begin(), blocks_in_window.end(), block->m_sidechainId)) {
-					LOGINFO(4, "orphan block at height " << log::Gray() << block->m_sidechainHeight << log::NoColor() << ": " << log::Gray() << block->m_sidechainId);
-					++total_orphans;
-					if (block->m_minerWallet == m_pool->params().m_wallet) {
-						++our_orphans;
-					}
-				}
-			}
-		}
-
-		const Wallet& w = m_pool->params().m_wallet;
-		const uint8_t tx_type = tip->get_tx_type();
-
-		hash eph_public_key;
-		for (size_t i = 0, n = tip->m_outputs.size(); i < n; ++i) {
-			const PoolBlock::TxOutput& out = tip->m_outputs[i];
-			if (!your_reward) {
-				if (tx_type == TXOUT_TO_TAGGED_KEY) {
-					if (w.get_eph_public_key_with_view_tag(tip->m_txkeySec, i, eph_public_key, out.m_viewTag) && (out.m_ephPublicKey == eph_public_key)) {
-						your_reward = out.m_reward;
-					}
-				}
-				else {
-					uint8_t view_tag;
-					if (w.get_eph_public_key(tip->m_txkeySec, i, eph_public_key, view_tag) && (out.m_ephPublicKey == eph_public_key)) {
-						your_reward = out.m_reward;
-					}
-				}
-			}
-			total_reward += out.m_reward;
-		}
-	}
+	const uint32_t total_blocks_in_window = stats->m_totalBlocks;
+	const uint32_t total_uncles_in_window = stats->m_totalUncles;
+	const uint64_t total_orphans = stats->m_totalOrphans;
+	const uint64_t our_orphans = stats->m_ourOrphans;
+	const std::array<uint32_t, 30>& our_blocks_in_window = stats->m_ourBlocks;
+	const std::array<uint32_t, 30>& our_uncles_in_window = stats->m_ourUncles;
 
 	uint64_t product[2];
 	product[0] = umul128(pool_hashrate, your_reward, &product[1]);
@@ -970,6 +1642,19 @@ void SideChain::print_status(bool obtain_sidechain_lock) const
 		our_uncles_in_window_chart += ']';
 	}
 
+	const CryptoCacheStats crypto_stats = get_crypto_cache_stats();
+	uint64_t crypto_size = 0, crypto_capacity = 0, crypto_hits = 0, crypto_misses = 0, crypto_evictions = 0;
+
+	for (const CryptoCacheStats::Counters* c : { &crypto_stats.m_derivations, &crypto_stats.m_publicKeys, &crypto_stats.m_txKeys }) {
+		crypto_size += c->m_size;
+		crypto_capacity += c->m_capacity;
+		crypto_hits += c->m_hits;
+		crypto_misses += c->m_misses;
+		crypto_evictions += c->m_evictions;
+	}
+
+	const double crypto_hit_rate = (crypto_hits + crypto_misses) ? (static_cast<double>(crypto_hits) * 100.0 / static_cast<double>(crypto_hits + crypto_misses)) : 0.0;
+
 	LOGINFO(0, "status" <<
 		"\nMain chain height         = " << m_pool->block_template().height() <<
 		"\nMain chain hashrate       = " << log::Hashrate(network_hashrate) <<
@@ -980,47 +1665,122 @@ void SideChain::print_status(bool obtain_sidechain_lock) const
 		"\nPPLNS window              = " << total_blocks_in_window << " blocks (+" << total_uncles_in_window << " uncles, " << total_orphans << " orphans)" <<
 		"\nYour shares               = " << our_blocks_in_window_total << " blocks (+" << our_uncles_in_window_total << " uncles, " << our_orphans << " orphans)"
 										 << our_blocks_in_window_chart << our_uncles_in_window_chart <<
-		"\nBlock reward share        = " << block_share << "% (" << log::XMRAmount(your_reward) << ')'
+		"\nBlock reward share        = " << block_share << "% (" << log::XMRAmount(your_reward) << ')' <<
+		"\nBlock arena               = " << m_blockAllocator.num_blocks() << '/' << m_blockAllocator.capacity() << " blocks in " <<
+										 m_blockAllocator.num_slabs() << " slabs (" << m_blockAllocator.memory_usage() / 1024 << " KB)" <<
+		"\nTransaction hashes        = " << TxHashList::num_unique_hashes() << " unique (" << TxHashList::memory_usage() / 1024 << " KB)" <<
+		"\nCrypto cache              = " << crypto_size << '/' << crypto_capacity << " entries, " << crypto_hit_rate << "% hits, " << crypto_evictions << " evicted"
 	);
 }
 
-double SideChain::get_reward_share(const Wallet& w) const
+double SideChain::get_reward_share(const Wallet& w) const
+{
+	uint64_t reward = 0;
+	uint64_t total_reward = 0;
+	const std::shared_ptr<const Snapshot> s = snapshot();
+	get_reward(*s, s->m_outputs, w, reward, total_reward);
+	return total_reward ? (static_cast<double>(reward) / static_cast<double>(total_reward)) : 0.0;
+}
+
+void SideChain::get_reward(const Snapshot& s, const std::vector<PoolBlock::TxOutput>& outputs, const Wallet& w, uint64_t& reward, uint64_t& total_reward)
+{
+	reward = 0;
+	total_reward = 0;
+
+	hash eph_public_key;
+	for (size_t i = 0, n = outputs.size(); i < n; ++i) {
+		const PoolBlock::TxOutput& out = outputs[i];
+		if (!reward) {
+			if (s.m_txType == TXOUT_TO_TAGGED_KEY) {
+				if (w.get_eph_public_key_with_view_tag(s.m_txkeySec, i, eph_public_key, out.m_viewTag) && (out.m_ephPublicKey == eph_public_key)) {
+					reward = out.m_reward;
+				}
+			}
+			else {
+				uint8_t view_tag;
+				if (w.get_eph_public_key(s.m_txkeySec, i, eph_public_key, view_tag) && (out.m_ephPublicKey == eph_public_key)) {
+					reward = out.m_reward;
+				}
+			}
+		}
+		total_reward += out.m_reward;
+	}
+}
+
+void SideChain::get_window_stats(const PoolBlock* tip, WindowStats& stats) const
 {
-	uint64_t reward = 0;
-	uint64_t total_reward = 0;
-	{
-		ReadLock lock(m_sidechainLock);
+	stats = WindowStats();
 
-		const PoolBlock* tip = m_chainTip;
-		if (tip) {
-			const uint8_t tx_type = tip->get_tx_type();
-			hash eph_public_key;
-			for (size_t i = 0, n = tip->m_outputs.size(); i < n; ++i) {
-				const PoolBlock::TxOutput& out = tip->m_outputs[i];
-				if (!reward) {
-					if (tx_type == TXOUT_TO_TAGGED_KEY) {
-						if (w.get_eph_public_key_with_view_tag(tip->m_txkeySec, i, eph_public_key, out.m_viewTag) && (out.m_ephPublicKey == eph_public_key)) {
-							reward = out.m_reward;
-						}
-					}
-					else {
-						uint8_t view_tag;
-						if (w.get_eph_public_key(tip->m_txkeySec, i, eph_public_key, view_tag) && (out.m_ephPublicKey == eph_public_key)) {
-							reward = out.m_reward;
-						}
+	const Wallet* w = m_pool ? &m_pool->params().m_wallet : nullptr;
+
+	std::vector<hash> blocks_in_window;
+	blocks_in_window.reserve(m_chainWindowSize * 9 / 8);
+
+	uint64_t block_depth = 0;
+	const PoolBlock* cur = tip;
+	const uint64_t tip_height = tip->m_sidechainHeight;
+
+	while (cur) {
+		blocks_in_window.emplace_back(cur->m_sidechainId);
+		++stats.m_totalBlocks;
+
+		if (w && (*cur->m_minerWallet == *w)) {
+			// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
+			const size_t window_index = (stats.m_totalBlocks - 1) / ((m_chainWindowSize + stats.m_ourBlocks.size() - 1) / stats.m_ourBlocks.size());
+			stats.m_ourBlocks[std::min(window_index, stats.m_ourBlocks.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
+		}
+
+		++block_depth;
+		if (block_depth >= m_chainWindowSize) {
+			break;
+		}
+
+		for (const hash& uncle_id : cur->m_uncles) {
+			blocks_in_window.emplace_back(uncle_id);
+			auto it = m_blocksById.find(uncle_id);
+			if (it != m_blocksById.end()) {
+				PoolBlock* uncle = it->second;
+				if (tip_height - uncle->m_sidechainHeight < m_chainWindowSize) {
+					++stats.m_totalUncles;
+					if (w && (*uncle->m_minerWallet == *w)) {
+						// this produces an integer division with quotient rounded up, avoids non-whole divisions from overflowing on total_blocks_in_window
+						const size_t window_index = (stats.m_totalBlocks - 1) / ((m_chainWindowSize + stats.m_ourUncles.size() - 1) / stats.m_ourUncles.size());
+						stats.m_ourUncles[std::min(window_index, stats.m_ourUncles.size() - 1)]++; // clamp window_index, even if total_blocks_in_window is not larger than m_chainWindowSize
 					}
 				}
-				total_reward += out.m_reward;
+			}
+		}
+
+		cur = get_parent(cur);
+	}
+
+	std::sort(blocks_in_window.begin(), blocks_in_window.end());
+	for (uint64_t i = 0; (i < m_chainWindowSize) && (i <= tip_height); ++i) {
+		const std::vector<PoolBlock*>* blocks = m_blocksByHeight.find(tip_height - i);
+		if (!blocks) {
+			continue;
+		}
+		for (const PoolBlock* block : *blocks) {
+			if (!std::binary_search(blocks_in_window.begin(), blocks_in_window.end(), block->m_sidechainId)) {
+				LOGINFO(4, "orphan block at height " << log::Gray() << block->m_sidechainHeight << log::NoColor() << ": " << log::Gray() << block->m_sidechainId);
+				++stats.m_totalOrphans;
+				if (w && (*block->m_minerWallet == *w)) {
+					++stats.m_ourOrphans;
+				}
 			}
 		}
 	}
-	return total_reward ? (static_cast<double>(reward) / static_cast<double>(total_reward)) : 0.0;
+}
+
+SideChain::VerifyStats SideChain::verify_stats() const
+{
+	ReadLock lock(m_sidechainLock);
+	return m_verifyStats;
 }
 
 difficulty_type SideChain::total_hashes() const
 {
-	const PoolBlock* tip = m_chainTip;
-	return tip ? tip->m_cumulativeDifficulty : difficulty_type();
+	return snapshot()->m_totalHashes;
 }
 
 uint64_t SideChain::miner_count()
@@ -1047,8 +1807,7 @@ uint64_t SideChain::miner_count()
 
 uint64_t SideChain::last_updated() const
 {
-	const PoolBlock* tip = m_chainTip;
-	return tip ? tip->m_localTimestamp : 0;
+	return snapshot()->m_localTimestamp;
 }
 
 bool SideChain::is_default() const
@@ -1099,17 +1858,19 @@ bool SideChain::split_reward(uint64_t reward, const std::vector<MinerShare>& sha
 	return true;
 }
 
-bool SideChain::get_difficulty(const PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const
+bool SideChain::get_difficulty(const PoolBlock* tip, difficulty_type& curDifficulty)
 {
-	difficultyData.clear();
-
-	const PoolBlock* cur = tip;
-	uint64_t oldest_timestamp = std::numeric_limits<uint64_t>::max();
+	for (const CachedDifficulty& d : m_difficultyCache) {
+		if ((d.m_id == tip->m_sidechainId) && !d.m_id.empty()) {
+			curDifficulty = d.m_difficulty;
+			return true;
+		}
+	}
 
-	uint64_t block_depth = 0;
-	do {
-		oldest_timestamp = std::min(oldest_timestamp, cur->m_timestamp);
-		difficultyData.emplace_back(cur->m_timestamp, cur->m_cumulativeDifficulty);
+	// Adds a block and its uncles which are in the difficulty window of "tip"
+	auto add_block = [this, tip](const PoolBlock* cur)
+	{
+		m_difficultyWindow.add(cur->m_sidechainHeight, cur->m_timestamp, cur->m_cumulativeDifficulty);
 
 		for (const hash& uncle_id : cur->m_uncles) {
 			auto it = m_blocksById.find(uncle_id);
@@ -1121,66 +1882,73 @@ bool SideChain::get_difficulty(const PoolBlock* tip, std::vector<DifficultyData>
 
 			const PoolBlock* uncle = it->second;
 			if (tip->m_sidechainHeight - uncle->m_sidechainHeight < m_chainWindowSize) {
-				oldest_timestamp = std::min(oldest_timestamp, uncle->m_timestamp);
-				difficultyData.emplace_back(uncle->m_timestamp, uncle->m_cumulativeDifficulty);
+				m_difficultyWindow.add(uncle->m_sidechainHeight, uncle->m_timestamp, uncle->m_cumulativeDifficulty);
 			}
 		}
 
-		++block_depth;
-		if (block_depth >= m_chainWindowSize) {
-			break;
-		}
+		return true;
+	};
 
-		// Reached the genesis block so we're done
-		if (cur->m_sidechainHeight == 0) {
-			break;
-		}
+	// The window always has blocks with height > tip height - window size
+	// So if tip is the next block after the window's tip, it's enough to add it and drop the blocks which got too old
+	const bool has_window = (m_difficultyWindow.size() > 0);
 
-		auto it = m_blocksById.find(cur->m_parent);
-		if (it == m_blocksById.end()) {
-			LOGWARN(3, "get_difficulty: can't find parent block at height = " << cur->m_sidechainHeight - 1 << ", id = " << cur->m_parent);
-			LOGWARN(3, "get_difficulty: can't calculate diff for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+	if (has_window && (tip->m_sidechainId == m_difficultyWindowTip)) {
+		// Already there
+	}
+	else if (has_window && (tip->m_parent == m_difficultyWindowTip) && (tip->m_sidechainHeight == m_difficultyWindowHeight + 1)) {
+		if (!add_block(tip)) {
+			m_difficultyWindow.clear();
 			return false;
 		}
 
-		cur = it->second;
-	} while (true);
+		if (tip->m_sidechainHeight >= m_chainWindowSize) {
+			m_difficultyWindow.prune(tip->m_sidechainHeight - m_chainWindowSize);
+		}
+	}
+	else {
+		m_difficultyWindow.clear();
 
-	// Discard 10% oldest and 10% newest (by timestamp) blocks
-	std::vector<uint32_t> tmpTimestamps;
-	tmpTimestamps.reserve(difficultyData.size());
+		const PoolBlock* cur = tip;
+		uint64_t block_depth = 0;
 
-	std::transform(difficultyData.begin(), difficultyData.end(), std::back_inserter(tmpTimestamps),
-		[oldest_timestamp](const DifficultyData& d)
-		{
-			return static_cast<uint32_t>(d.m_timestamp - oldest_timestamp);
-		});
+		do {
+			if (!add_block(cur)) {
+				m_difficultyWindow.clear();
+				return false;
+			}
 
-	const uint64_t cut_size = (difficultyData.size() + 9) / 10;
-	const uint64_t index1 = cut_size - 1;
-	const uint64_t index2 = difficultyData.size() - cut_size;
+			++block_depth;
+			if (block_depth >= m_chainWindowSize) {
+				break;
+			}
 
-	std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index1, tmpTimestamps.end());
-	const uint64_t timestamp1 = oldest_timestamp + tmpTimestamps[index1];
+			// Reached the genesis block so we're done
+			if (cur->m_sidechainHeight == 0) {
+				break;
+			}
 
-	std::nth_element(tmpTimestamps.begin(), tmpTimestamps.begin() + index2, tmpTimestamps.end());
-	const uint64_t timestamp2 = oldest_timestamp + tmpTimestamps[index2];
+			auto it = m_blocksById.find(cur->m_parent);
+			if (it == m_blocksById.end()) {
+				LOGWARN(3, "get_difficulty: can't find parent block at height = " << cur->m_sidechainHeight - 1 << ", id = " << cur->m_parent);
+				LOGWARN(3, "get_difficulty: can't calculate diff for block at height = " << tip->m_sidechainHeight << ", id = " << tip->m_sidechainId << ", mainchain height = " << tip->m_txinGenHeight);
+				m_difficultyWindow.clear();
+				return false;
+			}
 
-	const uint64_t delta_t = (timestamp2 > timestamp1) ? (timestamp2 - timestamp1) : 1;
+			cur = it->second;
+		} while (true);
+	}
 
-	difficulty_type diff1{ std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
-	difficulty_type diff2{ 0, 0 };
+	m_difficultyWindowTip = tip->m_sidechainId;
+	m_difficultyWindowHeight = tip->m_sidechainHeight;
 
-	for (const DifficultyData& d : difficultyData) {
-		if (timestamp1 <= d.m_timestamp && d.m_timestamp <= timestamp2) {
-			if (d.m_cumulativeDifficulty < diff1) {
-				diff1 = d.m_cumulativeDifficulty;
-			}
-			if (diff2 < d.m_cumulativeDifficulty) {
-				diff2 = d.m_cumulativeDifficulty;
-			}
-		}
-	}
+	// Discard 10% oldest and 10% newest (by timestamp) blocks
+	uint64_t timestamp1, timestamp2;
+	difficulty_type diff1, diff2;
+	m_difficultyWindow.get_range(timestamp1, timestamp2, diff1, diff2);
+
+	const uint64_t delta_t = (timestamp2 > timestamp1) ? (timestamp2 - timestamp1) : 1;
 
 	// This is correct as long as the difference between two 128-bit difficulties is less than 2^64, even if it wraps
 	const uint64_t delta_diff = diff2.lo - diff1.lo;
@@ -1201,6 +1969,8 @@ bool SideChain::get_difficulty(const PoolBlock* tip, std::vector<DifficultyData>
 		curDifficulty = m_minDifficulty;
 	}
 
+	m_difficultyCache[m_difficultyCacheIndex++ % DIFFICULTY_CACHE_SIZE] = { tip->m_sidechainId, curDifficulty };
+
 	return true;
 }
 
@@ -1208,76 +1978,129 @@ void SideChain::verify_loop(PoolBlock* block)
 {
 	// PoW is already checked at this point
 
+	// Blocks are verified in batches: all checks except output keys are done one block at a time in the correct order,
+	// then output keys for the whole batch are checked in parallel, and then the results are committed in the same order
+	constexpr size_t MAX_BATCH_SIZE = 64;
+
 	std::vector<PoolBlock*> blocks_to_verify(1, block);
 	PoolBlock* highest_block = nullptr;
 
+	std::vector<PoolBlock*> batch;
+	std::vector<VerifyJob> jobs;
+	std::vector<uint8_t> job_results;
+
+	batch.reserve(MAX_BATCH_SIZE);
+	jobs.reserve(MAX_BATCH_SIZE);
+
+	using namespace std::chrono;
+
 	while (!blocks_to_verify.empty()) {
-		block = blocks_to_verify.back();
-		blocks_to_verify.pop_back();
+		batch.clear();
+		jobs.clear();
 
-		if (block->m_verified) {
-			continue;
-		}
+		const auto t0 = high_resolution_clock::now();
 
-		verify(block);
+		while (!blocks_to_verify.empty() && (batch.size() < MAX_BATCH_SIZE)) {
+			block = blocks_to_verify.back();
+			blocks_to_verify.pop_back();
 
-		if (!block->m_verified) {
-			LOGINFO(6, "can't verify block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight << ": parent or uncle blocks are not available)");
-			continue;
-		}
+			if (block->m_verified) {
+				continue;
+			}
 
-		if (block->m_invalid) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight << " is invalid");
+			verify(block, jobs);
+
+			if (!block->m_verified) {
+				LOGINFO(6, "can't verify block at height = " << block->m_sidechainHeight <<
+					", id = " << block->m_sidechainId <<
+					", mainchain height = " << block->m_txinGenHeight << ": parent or uncle blocks are not available)");
+				continue;
+			}
+
+			batch.push_back(block);
+
+			// Blocks on top of this one can be checked in the same batch, assuming this block's output keys are correct
+			// If they're not, commit stage below will mark them as invalid too
+			if (!block->m_invalid) {
+				for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
+					const std::vector<PoolBlock*>* next_blocks = m_blocksByHeight.find(block->m_sidechainHeight + i);
+					if (next_blocks) {
+						blocks_to_verify.insert(blocks_to_verify.end(), next_blocks->begin(), next_blocks->end());
+					}
+				}
+			}
 		}
-		else {
-			LOGINFO(3, "verified block at height = " << block->m_sidechainHeight <<
-				", depth = " << block->m_depth <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight);
+
+		const auto t1 = high_resolution_clock::now();
+
+		verify_outputs_parallel(jobs, job_results);
+
+		m_verifyStats.m_numBlocks += batch.size();
+		m_verifyStats.m_prepareTime += duration_cast<microseconds>(t1 - t0).count();
+		m_verifyStats.m_outputsTime += duration_cast<microseconds>(high_resolution_clock::now() - t1).count();
+
+		size_t job_index = 0;
+
+		for (PoolBlock* b : batch) {
+			if ((job_index < jobs.size()) && (jobs[job_index].m_block == b)) {
+				if (!job_results[job_index]) {
+					b->m_invalid = true;
+				}
+				++job_index;
+			}
+
+			// Parent or uncles from this batch could've turned out invalid
+			if (!b->m_invalid) {
+				const PoolBlock* parent = get_parent(b);
+				if (parent && parent->m_invalid) {
+					b->m_invalid = true;
+				}
+				for (const hash& uncle_id : b->m_uncles) {
+					auto it = m_blocksById.find(uncle_id);
+					if ((it != m_blocksById.end()) && it->second->m_invalid) {
+						b->m_invalid = true;
+					}
+				}
+			}
+
+			if (b->m_invalid) {
+				LOGWARN(3, "block at height = " << b->m_sidechainHeight <<
+					", id = " << b->m_sidechainId <<
+					", mainchain height = " << b->m_txinGenHeight << " is invalid");
+				continue;
+			}
+
+			LOGINFO(3, "verified block at height = " << b->m_sidechainHeight <<
+				", depth = " << b->m_depth <<
+				", id = " << b->m_sidechainId <<
+				", mainchain height = " << b->m_txinGenHeight);
 
 			// This block is now verified
 
 			bool is_alternative;
-			if (is_longer_chain(highest_block, block, is_alternative)) {
-				highest_block = block;
+			if (is_longer_chain(highest_block, b, is_alternative)) {
+				highest_block = b;
 			}
-			else if (highest_block && (highest_block->m_sidechainHeight > block->m_sidechainHeight)) {
+			else if (highest_block && (highest_block->m_sidechainHeight > b->m_sidechainHeight)) {
 				LOGINFO(4, "block " << highest_block->m_sidechainId <<
 					", height = " << highest_block->m_sidechainHeight <<
-					" is not a longer chain than " << block->m_sidechainId <<
-					", height " << block->m_sidechainHeight);
+					" is not a longer chain than " << b->m_sidechainId <<
+					", height " << b->m_sidechainHeight);
 			}
 
 			P2PServer* server = p2pServer();
 
 			// If it came through a broadcast, send it to our peers
-			if (block->m_wantBroadcast && !block->m_broadcasted) {
-				block->m_broadcasted = true;
-				if (server && (block->m_depth < UNCLE_BLOCK_DEPTH)) {
-					server->broadcast(*block);
+			if (b->m_wantBroadcast && !b->m_broadcasted) {
+				b->m_broadcasted = true;
+				if (server && (b->m_depth < UNCLE_BLOCK_DEPTH)) {
+					server->broadcast(*b);
 				}
 			}
 
 			// Save it for faster syncing on the next p2pool start
 			if (server) {
-				server->store_in_cache(*block);
-			}
-
-			// Try to verify blocks on top of this one
-			for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
-				auto it = m_blocksByHeight.find(block->m_sidechainHeight + i);
-				if (it == m_blocksByHeight.end()) {
-					continue;
-				}
-
-				const std::vector<PoolBlock*>& next_blocks = it->second;
-				if (!next_blocks.empty()) {
-					blocks_to_verify.insert(blocks_to_verify.end(), next_blocks.begin(), next_blocks.end());
-				}
+				server->store_in_cache(*b);
 			}
 		}
 	}
@@ -1289,8 +2112,212 @@ void SideChain::verify_loop(PoolBlock* block)
 	return;
 }
 
-void SideChain::verify(PoolBlock* block)
+bool SideChain::verify_outputs(const VerifyJob& job, size_t begin, size_t end) const
+{
+	const PoolBlock* block = job.m_block;
+	const uint8_t tx_type = block->get_tx_type();
+
+	constexpr size_t BATCH_SIZE = 64;
+
+	hash eph_public_keys[BATCH_SIZE];
+	uint8_t view_tags[BATCH_SIZE];
+
+	for (size_t batch_begin = begin; batch_begin < end; batch_begin += BATCH_SIZE) {
+		const size_t n = std::min(end - batch_begin, BATCH_SIZE);
+
+		if (!Wallet::get_eph_public_keys(job.m_wallets.data() + batch_begin, n, block->m_txkeySec, batch_begin, eph_public_keys, view_tags)) {
+			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
+				", id = " << block->m_sidechainId <<
+				", mainchain height = " << block->m_txinGenHeight <<
+				" failed to eph_public_key at indices " << batch_begin << '-' << (batch_begin + n - 1));
+			return false;
+		}
+
+		for (size_t i = batch_begin; i < batch_begin + n; ++i) {
+			const PoolBlock::TxOutput& out = block->m_outputs[i];
+
+			if ((tx_type == TXOUT_TO_TAGGED_KEY) && (out.m_viewTag != view_tags[i - batch_begin])) {
+				LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
+					", id = " << block->m_sidechainId <<
+					", mainchain height = " << block->m_txinGenHeight <<
+					" has an incorrect view tag at index " << i);
+				return false;
+			}
+
+			if (eph_public_keys[i - batch_begin] != out.m_ephPublicKey) {
+				LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
+					", id = " << block->m_sidechainId <<
+					", mainchain height = " << block->m_txinGenHeight <<
+					" pays out to a wrong wallet at index " << i);
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+struct SideChain::VerifyBatch : public nocopy_nomove
+{
+	struct Chunk
+	{
+		size_t job;
+		size_t begin;
+		size_t end;
+	};
+
+	VerifyBatch(const SideChain* side_chain, const std::vector<VerifyJob>& jobs)
+		: m_sideChain(side_chain)
+		, m_jobs(jobs)
+		, m_jobFailed(new std::atomic<bool>[jobs.size()])
+		, m_nextChunk(0)
+		, m_numDone(0)
+	{
+		// Split all outputs into small chunks which can be checked independently
+		constexpr size_t CHUNK_SIZE = 32;
+
+		for (size_t i = 0, n = jobs.size(); i < n; ++i) {
+			m_jobFailed[i] = false;
+
+			const size_t k = jobs[i].m_wallets.size();
+			for (size_t j = 0; j < k; j += CHUNK_SIZE) {
+				m_chunks.push_back({ i, j, std::min(j + CHUNK_SIZE, k) });
+			}
+		}
+
+		uv_mutex_init_checked(&m_doneLock);
+		uv_cond_init_checked(&m_doneCond);
+	}
+
+	~VerifyBatch()
+	{
+		uv_mutex_destroy(&m_doneLock);
+		uv_cond_destroy(&m_doneCond);
+	}
+
+	// Workers can pick up the batch after all chunks are taken, they don't touch m_jobs then
+	void run()
+	{
+		size_t num_done = 0;
+
+		size_t i;
+		while ((i = m_nextChunk.fetch_add(1)) < m_chunks.size()) {
+			const Chunk& c = m_chunks[i];
+
+			// The first mismatch cancels all remaining chunks of the same job
+			if (!m_jobFailed[c.job].load(std::memory_order_relaxed) && !m_sideChain->verify_outputs(m_jobs[c.job], c.begin, c.end)) {
+				m_jobFailed[c.job] = true;
+			}
+			++num_done;
+		}
+
+		if (num_done) {
+			MutexLock lock(m_doneLock);
+			m_numDone += num_done;
+			if (m_numDone == m_chunks.size()) {
+				uv_cond_signal(&m_doneCond);
+			}
+		}
+	}
+
+	void wait()
+	{
+		MutexLock lock(m_doneLock);
+		while (m_numDone < m_chunks.size()) {
+			uv_cond_wait(&m_doneCond, &m_doneLock);
+		}
+	}
+
+	const SideChain* m_sideChain;
+	const std::vector<VerifyJob>& m_jobs;
+
+	std::vector<Chunk> m_chunks;
+	std::unique_ptr<std::atomic<bool>[]> m_jobFailed;
+	std::atomic<size_t> m_nextChunk;
+
+	uv_mutex_t m_doneLock;
+	uv_cond_t m_doneCond;
+	size_t m_numDone;
+};
+
+void SideChain::verify_outputs_parallel(const std::vector<VerifyJob>& jobs, std::vector<uint8_t>& results) const
+{
+	results.assign(jobs.size(), 1);
+
+	if (jobs.empty()) {
+		return;
+	}
+
+	std::shared_ptr<VerifyBatch> batch = std::make_shared<VerifyBatch>(this, jobs);
+
+	const size_t num_helpers = std::min<size_t>(m_numVerifyThreads, batch->m_chunks.size());
+
+	if ((num_helpers > 1) && !m_precalcStopped) {
+		MutexLock lock(m_precalcJobsMutex);
+		if (!m_precalcStopped) {
+			m_verifyBatches.insert(m_verifyBatches.end(), num_helpers - 1, batch);
+			uv_cond_broadcast(&m_verifyBatchesCond);
+		}
+	}
+
+	// Current thread also does its part of the work, so it never has to wait for busy workers to start
+	batch->run();
+	batch->wait();
+
+	for (size_t i = 0, n = jobs.size(); i < n; ++i) {
+		if (batch->m_jobFailed[i]) {
+			results[i] = 0;
+		}
+	}
+}
+
+bool SideChain::precheck_outputs(const PoolBlock& block, std::vector<InternedWallet>& wallets) const
+{
+	std::vector<MinerShare> shares;
+	{
+		ReadLock lock(m_sidechainLock);
+
+		// Only blocks which can be verified right away are worth checking here
+		const PoolBlock* parent = get_parent(&block);
+		if (!parent || !parent->m_verified || parent->m_invalid) {
+			return false;
+		}
+
+		for (const hash& uncle_id : block.m_uncles) {
+			auto it = m_blocksById.find(uncle_id);
+			if ((it == m_blocksById.end()) || !it->second->m_verified || it->second->m_invalid) {
+				return false;
+			}
+		}
+
+		if (!get_shares(&block, shares) || (shares.size() != block.m_outputs.size())) {
+			return false;
+		}
+
+		// Wallets can be freed by pruning when the lock is released, keep references to them
+		wallets.resize(shares.size());
+		for (size_t i = 0, n = shares.size(); i < n; ++i) {
+			wallets[i].assign(*shares[i].m_wallet);
+		}
+	}
+
+	std::vector<VerifyJob> jobs(1);
+	jobs[0].m_block = &block;
+	jobs[0].m_wallets.reserve(wallets.size());
+	for (const InternedWallet& w : wallets) {
+		jobs[0].m_wallets.push_back(w.get());
+	}
+
+	std::vector<uint8_t> results;
+	verify_outputs_parallel(jobs, results);
+
+	return results[0] != 0;
+}
+
+void SideChain::verify(PoolBlock* block, std::vector<VerifyJob>& jobs)
 {
+	ScopedLatency latency(metrics::verify_block);
+
 	// Genesis block
 	if (block->m_sidechainHeight == 0) {
 		if (!block->m_parent.empty() ||
@@ -1496,7 +2523,7 @@ void SideChain::verify(PoolBlock* block)
 	}
 
 	difficulty_type diff;
-	if (!get_difficulty(parent, m_difficultyData, diff)) {
+	if (!get_difficulty(parent, diff)) {
 		block->m_invalid = true;
 		return;
 	}
@@ -1511,9 +2538,17 @@ void SideChain::verify(PoolBlock* block)
 	}
 
 	std::vector<MinerShare> shares;
-	if (!get_shares(block, shares)) {
-		block->m_invalid = true;
-		return;
+	{
+		using namespace std::chrono;
+
+		const auto t = high_resolution_clock::now();
+		const bool result = get_shares(block, shares);
+		m_verifyStats.m_getSharesTime += duration_cast<microseconds>(high_resolution_clock::now() - t).count();
+
+		if (!result) {
+			block->m_invalid = true;
+			return;
+		}
 	}
 
 	if (shares.size() != block->m_outputs.size()) {
@@ -1547,9 +2582,7 @@ void SideChain::verify(PoolBlock* block)
 			<< " has invalid number of outputs: got " << block->m_outputs.size() << ", expected " << rewards.size());
 		block->m_invalid = true;
 		return;
-	}
-
-	const uint8_t tx_type = block->get_tx_type();
+	}
 
 	for (size_t i = 0, n = rewards.size(); i < n; ++i) {
 		const PoolBlock::TxOutput& out = block->m_outputs[i];
@@ -1562,38 +2595,43 @@ void SideChain::verify(PoolBlock* block)
 			block->m_invalid = true;
 			return;
 		}
+	}
 
-		hash eph_public_key;
-		uint8_t view_tag;
-		if (!shares[i].m_wallet->get_eph_public_key(block->m_txkeySec, i, eph_public_key, view_tag)) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight <<
-				" failed to eph_public_key at index " << i);
-			block->m_invalid = true;
-			return;
-		}
+	// Output keys of this block were checked before the last restart, and it's the same block as in our block cache
+	if (is_trusted(*block)) {
+		++m_verifyStats.m_numTrusted;
+		block->m_invalid = false;
+		return;
+	}
 
-		if ((tx_type == TXOUT_TO_TAGGED_KEY) && (out.m_viewTag != view_tag)) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight <<
-				" has an incorrect view tag at index " << i);
-			block->m_invalid = true;
-			return;
+	// add_external_block() already checked output keys for exactly the same shares
+	if ((block == m_precheckedBlock) && m_precheckedWallets && (m_precheckedWallets->size() == shares.size())) {
+		const std::vector<InternedWallet>& wallets = *m_precheckedWallets;
+
+		bool same_shares = true;
+		for (size_t i = 0, n = shares.size(); i < n; ++i) {
+			if (wallets[i].get() != shares[i].m_wallet) {
+				same_shares = false;
+				break;
+			}
 		}
 
-		if (eph_public_key != out.m_ephPublicKey) {
-			LOGWARN(3, "block at height = " << block->m_sidechainHeight <<
-				", id = " << block->m_sidechainId <<
-				", mainchain height = " << block->m_txinGenHeight <<
-				" pays out to a wrong wallet at index " << i);
-			block->m_invalid = true;
+		if (same_shares) {
+			++m_verifyStats.m_numPrechecked;
+			block->m_invalid = false;
 			return;
 		}
 	}
 
-	// All checks passed
+	// Output keys are the most expensive part, verify_loop() checks them for many blocks in parallel
+	VerifyJob job{ block, {} };
+	job.m_wallets.reserve(shares.size());
+	for (const MinerShare& share : shares) {
+		job.m_wallets.push_back(share.m_wallet);
+	}
+	jobs.emplace_back(std::move(job));
+
+	// All checks passed, output keys are checked later by verify_loop()
 	block->m_invalid = false;
 }
 
@@ -1614,12 +2652,10 @@ void SideChain::update_chain_tip(const PoolBlock* block)
 	bool is_alternative;
 	if (is_longer_chain(tip, block, is_alternative)) {
 		difficulty_type diff;
-		if (get_difficulty(block, m_difficultyData, diff)) {
+		if (get_difficulty(block, diff)) {
 			m_chainTip = const_cast<PoolBlock*>(block);
-			{
-				WriteLock lock(m_curDifficultyLock);
-				m_curDifficulty = diff;
-			}
+			m_snapshotTip = block;
+			m_snapshotDifficulty = diff;
 
 			LOGINFO(2, "new chain tip: next height = " << log::Gray() << block->m_sidechainHeight + 1 << log::NoColor() <<
 				", next difficulty = " << log::Gray() << diff << log::NoColor() <<
@@ -1635,12 +2671,13 @@ void SideChain::update_chain_tip(const PoolBlock* block)
 					if (s) {
 						s->reset_share_counters();
 					}
-					// Also clear cache because it has data from all old blocks now
-					clear_crypto_cache();
+					// Also evict cache entries from the old chain
+					age_crypto_cache();
 					LOGINFO(0, log::LightCyan() << "SYNCHRONIZED");
 				}
 			}
 			prune_old_blocks();
+			release_old_blobs();
 		}
 	}
 	else if (block->m_sidechainHeight > tip->m_sidechainHeight) {
@@ -1661,6 +2698,48 @@ void SideChain::update_chain_tip(const PoolBlock* block)
 	}
 }
 
+void SideChain::publish_snapshot()
+{
+	// One publisher at a time, so a snapshot of an older tip never replaces a newer one
+	MutexLock lock(m_snapshotLock);
+
+	// New chain tips are set under the write lock, so the tip and its window don't change while the snapshot is built
+	ReadLock lock2(m_sidechainLock);
+
+	const PoolBlock* tip = m_snapshotTip;
+	const difficulty_type diff = m_snapshotDifficulty;
+
+	if (!tip) {
+		return;
+	}
+
+	{
+		const std::shared_ptr<const Snapshot> s = snapshot();
+		if ((s->m_tipId == tip->m_sidechainId) && (s->m_difficulty == diff)) {
+			return;
+		}
+	}
+
+	Snapshot* snapshot = new Snapshot();
+
+	snapshot->m_tipId = tip->m_sidechainId;
+	snapshot->m_sidechainHeight = tip->m_sidechainHeight;
+	snapshot->m_txinGenHeight = tip->m_txinGenHeight;
+	snapshot->m_localTimestamp = tip->m_localTimestamp;
+	snapshot->m_difficulty = diff;
+	snapshot->m_totalHashes = tip->m_cumulativeDifficulty;
+	snapshot->m_txkeySec = tip->m_txkeySec;
+	snapshot->m_txType = tip->get_tx_type();
+
+	snapshot->m_blobs = tip->get_blobs();
+
+	// Readers only load these, so status and reward queries never walk the PPLNS window themselves
+	snapshot->m_outputs = tip->m_outputs;
+	get_window_stats(tip, snapshot->m_windowStats);
+
+	std::atomic_store(&m_snapshot, std::shared_ptr<const Snapshot>(snapshot));
+}
+
 PoolBlock* SideChain::get_parent(const PoolBlock* block) const
 {
 	if (block) {
@@ -1782,7 +2861,12 @@ bool SideChain::is_longer_chain(const PoolBlock* block, const PoolBlock* candida
 void SideChain::update_depths(PoolBlock* block)
 {
 	for (size_t i = 1; i <= UNCLE_BLOCK_DEPTH; ++i) {
-		for (PoolBlock* child : m_blocksByHeight[block->m_sidechainHeight + i]) {
+		const std::vector<PoolBlock*>* children = m_blocksByHeight.find(block->m_sidechainHeight + i);
+		if (!children) {
+			continue;
+		}
+
+		for (PoolBlock* child : *children) {
 			if (child->m_parent == block->m_sidechainId) {
 				if (i != 1) {
 					LOGERR(1, "m_blocksByHeight is inconsistent with child->m_parent. Fix the code!");
@@ -1860,49 +2944,80 @@ void SideChain::prune_old_blocks()
 
 	uint64_t num_blocks_pruned = 0;
 
-	for (auto it = m_blocksByHeight.begin(); (it != m_blocksByHeight.end()) && (it->first <= h);) {
-		const uint64_t height = it->first;
-		std::vector<PoolBlock*>& v = it->second;
-
-		v.erase(std::remove_if(v.begin(), v.end(),
-			[this, prune_distance, cur_time, prune_delay, &num_blocks_pruned, height](PoolBlock* block)
-			{
-				if ((block->m_depth >= prune_distance) || (cur_time >= block->m_localTimestamp + prune_delay)) {
-					auto it2 = m_blocksById.find(block->m_sidechainId);
-					if (it2 != m_blocksById.end()) {
-						m_blocksById.erase(it2);
-						unsee_block(*block);
-						delete block;
-						++num_blocks_pruned;
-					}
-					else {
-						LOGERR(1, "m_blocksByHeight and m_blocksById are inconsistent at height " << height << ". Fix the code!");
+	m_blocksByHeight.prune(h,
+		[this, prune_distance, cur_time, prune_delay, &num_blocks_pruned](uint64_t height, std::vector<PoolBlock*>& v)
+		{
+			v.erase(std::remove_if(v.begin(), v.end(),
+				[this, prune_distance, cur_time, prune_delay, &num_blocks_pruned, height](PoolBlock* block)
+				{
+					if ((block->m_depth >= prune_distance) || (cur_time >= block->m_localTimestamp + prune_delay)) {
+						auto it2 = m_blocksById.find(block->m_sidechainId);
+						if (it2 != m_blocksById.end()) {
+							m_blocksById.erase(it2);
+							unsee_block(*block);
+							m_blockAllocator.destroy(block);
+							++num_blocks_pruned;
+						}
+						else {
+							LOGERR(1, "m_blocksByHeight and m_blocksById are inconsistent at height " << height << ". Fix the code!");
+						}
+						return true;
 					}
-					return true;
-				}
-				return false;
-			}), v.end());
-
-		if (v.empty()) {
-			it = m_blocksByHeight.erase(it);
-		}
-		else {
-			++it;
-		}
-	}
+					return false;
+				}), v.end());
+		});
 
 	if (num_blocks_pruned) {
 		LOGINFO(4, "pruned " << num_blocks_pruned << " old blocks at heights <= " << h);
 
+		// Cached PPLNS window can't reference pruned blocks
+		{
+			MutexLock lock(m_sharesWindowLock);
+			if (!m_sharesWindow.m_blocks.empty() && (m_sharesWindow.m_blocks.back()->m_sidechainHeight <= h + UNCLE_BLOCK_DEPTH)) {
+				m_sharesWindow.clear();
+			}
+		}
+
 		// If side-chain started pruning blocks it means the initial sync is complete
 		// It's now safe to delete cached blocks
 		if (p2pServer()) {
 			p2pServer()->clear_cached_blocks();
 		}
 
-		// Pre-calc workers are not needed anymore
-		finish_precalc();
+		// Initial sync pre-calc jobs are not needed anymore
+		switch_precalc_to_background();
+	}
+}
+
+// Blocks in the PPLNS window are served to syncing peers (BLOCK_REQUEST and ANCESTORS_REQUEST), they keep their blobs
+// A syncing peer verifies the window of every block in its window, so it downloads up to 2 windows of blocks
+// Older blocks are rarely requested and are serialized again when needed, so memory used by them stays proportional to unique transactions (TxHashList)
+void SideChain::release_old_blobs()
+{
+	const uint64_t keep_depth = m_chainWindowSize * 2;
+
+	const uint64_t tip_height = m_chainTip.load()->m_sidechainHeight;
+	if (tip_height < keep_depth) {
+		return;
+	}
+
+	const uint64_t max_height = tip_height - keep_depth;
+
+	// Older heights were pruned already
+	const uint64_t min_height = (max_height > m_chainWindowSize * 4) ? (max_height - m_chainWindowSize * 4) : 0;
+
+	for (uint64_t h = std::max(m_blobsReleaseHeight, min_height); h <= max_height; ++h) {
+		std::vector<PoolBlock*>* blocks = m_blocksByHeight.find(h);
+		if (!blocks) {
+			continue;
+		}
+		for (PoolBlock* block : *blocks) {
+			MutexLock lock(block->m_lock);
+			block->m_blobs.reset();
+		}
 	}
+
+	m_blobsReleaseHeight = max_height + 1;
 }
 
 void SideChain::get_missing_blocks(std::vector<hash>& missing_blocks) const
@@ -1937,6 +3052,194 @@ void SideChain::get_missing_blocks(std::vector<hash>& missing_blocks) const
 	}
 }
 
+// Verified chain state file format:
+// magic (8 bytes), keccak(consensus ID) (32 bytes), number of blocks (8 bytes)
+// then for each block: sidechain ID (32 bytes), sidechain height (8 bytes), cumulative difficulty (16 bytes)
+// then keccak of everything above (32 bytes)
+static constexpr char chain_state_name[] = "p2pool.sidechain";
+static constexpr char chain_state_tmp_name[] = "p2pool.sidechain.tmp";
+static constexpr uint8_t chain_state_magic[8] = { 'P', '2', 'P', 'S', 'T', 'A', 'T', '1' };
+static constexpr size_t CHAIN_STATE_ENTRY_SIZE = HASH_SIZE + sizeof(uint64_t) + sizeof(uint64_t) * 2;
+
+void SideChain::save_chain_state() const
+{
+	std::vector<uint8_t> data;
+	{
+		ReadLock lock(m_sidechainLock);
+
+		data.reserve(sizeof(chain_state_magic) + HASH_SIZE * 2 + sizeof(uint64_t) + m_blocksById.size() * CHAIN_STATE_ENTRY_SIZE);
+		data.insert(data.end(), chain_state_magic, chain_state_magic + sizeof(chain_state_magic));
+
+		hash h;
+		keccak(m_consensusId.data(), static_cast<int>(m_consensusId.size()), h.h, HASH_SIZE);
+		data.insert(data.end(), h.h, h.h + HASH_SIZE);
+
+		const size_t count_offset = data.size();
+		data.resize(data.size() + sizeof(uint64_t));
+
+		uint64_t count = 0;
+		for (const auto& it : m_blocksById) {
+			const PoolBlock* b = it.second;
+			if (!b->m_verified || b->m_invalid) {
+				continue;
+			}
+
+			const difficulty_type& diff = b->m_cumulativeDifficulty;
+
+			data.insert(data.end(), b->m_sidechainId.h, b->m_sidechainId.h + HASH_SIZE);
+			data.insert(data.end(), reinterpret_cast<const uint8_t*>(&b->m_sidechainHeight), reinterpret_cast<const uint8_t*>(&b->m_sidechainHeight) + sizeof(uint64_t));
+			data.insert(data.end(), reinterpret_cast<const uint8_t*>(&diff.lo), reinterpret_cast<const uint8_t*>(&diff.lo) + sizeof(uint64_t));
+			data.insert(data.end(), reinterpret_cast<const uint8_t*>(&diff.hi), reinterpret_cast<const uint8_t*>(&diff.hi) + sizeof(uint64_t));
+			++count;
+		}
+
+		if (!count) {
+			return;
+		}
+
+		memcpy(data.data() + count_offset, &count, sizeof(count));
+	}
+
+	hash checksum;
+	keccak(data.data(), static_cast<int>(data.size()), checksum.h, HASH_SIZE);
+	data.insert(data.end(), checksum.h, checksum.h + HASH_SIZE);
+
+	MutexLock lock(m_chainStateFileLock);
+
+	// Write to a temporary file first, so a crash can't leave a half-written state behind
+	{
+		std::ofstream f(chain_state_tmp_name, std::ios::binary);
+		if (!f.is_open()) {
+			LOGERR(1, "couldn't open " << chain_state_tmp_name);
+			return;
+		}
+		f.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!f.good()) {
+			LOGERR(1, "couldn't write " << chain_state_tmp_name);
+			return;
+		}
+	}
+
+	std::remove(chain_state_name);
+	if (std::rename(chain_state_tmp_name, chain_state_name) != 0) {
+		LOGERR(1, "couldn't rename " << chain_state_tmp_name << " to " << chain_state_name);
+		return;
+	}
+
+	LOGINFO(5, "saved verified chain state (" << (data.size() - sizeof(chain_state_magic) - HASH_SIZE * 2 - sizeof(uint64_t)) / CHAIN_STATE_ENTRY_SIZE << " blocks)");
+}
+
+void SideChain::load_chain_state()
+{
+	std::vector<uint8_t> data;
+	{
+		std::ifstream f(chain_state_name, std::ios::binary);
+		if (!f.is_open()) {
+			return;
+		}
+		data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	}
+
+	constexpr size_t header_size = sizeof(chain_state_magic) + HASH_SIZE + sizeof(uint64_t);
+
+	if ((data.size() < header_size + HASH_SIZE) || memcmp(data.data(), chain_state_magic, sizeof(chain_state_magic))) {
+		LOGWARN(1, chain_state_name << " is corrupted, ignoring it");
+		return;
+	}
+
+	hash checksum;
+	keccak(data.data(), static_cast<int>(data.size() - HASH_SIZE), checksum.h, HASH_SIZE);
+	if (memcmp(checksum.h, data.data() + data.size() - HASH_SIZE, HASH_SIZE)) {
+		LOGWARN(1, chain_state_name << " has invalid checksum, ignoring it");
+		return;
+	}
+
+	hash h;
+	keccak(m_consensusId.data(), static_cast<int>(m_consensusId.size()), h.h, HASH_SIZE);
+	if (memcmp(h.h, data.data() + sizeof(chain_state_magic), HASH_SIZE)) {
+		LOGWARN(1, chain_state_name << " was saved with a different sidechain config, ignoring it");
+		return;
+	}
+
+	uint64_t count;
+	memcpy(&count, data.data() + sizeof(chain_state_magic) + HASH_SIZE, sizeof(count));
+
+	if (count != (data.size() - header_size - HASH_SIZE) / CHAIN_STATE_ENTRY_SIZE) {
+		LOGWARN(1, chain_state_name << " is corrupted, ignoring it");
+		return;
+	}
+
+	WriteLock lock(m_sidechainLock);
+
+	m_trustedBlocks.clear();
+	m_trustedBlocks.reserve(count);
+
+	for (const uint8_t* p = data.data() + header_size, *e = p + count * CHAIN_STATE_ENTRY_SIZE; p < e; p += CHAIN_STATE_ENTRY_SIZE) {
+		TrustedBlock b;
+		hash id;
+
+		memcpy(id.h, p, HASH_SIZE);
+		memcpy(&b.m_sidechainHeight, p + HASH_SIZE, sizeof(uint64_t));
+		memcpy(&b.m_cumulativeDifficulty.lo, p + HASH_SIZE + sizeof(uint64_t), sizeof(uint64_t));
+		memcpy(&b.m_cumulativeDifficulty.hi, p + HASH_SIZE + sizeof(uint64_t) * 2, sizeof(uint64_t));
+
+		m_trustedBlocks.emplace(id, b);
+	}
+
+	LOGINFO(1, "loaded verified chain state (" << m_trustedBlocks.size() << " blocks)");
+}
+
+void SideChain::trust_cached_blocks(const std::vector<PoolBlock*>& cached_blocks)
+{
+	WriteLock lock(m_sidechainLock);
+
+	if (m_trustedBlocks.empty()) {
+		return;
+	}
+
+	unordered_map<hash, TrustedBlock> trusted;
+	trusted.reserve(m_trustedBlocks.size());
+
+	for (const PoolBlock* block : cached_blocks) {
+		auto it = m_trustedBlocks.find(block->m_sidechainId);
+		if ((it == m_trustedBlocks.end()) ||
+			(it->second.m_sidechainHeight != block->m_sidechainHeight) ||
+			(it->second.m_cumulativeDifficulty != block->m_cumulativeDifficulty)) {
+			continue;
+		}
+
+		TrustedBlock b = it->second;
+
+		// get_blobs() can return a fresh serialization, it must stay alive while the blob is used
+		const std::shared_ptr<const PoolBlock::Blobs> blobs = block->get_blobs();
+		const std::vector<uint8_t>& blob = blobs->m_full;
+		keccak(blob.data(), static_cast<int>(blob.size()), b.m_blobHash.h, HASH_SIZE);
+
+		trusted.emplace(block->m_sidechainId, b);
+	}
+
+	LOGINFO(1, "verified chain state: " << trusted.size() << " of " << m_trustedBlocks.size() << " blocks are in the block cache");
+
+	m_trustedBlocks = std::move(trusted);
+}
+
+bool SideChain::is_trusted(const PoolBlock& block) const
+{
+	auto it = m_trustedBlocks.find(block.m_sidechainId);
+	if ((it == m_trustedBlocks.end()) ||
+		(it->second.m_sidechainHeight != block.m_sidechainHeight) ||
+		(it->second.m_cumulativeDifficulty != block.m_cumulativeDifficulty)) {
+		return false;
+	}
+
+	hash h;
+	const std::shared_ptr<const PoolBlock::Blobs> blobs = block.get_blobs();
+	const std::vector<uint8_t>& blob = blobs->m_full;
+	keccak(blob.data(), static_cast<int>(blob.size()), h.h, HASH_SIZE);
+
+	return h == it->second.m_blobHash;
+}
+
 bool SideChain::load_config(const std::string& filename)
 {
 	if (filename.empty()) {
@@ -2035,18 +3338,18 @@ void SideChain::launch_precalc(const PoolBlock* block)
 	}
 
 	for (int h = UNCLE_BLOCK_DEPTH - 1; h >= 0; --h) {
-		auto it = m_blocksByHeight.find(block->m_sidechainHeight + m_chainWindowSize + h - 1);
-		if (it == m_blocksByHeight.end()) {
+		const std::vector<PoolBlock*>* blocks = m_blocksByHeight.find(block->m_sidechainHeight + m_chainWindowSize + h - 1);
+		if (!blocks) {
 			continue;
 		}
-		for (PoolBlock* b : it->second) {
+		for (PoolBlock* b : *blocks) {
 			if (b->m_precalculated) {
 				continue;
 			}
 			std::vector<const Wallet*> wallets;
 			if (get_wallets(b, wallets)) {
 				b->m_precalculated = true;
-				PrecalcJob* job = new PrecalcJob{ b, std::move(wallets) };
+				PrecalcJob* job = new PrecalcJob{ b->m_txkeySec, std::move(wallets), {} };
 				{
 					MutexLock lock2(m_precalcJobsMutex);
 					m_precalcJobs.push_back(job);
@@ -2057,21 +3360,63 @@ void SideChain::launch_precalc(const PoolBlock* block)
 	}
 }
 
+void SideChain::launch_background_precalc(const hash& txkeySec, const std::vector<const Wallet*>& wallets)
+{
+	// Only the most recent jobs are useful in background mode
+	constexpr size_t MAX_BACKGROUND_JOBS = 8;
+
+	if (wallets.empty()) {
+		return;
+	}
+
+	PrecalcJob* job = new PrecalcJob{ txkeySec, {}, {} };
+
+	job->m_walletsCopy.reserve(wallets.size());
+	job->m_wallets.reserve(wallets.size());
+
+	for (const Wallet* w : wallets) {
+		job->m_walletsCopy.emplace_back();
+		job->m_walletsCopy.back().assign(*w);
+	}
+	for (const InternedWallet& w : job->m_walletsCopy) {
+		job->m_wallets.push_back(w.get());
+	}
+
+	{
+		MutexLock lock(m_precalcJobsMutex);
+
+		if (m_precalcStopped) {
+			delete job;
+			return;
+		}
+
+		if (m_precalcJobs.size() >= MAX_BACKGROUND_JOBS) {
+			delete m_precalcJobs.front();
+			m_precalcJobs.erase(m_precalcJobs.begin());
+		}
+
+		m_precalcJobs.push_back(job);
+	}
+	uv_cond_signal(&m_precalcJobsCond);
+}
+
 void SideChain::precalc_worker()
 {
+	bool is_background = false;
+
 	do {
 		PrecalcJob* job;
 		{
 			MutexLock lock(m_precalcJobsMutex);
 
-			if (m_precalcFinished) {
+			if (m_precalcStopped) {
 				return;
 			}
 
 			while (m_precalcJobs.empty()) {
 				uv_cond_wait(&m_precalcJobsCond, &m_precalcJobsMutex);
 
-				if (m_precalcFinished) {
+				if (m_precalcStopped) {
 					return;
 				}
 			}
@@ -2079,36 +3424,114 @@ void SideChain::precalc_worker()
 			job = m_precalcJobs.back();
 			m_precalcJobs.pop_back();
 
-			// Filter out duplicate inputs for get_eph_public_key()
-			uint8_t t[HASH_SIZE * 2 + sizeof(size_t)];
-			memcpy(t, job->b->m_txkeySec.h, HASH_SIZE);
-
-			for (size_t i = 0, n = job->wallets.size(); i < n; ++i) {
-				memcpy(t + HASH_SIZE, job->wallets[i]->view_public_key().h, HASH_SIZE);
-				memcpy(t + HASH_SIZE * 2, &i, sizeof(i));
-				if (!m_uniquePrecalcInputs->insert(robin_hood::hash_bytes(t, array_size(t))).second) {
-					job->wallets[i] = nullptr;
+			// Filter out duplicate inputs for get_eph_public_key() during the initial sync
+			if (m_uniquePrecalcInputs) {
+				// Precalc jobs only have interned wallets, so a wallet pointer identifies its view key
+				uint8_t t[HASH_SIZE + sizeof(const Wallet*) + sizeof(size_t)];
+				memcpy(t, job->m_txkeySec.h, HASH_SIZE);
+
+				for (size_t i = 0, n = job->m_wallets.size(); i < n; ++i) {
+					memcpy(t + HASH_SIZE, &job->m_wallets[i], sizeof(const Wallet*));
+					memcpy(t + HASH_SIZE + sizeof(const Wallet*), &i, sizeof(i));
+					if (!m_uniquePrecalcInputs->insert(robin_hood::hash_bytes(t, array_size(t))).second) {
+						job->m_wallets[i] = nullptr;
+					}
 				}
 			}
 		}
 
-		for (size_t i = 0, n = job->wallets.size(); i < n; ++i) {
-			if (job->wallets[i]) {
-				hash eph_public_key;
-				uint8_t view_tag;
-				job->wallets[i]->get_eph_public_key(job->b->m_txkeySec, i, eph_public_key, view_tag);
-			}
+		// Background mode must not slow down anything else
+		if (!is_background && m_precalcFinished) {
+			make_thread_background();
+			is_background = true;
+		}
+
+		{
+			const size_t n = job->m_wallets.size();
+			std::vector<hash> eph_public_keys(n);
+			std::vector<uint8_t> view_tags(n);
+			Wallet::get_eph_public_keys(job->m_wallets.data(), n, job->m_txkeySec, 0, eph_public_keys.data(), view_tags.data());
 		}
 		delete job;
 	} while (true);
 }
 
-void SideChain::finish_precalc()
+void SideChain::verify_worker()
+{
+	do {
+		std::shared_ptr<VerifyBatch> batch;
+		{
+			MutexLock lock(m_precalcJobsMutex);
+
+			if (m_precalcStopped) {
+				return;
+			}
+
+			while (m_verifyBatches.empty()) {
+				uv_cond_wait(&m_verifyBatchesCond, &m_precalcJobsMutex);
+
+				if (m_precalcStopped) {
+					return;
+				}
+			}
+
+			batch = std::move(m_verifyBatches.back());
+			m_verifyBatches.pop_back();
+		}
+
+		batch->run();
+	} while (true);
+}
+
+void SideChain::switch_precalc_to_background()
 {
 	if (m_precalcFinished.exchange(true)) {
 		return;
 	}
 
+	{
+		MutexLock lock(m_precalcJobsMutex);
+		for (PrecalcJob* job : m_precalcJobs) {
+			delete job;
+		}
+		m_precalcJobs.clear();
+		m_precalcJobs.shrink_to_fit();
+
+		delete m_uniquePrecalcInputs;
+		m_uniquePrecalcInputs = nullptr;
+	}
+
+	LOGINFO(4, "pre-calculation workers switched to background mode");
+
+	// All blocks from the saved chain state are processed by now
+	if (!m_trustedBlocks.empty()) {
+		LOGINFO(4, "verified chain state: " << m_trustedBlocks.size() << " blocks were trusted");
+		m_trustedBlocks.clear();
+	}
+
+	// Also evict cache entries which were only used for old blocks
+	age_crypto_cache();
+
+#ifdef DEV_TEST_SYNC
+	if (m_pool) {
+		LOGINFO(0, log::LightGreen() << "[DEV] Synchronization finished successfully, stopping P2Pool now");
+		print_status();
+		if (m_pool->p2p_server()) {
+			m_pool->p2p_server()->print_status();
+		}
+		m_pool->stop();
+	}
+#endif
+}
+
+void SideChain::finish_precalc()
+{
+	if (m_precalcStopped.exchange(true)) {
+		return;
+	}
+
+	m_precalcFinished = true;
+
 	try
 	{
 		{
@@ -2118,7 +3541,9 @@ void SideChain::finish_precalc()
 			}
 			m_precalcJobs.clear();
 			m_precalcJobs.shrink_to_fit();
+			m_verifyBatches.clear();
 			uv_cond_broadcast(&m_precalcJobsCond);
+			uv_cond_broadcast(&m_verifyBatchesCond);
 		}
 
 		for (std::thread& t : m_precalcWorkers) {
@@ -2127,11 +3552,18 @@ void SideChain::finish_precalc()
 		m_precalcWorkers.clear();
 		m_precalcWorkers.shrink_to_fit();
 
+		for (std::thread& t : m_verifyWorkers) {
+			t.join();
+		}
+		m_verifyWorkers.clear();
+		m_verifyWorkers.shrink_to_fit();
+
 		delete m_uniquePrecalcInputs;
 		m_uniquePrecalcInputs = nullptr;
 
 		uv_mutex_destroy(&m_precalcJobsMutex);
 		uv_cond_destroy(&m_precalcJobsCond);
+		uv_cond_destroy(&m_verifyBatchesCond);
 
 		LOGINFO(4, "pre-calculation workers stopped");
 	}
@@ -2139,20 +3571,6 @@ void SideChain::finish_precalc()
 	{
 		LOGERR(1, "exception in finish_precalc(): " << e.what());
 	}
-
-	// Also clear cache because it has data from all old blocks now
-	clear_crypto_cache();
-
-#ifdef DEV_TEST_SYNC
-	if (m_pool) {
-		LOGINFO(0, log::LightGreen() << "[DEV] Synchronization finished successfully, stopping P2Pool now");
-		print_status(false);
-		if (m_pool->p2p_server()) {
-			m_pool->p2p_server()->print_status();
-		}
-		m_pool->stop();
-	}
-#endif
 }
 
 } // namespace p2pool
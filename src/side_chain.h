@@ -18,14 +18,17 @@
 #pragma once
 
 #include "uv_util.h"
+#include "pool_block.h"
 #include <map>
+#include <deque>
+#include <queue>
 #include <thread>
+#include <memory>
 
 namespace p2pool {
 
 class p2pool;
 class P2PServer;
-struct DifficultyData;
 struct PoolBlock;
 class Wallet;
 
@@ -38,6 +41,137 @@ struct MinerShare
 	const Wallet* m_wallet;
 };
 
+// Sidechain blocks indexed by height
+// Live heights are always a narrow range below the chain tip, so they're stored in a ring buffer indexed by (height % capacity)
+// Heights which collide with an already occupied slot (very old or far ahead of the tip) go to a small overflow map
+class BlocksByHeight : public nocopy_nomove
+{
+public:
+	BlocksByHeight() : m_mask(0), m_minHeight(std::numeric_limits<uint64_t>::max()) {}
+
+	void init(uint64_t min_capacity);
+
+	std::vector<PoolBlock*>* find(uint64_t height);
+	const std::vector<PoolBlock*>* find(uint64_t height) const;
+
+	void add(uint64_t height, PoolBlock* block);
+
+	// Calls callback(height, blocks) for all heights <= max_height, heights with no blocks left after the callback are freed
+	template<typename T>
+	void prune(uint64_t max_height, T&& callback)
+	{
+		if (m_minHeight > max_height) {
+			return;
+		}
+
+		uint64_t new_min_height = max_height + 1;
+
+		const uint64_t capacity = m_slots.size();
+		const uint64_t start = ((max_height - m_minHeight) >= capacity) ? (max_height + 1 - capacity) : m_minHeight;
+
+		for (uint64_t h = start; h <= max_height; ++h) {
+			Slot& slot = m_slots[h & m_mask];
+			if (slot.m_blocks.empty() || (slot.m_height > max_height)) {
+				continue;
+			}
+
+			callback(slot.m_height, slot.m_blocks);
+
+			if (!slot.m_blocks.empty()) {
+				new_min_height = std::min(new_min_height, slot.m_height);
+			}
+		}
+
+		for (auto it = m_overflow.begin(); (it != m_overflow.end()) && (it->first <= max_height);) {
+			callback(it->first, it->second);
+
+			if (it->second.empty()) {
+				it = m_overflow.erase(it);
+			}
+			else {
+				new_min_height = std::min(new_min_height, it->first);
+				++it;
+			}
+		}
+
+		m_minHeight = new_min_height;
+	}
+
+private:
+	struct Slot
+	{
+		Slot() : m_height(0) {}
+
+		uint64_t m_height;
+		std::vector<PoolBlock*> m_blocks;
+	};
+
+	std::vector<Slot> m_slots;
+	uint64_t m_mask;
+
+	// Lower bound for the lowest height stored
+	uint64_t m_minHeight;
+
+	std::map<uint64_t, std::vector<PoolBlock*>> m_overflow;
+};
+
+// (timestamp, cumulative difficulty) entries of blocks in the difficulty window of one chain tip
+// Entries are kept in a treap ordered by timestamp, so adding, removing and the trimmed window query are all O(log n)
+class DifficultyWindow : public nocopy_nomove
+{
+public:
+	DifficultyWindow() : m_root(NONE), m_seq(0), m_rng(0x9E3779B97F4A7C15ULL) {}
+
+	void clear();
+	void add(uint64_t height, uint64_t timestamp, const difficulty_type& cumulative_difficulty);
+
+	// Removes all entries with height <= max_height
+	void prune(uint64_t max_height);
+
+	size_t size() const { return (m_root != NONE) ? m_nodes[m_root].m_size : 0; }
+
+	// Discards 10% oldest and 10% newest (by timestamp) entries
+	// Returns the timestamp range and the lowest and the highest cumulative difficulties of entries in it, window must not be empty
+	void get_range(uint64_t& timestamp1, uint64_t& timestamp2, difficulty_type& diff1, difficulty_type& diff2) const;
+
+private:
+	enum : uint32_t { NONE = 0xFFFFFFFFU };
+
+	struct Node
+	{
+		uint64_t m_timestamp;
+		uint64_t m_seq;
+		uint64_t m_priority;
+		difficulty_type m_cumulativeDifficulty;
+
+		uint32_t m_left;
+		uint32_t m_right;
+		uint32_t m_size;
+
+		// Lowest and highest cumulative difficulty in this subtree
+		difficulty_type m_minDiff;
+		difficulty_type m_maxDiff;
+	};
+
+	void update(uint32_t node);
+	uint32_t merge(uint32_t a, uint32_t b);
+	void split(uint32_t node, uint64_t timestamp, uint64_t seq, uint32_t& left, uint32_t& right);
+
+	const Node& kth(uint32_t k) const;
+	uint32_t count_less(uint64_t timestamp) const;
+	uint32_t count_less_or_equal(uint64_t timestamp) const;
+	void range_diff(uint32_t node, uint32_t begin, uint32_t end, difficulty_type& diff1, difficulty_type& diff2) const;
+
+	std::vector<Node> m_nodes;
+	std::vector<uint32_t> m_freeNodes;
+	uint32_t m_root;
+	uint64_t m_seq;
+	uint64_t m_rng;
+
+	// (height, node) pairs, lowest height first
+	std::priority_queue<std::pair<uint64_t, uint32_t>, std::vector<std::pair<uint64_t, uint32_t>>, std::greater<std::pair<uint64_t, uint32_t>>> m_heights;
+};
+
 class SideChain : public nocopy_nomove
 {
 public:
@@ -46,7 +180,11 @@ public:
 
 	void fill_sidechain_data(PoolBlock& block, const Wallet* w, const hash& txkeySec, std::vector<MinerShare>& shares) const;
 
+	// Starts calculating output keys for the next block template in the background as soon as its tx key is known
+	void precalc_template(const Wallet* w, const hash& txkeySec);
+
 	bool block_seen(const PoolBlock& block);
+	bool was_seen(const hash& id);
 	void unsee_block(const PoolBlock& block);
 	bool add_external_block(PoolBlock& block, std::vector<hash>& missing_blocks);
 	void add_block(const PoolBlock& block);
@@ -55,19 +193,72 @@ public:
 	PoolBlock* find_block(const hash& id) const;
 	void watch_mainchain_block(const ChainMain& data, const hash& possible_id);
 
-	bool get_block_blob(const hash& id, std::vector<uint8_t>& blob) const;
+	// Returned blobs are shared with the blocks, nothing is serialized or copied
+	typedef std::shared_ptr<const std::vector<uint8_t>> BlockBlob;
+
+	bool get_block_blob(const hash& id, BlockBlob& blob) const;
+
+	// Blobs of a known block if it still has them, nothing is serialized here
+	std::shared_ptr<const PoolBlock::Blobs> get_cached_blobs(const hash& id) const;
+
+	// Blocks starting from id and going back through their parents, until max_count blocks or max_size bytes are collected or a parent is unknown
+	void get_ancestor_blobs(const hash& id, uint32_t max_count, size_t max_size, std::vector<BlockBlob>& blobs) const;
 	bool get_outputs_blob(PoolBlock* block, uint64_t total_reward, std::vector<uint8_t>& blob, uv_loop_t* loop) const;
 
-	void print_status(bool obtain_sidechain_lock = true) const;
+	void print_status() const;
 	double get_reward_share(const Wallet& w) const;
 
+	// PPLNS window summary shown by print_status()
+	struct WindowStats
+	{
+		uint32_t m_totalBlocks = 0;
+		uint32_t m_totalUncles = 0;
+		uint64_t m_totalOrphans = 0;
+
+		// each dot corresponds to m_chainWindowSize / 30 shares, with current values, 2160 / 30 = 72
+		std::array<uint32_t, 30> m_ourBlocks{};
+		std::array<uint32_t, 30> m_ourUncles{};
+		uint64_t m_ourOrphans = 0;
+	};
+
+	// Immutable copy of the chain tip state, published on every chain tip change
+	// Readers get a consistent view without taking m_sidechainLock
+	struct Snapshot
+	{
+		hash m_tipId;
+		uint64_t m_sidechainHeight = 0;
+		uint64_t m_txinGenHeight = 0;
+		uint64_t m_localTimestamp = 0;
+		difficulty_type m_difficulty;
+		difficulty_type m_totalHashes;
+		hash m_txkeySec;
+		uint8_t m_txType = 0;
+
+		// Serialized tip, shared with the tip block, empty if there is no tip yet
+		std::shared_ptr<const PoolBlock::Blobs> m_blobs;
+
+		// Coinbase outputs and PPLNS window summary of the tip, computed when the snapshot is published
+		std::vector<PoolBlock::TxOutput> m_outputs;
+		WindowStats m_windowStats;
+	};
+
+	std::shared_ptr<const Snapshot> snapshot() const { return std::atomic_load(&m_snapshot); }
+
+	// Verified blocks are saved next to the block cache, so after a restart
+	// blocks from our own block cache skip their output key checks
+	void save_chain_state() const;
+	void load_chain_state();
+
+	// Keeps only saved blocks which are in the block cache and binds them to their full blobs
+	void trust_cached_blocks(const std::vector<PoolBlock*>& cached_blocks);
+
 	// Consensus ID can be used to spawn independent P2Pools with their own sidechains
 	// It's never sent over the network to avoid revealing it to the possible man in the middle
 	// Consensus ID can therefore be used as a password to create private P2Pools
 	const std::vector<uint8_t>& consensus_id() const { return m_consensusId; }
 	uint64_t chain_window_size() const { return m_chainWindowSize; }
 	NetworkType network_type() const { return m_networkType; }
-	FORCEINLINE difficulty_type difficulty() const { ReadLock lock(m_curDifficultyLock); return m_curDifficulty; }
+	FORCEINLINE difficulty_type difficulty() const { return snapshot()->m_difficulty; }
 	difficulty_type total_hashes() const;
 	uint64_t block_time() const { return m_targetBlockTime; }
 	uint64_t miner_count();
@@ -76,36 +267,87 @@ public:
 	bool is_mini() const;
 
 	const PoolBlock* chainTip() const { return m_chainTip; }
+
+	// Time spent in verify_loop() stages, in microseconds
+	// get_shares() time is a part of the prepare time
+	struct VerifyStats
+	{
+		uint64_t m_numBlocks = 0;
+		uint64_t m_prepareTime = 0;
+		uint64_t m_getSharesTime = 0;
+		uint64_t m_outputsTime = 0;
+		uint64_t m_numPrechecked = 0;
+		uint64_t m_numTrusted = 0;
+	};
+
+	VerifyStats verify_stats() const;
 	bool precalcFinished() const { return m_precalcFinished.load(); }
 
+	// PPLNS shares of the window ending at "tip", the caller must hold m_sidechainLock
+	// get_shares() updates the parent's window incrementally, get_shares_full() walks the whole window, both give the same result
+	bool get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares) const;
+	bool get_shares_full(const PoolBlock* tip, std::vector<MinerShare>& shares) const;
+
 	static bool split_reward(uint64_t reward, const std::vector<MinerShare>& shares, std::vector<uint64_t>& rewards);
 
+	// Sorts shares by wallet address and adds up weights of the same wallets
+	// Wallets with the same spend key get one share, it goes to the wallet with the lowest view key
+	static void combine_shares(std::vector<MinerShare>& shares);
+
 private:
 	p2pool* m_pool;
 	P2PServer* p2pServer() const;
 	NetworkType m_networkType;
 
 private:
-	bool get_shares(const PoolBlock* tip, std::vector<MinerShare>& shares) const;
-	bool get_difficulty(const PoolBlock* tip, std::vector<DifficultyData>& difficultyData, difficulty_type& curDifficulty) const;
+	template<typename Less, typename Equal>
+	static void merge_shares(std::vector<MinerShare>& shares, Less less, Equal equal);
+	bool get_difficulty(const PoolBlock* tip, difficulty_type& curDifficulty);
 	bool get_wallets(const PoolBlock* tip, std::vector<const Wallet*>& wallets) const;
+	// Output keys of a block which passed all other checks, verified later in parallel with other blocks
+	struct VerifyJob
+	{
+		const PoolBlock* m_block;
+		std::vector<const Wallet*> m_wallets;
+	};
+
 	void verify_loop(PoolBlock* block);
-	void verify(PoolBlock* block);
+	void verify(PoolBlock* block, std::vector<VerifyJob>& jobs);
+	bool verify_outputs(const VerifyJob& job, size_t begin, size_t end) const;
+	void verify_outputs_parallel(const std::vector<VerifyJob>& jobs, std::vector<uint8_t>& results) const;
+
+	// Output checks split into chunks, verification workers help the calling thread with them
+	struct VerifyBatch;
+
+	// Checks output keys of a new block without holding m_sidechainLock, using a snapshot of its shares
+	// verify() then skips output keys if it gets exactly the same shares
+	bool precheck_outputs(const PoolBlock& block, std::vector<InternedWallet>& wallets) const;
+	void add_block(const PoolBlock& block, const std::vector<InternedWallet>* prechecked_wallets);
+	void add_block_locked(const PoolBlock& block, const std::vector<InternedWallet>* prechecked_wallets);
 	void update_chain_tip(const PoolBlock* block);
+	void publish_snapshot();
+	bool is_trusted(const PoolBlock& block) const;
+	void get_window_stats(const PoolBlock* tip, WindowStats& stats) const;
+	static void get_reward(const Snapshot& s, const std::vector<PoolBlock::TxOutput>& outputs, const Wallet& w, uint64_t& reward, uint64_t& total_reward);
 	PoolBlock* get_parent(const PoolBlock* block) const;
 
 	// Checks if "candidate" has longer (higher difficulty) chain than "block"
 	bool is_longer_chain(const PoolBlock* block, const PoolBlock* candidate, bool& is_alternative);
 	void update_depths(PoolBlock* block);
 	void prune_old_blocks();
+	void release_old_blobs();
 
 	bool load_config(const std::string& filename);
 	bool check_config();
 
 	mutable uv_rwlock_t m_sidechainLock;
 	std::atomic<PoolBlock*> m_chainTip;
-	std::map<uint64_t, std::vector<PoolBlock*>> m_blocksByHeight;
+	BlocksByHeight m_blocksByHeight;
 	unordered_map<hash, PoolBlock*> m_blocksById;
+	PoolBlockAllocator m_blockAllocator;
+
+	// Blocks below this height don't keep serialized blobs anymore
+	uint64_t m_blobsReleaseHeight = 0;
 
 	uv_mutex_t m_seenWalletsLock;
 	unordered_map<hash, uint64_t> m_seenWallets;
@@ -114,7 +356,21 @@ private:
 	uv_mutex_t m_seenBlocksLock;
 	unordered_set<hash> m_seenBlocks;
 
-	std::vector<DifficultyData> m_difficultyData;
+	// Difficulty window of m_difficultyWindowTip, moved forward one block at a time when the next block's difficulty is needed
+	// Recent results are cached, so siblings of the window's tip don't force a full rebuild
+	DifficultyWindow m_difficultyWindow;
+	hash m_difficultyWindowTip;
+	uint64_t m_difficultyWindowHeight;
+
+	struct CachedDifficulty
+	{
+		hash m_id;
+		difficulty_type m_difficulty;
+	};
+
+	enum { DIFFICULTY_CACHE_SIZE = 16 };
+	CachedDifficulty m_difficultyCache[DIFFICULTY_CACHE_SIZE];
+	uint32_t m_difficultyCacheIndex;
 
 	std::string m_poolName;
 	std::string m_poolPassword;
@@ -126,29 +382,120 @@ private:
 	std::vector<uint8_t> m_consensusId;
 	std::string m_consensusIdDisplayStr;
 
-	mutable uv_rwlock_t m_curDifficultyLock;
-	difficulty_type m_curDifficulty;
+	std::shared_ptr<const Snapshot> m_snapshot;
+
+	// update_chain_tip() only records the new tip here, publish_snapshot() builds the snapshot after the write lock is released
+	const PoolBlock* m_snapshotTip = nullptr;
+	difficulty_type m_snapshotDifficulty;
+	uv_mutex_t m_snapshotLock;
+
+	// Blocks from the verified chain state file, only used until the initial sync is finished
+	// The sidechain id doesn't cover nonce and extra_nonce, so the full blob must match too
+	struct TrustedBlock
+	{
+		uint64_t m_sidechainHeight;
+		difficulty_type m_cumulativeDifficulty;
+		hash m_blobHash;
+	};
+
+	unordered_map<hash, TrustedBlock> m_trustedBlocks;
+
+	VerifyStats m_verifyStats;
+	mutable uv_mutex_t m_chainStateFileLock;
+
+	// Outputs recently generated by get_outputs_blob(), newest first
+	struct OutputsBlob
+	{
+		hash m_key;
+		std::vector<uint8_t> m_blob;
+		std::vector<PoolBlock::TxOutput> m_outputs;
+	};
+
+	mutable uv_mutex_t m_outputsBlobCacheLock;
+	mutable std::deque<OutputsBlob> m_outputsBlobCache;
+
+	// Running PPLNS share totals for one block's window, updated incrementally as the chain tip advances
+	struct SharesWindow
+	{
+		struct Entry
+		{
+			uint64_t m_weight;
+
+			// Wallets with this spend key and the number of shares each of them has in the window, almost always only one wallet
+			std::vector<std::pair<const Wallet*, uint64_t>> m_wallets;
+		};
+
+		struct Delta
+		{
+			const Wallet* m_wallet;
+			uint64_t m_weight;
+			uint64_t m_refs;
+			bool m_add;
+		};
+
+		hash m_tipId;
+
+		// Blocks in the window, m_blocks.front() is the tip
+		std::deque<const PoolBlock*> m_blocks;
+
+		// Sorted by wallet, this is the order get_shares() returns shares in
+		std::map<hash, Entry> m_entries;
+
+		void clear() { m_tipId = {}; m_blocks.clear(); m_entries.clear(); }
+		void update(const Delta& d, bool add);
+		void apply(const std::vector<Delta>& deltas);
+		void revert(const std::vector<Delta>& deltas);
+		void get_shares(std::vector<MinerShare>& shares) const;
+	};
+
+	mutable uv_mutex_t m_sharesWindowLock;
+	mutable SharesWindow m_sharesWindow;
+
+	uint64_t uncle_penalty(const PoolBlock* uncle) const;
+	bool build_shares_window(const PoolBlock* tip) const;
 
 	ChainMain m_watchBlock;
 	hash m_watchBlockSidechainId;
 
 	struct PrecalcJob
 	{
-		const PoolBlock* b;
-		std::vector<const Wallet*> wallets;
+		hash m_txkeySec;
+		std::vector<const Wallet*> m_wallets;
+
+		// Background jobs keep their own references to wallets because blocks they came from can be pruned before the job runs
+		// Interned wallets also have key tables for faster derivations
+		std::vector<InternedWallet> m_walletsCopy;
 	};
 
-	uv_cond_t m_precalcJobsCond;
-	uv_mutex_t m_precalcJobsMutex;
+	mutable uv_cond_t m_precalcJobsCond;
+	mutable uv_mutex_t m_precalcJobsMutex;
 
 	std::vector<PrecalcJob*> m_precalcJobs;
 	std::vector<std::thread> m_precalcWorkers;
+
+	// Output checks are waited on by threads holding m_sidechainLock, so they run on their own normal priority threads
+	// Pre-calculation workers can't help with them, they drop to idle priority in background mode
+	mutable uv_cond_t m_verifyBatchesCond;
+	mutable std::vector<std::shared_ptr<VerifyBatch>> m_verifyBatches;
+	std::vector<std::thread> m_verifyWorkers;
+
 	unordered_set<size_t>* m_uniquePrecalcInputs;
 
+	// Initial sync is finished, pre-calculation workers now run in background mode
 	std::atomic<bool> m_precalcFinished;
+	std::atomic<bool> m_precalcStopped;
+
+	uint32_t m_numVerifyThreads;
+
+	// Set only while add_block() holds m_sidechainLock
+	const PoolBlock* m_precheckedBlock;
+	const std::vector<InternedWallet>* m_precheckedWallets;
 
 	void launch_precalc(const PoolBlock* block);
+	void launch_background_precalc(const hash& txkeySec, const std::vector<const Wallet*>& wallets);
 	void precalc_worker();
+	void verify_worker();
+	void switch_precalc_to_background();
 	void finish_precalc();
 };
 
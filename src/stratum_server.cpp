@@ -22,6 +22,8 @@
 #include "side_chain.h"
 #include "params.h"
 #include "p2pool_api.h"
+#include "metrics.h"
+#include "trace.h"
 
 static constexpr char log_category_prefix[] = "StratumServer ";
 
@@ -30,6 +32,14 @@ static constexpr uint64_t DEFAULT_BAN_TIME = 600;
 static constexpr uint64_t MIN_DIFF = 1000;
 static constexpr uint64_t AUTO_DIFF_TARGET_TIME = 30;
 
+// Hashing blobs generated in advance with every new block template for clients that log in later
+static constexpr uint32_t LOGIN_BLOBS_COUNT = 256;
+
+// Share rate budget (--stratum-share-rate): auto diff multiplier in percent, and how many queued PoW checks mean the verifier is overloaded
+static constexpr uint32_t MIN_DIFF_MULTIPLIER = 100;
+static constexpr uint32_t MAX_DIFF_MULTIPLIER = 100000;
+static constexpr uint32_t MAX_PENDING_POW_CHECKS = 64;
+
 // Use short target format (4 bytes) for diff <= 4 million
 static constexpr uint64_t TARGET_4_BYTES_LIMIT = std::numeric_limits<uint64_t>::max() / 4000001;
 
@@ -43,29 +53,73 @@ namespace p2pool {
 
 StratumServer::StratumServer(p2pool* pool)
 	: TCPServer(StratumClient::allocate)
+	, m_main(this)
+	, m_numJobsSent(0)
+	, m_diffMultiplier(MIN_DIFF_MULTIPLIER)
+	, m_numPendingPoWChecks(0)
+	, m_lastPoWBatchSize(0)
+	, m_lastPoWBatchTime(0)
+	, m_pool(pool)
+	, m_autoDiff(pool->params().m_autoDiff)
+	, m_rng(RandomDeviceSeed::instance)
+	, m_cumulativeHashesAtLastShare(0)
+	, m_cumulativeFoundSharesDiff(0.0)
+	, m_totalFoundShares(0)
+	, m_apiLastUpdateTime(0)
+{
+	init();
+
+	uint32_t num_threads = pool->params().m_stratumThreads;
+	if ((num_threads > 1) && !reuse_port_supported()) {
+		LOGWARN(1, "--stratum-threads is not supported on this platform, using 1 thread");
+		num_threads = 1;
+	}
+
+	const bool reuse_port = (num_threads > 1);
+	start_listening(pool->params().m_stratumAddresses, reuse_port);
+
+	m_shards.reserve(num_threads);
+	m_shards.push_back(this);
+
+	for (uint32_t i = 1; i < num_threads; ++i) {
+		m_shards.push_back(new StratumServer(pool, this));
+	}
+
+	if (reuse_port) {
+		LOGINFO(1, "running " << num_threads << " event loops");
+	}
+}
+
+StratumServer::StratumServer(p2pool* pool, StratumServer* main)
+	: TCPServer(StratumClient::allocate)
+	, m_main(main)
+	, m_numJobsSent(0)
+	, m_diffMultiplier(MIN_DIFF_MULTIPLIER)
+	, m_numPendingPoWChecks(0)
+	, m_lastPoWBatchSize(0)
+	, m_lastPoWBatchTime(0)
 	, m_pool(pool)
 	, m_autoDiff(pool->params().m_autoDiff)
 	, m_rng(RandomDeviceSeed::instance)
-	, m_cumulativeHashes(0)
 	, m_cumulativeHashesAtLastShare(0)
-	, m_hashrateDataHead(0)
-	, m_hashrateDataTail_15m(0)
-	, m_hashrateDataTail_1h(0)
-	, m_hashrateDataTail_24h(0)
 	, m_cumulativeFoundSharesDiff(0.0)
 	, m_totalFoundShares(0)
 	, m_apiLastUpdateTime(0)
+{
+	init();
+	start_listening(pool->params().m_stratumAddresses, true);
+}
+
+void StratumServer::init()
 {
 	// Diffuse the initial state in case it has low quality
 	m_rng.discard(10000);
 
 	m_extraNonce = static_cast<uint32_t>(m_rng());
 
-	m_hashrateData[0] = { seconds_since_epoch(), 0 };
-
 	uv_mutex_init_checked(&m_blobsQueueLock);
 	uv_mutex_init_checked(&m_rngLock);
-	uv_rwlock_init_checked(&m_hashrateDataLock);
+	uv_mutex_init_checked(&m_foundSharesLock);
 
 	m_submittedSharesPool.resize(10);
 	for (size_t i = 0; i < m_submittedSharesPool.size(); ++i) {
@@ -80,34 +134,61 @@ StratumServer::StratumServer(p2pool* pool)
 	m_blobsAsync.data = this;
 	m_blobsQueue.reserve(2);
 
-	start_listening(pool->params().m_stratumAddresses);
+	m_numShareBatchesInProgress = 0;
 }
 
 StratumServer::~StratumServer()
 {
+	// Additional event loops use shared state from the main server, stop them first
+	for (size_t i = 1; i < m_shards.size(); ++i) {
+		delete m_shards[i];
+	}
+
 	shutdown_tcp();
 
 	uv_mutex_destroy(&m_blobsQueueLock);
 	uv_mutex_destroy(&m_rngLock);
-	uv_rwlock_destroy(&m_hashrateDataLock);
+	uv_mutex_destroy(&m_foundSharesLock);
 
 	for (SubmittedShare* share : m_submittedSharesPool) {
 		delete share;
 	}
+
+	for (SubmittedShare* share : m_pendingShares) {
+		delete share;
+	}
 }
 
 void StratumServer::on_block(const BlockTemplate& block)
 {
-	LOGINFO(4, "new block template at height " << block.height());
+	TraceSpan span("StratumServer::on_block");
+	if (trace::enabled) {
+		const std::shared_ptr<const BlockTemplate::Snapshot> t = block.snapshot();
+		if (t && t->m_poolBlockTemplate) {
+			span.set_id(t->m_poolBlockTemplate->m_parent);
+		}
+	}
 
-	const uint32_t num_connections = m_numConnections;
-	if (num_connections == 0) {
-		LOGINFO(4, "no clients connected");
-		return;
+	const uint64_t height = block.height();
+	LOGINFO(4, "new block template at height " << height);
+
+	update_share_rate_budget(seconds_since_epoch());
+
+	// Each event loop gets its own range of extra_nonce values and blobs
+	const size_t num_shards = m_shards.size();
+	std::vector<uint32_t> shard_connections(num_shards);
+
+	uint32_t num_connections = 0;
+	for (size_t i = 0; i < num_shards; ++i) {
+		shard_connections[i] = m_shards[i]->m_numConnections;
+		num_connections += shard_connections[i];
 	}
 
+	// Blobs for logins are generated together with the new jobs, they go after all connected clients' blobs
+	const uint32_t num_blobs = num_connections + LOGIN_BLOBS_COUNT;
+
 	const uint32_t extra_nonce_start = static_cast<uint32_t>(get_random64());
-	m_extraNonce.exchange(extra_nonce_start + num_connections);
+	m_extraNonce.exchange(extra_nonce_start + num_blobs);
 
 	BlobsData* blobs_data = new BlobsData{};
 	blobs_data->m_extraNonceStart = extra_nonce_start;
@@ -120,7 +201,15 @@ void StratumServer::on_block(const BlockTemplate& block)
 	// Even if they do, they'll be added to the beginning of the list and will get their block template in on_login()
 	// We'll iterate through the list backwards so when we get to the beginning and run out of extra_nonce values, it'll be only new clients left
 	blobs_data->m_numClientsExpected = num_connections;
-	blobs_data->m_blobSize = block.get_hashing_blobs(extra_nonce_start, num_connections, blobs_data->m_blobs, blobs_data->m_height, difficulty, sidechain_difficulty, blobs_data->m_seedHash, nonce_offset, blobs_data->m_templateId);
+	blobs_data->m_blobSize = block.get_hashing_blobs(extra_nonce_start, num_blobs, blobs_data->m_blobs, blobs_data->m_height, difficulty, sidechain_difficulty, blobs_data->m_seedHash, nonce_offset, blobs_data->m_templateId);
+
+	publish_login_blobs(blobs_data, num_connections, difficulty, sidechain_difficulty);
+
+	if (num_connections == 0) {
+		LOGINFO(4, "no clients connected");
+		delete blobs_data;
+		return;
+	}
 
 	// Integrity checks
 	if (blobs_data->m_blobSize < 76) {
@@ -154,6 +243,106 @@ void StratumServer::on_block(const BlockTemplate& block)
 
 	blobs_data->m_target = std::max(difficulty.target(), sidechain_difficulty.target());
 
+	if (num_shards == 1) {
+		queue_blobs(blobs_data);
+		return;
+	}
+
+	const size_t blob_size = blobs_data->m_blobSize;
+	if (blobs_data->m_blobs.size() != blob_size * num_connections) {
+		delete blobs_data;
+		return;
+	}
+
+	// Event loops send their jobs in parallel, each one walks only its own clients list
+	uint32_t offset = 0;
+
+	for (size_t i = 0; i < num_shards; ++i) {
+		const uint32_t n = shard_connections[i];
+		if (n == 0) {
+			continue;
+		}
+
+		const uint8_t* p = blobs_data->m_blobs.data() + offset * blob_size;
+
+		BlobsData* shard_data = new BlobsData{};
+		shard_data->m_extraNonceStart = extra_nonce_start + offset;
+		shard_data->m_blobs.assign(p, p + n * blob_size);
+		shard_data->m_blobSize = blob_size;
+		shard_data->m_target = blobs_data->m_target;
+		shard_data->m_numClientsExpected = n;
+		shard_data->m_templateId = blobs_data->m_templateId;
+		shard_data->m_height = blobs_data->m_height;
+		shard_data->m_seedHash = blobs_data->m_seedHash;
+
+		offset += n;
+		m_shards[i]->queue_blobs(shard_data);
+	}
+
+	delete blobs_data;
+}
+
+void StratumServer::update_share_rate_budget(uint64_t cur_time)
+{
+	const uint32_t target_rate = m_pool->params().m_stratumShareRate;
+	if (!target_rate) {
+		return;
+	}
+
+	uint64_t num_shares, dt;
+	m_shareRate.get(cur_time, 60, num_shares, dt);
+
+	const double rate = dt ? (static_cast<double>(num_shares) / dt) : 0.0;
+	const uint32_t pending = m_numPendingPoWChecks;
+	const uint32_t k = m_diffMultiplier;
+
+	uint32_t new_k = k;
+
+	// Raise difficulty by 25% when either the share rate or the PoW checks queue are over the limit, relax it by 20% when the load is low
+	if ((rate > target_rate) || (pending > MAX_PENDING_POW_CHECKS)) {
+		new_k = std::min(k + k / 4, MAX_DIFF_MULTIPLIER);
+	}
+	else if ((rate < target_rate * 0.5) && (pending == 0)) {
+		new_k = std::max(k - k / 5, MIN_DIFF_MULTIPLIER);
+	}
+
+	if (new_k != k) {
+		m_diffMultiplier = new_k;
+		LOGINFO(5, "share rate " << rate << "/s (target " << target_rate << "/s), " << pending << " PoW checks queued, auto diff multiplier " << new_k << '%');
+	}
+}
+
+void StratumServer::publish_login_blobs(BlobsData* blobs_data, uint32_t num_connections, const difficulty_type& difficulty, const difficulty_type& sidechain_difficulty)
+{
+	std::shared_ptr<LoginBlobs> login_blobs = std::make_shared<LoginBlobs>();
+
+	const size_t blob_size = blobs_data->m_blobSize;
+	const size_t jobs_size = num_connections * blob_size;
+
+	if ((blob_size >= 76) && (blobs_data->m_blobs.size() == jobs_size + LOGIN_BLOBS_COUNT * blob_size)) {
+		login_blobs->m_blobs.assign(blobs_data->m_blobs.begin() + jobs_size, blobs_data->m_blobs.end());
+		login_blobs->m_count = LOGIN_BLOBS_COUNT;
+		blobs_data->m_blobs.resize(jobs_size);
+	}
+	else {
+		// Something went wrong, all logins will generate their blobs (integrity checks in on_block() will report it)
+		login_blobs->m_count = 0;
+	}
+
+	login_blobs->m_extraNonceStart = blobs_data->m_extraNonceStart + num_connections;
+	login_blobs->m_blobSize = blob_size;
+	login_blobs->m_height = blobs_data->m_height;
+	login_blobs->m_difficulty = difficulty;
+	login_blobs->m_sidechainDifficulty = sidechain_difficulty;
+	login_blobs->m_seedHash = blobs_data->m_seedHash;
+	login_blobs->m_templateId = blobs_data->m_templateId;
+	login_blobs->m_next = 0;
+
+	std::atomic_store(&m_loginBlobs, std::shared_ptr<const LoginBlobs>(std::move(login_blobs)));
+}
+
+void StratumServer::queue_blobs(BlobsData* blobs_data)
+{
 	{
 		MutexLock lock(m_blobsQueueLock);
 		m_blobsQueue.push_back(blobs_data);
@@ -239,9 +428,9 @@ static bool get_custom_diff(const char* s, difficulty_type& diff)
 
 bool StratumServer::on_login(StratumClient* client, uint32_t id, const char* login)
 {
-	const uint32_t extra_nonce = m_extraNonce.fetch_add(1);
-
+	uint32_t extra_nonce;
 	uint8_t hashing_blob[128];
+	size_t blob_size;
 	uint64_t height;
 	difficulty_type difficulty;
 	difficulty_type sidechain_difficulty;
@@ -249,7 +438,24 @@ bool StratumServer::on_login(StratumClient* client, uint32_t id, const char* log
 	size_t nonce_offset;
 	uint32_t template_id;
 
-	const size_t blob_size = m_pool->block_template().get_hashing_blob(extra_nonce, hashing_blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset, template_id);
+	// Take a blob generated in on_block() if there are any left, this doesn't touch the block template at all
+	const std::shared_ptr<const LoginBlobs> login_blobs = std::atomic_load(&m_main->m_loginBlobs);
+	const uint32_t k = login_blobs ? login_blobs->m_next.fetch_add(1) : 0;
+
+	if (login_blobs && (k < login_blobs->m_count)) {
+		extra_nonce = login_blobs->m_extraNonceStart + k;
+		blob_size = login_blobs->m_blobSize;
+		memcpy(hashing_blob, login_blobs->m_blobs.data() + k * blob_size, blob_size);
+		height = login_blobs->m_height;
+		difficulty = login_blobs->m_difficulty;
+		sidechain_difficulty = login_blobs->m_sidechainDifficulty;
+		seed_hash = login_blobs->m_seedHash;
+		template_id = login_blobs->m_templateId;
+	}
+	else {
+		extra_nonce = m_main->m_extraNonce.fetch_add(1);
+		blob_size = m_pool->block_template().get_hashing_blob(extra_nonce, hashing_blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset, template_id);
+	}
 
 	uint64_t target = std::max(difficulty.target(), sidechain_difficulty.target());
 
@@ -368,6 +574,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 		if (!block.get_difficulties(template_id, height, mainchain_diff, sidechain_diff)) {
 			LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a stale share");
+			metrics::stale_shares.add();
 			return send(client,
 				[id](void* buf, size_t buf_size)
 				{
@@ -414,6 +621,7 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		share->m_mainchainHeight = height;
 		share->m_effort = -1.0;
 		share->m_timestamp = seconds_since_epoch();
+		share->m_receivedTime = std::chrono::high_resolution_clock::now();
 
 		uint64_t rem;
 		share->m_hashes = (target > 1) ? udiv128(1, 0, target, &rem) : 1;
@@ -429,14 +637,11 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 		}
 
 		// Else switch to a worker thread to check PoW which can take a long time
-		const int err = uv_queue_work(&m_loop, &share->m_req, on_share_found, on_after_share_found);
-		if (err) {
-			LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+		// Shares submitted while all batches are busy will be checked together in the next batches
+		m_pendingShares.push_back(share);
+		++m_main->m_numPendingPoWChecks;
 
-			// If uv_queue_work failed, process this share here anyway
-			on_share_found(&share->m_req);
-			on_after_share_found(&share->m_req, 0);
-		}
+		start_share_batches();
 
 		return true;
 	}
@@ -456,13 +661,27 @@ bool StratumServer::on_submit(StratumClient* client, uint32_t id, const char* jo
 
 uint64_t StratumServer::get_random64()
 {
-	MutexLock lock(m_rngLock);
-	return m_rng();
+	MutexLock lock(m_main->m_rngLock);
+	return m_main->m_rng();
+}
+
+void StratumServer::ban(const raw_ip& ip, uint64_t seconds)
+{
+	if (m_main != this) {
+		m_main->ban(ip, seconds);
+		return;
+	}
+
+	TCPServer::ban(ip, seconds);
+}
+
+bool StratumServer::is_banned(const raw_ip& ip)
+{
+	return (m_main != this) ? m_main->is_banned(ip) : TCPServer::is_banned(ip);
 }
 
 void StratumServer::print_status()
 {
-	update_hashrate_data(0, seconds_since_epoch());
 	print_stratum_status();
 }
 
@@ -471,11 +690,14 @@ void StratumServer::show_workers()
 	const uint64_t cur_time = seconds_since_epoch();
 	const difficulty_type pool_diff = m_pool->side_chain().difficulty();
 
-	MutexLock lock(m_clientsListLock);
-
 	int addr_len = 0;
-	for (const StratumClient* c = static_cast<StratumClient*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<StratumClient*>(c->m_next)) {
-		addr_len = std::max(addr_len, static_cast<int>(strlen(c->m_addrString)));
+	for (StratumServer* shard : m_shards) {
+		MutexLock lock(shard->m_clientsListLock);
+
+		const Client* list = shard->m_connectedClientsList;
+		for (const StratumClient* c = static_cast<StratumClient*>(list->m_next); c != list; c = static_cast<StratumClient*>(c->m_next)) {
+			addr_len = std::max(addr_len, static_cast<int>(strlen(c->m_addrString)));
+		}
 	}
 
 	size_t n = 0;
@@ -487,24 +709,34 @@ void StratumServer::show_workers()
 			<< "name"
 	);
 
-	for (const StratumClient* c = static_cast<StratumClient*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<StratumClient*>(c->m_next)) {
-		difficulty_type diff;
-		if (c->m_customDiff != 0) {
-			diff = c->m_customDiff;
-		}
-		else if (m_autoDiff && (c->m_autoDiff != 0)) {
-			diff = c->m_autoDiff;
-		}
-		else {
-			diff = pool_diff;
+	for (StratumServer* shard : m_shards) {
+		MutexLock lock(shard->m_clientsListLock);
+
+		const Client* list = shard->m_connectedClientsList;
+		for (const StratumClient* c = static_cast<StratumClient*>(list->m_next); c != list; c = static_cast<StratumClient*>(c->m_next)) {
+			difficulty_type diff;
+			if (c->m_customDiff != 0) {
+				diff = c->m_customDiff;
+			}
+			else if (m_autoDiff && (c->m_autoDiff != 0)) {
+				diff = c->m_autoDiff;
+			}
+			else {
+				diff = pool_diff;
+			}
+
+			// Use auto diff estimate if it's available, measured hashrate otherwise
+			const bool auto_diff_hashrate = m_autoDiff && (c->m_autoDiff != 0);
+			const uint64_t hashrate = auto_diff_hashrate ? (c->m_autoDiff.lo / AUTO_DIFF_TARGET_TIME) : c->m_hashrate.hashrate(cur_time, 15 * 60);
+
+			LOGINFO(0, log::pad_right(static_cast<const char*>(c->m_addrString), addr_len + 8)
+					<< log::pad_right(log::Duration(cur_time - c->m_connectedTime), 20)
+					<< log::pad_right(diff, 20)
+					<< log::pad_right(log::Hashrate(hashrate, auto_diff_hashrate || (hashrate != 0)), 15)
+					<< (c->m_rpcId ? c->m_customUser : "not logged in")
+			);
+			++n;
 		}
-		LOGINFO(0, log::pad_right(static_cast<const char*>(c->m_addrString), addr_len + 8)
-				<< log::pad_right(log::Duration(cur_time - c->m_connectedTime), 20)
-				<< log::pad_right(diff, 20)
-				<< log::pad_right(log::Hashrate(c->m_autoDiff.lo / AUTO_DIFF_TARGET_TIME, m_autoDiff && (c->m_autoDiff != 0)), 15)
-				<< (c->m_rpcId ? c->m_customUser : "not logged in")
-		);
-		++n;
 	}
 
 	LOGINFO(0, "Total: " << n << " workers");
@@ -512,7 +744,9 @@ void StratumServer::show_workers()
 
 void StratumServer::reset_share_counters()
 {
-	m_cumulativeHashes = 0;
+	m_hashrate.reset();
+
+	MutexLock lock(m_foundSharesLock);
 	m_cumulativeHashesAtLastShare = 0;
 	m_cumulativeFoundSharesDiff = 0.0;
 	m_totalFoundShares = 0;
@@ -520,53 +754,80 @@ void StratumServer::reset_share_counters()
 
 void StratumServer::print_stratum_status() const
 {
-	uint64_t hashes_15m, hashes_1h, hashes_24h, total_hashes;
-	int64_t dt_15m, dt_1h, dt_24h;
+	const uint64_t cur_time = seconds_since_epoch();
 
-	uint64_t hashes_since_last_share;
+	const uint64_t hashrate_15m = m_hashrate.hashrate(cur_time, 15 * 60);
+	const uint64_t hashrate_1h  = m_hashrate.hashrate(cur_time, 60 * 60);
+	const uint64_t hashrate_24h = m_hashrate.hashrate(cur_time, 60 * 60 * 24);
+	const uint64_t total_hashes = m_hashrate.total_hashes();
 
+	uint64_t hashes_at_last_share;
+	double diff;
+	uint32_t shares_found;
 	{
-		ReadLock lock(m_hashrateDataLock);
-
-		total_hashes = m_cumulativeHashes;
-		hashes_since_last_share = m_cumulativeHashes - m_cumulativeHashesAtLastShare;
-
-		const HashrateData* data = m_hashrateData;
-		const HashrateData& head = data[m_hashrateDataHead];
-		const HashrateData& tail_15m = data[m_hashrateDataTail_15m];
-		const HashrateData& tail_1h = data[m_hashrateDataTail_1h];
-		const HashrateData& tail_24h = data[m_hashrateDataTail_24h];
-
-		hashes_15m = head.m_cumulativeHashes - tail_15m.m_cumulativeHashes;
-		dt_15m = static_cast<int64_t>(head.m_timestamp - tail_15m.m_timestamp);
-
-		hashes_1h = head.m_cumulativeHashes - tail_1h.m_cumulativeHashes;
-		dt_1h = static_cast<int64_t>(head.m_timestamp - tail_1h.m_timestamp);
-
-		hashes_24h = head.m_cumulativeHashes - tail_24h.m_cumulativeHashes;
-		dt_24h = static_cast<int64_t>(head.m_timestamp - tail_24h.m_timestamp);
+		MutexLock lock(m_foundSharesLock);
+		hashes_at_last_share = m_cumulativeHashesAtLastShare;
+		diff = m_cumulativeFoundSharesDiff;
+		shares_found = m_totalFoundShares;
 	}
 
-	const uint64_t hashrate_15m = (dt_15m > 0) ? (hashes_15m / dt_15m) : 0;
-	const uint64_t hashrate_1h  = (dt_1h  > 0) ? (hashes_1h  / dt_1h ) : 0;
-	const uint64_t hashrate_24h = (dt_24h > 0) ? (hashes_24h / dt_24h) : 0;
+	const uint64_t hashes_since_last_share = total_hashes - hashes_at_last_share;
 
 	double average_effort = 0.0;
-	const double diff = m_cumulativeFoundSharesDiff;
 	if (diff > 0.0) {
-		average_effort = static_cast<double>(m_cumulativeHashesAtLastShare) * 100.0 / diff;
+		average_effort = static_cast<double>(hashes_at_last_share) * 100.0 / diff;
 	}
 
+	uint32_t connections, incoming_connections;
+	count_connections(connections, incoming_connections);
+
 	LOGINFO(0, "status" <<
 		"\nHashrate (15m est) = " << log::Hashrate(hashrate_15m) <<
 		"\nHashrate (1h  est) = " << log::Hashrate(hashrate_1h) <<
 		"\nHashrate (24h est) = " << log::Hashrate(hashrate_24h) <<
 		"\nTotal hashes       = " << total_hashes <<
-		"\nShares found       = " << m_totalFoundShares <<
+		"\nShares found       = " << shares_found <<
 		"\nAverage effort     = " << average_effort << '%' <<
 		"\nCurrent effort     = " << static_cast<double>(hashes_since_last_share) * 100.0 / m_pool->side_chain().difficulty().to_double() << '%' <<
-		"\nConnections        = " << m_numConnections.load() << " (" << m_numIncomingConnections.load() << " incoming)"
+		"\nConnections        = " << connections << " (" << incoming_connections << " incoming)"
 	);
+
+	const uint32_t pending = m_numPendingPoWChecks;
+	const uint32_t batch_size = m_lastPoWBatchSize;
+	const uint64_t batch_time = m_lastPoWBatchTime;
+	LOGINFO(0, "PoW checks: " << pending << " queued, last batch checked " << batch_size << " shares in " << batch_time << " us");
+
+	const uint32_t target_rate = m_pool->params().m_stratumShareRate;
+	if (target_rate) {
+		const uint64_t cur_time = seconds_since_epoch();
+		uint64_t num_shares, dt;
+		m_shareRate.get(cur_time, 60, num_shares, dt);
+
+		const double rate = dt ? (static_cast<double>(num_shares) / dt) : 0.0;
+		const uint32_t k = m_diffMultiplier;
+		LOGINFO(0, "share rate " << rate << "/s (target " << target_rate << "/s), auto diff multiplier " << k << '%');
+	}
+
+	if (m_shards.size() > 1) {
+		for (size_t i = 0; i < m_shards.size(); ++i) {
+			const StratumServer* shard = m_shards[i];
+			const uint32_t n = shard->m_numConnections;
+			const uint32_t n_incoming = shard->m_numIncomingConnections;
+			const uint64_t jobs_sent = shard->m_numJobsSent;
+			LOGINFO(0, "event loop " << i << ": " << n << " connections (" << n_incoming << " incoming), " << jobs_sent << " jobs sent");
+		}
+	}
+}
+
+void StratumServer::count_connections(uint32_t& connections, uint32_t& incoming_connections) const
+{
+	connections = 0;
+	incoming_connections = 0;
+
+	for (const StratumServer* shard : m_shards) {
+		connections += shard->m_numConnections;
+		incoming_connections += shard->m_numIncomingConnections;
+	}
 }
 
 // Compresses 64-bit hashes value into 16-bit value (5 bits for shift, 11 bits for data)
@@ -642,8 +903,59 @@ void StratumServer::update_auto_diff(StratumClient* client, const uint64_t times
 	}
 }
 
+// Writes a job message for one client, everything after the target is the same for all clients and comes pre-rendered in job_suffix
+static size_t write_job(char* buf, size_t buf_size, const uint8_t* blob, size_t blob_size, uint32_t job_id, uint64_t target, const char* job_suffix, size_t job_suffix_size)
+{
+	static constexpr char prefix[] = "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"";
+	static constexpr char job_id_prefix[] = "\",\"job_id\":\"";
+	static constexpr char target_prefix[] = "\",\"target\":\"";
+
+	char job_id_hex[sizeof(job_id) * 2];
+	size_t job_id_size = 0;
+	do {
+		job_id_hex[sizeof(job_id_hex) - 1 - job_id_size] = "0123456789abcdef"[job_id & 15];
+		++job_id_size;
+		job_id >>= 4;
+	} while (job_id);
+
+	const size_t target_size = (target >= TARGET_4_BYTES_LIMIT) ? sizeof(uint32_t) : sizeof(uint64_t);
+
+	const size_t size = (sizeof(prefix) - 1) + blob_size * 2 + (sizeof(job_id_prefix) - 1) + job_id_size + (sizeof(target_prefix) - 1) + target_size * 2 + job_suffix_size;
+	if (size >= buf_size) {
+		return 0;
+	}
+
+	char* p = buf;
+
+	memcpy(p, prefix, sizeof(prefix) - 1);
+	p += sizeof(prefix) - 1;
+
+	to_hex(blob, blob_size, p);
+	p += blob_size * 2;
+
+	memcpy(p, job_id_prefix, sizeof(job_id_prefix) - 1);
+	p += sizeof(job_id_prefix) - 1;
+
+	memcpy(p, job_id_hex + sizeof(job_id_hex) - job_id_size, job_id_size);
+	p += job_id_size;
+
+	memcpy(p, target_prefix, sizeof(target_prefix) - 1);
+	p += sizeof(target_prefix) - 1;
+
+	// Short target format uses the upper 4 bytes
+	to_hex(reinterpret_cast<const uint8_t*>(&target) + sizeof(uint64_t) - target_size, target_size, p);
+	p += target_size * 2;
+
+	memcpy(p, job_suffix, job_suffix_size);
+	p += job_suffix_size;
+
+	return static_cast<size_t>(p - buf);
+}
+
 void StratumServer::on_blobs_ready()
 {
+	ScopedLatency latency(metrics::stratum_job_broadcast);
+
 	std::vector<BlobsData*> blobs_queue;
 	blobs_queue.reserve(2);
 
@@ -671,6 +983,16 @@ void StratumServer::on_blobs_ready()
 	size_t numClientsProcessed = 0;
 	uint32_t num_sent = 0;
 
+	const uint64_t diff_multiplier = m_main->m_diffMultiplier;
+
+	char job_suffix[256];
+	size_t job_suffix_size;
+	{
+		log::Stream s(job_suffix);
+		s << "\",\"algo\":\"rx/0\",\"height\":" << data->m_height << ",\"seed_hash\":\"" << data->m_seedHash << "\"}}\n";
+		job_suffix_size = s.m_pos;
+	}
+
 	const uint64_t cur_time = seconds_since_epoch();
 	{
 		MutexLock lock2(m_clientsListLock);
@@ -710,7 +1032,12 @@ void StratumServer::on_blobs_ready()
 						// More than 500% effort, reduce the auto diff by 1/8 every time until the share is found
 						client->m_autoDiff.lo = std::max<uint64_t>(client->m_autoDiff.lo - client->m_autoDiff.lo / 8, MIN_DIFF);
 					}
-					target = std::max(target, client->m_autoDiff.target());
+					difficulty_type diff = client->m_autoDiff;
+					if (diff_multiplier > MIN_DIFF_MULTIPLIER) {
+						// Share rate budget is exceeded, ask for fewer shares
+						diff.lo = (diff.lo < std::numeric_limits<uint64_t>::max() / diff_multiplier) ? (diff.lo * diff_multiplier / 100) : std::numeric_limits<uint64_t>::max();
+					}
+					target = std::max(target, diff.target());
 				}
 				else {
 					// Not enough shares from the client yet, cut diff in half every 16 seconds
@@ -735,23 +1062,9 @@ void StratumServer::on_blobs_ready()
 			}
 
 			const bool result = send(client,
-				[data, target, hashing_blob, &job_id](void* buf, size_t buf_size)
+				[data, target, hashing_blob, job_id, &job_suffix, job_suffix_size](void* buf, size_t buf_size)
 				{
-					log::hex_buf target_hex(reinterpret_cast<const uint8_t*>(&target), sizeof(uint64_t));
-
-					if (target >= TARGET_4_BYTES_LIMIT) {
-						target_hex.m_data += sizeof(uint32_t);
-						target_hex.m_size -= sizeof(uint32_t);
-					}
-
-					log::Stream s(buf, buf_size);
-					s << "{\"jsonrpc\":\"2.0\",\"method\":\"job\",\"params\":{\"blob\":\"";
-					s << log::hex_buf(hashing_blob, data->m_blobSize) << "\",\"job_id\":\"";
-					s << log::Hex(job_id) << "\",\"target\":\"";
-					s << target_hex << "\",\"algo\":\"rx/0\",\"height\":";
-					s << data->m_height << ",\"seed_hash\":\"";
-					s << data->m_seedHash << "\"}}\n";
-					return s.m_pos;
+					return write_job(reinterpret_cast<char*>(buf), buf_size, hashing_blob, data->m_blobSize, job_id, target, job_suffix, job_suffix_size);
 				});
 
 			if (result) {
@@ -768,47 +1081,97 @@ void StratumServer::on_blobs_ready()
 		}
 	}
 
+	m_numJobsSent += num_sent;
+
 	LOGINFO(3, "sent new job to " << num_sent << '/' << numClientsProcessed << " clients");
 }
 
-void StratumServer::update_hashrate_data(uint64_t hashes, uint64_t timestamp)
+void StratumServer::check_pow(p2pool* pool, SubmittedShare** shares, size_t count)
 {
-	constexpr size_t N = array_size(&StratumServer::m_hashrateData);
+	// Sort by template and extra_nonce: every blob is fetched only once and all hashes for one template are calculated back to back
+	std::sort(shares, shares + count,
+		[](const SubmittedShare* a, const SubmittedShare* b)
+		{
+			if (a->m_templateId != b->m_templateId) {
+				return a->m_templateId < b->m_templateId;
+			}
+			return a->m_extraNonce < b->m_extraNonce;
+		});
 
-	WriteLock lock(m_hashrateDataLock);
+	std::vector<uint8_t> blobs;
+	std::vector<SubmittedShare*> hashed_shares;
+	std::vector<hash> pow_hashes;
 
-	m_cumulativeHashes += hashes;
+	for (size_t i = 0; i < count;) {
+		const uint32_t template_id = shares[i]->m_templateId;
 
-	HashrateData* data = m_hashrateData;
-	HashrateData& head = data[m_hashrateDataHead];
-	if (head.m_timestamp == timestamp) {
-		head.m_cumulativeHashes = m_cumulativeHashes;
-	}
-	else {
-		m_hashrateDataHead = (m_hashrateDataHead + 1) % N;
-		data[m_hashrateDataHead] = { timestamp, m_cumulativeHashes };
-	}
+		uint8_t blob[128];
+		uint32_t blob_size = 0;
+		uint64_t height = 0;
+		difficulty_type difficulty;
+		difficulty_type sidechain_difficulty;
+		hash seed_hash;
+		size_t nonce_offset = 0;
 
-	while (data[m_hashrateDataTail_15m].m_timestamp + 15 * 60 < timestamp) {
-		m_hashrateDataTail_15m = (m_hashrateDataTail_15m + 1) % N;
-	}
+		blobs.clear();
+		hashed_shares.clear();
 
-	while (data[m_hashrateDataTail_1h].m_timestamp + 60 * 60 < timestamp) {
-		m_hashrateDataTail_1h = (m_hashrateDataTail_1h + 1) % N;
-	}
+		for (; (i < count) && (shares[i]->m_templateId == template_id); ++i) {
+			SubmittedShare* share = shares[i];
+
+			if (hashed_shares.empty() || (share->m_extraNonce != hashed_shares.back()->m_extraNonce)) {
+				blob_size = pool->block_template().get_hashing_blob(template_id, share->m_extraNonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
+			}
+
+			if (!blob_size) {
+				LOGWARN(4, "client " << static_cast<char*>(share->m_client->m_addrString) << " got a stale share");
+				share->m_result = SubmittedShare::Result::STALE;
+				continue;
+			}
+
+			const size_t k = blobs.size();
+			blobs.insert(blobs.end(), blob, blob + blob_size);
 
-	while (data[m_hashrateDataTail_24h].m_timestamp + 60 * 60 * 24 < timestamp) {
-		m_hashrateDataTail_24h = (m_hashrateDataTail_24h + 1) % N;
+			for (uint32_t j = 0, nonce = share->m_nonce; j < sizeof(share->m_nonce); ++j) {
+				blobs[k + nonce_offset + j] = nonce & 255;
+				nonce >>= 8;
+			}
+
+			hashed_shares.push_back(share);
+		}
+
+		if (hashed_shares.empty()) {
+			continue;
+		}
+
+		pow_hashes.resize(hashed_shares.size());
+
+		if (!pool->calculate_hashes(blobs.data(), blob_size, hashed_shares.size(), height, seed_hash, pow_hashes.data())) {
+			for (SubmittedShare* share : hashed_shares) {
+				LOGWARN(3, "client " << static_cast<char*>(share->m_client->m_addrString) << " couldn't check share PoW");
+				share->m_result = SubmittedShare::Result::COULDNT_CHECK_POW;
+			}
+			continue;
+		}
+
+		for (size_t j = 0; j < hashed_shares.size(); ++j) {
+			SubmittedShare* share = hashed_shares[j];
+
+			if (pow_hashes[j] != share->m_resultHash) {
+				LOGWARN(4, "client " << static_cast<char*>(share->m_client->m_addrString) << " submitted a share with invalid PoW");
+				share->m_result = SubmittedShare::Result::INVALID_POW;
+				share->m_client->m_score += BAD_SHARE_POINTS;
+				continue;
+			}
+
+			share->m_sidechainDifficulty = sidechain_difficulty;
+			share->m_result = SubmittedShare::Result::OK;
+		}
 	}
 }
 
-void StratumServer::on_share_found(uv_work_t* req)
+void StratumServer::process_share(SubmittedShare* share)
 {
-	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
-	if (share->m_highEnoughDifficulty) {
-		bkg_jobs_tracker.start("StratumServer::on_share_found");
-	}
-
 	StratumClient* client = share->m_client;
 	StratumServer* server = share->m_server;
 	p2pool* pool = server->m_pool;
@@ -816,55 +1179,40 @@ void StratumServer::on_share_found(uv_work_t* req)
 	const uint64_t target = share->m_target;
 	const uint64_t hashes = share->m_hashes;
 
+	server->m_main->m_shareRate.add(share->m_timestamp, 1);
+
 	if (pool->stopped()) {
 		LOGWARN(0, "p2pool is shutting down, but a share was found. Trying to process it anyway!");
 	}
 
 	if (share->m_highEnoughDifficulty) {
-		uint8_t blob[128];
-		uint64_t height;
-		difficulty_type difficulty;
-		difficulty_type sidechain_difficulty;
-		hash seed_hash;
-		size_t nonce_offset;
-
-		const uint32_t blob_size = pool->block_template().get_hashing_blob(share->m_templateId, share->m_extraNonce, blob, height, difficulty, sidechain_difficulty, seed_hash, nonce_offset);
-		if (!blob_size) {
-			LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " got a stale share");
-			share->m_result = SubmittedShare::Result::STALE;
+		// PoW was checked in check_pow()
+		if (share->m_result != SubmittedShare::Result::OK) {
 			return;
 		}
 
-		for (uint32_t i = 0, nonce = share->m_nonce; i < sizeof(share->m_nonce); ++i) {
-			blob[nonce_offset + i] = nonce & 255;
-			nonce >>= 8;
-		}
-
-		hash pow_hash;
-		if (!pool->calculate_hash(blob, blob_size, height, seed_hash, pow_hash)) {
-			LOGWARN(3, "client " << static_cast<char*>(client->m_addrString) << " couldn't check share PoW");
-			share->m_result = SubmittedShare::Result::COULDNT_CHECK_POW;
-			return;
-		}
+		client->m_score += GOOD_SHARE_POINTS;
 
-		if (pow_hash != share->m_resultHash) {
-			LOGWARN(4, "client " << static_cast<char*>(client->m_addrString) << " submitted a share with invalid PoW");
-			share->m_result = SubmittedShare::Result::INVALID_POW;
-			client->m_score += BAD_SHARE_POINTS;
-			return;
-		}
+		{
+			// Shares can be found in several event loops at the same time
+			StratumServer* main = server->m_main;
+			MutexLock lock(main->m_foundSharesLock);
 
-		client->m_score += GOOD_SHARE_POINTS;
+			const uint64_t n = main->m_hashrate.total_hashes() + hashes;
+			const double diff = share->m_sidechainDifficulty.to_double();
+			share->m_effort = static_cast<double>(n - main->m_cumulativeHashesAtLastShare) * 100.0 / diff;
+			main->m_cumulativeHashesAtLastShare = n;
 
-		const uint64_t n = server->m_cumulativeHashes + hashes;
-		const double diff = sidechain_difficulty.to_double();
-		share->m_effort = static_cast<double>(n - server->m_cumulativeHashesAtLastShare) * 100.0 / diff;
-		server->m_cumulativeHashesAtLastShare = n;
+			main->m_cumulativeFoundSharesDiff += diff;
+			++main->m_totalFoundShares;
+		}
 
-		server->m_cumulativeFoundSharesDiff += diff;
-		++server->m_totalFoundShares;
+		const hash id = pool->submit_sidechain_block(share->m_templateId, share->m_nonce, share->m_extraNonce);
 
-		pool->submit_sidechain_block(share->m_templateId, share->m_nonce, share->m_extraNonce);
+		// From receiving the share to having a new sidechain block in the chain
+		if (trace::enabled) {
+			trace::add_span("StratumServer::on_share_found", id, share->m_receivedTime, trace::clock::now());
+		}
 	}
 
 	// Send the response to miner
@@ -872,8 +1220,9 @@ void StratumServer::on_share_found(uv_work_t* req)
 
 	if (LIKELY(value < target)) {
 		const uint64_t timestamp = share->m_timestamp;
-		server->update_hashrate_data(hashes, timestamp);
-		server->api_update_local_stats(timestamp);
+		server->m_main->m_hashrate.add(timestamp, hashes);
+		client->m_hashrate.add(timestamp, hashes);
+		server->m_main->api_update_local_stats(timestamp);
 		share->m_result = SubmittedShare::Result::OK;
 	}
 	else {
@@ -883,6 +1232,84 @@ void StratumServer::on_share_found(uv_work_t* req)
 	}
 }
 
+void StratumServer::on_share_found(uv_work_t* req)
+{
+	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
+	if (share->m_highEnoughDifficulty) {
+		bkg_jobs_tracker.start("StratumServer::on_share_found");
+		check_pow(share->m_server->m_pool, &share, 1);
+	}
+
+	process_share(share);
+}
+
+void StratumServer::start_share_batches()
+{
+	const uint32_t max_batches = std::max(work_lane_threads(WorkLane::POW), 1U);
+
+	while (!m_pendingShares.empty() && (m_numShareBatchesInProgress < max_batches)) {
+		ShareBatch* batch = new ShareBatch{ {}, this, {} };
+		batch->m_req.data = batch;
+
+		// Oldest shares go first
+		const size_t n = std::min<size_t>(m_pendingShares.size(), MAX_SHARE_BATCH_SIZE);
+		batch->m_shares.assign(m_pendingShares.begin(), m_pendingShares.begin() + n);
+		m_pendingShares.erase(m_pendingShares.begin(), m_pendingShares.begin() + n);
+
+		++m_numShareBatchesInProgress;
+
+		const int err = uv_queue_work_lane(&m_loop, WorkLane::POW, &batch->m_req, on_share_batch, on_after_share_batch);
+		if (err) {
+			LOGERR(1, "uv_queue_work failed, error " << uv_err_name(err));
+
+			// If uv_queue_work failed, process these shares here anyway
+			// on_after_share_batch() starts the next batch itself
+			on_share_batch(&batch->m_req);
+			on_after_share_batch(&batch->m_req, 0);
+			return;
+		}
+	}
+}
+
+void StratumServer::on_share_batch(uv_work_t* req)
+{
+	ShareBatch* batch = reinterpret_cast<ShareBatch*>(req->data);
+	std::vector<SubmittedShare*>& shares = batch->m_shares;
+
+	for (size_t i = 0; i < shares.size(); ++i) {
+		bkg_jobs_tracker.start("StratumServer::on_share_found");
+	}
+
+	using namespace std::chrono;
+	const high_resolution_clock::time_point start_time = high_resolution_clock::now();
+
+	check_pow(batch->m_server->m_pool, shares.data(), shares.size());
+
+	StratumServer* main = batch->m_server->m_main;
+	main->m_lastPoWBatchSize = static_cast<uint32_t>(shares.size());
+	main->m_lastPoWBatchTime = duration_cast<microseconds>(high_resolution_clock::now() - start_time).count();
+
+	for (SubmittedShare* share : shares) {
+		process_share(share);
+	}
+}
+
+void StratumServer::on_after_share_batch(uv_work_t* req, int /*status*/)
+{
+	ShareBatch* batch = reinterpret_cast<ShareBatch*>(req->data);
+	StratumServer* server = batch->m_server;
+
+	for (SubmittedShare* share : batch->m_shares) {
+		on_after_share_found(&share->m_req, 0);
+	}
+
+	server->m_main->m_numPendingPoWChecks -= static_cast<uint32_t>(batch->m_shares.size());
+	--server->m_numShareBatchesInProgress;
+	delete batch;
+
+	server->start_share_batches();
+}
+
 void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 {
 	SubmittedShare* share = reinterpret_cast<SubmittedShare*>(req->data);
@@ -896,6 +1323,11 @@ void StratumServer::on_after_share_found(uv_work_t* req, int /*status*/)
 
 	ON_SCOPE_LEAVE([share]() { share->m_server->m_submittedSharesPool.push_back(share); });
 
+	metrics::share_check.add(std::chrono::high_resolution_clock::now() - share->m_receivedTime);
+	if (share->m_result == SubmittedShare::Result::STALE) {
+		metrics::stale_shares.add();
+	}
+
 	StratumServer* server = share->m_server;
 
 	const bool bad_share = (share->m_result == SubmittedShare::Result::LOW_DIFF) || (share->m_result == SubmittedShare::Result::INVALID_POW);
@@ -976,6 +1408,8 @@ void StratumServer::StratumClient::reset()
 	m_customUser[0] = '\0';
 
 	m_score = 0;
+
+	m_hashrate.reset();
 }
 
 bool StratumServer::StratumClient::on_connect()
@@ -986,6 +1420,8 @@ bool StratumServer::StratumClient::on_connect()
 
 bool StratumServer::StratumClient::on_read(char* data, uint32_t size)
 {
+	AllocationTag tag(alloc_profiler::Tag::STRATUM);
+
 	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
 		LOGERR(1, "client: invalid data pointer or size in on_read()");
 		ban(DEFAULT_BAN_TIME);
@@ -1054,15 +1490,15 @@ bool StratumServer::StratumClient::process_request(char* data, uint32_t /*size*/
 
 	const char* s = method.GetString();
 	if (strcmp(s, "login") == 0) {
-		LOGINFO(6, "incoming login from " << log::Gray() << static_cast<char*>(m_addrString));
+		LOGINFO_FMT(6, "incoming login from {}{}", log::Gray(), static_cast<char*>(m_addrString));
 		return process_login(doc, id.GetUint());
 	}
 	else if (strcmp(s, "submit") == 0) {
-		LOGINFO(6, "incoming share from " << log::Gray() << static_cast<char*>(m_addrString));
+		LOGINFO_FMT(6, "incoming share from {}{}", log::Gray(), static_cast<char*>(m_addrString));
 		return process_submit(doc, id.GetUint());
 	}
 	else if (strcmp(s, "keepalived") == 0) {
-		LOGINFO(6, "incoming keepalive from " << log::Gray() << static_cast<char*>(m_addrString));
+		LOGINFO_FMT(6, "incoming keepalive from {}{}", log::Gray(), static_cast<char*>(m_addrString));
 		return true;
 	}
 
@@ -1180,49 +1616,34 @@ void StratumServer::api_update_local_stats(uint64_t timestamp)
 
 	m_apiLastUpdateTime = timestamp;
 
-	uint64_t hashes_15m, hashes_1h, hashes_24h, total_hashes;
-	int64_t dt_15m, dt_1h, dt_24h;
+	const uint64_t cur_time = seconds_since_epoch();
 
-	uint64_t hashes_since_last_share;
+	const uint64_t hashrate_15m = m_hashrate.hashrate(cur_time, 15 * 60);
+	const uint64_t hashrate_1h  = m_hashrate.hashrate(cur_time, 60 * 60);
+	const uint64_t hashrate_24h = m_hashrate.hashrate(cur_time, 60 * 60 * 24);
+	const uint64_t total_hashes = m_hashrate.total_hashes();
 
+	uint64_t hashes_at_last_share;
+	double diff;
+	uint32_t shares_found;
 	{
-		ReadLock lock(m_hashrateDataLock);
-
-		total_hashes = m_cumulativeHashes;
-		hashes_since_last_share = m_cumulativeHashes - m_cumulativeHashesAtLastShare;
-
-		const HashrateData* data = m_hashrateData;
-		const HashrateData& head = data[m_hashrateDataHead];
-		const HashrateData& tail_15m = data[m_hashrateDataTail_15m];
-		const HashrateData& tail_1h = data[m_hashrateDataTail_1h];
-		const HashrateData& tail_24h = data[m_hashrateDataTail_24h];
-
-		hashes_15m = head.m_cumulativeHashes - tail_15m.m_cumulativeHashes;
-		dt_15m = static_cast<int64_t>(head.m_timestamp - tail_15m.m_timestamp);
-
-		hashes_1h = head.m_cumulativeHashes - tail_1h.m_cumulativeHashes;
-		dt_1h = static_cast<int64_t>(head.m_timestamp - tail_1h.m_timestamp);
-
-		hashes_24h = head.m_cumulativeHashes - tail_24h.m_cumulativeHashes;
-		dt_24h = static_cast<int64_t>(head.m_timestamp - tail_24h.m_timestamp);
+		MutexLock lock(m_foundSharesLock);
+		hashes_at_last_share = m_cumulativeHashesAtLastShare;
+		diff = m_cumulativeFoundSharesDiff;
+		shares_found = m_totalFoundShares;
 	}
 
-	const uint64_t hashrate_15m = (dt_15m > 0) ? (hashes_15m / dt_15m) : 0;
-	const uint64_t hashrate_1h  = (dt_1h  > 0) ? (hashes_1h  / dt_1h ) : 0;
-	const uint64_t hashrate_24h = (dt_24h > 0) ? (hashes_24h / dt_24h) : 0;
+	const uint64_t hashes_since_last_share = total_hashes - hashes_at_last_share;
 
 	double average_effort = 0.0;
-	const double diff = m_cumulativeFoundSharesDiff;
 	if (diff > 0.0) {
-		average_effort = static_cast<double>(m_cumulativeHashesAtLastShare) * 100.0 / diff;
+		average_effort = static_cast<double>(hashes_at_last_share) * 100.0 / diff;
 	}
 
-	int shares_found = m_totalFoundShares;
-
 	double current_effort = static_cast<double>(hashes_since_last_share) * 100.0 / m_pool->side_chain().difficulty().to_double();
 
-	int connections = m_numConnections;
-	int incoming_connections = m_numIncomingConnections;
+	uint32_t connections, incoming_connections;
+	count_connections(connections, incoming_connections);
 
 	m_pool->api()->set(p2pool_api::Category::LOCAL, "stats",
 		[hashrate_15m, hashrate_1h, hashrate_24h, total_hashes, shares_found, average_effort, current_effort, connections, incoming_connections](log::Stream& s)
@@ -19,6 +19,7 @@
 
 #include "tcp_server.h"
 #include <rapidjson/document.h>
+#include <memory>
 
 namespace p2pool {
 
@@ -80,6 +81,9 @@ public:
 		char m_customUser[32];
 
 		int32_t m_score;
+
+		// 1 minute buckets for the last 15 minutes
+		HashrateCounter<60, 16> m_hashrate;
 	};
 
 	bool on_login(StratumClient* client, uint32_t id, const char* login);
@@ -91,13 +95,47 @@ public:
 
 	void reset_share_counters();
 
+	void ban(const raw_ip& ip, uint64_t seconds) override;
+
 private:
+	// Additional event loop (--stratum-threads) which accepts its own connections on the same port
+	StratumServer(p2pool* pool, StratumServer* main);
+
+	void init();
+	bool is_banned(const raw_ip& ip) override;
+
+	// Shared state (extra_nonce, RNG, hashrate and share counters, bans) lives in the main server
+	StratumServer* m_main;
+
+	// All event loops including this one, only filled in the main server
+	std::vector<StratumServer*> m_shards;
+	std::atomic<uint64_t> m_numJobsSent;
+
+	// Share rate budget (--stratum-share-rate), auto diff of all clients is multiplied by m_diffMultiplier percent
+	HashrateCounter<1, 61> m_shareRate;
+	std::atomic<uint32_t> m_diffMultiplier;
+	std::atomic<uint32_t> m_numPendingPoWChecks;
+	std::atomic<uint32_t> m_lastPoWBatchSize;
+	std::atomic<uint64_t> m_lastPoWBatchTime;
+
+	void update_share_rate_budget(uint64_t cur_time);
+
 	void print_stratum_status() const;
+	void count_connections(uint32_t& connections, uint32_t& incoming_connections) const;
 	void update_auto_diff(StratumClient* client, const uint64_t timestamp, const uint64_t hashes);
 
+	struct SubmittedShare;
+
+	static void check_pow(p2pool* pool, SubmittedShare** shares, size_t count);
+	static void process_share(SubmittedShare* share);
+
 	static void on_share_found(uv_work_t* req);
 	static void on_after_share_found(uv_work_t* req, int status);
 
+	void start_share_batches();
+	static void on_share_batch(uv_work_t* req);
+	static void on_after_share_batch(uv_work_t* req, int status);
+
 	p2pool* m_pool;
 	bool m_autoDiff;
 
@@ -117,6 +155,27 @@ private:
 	uv_async_t m_blobsAsync;
 	std::vector<BlobsData*> m_blobsQueue;
 
+	void queue_blobs(BlobsData* blobs_data);
+
+	// Read-only after it's published, except for m_next
+	struct LoginBlobs
+	{
+		uint32_t m_extraNonceStart;
+		uint32_t m_count;
+		std::vector<uint8_t> m_blobs;
+		size_t m_blobSize;
+		uint64_t m_height;
+		difficulty_type m_difficulty;
+		difficulty_type m_sidechainDifficulty;
+		hash m_seedHash;
+		uint32_t m_templateId;
+		mutable std::atomic<uint32_t> m_next;
+	};
+
+	std::shared_ptr<const LoginBlobs> m_loginBlobs;
+
+	void publish_login_blobs(BlobsData* blobs_data, uint32_t num_connections, const difficulty_type& difficulty, const difficulty_type& sidechain_difficulty);
+
 	static void on_blobs_ready(uv_async_t* handle) { reinterpret_cast<StratumServer*>(handle->data)->on_blobs_ready(); }
 	void on_blobs_ready();
 
@@ -143,6 +202,7 @@ private:
 		uint64_t m_mainchainHeight;
 		double m_effort;
 		uint64_t m_timestamp;
+		std::chrono::high_resolution_clock::time_point m_receivedTime;
 		uint64_t m_hashes;
 		bool m_highEnoughDifficulty;
 
@@ -157,28 +217,30 @@ private:
 
 	std::vector<SubmittedShare*> m_submittedSharesPool;
 
-	struct HashrateData
+	// Shares waiting for PoW check, they're checked in one worker thread job per batch
+	// Up to one batch per PoW lane thread is in flight, so a burst of shares is spread over all of them
+	struct ShareBatch
 	{
-		uint64_t m_timestamp;
-		uint64_t m_cumulativeHashes;
+		uv_work_t m_req;
+		StratumServer* m_server;
+		std::vector<SubmittedShare*> m_shares;
 	};
 
-	mutable uv_rwlock_t m_hashrateDataLock;
+	enum { MAX_SHARE_BATCH_SIZE = 8 };
 
-	HashrateData m_hashrateData[131072];
-	uint64_t m_cumulativeHashes;
-	uint64_t m_cumulativeHashesAtLastShare;
-	uint64_t m_hashrateDataHead;
-	uint64_t m_hashrateDataTail_15m;
-	uint64_t m_hashrateDataTail_1h;
-	uint64_t m_hashrateDataTail_24h;
+	std::vector<SubmittedShare*> m_pendingShares;
+	uint32_t m_numShareBatchesInProgress;
+
+	// 10 second buckets for the last 24 hours
+	HashrateCounter<10, 24 * 60 * 6 + 1> m_hashrate;
 
+	mutable uv_mutex_t m_foundSharesLock;
+	uint64_t m_cumulativeHashesAtLastShare;
 	double m_cumulativeFoundSharesDiff;
 	uint32_t m_totalFoundShares;
 
 	uint64_t m_apiLastUpdateTime;
 
-	void update_hashrate_data(uint64_t hashes, uint64_t timestamp);
 	void api_update_local_stats(uint64_t timestamp);
 
 	void on_shutdown() override;
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "uv_util.h"
+#include <memory>
 
 namespace p2pool {
 
@@ -47,7 +48,7 @@ public:
 	bool connect_to_peer(bool is_v6, const raw_ip& ip, int port);
 	virtual void on_connect_failed(bool /*is_v6*/, const raw_ip& /*ip*/, int /*port*/) {}
 
-	void ban(const raw_ip& ip, uint64_t seconds);
+	virtual void ban(const raw_ip& ip, uint64_t seconds);
 	virtual void print_bans();
 
 	struct Client
@@ -100,11 +101,15 @@ public:
 		std::atomic<uint32_t> m_resetCounter;
 	};
 
+	// Immutable data which can be sent to many clients without copying, it's kept alive until all writes using it are finished
+	typedef std::shared_ptr<const std::vector<uint8_t>> SharedBuf;
+
 	struct WriteBuf
 	{
 		Client* m_client = nullptr;
 		uv_write_t m_write = {};
 		std::vector<uint8_t> m_data;
+		SharedBuf m_sharedData;
 	};
 
 	std::vector<WriteBuf*> m_writeBuffers;
@@ -130,6 +135,9 @@ public:
 	template<typename T>
 	FORCEINLINE bool send(Client* client, T&& callback) { return send_internal(client, SendCallback<T>(std::move(callback))); }
 
+	// Sends a small header followed by the shared data
+	bool send(Client* client, const uint8_t* header, size_t header_size, const SharedBuf& data);
+
 private:
 	static void loop(void* data);
 	static void on_new_connection(uv_stream_t* server, int status);
@@ -142,6 +150,10 @@ private:
 	bool connect_to_peer(Client* client);
 
 	bool send_internal(Client* client, SendCallbackBase&& callback);
+	bool write(Client* client, const uint8_t* data, size_t size, const SharedBuf& shared_data);
+
+	// Used only in this server's event loop thread
+	uint8_t m_callbackBuf[WRITE_BUF_SIZE];
 
 	allocate_client_callback m_allocateNewClient;
 
@@ -152,7 +164,12 @@ private:
 	uv_thread_t m_loopThread;
 
 protected:
-	void start_listening(const std::string& listen_addresses);
+	// reuse_port = true lets several servers (each with its own event loop) listen on the same addresses, the kernel balances incoming connections between them
+	void start_listening(const std::string& listen_addresses, bool reuse_port = false);
+
+	// For servers which only make outgoing connections, start_listening() calls it too
+	void start_event_loop();
+	static bool reuse_port_supported();
 
 	std::string m_socks5Proxy;
 	bool m_socks5ProxyV6;
@@ -174,7 +191,7 @@ protected:
 	uv_mutex_t m_bansLock;
 	unordered_map<raw_ip, std::chrono::steady_clock::time_point> m_bans;
 
-	bool is_banned(const raw_ip& ip);
+	virtual bool is_banned(const raw_ip& ip);
 
 	unordered_set<raw_ip> m_pendingConnections;
 
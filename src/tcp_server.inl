@@ -19,6 +19,13 @@
 
 static thread_local bool server_event_loop_thread = false;
 
+// Only these platforms balance incoming connections between sockets sharing the same port
+#if defined(__linux__) && defined(SO_REUSEPORT)
+#define TCP_SERVER_REUSEPORT SO_REUSEPORT
+#elif defined(SO_REUSEPORT_LB)
+#define TCP_SERVER_REUSEPORT SO_REUSEPORT_LB
+#endif
+
 namespace p2pool {
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
@@ -126,7 +133,17 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::parse_address_list(const std::str
 }
 
 template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
-void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string& listen_addresses)
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::reuse_port_supported()
+{
+#ifdef TCP_SERVER_REUSEPORT
+	return true;
+#else
+	return false;
+#endif
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string& listen_addresses, bool reuse_port)
 {
 	if (listen_addresses.empty()) {
 		LOGERR(1, "listen address not set");
@@ -134,7 +151,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 	}
 
 	parse_address_list(listen_addresses,
-		[this](bool is_v6, const std::string& address, const std::string& ip, int port)
+		[this, reuse_port](bool is_v6, const std::string& address, const std::string& ip, int port)
 		{
 			if (m_listenPort < 0) {
 				m_listenPort = port;
@@ -153,13 +170,29 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 				m_listenSockets.push_back(socket);
 			}
 
-			int err = uv_tcp_init(&m_loop, socket);
+			// The socket must be created before bind() to set SO_REUSEPORT on it
+			int err = reuse_port ? uv_tcp_init_ex(&m_loop, socket, is_v6 ? AF_INET6 : AF_INET) : uv_tcp_init(&m_loop, socket);
 			if (err) {
 				LOGERR(1, "failed to create tcp server handle, error " << uv_err_name(err));
 				panic();
 			}
 			socket->data = this;
 
+			if (reuse_port) {
+#ifdef TCP_SERVER_REUSEPORT
+				uv_os_fd_t fd;
+				const int one = 1;
+				err = uv_fileno(reinterpret_cast<uv_handle_t*>(socket), &fd);
+				if (err || setsockopt(fd, SOL_SOCKET, TCP_SERVER_REUSEPORT, &one, sizeof(one))) {
+					LOGERR(1, "failed to set SO_REUSEPORT on tcp server handle");
+					panic();
+				}
+#else
+				LOGERR(1, "SO_REUSEPORT is not supported on this platform");
+				panic();
+#endif
+			}
+
 			err = uv_tcp_nodelay(socket, 1);
 			if (err) {
 				LOGERR(1, "failed to set tcp_nodelay on tcp server handle, error " << uv_err_name(err));
@@ -204,6 +237,12 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_listening(const std::string
 			LOGINFO(1, "listening on " << log::Gray() << address);
 		});
 
+	start_event_loop();
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::start_event_loop()
+{
 	const int err = uv_thread_create(&m_loopThread, loop, this);
 	if (err) {
 		LOGERR(1, "failed to start event loop thread, error " << uv_err_name(err));
@@ -379,7 +418,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::connect_to_peer(Client* client)
 		return false;
 	}
 	else {
-		LOGINFO(5, "connecting to " << log::Gray() << static_cast<const char*>(client->m_addrString));
+		LOGINFO_FMT(5, "connecting to {}{}", log::Gray(), static_cast<const char*>(client->m_addrString));
 	}
 
 	return true;
@@ -519,19 +558,7 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, Sen
 		return true;
 	}
 
-	WriteBuf* buf;
-
-	if (!m_writeBuffers.empty()) {
-		buf = m_writeBuffers.back();
-		m_writeBuffers.pop_back();
-	}
-	else {
-		buf = new WriteBuf();
-	}
-
-	// callback_buf is used in only 1 thread, so it's safe
-	static uint8_t callback_buf[WRITE_BUF_SIZE];
-	const size_t bytes_written = callback(callback_buf, sizeof(callback_buf));
+	const size_t bytes_written = callback(m_callbackBuf, sizeof(m_callbackBuf));
 
 	if (bytes_written > WRITE_BUF_SIZE) {
 		LOGERR(0, "send callback wrote " << bytes_written << " bytes, expected no more than " << WRITE_BUF_SIZE << " bytes");
@@ -540,22 +567,104 @@ bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send_internal(Client* client, Sen
 
 	if (bytes_written == 0) {
 		LOGWARN(1, "send callback wrote 0 bytes, nothing to do");
-		m_writeBuffers.push_back(buf);
 		return true;
 	}
 
+	return write(client, m_callbackBuf, bytes_written, SharedBuf());
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::send(Client* client, const uint8_t* header, size_t header_size, const SharedBuf& data)
+{
+	if (!server_event_loop_thread) {
+		LOGERR(1, "sending data from another thread, this is not thread safe");
+	}
+
+	if (client->m_isClosing) {
+		LOGWARN(5, "client " << static_cast<const char*>(client->m_addrString) << " is being disconnected, can't send any more data");
+		return true;
+	}
+
+	if ((header_size == 0) && (!data || data->empty())) {
+		LOGWARN(1, "nothing to send");
+		return true;
+	}
+
+	return write(client, header, header_size, data);
+}
+
+template<size_t READ_BUF_SIZE, size_t WRITE_BUF_SIZE>
+bool TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::write(Client* client, const uint8_t* data, size_t size, const SharedBuf& shared_data)
+{
+	uv_stream_t* stream = reinterpret_cast<uv_stream_t*>(&client->m_socket);
+
+	const size_t shared_size = shared_data ? shared_data->size() : 0;
+
+	if (size + shared_size == 0) {
+		return true;
+	}
+
+	uv_buf_t bufs[2] = {};
+	uint32_t num_bufs = 0;
+
+	if (size) {
+		bufs[num_bufs++] = uv_buf_init(reinterpret_cast<char*>(const_cast<uint8_t*>(data)), static_cast<uint32_t>(size));
+	}
+	if (shared_size) {
+		bufs[num_bufs++] = uv_buf_init(reinterpret_cast<char*>(const_cast<uint8_t*>(shared_data->data())), static_cast<uint32_t>(shared_size));
+	}
+
+	// Try to send everything right away, it doesn't need a copy of the data
+	// uv_try_write returns UV_EAGAIN if there are other writes queued for this client, so the order of messages is preserved
+	size_t sent = 0;
+
+	const int result = uv_try_write(stream, bufs, num_bufs);
+	if (result >= 0) {
+		sent = static_cast<size_t>(result);
+		if (sent >= size + shared_size) {
+			return true;
+		}
+	}
+	else if ((result != UV_EAGAIN) && (result != UV_ENOSYS)) {
+		LOGWARN(5, "failed to write data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(result));
+		return false;
+	}
+
+	WriteBuf* buf;
+
+	if (!m_writeBuffers.empty()) {
+		buf = m_writeBuffers.back();
+		m_writeBuffers.pop_back();
+	}
+	else {
+		buf = new WriteBuf();
+	}
+
 	buf->m_client = client;
 	buf->m_write.data = buf;
-	buf->m_data.reserve(round_up(bytes_written, 64));
-	buf->m_data.assign(callback_buf, callback_buf + bytes_written);
 
-	uv_buf_t bufs[1];
-	bufs[0].base = reinterpret_cast<char*>(buf->m_data.data());
-	bufs[0].len = static_cast<int>(bytes_written);
+	// Only what wasn't sent yet is queued: the unsent part of the temporary data is copied, the shared data is referenced
+	num_bufs = 0;
 
-	const int err = uv_write(&buf->m_write, reinterpret_cast<uv_stream_t*>(&client->m_socket), bufs, 1, Client::on_write);
+	if (sent < size) {
+		buf->m_data.reserve(round_up(size - sent, 64));
+		buf->m_data.assign(data + sent, data + size);
+		bufs[num_bufs++] = uv_buf_init(reinterpret_cast<char*>(buf->m_data.data()), static_cast<uint32_t>(size - sent));
+		sent = 0;
+	}
+	else {
+		sent -= size;
+	}
+
+	if (sent < shared_size) {
+		buf->m_sharedData = shared_data;
+		bufs[num_bufs++] = uv_buf_init(reinterpret_cast<char*>(const_cast<uint8_t*>(shared_data->data() + sent)), static_cast<uint32_t>(shared_size - sent));
+	}
+
+	const int err = uv_write(&buf->m_write, stream, bufs, num_bufs, Client::on_write);
 	if (err) {
 		LOGWARN(1, "failed to start writing data to client connection " << static_cast<const char*>(client->m_addrString) << ", error " << uv_err_name(err));
+		buf->m_sharedData.reset();
 		m_writeBuffers.push_back(buf);
 		return false;
 	}
@@ -624,7 +733,7 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_connection_close(uv_handle_t*
 	Client* client = static_cast<Client*>(handle->data);
 	TCPServer* owner = client->m_owner;
 
-	LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " disconnected");
+	LOGINFO_FMT(5, "peer {}{}{} disconnected", log::Gray(), static_cast<char*>(client->m_addrString), log::NoColor());
 
 	if (owner) {
 		MutexLock lock(owner->m_clientsListLock);
@@ -773,10 +882,10 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::on_new_client(uv_stream_t* server
 		client->init_addr_string();
 	}
 
-	LOGINFO(5, "new connection " << (client->m_isIncoming ? "from " : "to ") << log::Gray() << static_cast<char*>(client->m_addrString));
+	LOGINFO_FMT(5, "new connection {}{}{}", (client->m_isIncoming ? "from " : "to "), log::Gray(), static_cast<char*>(client->m_addrString));
 
 	if (is_banned(client->m_addr)) {
-		LOGINFO(5, "peer " << log::Gray() << static_cast<char*>(client->m_addrString) << log::NoColor() << " is banned, disconnecting");
+		LOGINFO_FMT(5, "peer {}{}{} is banned, disconnecting", log::Gray(), static_cast<char*>(client->m_addrString), log::NoColor());
 		client->close();
 		return;
 	}
@@ -1057,6 +1166,8 @@ void TCPServer<READ_BUF_SIZE, WRITE_BUF_SIZE>::Client::on_write(uv_write_t* req,
 	Client* client = buf->m_client;
 	TCPServer* server = client->m_owner;
 
+	buf->m_sharedData.reset();
+
 	if (server) {
 		server->m_writeBuffers.push_back(buf);
 	}
@@ -0,0 +1,167 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "trace.h"
+#include "uv_util.h"
+#include <fstream>
+
+static constexpr char log_category_prefix[] = "Trace ";
+
+namespace p2pool {
+
+namespace trace {
+
+bool enabled = false;
+
+struct Event
+{
+	const char* m_name;
+	hash m_id;
+	uint64_t m_start;
+	uint64_t m_duration;
+	uint32_t m_threadId;
+};
+
+static uint32_t sample_rate = 1;
+
+static uv_mutex_t events_lock;
+static std::vector<Event> events;
+
+// Held while writing to the file, so events are written in the order they were flushed
+static uv_mutex_t file_lock;
+static std::ofstream file;
+static bool first_event = true;
+
+static std::atomic<uint32_t> thread_counter{ 0 };
+static thread_local uint32_t thread_id = 0;
+
+static uint64_t to_us(clock::time_point t)
+{
+	return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count());
+}
+
+void init(const std::string& file_name, uint32_t rate)
+{
+	if (file_name.empty()) {
+		return;
+	}
+
+	file.open(file_name, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		LOGERR(1, "failed to open " << file_name);
+		return;
+	}
+
+	uv_mutex_init_checked(&events_lock);
+	uv_mutex_init_checked(&file_lock);
+
+	file << "[\n";
+
+	sample_rate = std::max(rate, 1U);
+	enabled = true;
+
+	LOGINFO(1, "writing traces for 1 in " << sample_rate << " blocks to " << file_name);
+}
+
+void flush()
+{
+	if (!enabled) {
+		return;
+	}
+
+	std::vector<Event> tmp;
+	{
+		MutexLock lock(events_lock);
+		tmp.swap(events);
+	}
+
+	MutexLock lock(file_lock);
+
+	if (!file.is_open() || tmp.empty()) {
+		return;
+	}
+
+	for (const Event& e : tmp) {
+		char buf[log::Stream::BUF_SIZE + 1];
+		log::Stream s(buf);
+
+		if (!first_event) {
+			s << ",\n";
+		}
+		first_event = false;
+
+		s << "{\"name\":\"" << e.m_name
+			<< "\",\"cat\":\"block\",\"ph\":\"X\",\"ts\":" << e.m_start
+			<< ",\"dur\":" << e.m_duration
+			<< ",\"pid\":1,\"tid\":" << e.m_threadId
+			<< ",\"args\":{\"id\":\"" << e.m_id << "\"}}";
+
+		file.write(buf, s.m_pos);
+	}
+
+	file.flush();
+}
+
+void stop()
+{
+	if (!enabled) {
+		return;
+	}
+
+	flush();
+	enabled = false;
+
+	MutexLock lock(file_lock);
+
+	if (file.is_open()) {
+		file << "\n]\n";
+		file.close();
+	}
+}
+
+bool sampled(const hash& id)
+{
+	if (id.empty()) {
+		return false;
+	}
+
+	uint64_t k;
+	memcpy(&k, id.h, sizeof(k));
+	return (k % sample_rate) == 0;
+}
+
+void add_span(const char* name, const hash& id, clock::time_point start, clock::time_point end)
+{
+	if (!enabled || !sampled(id)) {
+		return;
+	}
+
+	if (!thread_id) {
+		thread_id = ++thread_counter;
+	}
+
+	const uint64_t t0 = to_us(start);
+	const uint64_t t1 = to_us(end);
+
+	MutexLock lock(events_lock);
+	events.push_back({ name, id, t0, (t1 > t0) ? (t1 - t0) : 0, thread_id });
+}
+
+} // namespace trace
+
+} // namespace p2pool
@@ -0,0 +1,73 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+namespace p2pool {
+
+// Block propagation tracing in Chrome trace-event JSON format (chrome://tracing or ui.perfetto.dev)
+// Spans are keyed by sidechain id and sampled by it, so either all spans of a block are written or none
+// Nodes with the same sample rate pick the same blocks, so their traces can be compared
+namespace trace {
+
+typedef std::chrono::high_resolution_clock clock;
+
+extern bool enabled;
+
+void init(const std::string& file_name, uint32_t sample_rate);
+
+// Writes all buffered events to the file, can be called from any thread
+void flush();
+
+void stop();
+
+bool sampled(const hash& id);
+void add_span(const char* name, const hash& id, clock::time_point start, clock::time_point end);
+
+} // namespace trace
+
+// Records the time between construction and destruction as a span, the id can be set later
+class TraceSpan : public nocopy_nomove
+{
+public:
+	explicit FORCEINLINE TraceSpan(const char* name, const hash& id = hash())
+		: m_name(name)
+		, m_id(id)
+		, m_enabled(trace::enabled)
+	{
+		if (m_enabled) {
+			m_start = trace::clock::now();
+		}
+	}
+
+	FORCEINLINE ~TraceSpan()
+	{
+		if (m_enabled) {
+			trace::add_span(m_name, m_id, m_start, trace::clock::now());
+		}
+	}
+
+	FORCEINLINE void set_id(const hash& id) { m_id = id; }
+
+private:
+	const char* m_name;
+	hash m_id;
+	bool m_enabled;
+	trace::clock::time_point m_start;
+};
+
+} // namespace p2pool
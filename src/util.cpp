@@ -20,11 +20,20 @@
 #include "uv_util.h"
 #include <map>
 #include <thread>
+#include <deque>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #ifndef _WIN32
 #include <sched.h>
 #endif
 
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
 static constexpr char log_category_prefix[] = "Util ";
 
 namespace p2pool {
@@ -75,6 +84,102 @@ void make_thread_background()
 #endif
 }
 
+#ifdef __linux__
+// Parses sysfs lists like "0-7,16-23"
+static bool read_cpu_list(const char* path, std::vector<uint32_t>& result)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+
+	char buf[4096];
+	const bool ok = (fgets(buf, sizeof(buf), f) != nullptr);
+	fclose(f);
+
+	if (!ok) {
+		return false;
+	}
+
+	for (const char* p = buf; *p;) {
+		char* end;
+		const uint32_t a = strtoul(p, &end, 10);
+		if (end == p) {
+			break;
+		}
+
+		uint32_t b = a;
+		p = end;
+		if (*p == '-') {
+			b = strtoul(p + 1, &end, 10);
+			p = end;
+		}
+
+		for (uint32_t i = a; i <= b; ++i) {
+			result.push_back(i);
+		}
+
+		if (*p != ',') {
+			break;
+		}
+		++p;
+	}
+
+	return true;
+}
+#endif
+
+const std::vector<std::vector<uint32_t>>& numa_nodes()
+{
+	static const std::vector<std::vector<uint32_t>> nodes = []()
+	{
+		std::vector<std::vector<uint32_t>> result;
+#ifdef __linux__
+		std::vector<uint32_t> online;
+		if (read_cpu_list("/sys/devices/system/node/online", online)) {
+			for (uint32_t node : online) {
+				char path[64];
+				snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+
+				// Memory-only nodes have no CPUs to run on
+				std::vector<uint32_t> cpus;
+				if (read_cpu_list(path, cpus) && !cpus.empty()) {
+					result.emplace_back(std::move(cpus));
+				}
+			}
+		}
+#endif
+		if (result.empty()) {
+			result.emplace_back();
+		}
+		return result;
+	}();
+
+	return nodes;
+}
+
+bool set_thread_affinity(const std::vector<uint32_t>& cpus)
+{
+#ifdef __linux__
+	if (cpus.empty()) {
+		return false;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &set);
+		}
+	}
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
+
 NOINLINE bool difficulty_type::check_pow(const hash& pow_hash) const
 {
 	const uint64_t* a = reinterpret_cast<const uint64_t*>(pow_hash.h);
@@ -349,6 +454,209 @@ void BackgroundJobTracker::print_status()
 
 BackgroundJobTracker bkg_jobs_tracker;
 
+struct WorkLaneImpl : public nocopy_nomove
+{
+	struct Item
+	{
+		uv_async_t async;
+		uv_work_t* req;
+		uv_work_cb work_cb;
+		uv_after_work_cb after_work_cb;
+		std::chrono::high_resolution_clock::time_point queued;
+	};
+
+	WorkLaneImpl(const char* name, uint32_t num_threads, bool background)
+		: m_name(name)
+		, m_background(background)
+		, m_stopped(false)
+		, m_maxDepth(0)
+		, m_completed(0)
+		, m_waitTotalNs(0)
+		, m_waitMaxNs(0)
+		, m_runTotalNs(0)
+	{
+		uv_mutex_init_checked(&m_lock);
+		uv_cond_init_checked(&m_cond);
+
+		m_threads.reserve(num_threads);
+		for (uint32_t i = 0; i < num_threads; ++i) {
+			m_threads.emplace_back(&WorkLaneImpl::run, this);
+		}
+	}
+
+	~WorkLaneImpl()
+	{
+		{
+			MutexLock lock(m_lock);
+			m_stopped = true;
+		}
+		uv_cond_broadcast(&m_cond);
+
+		for (std::thread& t : m_threads) {
+			t.join();
+		}
+
+		uv_cond_destroy(&m_cond);
+		uv_mutex_destroy(&m_lock);
+	}
+
+	int queue(uv_loop_t* loop, uv_work_t* req, uv_work_cb work_cb, uv_after_work_cb after_work_cb)
+	{
+		Item* item = new Item{ {}, req, work_cb, after_work_cb, std::chrono::high_resolution_clock::now() };
+
+		const int err = uv_async_init(loop, &item->async, on_done);
+		if (err) {
+			delete item;
+			return err;
+		}
+		item->async.data = item;
+		req->loop = loop;
+
+		{
+			MutexLock lock(m_lock);
+			m_queue.push_back(item);
+			m_maxDepth = std::max<uint64_t>(m_maxDepth, m_queue.size());
+		}
+		uv_cond_signal(&m_cond);
+
+		return 0;
+	}
+
+	void run()
+	{
+		if (m_background) {
+			make_thread_background();
+		}
+
+		using namespace std::chrono;
+
+		for (;;) {
+			Item* item;
+			{
+				MutexLock lock(m_lock);
+				while (m_queue.empty() && !m_stopped) {
+					uv_cond_wait(&m_cond, &m_lock);
+				}
+				if (m_queue.empty()) {
+					return;
+				}
+				item = m_queue.front();
+				m_queue.pop_front();
+			}
+
+			const auto t1 = high_resolution_clock::now();
+			const uint64_t wait_ns = static_cast<uint64_t>(duration_cast<nanoseconds>(t1 - item->queued).count());
+
+			m_waitTotalNs += wait_ns;
+			uint64_t max_ns = m_waitMaxNs.load();
+			while ((wait_ns > max_ns) && !m_waitMaxNs.compare_exchange_weak(max_ns, wait_ns)) {}
+
+			item->work_cb(item->req);
+
+			m_runTotalNs += static_cast<uint64_t>(duration_cast<nanoseconds>(high_resolution_clock::now() - t1).count());
+			++m_completed;
+
+			uv_async_send(&item->async);
+		}
+	}
+
+	static void on_done(uv_async_t* handle)
+	{
+		Item* item = reinterpret_cast<Item*>(handle->data);
+		if (item->after_work_cb) {
+			item->after_work_cb(item->req, 0);
+		}
+		uv_close(reinterpret_cast<uv_handle_t*>(handle), [](uv_handle_t* h) { delete reinterpret_cast<Item*>(h->data); });
+	}
+
+	void print_status(log::Stream& s)
+	{
+		size_t depth;
+		uint64_t max_depth;
+		{
+			MutexLock lock(m_lock);
+			depth = m_queue.size();
+			max_depth = m_maxDepth;
+		}
+
+		const uint64_t completed = m_completed.load();
+		const uint64_t wait_avg_us = completed ? (m_waitTotalNs.load() / completed / 1000) : 0;
+		const uint64_t run_avg_us = completed ? (m_runTotalNs.load() / completed / 1000) : 0;
+
+		s << '\n' << m_name << ": " << m_threads.size() << " threads, " << depth << " queued (max " << max_depth << "), "
+			<< completed << " done, wait " << wait_avg_us << " us average, " << m_waitMaxNs.load() / 1000 << " us max, run " << run_avg_us << " us average";
+	}
+
+	const char* m_name;
+	bool m_background;
+
+	uv_mutex_t m_lock;
+	uv_cond_t m_cond;
+	std::deque<Item*> m_queue;
+	bool m_stopped;
+	uint64_t m_maxDepth;
+
+	std::vector<std::thread> m_threads;
+
+	std::atomic<uint64_t> m_completed;
+	std::atomic<uint64_t> m_waitTotalNs;
+	std::atomic<uint64_t> m_waitMaxNs;
+	std::atomic<uint64_t> m_runTotalNs;
+};
+
+// Set up once before the event loops start, torn down after they exit
+static WorkLaneImpl* work_lanes[static_cast<size_t>(WorkLane::COUNT)] = {};
+
+void init_work_lanes(const uint32_t (&num_threads)[static_cast<size_t>(WorkLane::COUNT)])
+{
+	static constexpr const char* names[static_cast<size_t>(WorkLane::COUNT)] = { "PoW", "Blocks", "Background" };
+
+	for (size_t i = 0; i < array_size(work_lanes); ++i) {
+		if (num_threads[i] && !work_lanes[i]) {
+			work_lanes[i] = new WorkLaneImpl(names[i], num_threads[i], i == static_cast<size_t>(WorkLane::BACKGROUND));
+		}
+	}
+}
+
+void stop_work_lanes()
+{
+	for (WorkLaneImpl*& lane : work_lanes) {
+		delete lane;
+		lane = nullptr;
+	}
+}
+
+void print_work_lanes_status()
+{
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream s(buf);
+
+	for (WorkLaneImpl* lane : work_lanes) {
+		if (lane) {
+			lane->print_status(s);
+		}
+	}
+
+	if (s.m_pos) {
+		LOGINFO(0, "work lanes:" << log::const_buf(buf, s.m_pos));
+	}
+}
+
+uint32_t work_lane_threads(WorkLane lane)
+{
+	const WorkLaneImpl* impl = work_lanes[static_cast<size_t>(lane)];
+	return impl ? static_cast<uint32_t>(impl->m_threads.size()) : 4;
+}
+
+int uv_queue_work_lane(uv_loop_t* loop, WorkLane lane, uv_work_t* req, uv_work_cb work_cb, uv_after_work_cb after_work_cb)
+{
+	WorkLaneImpl* impl = work_lanes[static_cast<size_t>(lane)];
+	if (!impl) {
+		return uv_queue_work(loop, req, work_cb, after_work_cb);
+	}
+	return impl->queue(loop, req, work_cb, after_work_cb);
+}
+
 static thread_local bool main_thread = false;
 void set_main_thread() { main_thread = true; }
 bool is_main_thread() { return main_thread; }
@@ -422,6 +730,35 @@ struct BSR8
 
 static constexpr BSR8 bsr8_table = BSR8::init();
 
+void to_hex(const uint8_t* data, size_t size, char* out)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+	// SSE2 is always available on x64: split bytes into nibbles, convert 16 nibbles at a time and interleave them back
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i digit0 = _mm_set1_epi8('0');
+	const __m128i letter_offset = _mm_set1_epi8('a' - '0' - 10);
+
+	for (; size >= 16; size -= 16, data += 16, out += 32) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+		__m128i lo = _mm_and_si128(x, mask);
+
+		hi = _mm_add_epi8(_mm_add_epi8(hi, digit0), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letter_offset));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, digit0), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letter_offset));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+
+	for (size_t i = 0; i < size; ++i) {
+		out[i * 2 + 0] = "0123456789abcdef"[data[i] >> 4];
+		out[i * 2 + 1] = "0123456789abcdef"[data[i] & 15];
+	}
+}
+
 NOINLINE uint64_t bsr_reference(uint64_t x)
 {
 	uint32_t y = static_cast<uint32_t>(x);
@@ -74,7 +74,7 @@ struct MinerCallbackHandler
 {
 	virtual ~MinerCallbackHandler() = 0;
 
-	virtual void handle_tx(TxMempoolData& tx) = 0;
+	virtual void handle_txs(std::vector<TxMempoolData>& txs) = 0;
 	virtual void handle_miner_data(MinerData& data) = 0;
 	virtual void handle_chain_main(ChainMain& data, const char* extra) = 0;
 };
@@ -87,6 +87,9 @@ static FORCEINLINE bool from_hex(char c, T& out_value) {
 	return false;
 }
 
+// Writes size * 2 lowercase hex characters to out, no null terminator
+void to_hex(const uint8_t* data, size_t size, char* out);
+
 template<typename T, bool is_signed> struct abs_helper {};
 template<typename T> struct abs_helper<T, false> { static FORCEINLINE T value(T x) { return x; } };
 template<typename T> struct abs_helper<T, true>  { static FORCEINLINE T value(T x) { return (x >= 0) ? x : -x; } };
@@ -150,6 +153,10 @@ template<typename T, typename U, size_t N> FORCEINLINE constexpr size_t array_si
 
 void make_thread_background();
 
+// CPUs of each NUMA node that has any (Linux only), a single empty list (any CPU) if the topology is unknown
+const std::vector<std::vector<uint32_t>>& numa_nodes();
+bool set_thread_affinity(const std::vector<uint32_t>& cpus);
+
 class BackgroundJobTracker : public nocopy_nomove
 {
 public:
@@ -204,6 +211,87 @@ FORCEINLINE uint64_t seconds_since_epoch()
 	return duration_cast<seconds>(steady_clock::now().time_since_epoch()).count();
 }
 
+// Lock-free hashrate counter: an exact total plus a ring of (timestamp, total hashes) snapshots, one per BUCKET_SECONDS
+// add() is one atomic add most of the time, hashrate windows are calculated only when they're read
+template<uint64_t BUCKET_SECONDS, size_t NUM_BUCKETS>
+class HashrateCounter
+{
+public:
+	HashrateCounter() { reset(); }
+
+	void reset()
+	{
+		m_totalHashes = 0;
+		for (Bucket& b : m_buckets) {
+			b.m_timestamp = 0;
+			b.m_totalHashes = 0;
+		}
+	}
+
+	void add(uint64_t timestamp, uint64_t hashes)
+	{
+		const uint64_t prev_total = m_totalHashes.fetch_add(hashes);
+
+		Bucket& b = m_buckets[(timestamp / BUCKET_SECONDS) % NUM_BUCKETS];
+		uint64_t t = b.m_timestamp.load();
+
+		// First share in this bucket: take the snapshot, the bucket is marked busy until it's consistent
+		// The snapshot includes this share, its work was done before "timestamp" and is outside of the time span get() measures
+		if ((t != BUSY) && (t / BUCKET_SECONDS < timestamp / BUCKET_SECONDS) && b.m_timestamp.compare_exchange_strong(t, BUSY)) {
+			b.m_totalHashes = prev_total + hashes;
+			b.m_timestamp = timestamp;
+		}
+	}
+
+	uint64_t total_hashes() const { return m_totalHashes.load(); }
+
+	// Hashes counted during the last "window" seconds and the actual time span they cover
+	void get(uint64_t now, uint64_t window, uint64_t& hashes, uint64_t& dt) const
+	{
+		const uint64_t total = m_totalHashes.load();
+
+		uint64_t oldest_timestamp = now;
+		uint64_t oldest_total = total;
+
+		for (const Bucket& b : m_buckets) {
+			const uint64_t t = b.m_timestamp.load();
+			if ((t == 0) || (t == BUSY) || (t + window < now) || (t >= oldest_timestamp)) {
+				continue;
+			}
+
+			const uint64_t h = b.m_totalHashes.load();
+
+			// Skip it if it was reused while we were reading it
+			if (b.m_timestamp.load() == t) {
+				oldest_timestamp = t;
+				oldest_total = h;
+			}
+		}
+
+		hashes = total - oldest_total;
+		dt = now - oldest_timestamp;
+	}
+
+	uint64_t hashrate(uint64_t now, uint64_t window) const
+	{
+		uint64_t hashes, dt;
+		get(now, window, hashes, dt);
+		return dt ? (hashes / dt) : 0;
+	}
+
+private:
+	static constexpr uint64_t BUSY = std::numeric_limits<uint64_t>::max();
+
+	struct Bucket
+	{
+		std::atomic<uint64_t> m_timestamp;
+		std::atomic<uint64_t> m_totalHashes;
+	};
+
+	std::atomic<uint64_t> m_totalHashes;
+	Bucket m_buckets[NUM_BUCKETS];
+};
+
 uint64_t bsr_reference(uint64_t x);
 
 #ifdef HAVE_BUILTIN_CLZLL
@@ -223,6 +311,50 @@ FORCEINLINE uint64_t bsr(uint64_t x)
 bool str_to_ip(bool is_v6, const char* ip, raw_ip& result);
 bool is_localhost(const std::string& host);
 
+// Sampling allocation profiler, it's turned on and off at runtime with the "memprof" console command
+// One allocation is sampled every N allocated bytes, samples are aggregated by call site and subsystem tag
+namespace alloc_profiler {
+
+enum class Tag : uint8_t
+{
+	OTHER,
+	SIDECHAIN,
+	P2P,
+	STRATUM,
+	CRYPTO_CACHE,
+	MEMPOOL,
+	COUNT,
+};
+
+struct TagStats
+{
+	bool m_running;
+	uint64_t m_liveBytes[static_cast<size_t>(Tag::COUNT)];
+	uint64_t m_totalBytes[static_cast<size_t>(Tag::COUNT)];
+};
+
+extern const char* const tag_names[static_cast<size_t>(Tag::COUNT)];
+
+void start(uint64_t sample_bytes);
+void stop();
+void print_status();
+void get_tag_stats(TagStats& stats);
+
+Tag set_tag(Tag tag);
+
+} // namespace alloc_profiler
+
+// Allocations in this thread are attributed to the tag until the end of the scope
+class AllocationTag : public nocopy_nomove
+{
+public:
+	explicit FORCEINLINE AllocationTag(alloc_profiler::Tag tag) : m_prevTag(alloc_profiler::set_tag(tag)) {}
+	FORCEINLINE ~AllocationTag() { alloc_profiler::set_tag(m_prevTag); }
+
+private:
+	alloc_profiler::Tag m_prevTag;
+};
+
 } // namespace p2pool
 
 void memory_tracking_start();
@@ -174,4 +174,25 @@ bool CallOnLoop(uv_loop_t* loop, T&& callback)
 	return false;
 }
 
+// Dedicated worker thread pools, so slow disk or network jobs in libuv's threadpool can't delay share and block verification
+enum class WorkLane : uint32_t
+{
+	POW,
+	BLOCKS,
+	BACKGROUND,
+
+	COUNT
+};
+
+// num_threads[i] = 0 leaves lane i on libuv's threadpool
+void init_work_lanes(const uint32_t (&num_threads)[static_cast<size_t>(WorkLane::COUNT)]);
+void stop_work_lanes();
+void print_work_lanes_status();
+
+// Number of threads running jobs of this lane, libuv's default threadpool size if the lane is left on libuv's threadpool
+uint32_t work_lane_threads(WorkLane lane);
+
+// Same contract as uv_queue_work: call it from the loop's thread, after_work_cb runs on that loop and keeps it alive until then
+int uv_queue_work_lane(uv_loop_t* loop, WorkLane lane, uv_work_t* req, uv_work_cb work_cb, uv_after_work_cb after_work_cb);
+
 } // namespace p2pool
@@ -79,12 +79,17 @@ static_assert(rev_alphabet.num_symbols == 58, "Check alphabet");
 
 namespace p2pool {
 
-Wallet::Wallet(const char* address) : m_prefix(0), m_checksum(0), m_type(NetworkType::Invalid)
+Wallet::Wallet(const char* address) : m_prefix(0), m_checksum(0), m_type(NetworkType::Invalid), m_keyTableEnabled(false), m_keyTable(nullptr)
 {
 	decode(address);
 }
 
-Wallet::Wallet(const Wallet& w)
+Wallet::~Wallet()
+{
+	destroy_wallet_key_table(m_keyTable.load());
+}
+
+Wallet::Wallet(const Wallet& w) : m_keyTableEnabled(false), m_keyTable(nullptr)
 {
 	operator=(w);
 }
@@ -197,6 +202,14 @@ bool Wallet::assign(const hash& spend_pub_key, const hash& view_pub_key, Network
 bool Wallet::get_eph_public_key(const hash& txkey_sec, size_t output_index, hash& eph_public_key, uint8_t& view_tag) const
 {
 	hash derivation;
+
+	const WalletKeyTable* table = get_key_table();
+	if (table) {
+		generate_key_derivation(*table, txkey_sec, output_index, derivation, view_tag);
+		derive_public_key(derivation, output_index, *table, eph_public_key);
+		return true;
+	}
+
 	if (!generate_key_derivation(m_viewPublicKey, txkey_sec, output_index, derivation, view_tag)) {
 		return false;
 	}
@@ -212,6 +225,17 @@ bool Wallet::get_eph_public_key_with_view_tag(const hash& txkey_sec, size_t outp
 {
 	hash derivation;
 	uint8_t view_tag;
+
+	const WalletKeyTable* table = get_key_table();
+	if (table) {
+		generate_key_derivation(*table, txkey_sec, output_index, derivation, view_tag);
+		if (view_tag != expected_view_tag) {
+			return false;
+		}
+		derive_public_key(derivation, output_index, *table, eph_public_key);
+		return true;
+	}
+
 	if (!generate_key_derivation(m_viewPublicKey, txkey_sec, output_index, derivation, view_tag) || (view_tag != expected_view_tag)) {
 		return false;
 	}
@@ -223,4 +247,213 @@ bool Wallet::get_eph_public_key_with_view_tag(const hash& txkey_sec, size_t outp
 	return true;
 }
 
+bool Wallet::get_eph_public_keys(const Wallet* const* wallets, size_t count, const hash& txkey_sec, size_t first_output_index, hash* eph_public_keys, uint8_t* view_tags)
+{
+	constexpr size_t BATCH_SIZE = 64;
+
+	const WalletKeyTable* tables[BATCH_SIZE];
+	hash derivations[BATCH_SIZE];
+
+	bool result = true;
+
+	for (size_t begin = 0; begin < count; begin += BATCH_SIZE) {
+		const size_t n = std::min(count - begin, BATCH_SIZE);
+
+		for (size_t i = 0; i < n; ++i) {
+			const Wallet* w = wallets[begin + i];
+			tables[i] = w ? w->get_key_table() : nullptr;
+
+			// Wallets which are not interned go one by one
+			if (w && !tables[i] && !w->get_eph_public_key(txkey_sec, first_output_index + begin + i, eph_public_keys[begin + i], view_tags[begin + i])) {
+				result = false;
+			}
+		}
+
+		generate_key_derivations(tables, txkey_sec, first_output_index + begin, n, derivations, view_tags + begin);
+		derive_public_keys(derivations, tables, first_output_index + begin, n, eph_public_keys + begin);
+	}
+
+	return result;
+}
+
+const WalletKeyTable* Wallet::get_key_table() const
+{
+	if (!m_keyTableEnabled) {
+		return nullptr;
+	}
+
+	WalletKeyTable* table = m_keyTable.load(std::memory_order_acquire);
+	if (table) {
+		return table;
+	}
+
+	table = create_wallet_key_table(m_spendPublicKey, m_viewPublicKey);
+
+	// Another thread could have created it in the meantime
+	WalletKeyTable* expected = nullptr;
+	if (!m_keyTable.compare_exchange_strong(expected, table, std::memory_order_acq_rel)) {
+		destroy_wallet_key_table(table);
+		table = expected;
+	}
+
+	return table;
+}
+
+namespace {
+
+// All distinct wallets referenced by InternedWallet handles
+struct WalletTable
+{
+	typedef std::array<uint8_t, HASH_SIZE * 2 + 1> Key;
+
+	WalletTable() { uv_mutex_init_checked(&m_lock); }
+
+	~WalletTable()
+	{
+		for (auto& it : m_entries) {
+			delete it.second;
+		}
+		uv_mutex_destroy(&m_lock);
+	}
+
+	static Key get_key(const hash& spend_pub_key, const hash& view_pub_key, NetworkType type)
+	{
+		Key key;
+		memcpy(key.data(), spend_pub_key.h, HASH_SIZE);
+		memcpy(key.data() + HASH_SIZE, view_pub_key.h, HASH_SIZE);
+		key[HASH_SIZE * 2] = static_cast<uint8_t>(type);
+		return key;
+	}
+
+	uv_mutex_t m_lock;
+	unordered_map<Key, InternedWallet::Entry*> m_entries;
+};
+
+WalletTable& wallet_table()
+{
+	static WalletTable table;
+	return table;
+}
+
+} // namespace
+
+const Wallet InternedWallet::s_invalidWallet(nullptr);
+
+InternedWallet::InternedWallet(const InternedWallet& w) : m_entry(w.m_entry)
+{
+	// w holds a reference, so the entry can't be deleted here
+	if (m_entry) {
+		++m_entry->m_refs;
+	}
+}
+
+InternedWallet& InternedWallet::operator=(const InternedWallet& w)
+{
+	if (m_entry != w.m_entry) {
+		release();
+		m_entry = w.m_entry;
+		if (m_entry) {
+			++m_entry->m_refs;
+		}
+	}
+	return *this;
+}
+
+InternedWallet::~InternedWallet()
+{
+	release();
+}
+
+bool InternedWallet::assign(const hash& spend_pub_key, const hash& view_pub_key, NetworkType type)
+{
+	Entry* e = acquire(spend_pub_key, view_pub_key, type, nullptr);
+	if (!e) {
+		return false;
+	}
+
+	release();
+	m_entry = e;
+	return true;
+}
+
+void InternedWallet::assign(const Wallet& w)
+{
+	Entry* e = acquire(w.spend_public_key(), w.view_public_key(), w.type(), &w);
+	release();
+	m_entry = e;
+}
+
+size_t InternedWallet::num_wallets()
+{
+	WalletTable& table = wallet_table();
+
+	MutexLock lock(table.m_lock);
+	return table.m_entries.size();
+}
+
+InternedWallet::Entry* InternedWallet::acquire(const hash& spend_pub_key, const hash& view_pub_key, NetworkType type, const Wallet* w)
+{
+	WalletTable& table = wallet_table();
+	const WalletTable::Key key = WalletTable::get_key(spend_pub_key, view_pub_key, type);
+
+	{
+		MutexLock lock(table.m_lock);
+
+		auto it = table.m_entries.find(key);
+		if (it != table.m_entries.end()) {
+			++it->second->m_refs;
+			return it->second;
+		}
+	}
+
+	// New wallet, check its keys outside of the lock
+	Wallet tmp(nullptr);
+	if (!w) {
+		if (!tmp.assign(spend_pub_key, view_pub_key, type)) {
+			return nullptr;
+		}
+		w = &tmp;
+	}
+
+	MutexLock lock(table.m_lock);
+
+	// Another thread could have added it in the meantime
+	auto it = table.m_entries.find(key);
+	if (it != table.m_entries.end()) {
+		++it->second->m_refs;
+		return it->second;
+	}
+
+	Entry* e = new Entry(*w);
+	table.m_entries.emplace(key, e);
+	return e;
+}
+
+void InternedWallet::release()
+{
+	Entry* e = m_entry;
+	if (!e) {
+		return;
+	}
+
+	m_entry = nullptr;
+
+	// Fast path: this is not the last reference
+	uint32_t refs = e->m_refs.load();
+	while (refs > 1) {
+		if (e->m_refs.compare_exchange_weak(refs, refs - 1)) {
+			return;
+		}
+	}
+
+	WalletTable& table = wallet_table();
+
+	MutexLock lock(table.m_lock);
+
+	if (--e->m_refs == 0) {
+		table.m_entries.erase(WalletTable::get_key(e->m_wallet.spend_public_key(), e->m_wallet.view_public_key(), e->m_wallet.type()));
+		delete e;
+	}
+}
+
 } // namespace p2pool
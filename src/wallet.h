@@ -21,10 +21,13 @@
 
 namespace p2pool {
 
+struct WalletKeyTable;
+
 class Wallet
 {
 public:
 	explicit Wallet(const char* address);
+	~Wallet();
 
 	Wallet(const Wallet& w);
 	Wallet& operator=(const Wallet& w);
@@ -41,15 +44,65 @@ public:
 	bool get_eph_public_key(const hash& txkey_sec, size_t output_index, hash& eph_public_key, uint8_t& view_tag) const;
 	bool get_eph_public_key_with_view_tag(const hash& txkey_sec, size_t output_index, hash& eph_public_key, uint8_t expected_view_tag) const;
 
+	// Eph public keys for outputs [first_output_index, first_output_index + count) of one miner tx, wallets[i] is used for output first_output_index + i
+	// Interned wallets are processed in one batch, nullptr wallets are skipped
+	static bool get_eph_public_keys(const Wallet* const* wallets, size_t count, const hash& txkey_sec, size_t first_output_index, hash* eph_public_keys, uint8_t* view_tags);
+
 	FORCEINLINE bool operator<(const Wallet& w) const { return m_spendPublicKey < w.m_spendPublicKey; }
 	FORCEINLINE bool operator==(const Wallet& w) const { return m_spendPublicKey == w.m_spendPublicKey; }
 
 private:
+	friend class InternedWallet;
+
+	const WalletKeyTable* get_key_table() const;
+
 	uint64_t m_prefix;
 	hash m_spendPublicKey;
 	hash m_viewPublicKey;
 	uint32_t m_checksum;
 	NetworkType m_type;
+
+	// Only wallets in the intern table have a key table, it's created on first use and is never copied
+	bool m_keyTableEnabled;
+	mutable std::atomic<WalletKeyTable*> m_keyTable;
+};
+
+// Reference-counted handle to a wallet stored in the global intern table
+// All blocks mined by the same address share one Wallet object, so equal wallets have equal pointers
+class InternedWallet
+{
+public:
+	FORCEINLINE InternedWallet() : m_entry(nullptr) {}
+	InternedWallet(const InternedWallet& w);
+	InternedWallet& operator=(const InternedWallet& w);
+	~InternedWallet();
+
+	// Public keys are checked only when this wallet is not in the intern table yet
+	bool assign(const hash& spend_pub_key, const hash& view_pub_key, NetworkType type);
+	void assign(const Wallet& w);
+
+	// Never returns nullptr, an empty handle points to an invalid wallet
+	FORCEINLINE const Wallet* get() const { return m_entry ? &m_entry->m_wallet : &s_invalidWallet; }
+	FORCEINLINE const Wallet* operator->() const { return get(); }
+	FORCEINLINE const Wallet& operator*() const { return *get(); }
+
+	static size_t num_wallets();
+
+	struct Entry
+	{
+		explicit Entry(const Wallet& w) : m_wallet(w), m_refs(1) { m_wallet.m_keyTableEnabled = true; }
+
+		Wallet m_wallet;
+		std::atomic<uint32_t> m_refs;
+	};
+
+private:
+	static Entry* acquire(const hash& spend_pub_key, const hash& view_pub_key, NetworkType type, const Wallet* w);
+	void release();
+
+	Entry* m_entry;
+
+	static const Wallet s_invalidWallet;
 };
 
 } // namespace p2pool
@@ -18,7 +18,6 @@
 #include "common.h"
 #include "zmq_reader.h"
 #include "json_parsers.h"
-#include <rapidjson/document.h>
 
 static constexpr char log_category_prefix[] = "ZMQReader ";
 
@@ -32,6 +31,10 @@ ZMQReader::ZMQReader(const std::string& address, uint32_t zmq_port, const std::s
 	, m_tx()
 	, m_minerData()
 	, m_chainmainData()
+	, m_allocatorBuf(PARSE_ALLOCATOR_BUF_SIZE)
+	, m_stackAllocatorBuf(PARSE_STACK_BUF_SIZE)
+	, m_allocator(m_allocatorBuf.data(), m_allocatorBuf.size())
+	, m_stackAllocator(m_stackAllocatorBuf.data(), m_stackAllocatorBuf.size())
 {
 	if (!m_proxy.empty() && is_localhost(address)) {
 		LOGINFO(5, "not using proxy to connect to localhost address " << log::Gray() << address);
@@ -203,8 +206,15 @@ void ZMQReader::parse(char* data, size_t size)
 
 	using namespace rapidjson;
 
-	Document doc;
-	if (doc.Parse<kParseCommentsFlag | kParseTrailingCommasFlag>(value, end - value).HasParseError()) {
+	// Everything allocated for the previous message is not used anymore
+	m_allocator.Clear();
+	m_stackAllocator.Clear();
+
+	m_parseBuf.assign(value, end);
+	m_parseBuf.push_back('\0');
+
+	ParseDocument doc(&m_allocator, PARSE_STACK_BUF_SIZE / 2, &m_stackAllocator);
+	if (doc.ParseInsitu<kParseCommentsFlag | kParseTrailingCommasFlag>(m_parseBuf.data()).HasParseError()) {
 		LOGWARN(1, "ZeroMQ message failed to parse, skipping it");
 		return;
 	}
@@ -216,16 +226,21 @@ void ZMQReader::parse(char* data, size_t size)
 		}
 
 		m_tx.time_received = seconds_since_epoch();
+		m_txs.clear();
 
 		for (SizeType i = 0, n = doc.Size(); i < n; ++i) {
 			const auto& v = doc[i];
 			if (PARSE(v, m_tx, id) && PARSE(v, m_tx, blob_size) && PARSE(v, m_tx, weight) && PARSE(v, m_tx, fee)) {
-				m_handler->handle_tx(m_tx);
+				m_txs.push_back(m_tx);
 			}
 			else {
 				LOGWARN(1, "transaction #" << (i + 1) << " in json-minimal-txpool_add failed to parse, skipped it");
 			}
 		}
+
+		if (!m_txs.empty()) {
+			m_handler->handle_txs(m_txs);
+		}
 	}
 	else if (strcmp(data, "json-full-miner_data") == 0) {
 		if (!doc.IsObject()) {
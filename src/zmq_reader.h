@@ -19,6 +19,7 @@
 
 #include "uv_util.h"
 #include <zmq.hpp>
+#include <rapidjson/document.h>
 
 namespace p2pool {
 
@@ -47,8 +48,25 @@ private:
 	std::atomic<int> m_finished{ 0 };
 
 	TxMempoolData m_tx;
+	std::vector<TxMempoolData> m_txs;
 	MinerData m_minerData;
 	ChainMain m_chainmainData;
+
+	// Messages are copied to m_parseBuf and parsed in-situ
+	// Parser memory comes from preallocated buffers which are reused for every message
+	enum {
+		PARSE_ALLOCATOR_BUF_SIZE = 1 << 20,
+		PARSE_STACK_BUF_SIZE = 1 << 16,
+	};
+
+	typedef rapidjson::MemoryPoolAllocator<> ParseAllocator;
+	typedef rapidjson::GenericDocument<rapidjson::UTF8<>, ParseAllocator, ParseAllocator> ParseDocument;
+
+	std::vector<char> m_parseBuf;
+	std::vector<uint8_t> m_allocatorBuf;
+	std::vector<uint8_t> m_stackAllocatorBuf;
+	ParseAllocator m_allocator;
+	ParseAllocator m_stackAllocator;
 };
 
 } // namespace p2pool
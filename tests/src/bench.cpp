@@ -0,0 +1,395 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "keccak.h"
+#include "wallet.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "block_template.h"
+#include <fstream>
+#include <random>
+
+// Micro-benchmarks for core kernels, prints one JSON document to stdout
+// Every benchmark runs a fixed number of iterations: one untimed warm-up pass and REPEATS timed passes
+// Usage: p2pool_bench [name filter...]
+
+void p2pool_usage() {}
+
+namespace {
+
+using namespace p2pool;
+
+constexpr int REPEATS = 5;
+
+#if defined(__x86_64__) || defined(_M_X64)
+constexpr char ARCH[] = "x86_64";
+#elif defined(__aarch64__) || defined(_M_ARM64)
+constexpr char ARCH[] = "aarch64";
+#elif defined(__i386__) || defined(_M_IX86)
+constexpr char ARCH[] = "x86";
+#elif defined(__arm__) || defined(_M_ARM)
+constexpr char ARCH[] = "arm";
+#else
+constexpr char ARCH[] = "unknown";
+#endif
+
+#if defined(__clang__)
+constexpr char COMPILER[] = "clang " __clang_version__;
+#elif defined(__GNUC__)
+constexpr char COMPILER[] = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+constexpr char COMPILER[] = "msvc";
+#else
+constexpr char COMPILER[] = "unknown";
+#endif
+
+// Results are folded into this so the compiler can't remove benchmarked calls
+volatile uint64_t sink = 0;
+
+FORCEINLINE void consume(const hash& h) { sink = sink + *reinterpret_cast<const uint64_t*>(h.h); }
+FORCEINLINE void consume(uint64_t x) { sink = sink + x; }
+
+int argc_filter = 0;
+char** argv_filter = nullptr;
+bool first_result = true;
+
+bool selected(const char* name)
+{
+	if (argc_filter < 2) {
+		return true;
+	}
+
+	for (int i = 1; i < argc_filter; ++i) {
+		if (strstr(name, argv_filter[i])) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// "reset" is called before every pass and isn't timed, "f(i)" is one operation
+template<typename Reset, typename F>
+void run(const char* name, const char* params, uint64_t iterations, Reset&& reset, F&& f)
+{
+	using namespace std::chrono;
+
+	if (!selected(name)) {
+		return;
+	}
+
+	double ns_per_op[REPEATS];
+
+	for (int r = -1; r < REPEATS; ++r) {
+		reset();
+
+		const auto t0 = high_resolution_clock::now();
+		for (uint64_t i = 0; i < iterations; ++i) {
+			f(i);
+		}
+		const auto t1 = high_resolution_clock::now();
+
+		if (r >= 0) {
+			ns_per_op[r] = static_cast<double>(duration_cast<nanoseconds>(t1 - t0).count()) / static_cast<double>(iterations);
+		}
+	}
+
+	std::sort(ns_per_op, ns_per_op + REPEATS);
+
+	std::cout << (first_result ? "\n" : ",\n")
+		<< "{\"name\":\"" << name << '"'
+		<< ",\"params\":\"" << params << '"'
+		<< ",\"iterations\":" << iterations
+		<< ",\"repeats\":" << REPEATS
+		<< ",\"ns_per_op_min\":" << ns_per_op[0]
+		<< ",\"ns_per_op_median\":" << ns_per_op[REPEATS / 2]
+		<< ",\"ns_per_op_max\":" << ns_per_op[REPEATS - 1]
+		<< '}';
+
+	first_result = false;
+}
+
+template<typename F>
+void run(const char* name, const char* params, uint64_t iterations, F&& f)
+{
+	run(name, params, iterations, []() {}, std::forward<F>(f));
+}
+
+std::vector<uint8_t> random_bytes(std::mt19937_64& rng, size_t size)
+{
+	std::vector<uint8_t> result(size);
+	for (uint8_t& b : result) {
+		b = static_cast<uint8_t>(rng());
+	}
+	return result;
+}
+
+void bench_keccak(std::mt19937_64& rng)
+{
+	for (int size : { 32, 76, 1024 }) {
+		const std::vector<uint8_t> data = random_bytes(rng, size);
+		const std::string params = "bytes=" + std::to_string(size);
+
+		run("keccak", params.c_str(), 100000, [&data, size](uint64_t)
+			{
+				hash h;
+				keccak(data.data(), size, h.h, HASH_SIZE);
+				consume(h);
+			});
+	}
+}
+
+bool bench_deserialize()
+{
+	if (!selected("PoolBlock::deserialize")) {
+		return true;
+	}
+
+	std::ifstream f("mainnet_test2_block.dat", std::ios::binary | std::ios::ate);
+	if (!f.good() || !f.is_open()) {
+		std::cerr << "couldn't open mainnet_test2_block.dat" << std::endl;
+		return false;
+	}
+
+	std::vector<uint8_t> buf(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	if (!f.good()) {
+		std::cerr << "couldn't read mainnet_test2_block.dat" << std::endl;
+		return false;
+	}
+
+	PoolBlock b;
+	SideChain sidechain(nullptr, NetworkType::Mainnet, "mainnet test 2");
+
+	bool ok = true;
+	run("PoolBlock::deserialize", "mainnet_test2_block.dat", 1000, [&b, &sidechain, &buf, &ok](uint64_t)
+		{
+			if (b.deserialize(buf.data(), buf.size(), sidechain, nullptr) != 0) {
+				ok = false;
+			}
+		});
+
+	if (!ok) {
+		std::cerr << "mainnet_test2_block.dat: deserialize failed" << std::endl;
+	}
+	return ok;
+}
+
+// Synthetic PPLNS window: every wallet has at least one share, and there are 2 shares per wallet on average
+void bench_shares(std::mt19937_64& rng)
+{
+	if (!selected("SideChain::combine_shares") && !selected("SideChain::split_reward")) {
+		return;
+	}
+
+	std::vector<InternedWallet> wallets;
+
+	for (size_t num_wallets : { 500, 2000, 5000 }) {
+		while (wallets.size() < num_wallets) {
+			hash spend_pub, view_pub, sec;
+			generate_keys(spend_pub, sec);
+			generate_keys(view_pub, sec);
+
+			InternedWallet w;
+			if (w.assign(spend_pub, view_pub, NetworkType::Mainnet)) {
+				wallets.push_back(w);
+			}
+		}
+
+		std::vector<MinerShare> window;
+		window.reserve(num_wallets * 2);
+
+		for (size_t i = 0; i < num_wallets * 2; ++i) {
+			window.emplace_back(rng() % 1000000 + 1, wallets[(i < num_wallets) ? i : (rng() % num_wallets)].get());
+		}
+		std::shuffle(window.begin(), window.end(), rng);
+
+		const std::string params = "wallets=" + std::to_string(num_wallets) + ",shares=" + std::to_string(window.size());
+
+		std::vector<MinerShare> shares;
+		shares.reserve(window.size());
+
+		run("SideChain::combine_shares", params.c_str(), 200, [&window, &shares](uint64_t)
+			{
+				shares.assign(window.begin(), window.end());
+				SideChain::combine_shares(shares);
+				consume(shares.size());
+			});
+
+		std::vector<uint64_t> rewards;
+		rewards.reserve(shares.size());
+
+		run("SideChain::split_reward", params.c_str(), 1000, [&shares, &rewards](uint64_t i)
+			{
+				SideChain::split_reward(600000000000ULL + i, shares, rewards);
+				consume(rewards.back());
+			});
+	}
+}
+
+// "cold" starts every pass with an empty crypto cache, "cached" finds everything in it
+void bench_crypto()
+{
+	if (!selected("generate_key_derivation") && !selected("derive_public_key")) {
+		return;
+	}
+
+	constexpr uint64_t N = 2000;
+
+	hash view_pub, spend_pub, sec;
+	generate_keys(view_pub, sec);
+	generate_keys(spend_pub, sec);
+
+	std::vector<hash> tx_keys(N);
+	for (hash& k : tx_keys) {
+		hash pub;
+		generate_keys(pub, k);
+	}
+
+	std::vector<hash> derivations(N);
+	for (uint64_t i = 0; i < N; ++i) {
+		uint8_t view_tag;
+		generate_key_derivation(view_pub, tx_keys[i], i, derivations[i], view_tag);
+	}
+
+	auto reset_cache = []() { destroy_crypto_cache(); init_crypto_cache(); };
+
+	auto derivation = [&view_pub, &tx_keys](uint64_t i)
+	{
+		hash d;
+		uint8_t view_tag;
+		generate_key_derivation(view_pub, tx_keys[i], i, d, view_tag);
+		consume(d);
+	};
+
+	auto public_key = [&derivations, &spend_pub](uint64_t i)
+	{
+		hash k;
+		derive_public_key(derivations[i], i, spend_pub, k);
+		consume(k);
+	};
+
+	run("generate_key_derivation", "cold", N, reset_cache, derivation);
+	run("generate_key_derivation", "cached", N, derivation);
+	run("derive_public_key", "cold", N, reset_cache, public_key);
+	run("derive_public_key", "cached", N, public_key);
+}
+
+// Synthetic block template with the same layout as mainnet_test2_block.dat: 43 byte header, 506 byte miner tx and 200 transactions
+void bench_hashing_blobs(std::mt19937_64& rng)
+{
+	if (!selected("BlockTemplate::get_hashing_blobs")) {
+		return;
+	}
+
+	constexpr size_t num_transactions = 200;
+
+	BlockTemplate::Snapshot t;
+
+	t.m_blockHeaderSize = 43;
+	t.m_minerTxOffsetInTemplate = 43;
+	t.m_minerTxSize = 506;
+	t.m_nonceOffset = 39;
+	t.m_extraNonceOffsetInTemplate = t.m_minerTxOffsetInTemplate + 450;
+	t.m_numTransactionHashes = num_transactions;
+	t.m_blockTemplateBlob = random_bytes(rng, t.m_minerTxOffsetInTemplate + t.m_minerTxSize + 1 + num_transactions * HASH_SIZE);
+
+	// Merkle tree of 201 transactions has 8 levels
+	t.m_merkleTreeMainBranch = random_bytes(rng, HASH_SIZE * 8);
+
+	t.calc_miner_tx_keccak_state();
+
+	std::vector<uint8_t> blobs;
+
+	for (uint32_t connections : { 1, 100, 5000 }) {
+		const std::string params = "connections=" + std::to_string(connections);
+		const uint64_t iterations = std::max<uint64_t>(20000 / connections, 10);
+
+		run("BlockTemplate::get_hashing_blobs", params.c_str(), iterations, [&t, &blobs, connections](uint64_t i)
+			{
+				consume(t.get_hashing_blobs(static_cast<uint32_t>(i * connections), connections, blobs));
+			});
+	}
+}
+
+void bench_wallet()
+{
+	const char address[] = "49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6";
+
+	Wallet w(address);
+
+	run("Wallet::decode", "mainnet", 100000, [&w, &address](uint64_t)
+		{
+			consume(w.decode(address) ? 1 : 0);
+		});
+}
+
+void bench_check_pow(std::mt19937_64& rng)
+{
+	constexpr size_t N = 1024;
+
+	std::vector<hash> hashes(N);
+	for (hash& h : hashes) {
+		for (uint8_t& b : h.h) {
+			b = static_cast<uint8_t>(rng());
+		}
+	}
+
+	const difficulty_type diffs[2] = { difficulty_type(300000000000ULL, 0), difficulty_type(0, 1) };
+	const char* params[2] = { "difficulty=300000000000", "difficulty=2^64" };
+
+	for (int k = 0; k < 2; ++k) {
+		const difficulty_type& diff = diffs[k];
+
+		run("difficulty_type::check_pow", params[k], 1000000, [&hashes, &diff](uint64_t i)
+			{
+				consume(diff.check_pow(hashes[i % N]) ? 1 : 0);
+			});
+	}
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	argc_filter = argc;
+	argv_filter = argv;
+
+	init_crypto_cache();
+
+	// Fixed seed, so every run uses the same data
+	std::mt19937_64 rng(0x5032506f6f6cULL);
+
+	std::cout << "{\"arch\":\"" << ARCH << "\",\"compiler\":\"" << COMPILER << "\",\"threads\":" << std::thread::hardware_concurrency() << ",\"benchmarks\":[";
+
+	bench_keccak(rng);
+	const bool ok = bench_deserialize();
+	bench_shares(rng);
+	bench_crypto();
+	bench_hashing_blobs(rng);
+	bench_wallet();
+	bench_check_pow(rng);
+
+	std::cout << "\n]}" << std::endl;
+
+	destroy_crypto_cache();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,105 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "block_cache.h"
+#include "keccak.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "gtest/gtest.h"
+#include <fstream>
+
+namespace p2pool {
+
+TEST(block_cache, corrupt_compact_record)
+{
+	SideChain sidechain(nullptr, NetworkType::Mainnet, "mainnet test 2");
+
+	PoolBlock b;
+	{
+		std::ifstream f("mainnet_test2_block.dat", std::ios::binary | std::ios::ate);
+		ASSERT_EQ(f.good() && f.is_open(), true);
+
+		std::vector<uint8_t> buf(f.tellg());
+		f.seekg(0);
+		f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+		ASSERT_EQ(f.good(), true);
+
+		ASSERT_EQ(b.deserialize(buf.data(), buf.size(), sidechain, nullptr), 0);
+		ASSERT_GT(b.m_transactions.size(), 1U);
+	}
+
+	remove("p2pool.cache");
+	remove("p2pool.cache.1");
+
+	// Segment with one compact record: it adds a transaction to the table, then refers to a transaction which doesn't exist
+	{
+		std::vector<uint8_t> record(sizeof(uint32_t) * 2, 0);
+		record.push_back(1);
+		record.insert(record.end(), sizeof(uint64_t) * 2 + HASH_SIZE, 0);
+		writeVarint(0U, record);
+		writeVarint(2U, record);
+		writeVarint(0U, record);
+		record.insert(record.end(), HASH_SIZE, 0xAB);
+		writeVarint(100U, record);
+
+		const uint32_t size = static_cast<uint32_t>(record.size() - sizeof(uint32_t) * 2);
+		hash h;
+		keccak(record.data() + sizeof(uint32_t) * 2, static_cast<int>(size), h.h, HASH_SIZE);
+		memcpy(record.data(), &size, sizeof(uint32_t));
+		memcpy(record.data() + sizeof(uint32_t), h.h, sizeof(uint32_t));
+
+		uint8_t header[24] = { 'P', '2', 'P', 'C', 'A', 'C', 'H', 'E', 4 };
+
+		std::ofstream f("p2pool.cache.0", std::ios::binary | std::ios::trunc);
+		f.write(reinterpret_cast<const char*>(header), sizeof(header));
+		f.write(reinterpret_cast<const char*>(record.data()), record.size());
+		ASSERT_EQ(f.good(), true);
+	}
+
+	// The corrupt record is dropped, the second copy of the block refers to transactions from the first one
+	{
+		BlockCache cache(sidechain);
+
+		std::vector<PoolBlock*> blocks;
+		cache.load_all(sidechain, blocks);
+		ASSERT_TRUE(blocks.empty());
+
+		cache.store(b);
+		cache.store(b);
+		cache.flush();
+	}
+
+	{
+		BlockCache cache(sidechain);
+
+		std::vector<PoolBlock*> blocks;
+		cache.load_all(sidechain, blocks);
+		ASSERT_EQ(blocks.size(), 2U);
+
+		for (PoolBlock* block : blocks) {
+			ASSERT_EQ(block->m_sidechainId, b.m_sidechainId);
+			ASSERT_EQ(block->m_blobs->m_full, b.m_blobs->m_full);
+			delete block;
+		}
+	}
+
+	remove("p2pool.cache.0");
+	remove("p2pool.cache.1");
+}
+
+}
@@ -92,4 +92,124 @@ TEST(crypto, derivation)
 	destroy_crypto_cache();
 }
 
+TEST(crypto, cache_aging)
+{
+	init_crypto_cache();
+
+	hash spend_key, block_id, pub, sec, pub2, sec2;
+	spend_key.h[0] = 1;
+
+	get_tx_keys(pub, sec, spend_key, block_id);
+	get_tx_keys(pub2, sec2, spend_key, block_id);
+
+	ASSERT_EQ(pub, pub2);
+	ASSERT_EQ(sec, sec2);
+
+	CryptoCacheStats stats = get_crypto_cache_stats();
+	ASSERT_EQ(stats.m_txKeys.m_size, 1);
+	ASSERT_EQ(stats.m_txKeys.m_hits, 1);
+	ASSERT_EQ(stats.m_txKeys.m_misses, 1);
+
+	// Entries used in the previous epoch are kept, entries not used for a whole epoch are evicted
+	age_crypto_cache();
+	ASSERT_EQ(get_crypto_cache_stats().m_txKeys.m_size, 1);
+
+	age_crypto_cache();
+	stats = get_crypto_cache_stats();
+	ASSERT_EQ(stats.m_txKeys.m_size, 0);
+	ASSERT_EQ(stats.m_txKeys.m_evictions, 1);
+
+	// All these keys start with the same spend key, so they go to the same shard which can't hold all of them
+	const uint64_t n = stats.m_txKeys.m_capacity / 32;
+	for (uint64_t i = 0; i < n; ++i) {
+		memcpy(block_id.h, &i, sizeof(i));
+		get_tx_keys(pub, sec, spend_key, block_id);
+	}
+
+	stats = get_crypto_cache_stats();
+	ASSERT_LT(stats.m_txKeys.m_size, n);
+	ASSERT_EQ(stats.m_txKeys.m_size + stats.m_txKeys.m_evictions, n + 1);
+
+	destroy_crypto_cache();
+}
+
+TEST(crypto, wallet_key_table)
+{
+	// More than one batch, output indices don't start from 0
+	constexpr size_t N = 100;
+	constexpr size_t FIRST_OUTPUT = 5;
+
+	std::vector<hash> spend_keys(N), view_keys(N);
+	std::vector<WalletKeyTable*> tables(N);
+
+	for (size_t i = 0; i < N; ++i) {
+		hash sec;
+		generate_keys(spend_keys[i], sec);
+		generate_keys(view_keys[i], sec);
+		tables[i] = create_wallet_key_table(spend_keys[i], view_keys[i]);
+		ASSERT_NE(tables[i], nullptr);
+	}
+
+	hash bad;
+	bad.h[0] = 2;
+	ASSERT_EQ(create_wallet_key_table(bad, view_keys[0]), nullptr);
+
+	hash txkey_pub, txkey_sec;
+	generate_keys(txkey_pub, txkey_sec);
+
+	// The table can't be used for such scalars, but the result must still be the same
+	hash txkey_sec2 = txkey_sec;
+	txkey_sec2.h[HASH_SIZE - 1] |= 0x80;
+
+	for (const hash& key : { txkey_sec, txkey_sec2 }) {
+		std::vector<hash> derivations(N), eph_public_keys(N);
+		std::vector<uint8_t> view_tags(N);
+
+		// Output skipped in the batch
+		WalletKeyTable* skipped = tables[N / 2];
+		tables[N / 2] = nullptr;
+
+		// Every path starts with an empty cache
+		init_crypto_cache();
+		generate_key_derivations(tables.data(), key, FIRST_OUTPUT, N, derivations.data(), view_tags.data());
+		derive_public_keys(derivations.data(), tables.data(), FIRST_OUTPUT, N, eph_public_keys.data());
+		destroy_crypto_cache();
+
+		tables[N / 2] = skipped;
+		ASSERT_TRUE(derivations[N / 2].empty());
+		ASSERT_TRUE(eph_public_keys[N / 2].empty());
+
+		for (size_t i = 0; i < N; ++i) {
+			const size_t output_index = FIRST_OUTPUT + i;
+
+			hash derivation, derivation2, eph_public_key, eph_public_key2;
+			uint8_t view_tag, view_tag2;
+
+			init_crypto_cache();
+			ASSERT_TRUE(generate_key_derivation(*tables[i], key, output_index, derivation, view_tag));
+			derive_public_key(derivation, output_index, *tables[i], eph_public_key);
+			destroy_crypto_cache();
+
+			init_crypto_cache();
+			ASSERT_TRUE(generate_key_derivation(view_keys[i], key, output_index, derivation2, view_tag2));
+			ASSERT_TRUE(derive_public_key(derivation2, output_index, spend_keys[i], eph_public_key2));
+			destroy_crypto_cache();
+
+			ASSERT_EQ(derivation, derivation2);
+			ASSERT_EQ(view_tag, view_tag2);
+			ASSERT_EQ(eph_public_key, eph_public_key2);
+
+			if (i != N / 2) {
+				ASSERT_EQ(derivations[i], derivation2);
+				ASSERT_EQ(view_tags[i], view_tag2);
+				ASSERT_EQ(eph_public_keys[i], eph_public_key2);
+			}
+		}
+	}
+
+	for (WalletKeyTable* t : tables) {
+		destroy_wallet_key_table(t);
+	}
+}
+
 }
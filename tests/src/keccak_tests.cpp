@@ -55,4 +55,75 @@ TEST(keccak, hashing)
 	check(v.data(), v.size(), "fadae6b49f129bbb812be8407b7b2894f34aecf6dbd1f9b0f0c7e9853098fc96");
 }
 
+TEST(keccak, incremental)
+{
+	uint8_t data[600];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = static_cast<uint8_t>(i * 7 + 3);
+	}
+
+	for (int size = 0; size <= static_cast<int>(sizeof(data)); size += 17) {
+		hash expected;
+		keccak(data, size, expected.h, HASH_SIZE);
+
+		// Absorb different prefixes first, then finish with the rest of data
+		for (int split = 0; split <= size; split += 31) {
+			uint64_t st[25] = {};
+
+			const uint8_t* p = data;
+			int n = split;
+			keccak_step(p, n, st);
+
+			const int absorbed = static_cast<int>(p - data);
+			ASSERT_EQ(absorbed % KeccakParams::HASH_DATA_AREA, 0);
+			ASSERT_EQ(absorbed + n, split);
+
+			hash output;
+			keccak_finish(p, size - absorbed, st, output.h);
+			ASSERT_EQ(output, expected);
+		}
+	}
+}
+
+TEST(keccak, batch)
+{
+	std::vector<uint8_t> data(300 * 20);
+	for (size_t i = 0; i < data.size(); ++i) {
+		data[i] = static_cast<uint8_t>(i * 13 + 5);
+	}
+
+	const int default_lanes = keccak_batch_lanes();
+
+	for (int lanes : { 1, 2, 4, 8 }) {
+		if (!keccak_batch_set_lanes(lanes)) {
+			continue;
+		}
+		ASSERT_EQ(keccak_batch_lanes(), lanes);
+
+		for (int inlen : { 0, 1, 32, 64, 135, 136, 137, 272, 300 }) {
+			for (size_t count = 0; count <= 20; ++count) {
+				std::vector<hash> expected(count);
+				for (size_t i = 0; i < count; ++i) {
+					keccak(data.data() + i * inlen, inlen, expected[i].h, HASH_SIZE);
+				}
+
+				std::vector<hash> output(count);
+				keccak_batch(data.data(), inlen, output.empty() ? nullptr : output[0].h, count);
+				ASSERT_EQ(output, expected);
+
+				// In-place, like merkle tree levels
+				if (inlen >= static_cast<int>(HASH_SIZE)) {
+					std::vector<uint8_t> buf(data.begin(), data.begin() + count * inlen);
+					keccak_batch(buf.data(), inlen, buf.data(), count);
+					ASSERT_EQ(memcmp(buf.data(), expected.data(), count * HASH_SIZE), 0);
+				}
+			}
+		}
+	}
+
+	ASSERT_FALSE(keccak_batch_set_lanes(3));
+	ASSERT_TRUE(keccak_batch_set_lanes(0));
+	ASSERT_EQ(keccak_batch_lanes(), default_lanes);
+}
+
 }
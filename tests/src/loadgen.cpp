@@ -0,0 +1,1391 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "keccak.h"
+#include "side_chain.h"
+#include "stratum_server.h"
+#include "p2p_server.h"
+#include "json_parsers.h"
+#include <rapidjson/document.h>
+#include <fstream>
+#include <random>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+// Synthetic load for a running p2pool node: simulated stratum miners and P2P peers
+// Prints progress to stderr and one JSON document with the results to stdout
+
+static constexpr char log_category_prefix[] = "LoadGen ";
+
+static constexpr int DEFAULT_BACKLOG = 16;
+
+#include "tcp_server.inl"
+
+void p2pool_usage()
+{
+	printf("Usage: p2pool_loadgen [options]\n\n"
+		"--stratum          IP:port of the stratum server, default 127.0.0.1:3333\n"
+		"--miners           Number of simulated miners, default 1000\n"
+		"--login            Login sent by every miner, default loadgen\n"
+		"--diff             Fixed share difficulty (login+diff), default 10000\n"
+		"--share-rate       Shares per second per miner, default 0.1\n"
+		"--invalid          Fraction of low diff shares, default 0\n"
+		"--stale            Fraction of shares for the previous job, default 0\n"
+		"--pow-shares       Fraction of shares which must go through the PoW check, default 0\n"
+		"--pow-diff         Difficulty of these shares, it must be above sidechain and below mainchain difficulty\n"
+		"--p2p              IP:port of the P2P server, default 127.0.0.1:37889\n"
+		"--p2p-peers        Number of simulated P2P peers, default 0\n"
+		"--p2p-rate         Duplicate broadcasts per second per peer, default 1\n"
+		"--mini             Simulated peers join p2pool-mini\n"
+		"--duration         Test duration in seconds, default 60\n"
+		"--report           Progress report interval in seconds, default 10\n"
+		"--server-pid       Process ID of p2pool to measure its CPU usage (Linux only)\n"
+		"--seed             Random seed, default 1\n"
+		"--loglevel         Log level, default 1\n"
+		"--help             Show this help message\n"
+	);
+}
+
+namespace p2pool {
+
+namespace loadgen {
+
+struct Options
+{
+	bool m_stratumV6 = false;
+	std::string m_stratumHost = "127.0.0.1";
+	int m_stratumPort = DEFAULT_STRATUM_PORT;
+	uint32_t m_miners = 1000;
+	std::string m_login = "loadgen";
+	uint64_t m_diff = 10000;
+	double m_shareRate = 0.1;
+	double m_invalidShares = 0.0;
+	double m_staleShares = 0.0;
+	double m_powShares = 0.0;
+	uint64_t m_powDiff = 0;
+
+	bool m_p2pV6 = false;
+	std::string m_p2pHost = "127.0.0.1";
+	int m_p2pPort = DEFAULT_P2P_PORT;
+	uint32_t m_p2pPeers = 0;
+	double m_p2pRate = 1.0;
+	bool m_mini = false;
+
+	uint32_t m_duration = 60;
+	uint32_t m_report = 10;
+	int m_serverPid = 0;
+	uint64_t m_seed = 1;
+};
+
+static uint64_t microseconds_now()
+{
+	using namespace std::chrono;
+	return static_cast<uint64_t>(duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+// Seconds between events of a Poisson process with the given rate
+static uint64_t next_interval_us(std::mt19937_64& rng, double rate)
+{
+	if (rate <= 0.0) {
+		return std::numeric_limits<uint64_t>::max() / 2;
+	}
+	std::exponential_distribution<double> d(rate);
+	return static_cast<uint64_t>(d(rng) * 1e6);
+}
+
+// Latency samples in microseconds, added from event loop threads and read from the main thread
+class LatencySamples : public nocopy_nomove
+{
+public:
+	LatencySamples() { uv_mutex_init_checked(&m_lock); }
+	~LatencySamples() { uv_mutex_destroy(&m_lock); }
+
+	void add(uint64_t us)
+	{
+		MutexLock lock(m_lock);
+		m_samples.push_back(static_cast<uint32_t>(std::min<uint64_t>(us, std::numeric_limits<uint32_t>::max())));
+	}
+
+	void write_json(std::ostream& s) const
+	{
+		std::vector<uint32_t> samples;
+		{
+			MutexLock lock(m_lock);
+			samples = m_samples;
+		}
+		std::sort(samples.begin(), samples.end());
+
+		auto percentile = [&samples](size_t p) -> uint32_t { return samples.empty() ? 0 : samples[std::min(samples.size() * p / 100, samples.size() - 1)]; };
+
+		s << "{\"count\":" << samples.size()
+			<< ",\"p50_us\":" << percentile(50)
+			<< ",\"p90_us\":" << percentile(90)
+			<< ",\"p99_us\":" << percentile(99)
+			<< ",\"max_us\":" << (samples.empty() ? 0 : samples.back())
+			<< '}';
+	}
+
+private:
+	mutable uv_mutex_t m_lock;
+	std::vector<uint32_t> m_samples;
+};
+
+// Time between the first and every other delivery of the same item, it shows how long the server takes to send it to everyone
+class FanOutTracker
+{
+public:
+	// Returns true if it's the first delivery
+	bool add(const std::string& key, uint64_t now, LatencySamples& samples)
+	{
+		auto it = m_firstSeen.find(key);
+		if (it == m_firstSeen.end()) {
+			if (m_firstSeen.size() >= 1024) {
+				m_firstSeen.clear();
+			}
+			m_firstSeen.emplace(key, now);
+			return true;
+		}
+
+		samples.add(now - it->second);
+		return false;
+	}
+
+private:
+	unordered_map<std::string, uint64_t> m_firstSeen;
+};
+
+// Simulated stratum miners, all connections run in one event loop
+class StratumLoad : public TCPServer<STRATUM_BUF_SIZE, STRATUM_BUF_SIZE>
+{
+public:
+	enum class ShareType { VALID, INVALID, STALE, POW, COUNT };
+	enum class Outcome { OK, LOW_DIFF, STALE, INVALID_JOB_ID, INVALID_POW, OTHER, COUNT };
+
+	static constexpr const char* share_type_names[static_cast<size_t>(ShareType::COUNT)] = { "valid", "invalid", "stale", "pow" };
+	static constexpr const char* outcome_names[static_cast<size_t>(Outcome::COUNT)] = { "ok", "low_diff", "stale", "invalid_job_id", "invalid_pow", "other" };
+
+	explicit StratumLoad(const Options& options);
+	~StratumLoad();
+
+	void write_json(std::ostream& s) const;
+	void print_progress() const;
+
+	struct Miner : public Client
+	{
+		Miner();
+		FORCEINLINE ~Miner() {}
+
+		static Client* allocate() { return new Miner(); }
+
+		void reset() override;
+		bool on_connect() override;
+		bool on_read(char* data, uint32_t size) override;
+		void on_disconnected() override;
+
+		bool process_message(char* line);
+		void on_job(const rapidjson::Value& job, uint64_t now, bool login);
+		bool submit_share(uint64_t now);
+
+		// Same as StratumClient::JOBS_SIZE
+		enum { JOB_HISTORY = 4 };
+
+		struct Job
+		{
+			char m_id[16];
+			uint64_t m_target;
+		};
+
+		struct PendingShare
+		{
+			uint32_t m_id;
+			ShareType m_type;
+			uint64_t m_sentTime;
+		};
+
+		char m_rpcId[32];
+		Job m_jobs[JOB_HISTORY];
+		uint32_t m_numJobs;
+
+		uint64_t m_loginTime;
+		uint64_t m_nextShareTime;
+		uint32_t m_nonce;
+		uint32_t m_nextRequestId;
+
+		// Mirrors the server's score, so deliberately bad shares never get this miner disconnected
+		int32_t m_score;
+
+		std::vector<PendingShare> m_pendingShares;
+	};
+
+private:
+	static void on_timer(uv_timer_t* timer) { reinterpret_cast<StratumLoad*>(timer->data)->on_tick(); }
+	void on_tick();
+	void on_shutdown() override;
+
+	void on_connect_failed(bool is_v6, const raw_ip& ip, int port) override;
+	void connect_next();
+
+	ShareType pick_share_type(const Miner* miner);
+
+	const Options& m_options;
+	std::mt19937_64 m_rng;
+
+	uv_timer_t m_timer;
+
+	uint32_t m_connecting;
+	uint64_t m_nextConnectTime;
+
+	FanOutTracker m_jobFanOut;
+
+	// Used only in this server's event loop thread
+	std::vector<Miner*> m_dueMiners;
+
+public:
+	LatencySamples m_loginLatency;
+	LatencySamples m_jobDelivery;
+	LatencySamples m_shareAck;
+
+	std::atomic<uint64_t> m_numConnects;
+	std::atomic<uint64_t> m_numConnectFailures;
+	std::atomic<uint64_t> m_numDisconnects;
+	std::atomic<uint64_t> m_numJobs;
+	std::atomic<uint64_t> m_numTemplates;
+
+	std::atomic<uint64_t> m_sharesSent[static_cast<size_t>(ShareType::COUNT)];
+	std::atomic<uint64_t> m_shareResults[static_cast<size_t>(ShareType::COUNT)][static_cast<size_t>(Outcome::COUNT)];
+};
+
+constexpr const char* StratumLoad::share_type_names[];
+constexpr const char* StratumLoad::outcome_names[];
+
+static uint64_t parse_target(const char* s, size_t size)
+{
+	uint8_t bytes[8] = {};
+	if ((size != 8) && (size != 16)) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < size / 2; ++i) {
+		uint32_t d[2];
+		if (!from_hex(s[i * 2], d[0]) || !from_hex(s[i * 2 + 1], d[1])) {
+			return 0;
+		}
+		bytes[i] = static_cast<uint8_t>((d[0] << 4) | d[1]);
+	}
+
+	uint64_t target;
+	memcpy(&target, bytes, sizeof(target));
+
+	// 4-byte targets are interpreted the same way as XMRig does it
+	if (size == 8) {
+		const uint32_t t = static_cast<uint32_t>(target);
+		return t ? (std::numeric_limits<uint64_t>::max() / (std::numeric_limits<uint32_t>::max() / t)) : 0;
+	}
+
+	return target;
+}
+
+StratumLoad::StratumLoad(const Options& options)
+	: TCPServer(Miner::allocate)
+	, m_options(options)
+	, m_rng(options.m_seed)
+	, m_timer{}
+	, m_connecting(0)
+	, m_nextConnectTime(0)
+	, m_numConnects(0)
+	, m_numConnectFailures(0)
+	, m_numDisconnects(0)
+	, m_numJobs(0)
+	, m_numTemplates(0)
+	, m_sharesSent{}
+	, m_shareResults{}
+{
+	int err = uv_timer_init(&m_loop, &m_timer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+	m_timer.data = this;
+
+	err = uv_timer_start(&m_timer, on_timer, 10, 10);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	start_event_loop();
+}
+
+StratumLoad::~StratumLoad()
+{
+	shutdown_tcp();
+}
+
+void StratumLoad::on_shutdown()
+{
+	uv_timer_stop(&m_timer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+}
+
+void StratumLoad::on_connect_failed(bool, const raw_ip&, int)
+{
+	--m_connecting;
+	++m_numConnectFailures;
+
+	// Don't flood a server which doesn't accept connections
+	m_nextConnectTime = microseconds_now() + 1000000;
+}
+
+void StratumLoad::connect_next()
+{
+	// TCPServer allows only one pending connection per IP, so connections are made one by one
+	if ((m_connecting > 0) || (m_numConnections + m_connecting >= m_options.m_miners) || (microseconds_now() < m_nextConnectTime)) {
+		return;
+	}
+
+	if (connect_to_peer(m_options.m_stratumV6, m_options.m_stratumHost.c_str(), m_options.m_stratumPort)) {
+		++m_connecting;
+	}
+}
+
+void StratumLoad::on_tick()
+{
+	connect_next();
+
+	const uint64_t now = microseconds_now();
+
+	m_dueMiners.clear();
+	{
+		MutexLock lock(m_clientsListLock);
+
+		for (Miner* c = static_cast<Miner*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<Miner*>(c->m_next)) {
+			if (c->m_numJobs && (now >= c->m_nextShareTime)) {
+				m_dueMiners.push_back(c);
+			}
+		}
+	}
+
+	for (Miner* c : m_dueMiners) {
+		c->m_nextShareTime = now + next_interval_us(m_rng, m_options.m_shareRate);
+		if (!c->submit_share(now)) {
+			c->close();
+		}
+	}
+}
+
+StratumLoad::ShareType StratumLoad::pick_share_type(const Miner* miner)
+{
+	std::uniform_real_distribution<double> d(0.0, 1.0);
+	double r = d(m_rng);
+
+	if (r < m_options.m_invalidShares) {
+		// Server's ban threshold is -15 points, a bad share costs 5 points
+		return (miner->m_score >= 10) ? ShareType::INVALID : ShareType::VALID;
+	}
+	r -= m_options.m_invalidShares;
+
+	if (r < m_options.m_staleShares) {
+		return (miner->m_numJobs > 1) ? ShareType::STALE : ShareType::VALID;
+	}
+	r -= m_options.m_staleShares;
+
+	if ((r < m_options.m_powShares) && m_options.m_powDiff) {
+		return (miner->m_score >= 10) ? ShareType::POW : ShareType::VALID;
+	}
+
+	return ShareType::VALID;
+}
+
+void StratumLoad::print_progress() const
+{
+	uint64_t sent = 0, ok = 0;
+	for (size_t i = 0; i < static_cast<size_t>(ShareType::COUNT); ++i) {
+		sent += m_sharesSent[i];
+		ok += m_shareResults[i][static_cast<size_t>(Outcome::OK)];
+	}
+
+	std::cerr << "stratum: " << m_numConnections.load() << '/' << m_options.m_miners << " miners connected, "
+		<< m_numTemplates.load() << " templates, " << m_numJobs.load() << " jobs, "
+		<< sent << " shares sent, " << ok << " accepted" << std::endl;
+}
+
+void StratumLoad::write_json(std::ostream& s) const
+{
+	s << "{\"miners\":" << m_options.m_miners
+		<< ",\"connected\":" << m_numConnections.load()
+		<< ",\"connects\":" << m_numConnects.load()
+		<< ",\"connect_failures\":" << m_numConnectFailures.load()
+		<< ",\"disconnects\":" << m_numDisconnects.load()
+		<< ",\"templates\":" << m_numTemplates.load()
+		<< ",\"jobs\":" << m_numJobs.load()
+		<< ",\"login_latency\":";
+	m_loginLatency.write_json(s);
+	s << ",\"job_delivery\":";
+	m_jobDelivery.write_json(s);
+	s << ",\"share_ack\":";
+	m_shareAck.write_json(s);
+
+	s << ",\"shares\":{";
+	for (size_t i = 0; i < static_cast<size_t>(ShareType::COUNT); ++i) {
+		s << (i ? "," : "") << '"' << share_type_names[i] << "\":{\"sent\":" << m_sharesSent[i].load();
+		for (size_t j = 0; j < static_cast<size_t>(Outcome::COUNT); ++j) {
+			s << ",\"" << outcome_names[j] << "\":" << m_shareResults[i][j].load();
+		}
+		s << '}';
+	}
+	s << "}}";
+}
+
+StratumLoad::Miner::Miner()
+	: m_rpcId{}
+	, m_jobs{}
+	, m_numJobs(0)
+	, m_loginTime(0)
+	, m_nextShareTime(0)
+	, m_nonce(0)
+	, m_nextRequestId(1)
+	, m_score(0)
+{
+}
+
+void StratumLoad::Miner::reset()
+{
+	Client::reset();
+
+	memset(m_rpcId, 0, sizeof(m_rpcId));
+	memset(m_jobs, 0, sizeof(m_jobs));
+	m_numJobs = 0;
+	m_loginTime = 0;
+	m_nextShareTime = 0;
+	m_nonce = 0;
+	m_nextRequestId = 1;
+	m_score = 0;
+	m_pendingShares.clear();
+}
+
+bool StratumLoad::Miner::on_connect()
+{
+	StratumLoad* owner = static_cast<StratumLoad*>(m_owner);
+
+	--owner->m_connecting;
+	++owner->m_numConnects;
+
+	m_loginTime = microseconds_now();
+	m_nextShareTime = m_loginTime + next_interval_us(owner->m_rng, owner->m_options.m_shareRate);
+
+	const uint32_t id = m_nextRequestId++;
+
+	const bool result = owner->send(this,
+		[owner, id](void* buf, size_t buf_size)
+		{
+			log::Stream s(buf, buf_size);
+			s << "{\"id\":" << id << ",\"jsonrpc\":\"2.0\",\"method\":\"login\",\"params\":{\"login\":\"" << owner->m_options.m_login.c_str()
+				<< '+' << owner->m_options.m_diff << "\",\"pass\":\"x\",\"agent\":\"p2pool-loadgen\"}}\n";
+			return s.m_pos;
+		});
+
+	// The next connection can start now
+	owner->connect_next();
+
+	return result;
+}
+
+bool StratumLoad::Miner::on_read(char* data, uint32_t size)
+{
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+		LOGERR(1, "miner: invalid data pointer or size in on_read()");
+		return false;
+	}
+	m_numRead += size;
+
+	char* line_start = m_readBuf;
+	for (char* c = data; c < m_readBuf + m_numRead; ++c) {
+		if (*c == '\n') {
+			*c = '\0';
+			if (!process_message(line_start)) {
+				return false;
+			}
+			line_start = c + 1;
+		}
+	}
+
+	if (line_start != m_readBuf) {
+		m_numRead = static_cast<uint32_t>(m_readBuf + m_numRead - line_start);
+		if (m_numRead > 0) {
+			memmove(m_readBuf, line_start, m_numRead);
+		}
+	}
+	else if (m_numRead >= sizeof(m_readBuf)) {
+		LOGWARN(1, "server sent a too long line");
+		return false;
+	}
+
+	return true;
+}
+
+void StratumLoad::Miner::on_disconnected()
+{
+	++static_cast<StratumLoad*>(m_owner)->m_numDisconnects;
+}
+
+bool StratumLoad::Miner::process_message(char* line)
+{
+	StratumLoad* owner = static_cast<StratumLoad*>(m_owner);
+	const uint64_t now = microseconds_now();
+
+	rapidjson::Document doc;
+	if (doc.ParseInsitu(line).HasParseError() || !doc.IsObject()) {
+		LOGWARN(1, "server sent invalid JSON");
+		return false;
+	}
+
+	// New job: {"jsonrpc":"2.0","method":"job","params":{...}}
+	const char* method = nullptr;
+	if (parseValue(doc, "method", method)) {
+		if ((strcmp(method, "job") == 0) && doc.HasMember("params")) {
+			on_job(doc["params"], now, false);
+		}
+		else {
+			LOGWARN(4, "server sent an unknown method: " << method);
+		}
+		return true;
+	}
+
+	if (!doc.HasMember("id") || !doc["id"].IsUint()) {
+		LOGWARN(4, "server sent a message without id");
+		return true;
+	}
+
+	const uint32_t id = doc["id"].GetUint();
+
+	const auto error = doc.FindMember("error");
+	const bool has_error = (error != doc.MemberEnd()) && error->value.IsObject();
+
+	const auto result = doc.FindMember("result");
+	const bool has_result = (result != doc.MemberEnd()) && result->value.IsObject();
+
+	// Login response: {"id":1,"jsonrpc":"2.0","result":{"id":"...","job":{...},...}}
+	if (!*m_rpcId) {
+		const char* rpc_id = nullptr;
+
+		if (has_error || !has_result || !parseValue(result->value, "id", rpc_id) || (strlen(rpc_id) >= sizeof(m_rpcId)) || !result->value.HasMember("job")) {
+			LOGWARN(1, "login failed");
+			return false;
+		}
+
+		strcpy(m_rpcId, rpc_id);
+
+		owner->m_loginLatency.add(now - m_loginTime);
+		on_job(result->value["job"], now, true);
+		return true;
+	}
+
+	// Share response: {"id":N,"jsonrpc":"2.0","error":null,"result":{"status":"OK"}} or {"id":N,"jsonrpc":"2.0","error":{"message":"..."}}
+	auto it = std::find_if(m_pendingShares.begin(), m_pendingShares.end(), [id](const PendingShare& s) { return s.m_id == id; });
+	if (it == m_pendingShares.end()) {
+		return true;
+	}
+
+	const PendingShare share = *it;
+	m_pendingShares.erase(it);
+
+	owner->m_shareAck.add(now - share.m_sentTime);
+
+	Outcome outcome = Outcome::OTHER;
+	const char* status = nullptr;
+	const char* message = nullptr;
+
+	if (!has_error && has_result && parseValue(result->value, "status", status) && (strcmp(status, "OK") == 0)) {
+		outcome = Outcome::OK;
+		++m_score;
+	}
+	else if (has_error && parseValue(error->value, "message", message)) {
+		if (strcmp(message, "Low diff share") == 0) {
+			outcome = Outcome::LOW_DIFF;
+			m_score -= 5;
+		}
+		else if (strcmp(message, "Stale share") == 0) {
+			outcome = Outcome::STALE;
+		}
+		else if (strcmp(message, "Invalid job id") == 0) {
+			outcome = Outcome::INVALID_JOB_ID;
+		}
+		else if (strcmp(message, "Invalid PoW") == 0) {
+			outcome = Outcome::INVALID_POW;
+			m_score -= 5;
+		}
+	}
+
+	++owner->m_shareResults[static_cast<size_t>(share.m_type)][static_cast<size_t>(outcome)];
+	return true;
+}
+
+void StratumLoad::Miner::on_job(const rapidjson::Value& job, uint64_t now, bool login)
+{
+	StratumLoad* owner = static_cast<StratumLoad*>(m_owner);
+
+	const char* blob = nullptr;
+	const char* job_id = nullptr;
+	const char* target = nullptr;
+
+	if (!parseValue(job, "blob", blob) || !parseValue(job, "job_id", job_id) || !parseValue(job, "target", target)) {
+		LOGWARN(1, "server sent an invalid job");
+		return;
+	}
+
+	const size_t job_id_size = strlen(job_id);
+	if (job_id_size >= sizeof(Job::m_id)) {
+		LOGWARN(1, "server sent a too long job id");
+		return;
+	}
+
+	Job& j = m_jobs[m_numJobs % JOB_HISTORY];
+	memcpy(j.m_id, job_id, job_id_size + 1);
+	j.m_target = parse_target(target, strlen(target));
+	++m_numJobs;
+
+	++owner->m_numJobs;
+
+	// Jobs for the same template have the same block header (major and minor version, timestamp, prev_id), only the merkle root is different
+	// Login jobs can be for an older template, so they're not counted as deliveries
+	if (!login) {
+		const std::string key(blob, std::min<size_t>(strlen(blob), 78));
+		if (owner->m_jobFanOut.add(key, now, owner->m_jobDelivery)) {
+			++owner->m_numTemplates;
+		}
+	}
+}
+
+bool StratumLoad::Miner::submit_share(uint64_t now)
+{
+	StratumLoad* owner = static_cast<StratumLoad*>(m_owner);
+
+	const ShareType type = owner->pick_share_type(this);
+	const Job& job = m_jobs[(m_numJobs - ((type == ShareType::STALE) ? 2 : 1)) % JOB_HISTORY];
+
+	const uint64_t target = std::max<uint64_t>(job.m_target, 2);
+	uint64_t value;
+
+	switch (type) {
+	case ShareType::INVALID:
+		value = std::numeric_limits<uint64_t>::max();
+		break;
+	case ShareType::POW:
+		value = std::numeric_limits<uint64_t>::max() / owner->m_options.m_powDiff;
+		break;
+	default:
+		// Below the miner's target, but well above sidechain target, so the server doesn't check PoW for it
+		value = target / 2 + owner->m_rng() % (target / 2);
+		break;
+	}
+
+	// Server reads the last 8 bytes of the result as a 64-bit number
+	uint8_t result[HASH_SIZE];
+	for (size_t i = 0; i < HASH_SIZE - sizeof(uint64_t); i += sizeof(uint64_t)) {
+		const uint64_t k = owner->m_rng();
+		memcpy(result + i, &k, sizeof(k));
+	}
+	memcpy(result + HASH_SIZE - sizeof(uint64_t), &value, sizeof(value));
+
+	const uint32_t nonce = m_nonce++;
+	const uint32_t id = m_nextRequestId++;
+
+	m_pendingShares.push_back({ id, type, now });
+	++owner->m_sharesSent[static_cast<size_t>(type)];
+
+	return owner->send(this,
+		[this, id, &job, nonce, &result](void* buf, size_t buf_size)
+		{
+			log::Stream s(buf, buf_size);
+			s << "{\"id\":" << id << ",\"jsonrpc\":\"2.0\",\"method\":\"submit\",\"params\":{\"id\":\"" << static_cast<const char*>(m_rpcId)
+				<< "\",\"job_id\":\"" << static_cast<const char*>(job.m_id)
+				<< "\",\"nonce\":\"" << log::hex_buf(reinterpret_cast<const uint8_t*>(&nonce), sizeof(nonce))
+				<< "\",\"result\":\"" << log::hex_buf(result, HASH_SIZE) << "\"}}\n";
+			return s.m_pos;
+		});
+}
+
+// Simulated P2P peers: they complete the handshake, answer requests with empty responses
+// and send every block broadcast back to the server, plus duplicates of the latest one at a fixed rate
+class P2PLoad : public TCPServer<P2P_BUF_SIZE, P2P_BUF_SIZE>
+{
+public:
+	typedef P2PServer::MessageId MessageId;
+
+	enum {
+		CHALLENGE_SIZE = P2PServer::P2PClient::CHALLENGE_SIZE,
+		CHALLENGE_DIFFICULTY = P2PServer::P2PClient::CHALLENGE_DIFFICULTY,
+	};
+
+	explicit P2PLoad(const Options& options);
+	~P2PLoad();
+
+	void write_json(std::ostream& s) const;
+	void print_progress() const;
+
+	struct Peer : public Client
+	{
+		Peer();
+		FORCEINLINE ~Peer() {}
+
+		static Client* allocate() { return new Peer(); }
+
+		void reset() override;
+		bool on_connect() override;
+		bool on_read(char* data, uint32_t size) override;
+		void on_disconnected() override;
+
+		bool on_message(MessageId id, const uint8_t* data, uint32_t size);
+		bool send_handshake_solution(const uint8_t* challenge);
+		bool send_broadcast(const SharedBuf& blob);
+
+		uint64_t m_peerId;
+		bool m_handshakeComplete;
+		uint64_t m_nextBroadcastTime;
+	};
+
+private:
+	static void on_timer(uv_timer_t* timer) { reinterpret_cast<P2PLoad*>(timer->data)->on_tick(); }
+	void on_tick();
+	void on_shutdown() override;
+
+	void on_connect_failed(bool is_v6, const raw_ip& ip, int port) override;
+	void connect_next();
+
+	const Options& m_options;
+	std::mt19937_64 m_rng;
+	std::vector<uint8_t> m_consensusId;
+
+	uv_timer_t m_timer;
+
+	uint32_t m_connecting;
+	uint64_t m_nextConnectTime;
+
+	FanOutTracker m_broadcastFanOut;
+
+	// Used only in this server's event loop thread
+	SharedBuf m_lastBroadcast;
+	std::vector<Peer*> m_duePeers;
+
+public:
+	LatencySamples m_broadcastDelivery;
+
+	std::atomic<uint64_t> m_numConnects;
+	std::atomic<uint64_t> m_numConnectFailures;
+	std::atomic<uint64_t> m_numDisconnects;
+	std::atomic<uint64_t> m_numHandshakes;
+	std::atomic<uint64_t> m_numBlocks;
+	std::atomic<uint64_t> m_broadcastsReceived;
+	std::atomic<uint64_t> m_broadcastsSent;
+};
+
+P2PLoad::P2PLoad(const Options& options)
+	: TCPServer(Peer::allocate)
+	, m_options(options)
+	, m_rng(options.m_seed + 1)
+	, m_timer{}
+	, m_connecting(0)
+	, m_nextConnectTime(0)
+	, m_numConnects(0)
+	, m_numConnectFailures(0)
+	, m_numDisconnects(0)
+	, m_numHandshakes(0)
+	, m_numBlocks(0)
+	, m_broadcastsReceived(0)
+	, m_broadcastsSent(0)
+{
+	{
+		SideChain sidechain(nullptr, NetworkType::Mainnet, options.m_mini ? "mini" : nullptr);
+		m_consensusId = sidechain.consensus_id();
+	}
+
+	int err = uv_timer_init(&m_loop, &m_timer);
+	if (err) {
+		LOGERR(1, "failed to create timer, error " << uv_err_name(err));
+		panic();
+	}
+	m_timer.data = this;
+
+	err = uv_timer_start(&m_timer, on_timer, 10, 10);
+	if (err) {
+		LOGERR(1, "failed to start timer, error " << uv_err_name(err));
+		panic();
+	}
+
+	start_event_loop();
+}
+
+P2PLoad::~P2PLoad()
+{
+	shutdown_tcp();
+}
+
+void P2PLoad::on_shutdown()
+{
+	uv_timer_stop(&m_timer);
+	uv_close(reinterpret_cast<uv_handle_t*>(&m_timer), nullptr);
+}
+
+void P2PLoad::on_connect_failed(bool, const raw_ip&, int)
+{
+	--m_connecting;
+	++m_numConnectFailures;
+	m_nextConnectTime = microseconds_now() + 1000000;
+}
+
+void P2PLoad::connect_next()
+{
+	if ((m_connecting > 0) || (m_numConnections + m_connecting >= m_options.m_p2pPeers) || (microseconds_now() < m_nextConnectTime)) {
+		return;
+	}
+
+	if (connect_to_peer(m_options.m_p2pV6, m_options.m_p2pHost.c_str(), m_options.m_p2pPort)) {
+		++m_connecting;
+	}
+}
+
+void P2PLoad::on_tick()
+{
+	connect_next();
+
+	if (!m_lastBroadcast) {
+		return;
+	}
+
+	const uint64_t now = microseconds_now();
+
+	m_duePeers.clear();
+	{
+		MutexLock lock(m_clientsListLock);
+
+		for (Peer* c = static_cast<Peer*>(m_connectedClientsList->m_next); c != m_connectedClientsList; c = static_cast<Peer*>(c->m_next)) {
+			if (c->m_handshakeComplete && (now >= c->m_nextBroadcastTime)) {
+				m_duePeers.push_back(c);
+			}
+		}
+	}
+
+	for (Peer* c : m_duePeers) {
+		c->m_nextBroadcastTime = now + next_interval_us(m_rng, m_options.m_p2pRate);
+		if (!c->send_broadcast(m_lastBroadcast)) {
+			c->close();
+		}
+	}
+}
+
+void P2PLoad::print_progress() const
+{
+	std::cerr << "p2p: " << m_numConnections.load() << '/' << m_options.m_p2pPeers << " peers connected, "
+		<< m_numHandshakes.load() << " handshakes, " << m_numBlocks.load() << " blocks, "
+		<< m_broadcastsReceived.load() << " broadcasts received, " << m_broadcastsSent.load() << " sent" << std::endl;
+}
+
+void P2PLoad::write_json(std::ostream& s) const
+{
+	s << "{\"peers\":" << m_options.m_p2pPeers
+		<< ",\"connected\":" << m_numConnections.load()
+		<< ",\"connects\":" << m_numConnects.load()
+		<< ",\"connect_failures\":" << m_numConnectFailures.load()
+		<< ",\"disconnects\":" << m_numDisconnects.load()
+		<< ",\"handshakes\":" << m_numHandshakes.load()
+		<< ",\"blocks\":" << m_numBlocks.load()
+		<< ",\"broadcasts_received\":" << m_broadcastsReceived.load()
+		<< ",\"broadcasts_sent\":" << m_broadcastsSent.load()
+		<< ",\"broadcast_delivery\":";
+	m_broadcastDelivery.write_json(s);
+	s << '}';
+}
+
+P2PLoad::Peer::Peer()
+	: m_peerId(0)
+	, m_handshakeComplete(false)
+	, m_nextBroadcastTime(0)
+{
+}
+
+void P2PLoad::Peer::reset()
+{
+	Client::reset();
+
+	m_peerId = 0;
+	m_handshakeComplete = false;
+	m_nextBroadcastTime = 0;
+}
+
+bool P2PLoad::Peer::on_connect()
+{
+	P2PLoad* owner = static_cast<P2PLoad*>(m_owner);
+
+	--owner->m_connecting;
+	++owner->m_numConnects;
+
+	m_peerId = owner->m_rng();
+	const uint64_t challenge = owner->m_rng();
+
+	const bool result = owner->send(this,
+		[this, challenge](void* buf, size_t buf_size) -> size_t
+		{
+			if (buf_size < 1 + CHALLENGE_SIZE + sizeof(uint64_t)) {
+				return 0;
+			}
+
+			uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+			*(p++) = static_cast<uint8_t>(MessageId::HANDSHAKE_CHALLENGE);
+			memcpy(p, &challenge, CHALLENGE_SIZE);
+			memcpy(p + CHALLENGE_SIZE, &m_peerId, sizeof(uint64_t));
+			return 1 + CHALLENGE_SIZE + sizeof(uint64_t);
+		});
+
+	owner->connect_next();
+
+	return result;
+}
+
+void P2PLoad::Peer::on_disconnected()
+{
+	++static_cast<P2PLoad*>(m_owner)->m_numDisconnects;
+}
+
+bool P2PLoad::Peer::on_read(char* data, uint32_t size)
+{
+	if ((data != m_readBuf + m_numRead) || (data + size > m_readBuf + sizeof(m_readBuf))) {
+		LOGERR(1, "peer: invalid data pointer or size in on_read()");
+		return false;
+	}
+	m_numRead += size;
+
+	const uint8_t* buf = reinterpret_cast<const uint8_t*>(m_readBuf);
+	uint32_t bytes_left = m_numRead;
+
+	while (bytes_left > 0) {
+		const MessageId id = static_cast<MessageId>(buf[0]);
+
+		// Sizes of fixed size messages, or the position of the 4-byte size field for variable size messages
+		uint32_t header_size = 1;
+		uint32_t payload_size = 0;
+
+		switch (id) {
+		case MessageId::HANDSHAKE_CHALLENGE: payload_size = CHALLENGE_SIZE + sizeof(uint64_t); break;
+		case MessageId::HANDSHAKE_SOLUTION:  payload_size = HASH_SIZE + CHALLENGE_SIZE; break;
+		case MessageId::LISTEN_PORT:         payload_size = sizeof(int32_t); break;
+		case MessageId::BLOCK_REQUEST:       payload_size = HASH_SIZE; break;
+		case MessageId::PEER_LIST_REQUEST:   break;
+		case MessageId::ANCESTORS_REQUEST:   payload_size = HASH_SIZE + sizeof(uint32_t); break;
+
+		case MessageId::PEER_LIST_RESPONSE:
+			if (bytes_left < 2) {
+				payload_size = 1;
+			}
+			else {
+				payload_size = 1 + buf[1] * (1 + 16 + 2);
+			}
+			break;
+
+		case MessageId::BLOCK_RESPONSE:
+		case MessageId::BLOCK_BROADCAST:
+		case MessageId::COMPACT_BLOCK_BROADCAST:
+		case MessageId::MISSING_TXS_REQUEST:
+		case MessageId::MISSING_TXS_RESPONSE:
+		case MessageId::ANCESTORS_RESPONSE:
+			header_size = 1 + sizeof(uint32_t);
+			if (bytes_left >= header_size) {
+				payload_size = read_unaligned(reinterpret_cast<const uint32_t*>(buf + 1));
+			}
+			break;
+
+		default:
+			LOGWARN(1, "server sent an unknown message " << static_cast<int>(buf[0]));
+			return false;
+		}
+
+		if (header_size + static_cast<uint64_t>(payload_size) > sizeof(m_readBuf)) {
+			LOGWARN(1, "server sent a too big message");
+			return false;
+		}
+
+		if (bytes_left < header_size + payload_size) {
+			break;
+		}
+
+		if (!on_message(id, buf + header_size, payload_size)) {
+			return false;
+		}
+
+		buf += header_size + payload_size;
+		bytes_left -= header_size + payload_size;
+	}
+
+	if (bytes_left && (buf != reinterpret_cast<const uint8_t*>(m_readBuf))) {
+		memmove(m_readBuf, buf, bytes_left);
+	}
+	m_numRead = bytes_left;
+
+	return true;
+}
+
+bool P2PLoad::Peer::on_message(MessageId id, const uint8_t* data, uint32_t size)
+{
+	P2PLoad* owner = static_cast<P2PLoad*>(m_owner);
+
+	switch (id) {
+	case MessageId::HANDSHAKE_CHALLENGE:
+		return send_handshake_solution(data);
+
+	case MessageId::HANDSHAKE_SOLUTION:
+		// The server is the incoming side, its solution doesn't need PoW and isn't checked here
+		m_handshakeComplete = true;
+		m_nextBroadcastTime = microseconds_now() + next_interval_us(owner->m_rng, owner->m_options.m_p2pRate);
+		++owner->m_numHandshakes;
+		return true;
+
+	case MessageId::BLOCK_REQUEST:
+		// Empty response: this peer doesn't have any blocks
+		return owner->send(this,
+			[](void* buf, size_t buf_size) -> size_t
+			{
+				if (buf_size < 1 + sizeof(uint32_t)) {
+					return 0;
+				}
+
+				uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+				*p = static_cast<uint8_t>(MessageId::BLOCK_RESPONSE);
+				memset(p + 1, 0, sizeof(uint32_t));
+				return 1 + sizeof(uint32_t);
+			});
+
+	case MessageId::PEER_LIST_REQUEST:
+		return owner->send(this,
+			[](void* buf, size_t buf_size) -> size_t
+			{
+				if (buf_size < 2) {
+					return 0;
+				}
+
+				uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+				p[0] = static_cast<uint8_t>(MessageId::PEER_LIST_RESPONSE);
+				p[1] = 0;
+				return 2;
+			});
+
+	case MessageId::BLOCK_BROADCAST:
+		{
+			++owner->m_broadcastsReceived;
+
+			hash h;
+			keccak(data, static_cast<int>(size), h.h, HASH_SIZE);
+
+			if (owner->m_broadcastFanOut.add(std::string(reinterpret_cast<const char*>(h.h), HASH_SIZE), microseconds_now(), owner->m_broadcastDelivery)) {
+				++owner->m_numBlocks;
+			}
+
+			SharedBuf blob = std::make_shared<std::vector<uint8_t>>(data, data + size);
+			owner->m_lastBroadcast = blob;
+
+			// Relay it back, like every other peer of this node would do
+			return send_broadcast(blob);
+		}
+
+	default:
+		return true;
+	}
+}
+
+bool P2PLoad::Peer::send_handshake_solution(const uint8_t* challenge)
+{
+	P2PLoad* owner = static_cast<P2PLoad*>(m_owner);
+
+	// Outgoing connections must provide PoW: H = KECCAK(CHALLENGE|CONSENSUS_ID|SALT), see P2PServer::P2PClient::send_handshake_solution()
+	const std::vector<uint8_t>& consensus_id = owner->m_consensusId;
+	std::vector<uint8_t> input(CHALLENGE_SIZE * 2 + consensus_id.size());
+
+	memcpy(input.data(), challenge, CHALLENGE_SIZE);
+	memcpy(input.data() + CHALLENGE_SIZE, consensus_id.data(), consensus_id.size());
+
+	uint8_t* salt = input.data() + CHALLENGE_SIZE + consensus_id.size();
+	hash solution;
+
+	for (uint64_t k = owner->m_rng();; ++k) {
+		memcpy(salt, &k, CHALLENGE_SIZE);
+		keccak(input.data(), static_cast<int>(input.size()), solution.h, HASH_SIZE);
+
+		uint64_t value;
+		memcpy(&value, solution.h + HASH_SIZE - sizeof(uint64_t), sizeof(value));
+
+		uint64_t high;
+		umul128(value, CHALLENGE_DIFFICULTY, &high);
+
+		if (high == 0) {
+			break;
+		}
+	}
+
+	return owner->send(this,
+		[&solution, salt](void* buf, size_t buf_size) -> size_t
+		{
+			if (buf_size < 1 + HASH_SIZE + CHALLENGE_SIZE) {
+				return 0;
+			}
+
+			uint8_t* p = reinterpret_cast<uint8_t*>(buf);
+			*p = static_cast<uint8_t>(MessageId::HANDSHAKE_SOLUTION);
+			memcpy(p + 1, solution.h, HASH_SIZE);
+			memcpy(p + 1 + HASH_SIZE, salt, CHALLENGE_SIZE);
+			return 1 + HASH_SIZE + CHALLENGE_SIZE;
+		});
+}
+
+bool P2PLoad::Peer::send_broadcast(const SharedBuf& blob)
+{
+	P2PLoad* owner = static_cast<P2PLoad*>(m_owner);
+
+	uint8_t header[1 + sizeof(uint32_t)];
+	header[0] = static_cast<uint8_t>(MessageId::BLOCK_BROADCAST);
+
+	const uint32_t size = static_cast<uint32_t>(blob->size());
+	memcpy(header + 1, &size, sizeof(size));
+
+	++owner->m_broadcastsSent;
+	return owner->send(this, header, sizeof(header), blob);
+}
+
+// Total CPU time of a process in seconds
+static bool process_cpu_time(int pid, double& seconds)
+{
+#ifdef __linux__
+	std::ifstream f("/proc/" + std::to_string(pid) + "/stat");
+	std::string stat;
+	if (!f.good() || !std::getline(f, stat)) {
+		return false;
+	}
+
+	// Process name can contain spaces, fields after it are separated by single spaces: state is field 3, utime and stime are fields 14 and 15
+	const size_t k = stat.rfind(')');
+	if (k == std::string::npos) {
+		return false;
+	}
+
+	const char* p = stat.c_str() + k + 1;
+	for (int field = 2; field < 14; ++field) {
+		p = strchr(p + 1, ' ');
+		if (!p) {
+			return false;
+		}
+	}
+
+	char* end;
+	const uint64_t utime = strtoull(p, &end, 10);
+	const uint64_t stime = strtoull(end, nullptr, 10);
+
+	seconds = static_cast<double>(utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+	return true;
+#else
+	(void)pid;
+	(void)seconds;
+	return false;
+#endif
+}
+
+static bool own_cpu_time(double& seconds)
+{
+#ifdef _WIN32
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	if (!GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time)) {
+		return false;
+	}
+
+	auto to_seconds = [](const FILETIME& t) { return static_cast<double>((static_cast<uint64_t>(t.dwHighDateTime) << 32) | t.dwLowDateTime) * 1e-7; };
+	seconds = to_seconds(kernel_time) + to_seconds(user_time);
+	return true;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return false;
+	}
+
+	seconds = static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6;
+	return true;
+#endif
+}
+
+static bool parse_address(const char* s, bool& is_v6, std::string& host, int& port)
+{
+	const char* k = strrchr(s, ':');
+	if (!k) {
+		return false;
+	}
+
+	host.assign(s, k);
+	port = atoi(k + 1);
+
+	is_v6 = (host.find(':') != std::string::npos);
+	if (is_v6 && (host.size() >= 2) && (host.front() == '[') && (host.back() == ']')) {
+		host = host.substr(1, host.size() - 2);
+	}
+
+	return (port > 0) && (port < 65536) && !host.empty();
+}
+
+static bool parse_options(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; ++i) {
+		const char* arg = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		bool ok = true;
+
+		if (!strcmp(arg, "--mini")) {
+			options.m_mini = true;
+			continue;
+		}
+
+		if (!value) {
+			ok = false;
+		}
+		else if (!strcmp(arg, "--stratum"))     { ok = parse_address(value, options.m_stratumV6, options.m_stratumHost, options.m_stratumPort); }
+		else if (!strcmp(arg, "--miners"))      { options.m_miners = static_cast<uint32_t>(strtoul(value, nullptr, 10)); }
+		else if (!strcmp(arg, "--login"))       { options.m_login = value; }
+		else if (!strcmp(arg, "--diff"))        { options.m_diff = strtoull(value, nullptr, 10); }
+		else if (!strcmp(arg, "--share-rate"))  { options.m_shareRate = strtod(value, nullptr); }
+		else if (!strcmp(arg, "--invalid"))     { options.m_invalidShares = strtod(value, nullptr); }
+		else if (!strcmp(arg, "--stale"))       { options.m_staleShares = strtod(value, nullptr); }
+		else if (!strcmp(arg, "--pow-shares"))  { options.m_powShares = strtod(value, nullptr); }
+		else if (!strcmp(arg, "--pow-diff"))    { options.m_powDiff = strtoull(value, nullptr, 10); }
+		else if (!strcmp(arg, "--p2p"))         { ok = parse_address(value, options.m_p2pV6, options.m_p2pHost, options.m_p2pPort); }
+		else if (!strcmp(arg, "--p2p-peers"))   { options.m_p2pPeers = static_cast<uint32_t>(strtoul(value, nullptr, 10)); }
+		else if (!strcmp(arg, "--p2p-rate"))    { options.m_p2pRate = strtod(value, nullptr); }
+		else if (!strcmp(arg, "--duration"))    { options.m_duration = static_cast<uint32_t>(strtoul(value, nullptr, 10)); }
+		else if (!strcmp(arg, "--report"))      { options.m_report = std::max<uint32_t>(static_cast<uint32_t>(strtoul(value, nullptr, 10)), 1); }
+		else if (!strcmp(arg, "--server-pid"))  { options.m_serverPid = atoi(value); }
+		else if (!strcmp(arg, "--seed"))        { options.m_seed = strtoull(value, nullptr, 10); }
+		else if (!strcmp(arg, "--loglevel"))    { log::GLOBAL_LOG_LEVEL = std::min(std::max(atoi(value), 0), log::MAX_GLOBAL_LOG_LEVEL); }
+		else {
+			ok = false;
+		}
+
+		if (!ok) {
+			std::cerr << "invalid command line option " << arg << std::endl;
+			return false;
+		}
+
+		++i;
+	}
+
+	if (options.m_invalidShares + options.m_staleShares + options.m_powShares > 1.0) {
+		std::cerr << "--invalid, --stale and --pow-shares add up to more than 1" << std::endl;
+		return false;
+	}
+
+	if ((options.m_powShares > 0.0) && !options.m_powDiff) {
+		std::cerr << "--pow-shares needs --pow-diff" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+} // namespace loadgen
+
+} // namespace p2pool
+
+int main(int argc, char** argv)
+{
+	using namespace p2pool;
+	using namespace p2pool::loadgen;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
+			p2pool_usage();
+			return 0;
+		}
+	}
+
+	log::GLOBAL_LOG_LEVEL = 1;
+
+	Options options;
+	if (!parse_options(argc, argv, options)) {
+		return 1;
+	}
+
+	init_crypto_cache();
+
+	double server_cpu0 = 0.0, server_cpu1 = 0.0, own_cpu0 = 0.0, own_cpu1 = 0.0;
+	const bool has_server_cpu = (options.m_serverPid > 0) && process_cpu_time(options.m_serverPid, server_cpu0);
+	own_cpu_time(own_cpu0);
+
+	using namespace std::chrono;
+	const auto start_time = steady_clock::now();
+
+	{
+		std::unique_ptr<StratumLoad> stratum(options.m_miners ? new StratumLoad(options) : nullptr);
+		std::unique_ptr<P2PLoad> p2p(options.m_p2pPeers ? new P2PLoad(options) : nullptr);
+
+		for (uint32_t t = 1; t <= options.m_duration; ++t) {
+			std::this_thread::sleep_until(start_time + seconds(t));
+
+			if ((t % options.m_report == 0) || (t == options.m_duration)) {
+				std::cerr << "[" << t << "s] ";
+				if (has_server_cpu) {
+					double cpu;
+					if (process_cpu_time(options.m_serverPid, cpu)) {
+						std::cerr << "server CPU " << (cpu - server_cpu0) * 100.0 / t << "% ";
+					}
+				}
+				std::cerr << std::endl;
+
+				if (stratum) {
+					stratum->print_progress();
+				}
+				if (p2p) {
+					p2p->print_progress();
+				}
+			}
+		}
+
+		const double elapsed = duration_cast<duration<double>>(steady_clock::now() - start_time).count();
+
+		const bool server_cpu_valid = has_server_cpu && process_cpu_time(options.m_serverPid, server_cpu1);
+		own_cpu_time(own_cpu1);
+
+		std::cout << "{\"duration_s\":" << elapsed;
+
+		if (server_cpu_valid) {
+			std::cout << ",\"server_cpu_percent\":" << (server_cpu1 - server_cpu0) * 100.0 / elapsed;
+		}
+		std::cout << ",\"loadgen_cpu_percent\":" << (own_cpu1 - own_cpu0) * 100.0 / elapsed;
+
+		if (stratum) {
+			std::cout << ",\"stratum\":";
+			stratum->write_json(std::cout);
+		}
+
+		if (p2p) {
+			std::cout << ",\"p2p\":";
+			p2p->write_json(std::cout);
+		}
+
+		std::cout << '}' << std::endl;
+	}
+
+	destroy_crypto_cache();
+	log::stop();
+
+	return 0;
+}
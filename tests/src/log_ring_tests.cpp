@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "log_ring.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(log_ring, wrap_at_every_alignment)
+{
+	typedef log::LogRing<256> Ring;
+
+	char data[64];
+	for (uint32_t i = 0; i < sizeof(data); ++i) {
+		data[i] = static_cast<char>(i * 7 + 1);
+	}
+
+	// Start at every record-aligned offset, including right before the 32-bit position overflow
+	for (uint32_t start = 0; start < 256; start += Ring::RECORD_ALIGN) {
+		for (uint32_t base : { 0U, 0U - 1024U }) {
+			Ring ring;
+			ring.m_writePos = base + start;
+			ring.m_readPos = base + start;
+
+			uint64_t written = 0;
+			uint64_t read = 0;
+
+			for (uint32_t iter = 0; iter < 200; ++iter) {
+				// Fill the ring until it's full, then drain it
+				for (;;) {
+					const uint32_t size = 1 + static_cast<uint32_t>((written * 13 + start) % 40);
+					if (!ring.write(log::Severity::Info, written, data, size)) {
+						break;
+					}
+					++written;
+				}
+				ASSERT_GT(written, read);
+
+				const uint32_t end = ring.m_writePos;
+				while (const Ring::Record* r = ring.peek(end)) {
+					const uint32_t offset = static_cast<uint32_t>(reinterpret_cast<const char*>(r) - ring.m_buf);
+					ASSERT_LE(offset + Ring::HEADER_SIZE + r->m_size, 256U);
+
+					ASSERT_EQ(r->m_timestamp, read);
+					ASSERT_EQ(r->m_size, 1 + static_cast<uint32_t>((read * 13 + start) % 40));
+					ASSERT_EQ(memcmp(reinterpret_cast<const char*>(r) + Ring::HEADER_SIZE, data, r->m_size), 0);
+
+					ring.pop(r);
+					++read;
+				}
+
+				ASSERT_EQ(read, written);
+				ASSERT_EQ(ring.m_readPos.load(), ring.m_writePos.load());
+			}
+		}
+	}
+}
+
+TEST(log_ring, deferred_format)
+{
+	static constexpr char prefix[] = "Test ";
+	static constexpr log::DeferredFormat fmt = { prefix, "peer {}{}{} sent {} bytes (block {}, height {}, {}, {}{}" };
+
+	hash id;
+	for (size_t i = 0; i < HASH_SIZE; ++i) {
+		id.h[i] = static_cast<uint8_t>(i * 11);
+	}
+
+	raw_ip ip;
+	memset(ip.data, 0, sizeof(ip.data));
+	ip.data[10] = 0xFF;
+	ip.data[11] = 0xFF;
+	ip.data[12] = 127;
+	ip.data[15] = 1;
+
+	char addr[72] = "127.0.0.1:37889";
+	const uint32_t size = 100500;
+	const uint64_t height = 3456789;
+	const std::string s = "str";
+	const uint8_t bytes[3] = { 1, 2, 0xAB };
+
+	std::vector<uint8_t> data(sizeof(&fmt) + log::deferred_size(log::Gray(), addr, log::NoColor(), size, id, height, ip, s, log::hex_buf(bytes, sizeof(bytes))));
+	const log::DeferredFormat* p = &fmt;
+	memcpy(data.data(), &p, sizeof(p));
+	uint8_t* end = log::deferred_write(data.data() + sizeof(p), log::Gray(), addr, log::NoColor(), size, id, height, ip, s, log::hex_buf(bytes, sizeof(bytes)));
+	ASSERT_EQ(end, data.data() + data.size());
+
+	char buf[log::Stream::BUF_SIZE + 1];
+	log::Stream result(buf);
+	log::format_deferred(data.data(), log::Severity::Warning, result);
+
+	// Must be the same as what LOG() would write
+	char buf2[log::Stream::BUF_SIZE + 1];
+	log::Stream expected(buf2);
+	expected << log::Gray() << prefix << log::Yellow() << "peer " << log::Gray() << static_cast<char*>(addr) << log::NoColor() << " sent " << size
+		<< " bytes (block " << id << ", height " << height << ", " << ip << ", " << s << log::hex_buf(bytes, sizeof(bytes)) << log::NoColor() << '\n';
+
+	ASSERT_EQ(std::string(buf, result.m_pos), std::string(buf2, expected.m_pos));
+}
+
+}
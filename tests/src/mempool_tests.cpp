@@ -0,0 +1,76 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "mempool.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+static TxMempoolData make_tx(uint8_t id, uint64_t weight, uint64_t fee, uint64_t time_received)
+{
+	TxMempoolData tx;
+	tx.id.h[0] = id;
+	tx.blob_size = weight;
+	tx.weight = weight;
+	tx.fee = fee;
+	tx.time_received = time_received;
+	return tx;
+}
+
+TEST(mempool, best_transactions)
+{
+	Mempool mempool;
+
+	std::vector<TxMempoolData> txs{
+		make_tx(1, 1000, 1000, 100),
+		make_tx(2, 2000, 8000, 100),
+		make_tx(3, 1000, 3000, 100),
+		make_tx(4, 1000, 9000, 115),
+		make_tx(5, 3000, 6000, 100),
+	};
+
+	mempool.add_batch(txs);
+
+	// Duplicates are ignored
+	mempool.add_batch({ make_tx(3, 10, 100000, 100) });
+
+	std::vector<TxMempoolData> result;
+	ASSERT_EQ(mempool.get_best_transactions(120, 10, 1000, result), 5);
+
+	// Transaction 4 has the highest fee per byte, but it's too new
+	ASSERT_EQ(result.size(), 4);
+	ASSERT_EQ(result[0].id.h[0], 2);
+	ASSERT_EQ(result[1].id.h[0], 3);
+	ASSERT_EQ(result[2].id.h[0], 5);
+	ASSERT_EQ(result[3].id.h[0], 1);
+
+	ASSERT_EQ(mempool.get_best_transactions(125, 10, 2, result), 5);
+	ASSERT_EQ(result.size(), 2);
+	ASSERT_EQ(result[0].id.h[0], 4);
+	ASSERT_EQ(result[1].id.h[0], 2);
+
+	// swap() replaces everything, but keeps time_received of known transactions
+	std::vector<TxMempoolData> backlog{ make_tx(4, 1000, 9000, 0), make_tx(6, 1000, 100, 0) };
+	mempool.swap(backlog);
+
+	ASSERT_EQ(mempool.get_best_transactions(125, 10, 1000, result), 2);
+	ASSERT_EQ(result.size(), 1);
+	ASSERT_EQ(result[0].id.h[0], 4);
+}
+
+}
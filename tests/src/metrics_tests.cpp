@@ -0,0 +1,65 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "metrics.h"
+#include "gtest/gtest.h"
+
+namespace p2pool {
+
+TEST(metrics, latency_histogram)
+{
+	LatencyHistogram h("test_seconds", "test");
+
+	h.add_ns(500);         // < 1 us
+	h.add_ns(1500);        // 1 us
+	h.add_ns(3000);        // 3 us
+	h.add(std::chrono::milliseconds(1));
+	h.add(std::chrono::hours(1));
+
+	std::string out;
+	h.render(out);
+
+	ASSERT_NE(out.find("# TYPE test_seconds histogram\n"), std::string::npos);
+
+	// Buckets are cumulative
+	ASSERT_NE(out.find("test_seconds_bucket{le=\"1e-06\"} 1\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_bucket{le=\"2e-06\"} 2\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_bucket{le=\"4e-06\"} 3\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_bucket{le=\"0.001024\"} 4\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_bucket{le=\"+Inf\"} 5\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_count 5\n"), std::string::npos);
+	ASSERT_NE(out.find("test_seconds_sum 3600.001005000\n"), std::string::npos);
+}
+
+TEST(metrics, render)
+{
+	MetricCounter c("test_total", "test");
+	c.add();
+	c.add(2);
+
+	std::string out;
+	c.render(out);
+	ASSERT_EQ(out, "# HELP test_total test\n# TYPE test_total counter\ntest_total 3\n");
+
+	const std::string all = metrics::render();
+	ASSERT_NE(all.find("p2pool_block_template_update_seconds_count "), std::string::npos);
+	ASSERT_NE(all.find("p2pool_stale_shares_total "), std::string::npos);
+	ASSERT_NE(all.find("p2pool_crypto_cache_hits_total{cache=\"derivations\"} "), std::string::npos);
+}
+
+}
@@ -61,6 +61,30 @@ TEST(pool_block, deserialize)
 	ASSERT_EQ(outputs_offset, 54);
 	ASSERT_EQ(outputs_blob_size, 420);
 
+	// Deserialized block keeps its blobs, full blob is the canonical serialization
+	ASSERT_TRUE(b.m_blobs != nullptr);
+	ASSERT_TRUE(b.get_blobs() == b.m_blobs);
+	ASSERT_EQ(b.m_blobs->m_full, buf);
+	ASSERT_EQ(b.m_blobs->m_mainchainSize, mainchain_data.size());
+	ASSERT_EQ(b.m_blobs->m_headerSize, header_size);
+	ASSERT_EQ(b.m_blobs->m_minerTxSize, miner_tx_size);
+
+	PoolBlockView view;
+	ASSERT_EQ(view.parse(b.m_blobs->m_pruned.data(), b.m_blobs->m_pruned.size()), 0);
+	ASSERT_EQ(view.m_numOutputs, 0);
+	ASSERT_EQ(view.m_outputsBlobSize, outputs_blob_size);
+	ASSERT_EQ(view.m_sidechainId, b.m_sidechainId);
+
+	uint64_t total_reward = 0;
+	for (const PoolBlock::TxOutput& output : b.m_outputs) {
+		total_reward += output.m_reward;
+	}
+	ASSERT_EQ(view.m_totalReward, total_reward);
+
+	// Copies share the blobs
+	PoolBlock c(b);
+	ASSERT_TRUE(c.m_blobs == b.m_blobs);
+
 	ASSERT_EQ(b.m_majorVersion, 14);
 	ASSERT_EQ(b.m_minorVersion, 14);
 	ASSERT_EQ(b.m_timestamp, 1630934403);
@@ -103,6 +127,53 @@ TEST(pool_block, deserialize)
 	ASSERT_EQ(b.m_difficulty.check_pow(pow_hash), true);
 }
 
+TEST(pool_block, tx_hash_list)
+{
+	std::vector<uint8_t> hashes(HASH_SIZE * 10);
+	for (size_t i = 0; i < hashes.size(); ++i) {
+		hashes[i] = static_cast<uint8_t>((i * 7) % 251);
+	}
+
+	const uint64_t num_unique = TxHashList::num_unique_hashes();
+	{
+		TxHashList a;
+		ASSERT_TRUE(a.empty());
+
+		a.reset(11);
+		a.append(hashes.data(), 10);
+		ASSERT_EQ(a.size(), 11);
+		ASSERT_EQ(TxHashList::num_unique_hashes(), num_unique + 10);
+
+		for (size_t i = 1; i <= 10; ++i) {
+			ASSERT_EQ(memcmp(a[i].h, hashes.data() + (i - 1) * HASH_SIZE, HASH_SIZE), 0);
+		}
+
+		// Same transactions in another block don't take more memory
+		TxHashList b;
+		b.reset(6);
+		b.append(hashes.data() + HASH_SIZE * 5, 5);
+		ASSERT_EQ(TxHashList::num_unique_hashes(), num_unique + 10);
+
+		b.miner_tx_hash().h[0] = 1;
+		ASSERT_EQ(b[0].h[0], 1);
+		ASSERT_EQ(a[0], hash());
+
+		std::vector<uint8_t> tmp(HASH_SIZE * 5);
+		b.copy_to(tmp.data(), 1);
+		ASSERT_EQ(memcmp(tmp.data(), hashes.data() + HASH_SIZE * 5, tmp.size()), 0);
+
+		TxHashList c(a);
+		a.clear();
+		ASSERT_TRUE(a.empty());
+		ASSERT_EQ(TxHashList::num_unique_hashes(), num_unique + 10);
+
+		c = b;
+		ASSERT_EQ(c.size(), 6);
+		ASSERT_EQ(TxHashList::num_unique_hashes(), num_unique + 5);
+	}
+	ASSERT_EQ(TxHashList::num_unique_hashes(), num_unique);
+}
+
 TEST(pool_block, verify)
 {
 	init_crypto_cache();
@@ -142,6 +213,12 @@ TEST(pool_block, verify)
 
 			sidechain.add_block(b);
 			ASSERT_TRUE(sidechain.find_block(b.m_sidechainId) != nullptr);
+
+			// Block requests get the blob shared with the block
+			SideChain::BlockBlob blob;
+			ASSERT_TRUE(sidechain.get_block_blob(b.m_sidechainId, blob));
+			ASSERT_TRUE(blob.get() == &sidechain.find_block(b.m_sidechainId)->m_blobs->m_full);
+			ASSERT_TRUE((blob->size() == n) && (memcmp(blob->data(), p - n, n) == 0));
 		}
 
 		const PoolBlock* tip = sidechain.chainTip();
@@ -151,9 +228,156 @@ TEST(pool_block, verify)
 
 		ASSERT_EQ(tip->m_txinGenHeight, t.m_txinGenHeight);
 		ASSERT_EQ(tip->m_sidechainHeight, t.m_sidechainHeight);
+
+		const std::shared_ptr<const SideChain::Snapshot> snapshot = sidechain.snapshot();
+		ASSERT_EQ(snapshot->m_tipId, tip->m_sidechainId);
+		ASSERT_EQ(snapshot->m_sidechainHeight, tip->m_sidechainHeight);
+		ASSERT_EQ(snapshot->m_totalHashes, tip->m_cumulativeDifficulty);
+		ASSERT_EQ(snapshot->m_outputs.size(), tip->m_outputs.size());
+		ASSERT_EQ(sidechain.total_hashes(), tip->m_cumulativeDifficulty);
+
+		// Blocks from the saved chain state must end up with the same chain tip
+		// Only blocks which are exactly the same as in the block cache are trusted
+		std::remove("p2pool.sidechain");
+		sidechain.save_chain_state();
+		for (bool change_nonce : { false, true }) {
+			SideChain sidechain2(nullptr, NetworkType::Mainnet, t.m_poolName);
+			sidechain2.load_chain_state();
+
+			std::vector<PoolBlock*> cached_blocks;
+			for (const uint8_t *p = buf.data(), *e = buf.data() + buf.size(); p < e;) {
+				const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+				p += sizeof(uint32_t);
+				PoolBlock* cached = new PoolBlock();
+				ASSERT_EQ(cached->deserialize(p, n, sidechain2, nullptr), 0);
+				cached_blocks.push_back(cached);
+				p += n;
+			}
+			sidechain2.trust_cached_blocks(cached_blocks);
+
+			for (const PoolBlock* cached : cached_blocks) {
+				b = *cached;
+				if (change_nonce) {
+					// Same sidechain id, but a different block
+					++b.m_nonce;
+					b.m_blobs.reset();
+				}
+				sidechain2.add_block(b);
+				delete cached;
+			}
+
+			const PoolBlock* tip2 = sidechain2.chainTip();
+			ASSERT_TRUE(tip2 != nullptr);
+			ASSERT_EQ(tip2->m_sidechainId, tip->m_sidechainId);
+			ASSERT_TRUE(tip2->m_verified);
+			ASSERT_FALSE(tip2->m_invalid);
+
+			const uint64_t num_trusted = sidechain2.verify_stats().m_numTrusted;
+			if (change_nonce) {
+				ASSERT_EQ(num_trusted, 0);
+			}
+			else {
+				ASSERT_GT(num_trusted, 0);
+			}
+		}
+		std::remove("p2pool.sidechain");
+	}
+
+	destroy_crypto_cache();
+}
+
+TEST(pool_block, view)
+{
+	init_crypto_cache();
+
+	PoolBlock b;
+	SideChain sidechain(nullptr, NetworkType::Mainnet, "mini");
+
+	std::ifstream f("sidechain_dump_mini.dat", std::ios::binary | std::ios::ate);
+	ASSERT_EQ(f.good() && f.is_open(), true);
+
+	std::vector<uint8_t> buf(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	ASSERT_EQ(f.good(), true);
+
+	const uint8_t* p = buf.data();
+	const uint8_t* e = buf.data() + buf.size();
+
+	for (int i = 0; (i < 100) && (p < e); ++i) {
+		const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+		p += sizeof(uint32_t);
+
+		PoolBlockView view;
+		ASSERT_EQ(view.parse(p, n), 0);
+		ASSERT_EQ(b.deserialize(view, sidechain, nullptr), 0);
+
+		ASSERT_EQ(view.m_sidechainId, b.m_sidechainId);
+		ASSERT_EQ(view.m_sidechainHeight, b.m_sidechainHeight);
+		ASSERT_EQ(view.m_txinGenHeight, b.m_txinGenHeight);
+		ASSERT_EQ(view.m_prevId, b.m_prevId);
+		ASSERT_EQ(view.m_parent, b.m_parent);
+		ASSERT_EQ(view.m_numOutputs, b.m_outputs.size());
+		ASSERT_EQ(view.m_numTransactions + 1, b.m_transactions.size());
+		ASSERT_EQ(view.m_numUncles, b.m_uncles.size());
+		ASSERT_EQ(view.m_cumulativeDifficulty, b.m_cumulativeDifficulty);
+
+		// Truncated or extended data must be rejected
+		ASSERT_NE(view.parse(p, n - 1), 0);
+		std::vector<uint8_t> tmp(p, p + n);
+		tmp.push_back(0);
+		ASSERT_NE(view.parse(tmp.data(), tmp.size()), 0);
+
+		p += n;
 	}
 
 	destroy_crypto_cache();
 }
 
+TEST(pool_block, allocator)
+{
+	PoolBlockAllocator allocator;
+	std::vector<PoolBlock*> blocks;
+
+	PoolBlock b;
+	for (uint64_t height = 0; height < PoolBlockAllocator::HEIGHTS_PER_BUCKET * 4; ++height) {
+		b.m_sidechainHeight = height;
+		b.m_sidechainId.h[0] = static_cast<uint8_t>(height);
+
+		for (int i = 0; i < 3; ++i) {
+			PoolBlock* p = allocator.create(b);
+			ASSERT_EQ(p->m_sidechainHeight, height);
+			ASSERT_EQ(p->m_sidechainId, b.m_sidechainId);
+			blocks.push_back(p);
+		}
+	}
+
+	ASSERT_EQ(allocator.num_blocks(), blocks.size());
+	ASSERT_EQ(allocator.num_slabs(), 4 * ((PoolBlockAllocator::HEIGHTS_PER_BUCKET * 3 + PoolBlockAllocator::SLOTS_PER_SLAB - 1) / PoolBlockAllocator::SLOTS_PER_SLAB));
+
+	// Free the oldest bucket, its slabs must be released
+	const uint64_t slabs_before = allocator.num_slabs();
+	const size_t n = PoolBlockAllocator::HEIGHTS_PER_BUCKET * 3;
+	for (size_t i = 0; i < n; ++i) {
+		allocator.destroy(blocks[i]);
+	}
+	blocks.erase(blocks.begin(), blocks.begin() + n);
+
+	ASSERT_EQ(allocator.num_blocks(), blocks.size());
+	ASSERT_EQ(allocator.num_slabs(), slabs_before / 4 * 3);
+
+	// Freed slot is reused
+	PoolBlock* p = blocks.back();
+	b.m_sidechainHeight = p->m_sidechainHeight;
+	allocator.destroy(p);
+	ASSERT_EQ(allocator.create(b), p);
+
+	for (PoolBlock* block : blocks) {
+		allocator.destroy(block);
+	}
+
+	ASSERT_EQ(allocator.num_blocks(), 0);
+	ASSERT_EQ(allocator.num_slabs(), 0);
+}
+
 }
@@ -0,0 +1,239 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <random>
+
+namespace p2pool {
+
+TEST(side_chain, blocks_by_height)
+{
+	BlocksByHeight blocks;
+	blocks.init(100);
+
+	std::vector<PoolBlock> b(4);
+	PoolBlock* p[4] = { &b[0], &b[1], &b[2], &b[3] };
+
+	ASSERT_EQ(blocks.find(0), nullptr);
+
+	blocks.add(10, p[0]);
+	blocks.add(10, p[1]);
+	blocks.add(11, p[2]);
+
+	// 10 + 128 uses the same slot as 10, it must go to the overflow map
+	blocks.add(138, p[3]);
+
+	ASSERT_NE(blocks.find(10), nullptr);
+	ASSERT_EQ(blocks.find(10)->size(), 2);
+	ASSERT_EQ(blocks.find(11)->size(), 1);
+	ASSERT_EQ(blocks.find(138)->size(), 1);
+	ASSERT_EQ(blocks.find(138)->front(), p[3]);
+	ASSERT_EQ(blocks.find(12), nullptr);
+	ASSERT_EQ(blocks.find(266), nullptr);
+
+	// Prune only one block at height 10
+	std::vector<uint64_t> heights;
+	blocks.prune(10, [&heights, &p](uint64_t height, std::vector<PoolBlock*>& v) {
+		heights.push_back(height);
+		v.erase(std::remove(v.begin(), v.end(), p[0]), v.end());
+	});
+
+	ASSERT_EQ(heights, std::vector<uint64_t>{ 10 });
+	ASSERT_EQ(blocks.find(10)->size(), 1);
+
+	// Prune everything up to 138
+	heights.clear();
+	blocks.prune(138, [&heights](uint64_t height, std::vector<PoolBlock*>& v) {
+		heights.push_back(height);
+		v.clear();
+	});
+
+	std::sort(heights.begin(), heights.end());
+	ASSERT_EQ(heights, (std::vector<uint64_t>{ 10, 11, 138 }));
+	ASSERT_EQ(blocks.find(10), nullptr);
+	ASSERT_EQ(blocks.find(11), nullptr);
+	ASSERT_EQ(blocks.find(138), nullptr);
+
+	// Freed slot can be reused by another height
+	blocks.add(266, p[0]);
+	ASSERT_EQ(blocks.find(266)->front(), p[0]);
+	ASSERT_EQ(blocks.find(10), nullptr);
+}
+
+TEST(side_chain, difficulty_window)
+{
+	struct Entry
+	{
+		uint64_t m_height;
+		uint64_t m_timestamp;
+		difficulty_type m_cumulativeDifficulty;
+	};
+
+	std::mt19937_64 rng(123);
+
+	DifficultyWindow window;
+	std::vector<Entry> entries;
+
+	for (uint64_t height = 0; height < 2000; ++height) {
+		// A block and up to 2 uncles with lower heights, timestamps are not in order
+		const uint64_t n = 1 + (rng() % 3);
+		for (uint64_t i = 0; i < n; ++i) {
+			const uint64_t h = height - std::min<uint64_t>(height, i * (1 + rng() % 3));
+			const Entry e{ h, 1600000000 + height * 10 + (rng() % 200), { rng() % 1000000, rng() % 2 } };
+			window.add(e.m_height, e.m_timestamp, e.m_cumulativeDifficulty);
+			entries.push_back(e);
+		}
+
+		if (height >= 100) {
+			window.prune(height - 100);
+			entries.erase(std::remove_if(entries.begin(), entries.end(), [height](const Entry& e) { return e.m_height <= height - 100; }), entries.end());
+		}
+
+		ASSERT_EQ(window.size(), entries.size());
+
+		std::vector<uint64_t> timestamps;
+		for (const Entry& e : entries) {
+			timestamps.push_back(e.m_timestamp);
+		}
+		std::sort(timestamps.begin(), timestamps.end());
+
+		const size_t cut_size = (timestamps.size() + 9) / 10;
+		const uint64_t t1 = timestamps[cut_size - 1];
+		const uint64_t t2 = timestamps[timestamps.size() - cut_size];
+
+		difficulty_type d1{ std::numeric_limits<uint64_t>::max(), std::numeric_limits<uint64_t>::max() };
+		difficulty_type d2{ 0, 0 };
+
+		for (const Entry& e : entries) {
+			if ((t1 <= e.m_timestamp) && (e.m_timestamp <= t2)) {
+				if (e.m_cumulativeDifficulty < d1) {
+					d1 = e.m_cumulativeDifficulty;
+				}
+				if (d2 < e.m_cumulativeDifficulty) {
+					d2 = e.m_cumulativeDifficulty;
+				}
+			}
+		}
+
+		uint64_t timestamp1, timestamp2;
+		difficulty_type diff1, diff2;
+		window.get_range(timestamp1, timestamp2, diff1, diff2);
+
+		ASSERT_EQ(timestamp1, t1);
+		ASSERT_EQ(timestamp2, t2);
+		ASSERT_EQ(diff1, d1);
+		ASSERT_EQ(diff2, d2);
+	}
+
+	window.clear();
+	ASSERT_EQ(window.size(), 0);
+}
+
+static void compare_shares(const std::vector<MinerShare>& a, const std::vector<MinerShare>& b)
+{
+	ASSERT_EQ(a.size(), b.size());
+
+	for (size_t i = 0, n = a.size(); i < n; ++i) {
+		ASSERT_EQ(a[i].m_weight, b[i].m_weight);
+		ASSERT_EQ(a[i].m_wallet->spend_public_key(), b[i].m_wallet->spend_public_key());
+		ASSERT_EQ(a[i].m_wallet->view_public_key(), b[i].m_wallet->view_public_key());
+	}
+}
+
+TEST(side_chain, shares_window)
+{
+	init_crypto_cache();
+
+	PoolBlock b;
+	SideChain sidechain(nullptr, NetworkType::Mainnet);
+
+	std::ifstream f("sidechain_dump.dat", std::ios::binary | std::ios::ate);
+	ASSERT_EQ(f.good() && f.is_open(), true);
+
+	std::vector<uint8_t> buf(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	ASSERT_EQ(f.good(), true);
+
+	for (const uint8_t *p = buf.data(), *e = buf.data() + buf.size(); p < e;) {
+		ASSERT_TRUE(p + sizeof(uint32_t) <= e);
+		const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+		p += sizeof(uint32_t);
+
+		ASSERT_TRUE(p + n <= e);
+		ASSERT_EQ(b.deserialize(p, n, sidechain, nullptr), 0);
+		p += n;
+
+		sidechain.add_block(b);
+	}
+
+	const PoolBlock* tip = sidechain.chainTip();
+	ASSERT_TRUE(tip != nullptr);
+
+	// Go up the chain one block at a time, so every block after the first one updates its parent's window
+	std::vector<const PoolBlock*> chain;
+	for (const PoolBlock* cur = tip; cur && (chain.size() < 100); cur = sidechain.find_block(cur->m_parent)) {
+		chain.push_back(cur);
+	}
+	std::reverse(chain.begin(), chain.end());
+
+	std::vector<MinerShare> shares, shares_full;
+
+	for (const PoolBlock* block : chain) {
+		ASSERT_TRUE(sidechain.get_shares(block, shares));
+		ASSERT_TRUE(sidechain.get_shares_full(block, shares_full));
+		compare_shares(shares, shares_full);
+	}
+
+	// A block template on top of the tip, mined to a wallet with the same spend key as the tip's wallet but with a different view key
+	const Wallet* w1 = tip->m_minerWallet.get();
+	auto it = std::find_if(shares_full.begin(), shares_full.end(), [w1](const MinerShare& s) { return !(*s.m_wallet == *w1); });
+	ASSERT_TRUE(it != shares_full.end());
+	const Wallet* w2 = it->m_wallet;
+
+	PoolBlock t(*tip);
+	t.m_parent = tip->m_sidechainId;
+	t.m_sidechainHeight = tip->m_sidechainHeight + 1;
+	t.m_sidechainId.h[0] ^= 1;
+	t.m_uncles.clear();
+
+	ASSERT_TRUE(t.m_minerWallet.assign(w1->spend_public_key(), w2->view_public_key(), NetworkType::Mainnet));
+
+	ASSERT_TRUE(sidechain.get_shares(&t, shares));
+	ASSERT_TRUE(sidechain.get_shares_full(&t, shares_full));
+	compare_shares(shares, shares_full);
+
+	// Both wallets are counted as one, the share goes to the wallet with the lowest view key
+	const hash& view_key = std::min(w1->view_public_key(), w2->view_public_key());
+	it = std::find_if(shares.begin(), shares.end(), [w1](const MinerShare& s) { return *s.m_wallet == *w1; });
+	ASSERT_TRUE(it != shares.end());
+	ASSERT_EQ(it->m_wallet->view_public_key(), view_key);
+
+	// The template didn't change the tip's window
+	ASSERT_TRUE(sidechain.get_shares(tip, shares));
+	ASSERT_TRUE(sidechain.get_shares_full(tip, shares_full));
+	compare_shares(shares, shares_full);
+
+	destroy_crypto_cache();
+}
+
+}
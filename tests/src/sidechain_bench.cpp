@@ -0,0 +1,171 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "crypto.h"
+#include "pool_block.h"
+#include "side_chain.h"
+#include <fstream>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Replays sidechain dumps from the test data and prints one JSON object per dump to stdout
+// Usage: p2pool_sidechain_bench [default] [mini]
+
+void p2pool_usage() {}
+
+namespace {
+
+uint64_t peak_memory_kb()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return pmc.PeakWorkingSetSize / 1024;
+	}
+	return 0;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return 0;
+	}
+#ifdef __MACH__
+	// macOS reports bytes
+	return static_cast<uint64_t>(usage.ru_maxrss) / 1024;
+#else
+	return static_cast<uint64_t>(usage.ru_maxrss);
+#endif
+#endif
+}
+
+bool replay(const char* pool_name, const char* file_name)
+{
+	using namespace p2pool;
+	using namespace std::chrono;
+
+	std::ifstream f(file_name, std::ios::binary | std::ios::ate);
+	if (!f.good() || !f.is_open()) {
+		std::cerr << "couldn't open " << file_name << std::endl;
+		return false;
+	}
+
+	std::vector<uint8_t> buf(f.tellg());
+	f.seekg(0);
+	f.read(reinterpret_cast<char*>(buf.data()), buf.size());
+	if (!f.good()) {
+		std::cerr << "couldn't read " << file_name << std::endl;
+		return false;
+	}
+
+	init_crypto_cache();
+
+	uint64_t num_blocks = 0;
+	uint64_t deserialize_time = 0;
+	uint64_t add_block_time = 0;
+	SideChain::VerifyStats stats;
+	bool tip_valid;
+	{
+		PoolBlock b;
+		SideChain sidechain(nullptr, NetworkType::Mainnet, pool_name);
+
+		for (const uint8_t *p = buf.data(), *e = buf.data() + buf.size(); p + sizeof(uint32_t) <= e;) {
+			const uint32_t n = *reinterpret_cast<const uint32_t*>(p);
+			p += sizeof(uint32_t);
+
+			if (p + n > e) {
+				std::cerr << file_name << " is truncated" << std::endl;
+				return false;
+			}
+
+			const auto t0 = high_resolution_clock::now();
+			const int result = b.deserialize(p, n, sidechain, nullptr);
+			const auto t1 = high_resolution_clock::now();
+
+			if (result != 0) {
+				std::cerr << file_name << ": deserialize failed at block " << num_blocks << ", error " << result << std::endl;
+				return false;
+			}
+
+			sidechain.add_block(b);
+
+			deserialize_time += duration_cast<microseconds>(t1 - t0).count();
+			add_block_time += duration_cast<microseconds>(high_resolution_clock::now() - t1).count();
+
+			p += n;
+			++num_blocks;
+		}
+
+		stats = sidechain.verify_stats();
+
+		const PoolBlock* tip = sidechain.chainTip();
+		tip_valid = tip && tip->m_verified && !tip->m_invalid;
+	}
+
+	destroy_crypto_cache();
+
+	const uint64_t total_time = deserialize_time + add_block_time;
+
+	std::cout << "{\"pool\":\"" << pool_name << "\",\"file\":\"" << file_name << '"'
+		<< ",\"blocks\":" << num_blocks
+		<< ",\"verified\":" << stats.m_numBlocks
+		<< ",\"tip_valid\":" << (tip_valid ? "true" : "false")
+		<< ",\"total_us\":" << total_time
+		<< ",\"blocks_per_sec\":" << (total_time ? static_cast<double>(num_blocks) * 1e6 / static_cast<double>(total_time) : 0.0)
+		<< ",\"deserialize_us\":" << deserialize_time
+		<< ",\"add_block_us\":" << add_block_time
+		<< ",\"verify_us\":" << stats.m_prepareTime
+		<< ",\"get_shares_us\":" << stats.m_getSharesTime
+		<< ",\"outputs_us\":" << stats.m_outputsTime
+		<< ",\"peak_memory_kb\":" << peak_memory_kb()
+		<< '}' << std::endl;
+
+	return tip_valid;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	struct Dump
+	{
+		const char* m_poolName;
+		const char* m_fileName;
+	} dumps[2] = {
+		{ "default", "sidechain_dump.dat" },
+		{ "mini", "sidechain_dump_mini.dat" },
+	};
+
+	bool ok = true;
+
+	for (const Dump& d : dumps) {
+		bool selected = (argc < 2);
+		for (int i = 1; i < argc; ++i) {
+			if (strcmp(argv[i], d.m_poolName) == 0) {
+				selected = true;
+			}
+		}
+		if (selected && !replay(d.m_poolName, d.m_fileName)) {
+			ok = false;
+		}
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Monero P2Pool <https://github.com/SChernykh/p2pool>
+ * Copyright (c) 2021-2022 SChernykh <https://github.com/SChernykh>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "common.h"
+#include "trace.h"
+#include "gtest/gtest.h"
+#include <fstream>
+#include <sstream>
+
+namespace p2pool {
+
+TEST(trace, chrome_trace)
+{
+	const char* file_name = "trace_test.json";
+
+	trace::init(file_name, 1);
+	ASSERT_TRUE(trace::enabled);
+
+	hash id;
+	id.h[0] = 0xab;
+	id.h[31] = 0xcd;
+
+	// Empty ids are never sampled
+	ASSERT_TRUE(trace::sampled(id));
+	ASSERT_FALSE(trace::sampled(hash()));
+
+	{
+		TraceSpan span("span1", id);
+	}
+	{
+		TraceSpan span("span2");
+		span.set_id(id);
+	}
+	{
+		TraceSpan span("unsampled");
+	}
+
+	const trace::clock::time_point t = trace::clock::now();
+	trace::add_span("span3", id, t, t + std::chrono::microseconds(1500));
+
+	trace::stop();
+	ASSERT_FALSE(trace::enabled);
+
+	std::ifstream f(file_name);
+	std::stringstream ss;
+	ss << f.rdbuf();
+	const std::string s = ss.str();
+	f.close();
+	remove(file_name);
+
+	ASSERT_EQ(s.front(), '[');
+	ASSERT_EQ(s.substr(s.length() - 3), "\n]\n");
+	ASSERT_NE(s.find("{\"name\":\"span1\",\"cat\":\"block\",\"ph\":\"X\",\"ts\":"), std::string::npos);
+	ASSERT_NE(s.find("{\"name\":\"span2\""), std::string::npos);
+	ASSERT_NE(s.find("\"dur\":1500,"), std::string::npos);
+	ASSERT_NE(s.find("\"args\":{\"id\":\"ab000000000000000000000000000000000000000000000000000000000000cd\"}}"), std::string::npos);
+	ASSERT_EQ(s.find("unsampled"), std::string::npos);
+}
+
+} // namespace p2pool
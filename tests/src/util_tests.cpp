@@ -17,7 +17,9 @@
 
 #include "common.h"
 #include "util.h"
+#include "uv_util.h"
 #include "gtest/gtest.h"
+#include <thread>
 
 namespace p2pool {
 
@@ -82,6 +84,58 @@ TEST(util, varint)
 	ASSERT_EQ(readVarint(buf2, buf2 + 1, check), nullptr);
 }
 
+TEST(util, to_hex)
+{
+	uint8_t data[256];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = static_cast<uint8_t>(i * 97 + 13);
+	}
+
+	// Check both the vectorized and the tail parts against log::hex_buf
+	for (size_t size = 0; size <= sizeof(data); ++size) {
+		char buf[sizeof(data) * 2 + 1];
+		log::Stream s(buf);
+		s << log::hex_buf(data, size);
+
+		char out[sizeof(data) * 2];
+		to_hex(data, size, out);
+
+		ASSERT_EQ(memcmp(buf, out, size * 2), 0);
+	}
+}
+
+TEST(util, hashrate_counter)
+{
+	HashrateCounter<10, 7> counter;
+
+	uint64_t hashes, dt;
+	counter.get(1000, 60, hashes, dt);
+	ASSERT_EQ(hashes, 0);
+	ASSERT_EQ(dt, 0);
+
+	// 100 H/s for 100 seconds
+	for (uint64_t t = 1000; t < 1100; ++t) {
+		counter.add(t, 100);
+	}
+	ASSERT_EQ(counter.total_hashes(), 10000);
+
+	// The oldest bucket in the window starts at 1040, the share at 1040 is work done before it and isn't counted
+	counter.get(1099, 60, hashes, dt);
+	ASSERT_EQ(hashes, 5900);
+	ASSERT_EQ(dt, 59);
+	ASSERT_EQ(counter.hashrate(1099, 60), 100);
+
+	// Window is longer than the data available
+	counter.get(1099, 1000, hashes, dt);
+	ASSERT_EQ(hashes, 6900);
+	ASSERT_EQ(dt, 69);
+	ASSERT_EQ(counter.hashrate(1099, 1000), 100);
+
+	counter.reset();
+	ASSERT_EQ(counter.total_hashes(), 0);
+	ASSERT_EQ(counter.hashrate(1100, 60), 0);
+}
+
 TEST(util, bsr)
 {
 	for (uint64_t i = 0, x = 1; i <= 63; ++i, x <<= 1) {
@@ -90,4 +144,125 @@ TEST(util, bsr)
 	}
 }
 
+TEST(util, numa_nodes)
+{
+	const std::vector<std::vector<uint32_t>>& nodes = numa_nodes();
+	ASSERT_FALSE(nodes.empty());
+
+	// A node's CPUs are sorted, and no CPU belongs to two nodes
+	std::vector<uint32_t> all;
+	for (const std::vector<uint32_t>& cpus : nodes) {
+		ASSERT_TRUE(std::is_sorted(cpus.begin(), cpus.end()));
+		all.insert(all.end(), cpus.begin(), cpus.end());
+	}
+
+	std::sort(all.begin(), all.end());
+	ASSERT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+
+	if (!nodes[0].empty()) {
+		bool pinned = false;
+		std::thread t([&nodes, &pinned]() { pinned = set_thread_affinity(nodes[0]); });
+		t.join();
+		ASSERT_TRUE(pinned);
+	}
+}
+
+TEST(util, work_lanes)
+{
+	const uint32_t num_threads[static_cast<size_t>(WorkLane::COUNT)] = { 2, 1, 1 };
+	init_work_lanes(num_threads);
+
+	uv_loop_t loop;
+	ASSERT_EQ(uv_loop_init(&loop), 0);
+
+	struct Work
+	{
+		uv_work_t req;
+		std::thread::id loop_thread;
+		std::atomic<uint32_t>* num_done;
+		bool worked;
+		bool after_on_loop;
+	};
+
+	constexpr uint32_t N = 64;
+	std::vector<Work> works(N);
+	std::atomic<uint32_t> num_done{ 0 };
+
+	for (uint32_t i = 0; i < N; ++i) {
+		Work& w = works[i];
+		w.req.data = &w;
+		w.loop_thread = std::this_thread::get_id();
+		w.num_done = &num_done;
+		w.worked = false;
+		w.after_on_loop = false;
+
+		const int err = uv_queue_work_lane(&loop, static_cast<WorkLane>(i % static_cast<uint32_t>(WorkLane::COUNT)), &w.req,
+			[](uv_work_t* req) { reinterpret_cast<Work*>(req->data)->worked = true; },
+			[](uv_work_t* req, int status)
+			{
+				Work* w = reinterpret_cast<Work*>(req->data);
+				w->after_on_loop = (status == 0) && (std::this_thread::get_id() == w->loop_thread);
+				++*w->num_done;
+			});
+		ASSERT_EQ(err, 0);
+	}
+
+	// The loop must stay alive until all after_work callbacks have run
+	uv_run(&loop, UV_RUN_DEFAULT);
+	ASSERT_EQ(num_done.load(), N);
+
+	for (const Work& w : works) {
+		ASSERT_TRUE(w.worked);
+		ASSERT_TRUE(w.after_on_loop);
+	}
+
+	ASSERT_EQ(uv_loop_close(&loop), 0);
+	stop_work_lanes();
+}
+
+TEST(util, alloc_profiler)
+{
+	using namespace alloc_profiler;
+
+	constexpr size_t N = 16;
+	constexpr size_t SIZE = 65536;
+
+	start(1024);
+
+	TagStats stats;
+	get_tag_stats(stats);
+	ASSERT_TRUE(stats.m_running);
+
+	const size_t p2p = static_cast<size_t>(Tag::P2P);
+	const uint64_t live_before = stats.m_liveBytes[p2p];
+	const uint64_t total_before = stats.m_totalBytes[p2p];
+
+	std::vector<std::vector<uint8_t>> buffers;
+	buffers.reserve(N);
+	{
+		AllocationTag tag(Tag::P2P);
+		for (size_t i = 0; i < N; ++i) {
+			buffers.emplace_back(SIZE, static_cast<uint8_t>(i));
+		}
+	}
+
+	// Every allocation is bigger than the sampling interval, so all of them are sampled
+	get_tag_stats(stats);
+	ASSERT_GE(stats.m_liveBytes[p2p], live_before + N * SIZE);
+	ASSERT_GE(stats.m_totalBytes[p2p], total_before + N * SIZE);
+
+	buffers.clear();
+	buffers.shrink_to_fit();
+
+	get_tag_stats(stats);
+	ASSERT_EQ(stats.m_liveBytes[p2p], live_before);
+	ASSERT_GE(stats.m_totalBytes[p2p], total_before + N * SIZE);
+
+	stop();
+
+	get_tag_stats(stats);
+	ASSERT_FALSE(stats.m_running);
+	ASSERT_EQ(stats.m_totalBytes[p2p], 0);
+}
+
 }
@@ -17,6 +17,7 @@
 
 #include "common.h"
 #include "wallet.h"
+#include "crypto.h"
 #include "gtest/gtest.h"
 
 namespace p2pool {
@@ -124,4 +125,92 @@ TEST(wallet, decode)
 	);
 }
 
+TEST(wallet, interned)
+{
+	const size_t num_wallets = InternedWallet::num_wallets();
+
+	const Wallet w1("49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6");
+	const Wallet w2("45JHuqGBSqUXUyZx95H4C2J5aEL4zFjM3jpTmMTESPXPa3jmtSQWYezHX7r4A2xPQNBGsQupJqmPhRZb2QgBcEWRDQ9ywwR");
+
+	{
+		InternedWallet empty;
+		ASSERT_FALSE(empty->valid());
+
+		InternedWallet a, b, c;
+		a.assign(w1);
+		ASSERT_TRUE(b.assign(w1.spend_public_key(), w1.view_public_key(), w1.type()));
+		c.assign(w2);
+
+		// Same address, same object
+		ASSERT_EQ(a.get(), b.get());
+		ASSERT_NE(a.get(), c.get());
+		ASSERT_EQ(*a, w1);
+		ASSERT_EQ(*c, w2);
+		ASSERT_EQ(InternedWallet::num_wallets(), num_wallets + 2);
+
+		// Invalid keys are rejected and the old value is kept
+		hash bad;
+		bad.h[0] = 2;
+		ASSERT_FALSE(b.assign(bad, w1.view_public_key(), w1.type()));
+		ASSERT_EQ(b.get(), a.get());
+
+		InternedWallet d(c);
+		ASSERT_EQ(d.get(), c.get());
+
+		c = a;
+		b = a;
+		ASSERT_EQ(c.get(), a.get());
+		ASSERT_EQ(InternedWallet::num_wallets(), num_wallets + 2);
+
+		// The last reference to w2 is gone
+		d = a;
+		ASSERT_EQ(InternedWallet::num_wallets(), num_wallets + 1);
+	}
+
+	ASSERT_EQ(InternedWallet::num_wallets(), num_wallets);
+}
+
+TEST(wallet, eph_public_keys)
+{
+	init_crypto_cache();
+
+	const Wallet w1("49ccoSmrBTPJd5yf8VYCULh4J5rHQaXP1TeC8Cnqhd5H9Y2cMwkJ9w42euLmMghKtCiQcgZEiGYW1K6Ae4biZ7w1HLSexS6");
+	const Wallet w2("45JHuqGBSqUXUyZx95H4C2J5aEL4zFjM3jpTmMTESPXPa3jmtSQWYezHX7r4A2xPQNBGsQupJqmPhRZb2QgBcEWRDQ9ywwR");
+
+	InternedWallet a;
+	a.assign(w1);
+
+	hash txkey_pub, txkey_sec;
+	generate_keys(txkey_pub, txkey_sec);
+
+	// Interned wallets use key tables, other wallets and nullptr are handled separately
+	constexpr size_t N = 4;
+	const Wallet* wallets[N] = { a.get(), &w2, nullptr, a.get() };
+
+	hash eph_public_keys[N];
+	uint8_t view_tags[N] = {};
+	ASSERT_TRUE(Wallet::get_eph_public_keys(wallets, N, txkey_sec, 1, eph_public_keys, view_tags));
+	ASSERT_TRUE(eph_public_keys[2].empty());
+
+	destroy_crypto_cache();
+	init_crypto_cache();
+
+	for (size_t i = 0; i < N; ++i) {
+		if (wallets[i]) {
+			// A copy of an interned wallet doesn't have a key table
+			const Wallet w(*wallets[i]);
+
+			hash eph_public_key;
+			uint8_t view_tag;
+			ASSERT_TRUE(w.get_eph_public_key(txkey_sec, i + 1, eph_public_key, view_tag));
+			ASSERT_EQ(eph_public_keys[i], eph_public_key);
+			ASSERT_EQ(view_tags[i], view_tag);
+			ASSERT_TRUE(wallets[i]->get_eph_public_key_with_view_tag(txkey_sec, i + 1, eph_public_key, view_tag));
+			ASSERT_EQ(eph_public_keys[i], eph_public_key);
+		}
+	}
+
+	destroy_crypto_cache();
+}
+
 }